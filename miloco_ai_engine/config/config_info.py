@@ -3,7 +3,7 @@
 
 """Model configuration"""
 from pydantic import BaseModel, Field, ConfigDict
-from typing import Optional, Dict, Any
+from typing import Optional, Dict, Any, List
 from enum import Enum
 
 MAX_CUDA_LAYERS = 50
@@ -38,6 +38,103 @@ class ModelConfig(BaseModel):
 
     # Cache settings
     cache_seq_num: int = Field(default=0, description="Cache sequence count")
+    cache_path: Optional[str] = Field(default=None, description="KV cache snapshot kept across restarts")
+    kv_defrag_thold: Optional[float] = Field(default=None, description="KV fragmentation compacted in idle gaps")
+    kv_defrag_idle_ms: Optional[int] = Field(default=None, description="Idle time before KV compaction")
+    kv_swa_full: Optional[bool] = Field(default=None, description="Full size kv of sliding window layers")
+    cache_type_k: Optional[str] = Field(default=None, description="KV cache K type, f16/q8_0/q4_0")
+    cache_type_v: Optional[str] = Field(default=None, description="KV cache V type, quantized enables flash_attn")
+    flash_attn: Optional[bool] = Field(default=None, description="Flash attention in the LLM")
+    cache_host_mb: int = Field(default=0, description="Host memory for evicted cache sequences")
+    cache_pin_max: Optional[int] = Field(default=None, description="Cache sequences pinned prompts may hold")
+    cache_class_seqs: Optional[List[int]] = Field(
+        default=None, description="Cache sequences interactive, rule trigger and background prompts may hold")
+    preempt_host_mb: int = Field(default=1024, description="Host memory for kv swapped out by preemption")
+    coalesce_requests: Optional[bool] = Field(default=None, description="Identical greedy requests share a sequence")
+    response_cache_mb: Optional[int] = Field(default=None, description="Completions kept for identical greedy requests")
+    response_cache_ttl_s: Optional[int] = Field(default=None, description="Age of a replayed completion")
+    admission_queue_max: Optional[int] = Field(default=None, description="Requests waiting for a free sequence")
+    admission_wait_ms: Optional[int] = Field(default=None, description="Longest wait for a free sequence")
+    kv_admission: Optional[bool] = Field(default=None, description="Admit requests once prompt plus max_tokens fit")
+    kv_output_reserve: Optional[int] = Field(default=None, description="Output tokens projected without max_tokens")
+    park_context_num: int = Field(default=4096, description="KV tokens finished sequences keep for reuse")
+    video_sessions: Optional[int] = Field(default=None, description="Sequences keeping a live video frame window")
+    encoder_workers: int = Field(default=1, description="Vision encoder workers")
+    prepare_workers: int = Field(default=2, description="Threads preparing prompts ahead of inference")
+    request_log_path: Optional[str] = Field(default=None, description="Binary log of requests for offline replay")
+    op_profile: Optional[bool] = Field(default=None, description="Per op times of the LLM and vision graphs, slow")
+    encoder_devices: Optional[List[str]] = Field(default=None, description="Backend device of each encoder worker")
+    mmproj_flash_attn: Optional[str] = Field(default=None, description="Vision encoder flash attention, auto/on/off")
+    mmproj_weight_type: Optional[str] = Field(default=None, description="Encoder linear weight type f16/q8_0/q4_k/q4_0")
+    mmproj_f16_activations: Optional[bool] = Field(default=None, description="F16 K/V in the vision encoder attention")
+    load_threads: Optional[int] = Field(default=None, description="Threads reading the weights in parallel on load")
+    mmap_prefetch_async: Optional[bool] = Field(default=None, description="Populate mapped weights after the load")
+    mmap_hugepages: Optional[bool] = Field(default=None, description="Transparent hugepages on the mapped weights")
+    repack_cache: Optional[bool] = Field(default=None, description="Keep repacked CPU weights next to the GGUF")
+    mmproj_lazy: Optional[bool] = Field(default=None, description="Load the vision encoder on the first modal request")
+    mmproj_idle_unload_s: Optional[int] = Field(default=None, description="Unload the idle vision encoder, 0 never")
+    decode_graphs: Optional[int] = Field(default=None, description="CUDA graphs kept per decode shape")
+    pipeline_cache_dir: Optional[str] = Field(default=None, description="Vulkan pipelines kept across restarts")
+    kv_pad: Optional[int] = Field(default=None, description="Attended kv cells padded to this multiple")
+    encoder_rpc_servers: Optional[List[str]] = Field(default=None, description="ggml rpc-servers encoding images")
+    model_devices: Optional[List[str]] = Field(default=None, description="GPUs of the LLM, default all")
+    main_gpu: Optional[int] = Field(default=None, description="GPU of the whole LLM with split_mode none")
+    split_mode: Optional[str] = Field(default=None, description="Split of the LLM over its GPUs, none/layer/row")
+    tensor_split: Optional[List[float]] = Field(default=None, description="Share of the LLM on each of its GPUs")
+    pipeline_microbatches: Optional[int] = Field(
+        default=None, description="Prompt graph runs per batch overlapped across layer split GPUs, 0 for one")
+    prefill_devices: Optional[List[str]] = Field(default=None, description="GPUs of a model copy prefilling prompts")
+    prefill_offload_tokens: Optional[int] = Field(default=None, description="Uncached prompt tokens prefilled there")
+    replica_devices: Optional[List[str]] = Field(default=None, description="GPUs of one data parallel LLM copy each")
+    threads: Optional[int] = Field(default=None, description="ggml compute threads of CPU layers")
+    threads_batch: Optional[int] = Field(default=None, description="ggml compute threads of prompt batches")
+    encoder_threads: Optional[int] = Field(default=None, description="ggml compute threads of the vision encoder")
+    repeat_penalty: Optional[float] = Field(default=None, description="Logit scale down of recently sampled tokens")
+    presence_penalty: Optional[float] = Field(default=None, description="Logit penalty of recently sampled tokens")
+    frequency_penalty: Optional[float] = Field(
+        default=None, description="Logit penalty per occurrence of recently sampled tokens")
+    penalty_last_n: Optional[int] = Field(default=None, description="Sampled tokens of a request the penalties count")
+    sample_threads: Optional[int] = Field(
+        default=None, description="Threads selecting top_k candidates of plain sampled rows, 0 uses the chains")
+    cpu_mask: Optional[str] = Field(default=None, description="CPUs of the compute threads, ranges or hex masks")
+    cpu_mask_batch: Optional[str] = Field(default=None, description="CPUs of the prompt batch compute threads")
+    cpu_strict: Optional[bool] = Field(default=None, description="One CPU of the mask per compute thread")
+    encoder_cpu_mask: Optional[str] = Field(default=None, description="CPUs of the vision encoder workers")
+    scheduler_cpu_mask: Optional[str] = Field(default=None, description="CPUs of the batch scheduler thread")
+    prepare_cpu_mask: Optional[str] = Field(default=None, description="CPUs of the prompt preparing workers")
+    numa: Optional[str] = Field(default=None, description="NUMA placement, distribute/isolate/numactl")
+    image_cache_precision: str = Field(default="f32", description="Cached image embeddings storage, f32/f16/q8")
+    frame_dedup_threshold: int = Field(default=0, description="Perceptual hash distance of near frames of one camera")
+    warmup_image_sizes: Optional[List[int]] = Field(default=None, description="Image sizes encoded once at init")
+    warmup_ubatch: Optional[bool] = Field(default=None, description="Decode a full n_ubatch once at init")
+    autotune: Optional[bool] = Field(default=None, description="Calibrate chunk and sequence counts at init")
+    autotune_latency_ms: Optional[int] = Field(default=None, description="Longest chunk and step autotune accepts")
+    image_cache_entries: int = Field(default=100, description="Cached image embeddings, -1 sizes from free memory")
+    image_cache_mb: int = Field(default=1024, description="Image embedding cache memory, -1 sizes from free memory")
+    image_cache_disk_path: Optional[str] = Field(default=None, description="Disk tier of evicted image embeddings")
+    image_cache_disk_mb: Optional[int] = Field(default=None, description="Size of the image embedding disk tier")
+    image_cache_shm_mb: Optional[int] = Field(default=None, description="Image embeddings shared across processes")
+    image_kv_entries: Optional[int] = Field(default=None, description="Image kv spans reused after other prefixes")
+    adaptive_resolution_step: float = Field(default=1.0, description="Encoder backlog per lower image resolution")
+    image_kv_keep: Optional[float] = Field(default=None, description="Kv fraction of each image kept after prefill")
+    batch_wait_ms: int = Field(default=3, description="Longest wait of partial batches for more requests")
+    prefill_ubatch: Optional[int] = Field(default=None, description="Tokens per prompt graph run, default chunk_size")
+    weight_stream_tokens: Optional[int] = Field(
+        default=None, description="Prompt tokens from which CPU layer weights stream to the GPU, 0 off")
+    decode_ubatch: int = Field(default=0, description="Tokens per step while sequences decode, 0 for chunk_size")
+    text_batch_size: int = Field(default=512, description="Prefill tokens submitted together, 0 for chunk_size")
+    image_batch_size: int = Field(default=0, description="Image tokens decoded together, 0 for chunk_size")
+    slo_class_priorities: Optional[List[int]] = Field(
+        default=None, description="Lowest priority of the interactive and rule trigger classes")
+    slo_target_ms: Optional[List[int]] = Field(
+        default=None, description="Latency target of interactive, rule trigger and background requests")
+    context_shift: bool = Field(default=False, description="Evict the oldest kv items of full sequences in place")
+    context_sink_tokens: int = Field(default=4, description="First tokens a context shift always keeps")
+    draft_model_path: Optional[str] = Field(default=None, description="Draft model of speculative decode, same vocab")
+    draft_max_tokens: int = Field(default=4, description="Draft tokens per sequence and decode step")
+    lookup_ngram_size: int = Field(default=0, description="Prompt lookup drafting without a draft model, 0 disables")
+    lora_adapters: Optional[List[Dict[str, Any]]] = Field(
+        default=None, description="LoRA adapters (name, path, scale) requests select by name")
 
     # Model parameters
     n_seq_max: int = Field(default=1, description="Maximum sequence count")
@@ -47,7 +144,7 @@ class ModelConfig(BaseModel):
 
     # Inference parameter defaults
     context_per_seq: int = Field(
-        default=4096, description="Maximum available context")
+        default=4096, description="Context guaranteed to each sequence, grows into unused pool")
     temperature: float = Field(default=-1, description="Temperature parameter")
 
     # Business hardcoded configuration
@@ -124,6 +124,9 @@ def apply_memory_optimization_to_default_model(config: ModelConfig, memory_mode:
     """
     if not config or not AUTO_OPT_VRAM:
         return config
+    if getattr(config, "autotune", None):
+        logger.info("Model %s is calibrated by the engine at load, skip the VRAM tables", config.model_name)
+        return config
 
     if memory_mode == FreeMemoryLevel.LEVEL_0:
         logger.warning("No GPU detected, model layers attemp load to CPU")
@@ -0,0 +1,179 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "admission-queue.h"
+
+#include <algorithm>
+#include <limits>
+
+AdmissionQueue::AdmissionQueue(LlamaMicoContext* context, size_t max_waiting, int32_t max_wait_ms)
+    : context_(context), max_waiting_(max_waiting), max_wait_ms_(max_wait_ms) {
+    LOG_INF("Admission queue of %zu requests, wait up to %d ms\n", max_waiting, max_wait_ms);
+}
+
+AdmissionQueue::~AdmissionQueue() { drop_async(); }
+
+int32_t AdmissionQueue::wait(size_t cmpl_id, int32_t priority, int64_t deadline_ms, int64_t expire_ms) {
+    int64_t t_start = ggml_time_us();
+    int64_t until_ms = max_wait_ms_ > 0 ? ggml_time_ms() + max_wait_ms_ : std::numeric_limits<int64_t>::max();
+    if (expire_ms > 0) {
+        until_ms = std::min(until_ms, expire_ms);
+        deadline_ms = std::min(deadline_ms, expire_ms);
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (waiters_.size() >= max_waiting_) {
+        stats_.rejected++;
+        return -1;
+    }
+    Waiter waiter{cmpl_id, priority, deadline_ms, n_arrived_++};
+    waiters_.push_back(&waiter);
+    stats_.max_waiting = std::max(stats_.max_waiting, waiters_.size());
+    std::vector<Waiter*> granted_async = grant_locked();  // NOTE: a sequence freed before it queued
+    if (!granted_async.empty()) {
+        lock.unlock();
+        run_granted(granted_async);
+        lock.lock();
+    }
+    auto granted = [&waiter]() { return waiter.seq_id >= 0 || waiter.cancelled; };
+    if (until_ms == std::numeric_limits<int64_t>::max()) {
+        condition_.wait(lock, granted);
+    } else {
+        condition_.wait_for(lock, std::chrono::milliseconds(std::max<int64_t>(until_ms - ggml_time_ms(), 0)), granted);
+    }
+    if (waiter.cancelled) return ADMISSION_CANCELLED;
+    if (waiter.seq_id < 0) {
+        waiters_.remove(&waiter);
+        stats_.timed_out++;
+        return -1;
+    }
+    stats_.admitted++;
+    context_->metrics.record(METRIC_ADMISSION_WAIT, ggml_time_us() - t_start);
+    return waiter.seq_id;
+}
+
+void AdmissionQueue::wait_async(size_t cmpl_id, int32_t priority, int64_t deadline_ms, int64_t expire_ms,
+                                GrantCallback on_grant) {
+    int64_t until_ms = max_wait_ms_ > 0 ? ggml_time_ms() + max_wait_ms_ : std::numeric_limits<int64_t>::max();
+    if (expire_ms > 0) {
+        until_ms = std::min(until_ms, expire_ms);
+        deadline_ms = std::min(deadline_ms, expire_ms);
+    }
+
+    std::vector<Waiter*> granted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (waiters_.size() >= max_waiting_) {
+            stats_.rejected++;
+        } else {
+            Waiter* waiter = new Waiter{cmpl_id, priority, deadline_ms, n_arrived_++};
+            waiter->until_ms = until_ms;
+            waiter->t_start_us = ggml_time_us();
+            waiter->on_grant = std::move(on_grant);
+            waiters_.push_back(waiter);
+            stats_.max_waiting = std::max(stats_.max_waiting, waiters_.size());
+            granted = grant_locked();  // NOTE: a sequence freed before it queued
+        }
+    }
+    if (on_grant) on_grant(-1);  // NOTE: still set only if the queue was full
+    run_granted(granted);
+}
+
+void AdmissionQueue::expire() {
+    std::vector<Waiter*> expired;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        int64_t now_ms = ggml_time_ms();
+        for (auto it = waiters_.begin(); it != waiters_.end();) {
+            if ((*it)->on_grant && (*it)->until_ms <= now_ms) {
+                expired.push_back(*it);
+                it = waiters_.erase(it);
+                stats_.timed_out++;
+            } else {
+                ++it;
+            }
+        }
+    }
+    run_granted(expired);  // NOTE: seq_id still -1
+}
+
+void AdmissionQueue::drop_async() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = waiters_.begin(); it != waiters_.end();) {
+        if (!(*it)->on_grant) {
+            ++it;
+            continue;
+        }
+        delete *it;
+        it = waiters_.erase(it);
+    }
+}
+
+void AdmissionQueue::run_granted(std::vector<Waiter*>& granted) {
+    for (Waiter* waiter : granted) {
+        if (waiter->seq_id >= 0) context_->metrics.record(METRIC_ADMISSION_WAIT, ggml_time_us() - waiter->t_start_us);
+        waiter->on_grant(waiter->cancelled ? ADMISSION_CANCELLED : waiter->seq_id);
+        delete waiter;
+    }
+    granted.clear();
+}
+
+void AdmissionQueue::grant() {
+    std::vector<Waiter*> granted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        granted = grant_locked();
+    }
+    run_granted(granted);
+}
+
+std::vector<AdmissionQueue::Waiter*> AdmissionQueue::grant_locked() {
+    std::vector<Waiter*> granted_async;
+    bool granted = false;
+    while (!waiters_.empty()) {
+        auto next = std::min_element(waiters_.begin(), waiters_.end(), [](const Waiter* a, const Waiter* b) {
+            if (a->deadline_ms != b->deadline_ms) return a->deadline_ms < b->deadline_ms;
+            if (a->priority != b->priority) return a->priority > b->priority;
+            return a->order < b->order;
+        });
+        int32_t seq_id = context_->set_seq_id((*next)->cmpl_id);
+        if (seq_id < 0) break;  // none free
+        (*next)->seq_id = seq_id;
+        if ((*next)->on_grant) {
+            granted_async.push_back(*next);
+            stats_.admitted++;
+        } else {
+            granted = true;
+        }
+        waiters_.erase(next);
+    }
+    if (granted) condition_.notify_all();
+    return granted_async;
+}
+
+bool AdmissionQueue::cancel(size_t cmpl_id) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = std::find_if(waiters_.begin(), waiters_.end(),
+                           [cmpl_id](const Waiter* waiter) { return waiter->cmpl_id == cmpl_id; });
+    if (it == waiters_.end()) return false;
+    (*it)->cancelled = true;
+    if ((*it)->on_grant) {
+        std::vector<Waiter*> cancelled = {*it};
+        waiters_.erase(it);
+        lock.unlock();
+        run_granted(cancelled);
+        return true;
+    }
+    waiters_.erase(it);
+    condition_.notify_all();
+    return true;
+}
+
+AdmissionStats AdmissionQueue::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    AdmissionStats stats = stats_;
+    stats.waiting = waiters_.size();
+    return stats;
+}
@@ -0,0 +1,76 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef ADMISSION_QUEUE_H
+#define ADMISSION_QUEUE_H
+
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <vector>
+
+#include "utils/mico-common.h"
+
+#define ADMISSION_CANCELLED -2  // AdmissionQueue::wait of a cancelled request
+
+struct AdmissionStats {
+    size_t waiting{0};
+    size_t max_waiting{0};  // high water mark
+    size_t admitted{0};     // got a sequence after waiting
+    size_t rejected{0};     // queue full
+    size_t timed_out{0};    // past max_wait_ms or the request deadline
+};
+
+// Requests finding no free sequence wait here instead of failing at once: every sequence freed goes to the most
+// urgent waiter, earliest deadline first (the latency target of its class or its own deadline), then the highest
+// priority, then the oldest. At most max_waiting requests wait, each for up to max_wait_ms (0 until its deadline)
+class AdmissionQueue {
+  public:
+    // Result of an async wait: the sequence, -1 or ADMISSION_CANCELLED as from wait
+    using GrantCallback = std::function<void(int32_t seq_id)>;
+
+    AdmissionQueue(LlamaMicoContext* context, size_t max_waiting, int32_t max_wait_ms);
+    ~AdmissionQueue();
+
+    // Blocks until cmpl_id holds a sequence, -1 if the queue is full, it waited max_wait_ms or expire_ms (the request
+    // deadline, 0 for none) passed, ADMISSION_CANCELLED once cancel(cmpl_id) took it out
+    int32_t wait(size_t cmpl_id, int32_t priority, int64_t deadline_ms, int64_t expire_ms);
+    // Waits like wait without a thread, on_grant gets the result. NOTE: called with no lock held, maybe before this
+    // returns, by the thread freeing the sequence (grant), cancelling (cancel) or timing it out (expire)
+    void wait_async(size_t cmpl_id, int32_t priority, int64_t deadline_ms, int64_t expire_ms, GrantCallback on_grant);
+    void expire();  // async waiters past their wait give up, called now and then by their owner
+    void drop_async();  // async waiters leave without a result, their owner goes away
+    void grant();  // a sequence may have been freed
+    bool cancel(size_t cmpl_id);  // false if it is not waiting
+    AdmissionStats stats();
+
+  private:
+    struct Waiter {
+        size_t cmpl_id;
+        int32_t priority;
+        int64_t deadline_ms;
+        uint64_t order;
+        int32_t seq_id{-1};  // granted
+        bool cancelled{false};
+        int64_t until_ms{0};     // async: gives up past it
+        int64_t t_start_us{0};   // async: when it queued
+        GrantCallback on_grant;  // async: owned by the queue while it waits, blocking waiters have none
+    };
+    // NOTE: mutex_ must be held, returns the async waiters granted, run_granted reports them once it is released
+    std::vector<Waiter*> grant_locked();
+    void run_granted(std::vector<Waiter*>& granted);
+
+    LlamaMicoContext* context_;
+    size_t max_waiting_;
+    int32_t max_wait_ms_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    std::list<Waiter*> waiters_;
+    uint64_t n_arrived_{0};
+    AdmissionStats stats_;
+};
+
+#endif  // ADMISSION_QUEUE_H
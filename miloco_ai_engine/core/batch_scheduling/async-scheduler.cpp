@@ -0,0 +1,332 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "async-scheduler.h"
+
+#include "batch_scheduling/batch-scheduler.h"
+#include "batch_scheduling/prompt-frontend.h"
+#include "utils/mico-dialog-util.h"
+
+#define WAIT_POLL_MS 20  // waiting prompts look again this often, kv is released without a notification
+
+AsyncScheduler::AsyncScheduler(LlamaMicoContext* context, size_t n_workers) : context_(context) {
+    for (size_t i = 0; i < std::max(n_workers, (size_t)1); i++) {
+        workers_.emplace_back(&AsyncScheduler::process_tasks, this);
+    }
+    waiter_ = std::thread(&AsyncScheduler::process_waits, this);
+    context->async_scheduler = (void*)this;
+}
+
+AsyncScheduler::~AsyncScheduler() {
+    stop_waits();
+    {
+        std::lock_guard<std::mutex> lock(task_mutex_);
+        stop_flag_.store(true);
+    }
+    task_condition_.notify_all();
+    for (auto& worker : workers_) worker.join();
+}
+
+bool AsyncScheduler::submit(int32_t ticket, PrepareRunner prepare, PromptRunner prompt,
+                            llama_mico_piece_callback callback, void* user_data, std::shared_ptr<SpscByteRing> ring,
+                            std::vector<std::string> stop_strings) {
+    auto stream = std::make_shared<AsyncStream>();
+    stream->ticket = ticket;
+    stream->stop_strings = std::move(stop_strings);
+    stream->callback = callback;
+    stream->user_data = user_data;
+    stream->ring = ring;
+    {
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        if (streams_.count(ticket) > 0) return false;  // ticket not polled to the end yet
+        streams_[ticket] = stream;
+    }
+
+    // NOTE: prepared on the front-end, so a worker waiting for a prefill never holds up the next prompt. A prompt
+    // waiting for a sequence or kv holds up neither, the workers must stay free to release the sequences it waits for
+    auto pending = std::make_shared<PendingPrompt>();
+    pending->stream = stream;
+    pending->prepare = std::move(prepare);
+    pending->prompt = std::move(prompt);
+    PromptFrontend* frontend = static_cast<PromptFrontend*>(context_->prompt_frontend);
+    frontend->submit([this, pending]() { run_prepare(pending); });
+    return true;
+}
+
+void AsyncScheduler::run_prepare(std::shared_ptr<PendingPrompt> pending) {
+    int32_t is_finished = 0;
+    std::string content = "";
+    int32_t ret = pending->prepare(pending->waits, is_finished, content);
+    if (ret != MICO_SUCCESS || is_finished) {
+        finish_prompt(pending->stream, ret, content);
+        return;
+    }
+    PromptWaits& waits = pending->waits;
+    if (waits.queued) {
+        waits.queued = false;
+        {
+            std::lock_guard<std::mutex> lock(wait_mutex_);
+            n_admitting_++;
+        }
+        wait_condition_.notify_one();  // NOTE: expires the queued prompts from now on
+        BatchScheduler* bs = static_cast<BatchScheduler*>(context_->batch_scheduler);
+        bs->admit_async(pending->stream->ticket, waits.priority, waits.expire_ms, [this, pending](int32_t seq_id) {
+            pending->waits.granted = true;
+            pending->waits.admitted = seq_id;
+            {
+                std::lock_guard<std::mutex> lock(wait_mutex_);
+                n_admitting_--;
+                granted_.push_back(pending);
+            }
+            wait_condition_.notify_one();
+        });
+        return;
+    }
+    if (waits.kv_pos > 0) {
+        {
+            std::lock_guard<std::mutex> lock(wait_mutex_);
+            kv_waits_.push_back(pending);
+        }
+        wait_condition_.notify_one();
+        return;
+    }
+    run_prompt(pending);
+}
+
+void AsyncScheduler::run_prompt(std::shared_ptr<PendingPrompt> pending) {
+    submit_task([this, pending]() {
+        int32_t is_finished = 0;
+        std::string content = "";
+        auto stream = pending->stream;
+        int32_t ret =
+            pending->prompt([this, stream](llama_token token) { on_token(stream, token); }, is_finished, content);
+        if (ret == MICO_SUCCESS && !is_finished) return;  // decoding, tokens arrive through on_token
+        finish_prompt(stream, ret, content);
+    });
+}
+
+void AsyncScheduler::fail_wait(std::shared_ptr<PendingPrompt> pending, std::string err) {
+    submit_task([this, pending, err]() mutable {  // NOTE: releases the prepared sequence, not a wait
+        const char* content = nullptr;
+        int32_t is_finished = 0;
+        int32_t seq_id = pending->waits.kv_seq;
+        int32_t ret = stop_process(false /* success */, err, &content, is_finished, context_->get_seq_state(seq_id),
+                                   context_, seq_id, true /* stop */);
+        finish_prompt(pending->stream, ret, content ? content : "");
+    });
+}
+
+void AsyncScheduler::process_waits() {
+    PromptFrontend* frontend = static_cast<PromptFrontend*>(context_->prompt_frontend);
+    BatchScheduler* bs = static_cast<BatchScheduler*>(context_->batch_scheduler);
+    while (true) {
+        std::vector<std::shared_ptr<PendingPrompt>> granted;
+        std::list<std::shared_ptr<PendingPrompt>> kv_waits;
+        {
+            std::unique_lock<std::mutex> lock(wait_mutex_);
+            auto ready = [this] { return !granted_.empty() || waits_stopped_; };
+            if (n_admitting_ > 0 || !kv_waits_.empty()) {
+                wait_condition_.wait_for(lock, std::chrono::milliseconds(WAIT_POLL_MS), ready);
+            } else {
+                wait_condition_.wait(lock, ready);
+            }
+            if (waits_stopped_) break;
+            granted.swap(granted_);
+            kv_waits.swap(kv_waits_);
+        }
+
+        for (auto& pending : granted) frontend->submit([this, pending]() { run_prepare(pending); });
+        if (bs->admission()) bs->admission()->expire();
+        for (auto it = kv_waits.begin(); it != kv_waits.end();) {
+            PromptWaits& waits = (*it)->waits;
+            int64_t now_ms = ggml_time_ms();
+            if (context_->get_seq_state(waits.kv_seq).cancelled) {
+                fail_wait(*it, "ERR: cancelled\n");
+            } else if (context_->reserve_kv(waits.kv_seq, waits.kv_pos, now_ms)) {
+                waits.kv_pos = 0;
+                run_prompt(*it);
+            } else if (now_ms >= waits.kv_until_ms) {
+                fail_wait(*it, "kv cache full, " + std::to_string(waits.kv_pos) + " projected positions do not fit\n");
+            } else {
+                ++it;
+                continue;
+            }
+            it = kv_waits.erase(it);
+        }
+        if (!kv_waits.empty()) {
+            std::lock_guard<std::mutex> lock(wait_mutex_);
+            kv_waits_.splice(kv_waits_.begin(), kv_waits);  // NOTE: the older ones first
+        }
+    }
+}
+
+void AsyncScheduler::stop_waits() {
+    bool running = false;
+    {
+        std::lock_guard<std::mutex> lock(wait_mutex_);
+        running = !waits_stopped_;
+        waits_stopped_ = true;
+    }
+    if (running) {
+        wait_condition_.notify_all();
+        waiter_.join();
+    }
+    BatchScheduler* bs = static_cast<BatchScheduler*>(context_->batch_scheduler);
+    if (bs && bs->admission()) bs->admission()->drop_async();
+}
+
+void AsyncScheduler::finish_prompt(std::shared_ptr<AsyncStream> stream, int32_t ret, const std::string& content) {
+    // NOTE: the prompt already released the sequence
+    {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        stream->finishing = true;
+        stream->result = ret;
+        stream->text += content;  // error message or the whole answer
+    }
+    if (!content.empty() && stream->callback) stream->callback(content.c_str(), stream->user_data);
+    if (!content.empty() && stream->ring) stream->ring->push(content.data(), content.size());
+    finish(stream);
+}
+
+void AsyncScheduler::finish(std::shared_ptr<AsyncStream> stream) {
+    {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        stream->done = true;
+    }
+    if (!stream->ring) return;  // reported by poll
+    stream->ring->close(stream->result);
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    streams_.erase(stream->ticket);
+}
+
+bool AsyncScheduler::has(int32_t ticket) const {
+    std::lock_guard<std::mutex> lock(stream_mutex_);
+    return streams_.count(ticket) > 0;
+}
+
+int32_t AsyncScheduler::poll(int32_t ticket, int32_t& is_finished, std::string& text) {
+    std::shared_ptr<AsyncStream> stream;
+    {
+        std::lock_guard<std::mutex> lock(stream_mutex_);
+        auto it = streams_.find(ticket);
+        if (it == streams_.end()) {
+            is_finished = 1;
+            text = "unknown ticket " + std::to_string(ticket) + "\n";
+            return MICO_ERROR;
+        }
+        stream = it->second;
+    }
+
+    std::lock_guard<std::mutex> lock(stream->mutex);
+    text = std::move(stream->text);
+    stream->text.clear();
+    is_finished = stream->done ? 1 : 0;
+    if (!stream->done) return MICO_SUCCESS;
+
+    std::lock_guard<std::mutex> map_lock(stream_mutex_);  // Finished and reported, ticket can be reused
+    streams_.erase(ticket);
+    return stream->result;
+}
+
+void AsyncScheduler::on_token(std::shared_ptr<AsyncStream> stream, llama_token token) {  // run in memory thread
+    if (token < 0) {  // retired by the decode loop
+        int32_t seq_id = context_->get_seq_id(stream->ticket);
+        if (seq_id >= 0 && context_->get_seq_state(seq_id).cancelled) {
+            append(stream, "ERR: cancelled\n", true, MICO_ERROR);
+            return;
+        }
+        bool too_long =
+            seq_id >= 0 && context_->get_seq_state(seq_id).n_past.load() >= context_->seq_context_limit(seq_id);
+        append(stream, "", true, too_long ? MICO_ERROR_EXCEED_MAX_CONTEXT : MICO_SUCCESS);
+        return;
+    }
+    if (llama_vocab_is_eog(context_->vocab, token)) {
+        append(stream, "", true, MICO_SUCCESS);
+        return;
+    }
+    append(stream, context_->token_piece(token), false, MICO_SUCCESS);
+}
+
+void AsyncScheduler::append(std::shared_ptr<AsyncStream> stream, std::string_view piece, bool finish,
+                            int32_t result) {
+    std::string out = "";  // NOTE: only filled for a callback, the ring and text take the held text in place
+    {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        if (stream->finishing) return;
+        stream->held.append(piece.data(), piece.size());
+        bool stopped = false;  // NOTE: text that may still become a stop string is held back too
+        size_t len = finish ? stream->held.size() : held_text_len(stream->held, stream->stop_strings, stopped);
+        if (stopped) {
+            finish = true;
+            result = MICO_SUCCESS;
+        }
+        if (stream->ring) {
+            if (!stream->ring->push(stream->held.data(), len) && !finish) {  // cancelled by the reader
+                finish = true;
+                result = MICO_SUCCESS;
+            }
+        } else if (!stream->callback) {
+            stream->text.append(stream->held, 0, len);
+        } else {
+            out.assign(stream->held, 0, len);
+        }
+        stream->held.erase(0, len);
+        if (finish) {
+            stream->finishing = true;
+            stream->result = result;
+        }
+    }
+
+    if (stream->callback && !out.empty() && stream->callback(out.c_str(), stream->user_data) != 0 && !finish) {
+        std::lock_guard<std::mutex> lock(stream->mutex);  // stopped by callback
+        stream->finishing = true;
+        stream->result = MICO_SUCCESS;
+        finish = true;
+    }
+    if (finish) release(stream);
+}
+
+void AsyncScheduler::release(std::shared_ptr<AsyncStream> stream) {
+    // NOTE: stop_process waits for the in-flight decode step, never run it on the memory thread
+    submit_task([this, stream]() {
+        int32_t seq_id = context_->get_seq_id(stream->ticket);
+        if (seq_id >= 0) {
+            std::string res = "";
+            const char* content = nullptr;
+            int32_t is_finished = 0;
+            stop_process(true /* success */, res, &content, is_finished, context_->get_seq_state(seq_id), context_,
+                         seq_id, true /* stop */);
+        }
+        finish(stream);
+    });
+}
+
+void AsyncScheduler::submit_task(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(task_mutex_);
+    task_queue_.push(std::move(task));
+    task_condition_.notify_one();
+}
+
+void AsyncScheduler::process_tasks() {
+    while (true) {
+        std::function<void()> task = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(task_mutex_);
+            task_condition_.wait(lock, [this] { return !task_queue_.empty() || stop_flag_.load(); });
+            if (stop_flag_.load()) break;
+
+            task = std::move(task_queue_.front());
+            task_queue_.pop();
+        }
+
+        if (task == nullptr) continue;  // Skip if task is null
+
+        try {
+            task();
+        } catch (const std::exception& e) {
+            LOG_ERR("failed to run async request task: %s\n", e.what());
+        }
+    }
+}
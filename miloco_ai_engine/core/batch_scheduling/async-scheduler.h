@@ -0,0 +1,115 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef ASYNC_SCHEDULER_H
+#define ASYNC_SCHEDULER_H
+
+#include <list>
+#include <map>
+#include <queue>
+#include <string_view>
+#include <thread>
+
+#include "llama-mico.h"
+#include "utils/mico-common.h"
+#include "utils/spsc-ring.h"
+
+// Prepares the prompt of submitted requests on the PromptFrontend pool, then infers it on a small worker pool and
+// streams the decode loop output into a per-ticket buffer (poll) or the request callback, so callers never block a
+// thread per request. A prompt waiting for a sequence or kv waits on neither pool, it is handed on once granted
+class AsyncScheduler {
+  public:
+    // What a prepared prompt still waits for, filled by PrepareRunner instead of waiting in place
+    struct PromptWaits {
+        bool queued{false};  // no sequence was free, prepared again once the admission queue granted one
+        int32_t priority{0};
+        int64_t expire_ms{0};
+        int64_t t_arrival_us{0};
+        bool granted{false};  // prepared again, admitted is the sequence, -1 or ADMISSION_CANCELLED
+        int32_t admitted{-1};
+        int32_t kv_seq{-1};  // kv_admission: the prepared sequence claims kv_pos positions before it is inferred
+        int32_t kv_pos{0};
+        int64_t kv_until_ms{0};
+    };
+
+    using TokenSink = std::function<void(llama_token)>;
+    // Runs the prompt and joins the decode loop with the sink, returns a MICO_* code
+    using PromptRunner = std::function<int32_t(TokenSink, int32_t& is_finished, std::string& content)>;
+    // Templates and tokenizes the prompt ahead of PromptRunner, returns a MICO_* code. Runs again once a queued
+    // prompt was granted a sequence
+    using PrepareRunner = std::function<int32_t(PromptWaits& waits, int32_t& is_finished, std::string& content)>;
+
+    explicit AsyncScheduler(LlamaMicoContext* context, size_t n_workers);
+    ~AsyncScheduler();
+
+    // ticket is the request id, callback (optional) is invoked from the decode loop, a ring (optional) receives the
+    // text instead and is closed with the result, the ticket is then released without a poll. The text ends before
+    // the first of stop_strings
+    bool submit(int32_t ticket, PrepareRunner prepare, PromptRunner prompt, llama_mico_piece_callback callback,
+                void* user_data, std::shared_ptr<SpscByteRing> ring = nullptr,
+                std::vector<std::string> stop_strings = {});
+    // Non-blocking, moves the text generated since the last poll into text
+    int32_t poll(int32_t ticket, int32_t& is_finished, std::string& text);
+    bool has(int32_t ticket) const;  // submitted and not released yet
+    // Drops the waiting prompts, NOTE: before the PromptFrontend goes, granted prompts are prepared again on it
+    void stop_waits();
+
+  private:
+    struct AsyncStream {
+        int32_t ticket{0};
+        llama_mico_piece_callback callback{nullptr};
+        void* user_data{nullptr};
+        std::shared_ptr<SpscByteRing> ring;
+
+        std::mutex mutex;
+        std::string text{""};   // not polled yet
+        std::string held{""};   // partial utf8 or stop string
+        std::vector<std::string> stop_strings;
+        bool finishing{false};  // no more text is accepted
+        bool done{false};       // sequence released, reported by poll
+        int32_t result{0};
+    };
+    struct PendingPrompt {
+        std::shared_ptr<AsyncStream> stream;
+        PrepareRunner prepare;
+        PromptRunner prompt;
+        PromptWaits waits;
+    };
+
+    void run_prepare(std::shared_ptr<PendingPrompt> pending);  // on the front-end
+    void run_prompt(std::shared_ptr<PendingPrompt> pending);
+    void fail_wait(std::shared_ptr<PendingPrompt> pending, std::string err);
+    void process_waits();  // hands on granted prompts, claims the kv of waiting ones
+
+    // Ends a stream whose prompt failed or finished without decoding
+    void finish_prompt(std::shared_ptr<AsyncStream> stream, int32_t ret, const std::string& content);
+    void on_token(std::shared_ptr<AsyncStream> stream, llama_token token);
+    void append(std::shared_ptr<AsyncStream> stream, std::string_view piece, bool finish, int32_t result);
+    void release(std::shared_ptr<AsyncStream> stream);
+    void finish(std::shared_ptr<AsyncStream> stream);  // sequence released
+    void submit_task(std::function<void()> task);
+    void process_tasks();
+
+    LlamaMicoContext* context_;
+
+    std::atomic<bool> stop_flag_{false};
+    std::vector<std::thread> workers_;
+
+    mutable std::mutex task_mutex_;
+    std::queue<std::function<void()>> task_queue_;
+    std::condition_variable task_condition_;
+
+    std::thread waiter_;
+    std::mutex wait_mutex_;
+    std::condition_variable wait_condition_;
+    bool waits_stopped_{false};
+    size_t n_admitting_{0};                                 // in the admission queue
+    std::vector<std::shared_ptr<PendingPrompt>> granted_;  // admitted, to prepare again
+    std::list<std::shared_ptr<PendingPrompt>> kv_waits_;
+
+    mutable std::mutex stream_mutex_;
+    std::map<int32_t, std::shared_ptr<AsyncStream>> streams_;
+};
+
+#endif  // ASYNC_SCHEDULER_H
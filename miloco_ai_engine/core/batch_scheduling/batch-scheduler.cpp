@@ -5,15 +5,46 @@
 
 #include "batch-scheduler.h"
 
+#include <limits>
+#include <numeric>
+
+#include "utils/mico-dialog-util.h"
+
+#define DECODE_MAX_LOOKAHEAD 32  // max tokens generated ahead of the consumer per sequence
+#define BATCH_EWMA_ALPHA 0.2     // weight of the newest sample in the arrival and decode time averages
+
+static void ewma_update(double& average, double sample) {  // negative average: no sample yet
+    average = average < 0 ? sample : average + BATCH_EWMA_ALPHA * (sample - average);
+}
+
 BatchScheduler::BatchScheduler(LlamaMicoContext* context, size_t batch_time_wait)
     : context_(context), time_wait_(batch_time_wait) {
-    encoder_scheduler_ = std::make_unique<EncoderSheduler>(context);
+    encoder_scheduler_ =
+        std::make_unique<EncoderSheduler>(context, context->image_cache_entries, context->image_cache_mb);
     llm_scheduler_ = std::make_unique<LlmScheduler>(context);
+    if (context->draft_ctx) draft_scheduler_ = std::make_unique<DraftScheduler>(context);
+    if (context->prefill_ctx) {
+        prefill_scheduler_ = std::make_unique<PrefillScheduler>(context, encoder_scheduler_.get());
+    }
 
+    if (context->image_kv_seq >= 0) image_kv_ = std::make_unique<ImageKvCache>(context, context->image_kv_entries);
     if (context->kv_cache_seq > 0) {
         kv_cache_ = std::make_unique<ChunkInferCache>((size_t)context->kv_cache_seq, context);
+        kv_cache_->set_modal_cache(modal_cache());
+    }
+    if (context->response_cache_bytes > 0) {
+        response_cache_ = std::make_unique<ResponseCache>(context->response_cache_bytes, context->response_cache_ttl_s);
+    }
+    if (context->admission_queue_max > 0) {
+        admission_ =
+            std::make_unique<AdmissionQueue>(context, context->admission_queue_max, context->admission_wait_ms);
     }
 
+    step_token_budget_ = context->n_batch;
+    decode_step_size_ = context->decode_step_size;
+    text_batch_size_ = context->text_batch_size;
+    image_batch_size_ = context->image_batch_size;  // NOTE: images wait up to batch_window_ms() to share a decode
+    for (auto& step : steps_) step.batch = llama_batch_init(step_token_budget_, 0, 1);
     scheduler_thread_ = new std::thread(&BatchScheduler::process_batch, this);
 
     context->batch_scheduler = (void*)this;
@@ -26,115 +57,1124 @@ BatchScheduler::~BatchScheduler() {
         scheduler_thread_->join();
         delete scheduler_thread_;
     }
+    {  // in-flight steps still reference their batches
+        std::unique_lock<std::mutex> task_lock(task_queue_mutex_);
+        step_condition_.wait(task_lock, [this]() { return steps_in_flight_ == 0; });
+    }
+    for (auto& step : steps_) llama_batch_free(step.batch);
 }
 
-void BatchScheduler::blocking_infer(std::shared_ptr<mtmd::input_chunks> input_chunks, size_t chat_cmpl_id,
-                                    int32_t priority) {
-    auto input = std::make_shared<BatchSchedulerInput>(input_chunks, chat_cmpl_id, priority);
-    for (const auto& chunk : input->input_chunks) {  // encoder
-        auto chunk_type = mtmd_input_chunk_get_type(chunk->input_chunk.get());
-        if (chunk_type != MTMD_INPUT_CHUNK_TYPE_IMAGE) continue;
-        encoder_scheduler_->submit_encoder_task(chunk->input_chunk);
-    }
-
-    auto hashs = chunk_hashs(input_chunks.get());
-
-    auto& state = context_->get_seq_state(chat_cmpl_id);
-    for (size_t i = 0; i < input_chunks->size(); i++) {
-        auto chunk = input->input_chunks[i];
-        std::string chunk_hash = hashs[i];
-
-        if (kv_cache_ && i != input_chunks->size() - 1) {  // NOTE: only cache image infer chunks now
-            // wait for kv cache, if not ready, wait
-            kv_cache_->block_waiting_and_prepare(chunk_hash);
-            if (kv_cache_->storing(chunk_hash)) {  // Internal inference storage
-                auto entry = kv_cache_->lookup(chunk_hash);
-                bool success = kv_cache_->apply_cache_entry(entry, chunk->cmpl_id);
-                if (success) {
-                    chunk->status = TaskStatus::COMPLETED;
-                    state.last_token.store(entry->last_token);
-                    state.n_past.store(entry->pos_end);
+void BatchScheduler::start_decoding(int32_t seq_id, std::function<void(llama_token)> token_sink) {
+    auto& state = context_->get_seq_state(seq_id);
+    if (seq_id >= FOLLOWER_SEQ_BASE) {  // tokens come from the leader, the ones queued meanwhile go first
+        {
+            std::lock_guard<std::mutex> token_lock(state.token_mutex);
+            state.token_sink = token_sink;
+            if (!token_sink) return;
+            emit_token(token_sink, state.last_token.load());
+            for (llama_token token : state.generated_tokens) emit_token(token_sink, token);
+            state.generated_tokens.clear();
+            if (state.decode_done) emit_token(token_sink, LLAMA_TOKEN_NULL);
+        }
+        flush_sinks();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> token_lock(state.token_mutex);
+        state.generated_tokens.clear();
+        state.decode_done = false;
+        state.token_sink = token_sink;
+    }
+    state.forced_tokens.clear();
+    state.stop_tail.clear();
+    if (!state.stop_strings.empty() && state.last_token.load() >= 0) {  // a stop string may start in the prompt token
+        state.stop_tail = context_->token_piece(state.last_token.load());
+    }
+    state.call_text.clear();
+    state.call_done = false;
+    if (state.call_syntax.format != COMMON_CHAT_FORMAT_CONTENT_ONLY && state.last_token.load() >= 0) {
+        state.call_text = context_->token_piece(state.last_token.load());
+    }
+    if (token_sink) token_sink(state.last_token.load());  // Prompt token, before the loop can produce more
+    {
+        std::lock_guard<std::mutex> task_lock(task_queue_mutex_);
+        decoding_seqs_.insert(seq_id);
+        if (state.cancelled)  // NOTE: cancelled after its prompt, the consumer gets no token
+            retire_decoding_seq(seq_id);
+        else
+            task_condition_.notify_one();
+    }
+    flush_sinks();
+}
+
+void BatchScheduler::stop_decoding(int32_t seq_id) {
+    {
+        std::unique_lock<std::mutex> task_lock(task_queue_mutex_);
+        if (decoding_seqs_.count(seq_id) > 0) retire_decoding_seq(seq_id);
+        // an in-flight step may still write this sequence
+        step_condition_.wait(task_lock, [this, seq_id]() { return !seq_in_flight(seq_id); });
+
+        auto& state = context_->get_seq_state(seq_id);
+        end_coalescing(state);  // NOTE: a leader stopped by its consumer ends its followers early
+        state.response_key = HashKey();  // an unfinished completion is not stored
+        std::lock_guard<std::mutex> token_lock(state.token_mutex);
+        state.generated_tokens.clear();
+        state.token_sink = nullptr;
+    }
+    flush_sinks();
+}
+
+bool BatchScheduler::wait_next_token(LlamaSeqState& state, llama_token& token) {
+    {
+        std::unique_lock<std::mutex> token_lock(state.token_mutex);
+        state.token_condition.wait(token_lock, [this, &state]() {
+            return !state.generated_tokens.empty() || state.decode_done || stop_flag_.load();
+        });
+        if (state.generated_tokens.empty()) return false;
+        token = state.generated_tokens.front();
+        state.generated_tokens.pop_front();
+    }
+    std::lock_guard<std::mutex> task_lock(task_queue_mutex_);  // Lookahead room may unblock the loop
+    task_condition_.notify_one();
+    return true;
+}
+
+int32_t BatchScheduler::preempt_seq(size_t cmpl_id, int32_t priority) {
+    std::lock_guard<std::mutex> move_lock(context_->seq_move_mutex);
+    int32_t seq_id = context_->set_seq_id(cmpl_id);  // a sequence may have finished meanwhile
+    if (seq_id >= 0 || context_->preempt_host_bytes <= swapped_bytes_) return seq_id;
+
+    int32_t victim = -1;
+    {
+        std::unique_lock<std::mutex> task_lock(task_queue_mutex_);
+        int32_t min_class = (int32_t)task_class(priority);
+        // NOTE: only decoding sequences, their whole kv is in place and the next step can resume anywhere
+        for (int32_t candidate : decoding_seqs_) {  // lowest class, then lowest priority, then the smallest kv
+            auto& state = context_->get_seq_state(candidate);
+            int32_t candidate_class = (int32_t)task_class(state.priority);
+            if (candidate_class <= min_class || has_followers(state)) continue;  // NOTE: a leader serves several
+            if (victim >= 0) {
+                auto& best = context_->get_seq_state(victim);
+                int32_t best_class = (int32_t)task_class(best.priority);
+                if (candidate_class != best_class) {
+                    if (candidate_class < best_class) continue;
+                } else if (state.priority != best.priority) {
+                    if (state.priority > best.priority) continue;
+                } else if (state.n_past.load() >= best.n_past.load()) {
                     continue;
                 }
             }
+            victim = candidate;
         }
+        if (victim < 0) return -1;
+        decoding_seqs_.erase(victim);  // NOTE: not retired, its consumer waits until it resumes
+        step_condition_.wait(task_lock, [this, victim]() { return !seq_in_flight(victim); });
+    }
 
-        // wait for encoder
-        if (mtmd_input_chunk_get_type(chunk->input_chunk.get()) == MTMD_INPUT_CHUNK_TYPE_IMAGE) {
-            chunk->embeddig = encoder_scheduler_->wait_for_result(chunk->input_chunk);
-            if (!chunk->embeddig) {
-                LOG_ERR("Encoder embedding failed\n");
-                chunk->status = TaskStatus::FAILED;
-                state.last_token.store(-1);
-                if (kv_cache_) kv_cache_->unprepared(chunk_hash);
-                break;
+    auto kv = std::make_shared<std::vector<uint8_t>>();
+    auto promise = std::make_shared<std::promise<bool>>();
+    auto swapped = promise->get_future();
+    size_t budget = context_->preempt_host_bytes - swapped_bytes_;
+    LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(context_->memory_scheduler);
+    ms->submit_function_use_mem([this, kv, promise, victim, budget]() {
+        size_t size = llama_state_seq_get_size(context_->lctx, victim);
+        if (size <= budget) {
+            kv->resize(size);
+            kv->resize(llama_state_seq_get_data(context_->lctx, kv->data(), size, victim));
+        }
+        if (!kv->empty()) llama_memory_seq_rm(llama_get_memory(context_->lctx), victim, -1, -1);
+        promise->set_value(!kv->empty());
+    });
+    if (!swapped.get()) {  // over the host budget, the victim keeps decoding
+        std::lock_guard<std::mutex> task_lock(task_queue_mutex_);
+        decoding_seqs_.insert(victim);
+        task_condition_.notify_one();
+        return -1;
+    }
+
+    int32_t swap_id = PREEMPT_SEQ_BASE;
+    auto used = [this](int32_t id) {
+        return std::any_of(swapped_seqs_.begin(), swapped_seqs_.end(),
+                           [id](const SwappedSeq& seq) { return seq.swap_id == id; });
+    };
+    while (used(swap_id)) swap_id++;
+    int32_t victim_priority = context_->get_seq_state(victim).priority;
+    context_->swap_out_seq(victim, swap_id, cmpl_id);
+    swapped_bytes_ += kv->size();
+    swapped_seqs_.push_back({swap_id, kv});
+    LOG_INF("preempt seq %d (priority %d) for priority %d, %zu KB kv swapped to host, %zu/%zu MB\n", victim,
+            victim_priority, priority, kv->size() >> 10, swapped_bytes_ >> 20, context_->preempt_host_bytes >> 20);
+    return victim;
+}
+
+void BatchScheduler::resume_preempted() {
+    std::lock_guard<std::mutex> move_lock(context_->seq_move_mutex);
+    while (!swapped_seqs_.empty()) {
+        auto swapped = swapped_seqs_.front();
+        int32_t seq_id = context_->swap_in_seq(swapped.swap_id);
+        if (seq_id < 0) break;  // no free sequence
+        swapped_seqs_.pop_front();
+        swapped_bytes_ -= swapped.kv->size();
+
+        auto kv = swapped.kv;
+        auto promise = std::make_shared<std::promise<bool>>();
+        auto restored = promise->get_future();
+        LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(context_->memory_scheduler);
+        ms->submit_function_use_mem([this, kv, promise, seq_id]() {
+            promise->set_value(llama_state_seq_set_data(context_->lctx, kv->data(), kv->size(), seq_id) != 0);
+        });
+        bool ok = restored.get();
+
+        std::lock_guard<std::mutex> task_lock(task_queue_mutex_);
+        if (!ok) {  // the consumer gets an invalid token
+            LOG_ERR("failed to restore preempted seq %d\n", seq_id);
+            auto& state = context_->get_seq_state(seq_id);
+            state.last_token.store(-1);
+            if (!state.token_sink) {
+                std::lock_guard<std::mutex> token_lock(state.token_mutex);
+                state.generated_tokens.push_back(-1);
             }
+            publish_token(state, -1);
+            retire_decoding_seq(seq_id);
+            continue;
         }
+        LOG_INF("resume preempted seq %d, %zu/%zu MB kv swapped\n", seq_id, swapped_bytes_ >> 20,
+                context_->preempt_host_bytes >> 20);
+        decoding_seqs_.insert(seq_id);
+        task_condition_.notify_one();
+    }
+    flush_sinks();
+}
 
-        {  // Start inference
-            std::unique_lock<std::mutex> task_lock(task_queue_mutex_);
-            task_queue_.push(chunk);
-            task_condition_.notify_one();
-            finish_condition_.wait(task_lock, [this, &chunk]() {
-                return chunk->status.load() != TaskStatus::WAIT && chunk->status.load() != TaskStatus::PENDING;
-            });
+int32_t BatchScheduler::admit(size_t cmpl_id, int32_t priority, int64_t expire_ms) {
+    if (!admission_) return -1;
+    return admission_->wait(cmpl_id, priority, task_deadline(priority), expire_ms);
+}
+
+void BatchScheduler::admit_async(size_t cmpl_id, int32_t priority, int64_t expire_ms,
+                                 AdmissionQueue::GrantCallback on_grant) {
+    admission_->wait_async(cmpl_id, priority, task_deadline(priority), expire_ms, std::move(on_grant));
+}
+
+bool BatchScheduler::cancel(size_t cmpl_id) {
+    if (admission_ && admission_->cancel(cmpl_id)) return true;
+    std::lock_guard<std::mutex> move_lock(context_->seq_move_mutex);  // NOTE: the sequence stays where it is
+    LlamaSeqState* state = context_->get_cmpl_state(cmpl_id);
+    if (!state) return false;
+    int32_t seq_id = state->seq_id;
+    state->cancelled.store(true);
+    LOG_INF("cancel chat-cmpl-%zu in seq %d\n", cmpl_id, seq_id);
+    {
+        std::lock_guard<std::mutex> lock(encoding_mutex_);
+        auto encoding = encoding_.find(seq_id);
+        if (encoding != encoding_.end()) {
+            for (const auto& chunk : encoding->second) {
+                if (encoder_scheduler_->result_ready(chunk->input_chunk)) continue;
+                encoder_scheduler_->cancel(chunk->input_chunk);
+            }
+        }
+    }
+    {
+        std::lock_guard<std::mutex> task_lock(task_queue_mutex_);
+        if (decoding_seqs_.count(seq_id) > 0) {
+            retire_decoding_seq(seq_id);
+            // NOTE: queued after the in-flight steps, the decode loop no longer writes the sequence
+            LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(context_->memory_scheduler);
+            ms->submit_clear_mem(seq_id, -1, -1);
+        } else if (seq_id >= PREEMPT_SEQ_BASE) {  // a follower or swapped out, nothing of its own is inferred
+            retire_decoding_seq(seq_id);
+        }
+        task_condition_.notify_one();  // the loop drops its buffered chunks
+    }
+    flush_sinks();
+    return true;
+}
+
+void BatchScheduler::drop_preempted(int32_t swap_id) {
+    auto it = std::find_if(swapped_seqs_.begin(), swapped_seqs_.end(),
+                           [swap_id](const SwappedSeq& seq) { return seq.swap_id == swap_id; });
+    if (it == swapped_seqs_.end()) return;
+    swapped_bytes_ -= it->kv->size();
+    swapped_seqs_.erase(it);
+}
+
+size_t BatchScheduler::swapped_bytes() {
+    std::lock_guard<std::mutex> lock(context_->seq_move_mutex);
+    return swapped_bytes_;
+}
+
+void BatchScheduler::retire_decoding_seq(int32_t seq_id) {
+    decoding_seqs_.erase(seq_id);
+    auto& state = context_->get_seq_state(seq_id);
+    {
+        std::lock_guard<std::mutex> token_lock(state.token_mutex);
+        state.decode_done = true;
+    }
+    state.token_condition.notify_all();
+    if (state.token_sink) emit_token(state.token_sink, LLAMA_TOKEN_NULL);
+    end_coalescing(state);
+}
+
+bool BatchScheduler::generation_limit(LlamaSeqState& state, llama_token token) {
+    if (reached_max_tokens(state)) return true;
+    if (tool_call_complete(state, token)) return true;
+    if (state.stop_strings.empty()) return false;
+    state.stop_tail.append(context_->token_piece(token));
+    size_t max_len = 0;
+    for (const auto& stop : state.stop_strings) {
+        if (state.stop_tail.find(stop) != std::string::npos) return true;
+        max_len = std::max(max_len, stop.size());
+    }
+    if (state.stop_tail.size() >= max_len) state.stop_tail.erase(0, state.stop_tail.size() - (max_len - 1));
+    return false;
+}
+
+int32_t BatchScheduler::follow(size_t cmpl_id, const HashKey& fingerprint) {
+    std::lock_guard<std::mutex> lock(follow_mutex_);
+    auto leader = leaders_.find(fingerprint);
+    if (leader == leaders_.end()) return -1;
+    int32_t follower_id = context_->bind_follower(cmpl_id);
+    auto& state = context_->get_seq_state(follower_id);
+    {
+        std::lock_guard<std::mutex> token_lock(state.token_mutex);
+        state.generated_tokens.clear();
+        state.decode_done = false;
+        state.token_sink = nullptr;
+    }
+    state.leader = leader->second;
+    leader->second->followers.push_back(&state);
+    LOG_DBG("request %zu follows seq %d, %zu followers\n", cmpl_id, leader->second->seq_id,
+            leader->second->followers.size());
+    return follower_id;
+}
+
+int32_t BatchScheduler::replay(size_t cmpl_id, const HashKey& fingerprint) {
+    std::vector<llama_token> tokens;
+    if (!response_cache_ || !response_cache_->lookup(fingerprint, tokens)) return -1;
+    int32_t follower_id = context_->bind_follower(cmpl_id);
+    auto& state = context_->get_seq_state(follower_id);
+    std::lock_guard<std::mutex> token_lock(state.token_mutex);
+    state.generated_tokens.assign(tokens.begin(), tokens.end());
+    state.decode_done = true;
+    state.token_sink = nullptr;
+    LOG_DBG("request %zu replays %zu stored tokens\n", cmpl_id, tokens.size());
+    return follower_id;
+}
+
+bool BatchScheduler::score(int32_t seq_id, llama_token last_token, const std::vector<llama_tokens>& candidates,
+                           std::vector<float>& logprobs) {
+    std::vector<int32_t> forks = context_->reserve_forks(candidates.empty() ? 0 : candidates.size() - 1);
+    for (int32_t fork : forks) context_->route_lora(fork, context_->get_seq_state(seq_id).lora);
+    logprobs.assign(candidates.size(), NAN);
+    size_t next = 0;
+    while (next < candidates.size()) {  // NOTE: one decode unless sequences or the batch run short
+        std::vector<llama_seq_id> seq_ids;
+        std::vector<llama_tokens> wave;
+        size_t n_tokens = 0;
+        while (next < candidates.size() && wave.size() <= forks.size() &&
+               (wave.empty() || n_tokens + candidates[next].size() <= (size_t)context_->n_batch)) {
+            seq_ids.push_back(wave.empty() ? seq_id : forks[wave.size() - 1]);
+            n_tokens += candidates[next].size();
+            wave.push_back(candidates[next++]);
         }
+        auto result = std::make_shared<std::vector<float>>(wave.size(), NAN);
+        auto promise = std::make_shared<std::promise<void>>();
+        auto scored = promise->get_future();
+        llm_scheduler_->submit_score_infer(seq_ids, last_token, wave, result, [promise]() { promise->set_value(); });
+        scored.wait();
+        std::copy(result->begin(), result->end(), logprobs.begin() + (next - wave.size()));
+    }
+    context_->release_forks(forks);
+    admit_waiting();
+    return std::all_of(logprobs.begin(), logprobs.end(), [](float logprob) { return !std::isnan(logprob); });
+}
+
+bool BatchScheduler::embed(const llama_tokens& tokens, std::vector<float>& embd) {
+    std::vector<int32_t> forks = context_->reserve_forks(1);
+    if (forks.empty()) return false;
+    bool ok = (int32_t)tokens.size() <= context_->seq_context_limit(forks[0]);
+    if (ok) {
+        context_->route_lora(forks[0], nullptr);
+        auto pooled = std::make_shared<std::vector<float>>();
+        auto promise = std::make_shared<std::promise<void>>();
+        auto done = promise->get_future();
+        llm_scheduler_->submit_pool_infer(forks[0], tokens, pooled, [promise]() { promise->set_value(); });
+        done.wait();
+        embd.swap(*pooled);
+        ok = !embd.empty();
+    }
+    context_->release_forks(forks);
+    admit_waiting();
+    return ok;
+}
 
-        // wait for llm
-        llm_scheduler_->block_waitting_seq(chunk->cmpl_id);
+void BatchScheduler::lead(LlamaSeqState& state, const HashKey& fingerprint) {
+    std::lock_guard<std::mutex> lock(follow_mutex_);
+    if (leaders_.emplace(fingerprint, &state).second) state.fingerprint = fingerprint;  // NOTE: else one leads already
+}
 
-        size_t last_token = state.last_token.load();
-        size_t npast = state.n_past.load();
+void BatchScheduler::unlead(LlamaSeqState& state) {
+    if (state.fingerprint.empty()) return;
+    auto leader = leaders_.find(state.fingerprint);
+    if (leader != leaders_.end() && leader->second == &state) leaders_.erase(leader);
+    state.fingerprint = HashKey();
+}
 
-        if (last_token < 0) {
-            chunk->status = TaskStatus::FAILED;
-            if (kv_cache_) kv_cache_->unprepared(chunk_hash);
-            break;
+void BatchScheduler::publish_token(LlamaSeqState& state, llama_token token) {
+    if (!state.response_key.empty()) {  // NOTE: one producer at a time, the prefill round then the decode loop
+        bool eog = token >= 0 && llama_vocab_is_eog(context_->vocab, token);
+        if (token >= 0) state.response_tokens.push_back(token);
+        if (eog) response_cache_->store(state.response_key, std::move(state.response_tokens));
+        if (token < 0 || eog) {
+            state.response_key = HashKey();
+            state.response_tokens.clear();
+        }
+    }
+    std::lock_guard<std::mutex> lock(follow_mutex_);
+    for (LlamaSeqState* follower : state.followers) {
+        std::lock_guard<std::mutex> token_lock(follower->token_mutex);
+        if (follower->token_sink) {
+            emit_token(follower->token_sink, token);
         } else {
+            follower->generated_tokens.push_back(token);
+            follower->token_condition.notify_all();
+        }
+    }
+}
+
+void BatchScheduler::end_coalescing(LlamaSeqState& state) {
+    std::lock_guard<std::mutex> lock(follow_mutex_);
+    unlead(state);
+    if (state.leader) {
+        auto& followers = state.leader->followers;
+        followers.erase(std::remove(followers.begin(), followers.end(), &state), followers.end());
+        state.leader = nullptr;
+    }
+    for (LlamaSeqState* follower : state.followers) {
+        std::lock_guard<std::mutex> token_lock(follower->token_mutex);
+        follower->decode_done = true;
+        follower->call_done = state.call_done;  // NOTE: ended by a whole tool call, not by the context
+        follower->token_condition.notify_all();
+        if (follower->token_sink) emit_token(follower->token_sink, LLAMA_TOKEN_NULL);
+        follower->leader = nullptr;
+    }
+    state.followers.clear();
+}
+
+void BatchScheduler::emit_token(const std::function<void(llama_token)>& sink, llama_token token) {
+    std::lock_guard<std::mutex> lock(sink_mutex_);
+    sink_calls_.emplace_back(sink, token);
+}
+
+void BatchScheduler::flush_sinks() {
+    std::vector<std::pair<std::function<void(llama_token)>, llama_token>> calls;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> flush_lock(sink_flush_mutex_, std::try_to_lock);
+            if (!flush_lock.owns_lock()) return;  // the flushing thread makes these calls too
+            while (true) {
+                {
+                    std::lock_guard<std::mutex> lock(sink_mutex_);
+                    calls.swap(sink_calls_);
+                }
+                if (calls.empty()) break;
+                for (auto& call : calls) call.first(call.second);
+                calls.clear();
+            }
+        }
+        // NOTE: a call queued while the flush lock was going away found it held, it is made here
+        std::lock_guard<std::mutex> lock(sink_mutex_);
+        if (sink_calls_.empty()) return;
+    }
+}
+
+bool BatchScheduler::has_followers(LlamaSeqState& state) {
+    std::lock_guard<std::mutex> lock(follow_mutex_);
+    return !state.followers.empty();
+}
+
+// A step queues behind in-flight ones only if they decode nothing, so only prefill-only steps overlap. NOTE: decode
+// and mixed steps stay serialized: the rows of a decoding sequence need the token sampled from its in-flight step,
+// and a step queued in between would delay that sequence by a whole step
+bool BatchScheduler::step_slot_free() const {
+    if (steps_in_flight_ >= STEP_PIPELINE_DEPTH) return false;
+    for (const auto& step : steps_) {
+        if (step.in_flight && !step.seqs.empty()) return false;
+    }
+    return true;
+}
+
+bool BatchScheduler::seq_in_flight(int32_t seq_id) const {
+    for (const auto& step : steps_) {
+        if (step.in_flight && std::find(step.seqs.begin(), step.seqs.end(), seq_id) != step.seqs.end()) return true;
+    }
+    return false;
+}
+
+bool BatchScheduler::decode_step_ready() {
+    if (!step_slot_free() || decoding_seqs_.empty()) return false;
+    for (int32_t seq_id : decoding_seqs_) {
+        auto& state = context_->get_seq_state(seq_id);
+        std::lock_guard<std::mutex> token_lock(state.token_mutex);
+        if (state.token_sink || state.generated_tokens.size() < DECODE_MAX_LOOKAHEAD) return true;
+    }
+    return false;
+}
+
+bool BatchScheduler::prefill_step_ready() {
+    if (!step_slot_free() || prefill_buffer_.empty()) return false;
+    if (prefill_due_) return true;
+    auto now = ggml_time_ms();
+    if (prefill_buffer_.front()->deadline_ms <= now) return true;  // overdue, no wait for a fuller batch
+    return prefill_size_ >= text_batch_size_ || (now - prefill_since_) >= batch_window_ms();
+}
+
+// Waiting for the next chunk pays only if it likely arrives within half a decode step, a step of its own would cost
+// a whole one. Idle or sparse traffic flushes at once, while a step is in flight chunks pile up for the next anyway
+int64_t BatchScheduler::batch_window_ms() const {
+    if (arrival_gap_ms_ < 0 || arrival_gap_ms_ >= decode_ms_ / 2) return 0;
+    return std::min((int64_t)time_wait_, (int64_t)std::ceil(arrival_gap_ms_));
+}
+
+TaskClass BatchScheduler::task_class(int32_t priority) const {
+    if (priority >= context_->slo_class_priorities[0]) return TaskClass::INTERACTIVE;
+    if (priority >= context_->slo_class_priorities[1]) return TaskClass::RULE_TRIGGER;
+    return TaskClass::BACKGROUND;
+}
+
+int64_t BatchScheduler::task_deadline(int32_t priority) const {
+    return ggml_time_ms() + context_->slo_target_ms[(int)task_class(priority)];
+}
+
+void BatchScheduler::submit_step(std::unique_lock<std::mutex>& task_lock) {
+    TraceScope trace("submit_step");
+    std::vector<int32_t> seqs;
+    for (int32_t seq_id : decoding_seqs_) {
+        auto& state = context_->get_seq_state(seq_id);
+        std::lock_guard<std::mutex> token_lock(state.token_mutex);
+        bool behind = !state.token_sink && state.generated_tokens.size() >= DECODE_MAX_LOOKAHEAD;
+        if (!behind) seqs.push_back(seq_id);  // consumer is behind
+    }
+    // NOTE: a step decoding sequences stays within decode_ubatch (its graph is reserved at init) but fits a token of
+    // each, prefill piggybacks in the rest; prompt-only steps take the whole n_batch in n_ubatch slices
+    int32_t n_budget = step_token_budget_;
+    if (!seqs.empty()) n_budget = std::min(n_budget, std::max(decode_step_size_, (int32_t)seqs.size()));
+
+    // Drafts of the decoding sequences, the draft model runs with task_queue_mutex_ released so request threads
+    // and the memory thread do not wait for it. NOTE: none of these sequences is in flight, see step_slot_free()
+    std::unordered_map<int32_t, std::vector<llama_token>> drafts;
+    if (draft_scheduler_ && draft_scheduler_->enabled() && !seqs.empty()) {
+        std::vector<DraftScheduler::DraftInput> inputs;
+        int32_t n_spare = n_budget - (int32_t)seqs.size();
+        for (int32_t seq_id : seqs) n_spare -= (int32_t)context_->get_seq_state(seq_id).forced_tokens.size();
+        for (int32_t seq_id : seqs) {
+            auto& state = context_->get_seq_state(seq_id);
+            int32_t n_forced = (int32_t)state.forced_tokens.size();
+            int32_t n_room = context_->seq_context_limit(seq_id) - state.n_past.load() - n_forced - 1;
+            int32_t n_max = std::min({draft_scheduler_->n_max(), n_room, n_spare / (int32_t)seqs.size()});
+            if (n_max <= 0) continue;
+            DraftScheduler::DraftInput input{seq_id, state.text_tokens(), state.last_token.load(), n_max, {}};
+            input.history.insert(input.history.end(), state.forced_tokens.begin(), state.forced_tokens.end());
+            inputs.push_back(std::move(input));
+        }
+        task_lock.unlock();
+        draft_scheduler_->draft(inputs);
+        task_lock.lock();
+        for (auto& input : inputs) {
+            if (!input.draft.empty()) drafts[input.seq_id] = std::move(input.draft);
+        }
+    }
+
+    int32_t slot = 0;
+    while (steps_[slot].in_flight) slot++;  // NOTE: step_slot_free() was checked, only this thread submits
+    auto& step = steps_[slot];
+    auto& step_batch = step.batch;
+    common_batch_clear(step_batch);
+    step.seqs.clear();
+
+    std::vector<DraftRun> draft_runs;
+    for (int32_t seq_id : seqs) {  // Decode first, one token per sequence, the forced ones before it, its draft after
+        if (decoding_seqs_.count(seq_id) == 0) continue;  // stopped while drafting
+        auto& state = context_->get_seq_state(seq_id);
+        if (step_batch.n_tokens + (int32_t)state.forced_tokens.size() >= n_budget) break;
+        bool full = state.n_past.load() + state.forced_tokens.size() >= context_->seq_context_limit(seq_id);
+        if (full && !context_->shift_seq_context(state)) {  // exceed max context
+            retire_decoding_seq(seq_id);
+            continue;
+        }
+        std::vector<llama_token> draft;
+        auto it = drafts.find(seq_id);
+        if (it != drafts.end() && !full) draft = std::move(it->second);  // NOTE: a shifted sequence drafts next step
+        for (llama_token token : state.forced_tokens) {
+            common_batch_add(step_batch, token, state.n_past.fetch_add(1), {seq_id}, false);
+            state.kv_items.push_back({token, 1});
+        }
+        state.forced_tokens.clear();
+        draft.resize(std::min(draft.size(), (size_t)(n_budget - step_batch.n_tokens - 1)));
+
+        draft_runs.push_back({step_batch.n_tokens, draft});
+        common_batch_add(step_batch, state.last_token.load(), state.n_past.fetch_add(1), {seq_id}, true);
+        state.kv_items.push_back({state.last_token.load(), 1});
+        for (llama_token token : draft) {
+            common_batch_add(step_batch, token, state.n_past.fetch_add(1), {seq_id}, true);
+            state.kv_items.push_back({token, 1});
+        }
+        state.n_drafted = (int32_t)draft.size();
+        step.seqs.push_back(seq_id);
+    }
+
+    std::vector<std::shared_ptr<SycChunkTask>> prefilled;  // chunks whose last token is in this step
+    while (!prefill_buffer_.empty() && step_batch.n_tokens < n_budget) {  // Prefill the rest
+        auto chunk = prefill_buffer_.front();
+        size_t n_tokens;
+        const auto tokens = mtmd_input_chunk_get_tokens_text(chunk->input_chunk.get(), &n_tokens);
+        size_t seq_id = chunk->cmpl_id;
+        auto& state = context_->get_seq_state(seq_id);
+
+        size_t n_take = std::min(n_tokens - chunk->n_prefilled, (size_t)(n_budget - step_batch.n_tokens));
+        if (chunk->queued_us > 0) {  // first step of the chunk
+            context_->metrics.record(METRIC_QUEUE_WAIT, ggml_time_us() - chunk->queued_us);
+            chunk->queued_us = 0;
+        }
+        step.n_prefill += (int32_t)n_take;
+        for (size_t i = chunk->n_prefilled; i < chunk->n_prefilled + n_take; i++)
+            common_batch_add(step_batch, tokens[i], state.n_past.fetch_add(1), {(llama_seq_id)seq_id}, false);
+        chunk->n_prefilled += n_take;
+        prefill_size_ -= n_take;
+        if (chunk->n_prefilled < n_tokens) break;  // Truncated, continue in next step
+
+        if (chunk->is_last_chunk && n_tokens > 0) step_batch.logits[step_batch.n_tokens - 1] = true;
+        prefilled.push_back(chunk);
+        prefill_buffer_.pop_front();
+    }
+    if (!prefill_buffer_.empty()) prefill_since_ = ggml_time_ms();
+    prefill_due_ = false;
+    if (step_batch.n_tokens == 0) return;
+
+    step.in_flight = true;
+    step.submitted = ggml_time_ms();
+    step.submitted_us = ggml_time_us();
+    step.id = n_steps_++;
+    trace.set_tokens(step_batch.n_tokens);
+    trace.set_batch(step.id);
+    context_->metrics.record_step_fill(step_batch.n_tokens, n_budget);
+    steps_in_flight_++;
+    for (auto& chunk : prefilled) chunk->status.store(TaskStatus::IN_PROGRESS);  // NOTE: before it can complete
+    auto on_finish = [this, slot, prefilled]() {
+        finish_decode_step(slot);
+        for (const auto& chunk : prefilled) complete_chunk(chunk);
+    };
+    llm_scheduler_->submit_token_infer(step_batch, on_finish, std::move(draft_runs));
+}
+
+void BatchScheduler::finish_decode_step(int32_t slot) {  // run in memory thread
+    std::unique_lock<std::mutex> task_lock(task_queue_mutex_);
+    auto& step = steps_[slot];
+    TraceScope trace("finish_step", -1, (int32_t)step.seqs.size(), 0, step.id);
+    auto now = ggml_time_ms();  // NOTE: a queued step starts when the one before it finished
+    ewma_update(decode_ms_, (double)(now - std::max(step.submitted, last_step_finished_)));
+    last_step_finished_ = now;
+    int64_t now_us = ggml_time_us();
+    if (step.n_prefill == 0) {
+        context_->metrics.record(METRIC_TOKEN_DECODE, now_us - std::max(step.submitted_us, last_step_finished_us_));
+    }
+    last_step_finished_us_ = now_us;
+    step.n_prefill = 0;
+    for (int32_t seq_id : step.seqs) {
+        auto& state = context_->get_seq_state(seq_id);
+        // the accepted draft tokens, the one sampled after them and the ones the grammar forces next
+        std::vector<llama_token> tokens;
+        tokens.swap(state.step_tokens);
+        size_t n_sampled = tokens.size() - state.forced_tokens.size();
+        size_t n_rejected = state.n_drafted + 1 - std::min(n_sampled, (size_t)state.n_drafted + 1);
+        state.kv_items.resize(state.kv_items.size() - n_rejected);
+        state.n_drafted = 0;
+        bool done = false;
+        for (llama_token token : tokens) {
+            state.n_generated++;
+            if (state.token_sink) {
+                emit_token(state.token_sink, token);
+            } else {
+                {
+                    std::lock_guard<std::mutex> token_lock(state.token_mutex);
+                    state.generated_tokens.push_back(token);
+                }
+                state.token_condition.notify_all();
+            }
+            publish_token(state, token);
+            done = token < 0 || llama_vocab_is_eog(context_->vocab, token) || generation_limit(state, token);
+            if (done) break;  // NOTE: tokens after an end of generation are dropped
+        }
+
+        if (decoding_seqs_.count(seq_id) == 0) continue;
+        bool full = !context_->context_shift && state.n_past.load() >= context_->seq_context_limit(seq_id);
+        if (done || full) retire_decoding_seq(seq_id);
+    }
+    step.seqs.clear();
+    step.in_flight = false;
+    steps_in_flight_--;
+    step_condition_.notify_all();
+    task_condition_.notify_one();
+    task_lock.unlock();
+    flush_sinks();
+}
+
+bool BatchScheduler::tool_call_complete(LlamaSeqState& state, llama_token token) {
+    if (state.call_syntax.format == COMMON_CHAT_FORMAT_CONTENT_ONLY) return false;
+    std::string_view piece = context_->token_piece(token);
+    state.call_text.append(piece.data(), piece.size());
+    // NOTE: a call can only complete with the end of a json object or of a closing tag
+    if (piece.find_first_of("}>]") == std::string_view::npos) return false;
+    try {  // a partial call parses as content only
+        common_chat_msg msg = common_chat_parse(state.call_text, false /* is_partial */, state.call_syntax);
+        state.call_done = !msg.tool_calls.empty();
+    } catch (const std::exception&) {
+        state.call_done = false;
+    }
+    return state.call_done;
+}
+
+void BatchScheduler::blocking_infer(std::shared_ptr<mtmd::input_chunks> input_chunks, size_t chat_cmpl_id,
+                                    int32_t priority) {
+    blocking_infer_batch({input_chunks}, {chat_cmpl_id}, {priority});
+}
+
+// Items of the prompt stored in the kv cache once it is inferred, 0 if it is kept with its session or video window
+static size_t stored_items(const LlamaSeqState& state, size_t n_items) {
+    if (state.n_cache_items == 0 && !state.session.empty()) return 0;
+    if (!state.video_session.empty()) return 0;  // NOTE: frames of a live stream are not reused by other requests
+    if (state.n_cache_items > 0) n_items = std::min(n_items, state.n_cache_items);  // shared head only
+    // NOTE: kv past the head moved by a context shift
+    if (state.n_evicted_items > 0) n_items = std::min(n_items, state.n_head_items);
+    return std::min(n_items, state.n_exact_items);  // NOTE: thinned images only fit the prompt they were decoded in
+}
+
+void BatchScheduler::blocking_infer_batch(const std::vector<std::shared_ptr<mtmd::input_chunks>>& batch_chunks,
+                                          const std::vector<size_t>& chat_cmpl_ids,
+                                          const std::vector<int32_t>& priorities) {
+    if (std::any_of(chat_cmpl_ids.begin(), chat_cmpl_ids.end(), [](size_t id) { return id >= FOLLOWER_SEQ_BASE; })) {
+        std::vector<std::shared_ptr<mtmd::input_chunks>> leader_chunks;
+        std::vector<size_t> leader_ids, follower_ids;
+        std::vector<int32_t> leader_priorities;
+        for (size_t r = 0; r < chat_cmpl_ids.size(); r++) {
+            if (chat_cmpl_ids[r] >= FOLLOWER_SEQ_BASE) {
+                follower_ids.push_back(chat_cmpl_ids[r]);
+                continue;
+            }
+            leader_chunks.push_back(batch_chunks[r]);
+            leader_ids.push_back(chat_cmpl_ids[r]);
+            leader_priorities.push_back(priorities[r]);
+        }
+        if (!leader_ids.empty()) blocking_infer_batch(leader_chunks, leader_ids, leader_priorities);
+        for (size_t follower_id : follower_ids) {  // The prompt token of the leader, -1 if it ended without one
+            auto& state = context_->get_seq_state(follower_id);
+            llama_token token = -1;
+            state.last_token.store(wait_next_token(state, token) ? token : -1);
+        }
+        return;
+    }
+    int64_t t_start = ggml_time_us();
+    if (!kv_cache_ || batch_chunks.size() < 2) {
+        infer_round(batch_chunks, chat_cmpl_ids, priorities, t_start);
+        return;
+    }
+
+    // Prefix groups: a request sharing a long prefix with an earlier leader the cache does not hold is a follower.
+    // The prefix the leader shares with all its followers is forked: prefilled once in the leader sequence and
+    // stored, then the leader and its followers copy it and prefill their own tails in one round
+    size_t n_requests = batch_chunks.size();
+    std::vector<double> hit_priority(n_requests);
+    std::vector<int32_t> leader(n_requests, -1);
+    std::vector<size_t> n_stored(n_requests, 0);
+    std::vector<size_t> n_fork(n_requests, 0);  // of a leader, the items common to all its followers
+    for (size_t r = 0; r < n_requests; r++) {
+        auto& state = context_->get_seq_state(chat_cmpl_ids[r]);
+        if (state.prompt_items.empty()) state.prompt_items = prefix_items(batch_chunks[r].get());
+        const auto& prefix = state.prompt_items;
+        if (prefix.size() < 2 || state.n_evicted_items > 0 || state.lora) {  // NOTE: no cache lookup, see infer_round
+            hit_priority[r] = std::numeric_limits<double>::infinity();
+            continue;
+        }
+        size_t n_hit = std::max(kv_cache_->peek_prefix(prefix, prefix.size() - 1, hit_priority[r]),
+                                state.n_resident_items);
+        for (size_t l = 0; l < r && leader[r] < 0; l++) {
+            const auto& leader_prefix = context_->get_seq_state(chat_cmpl_ids[l]).prompt_items;
+            size_t n_max = std::min(n_stored[l], prefix.size() - 1);
+            size_t n_common = 0;
+            while (n_common < n_max && leader_prefix[n_common].key == prefix[n_common].key) n_common++;
+            llama_pos n_shared = prefix_n_pos(prefix, n_common) - prefix_n_pos(prefix, n_hit);
+            if (n_common <= n_hit || n_shared < PREFIX_GROUP_MIN_POS) continue;
+            leader[r] = (int32_t)l;
+            n_fork[l] = n_fork[l] > 0 ? std::min(n_fork[l], n_common) : n_common;
+        }
+        if (leader[r] < 0) n_stored[r] = stored_items(state, prefix.size());
+    }
+
+    std::vector<std::shared_ptr<mtmd::input_chunks>> fork_chunks;
+    std::vector<size_t> fork_ids, fork_rows;
+    std::vector<int32_t> fork_priorities;
+    std::vector<std::vector<PrefixItem>> full_items;
+    for (size_t r = 0; r < n_requests; r++) {
+        if (n_fork[r] == 0) continue;
+        auto& state = context_->get_seq_state(chat_cmpl_ids[r]);
+        fork_chunks.push_back(prefix_chunks(*batch_chunks[r], n_fork[r]));
+        fork_ids.push_back(chat_cmpl_ids[r]);
+        fork_rows.push_back(r);
+        fork_priorities.push_back(priorities[r]);
+        full_items.push_back(state.prompt_items);
+        state.prompt_items.resize(n_fork[r]);
+        state.last_token.store(0);
+    }
+    if (!fork_ids.empty()) {
+        // NOTE: the images of the group are encoded while the prefix is prefilled, the encoder is idle meanwhile
+        for (size_t r = 0; r < n_requests && !image_kv_; r++) {
+            if (n_fork[r] == 0 && leader[r] < 0) continue;
+            for (size_t i = 0; i < batch_chunks[r]->size(); i++) {
+                const mtmd_input_chunk* chunk = (*batch_chunks[r])[i];
+                if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) continue;
+                encoder_scheduler_->submit_encode_ahead(
+                    std::shared_ptr<mtmd_input_chunk>(mtmd_input_chunk_copy(chunk), mtmd_input_chunk_free));
+            }
+        }
+        LOG_INF("%s: %zu shared prefixes forked into %zu requests\n", __func__, fork_ids.size(),
+                (size_t)std::count_if(leader.begin(), leader.end(), [](int32_t l) { return l >= 0; }));
+        infer_round(fork_chunks, fork_ids, fork_priorities, t_start, true /* fork */);
+        for (size_t f = 0; f < fork_ids.size(); f++) {
+            auto& state = context_->get_seq_state(fork_ids[f]);
+            state.prompt_items = std::move(full_items[f]);
+            // NOTE: the leader keeps its prefix in its sequence, a failed one fails its own prefill too
+            if (state.last_token.load() >= 0)
+                state.n_resident_items = std::max(state.n_resident_items, n_fork[fork_rows[f]]);
+        }
+    }
+
+    // Hits the cache sequences closest to eviction first, a page in from the host tier may evict them
+    std::vector<size_t> order(n_requests);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&hit_priority](size_t a, size_t b) { return hit_priority[a] < hit_priority[b]; });
+    std::vector<std::shared_ptr<mtmd::input_chunks>> round_chunks;
+    std::vector<size_t> round_ids;
+    std::vector<int32_t> round_priorities;
+    for (size_t r : order) {
+        round_chunks.push_back(batch_chunks[r]);
+        round_ids.push_back(chat_cmpl_ids[r]);
+        round_priorities.push_back(priorities[r]);
+    }
+    infer_round(round_chunks, round_ids, round_priorities, t_start);
+}
+
+void BatchScheduler::blocking_infer_fork(const std::vector<std::shared_ptr<mtmd::input_chunks>>& batch_chunks,
+                                         const std::vector<size_t>& chat_cmpl_ids, int32_t priority) {
+    int64_t t_start = ggml_time_us();
+    std::vector<int32_t> priorities(chat_cmpl_ids.size(), priority);
+    auto& leader = context_->get_seq_state(chat_cmpl_ids[0]);
+    std::vector<PrefixItem> items = leader.prompt_items;
+    size_t n_fork = items.empty() ? 0 : items.size() - 1;
+    bool fork = chat_cmpl_ids.size() > 1 && n_fork > 0;
+    for (size_t id : chat_cmpl_ids) {  // NOTE: a follower has no kv, a shifted sequence not the prompt positions
+        fork = fork && id < FOLLOWER_SEQ_BASE && context_->get_seq_state(id).n_evicted_items == 0;
+    }
+    if (fork) {
+        leader.prompt_items.resize(n_fork);
+        leader.last_token.store(0);
+        auto head = prefix_chunks(*batch_chunks[0], n_fork);
+        infer_round({head}, {chat_cmpl_ids[0]}, {priority}, t_start, true /* fork */);
+        leader.prompt_items = std::move(items);
+    }
+    if (fork && leader.last_token.load() >= 0) {  // NOTE: a failed leader fails its own prefill, the rest infer alone
+        // NOTE: queued on the memory thread ahead of any decode of the siblings, a copy only adds the positions past
+        // the prefix a sibling kept
+        LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(context_->memory_scheduler);
+        llama_pos n_pos = prefix_n_pos(leader.prompt_items, n_fork);
+        for (size_t id : chat_cmpl_ids) {
+            auto& state = context_->get_seq_state(id);
+            if (&state != &leader && state.n_resident_items < n_fork)
+                ms->submit_cache_mem(chat_cmpl_ids[0], id, 0, n_pos);
+            state.n_resident_items = std::max(state.n_resident_items, n_fork);
+        }
+    }
+    infer_round(batch_chunks, chat_cmpl_ids, priorities, t_start);
+}
+
+void BatchScheduler::infer_round(const std::vector<std::shared_ptr<mtmd::input_chunks>>& batch_chunks,
+                                 const std::vector<size_t>& chat_cmpl_ids, const std::vector<int32_t>& priorities,
+                                 int64_t t_start, bool fork) {
+    struct InferItem {
+        std::shared_ptr<BatchSchedulerInput> input;
+        std::vector<PrefixItem> prefix;
+        LlamaSeqState* state;
+        std::shared_ptr<SycChunkTask> last;  // last chunk of the chain, nullptr if the whole prompt is cached
+        size_t n_resident{0};                // kv items kept in the sequence from its last request
+        bool active{true};
+    };
+    std::vector<InferItem> items(batch_chunks.size());
+    size_t max_chunks = 0;
+    for (size_t r = 0; r < batch_chunks.size(); r++) {
+        auto& item = items[r];
+        item.state = &context_->get_seq_state(chat_cmpl_ids[r]);
+        item.input = std::make_shared<BatchSchedulerInput>(batch_chunks[r], chat_cmpl_ids[r], priorities[r],
+                                                           task_deadline(priorities[r]), item.state->expire_ms,
+                                                           item.state->arena);
+        if (fork && !item.input->input_chunks.empty()) item.input->input_chunks.back()->is_last_chunk = false;
+        max_chunks = std::max(max_chunks, item.input->input_chunks.size());
+        item.prefix = std::move(item.state->prompt_items);  // NOTE: computed once in prepare_prompt
+        if (item.prefix.empty()) item.prefix = prefix_items(batch_chunks[r].get());
+        item.state->kv_items = item.prefix;
+        size_t n_evicted = item.state->n_evicted_items;  // NOTE: skipped as if resident, never in kv
+        auto head_end = item.state->kv_items.begin() + item.state->n_head_items;
+        if (n_evicted > 0) item.state->kv_items.erase(head_end, head_end + n_evicted);
+        item.n_resident = item.state->n_resident_items - n_evicted;
+        if (item.state->n_exact_items >= item.n_resident) item.state->n_exact_items = SIZE_MAX;  // the rest is new
+
+        // Reuse the prefix kept in the sequence or the longest cached one, the last item is inferred for its logits
+        size_t n_cached = item.state->n_resident_items;
+        llama_pos n_pos = prefix_n_pos(item.state->kv_items, n_cached - n_evicted);
+        llama_pos n_cache_pos = 0;
+        size_t n_cache_items = kv_cache_ && n_evicted == 0 && !item.state->lora  // NOTE: cached kv is of the base model
+                                   ? kv_cache_->apply_prefix(item.prefix, item.prefix.size() - 1, chat_cmpl_ids[r],
+                                                             n_cache_pos)
+                                   : 0;
+        if (auto* timings = item.state->timings.get()) {  // NOTE: a fork round reports the last one
+            timings->n_prompt_pos = prefix_n_pos(item.state->kv_items, SIZE_MAX);
+            timings->n_resident_pos = n_pos;
+            timings->n_cached_pos = n_cache_items > n_cached ? n_cache_pos - n_pos : 0;
+        }
+        if (n_cache_items > n_cached) {  // NOTE: only the part past the kept prefix is copied
+            n_cached = n_cache_items;
+            n_pos = n_cache_pos;
+        }
+        // Disaggregated prefill, the kv comes back as if cached. NOTE: the next items of the round wait for it
+        bool offload = prefill_scheduler_ && n_evicted == 0 && !item.state->lora;
+        if (offload && prefix_n_pos(item.prefix, item.prefix.size()) - n_pos >= prefill_scheduler_->n_offload_min()) {
+            int32_t seq_id = (int32_t)chat_cmpl_ids[r];
+            n_cached = prefill_scheduler_->prefill(seq_id, item.input->input_chunks, n_cached, n_pos);
+            n_pos = prefix_n_pos(item.prefix, n_cached);
+        }
+        if (n_cached == 0) continue;
+        item.state->n_past.store(n_pos);
+        for (const auto& chunk : item.input->input_chunks) {
+            size_t n_items = chunk_n_items(chunk->input_chunk.get());
+            if (n_cached < n_items) {
+                chunk->n_prefilled = n_cached;  // NOTE: only a text chunk can be partially cached
+                break;
+            }
             chunk->status = TaskStatus::COMPLETED;
-            // NOTE: only cache image infer chunks now
-            if (kv_cache_ && i != input_chunks->size() - 1)
-                kv_cache_->store(hashs, i, chunk->cmpl_id, last_token, npast);
+            n_cached -= n_items;
+        }
+    }
+    // Each prompt is one chain of its uncached chunks, submitted by the memory thread as the chunk before is decoded,
+    // so requests advance independently and this thread only feeds embeddings and waits for the last chunks
+    std::vector<std::shared_ptr<SycChunkTask>> modal_chunks;  // chunk order, the earliest first
+    std::vector<std::shared_ptr<SycChunkTask>> heads;
+    for (size_t i = 0; i < max_chunks; i++) {
+        for (auto& item : items) {
+            if (i >= item.input->input_chunks.size()) continue;
+            auto chunk = item.input->input_chunks[i];
+            if (chunk->status.load() == TaskStatus::COMPLETED) continue;  // cached
+            bool modal = mtmd_input_chunk_get_type(chunk->input_chunk.get()) != MTMD_INPUT_CHUNK_TYPE_TEXT;
+            chunk->kv_reuse = modal && image_kv_ && !item.state->lora && image_kv_->acquire(chunk->input_chunk.get());
+            bool encode = modal && !chunk->kv_reuse;
+            chunk->chained = item.last != nullptr;
+            chunk->n_deps.store((chunk->chained ? 1 : 0) + (encode ? 1 : 0));
+            if (item.last) item.last->next = chunk;
+            if (!item.last && !encode) heads.push_back(chunk);
+            item.last = chunk;
+            RequestTimings* timings = modal ? item.state->timings.get() : nullptr;
+            if (timings && chunk->kv_reuse)
+                timings->n_images_kv_reused++;
+            else if (timings && encoder_scheduler_->result_ready(chunk->input_chunk))
+                timings->n_images_cached++;
+            else if (timings)
+                timings->n_images_encoded++;
+            if (!encode) continue;
+            encoder_scheduler_->submit_encoder_task(chunk->input_chunk, chunk->deadline_ms, chunk->expire_ms);
+            modal_chunks.push_back(chunk);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(encoding_mutex_);
+        for (const auto& chunk : modal_chunks) encoding_[(int32_t)chunk->cmpl_id].push_back(chunk);
+    }
+    for (auto& chunk : heads) submit_chunk(chunk);
+    // Embeddings already encoded go first, then the rest in chunk order as the encoder delivers them
+    std::stable_partition(modal_chunks.begin(), modal_chunks.end(),
+                          [this](const std::shared_ptr<SycChunkTask>& chunk) {
+                              return encoder_scheduler_->result_ready(chunk->input_chunk);
+                          });
+    for (auto& chunk : modal_chunks) {
+        if (chunk->status.load() == TaskStatus::FAILED) continue;  // an earlier chunk of its prompt failed
+        auto& state = context_->get_seq_state(chunk->cmpl_id);
+        if (!state.cancelled) {
+            int64_t t_wait = ggml_time_us();
+            chunk->embeddig = encoder_scheduler_->wait_for_result(chunk->input_chunk);
+            if (state.timings) state.timings->encode_wait_us += ggml_time_us() - t_wait;
+            if (!chunk->embeddig) LOG_ERR("Encoder embedding failed\n");
+        }
+        if (!chunk->embeddig) chunk->status.store(TaskStatus::FAILED);
+        release_chunk(chunk);
+    }
+    {
+        std::lock_guard<std::mutex> lock(encoding_mutex_);
+        for (const auto& chunk : modal_chunks) encoding_.erase((int32_t)chunk->cmpl_id);
+    }
+
+    {  // Wait for the whole prompts
+        std::unique_lock<std::mutex> finish_lock(finish_mutex_);
+        finish_condition_.wait(finish_lock, [&items]() {
+            for (const auto& item : items) {
+                if (!item.last) continue;
+                auto status = item.last->status.load();
+                if (status != TaskStatus::COMPLETED && status != TaskStatus::FAILED) return false;
+            }
+            return true;
+        });
+    }
+    for (auto& item : items) {
+        if (!item.last) continue;
+        llm_scheduler_->block_waitting_seq(item.last->cmpl_id);  // NOTE: the last decode releases it after the chain
+        if (item.last->status.load() == TaskStatus::COMPLETED) continue;
+        item.state->last_token.store(-1);
+        item.active = false;
+    }
+    for (size_t r = 0; r < items.size() && !fork && context_->image_kv_keep > 0.0f; r++) {
+        if (!items[r].active || !items[r].last) continue;  // NOTE: nothing prefilled
+        thin_image_kv((int32_t)chat_cmpl_ids[r], *items[r].state, items[r].n_resident);
+    }
+    if (fork) {  // NOTE: the requests continue in the next round, their followers wait on it
+        for (size_t r = 0; r < items.size() && kv_cache_; r++) {
+            if (!items[r].active) continue;
+            auto& prefix = items[r].prefix;
+            prefix.resize(stored_items(*items[r].state, prefix.size()));
+            if (!prefix.empty()) kv_cache_->store(prefix, chat_cmpl_ids[r], (int32_t)task_class(priorities[r]));
+        }
+        return;
+    }
+    for (auto& item : items) {  // Followers get the prompt token, no one joins a decoding leader
+        {
+            std::lock_guard<std::mutex> lock(follow_mutex_);
+            unlead(*item.state);
         }
+        if (item.active) publish_token(*item.state, item.state->last_token.load());
+    }
+    flush_sinks();
+
+    int64_t t_end = ggml_time_us();
+    for (const auto& item : items) {
+        if (item.active) context_->metrics.record(METRIC_PREFILL, t_end - t_start);
+    }
+
+    if (!kv_cache_) return;
+    for (size_t r = 0; r < items.size(); r++) {  // Whole prompt is in kv now
+        if (!items[r].active || items[r].state->lora) continue;
+        auto& prefix = items[r].prefix;
+        size_t n_stored = stored_items(*items[r].state, prefix.size());
+        if (n_stored == 0) continue;  // stored with the session
+        prefix.resize(n_stored);
+        // NOTE: the class of the request, a prime runs at background priority for the prompt it warms
+        auto& state = *items[r].state;
+        kv_cache_->store(prefix, chat_cmpl_ids[r], (int32_t)task_class(state.priority), state.cache_pin);
+    }
+}
+
+void BatchScheduler::thin_image_kv(int32_t seq_id, LlamaSeqState& state, size_t n_resident) {
+    const auto& kv_items = state.kv_items;
+    if (state.lora || kv_items.size() < 2 || kv_items.back().key < 0) return;  // NOTE: the last item is a text token
+    std::vector<std::pair<llama_pos, llama_pos>> images;
+    size_t first = SIZE_MAX;
+    llama_pos pos = 0;
+    for (size_t i = 0; i + 1 < kv_items.size(); pos += kv_items[i++].n_pos) {
+        if (kv_items[i].key >= 0 || (i >= state.n_exact_items && i < n_resident)) continue;
+        images.emplace_back(pos, pos + kv_items[i].n_pos);
+        first = std::min(first, i);
     }
+    if (images.empty()) return;
+
+    auto promise = std::make_shared<std::promise<int32_t>>();
+    auto done = promise->get_future();
+    llm_scheduler_->submit_image_kv_thin(seq_id, (llama_token)kv_items.back().key, pos, images,
+                                         context_->image_kv_keep, [promise](int32_t n) { promise->set_value(n); });
+    int32_t n_dropped = done.get();
+    if (n_dropped > 0) state.n_exact_items = std::min(state.n_exact_items, first);
+    LOG_DBG("%s: seq %d dropped %d kv cells of %zu images\n", __func__, seq_id, n_dropped, images.size());
+}
+
+void BatchScheduler::store_session(int32_t seq_id) {
+    auto& state = context_->get_seq_state(seq_id);
+    if (seq_id >= PREEMPT_SEQ_BASE) return;  // kv is swapped out
+    if (kv_cache_ && !state.session.empty() && !state.lora)
+        kv_cache_->store_session(state.session, state.kv_items, seq_id);
+}
+
+void BatchScheduler::release_session(const std::string& session) {
+    if (kv_cache_) kv_cache_->release_session(session);
+    context_->release_video_session(session);
 }
 
 void BatchScheduler::process_batch() {
-    std::vector<std::shared_ptr<SycChunkTask>> text_buffer;
+    mico_trace::set_thread_name("batch_scheduler");
+    set_thread_affinity(context_->cpu_scheduler);
     std::vector<std::shared_ptr<SycChunkTask>> image_buffer;
-    auto last_text = ggml_time_ms();
     auto last_image = ggml_time_ms();
-    size_t text_size = 0, image_size = 0;
+    size_t image_size = 0;
     int32_t remaining_wait = time_wait_;
 
     while (!stop_flag_.load()) {  // event
         std::unique_lock<std::mutex> task_lock(task_queue_mutex_);
-        if (text_buffer.empty() && image_buffer.empty()) {
-            task_condition_.wait(task_lock, [this]() { return !task_queue_.empty() || stop_flag_.load(); });
+        auto ready = [this]() {
+            return !submit_queue_.empty() || stop_flag_.load() || decode_step_ready() || prefill_step_ready();
+        };
+        scheduler_waiting_.store(true);  // NOTE: before ready() checks submit_queue_
+        // NOTE: pending prefill only counts down while a step can be submitted
+        bool prefill_waiting = !prefill_buffer_.empty() && step_slot_free();
+        if (!prefill_waiting && image_buffer.empty()) {
+            task_condition_.wait(task_lock, ready);
         } else {
             auto now = ggml_time_ms();
             int32_t past_time = 0;
-            if (!text_buffer.empty()) past_time = std::max(past_time, (int32_t)(now - last_text));
+            if (prefill_waiting) past_time = std::max(past_time, (int32_t)(now - prefill_since_));
             if (!image_buffer.empty()) past_time = std::max(past_time, (int32_t)(now - last_image));
 
-            remaining_wait = std::max((int32_t)time_wait_ - past_time, 0);
-            task_condition_.wait_for(task_lock, std::chrono::milliseconds(remaining_wait),
-                                     [this]() { return !task_queue_.empty() || stop_flag_.load(); });
+            remaining_wait = std::max((int32_t)batch_window_ms() - past_time, 0);
+            task_condition_.wait_for(task_lock, std::chrono::milliseconds(remaining_wait), ready);
         }
+        scheduler_waiting_.store(false);
         if (stop_flag_.load()) break;
 
-        if (!task_queue_.empty()) {  // Prepare data
+        bool image_due = false;
+        for (auto& chunk : submit_queue_.drain()) {
+            if (chunk->chained) {  // NOTE: follows a decode, no arrival of a request
+                bool text = mtmd_input_chunk_get_type(chunk->input_chunk.get()) == MTMD_INPUT_CHUNK_TYPE_TEXT;
+                (text ? prefill_due_ : image_due) = true;
+            } else {  // NOTE: timed at submit_chunk, a burst drained at once keeps its gaps
+                int64_t arrival_us = chunk->queued_us;
+                if (last_arrival_us_ > 0) {
+                    ewma_update(arrival_gap_ms_, std::max<int64_t>(arrival_us - last_arrival_us_, 0) / 1000.0);
+                }
+                last_arrival_us_ = std::max(last_arrival_us_, arrival_us);
+            }
+            task_queue_.push(std::move(chunk));
+        }
+
+        // NOTE: buffered chunks stay sorted, an urgent chunk preempts the pending prefill of older ones next step
+        auto more_urgent = [](const std::shared_ptr<SycChunkTask>& chunk, const std::shared_ptr<SycChunkTask>& other) {
+            return *other < *chunk;
+        };
+        while (!task_queue_.empty()) {  // Prepare data, drain so chunks queued together share a step
             auto chunk = std::move(task_queue_.top());
             task_queue_.pop();
             switch (mtmd_input_chunk_get_type(chunk->input_chunk.get())) {
                 case MTMD_INPUT_CHUNK_TYPE_TEXT:
-                    if (text_buffer.empty()) last_text = ggml_time_ms();
-                    text_buffer.push_back(chunk);
-                    text_size += mtmd_input_chunk_get_n_tokens(chunk->input_chunk.get());
+                    if (prefill_buffer_.empty()) prefill_since_ = ggml_time_ms();
+                    prefill_size_ += mtmd_input_chunk_get_n_tokens(chunk->input_chunk.get()) - chunk->n_prefilled;
+                    prefill_buffer_.insert(
+                        std::upper_bound(prefill_buffer_.begin(), prefill_buffer_.end(), chunk, more_urgent), chunk);
                     break;
                 case MTMD_INPUT_CHUNK_TYPE_IMAGE:
+                case MTMD_INPUT_CHUNK_TYPE_AUDIO:  // NOTE: embeddings as well, decoded in the same batches
                     if (image_buffer.empty()) last_image = ggml_time_ms();
-                    image_buffer.push_back(chunk);
+                    image_buffer.insert(std::upper_bound(image_buffer.begin(), image_buffer.end(), chunk, more_urgent),
+                                        chunk);
                     image_size += mtmd_input_chunk_get_n_tokens(chunk->input_chunk.get());
                     break;
                 default:
@@ -143,22 +1183,12 @@ void BatchScheduler::process_batch() {
             }
         }
 
-        {  // Prepared text batch
-            auto now = ggml_time_ms();
-            bool text_infer = false;
-            if (!text_buffer.empty()) text_infer |= (now - last_text) >= time_wait_;
-            text_infer |= text_size >= text_batch_size_;
-            if (text_infer) {
-                process_text_batch(text_buffer);  // Submit to LlmScheduler
-                text_buffer.clear();
-                last_text = ggml_time_ms();
-                text_size = 0;
-            }
-        }
+        drop_expired(image_buffer, image_size);
+
         {  // Prepared image batch
             auto now = ggml_time_ms();
-            bool image_infer = false;
-            if (!image_buffer.empty()) image_infer |= (now - last_image) >= time_wait_;
+            bool image_infer = image_due;
+            if (!image_buffer.empty()) image_infer |= (now - last_image) >= batch_window_ms();
             image_infer |= image_size >= image_batch_size_;
             if (image_infer) {
                 process_image_batch(image_buffer);  // Submit to LlmScheduler
@@ -167,48 +1197,143 @@ void BatchScheduler::process_batch() {
                 image_size = 0;
             }
         }
+
+        // Next token of all decoding sequences, pending prompt tokens piggyback on the same step
+        if (decode_step_ready() || prefill_step_ready()) submit_step(task_lock);
+        task_lock.unlock();
+        flush_sinks();  // sequences retired by the step
     }
 }
 
-void BatchScheduler::process_text_batch(std::vector<std::shared_ptr<SycChunkTask>> text_buffer) {
-    llama_batch text_batch = llama_batch_init(context_->n_batch, 0, 1);
-    int32_t last_uncomplie = 0;  // Splice batch
-    for (int32_t i = 0; i < text_buffer.size(); i++) {
-        auto chunk = text_buffer[i];
-        size_t n_tokens;
-        const auto tokens = mtmd_input_chunk_get_tokens_text(chunk->input_chunk.get(), &n_tokens);
-        size_t seq_id = chunk->cmpl_id;
-        auto& state = context_->get_seq_state(seq_id);
+void BatchScheduler::drop_expired(std::vector<std::shared_ptr<SycChunkTask>>& image_buffer, size_t& image_size) {
+    auto now = ggml_time_ms();
+    auto dropped = [this, now](const std::shared_ptr<SycChunkTask>& chunk) {
+        if (chunk->expired(now)) {
+            LOG_WRN("drop expired prompt of chat-cmpl-%zu\n", chunk->cmpl_id);
+        } else if (context_->get_seq_state(chunk->cmpl_id).cancelled) {
+            LOG_INF("drop cancelled prompt of chat-cmpl-%zu\n", chunk->cmpl_id);
+        } else {
+            return false;
+        }
+        return true;
+    };
+    // NOTE: a truncated chunk may have tokens in an in-flight step, the kv clear of its request is queued after it
+    for (auto it = prefill_buffer_.begin(); it != prefill_buffer_.end();) {
+        auto chunk = *it;
+        if (!dropped(chunk)) {
+            ++it;
+            continue;
+        }
+        prefill_size_ -= mtmd_input_chunk_get_n_tokens(chunk->input_chunk.get()) - chunk->n_prefilled;
+        it = prefill_buffer_.erase(it);
+        fail_chain(chunk);
+    }
+    for (auto it = image_buffer.begin(); it != image_buffer.end();) {
+        auto chunk = *it;
+        if (!dropped(chunk)) {
+            ++it;
+            continue;
+        }
+        image_size -= mtmd_input_chunk_get_n_tokens(chunk->input_chunk.get());
+        it = image_buffer.erase(it);
+        fail_chain(chunk);
+    }
+}
 
-        size_t token_index = 0;
-        while (token_index < n_tokens) {  // Single chunk truncated
-            for (; token_index < n_tokens && text_batch.n_tokens < context_->n_batch; token_index++) {  // Build batch
-                std::vector<llama_seq_id> seqs;
-                seqs.push_back(seq_id);
-                common_batch_add(text_batch, tokens[token_index], state.n_past.fetch_add(1), seqs, false);
-            }
-            if (token_index == n_tokens && chunk->is_last_chunk) text_batch.logits[text_batch.n_tokens - 1] = true;
-            if (text_batch.n_tokens == context_->n_batch) {  // Batch is full
-                llm_scheduler_->submit_token_infer(text_batch);
-                int32_t last = ((token_index == n_tokens) ? i : i - 1);  // Whether this chunk is completed
-                for (int t = last_uncomplie; t <= last; t++) text_buffer[t]->status.store(TaskStatus::IN_PROGRESS);
-                text_batch = llama_batch_init(context_->n_batch, 0, 1);
-                last_uncomplie = last + 1;
+void BatchScheduler::process_image_batch(std::vector<std::shared_ptr<SycChunkTask>> image_buffer) {
+    TraceScope trace("image_batch", -1, (int32_t)image_buffer.size());
+    // Images of different sequences share a decode up to n_batch tokens, non-causal ones up to n_ubatch: they attend
+    // their whole sequence (per sequence mask), which must not be split over ubatches
+    int32_t n_pack = context_->shared_model->vision_non_causal ? (int32_t)llama_n_ubatch(context_->lctx)
+                                                               : context_->n_batch;
+    std::vector<std::shared_ptr<mtmd_input_chunk>> chunks;
+    std::vector<std::shared_ptr<std::vector<float>>> embeddigs;
+    std::vector<llama_seq_id> seq_ids;
+    std::vector<std::shared_ptr<SycChunkTask>> tasks;
+    int32_t n_tokens = 0;
+    auto flush = [&]() {
+        auto on_finish = [this, tasks]() {
+            for (const auto& task : tasks) {
+                auto& state = context_->get_seq_state(task->cmpl_id);
+                llama_pos p0 = state.n_past.load() - mtmd_input_chunk_get_n_pos(task->input_chunk.get());
+                if (image_kv_ && !state.lora && state.last_token.load() >= 0)
+                    image_kv_->store(task->input_chunk.get(), task->cmpl_id, p0);
+                complete_chunk(task);
             }
+        };
+        if (chunks.size() == 1)
+            llm_scheduler_->submit_embedding_infer(chunks[0], embeddigs[0], seq_ids[0], on_finish);
+        else if (chunks.size() > 1)
+            llm_scheduler_->submit_embedding_batch_infer(chunks, embeddigs, seq_ids, on_finish);
+        chunks.clear();
+        embeddigs.clear();
+        seq_ids.clear();
+        tasks.clear();
+        n_tokens = 0;
+    };
+    for (const auto& task : image_buffer) {
+        if (task->kv_reuse) {  // NOTE: a copy of kv, no decode to share
+            context_->metrics.record(METRIC_QUEUE_WAIT, ggml_time_us() - task->queued_us);
+            task->queued_us = 0;
+            task->status.store(TaskStatus::IN_PROGRESS);
+            llm_scheduler_->submit_image_kv_infer(task->input_chunk, image_kv_.get(), task->cmpl_id,
+                                                  [this, task]() { complete_chunk(task); });
+            continue;
         }
+        int32_t n_chunk = mtmd_input_chunk_get_n_tokens(task->input_chunk.get());
+        bool same_seq = std::find(seq_ids.begin(), seq_ids.end(), (llama_seq_id)task->cmpl_id) != seq_ids.end();
+        if (!chunks.empty() && (same_seq || n_tokens + n_chunk > n_pack)) flush();
+        chunks.push_back(task->input_chunk);
+        embeddigs.push_back(task->embeddig);
+        seq_ids.push_back(task->cmpl_id);
+        tasks.push_back(task);
+        n_tokens += n_chunk;
+        context_->metrics.record(METRIC_QUEUE_WAIT, ggml_time_us() - task->queued_us);
+        task->queued_us = 0;
+        task->status.store(TaskStatus::IN_PROGRESS);
     }
-    if (text_batch.n_tokens > 0) {
-        llm_scheduler_->submit_token_infer(text_batch);
-        for (int t = last_uncomplie; t < text_buffer.size(); t++) text_buffer[t]->status.store(TaskStatus::IN_PROGRESS);
+    flush();
+}
+
+void BatchScheduler::submit_chunk(std::shared_ptr<SycChunkTask> task) {
+    task->queued_us = ggml_time_us();
+    submit_queue_.push(std::move(task));
+    if (!scheduler_waiting_.load()) return;  // NOTE: the loop checks submit_queue_ after it raised the flag
+    std::lock_guard<std::mutex> task_lock(task_queue_mutex_);
+    task_condition_.notify_one();
+}
+
+void BatchScheduler::release_chunk(std::shared_ptr<SycChunkTask> chunk) {
+    if (chunk->n_deps.fetch_sub(1) != 1) return;
+    if (chunk->status.load() == TaskStatus::FAILED) {
+        fail_chain(chunk);
+        return;
     }
-    finish_condition_.notify_all();
+    submit_chunk(std::move(chunk));
 }
 
-void BatchScheduler::process_image_batch(std::vector<std::shared_ptr<SycChunkTask>> image_buffer) {
-    for (int32_t i = 0; i < image_buffer.size(); i++) {  // NOTE: image not support batch now
-        llm_scheduler_->submit_embedding_infer(image_buffer[i]->input_chunk, image_buffer[i]->embeddig,
-                                               image_buffer[i]->cmpl_id);
-        image_buffer[i]->status.store(TaskStatus::IN_PROGRESS);
+void BatchScheduler::complete_chunk(const std::shared_ptr<SycChunkTask>& chunk) {  // run in memory thread
+    if (context_->get_seq_state(chunk->cmpl_id).last_token.load() < 0) {
+        fail_chain(chunk);
+        return;
     }
+    chunk->status.store(TaskStatus::COMPLETED);
+    if (chunk->next)
+        release_chunk(chunk->next);
+    else
+        notify_finished();
+}
+
+void BatchScheduler::fail_chain(std::shared_ptr<SycChunkTask> chunk) {
+    for (; chunk; chunk = chunk->next) {
+        auto status = chunk->status.exchange(TaskStatus::FAILED);
+        // NOTE: only a submitted chunk reached the insert that unpins its span
+        if (chunk->kv_reuse && status != TaskStatus::IN_PROGRESS) image_kv_->release(chunk->input_chunk.get());
+    }
+    notify_finished();
+}
+
+void BatchScheduler::notify_finished() {
+    std::lock_guard<std::mutex> finish_lock(finish_mutex_);
     finish_condition_.notify_all();
 }
\ No newline at end of file
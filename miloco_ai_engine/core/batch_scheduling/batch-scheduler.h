@@ -5,16 +5,31 @@
 #ifndef BATCH_SCHEDULER_H
 #define BATCH_SCHEDULER_H
 
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <set>
+#include <unordered_map>
+
+#include "admission-queue.h"
 #include "cache_manager/chunk-infer-cache.h"
+#include "cache_manager/image-kv-cache.h"
+#include "cache_manager/response-cache.h"
 #include "common/chat.h"
 #include "common/json-partial.h"
 #include "common/log.h"
+#include "draft-scheduler.h"
 #include "encoder-scheduler.h"
 #include "llama.h"
 #include "llm-scheduler.h"
+#include "prefill-scheduler.h"
 #include "scheduler_task_info.h"
 #include "utils/chunk-hash.h"
 #include "utils/llama-memory-scheduling.h"
+#include "utils/mpsc-queue.h"
+
+#define STEP_PIPELINE_DEPTH 2  // steps queued to the memory thread at once, see step_slot_free()
+#define PREFIX_GROUP_MIN_POS 64  // a request waits for another one of its batch to reuse at least this many kv pos
 
 class BatchScheduler {
   public:
@@ -22,31 +37,228 @@ class BatchScheduler {
     ~BatchScheduler();
 
     void blocking_infer(std::shared_ptr<mtmd::input_chunks> input_chunks, size_t chat_cmpl_id, int32_t priority = 0);
+    // Every prompt is submitted as one chain the memory thread advances chunk by chunk, the caller waits once for the
+    // last chunks. Requests share prefill steps and encoder work, a prefix several share that the cache does not hold
+    // yet is prefilled and stored first, then they copy it from the cache
+    void blocking_infer_batch(const std::vector<std::shared_ptr<mtmd::input_chunks>>& batch_chunks,
+                              const std::vector<size_t>& chat_cmpl_ids, const std::vector<int32_t>& priorities);
+    // Completions of one prompt (n > 1): all but its last item is prefilled once in the first sequence and its kv
+    // copied into the others, then each prefills the last item for a first token of its own
+    void blocking_infer_fork(const std::vector<std::shared_ptr<mtmd::input_chunks>>& batch_chunks,
+                             const std::vector<size_t>& chat_cmpl_ids, int32_t priority);
+
+    // Continuous decode loop: every step decodes the next token of all registered sequences in one batch,
+    // pending prompt tokens fill the rest of the step token budget (chunked prefill)
+    // token_sink (optional) gets the prompt token first, then every decoded token on the memory thread
+    void start_decoding(int32_t seq_id, std::function<void(llama_token)> token_sink = nullptr);
+    void stop_decoding(int32_t seq_id);
+    // Blocks until the decode loop produced a token for the sequence, false if it was retired without one
+    bool wait_next_token(LlamaSeqState& state, llama_token& token);
+    // The sequence generated max_tokens of its request, the prompt token included
+    static bool reached_max_tokens(const LlamaSeqState& state) {
+        return state.max_tokens > 0 && state.n_generated + 1 >= state.max_tokens;
+    }
+
+    // Request coalescing: a request identical to a leader still in prefill reads the tokens of the leader instead of
+    // taking a sequence. follow binds cmpl_id as a follower (an id >= FOLLOWER_SEQ_BASE), -1 if there is no leader
+    // with the fingerprint. A follower infers nothing, it gets the prompt token and every decoded token of its leader
+    // and ends with it, also if the leader is stopped early
+    int32_t follow(size_t cmpl_id, const HashKey& fingerprint);
+    void lead(LlamaSeqState& state, const HashKey& fingerprint);  // joinable until its prompt is inferred
+    // Memoisation: binds cmpl_id as a follower holding the stored completion of the fingerprint and already ended,
+    // -1 on a miss. A sequence with response_key set stores its completion once it reaches an end of generation
+    int32_t replay(size_t cmpl_id, const HashKey& fingerprint);
+
+    // Log probability of each candidate continuation of the prefilled seq_id after last_token (the prompt token left
+    // out of the prefill), candidates run in forks of the sequence sharing its prefix kv, as many per decode as there
+    // are free sequences and n_batch allows. False if a decode failed, the kv of seq_id is cut back to its prefix
+    bool score(int32_t seq_id, llama_token last_token, const std::vector<llama_tokens>& candidates,
+               std::vector<float>& logprobs);
+
+    // Swaps the kv of a decoding sequence of a lower latency class than priority to host memory and reserves its
+    // id for cmpl_id, -1 if there is none or the swapped kv would exceed preempt_host_bytes
+    int32_t preempt_seq(size_t cmpl_id, int32_t priority);
+    // Swapped sequences rejoin the decode loop in free ids, oldest first
+    void resume_preempted();
+    void drop_preempted(int32_t swap_id);  // NOTE: context_->seq_move_mutex must be held
+    // Admission: a request with no free sequence (nor one to preempt) waits for one, -1 without admission queue or
+    // once it gave up. admit_waiting hands the free sequences to the waiting requests
+    int32_t admit(size_t cmpl_id, int32_t priority, int64_t expire_ms);
+    // admit without blocking the caller, on_grant gets its result. NOTE: requires the admission queue
+    void admit_async(size_t cmpl_id, int32_t priority, int64_t expire_ms, AdmissionQueue::GrantCallback on_grant);
+    void admit_waiting() {
+        if (admission_) admission_->grant();
+    }
+    // Cancellation: drops the queued prompt chunks and encodes of cmpl_id, ends its decoding and clears its kv, the
+    // request fails once its consumer stops it. False if cmpl_id holds no sequence nor waits for one
+    bool cancel(size_t cmpl_id);
+
+    // Multi-turn sessions, the kv of a stopped session request stays cached for the next turn
+    void store_session(int32_t seq_id);
+    void release_session(const std::string& session);
+    bool has_session(const std::string& session) const { return kv_cache_ && kv_cache_->has_session(session); }
+    // Session migration between instances, see ChunkInferCache::export_session, false without cache sequences
+    bool export_session(const std::string& session, std::vector<uint8_t>& out) {
+        return kv_cache_ && kv_cache_->export_session(session, out);
+    }
+    // Pooled embedding of text tokens prefilled in a free sequence, see LlmScheduler::submit_pool_infer. Decodes
+    // interleave with the steps of the decode loop on the memory thread. False if no sequence is free or it failed
+    bool embed(const llama_tokens& tokens, std::vector<float>& embd);
+    // Projector embeddings of an image chunk from the modal cache, else encoded in the queue at default priority
+    std::shared_ptr<std::vector<float>> encode(std::shared_ptr<mtmd_input_chunk> chunk) {
+        return encoder_scheduler_->blocking_encoder(std::move(chunk));
+    }
+    bool import_session(const uint8_t* data, size_t size, std::string& session) {
+        return kv_cache_ && kv_cache_->import_session(data, size, session);
+    }
+
+    std::shared_ptr<ModalEmbeddingCache> modal_cache() { return encoder_scheduler_->get_cache(); }
+    void share_modal_cache(std::shared_ptr<ModalEmbeddingCache> cache) {
+        if (kv_cache_) kv_cache_->set_modal_cache(cache);
+        encoder_scheduler_->share_cache(std::move(cache));
+    }
+    float encoder_load() const { return encoder_scheduler_->load(); }
+    bool encode_ahead(std::shared_ptr<mtmd_input_chunk> chunk) {
+        return encoder_scheduler_->submit_encode_ahead(std::move(chunk));
+    }
+    const ChunkInferCache* kv_cache() const { return kv_cache_.get(); }  // nullptr without cache sequences
+    ResponseCache* response_cache() { return response_cache_.get(); }    // nullptr without response_cache_bytes
+    AdmissionQueue* admission() { return admission_.get(); }             // nullptr without admission_queue_max
+    size_t swapped_bytes();  // host memory of the kv of preempted sequences
 
   private:
+    // One round of blocking_infer_batch, t_start (us) is the start of the batch. A fork round prefills shared prefixes
+    // only: no logits, no token, the prefix is stored for the requests that copy it
+    void infer_round(const std::vector<std::shared_ptr<mtmd::input_chunks>>& batch_chunks,
+                     const std::vector<size_t>& chat_cmpl_ids, const std::vector<int32_t>& priorities, int64_t t_start,
+                     bool fork = false);
+    // image_kv_keep: thins the kv of the exact images of a prefilled prompt, see LlmScheduler::submit_image_kv_thin.
+    // n_resident are the kv items kept from the last request, those from n_exact_items on are thinned already
+    void thin_image_kv(int32_t seq_id, LlamaSeqState& state, size_t n_resident);
     void process_batch();
-    void process_text_batch(std::vector<std::shared_ptr<SycChunkTask>> text_buffer);
+    bool decode_step_ready();   // NOTE: task_queue_mutex_ must be held
+    bool prefill_step_ready();  // NOTE: task_queue_mutex_ must be held
+    // NOTE: task_lock must hold task_queue_mutex_, drafting unlocks it for a while
+    void submit_step(std::unique_lock<std::mutex>& task_lock);
+    void finish_decode_step(int32_t slot);
+    // NOTE: task_queue_mutex_ must be held for the step helpers below
+    bool step_slot_free() const;
+    bool seq_in_flight(int32_t seq_id) const;
+    void retire_decoding_seq(int32_t seq_id);  // NOTE: task_queue_mutex_ must be held
+    // token (just emitted) ends the request: max_tokens reached, a tool call completed or a stop string completed in
+    // stop_tail, the consumer still cuts the text at the stop string itself
+    bool generation_limit(LlamaSeqState& state, llama_token token);
+    // A tool request generated a whole tool call, the tokens the model would add after it (closing tokens, chatter up
+    // to the end of generation) are never decoded
+    bool tool_call_complete(LlamaSeqState& state, llama_token token);
     void process_image_batch(std::vector<std::shared_ptr<SycChunkTask>> image_buffer);
+    // Fails the chains of buffered chunks past their request deadline or of a cancelled request,
+    // NOTE: task_queue_mutex_ must be held
+    void drop_expired(std::vector<std::shared_ptr<SycChunkTask>>& image_buffer, size_t& image_size);
+    void submit_chunk(std::shared_ptr<SycChunkTask> task);  // lock-free, wakes the loop only if it sleeps
+    // Prompt chains: a dependency of chunk is met, it is submitted once none is left
+    void release_chunk(std::shared_ptr<SycChunkTask> chunk);
+    void complete_chunk(const std::shared_ptr<SycChunkTask>& chunk);  // decoded, run in memory thread
+    void fail_chain(std::shared_ptr<SycChunkTask> chunk);             // chunk and the rest of its prompt
+    void notify_finished();
+    // Coalescing, NOTE: follow_mutex_ is taken inside task_queue_mutex_, never the other way round
+    void unlead(LlamaSeqState& state);  // NOTE: follow_mutex_ must be held
+    // to the followers of state and to its memoised completion
+    void publish_token(LlamaSeqState& state, llama_token token);
+    // The followers of state get no more tokens, a follower state leaves its leader
+    void end_coalescing(LlamaSeqState& state);
+    // Token sinks run user callbacks that may re-enter the scheduler (e.g. cancel), so a call is queued under the
+    // scheduler locks and made by flush_sinks once they are released, in the order queued
+    void emit_token(const std::function<void(llama_token)>& sink, llama_token token);
+    void flush_sinks();  // NOTE: no scheduler lock may be held
+    bool has_followers(LlamaSeqState& state);
+    // Adaptive batching window (ms) of partial batches, NOTE: task_queue_mutex_ must be held
+    int64_t batch_window_ms() const;
+    TaskClass task_class(int32_t priority) const;
+    int64_t task_deadline(int32_t priority) const;  // ms, from now
 
     LlamaMicoContext* context_{nullptr};
 
     std::unique_ptr<EncoderSheduler> encoder_scheduler_{nullptr};
     std::unique_ptr<LlmScheduler> llm_scheduler_{nullptr};
+    std::unique_ptr<DraftScheduler> draft_scheduler_{nullptr};  // NOTE: scheduler thread only
+    std::unique_ptr<PrefillScheduler> prefill_scheduler_{nullptr};  // long prompts, nullptr without prefill_devices
 
     std::unique_ptr<ChunkInferCache> kv_cache_{nullptr};
+    std::unique_ptr<ImageKvCache> image_kv_{nullptr};  // nullptr without image_kv_entries
+    std::unique_ptr<ResponseCache> response_cache_{nullptr};
+    std::unique_ptr<AdmissionQueue> admission_{nullptr};
 
     std::thread* scheduler_thread_{nullptr};
     std::atomic<bool> stop_flag_{false};
 
     mutable std::mutex task_queue_mutex_;
     std::condition_variable task_condition_;
+    std::atomic<bool> scheduler_waiting_{false};  // loop sleeps on task_condition_, submit_chunk has to wake it
+
+    // Completion of submitted chunks, separate from task_queue_mutex_ so waiters never hold up a step
+    std::mutex finish_mutex_;
     std::condition_variable finish_condition_;
 
-    std::priority_queue<std::shared_ptr<SycChunkTask>> task_queue_;
+    MpscQueue<std::shared_ptr<SycChunkTask>> submit_queue_;  // request threads
+    // NOTE: scheduler thread only, filled from submit_queue_
+    std::priority_queue<std::shared_ptr<SycChunkTask>, std::vector<std::shared_ptr<SycChunkTask>>, SycChunkTaskLess>
+        task_queue_;
+
+    // decode loop
+    std::set<int32_t> decoding_seqs_;
+    // Steps are double buffered: the next one is built and queued while the memory thread still runs the current,
+    // so the host work of a step overlaps the device compute of the previous one
+    struct DecodeStep {
+        llama_batch batch;
+        std::vector<int32_t> seqs;  // decoding sequences of the step
+        bool in_flight{false};
+        int64_t submitted{0};  // ms
+        int64_t submitted_us{0};
+        int32_t n_prefill{0};  // prompt tokens of the step
+        int64_t id{0};         // batch id in the trace
+    };
+    DecodeStep steps_[STEP_PIPELINE_DEPTH];
+    int32_t steps_in_flight_{0};
+    int64_t n_steps_{0};
+    int64_t last_step_finished_{0};  // ms
+    int64_t last_step_finished_us_{0};
+    int32_t step_token_budget_{0};  // max tokens per step, decode first then prefill
+    int32_t decode_step_size_{0};   // max tokens per step with decoding sequences
+    std::condition_variable step_condition_;
+
+    // preempted sequences, NOTE: context_->seq_move_mutex must be held
+    struct SwappedSeq {
+        int32_t swap_id;
+        std::shared_ptr<std::vector<uint8_t>> kv;  // llama_state_seq data
+    };
+    std::deque<SwappedSeq> swapped_seqs_;
+    size_t swapped_bytes_{0};
+
+    std::mutex encoding_mutex_;
+    std::unordered_map<int32_t, std::vector<std::shared_ptr<SycChunkTask>>> encoding_;  // submitted encodes by seq
+
+    std::mutex follow_mutex_;
+
+    std::mutex sink_mutex_;
+    std::vector<std::pair<std::function<void(llama_token)>, llama_token>> sink_calls_;
+    std::mutex sink_flush_mutex_;  // one flush at a time, a sink re-entering leaves its calls to it
+    std::unordered_map<HashKey, LlamaSeqState*, HashKeyHasher> leaders_;  // in prefill, by request fingerprint
+
+    // chunked prefill
+    std::deque<std::shared_ptr<SycChunkTask>> prefill_buffer_;  // most urgent first
+    size_t prefill_size_{0};    // tokens not yet submitted
+    int64_t prefill_since_{0};  // ms
+    bool prefill_due_{false};   // a chained chunk is buffered, its prompt already waited for its batch
 
     int32_t text_batch_size_{512};  // token size
     int32_t image_batch_size_{1};   // token size
-    size_t time_wait_{3};           // ms
+    size_t time_wait_{3};           // ms, upper bound of the batching window
+
+    // EWMA of the gap between submitted chunks and of the decode step time, ms
+    double arrival_gap_ms_{-1.0};
+    double decode_ms_{-1.0};
+    int64_t last_arrival_us_{0};  // submit_chunk time of the latest arrival drained
 };
 
 #endif  // BATCH_SCHEDULER_H
\ No newline at end of file
@@ -0,0 +1,105 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "draft-scheduler.h"
+
+DraftScheduler::DraftScheduler(LlamaMicoContext* context) : context_(context) {
+    batch_ = llama_batch_init(std::max(context->n_batch, 1), 0, 1);
+}
+
+DraftScheduler::~DraftScheduler() { llama_batch_free(batch_); }
+
+void DraftScheduler::reset() {
+    llama_memory_clear(llama_get_memory(context_->draft_ctx), true);
+    in_kv_.clear();
+}
+
+// Longest n-gram first, down to a single token, the latest match wins: recent output repeats more likely
+void DraftScheduler::lookup(DraftInput& input) const {
+    input.draft.clear();
+    const auto& history = input.history;
+    std::vector<llama_token> tail(history.end() - std::min(history.size(), (size_t)context_->n_lookup_ngram),
+                                  history.end());
+    tail.push_back(input.last_token);  // NOTE: the n-gram ends with the token to decode, its followers are the draft
+    for (size_t n = std::min(tail.size(), (size_t)context_->n_lookup_ngram); n > 0; n--) {
+        auto gram = tail.end() - n;
+        for (size_t end = history.size(); end >= n; end--) {  // history[end - n, end) == gram, history[end] follows
+            if (!std::equal(gram, tail.end(), history.begin() + (end - n))) continue;
+            size_t n_draft = std::min(history.size() - end, (size_t)input.n_max);
+            if (n_draft == 0) continue;
+            input.draft.assign(history.begin() + end, history.begin() + end + n_draft);
+            return;
+        }
+    }
+}
+
+void DraftScheduler::draft(std::vector<DraftInput>& inputs) {
+    if (!enabled() || inputs.empty()) return;
+    if (!context_->draft_ctx) {
+        for (auto& input : inputs) lookup(input);
+        return;
+    }
+    llama_context* ctx_dft = context_->draft_ctx;
+    llama_memory_t mem = llama_get_memory(ctx_dft);
+    int32_t n_batch = std::max(context_->n_batch, 1);
+    auto decode = [this, ctx_dft]() {
+        if (batch_.n_tokens == 0 || llama_decode(ctx_dft, batch_) == 0) return true;
+        LOG_WRN("draft model: failed to decode %d tokens, draft kv reset\n", batch_.n_tokens);
+        reset();
+        return false;
+    };
+
+    // Catch up: the part of each history past the common prefix with the draft kv, the last token waits for its logits
+    common_batch_clear(batch_);
+    for (auto& input : inputs) {
+        input.draft.clear();
+        auto& in_kv = in_kv_[input.seq_id];
+        size_t n_common = 0;
+        while (n_common < in_kv.size() && n_common < input.history.size() && in_kv[n_common] == input.history[n_common])
+            n_common++;
+        if (n_common < in_kv.size()) llama_memory_seq_rm(mem, input.seq_id, n_common, -1);
+        in_kv.resize(n_common);
+        for (size_t i = n_common; i < input.history.size(); i++) {
+            if (batch_.n_tokens >= n_batch) {
+                if (!decode()) return;
+                common_batch_clear(batch_);
+            }
+            common_batch_add(batch_, input.history[i], (llama_pos)in_kv.size(), {input.seq_id}, false);
+            in_kv.push_back(input.history[i]);
+        }
+    }
+    if (!decode()) return;
+
+    // Draft rounds: one token of every sequence still drafting per decode, argmax stays on device
+    std::vector<int32_t> rows(inputs.size(), -1);
+    std::vector<llama_token> next(inputs.size());
+    for (size_t k = 0; k < inputs.size(); k++) next[k] = inputs[k].last_token;
+    llama_set_output_argmax(ctx_dft, true);
+    while (true) {
+        common_batch_clear(batch_);
+        for (size_t k = 0; k < inputs.size(); k++) {
+            auto& input = inputs[k];
+            rows[k] = -1;
+            if (next[k] < 0 || (int32_t)input.draft.size() >= input.n_max || batch_.n_tokens >= n_batch) continue;
+            auto& in_kv = in_kv_[input.seq_id];
+            rows[k] = batch_.n_tokens;
+            common_batch_add(batch_, next[k], (llama_pos)in_kv.size(), {input.seq_id}, true);
+            in_kv.push_back(next[k]);
+        }
+        if (batch_.n_tokens == 0) break;
+        if (!decode()) {
+            for (auto& input : inputs) input.draft.clear();
+            break;
+        }
+        for (size_t k = 0; k < inputs.size(); k++) {
+            if (rows[k] < 0) continue;
+            llama_token token = llama_get_argmax_ith(ctx_dft, rows[k]);
+            bool stop = token < 0 || llama_vocab_is_eog(context_->vocab, token);
+            if (token >= 0) inputs[k].draft.push_back(token);
+            next[k] = stop ? -1 : token;  // NOTE: the last draft token is not decoded, the next catch up does it
+        }
+    }
+    llama_set_output_argmax(ctx_dft, false);
+}
@@ -0,0 +1,46 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef DRAFT_SCHEDULING_H
+#define DRAFT_SCHEDULING_H
+
+#include <unordered_map>
+
+#include "utils/mico-common.h"
+
+// Speculative decode: proposes the next tokens of decoding sequences, the main model verifies them in its decode step
+// Drafts come from the draft model, or without one from prompt lookup: the tokens that followed the latest earlier
+// occurrence of the sequence's last n-gram, e.g. device names and ids a tool call copies from the prompt
+class DraftScheduler {
+  public:
+    explicit DraftScheduler(LlamaMicoContext* context);
+    ~DraftScheduler();
+
+    bool enabled() const {
+        return (context_->draft_ctx != nullptr || context_->n_lookup_ngram > 0) && context_->n_draft_max > 0;
+    }
+    int32_t n_max() const { return context_->n_draft_max; }
+
+    struct DraftInput {
+        int32_t seq_id;
+        std::vector<llama_token> history;  // text tokens in the kv of the sequence, images are skipped
+        llama_token last_token;            // sampled, not in kv yet
+        int32_t n_max;
+        std::vector<llama_token> draft;  // output
+    };
+    // Drafts of all inputs: greedy from the draft model, its kv catching up with every history in one batch first,
+    // or by prompt lookup
+    // NOTE: scheduler thread only, no llama_context of the main model is touched
+    void draft(std::vector<DraftInput>& inputs);
+
+  private:
+    void reset();  // drops the whole draft kv, e.g. after a failed decode
+    void lookup(DraftInput& input) const;
+
+    LlamaMicoContext* context_;
+    llama_batch batch_;
+    std::unordered_map<int32_t, std::vector<llama_token>> in_kv_;  // tokens in the draft kv of each sequence
+};
+
+#endif  // DRAFT_SCHEDULING_H
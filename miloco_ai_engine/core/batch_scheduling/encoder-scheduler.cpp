@@ -5,40 +5,99 @@
 
 #include "encoder-scheduler.h"
 
+#include <algorithm>
+
+#include "utils/op-profiler.h"
+
 EncoderSheduler::EncoderSheduler(LlamaMicoContext* context, int32_t max_entries, int32_t max_memory_mb)
     : context_(context) {
     // encoder cache
-    encode_cache_ = std::make_unique<ImageEmbeddingCache>(max_entries, max_memory_mb, context);
-    encoder_thread_ = new std::thread(&EncoderSheduler::process_encoder, this);
+    encode_cache_ = std::make_unique<ModalEmbeddingCache>(max_entries, max_memory_mb, context);
+    if (!context->shared_model->has_vision()) return;  // text only
+    workers_.resize(context->shared_model->n_vision_workers());
+    for (size_t worker = 0; worker < context->shared_model->n_vision_workers(); worker++)
+        encoder_threads_.push_back(new std::thread(&EncoderSheduler::process_encoder, this, worker));
 }
 
 EncoderSheduler::~EncoderSheduler() {
     stop_flag_.store(true);
-    encode_condition_.notify_one();
-    if (encoder_thread_) {
-        encoder_thread_->join();
-        delete encoder_thread_;
+    encode_condition_.notify_all();
+    for (auto* thread : encoder_threads_) {
+        thread->join();
+        delete thread;
     }
 }
 
-void EncoderSheduler::submit_encoder_task(std::shared_ptr<mtmd_input_chunk> chunk) {
-    std::function<void()> task = [this, chunk]() {
-        encoder_task(chunk);
-        encode_finish_condition_.notify_all();
+std::function<void(mtmd_context*)> EncoderSheduler::encode_job(std::shared_ptr<mtmd_input_chunk> chunk) {
+    return [this, chunk](mtmd_context* ctx_vision) {
+        bool stored = false;
+        try {
+            stored = encoder_task(chunk, ctx_vision);
+        } catch (const std::exception& e) {
+            LOG_ERR("failed to encode: %s\n", e.what());
+        }
+        if (!stored) encode_cache_->fail(chunk.get());  // NOTE: waiters would block forever otherwise
     };
+}
+
+void EncoderSheduler::submit_encoder_task(std::shared_ptr<mtmd_input_chunk> chunk, int64_t deadline_ms,
+                                          int64_t expire_ms) {
+    std::unique_lock<std::mutex> queue_lock(encoder_queue_mutex_);
+    HashKey key = modal_chunk_key(chunk.get());
+    if (!encode_cache_->prepare(chunk.get())) {  // Blocking stage placeholder
+        auto queued = queued_.find(key);  // NOTE: another request waits on the same frame, keep it alive
+        if (queued == queued_.end()) return;
+        if (queued->second.ahead) {  // encoded ahead and not started, the request takes it over
+            auto ahead = std::find_if(ahead_queue_.begin(), ahead_queue_.end(), [&key](const EncoderJob& job) {
+                return modal_chunk_key(job.chunk.get()) == key;
+            });
+            queued->second = {expire_ms, 1, false, deadline_ms, n_submitted_++};
+            encoder_queue_.push({deadline_ms, queued->second.order, ahead->chunk, ahead->task});
+            ahead_queue_.erase(ahead);
+            encode_condition_.notify_one();
+            return;
+        }
+        queued->second.n_requests++;
+        if (queued->second.expire_ms > 0)
+            queued->second.expire_ms = expire_ms > 0 ? std::max(queued->second.expire_ms, expire_ms) : 0;
+        if (deadline_ms < queued->second.deadline_ms) {  // e.g. an interactive question on a frame a sweep queued
+            queued->second.deadline_ms = deadline_ms;
+            queued->second.order = n_submitted_++;
+            encoder_queue_.push({deadline_ms, queued->second.order, chunk, encode_job(chunk)});
+            encode_condition_.notify_one();
+        }
+        return;
+    }
+    queued_[key] = {expire_ms, 1, false, deadline_ms, n_submitted_};
+    encoder_queue_.push({deadline_ms, n_submitted_++, chunk, encode_job(chunk)});
+    encode_condition_.notify_one();
+}
 
+bool EncoderSheduler::submit_encode_ahead(std::shared_ptr<mtmd_input_chunk> chunk) {
+    if (encoder_threads_.empty()) return false;
     std::unique_lock<std::mutex> queue_lock(encoder_queue_mutex_);
-    std::string key = encode_cache_->prepare(chunk.get());  // Blocking stage placeholder
-    if (key.empty()) return;
-    encoder_queue_.push(task);
+    if (!encode_cache_->prepare(chunk.get())) return true;  // cached, or queued or encoding for a request
+    queued_[modal_chunk_key(chunk.get())] = {0, 0, true, INT64_MAX, n_submitted_};
+    ahead_queue_.push_back({0, n_submitted_++, chunk, encode_job(chunk)});
+    while (ahead_queue_.size() > ENCODE_AHEAD_PER_WORKER * encoder_threads_.size()) {  // a stale camera frame
+        const EncoderJob& oldest = ahead_queue_.front();
+        queued_.erase(modal_chunk_key(oldest.chunk.get()));
+        encode_cache_->fail(oldest.chunk.get());
+        ahead_queue_.pop_front();
+    }
     encode_condition_.notify_one();
+    return true;
+}
+
+void EncoderSheduler::cancel(std::shared_ptr<mtmd_input_chunk> chunk) {
+    std::lock_guard<std::mutex> queue_lock(encoder_queue_mutex_);
+    auto queued = queued_.find(modal_chunk_key(chunk.get()));
+    if (queued == queued_.end() || --queued->second.n_requests > 0) return;
+    queued->second.expire_ms = 1;  // dropped once it is popped
 }
 
 std::shared_ptr<std::vector<float>> EncoderSheduler::wait_for_result(std::shared_ptr<mtmd_input_chunk> chunk) {
-    std::unique_lock<std::mutex> queue_lock(encoder_queue_mutex_);  // tmp lock
-    encode_finish_condition_.wait(queue_lock, [this, chunk] { return !encode_cache_->waiting(chunk.get()); });
-    auto res = encode_cache_->lookup(chunk.get());
-    return res;
+    return encode_cache_->wait(chunk.get());
 }
 
 std::shared_ptr<std::vector<float>> EncoderSheduler::blocking_encoder(std::shared_ptr<mtmd_input_chunk> chunk) {
@@ -46,44 +105,136 @@ std::shared_ptr<std::vector<float>> EncoderSheduler::blocking_encoder(std::share
     return wait_for_result(chunk);
 }
 
-void EncoderSheduler::encoder_task(std::shared_ptr<mtmd_input_chunk> chunk) {
+bool EncoderSheduler::encoder_task(std::shared_ptr<mtmd_input_chunk> chunk, mtmd_context* ctx_vision) {
     auto chunk_type = mtmd_input_chunk_get_type(chunk.get());
-    if (chunk_type != MTMD_INPUT_CHUNK_TYPE_IMAGE) return;
+    if (chunk_type == MTMD_INPUT_CHUNK_TYPE_TEXT) return false;
+    const char* modal = chunk_type == MTMD_INPUT_CHUNK_TYPE_AUDIO ? "audio" : "image";
+    if (!ctx_vision) {
+        LOG_ERR("no vision model to encode %s\n", modal);
+        return false;
+    }
+
+    size_t n_embd = mtmd_input_chunk_get_n_tokens(chunk.get()) * llama_model_n_embd(context_->model);
+    if (n_embd == 0) return false;
+    TraceScope trace("encode", -1, (int32_t)mtmd_input_chunk_get_n_tokens(chunk.get()),
+                     modal_chunk_key(chunk.get()).lo);
 
-    int64_t t1 = ggml_time_ms();
-    int32_t ret = mtmd_encode_chunk(context_->ctx_vision.get(), chunk.get());
-    LOG_INF("image encode in %" PRId64 " ms\n", ggml_time_ms() - t1);
+    // NOTE: encoded straight into the cached buffer, the device output is the only copy
+    auto embeddings = std::make_shared<std::vector<float>>(n_embd);
+    int64_t t1 = ggml_time_us();
+    int32_t ret = 0;
+    {
+        std::lock_guard<std::mutex> lock(context_->shared_model->encode_mutex(ctx_vision));
+        // NOTE: the vision contexts may be shared with other handles, the profiler of this one is set per encode
+        OpProfiler* profiler = context_->op_profiler.get();
+        if (profiler) mtmd_set_eval_callback(ctx_vision, OpProfiler::eval_callback, profiler->probe(OP_GRAPH_VISION));
+        ret = mtmd_encode_chunk_to(ctx_vision, chunk.get(), embeddings->data());
+        if (profiler) mtmd_set_eval_callback(ctx_vision, nullptr, nullptr);
+    }
+    int64_t encode_us = ggml_time_us() - t1;
+    int64_t encode_ms = encode_us / 1000;
+    context_->metrics.record(METRIC_ENCODE, encode_us);
+    LOG_INF("%s encode in %" PRId64 " ms\n", modal, encode_ms);
     if (ret != 0) {
-        LOG_ERR("failed to encode image\n");
-        return;
+        LOG_ERR("failed to encode %s\n", modal);
+        return false;
     }
+    if (!encode_cache_->store(chunk.get(), std::move(embeddings), (float)encode_ms)) return false;
+    // NOTE: waiters hold the embeddings now, the patches would stay in every copy of the chunk until its request ends
+    mtmd_input_chunk_release_pixels(chunk.get());
+    return true;
+}
 
-    auto embd = mtmd_get_output_embd(context_->ctx_vision.get());
-    size_t n_embd = mtmd_input_chunk_get_n_tokens(chunk.get()) * llama_model_n_embd(context_->model);
-    if (embd && n_embd > 0) {
-        std::vector<float> embeddings(embd, embd + n_embd);
-        encode_cache_->store(chunk.get(), embeddings);
+int64_t EncoderSheduler::defer_us(size_t worker, int32_t n_tokens) const {
+    const WorkerLoad& self = workers_[worker];
+    if (workers_.size() < 2 || self.us_per_token <= 0) return 0;  // NOTE: an unmeasured worker takes jobs to measure
+    int64_t now = ggml_time_us();
+    double own_us = self.us_per_token * n_tokens;
+    for (size_t i = 0; i < workers_.size(); i++) {
+        const WorkerLoad& other = workers_[i];
+        if (i == worker || other.us_per_token <= 0) continue;
+        int64_t busy_us = std::max<int64_t>(0, other.busy_until_us - now);
+        if (busy_us + other.us_per_token * n_tokens < ENCODER_DEFER_RATIO * own_us)
+            return std::min<int64_t>(std::max<int64_t>(busy_us, 1000), ENCODER_DEFER_MAX_US);
     }
+    return 0;
 }
 
-void EncoderSheduler::process_encoder() {
+// NOTE: worker 0 also unloads the idle vision model, waking up for it while the queue stays empty
+void EncoderSheduler::process_encoder(size_t worker) {
+    mico_trace::set_thread_name("encoder");
+    set_thread_affinity(context_->cpu_encoder);  // NOTE: before the encoder starts ggml threads, they inherit it
+    int32_t idle_unload_s = worker == 0 ? context_->shared_model->params.mmproj_idle_unload_s : 0;
+    auto ready = [this] { return !encoder_queue_.empty() || !ahead_queue_.empty() || stop_flag_.load(); };
     while (true) {
-        std::function<void()> task = nullptr;
+        std::function<void(mtmd_context*)> task = nullptr;
+        int32_t n_tokens = 0;
         {
             std::unique_lock<std::mutex> lock(encoder_queue_mutex_);
-            encode_condition_.wait(lock, [this] { return !encoder_queue_.empty() || stop_flag_.load(); });
+            if (idle_unload_s <= 0) {
+                encode_condition_.wait(lock, ready);
+            } else if (!encode_condition_.wait_for(lock, std::chrono::seconds(idle_unload_s), ready)) {
+                lock.unlock();
+                context_->shared_model->unload_idle_vision();
+                continue;
+            }
             if (stop_flag_.load()) break;
 
-            task = std::move(encoder_queue_.front());
-            encoder_queue_.pop();
+            bool ahead = encoder_queue_.empty();  // NOTE: encodes ahead only run with no request chunk queued
+            const auto& job = ahead ? ahead_queue_.back() : encoder_queue_.top();
+            auto queued = queued_.find(modal_chunk_key(job.chunk.get()));
+            if (!ahead && (queued == queued_.end() || queued->second.order != job.order)) {  // moved up, done before
+                encoder_queue_.pop();
+                continue;
+            }
+            n_tokens = std::max(1, (int32_t)mtmd_input_chunk_get_n_tokens(job.chunk.get()));
+            int64_t defer = defer_us(worker, n_tokens);
+            if (defer > 0) {  // Another device finishes it sooner, wake it if idle and look again after
+                encode_condition_.notify_all();
+                encode_condition_.wait_for(lock, std::chrono::microseconds(defer));
+                continue;
+            }
+            HashKey key = queued->first;
+            int64_t expire_ms = queued->second.expire_ms;
+            queued_.erase(queued);
+            if (expire_ms > 0 && ggml_time_ms() >= expire_ms) {  // Every request waiting on it expired or cancelled
+                LOG_WRN("drop encode of %s, no request waits for it\n", hash_to_hex(key).c_str());
+                encode_cache_->fail(job.chunk.get());
+            } else {
+                task = job.task;
+                if (!workers_.empty())
+                    workers_[worker].busy_until_us = ggml_time_us() + workers_[worker].us_per_token * n_tokens;
+            }
+            if (ahead)
+                ahead_queue_.pop_back();
+            else
+                encoder_queue_.pop();
         }
 
         if (task == nullptr) continue;  // Skip if task is null
 
+        int64_t t_start = ggml_time_us();
         try {
-            task();
+            std::shared_ptr<mtmd_context> ctx_vision = context_->vision(worker);  // NOTE: loads a lazy or unloaded one
+            n_running_++;
+            task(ctx_vision.get());
+            n_running_--;
         } catch (const std::exception& e) {
-            LOG_ERR("failed to image encode\n");
+            n_running_--;
+            LOG_ERR("failed to encode\n");
         }
+        std::lock_guard<std::mutex> lock(encoder_queue_mutex_);
+        if (workers_.empty()) continue;
+        WorkerLoad& load = workers_[worker];
+        double us_per_token = (double)(ggml_time_us() - t_start) / n_tokens;
+        load.us_per_token = load.us_per_token > 0 ? 0.8 * load.us_per_token + 0.2 * us_per_token : us_per_token;
+        load.busy_until_us = 0;
     }
-}
\ No newline at end of file
+}
+
+float EncoderSheduler::load() const {
+    std::lock_guard<std::mutex> lock(encoder_queue_mutex_);
+    size_t n_workers = std::max<size_t>(1, encoder_threads_.size());
+    // NOTE: queued_ and not encoder_queue_, which holds the stale copies of moved up jobs
+    return (float)(queued_.size() - ahead_queue_.size() + n_running_.load()) / n_workers;
+}
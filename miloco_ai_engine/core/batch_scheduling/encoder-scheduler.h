@@ -4,38 +4,87 @@
  */
 #ifndef ENCODER_SCHEDULING_H
 #define ENCODER_SCHEDULING_H
+#include <deque>
 #include <memory>
 
-#include "cache_manager/image-embedding-cache.h"
+#include "cache_manager/modal-embedding-cache.h"
+
+#define ENCODER_DEFER_RATIO 0.8  // a job is left to a worker finishing it in less than this share of the time
+#define ENCODER_DEFER_MAX_US 50000
+#define ENCODE_AHEAD_PER_WORKER 4  // frames queued for encode ahead per worker, the oldest is dropped for a new one
 
 class EncoderSheduler {
   public:
     explicit EncoderSheduler(LlamaMicoContext* context, int32_t max_entries = 100, int32_t max_memory_mb = 1024);
     ~EncoderSheduler();
 
-    std::shared_ptr<ImageEmbeddingCache> get_cache() { return encode_cache_; }
+    std::shared_ptr<ModalEmbeddingCache> get_cache() { return encode_cache_; }
+    // Uses the cache of another handle with the same vision model, NOTE: before the first task
+    void share_cache(std::shared_ptr<ModalEmbeddingCache> cache) { encode_cache_ = std::move(cache); }
 
-    void submit_encoder_task(std::shared_ptr<mtmd_input_chunk> chunk);
+    // Queued image and audio chunks are encoded earliest deadline (ms) first, a chunk still queued at expire_ms (the
+    // latest of the requests waiting on it, 0 never) is dropped and its waiters get nullptr. A request of an earlier
+    // deadline waiting on a queued chunk moves it up to its deadline
+    void submit_encoder_task(std::shared_ptr<mtmd_input_chunk> chunk, int64_t deadline_ms = 0, int64_t expire_ms = 0);
+    // A request submitting chunk no longer waits for it, a queued chunk no request waits for is dropped
+    void cancel(std::shared_ptr<mtmd_input_chunk> chunk);
+    // Encodes chunk into the cache while no request chunk is queued, newest first. A request submitting it while it
+    // waits moves it to the request queue. False without a vision model
+    bool submit_encode_ahead(std::shared_ptr<mtmd_input_chunk> chunk);
 
     std::shared_ptr<std::vector<float>> wait_for_result(std::shared_ptr<mtmd_input_chunk> chunk);
+    bool result_ready(std::shared_ptr<mtmd_input_chunk> chunk) { return encode_cache_->storing(chunk.get()); }
 
     std::shared_ptr<std::vector<float>> blocking_encoder(std::shared_ptr<mtmd_input_chunk> chunk);
 
+    // Queued and running encodes per worker, above 1 a new chunk waits behind others
+    float load() const;
+
   private:
-    void encoder_task(std::shared_ptr<mtmd_input_chunk> chunk);
-    void process_encoder();
+    bool encoder_task(std::shared_ptr<mtmd_input_chunk> chunk, mtmd_context* ctx_vision);  // true once stored
+    std::function<void(mtmd_context*)> encode_job(std::shared_ptr<mtmd_input_chunk> chunk);
+    void process_encoder(size_t worker);
+    // Workers of different devices (e.g. a CPU one next to a GPU): how long worker leaves a job of n_tokens to one
+    // with an earlier estimated completion, 0 takes it. NOTE: encoder_queue_mutex_ must be held
+    int64_t defer_us(size_t worker, int32_t n_tokens) const;
 
     LlamaMicoContext* context_;
 
     std::atomic<bool> stop_flag_{false};
-    std::thread* encoder_thread_;
+    std::atomic<int32_t> n_running_{0};
+    std::vector<std::thread*> encoder_threads_;  // one per vision context sharing encoder_queue_, none if text only
 
     mutable std::mutex encoder_queue_mutex_;
-    std::queue<std::function<void()>> encoder_queue_;
+    struct EncoderJob {
+        int64_t deadline_ms;
+        uint64_t order;  // submission order among equal deadlines
+        std::shared_ptr<mtmd_input_chunk> chunk;
+        std::function<void(mtmd_context*)> task;
+
+        bool operator<(const EncoderJob& other) const {
+            if (deadline_ms != other.deadline_ms) return deadline_ms > other.deadline_ms;
+            return order > other.order;
+        }
+    };
+    std::priority_queue<EncoderJob> encoder_queue_;
+    std::deque<EncoderJob> ahead_queue_;  // encode ahead, no request waits for them, oldest first
+    struct QueuedChunk {
+        int64_t expire_ms;  // the latest of its requests, 0 never
+        int32_t n_requests;
+        bool ahead;           // in ahead_queue_
+        int64_t deadline_ms;  // the earliest of its requests
+        uint64_t order;       // of its live job, a job moved up leaves a stale copy behind in encoder_queue_
+    };
+    std::unordered_map<HashKey, QueuedChunk, HashKeyHasher> queued_;  // queued chunks by key
+    struct WorkerLoad {
+        double us_per_token{0};   // running average of its encodes, 0 until one is measured
+        int64_t busy_until_us{0};  // estimated end of its current encode, 0 while idle
+    };
+    std::vector<WorkerLoad> workers_;
+    uint64_t n_submitted_{0};
     std::condition_variable encode_condition_;  // for encode thread
-    std::condition_variable encode_finish_condition_;
 
-    std::shared_ptr<ImageEmbeddingCache> encode_cache_{nullptr};
+    std::shared_ptr<ModalEmbeddingCache> encode_cache_{nullptr};
 };
 
 #endif  // ENCODER_SCHEDULING_H
\ No newline at end of file
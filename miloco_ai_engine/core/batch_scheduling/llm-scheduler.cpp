@@ -5,29 +5,73 @@
 
 #include "llm-scheduler.h"
 
+#include <cmath>
+
+#include "utils/mico-log.h"
+
+#define JUMP_FORWARD_MAX 16  // grammar forced tokens appended after a sampled one
+#define POOL_INFER_BATCH 64  // tokens per pooling decode, every token is an output row (embeddings and logits)
+
 LlmScheduler::LlmScheduler(LlamaMicoContext* context) : context_(context) {
     memory_scheduler_ = static_cast<LlamaMemoryScheduler*>(context->memory_scheduler);
+    if (context->sample_threads > 0) row_sampler_ = std::make_unique<RowSampler>(context->sample_threads);
+    sample_thread_ = std::thread(&LlmScheduler::process_samples, this);
 }
 
-LlmScheduler::~LlmScheduler() {}
+LlmScheduler::~LlmScheduler() {
+    {
+        std::lock_guard<std::mutex> lock(sample_mutex_);
+        sample_stop_ = true;
+    }
+    sample_condition_.notify_one();
+    sample_thread_.join();
+}
 
 void LlmScheduler::block_waitting_seq(llama_seq_id seq_id) {
     std::unique_lock<std::mutex> lock(seq_set_mutex_);
-    finish_condition_.wait(lock, [this, seq_id]() { return running_seq_[seq_id] <= 0; });
+    auto& seq = running_seq_[seq_id];
+    seq.finished.wait(lock, [&seq]() { return seq.n_running == 0; });
 }
 
-void LlmScheduler::submit_embedding_infer(std::shared_ptr<mtmd_input_chunk> chunk,
-                                          std::shared_ptr<std::vector<float>>& embeddig, llama_seq_id seq_id) {
-    {
-        std::unique_lock<std::mutex> lock(seq_set_mutex_);
-        running_seq_[seq_id]++;
+void LlmScheduler::acquire_seqs(const std::vector<llama_seq_id>& seq_ids) {
+    std::unique_lock<std::mutex> lock(seq_set_mutex_);
+    for (llama_seq_id seq_id : seq_ids) running_seq_[seq_id].n_running++;
+}
+
+void LlmScheduler::release_seqs(const std::vector<llama_seq_id>& seq_ids) {
+    std::unique_lock<std::mutex> lock(seq_set_mutex_);
+    for (llama_seq_id seq_id : seq_ids) {
+        auto& seq = running_seq_[seq_id];
+        if (seq.n_running > 0 && --seq.n_running == 0) seq.finished.notify_all();
     }
+}
+
+std::vector<llama_seq_id> LlmScheduler::batch_seqs(const llama_batch& batch) {
+    std::vector<llama_seq_id> seq_ids;
+    for (int32_t i = 0; i < batch.n_tokens; i++) {  // NOTE: only one seq_id in each token
+        llama_seq_id seq_id = batch.seq_id[i][0];
+        if (std::find(seq_ids.begin(), seq_ids.end(), seq_id) == seq_ids.end()) seq_ids.push_back(seq_id);
+    }
+    return seq_ids;
+}
+
+void LlmScheduler::submit_embedding_infer(std::shared_ptr<mtmd_input_chunk> chunk,
+                                          std::shared_ptr<std::vector<float>>& embeddig, llama_seq_id seq_id,
+                                          std::function<void()> on_finish) {
+    acquire_seqs({seq_id});
 
-    std::function<void()> task = [this, chunk, embeddig, seq_id]() {
-        llama_pos past = this->context_->get_seq_state(seq_id).n_past.load(), new_past;
+    std::function<void()> task = [this, chunk, embeddig, seq_id, on_finish]() {
+        llama_pos past = this->context_->get_seq_state(seq_id).n_past.load(), new_past = past;
+        TraceScope trace("image_infer", seq_id, (int32_t)mtmd_input_chunk_get_n_tokens(chunk.get()),
+                         modal_chunk_key(chunk.get()).lo);
 
-        int ret = mtmd_helper_decode_image_chunk(context_->ctx_vision.get(), context_->lctx, chunk.get(),
-                                                 embeddig->data(), past, seq_id, context_->n_batch, &new_past);
+        int64_t t1 = ggml_time_us();
+        std::shared_ptr<mtmd_context> ctx_vision = context_->vision();  // NOTE: for its decode flags only
+        int ret = ctx_vision ? mtmd_helper_decode_image_chunk(ctx_vision.get(), context_->lctx, chunk.get(),
+                                                              embeddig->data(), past, seq_id, context_->n_batch,
+                                                              &new_past)
+                             : -1;
+        context_->metrics.record(METRIC_IMAGE_DECODE, ggml_time_us() - t1);
 
         this->context_->get_seq_state(seq_id).n_past.store(new_past);
         if (ret != 0) {
@@ -36,52 +80,378 @@ void LlmScheduler::submit_embedding_infer(std::shared_ptr<mtmd_input_chunk> chun
         } else
             this->context_->get_seq_state(seq_id).last_token.store(0);  // TODO: get last token
 
-        std::unique_lock<std::mutex> lock(this->seq_set_mutex_);
-        if (this->running_seq_[seq_id] > 0) --this->running_seq_[seq_id];
+        if (on_finish) on_finish();
+        release_seqs({seq_id});
+    };
+
+    memory_scheduler_->submit_function_use_mem(task, {seq_id});
+}
+
+void LlmScheduler::submit_image_kv_infer(std::shared_ptr<mtmd_input_chunk> chunk, ImageKvCache* cache,
+                                         llama_seq_id seq_id, std::function<void()> on_finish) {
+    acquire_seqs({seq_id});
+
+    std::function<void()> task = [this, chunk, cache, seq_id, on_finish]() {
+        auto& state = this->context_->get_seq_state(seq_id);
+        llama_pos past = state.n_past.load();
+        TraceScope trace("image_kv", seq_id, (int32_t)mtmd_input_chunk_get_n_tokens(chunk.get()),
+                         modal_chunk_key(chunk.get()).lo);
+        if (cache->insert(chunk.get(), seq_id, past)) {
+            state.n_past.store(past + mtmd_input_chunk_get_n_pos(chunk.get()));
+            state.last_token.store(0);
+        } else {
+            LOG_ERR("image kv infer: no kv span of the chunk\n");
+            state.last_token.store(-1);
+        }
 
-        this->finish_condition_.notify_all();
+        if (on_finish) on_finish();
+        release_seqs({seq_id});
     };
 
-    memory_scheduler_->submit_function_use_mem(task);
+    memory_scheduler_->submit_function_use_mem(task, {seq_id});
 }
 
-void LlmScheduler::submit_token_infer(llama_batch text_batch) {
-    {
-        std::unique_lock<std::mutex> lock(seq_set_mutex_);
-        for (int i = 0; i < text_batch.n_tokens; i++) {
-            running_seq_[text_batch.seq_id[i][0]]++;  // NOTE: only one seq_id in each token
+void LlmScheduler::submit_embedding_batch_infer(const std::vector<std::shared_ptr<mtmd_input_chunk>>& chunks,
+                                                const std::vector<std::shared_ptr<std::vector<float>>>& embeddigs,
+                                                const std::vector<llama_seq_id>& seq_ids,
+                                                std::function<void()> on_finish) {
+    acquire_seqs(seq_ids);
+
+    std::function<void()> task = [this, chunks, embeddigs, seq_ids, on_finish]() {
+        int32_t n_embd = llama_model_n_embd(context_->model);
+        bool mrope = context_->shared_model->vision_mrope;
+        int32_t n_tokens = 0;
+        for (const auto& chunk : chunks) n_tokens += mtmd_input_chunk_get_n_tokens(chunk.get());
+        TraceScope trace("image_batch_infer", -1, n_tokens);
+
+        auto& eb = embd_batch_;  // NOTE: resize keeps the capacity, no allocation once the largest batch was seen
+        eb.embd.resize((size_t)n_tokens * n_embd);
+        eb.pos.resize((size_t)n_tokens * (mrope ? 4 : 1));
+        eb.n_seq_id.assign(n_tokens, 1);
+        eb.seq_id.resize(n_tokens);
+        eb.seq_id_ptrs.assign(n_tokens + 1, nullptr);
+        eb.logits.assign(n_tokens, 0);
+        eb.pasts.resize(chunks.size());
+        auto& embd = eb.embd;
+        auto& pos = eb.pos;
+        auto& seq_id = eb.seq_id;
+        auto& seq_id_ptrs = eb.seq_id_ptrs;
+        auto& pasts = eb.pasts;
+        int32_t offset = 0;
+        for (size_t c = 0; c < chunks.size(); c++) {
+            const mtmd_input_chunk* chunk = chunks[c].get();
+            int32_t n_chunk = mtmd_input_chunk_get_n_tokens(chunk);
+            llama_pos past = context_->get_seq_state(seq_ids[c]).n_past.load();
+            pasts[c] = past;
+            std::copy(embeddigs[c]->begin(), embeddigs[c]->begin() + (size_t)n_chunk * n_embd,
+                      embd.begin() + (size_t)offset * n_embd);
+            const mtmd_image_tokens* image_tokens = mtmd_input_chunk_get_tokens_image(chunk);
+            int32_t nx = image_tokens ? std::max(1, (int32_t)mtmd_image_tokens_get_nx(image_tokens)) : 0;  // 0: audio
+            for (int32_t k = 0; k < n_chunk; k++) {
+                int32_t i = offset + k;
+                seq_id[i] = seq_ids[c];
+                seq_id_ptrs[i] = &seq_id[i];
+                if (!mrope) {
+                    pos[i] = past + k;
+                    continue;
+                }
+                // NOTE: M-RoPE sections, same layout as mtmd_helper_decode_image_chunk, audio runs along all three
+                pos[i] = nx > 0 ? past : past + k;
+                pos[i + n_tokens] = nx > 0 ? past + k / nx : past + k;
+                pos[i + n_tokens * 2] = nx > 0 ? past + k % nx : past + k;
+                pos[i + n_tokens * 3] = 0;
+            }
+            offset += n_chunk;
+        }
+
+        llama_batch batch = {n_tokens, nullptr, embd.data(), pos.data(), eb.n_seq_id.data(), seq_id_ptrs.data(),
+                             eb.logits.data()};
+        bool non_causal = context_->shared_model->vision_non_causal;  // NOTE: the mask of the batch sequences only
+        for (llama_seq_id seq_id : seq_ids) {
+            if (non_causal) llama_set_seq_causal_attn(context_->lctx, seq_id, false);
+        }
+        int64_t t1 = ggml_time_us();
+        int32_t ret = llama_decode(context_->lctx, batch);
+        int64_t decode_us = ggml_time_us() - t1;
+        for (llama_seq_id seq_id : seq_ids) {
+            if (non_causal) llama_set_seq_causal_attn(context_->lctx, seq_id, true);
+        }
+        context_->metrics.record(METRIC_IMAGE_DECODE, decode_us);
+        if (ret != 0) LOG_ERR("image infer: failed to decode %zu image/audio chunks\n", chunks.size());
+        LOG_INF("%zu image/audio chunks decoded in one batch (n_tokens = %d) in %" PRId64 " ms\n", chunks.size(), n_tokens,
+                decode_us / 1000);
+        for (size_t c = 0; c < chunks.size(); c++) {
+            auto& state = context_->get_seq_state(seq_ids[c]);
+            state.n_past.store(pasts[c] + mtmd_input_chunk_get_n_pos(chunks[c].get()));
+            state.last_token.store(ret != 0 ? -1 : 0);
         }
-    }
 
-    std::function<void()> task = [this, text_batch]() {
+        if (on_finish) on_finish();
+        release_seqs(seq_ids);
+    };
+
+    memory_scheduler_->submit_function_use_mem(task, seq_ids);
+}
+
+void LlmScheduler::submit_token_infer(llama_batch text_batch, std::function<void()> on_finish,
+                                      std::vector<DraftRun> drafts) {
+    std::vector<llama_seq_id> seq_ids = batch_seqs(text_batch);
+    acquire_seqs(seq_ids);  // NOTE: once per sequence, not per token
+
+    std::function<void()> task = [this, text_batch, on_finish, seq_ids, drafts]() {
+        TraceScope trace("token_infer", -1, text_batch.n_tokens);
+        bool greedy = true;  // every output row argmax only, logits stay on device
+        for (int32_t i = 0; i < text_batch.n_tokens && greedy; i++) {
+            if (text_batch.logits[i]) greedy = context_->get_seq_state(text_batch.seq_id[i][0]).greedy;
+        }
+        llama_set_output_argmax(context_->lctx, greedy);
+
         int64_t t1 = ggml_time_ms();
-        if (llama_decode(context_->lctx, text_batch)) {
-            LOG_ERR("text infer: failed to decode token\n");
-            for (int32_t i = 0; i < text_batch.n_tokens; i++)
-                context_->get_seq_state(text_batch.seq_id[i][0]).last_token.store(-1);
-        } else {
-            for (int32_t i = 0; i < text_batch.n_tokens; i++) {
-                if (text_batch.logits[i]) {
-                    llama_token token_id = common_sampler_sample(context_->smpl, context_->lctx, i);
-                    common_sampler_accept(context_->smpl, token_id, true);
-
-                    for (int32_t j = 0; j < text_batch.n_seq_id[i]; ++j)
-                        context_->get_seq_state(text_batch.seq_id[i][j]).last_token.store(token_id);
-                } else {
-                    // NOTE: only one seq_id in each token
-                    context_->get_seq_state(text_batch.seq_id[i][0]).last_token.store(0);
+        bool ok = llama_decode(context_->lctx, text_batch) == 0;
+        llama_outputs* outputs = ok ? llama_take_outputs(context_->lctx) : nullptr;  // NOTE: waits for the graph
+        llama_set_output_argmax(context_->lctx, false);
+        LOG_HOT("text decode in %" PRId64 " ms, count %d token\n", ggml_time_ms() - t1, text_batch.n_tokens);
+
+        // NOTE: the sequences of the batch stay acquired until sampled, no batch of theirs is decoded before
+        std::lock_guard<std::mutex> lock(sample_mutex_);
+        sample_queue_.push_back([this, text_batch, ok, outputs, greedy, drafts, on_finish, seq_ids]() {
+            if (ok) {
+                sample_step(text_batch, outputs, greedy, drafts);
+            } else {
+                LOG_ERR("text infer: failed to decode token\n");
+                for (int32_t i = 0; i < text_batch.n_tokens; i++) {
+                    auto& state = context_->get_seq_state(text_batch.seq_id[i][0]);
+                    state.last_token.store(-1);
+                    state.step_tokens.assign(1, -1);
                 }
             }
+            llama_outputs_free(outputs);
+            if (on_finish) on_finish();
+            release_seqs(seq_ids);
+        });
+        sample_condition_.notify_one();
+    };
+
+    memory_scheduler_->submit_function_use_mem(task, seq_ids);  // NOTE: kv ops of other sequences may run first
+}
+
+void LlmScheduler::sample_step(const llama_batch& text_batch, llama_outputs* outputs, bool greedy,
+                               const std::vector<DraftRun>& drafts) {
+    int64_t t_sample = ggml_time_us();
+    int32_t n_vocab = llama_vocab_n_tokens(context_->vocab);
+    // Output rows of plain top_k sequences, draft rows included, get their candidates selected in one pass
+    std::vector<int32_t> fast_slot(text_batch.n_tokens, -1), fast_ks;
+    std::vector<const float*> fast_rows;
+    for (int32_t i = 0; i < text_batch.n_tokens && !greedy && row_sampler_; i++) {
+        if (!text_batch.logits[i]) continue;
+        llama_seq_id seq_id = text_batch.seq_id[i][0];
+        auto& state = context_->get_seq_state(seq_id);
+        if (!state.smpl || state.row_sampling.top_k <= 0) continue;
+        if (state.penalties.active()) {  // NOTE: the counts of a draft row depend on the tokens accepted before
+            if (i > 0 && text_batch.logits[i - 1] && text_batch.seq_id[i - 1][0] == seq_id) continue;
+            state.penalties.apply(llama_outputs_logits_ith(outputs, i));
+        }
+        fast_slot[i] = (int32_t)fast_rows.size();
+        fast_rows.push_back(llama_outputs_logits_ith(outputs, i));
+        fast_ks.push_back(state.row_sampling.top_k);
+    }
+    if (!fast_rows.empty()) row_sampler_->select(fast_rows, n_vocab, fast_ks);
+    size_t next_draft = 0;
+    for (int32_t i = 0; i < text_batch.n_tokens; i++) {
+        if (!text_batch.logits[i]) {  // NOTE: only one seq_id in each token
+            context_->get_seq_state(text_batch.seq_id[i][0]).last_token.store(0);
+            continue;
+        }
+        llama_seq_id seq_id = text_batch.seq_id[i][0];
+        auto& state = context_->get_seq_state(seq_id);
+        common_sampler* smpl = state.smpl ? state.smpl : context_->smpl;
+        auto sample = [&](int32_t row) {
+            llama_token token =
+                greedy ? llama_outputs_argmax_ith(outputs, row)
+                : fast_slot[row] >= 0
+                    ? row_sampler_->sample(fast_slot[row], state.row_sampling, state.rng)
+                    : common_sampler_sample_logits(smpl, llama_outputs_logits_ith(outputs, row), n_vocab);
+            if (token >= 0) common_sampler_accept(smpl, token, true);
+            state.penalties.accept(token);
+            return token;
+        };
+        llama_token token_id = sample(i);
+        if (next_draft < drafts.size() && drafts[next_draft].i_batch == i) {
+            // NOTE: a draft token is kept only if sampling picks it, the output is the same as without
+            const auto& draft = drafts[next_draft++].draft;
+            state.step_tokens.assign(1, token_id);
+            size_t n_accept = 0;
+            while (n_accept < draft.size() && token_id >= 0 && token_id == draft[n_accept]) {
+                token_id = sample(i + 1 + (int32_t)n_accept++);
+                state.step_tokens.push_back(token_id);
+            }
+            if (n_accept < draft.size()) {  // NOTE: queued ahead of the next decode of the sequence
+                llama_pos p0 = text_batch.pos[i] + 1 + (llama_pos)n_accept;
+                memory_scheduler_->submit_clear_mem(seq_id, p0, -1);
+                state.n_past.fetch_sub(draft.size() - n_accept);
+            }
+            i += (int32_t)draft.size();
+
+            // NOTE: a forced token is the only one sampling could pick, no decode is needed to emit it
+            state.forced_tokens.clear();
+            while (token_id >= 0 && state.forced_tokens.size() < JUMP_FORWARD_MAX) {
+                llama_token forced = common_sampler_forced_token(smpl);
+                if (forced == LLAMA_TOKEN_NULL) break;
+                common_sampler_accept(smpl, forced, true);
+                state.penalties.accept(forced);
+                state.forced_tokens.push_back(token_id);
+                state.step_tokens.push_back(forced);
+                token_id = forced;
+            }
         }
-        LOG_DBG("text decode in %" PRId64 " ms, count %d token\n", ggml_time_ms() - t1, text_batch.n_tokens);
-        // Uniformly delete seq_id
-        std::unique_lock<std::mutex> lock(this->seq_set_mutex_);
-        for (int32_t i = 0; i < text_batch.n_tokens; i++) {
-            if (this->running_seq_[text_batch.seq_id[i][0]] > 0) --this->running_seq_[text_batch.seq_id[i][0]];
+        state.last_token.store(token_id);
+    }
+    context_->metrics.record(METRIC_SAMPLING, ggml_time_us() - t_sample);
+}
 
-            this->finish_condition_.notify_all();
+void LlmScheduler::process_samples() {
+    mico_trace::set_thread_name("sampler");
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(sample_mutex_);
+            sample_condition_.wait(lock, [this]() { return sample_stop_ || !sample_queue_.empty(); });
+            if (sample_queue_.empty()) return;  // NOTE: stops once the queued steps are sampled
+            job = std::move(sample_queue_.front());
+            sample_queue_.pop_front();
         }
+        job();
+    }
+}
+
+// Log probability of token in a row of logits
+static float token_logprob(const float* logits, int32_t n_vocab, llama_token token) {
+    float max_logit = *std::max_element(logits, logits + n_vocab);
+    double sum = 0.0;
+    for (int32_t v = 0; v < n_vocab; v++) sum += std::exp((double)(logits[v] - max_logit));
+    return (float)(logits[token] - max_logit - std::log(sum));
+}
+
+void LlmScheduler::submit_score_infer(const std::vector<llama_seq_id>& seq_ids, llama_token last_token,
+                                      const std::vector<llama_tokens>& candidates,
+                                      std::shared_ptr<std::vector<float>> logprobs, std::function<void()> on_finish) {
+    acquire_seqs(seq_ids);
+
+    std::function<void()> task = [this, seq_ids, last_token, candidates, logprobs, on_finish]() {
+        llama_memory_t memory = llama_get_memory(context_->lctx);
+        llama_pos past = context_->get_seq_state(seq_ids[0]).n_past.load();
+        int32_t n_tokens = 0;
+        for (const auto& candidate : candidates) n_tokens += (int32_t)candidate.size();
+        TraceScope trace("score_infer", seq_ids[0], n_tokens);
+
+        llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+        for (size_t c = 0; c < candidates.size(); c++) {
+            if (c > 0) {  // NOTE: the prefix cells are shared, not copied
+                llama_memory_seq_rm(memory, seq_ids[c], -1, -1);
+                llama_memory_seq_cp(memory, seq_ids[0], seq_ids[c], 0, past);
+            }
+            for (size_t k = 0; k < candidates[c].size(); k++) {  // row k predicts token k of the candidate
+                llama_token token = k == 0 ? last_token : candidates[c][k - 1];
+                common_batch_add(batch, token, past + (llama_pos)k, {seq_ids[c]}, true);
+            }
+        }
+        llama_set_output_argmax(context_->lctx, false);
+        int64_t t1 = ggml_time_us();
+        int32_t ret = llama_decode(context_->lctx, batch);
+        if (ret != 0) LOG_ERR("score infer: failed to decode %zu candidates\n", candidates.size());
+
+        int32_t n_vocab = llama_vocab_n_tokens(context_->vocab);
+        int32_t row = 0;
+        for (size_t c = 0; c < candidates.size(); c++) {
+            float logprob = 0.0f;
+            for (llama_token token : candidates[c]) {
+                if (ret == 0) logprob += token_logprob(llama_get_logits_ith(context_->lctx, row), n_vocab, token);
+                row++;
+            }
+            (*logprobs)[c] = ret != 0 ? NAN : logprob;
+            llama_memory_seq_rm(memory, seq_ids[c], c > 0 ? -1 : past, -1);
+        }
+        llama_batch_free(batch);
+        LOG_HOT("score %zu candidates (n_tokens = %d) in %" PRId64 " ms\n", candidates.size(), n_tokens,
+                (ggml_time_us() - t1) / 1000);
+
+        if (on_finish) on_finish();
+        release_seqs(seq_ids);
+    };
+
+    memory_scheduler_->submit_function_use_mem(task, seq_ids);
+}
+
+void LlmScheduler::submit_image_kv_thin(llama_seq_id seq_id, llama_token token, llama_pos pos,
+                                        const std::vector<std::pair<llama_pos, llama_pos>>& images, float keep,
+                                        std::function<void(int32_t)> on_finish) {
+    acquire_seqs({seq_id});
+
+    std::function<void()> task = [this, seq_id, token, pos, images, keep, on_finish]() {
+        TraceScope trace("image_kv_thin", seq_id, (int32_t)images.size());
+        llama_batch batch = llama_batch_init(1, 0, 1);
+        common_batch_add(batch, token, pos, {seq_id}, false);
+        llama_memory_seq_rm(llama_get_memory(context_->lctx), seq_id, pos, -1);
+        llama_set_attn_probe(context_->lctx, seq_id);
+        bool ok = llama_decode(context_->lctx, batch) == 0;
+        llama_set_attn_probe(context_->lctx, -1);
+        llama_batch_free(batch);
+        if (!ok) LOG_ERR("image kv thin: failed to decode the last prompt token of seq %d\n", seq_id);
+
+        int32_t n_dropped = ok ? 0 : -1;
+        for (size_t i = 0; ok && i < images.size(); i++) {
+            int32_t n = llama_attn_probe_evict(context_->lctx, seq_id, images[i].first, images[i].second, keep);
+            n_dropped = n < 0 ? -1 : n_dropped + n;
+            ok = n >= 0;  // NOTE: the same for every image, the kv cache cannot be probed
+        }
+
+        if (on_finish) on_finish(n_dropped);
+        release_seqs({seq_id});
+    };
+
+    memory_scheduler_->submit_function_use_mem(task, {seq_id});
+}
+
+void LlmScheduler::submit_pool_infer(llama_seq_id seq_id, const llama_tokens& tokens,
+                                     std::shared_ptr<std::vector<float>> pooled, std::function<void()> on_finish) {
+    acquire_seqs({seq_id});
+
+    std::function<void()> task = [this, seq_id, tokens, pooled, on_finish]() {
+        int32_t n_embd = llama_model_n_embd(context_->model);
+        TraceScope trace("pool_infer", seq_id, (int32_t)tokens.size());
+        std::vector<double> sum(n_embd, 0.0);
+        llama_batch batch = llama_batch_init(POOL_INFER_BATCH, 0, 1);
+        llama_set_output_argmax(context_->lctx, false);
+        llama_set_embeddings(context_->lctx, true);  // NOTE: every token is an output while it is on
+        bool ok = true;
+        for (size_t i = 0; ok && i < tokens.size(); i += POOL_INFER_BATCH) {
+            common_batch_clear(batch);
+            size_t n = std::min(tokens.size() - i, (size_t)POOL_INFER_BATCH);
+            for (size_t k = 0; k < n; k++) common_batch_add(batch, tokens[i + k], (llama_pos)(i + k), {seq_id}, true);
+            ok = llama_decode(context_->lctx, batch) == 0;
+            for (int32_t row = 0; ok && row < (int32_t)n; row++) {
+                const float* embd = llama_get_embeddings_ith(context_->lctx, row);
+                if (!embd) ok = false;
+                for (int32_t d = 0; ok && d < n_embd; d++) sum[d] += embd[d];
+            }
+        }
+        llama_set_embeddings(context_->lctx, false);
+        llama_batch_free(batch);
+        llama_memory_seq_rm(llama_get_memory(context_->lctx), seq_id, -1, -1);
+
+        pooled->clear();
+        if (ok && !tokens.empty()) {
+            double norm = 0.0;
+            for (double v : sum) norm += v * v;
+            norm = norm > 0.0 ? std::sqrt(norm) : 1.0;
+            for (double v : sum) pooled->push_back((float)(v / norm));  // NOTE: the mean normalises to the same vector
+        } else {
+            LOG_ERR("pool infer: failed to decode %zu tokens\n", tokens.size());
+        }
+
+        if (on_finish) on_finish();
+        release_seqs({seq_id});
     };
 
-    memory_scheduler_->submit_function_use_mem(task);
-}
\ No newline at end of file
+    memory_scheduler_->submit_function_use_mem(task, {seq_id});
+}
@@ -5,29 +5,106 @@
 #ifndef LLM_SCHEDULING_H
 #define LLM_SCHEDULING_H
 
+#include <deque>
+#include <thread>
 #include <unordered_map>
 
+#include "cache_manager/image-kv-cache.h"
 #include "scheduler_task_info.h"
 #include "utils/llama-memory-scheduling.h"
 #include "utils/mico-common.h"
 
+// Decoding sequence in a decode batch: row i_batch holds its last token, the draft (may be empty) the rows right after
+struct DraftRun {
+    int32_t i_batch;
+    std::vector<llama_token> draft;
+};
+
 class LlmScheduler {
   public:
     explicit LlmScheduler(LlamaMicoContext* context);
     ~LlmScheduler();
 
+    // on_finish of the embedding decodes runs on the memory thread once last_token and n_past are updated
     void submit_embedding_infer(std::shared_ptr<mtmd_input_chunk> chunk, std::shared_ptr<std::vector<float>>& embeddig,
-                                llama_seq_id seq_id);
-    void submit_token_infer(llama_batch text_batch);
+                                llama_seq_id seq_id, std::function<void()> on_finish = nullptr);
+    // Image chunks of different sequences in one llama_decode, at most one chunk per sequence and n_batch tokens
+    // (n_ubatch for a non-causal projector, each sequence gets a non-causal mask of its own)
+    void submit_embedding_batch_infer(const std::vector<std::shared_ptr<mtmd_input_chunk>>& chunks,
+                                      const std::vector<std::shared_ptr<std::vector<float>>>& embeddigs,
+                                      const std::vector<llama_seq_id>& seq_ids,
+                                      std::function<void()> on_finish = nullptr);
+    // Image or audio chunk from its kv span pinned in cache instead of its embeddings, see ImageKvCache
+    void submit_image_kv_infer(std::shared_ptr<mtmd_input_chunk> chunk, ImageKvCache* cache, llama_seq_id seq_id,
+                               std::function<void()> on_finish = nullptr);
+    // on_finish runs on the sample thread after sampling, before waiters of the batch seqs are released: the logits
+    // are taken out of the context so the memory thread decodes the next batch while this one is sampled
+    // drafts (sorted by row) are verified: sampling walks a draft while it matches, the tokens produced go to
+    // LlamaSeqState::step_tokens and the kv of the rejected rest is removed. Tokens the grammar forces after them
+    // are appended too (jump-forward), they wait in LlamaSeqState::forced_tokens for the kv
+    void submit_token_infer(llama_batch text_batch, std::function<void()> on_finish = nullptr,
+                            std::vector<DraftRun> drafts = {});
+
+    // Candidate continuations of a prefilled sequence in one decode: seq_ids[0] is the prefilled sequence, the others
+    // are forks whose kv is dropped first. Candidate i runs in seq_ids[i] from n_past of the prefilled sequence, the
+    // fork shares the prefix cells by a seq_cp, and every sequence is cut back to the prefix afterwards
+    // logprobs[i] is the sum of the log probabilities of the tokens of candidate i after last_token, NaN if the decode
+    // failed, on_finish runs on the memory thread once they are set
+    void submit_score_infer(const std::vector<llama_seq_id>& seq_ids, llama_token last_token,
+                            const std::vector<llama_tokens>& candidates, std::shared_ptr<std::vector<float>> logprobs,
+                            std::function<void()> on_finish = nullptr);
+
+    // Mean of the final hidden states of tokens prefilled in the empty seq_id, L2 normalised into pooled (empty if a
+    // decode failed). Decodes a few tokens at a time with embeddings on, the kv is removed afterwards
+    void submit_pool_infer(llama_seq_id seq_id, const llama_tokens& tokens, std::shared_ptr<std::vector<float>> pooled,
+                           std::function<void()> on_finish = nullptr);
+
+    // Thins the kv of the images of a prefilled sequence: its last prompt token (at pos) is decoded again with the
+    // attention probe on, then each image span [p0, p1) keeps the keep fraction of its cells it attends most.
+    // on_finish gets the cells dropped, -1 if the kv cache cannot be probed
+    void submit_image_kv_thin(llama_seq_id seq_id, llama_token token, llama_pos pos,
+                              const std::vector<std::pair<llama_pos, llama_pos>>& images, float keep,
+                              std::function<void(int32_t)> on_finish);
 
     void block_waitting_seq(llama_seq_id seq_id);
 
   private:
+    // Waitable slot of a sequence, only its own waiters wake when its last decode finishes
+    struct RunningSeq {
+        size_t n_running{0};  // submitted decodes not finished yet
+        std::condition_variable finished;
+    };
+    void acquire_seqs(const std::vector<llama_seq_id>& seq_ids);
+    void release_seqs(const std::vector<llama_seq_id>& seq_ids);  // NOTE: each finished sequence is notified once
+    static std::vector<llama_seq_id> batch_seqs(const llama_batch& batch);  // distinct, in batch order
+    // Output rows of a decoded step: the tokens of its sequences, the kv of rejected drafts is dropped
+    void sample_step(const llama_batch& text_batch, llama_outputs* outputs, bool greedy,
+                     const std::vector<DraftRun>& drafts);
+    void process_samples();
+
     LlamaMicoContext* context_;
     LlamaMemoryScheduler* memory_scheduler_{nullptr};
+    std::unique_ptr<RowSampler> row_sampler_;  // nullptr with sample_threads 0, NOTE: only used on the sample thread
+
+    // Sampling of decoded steps in decode order, off the memory thread
+    std::thread sample_thread_;
+    std::mutex sample_mutex_;
+    std::condition_variable sample_condition_;
+    std::deque<std::function<void()>> sample_queue_;
+    bool sample_stop_{false};
+
+    // Image batch arrays reused across decodes, grown to the largest batch, NOTE: only used on the memory thread
+    struct EmbdBatch {
+        std::vector<float> embd;
+        std::vector<llama_pos> pos;
+        std::vector<int32_t> n_seq_id;
+        std::vector<llama_seq_id> seq_id;
+        std::vector<llama_seq_id*> seq_id_ptrs;
+        std::vector<int8_t> logits;
+        std::vector<llama_pos> pasts;
+    } embd_batch_;
 
     mutable std::mutex seq_set_mutex_;
-    std::condition_variable finish_condition_;
-    std::unordered_map<size_t, size_t> running_seq_;
+    std::unordered_map<size_t, RunningSeq> running_seq_;  // NOTE: nodes are never erased, waiters keep references
 };
 #endif  // LLM_SCHEDULING_H
\ No newline at end of file
@@ -0,0 +1,120 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "prefill-scheduler.h"
+
+#include <future>
+
+PrefillScheduler::PrefillScheduler(LlamaMicoContext* context, EncoderSheduler* encoder)
+    : context_(context), encoder_(encoder) {
+    memory_scheduler_ = std::make_unique<LlamaMemoryScheduler>(context->prefill_ctx);  // NOTE: emptied per prompt
+}
+
+PrefillScheduler::~PrefillScheduler() {}
+
+// Runs func on the memory thread of ms and waits for its result
+template <typename T>
+static T run_on(LlamaMemoryScheduler* ms, llama_seq_id seq_id, std::function<T()> func) {
+    auto promise = std::make_shared<std::promise<T>>();
+    auto result = promise->get_future();
+    ms->submit_function_use_mem([promise, func]() { promise->set_value(func()); }, {seq_id});
+    return result.get();
+}
+
+size_t PrefillScheduler::prefill(int32_t seq_id, const std::vector<std::shared_ptr<SycChunkTask>>& chunks,
+                                 size_t n_items, llama_pos n_pos) {
+    struct Part {
+        std::shared_ptr<SycChunkTask> chunk;
+        size_t i0, i1;  // items of the chunk prefilled here
+        std::shared_ptr<std::vector<float>> embd;
+    };
+    std::vector<Part> parts;
+    size_t n_total = 0;
+    for (const auto& chunk : chunks) {
+        size_t n = chunk_n_items(chunk->input_chunk.get());
+        size_t i0 = n_items > n_total ? std::min(n_items - n_total, n) : 0;
+        if (i0 < n) parts.push_back({chunk, i0, n, nullptr});
+        n_total += n;
+    }
+    if (parts.empty() || mtmd_input_chunk_get_type(parts.back().chunk->input_chunk.get()) != MTMD_INPUT_CHUNK_TYPE_TEXT)
+        return n_items;
+    if (--parts.back().i1 == parts.back().i0) parts.pop_back();  // NOTE: the last token is decoded by the main context
+    if (parts.empty()) return n_items;
+
+    for (auto& part : parts) {  // All embeddings first, the encoder works through them in one go
+        if (mtmd_input_chunk_get_type(part.chunk->input_chunk.get()) == MTMD_INPUT_CHUNK_TYPE_TEXT) continue;
+        encoder_->submit_encoder_task(part.chunk->input_chunk, part.chunk->deadline_ms, part.chunk->expire_ms);
+    }
+    for (auto& part : parts) {
+        if (mtmd_input_chunk_get_type(part.chunk->input_chunk.get()) == MTMD_INPUT_CHUNK_TYPE_TEXT) continue;
+        part.embd = encoder_->wait_for_result(part.chunk->input_chunk);
+        if (!part.embd) return n_items;  // NOTE: the main chain encodes it again and fails the request there
+    }
+    if (context_->get_seq_state(seq_id).cancelled) return n_items;
+
+    int64_t t_start = ggml_time_us();
+    LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(context_->memory_scheduler);
+    auto kv = std::make_shared<std::vector<uint8_t>>();
+    if (n_pos > 0) {  // The kept prefix goes along, the prompt attends it
+        run_on<bool>(ms, seq_id, [this, kv, seq_id]() {
+            kv->resize(llama_state_seq_get_size(context_->lctx, seq_id));
+            kv->resize(llama_state_seq_get_data(context_->lctx, kv->data(), kv->size(), seq_id));
+            return true;
+        });
+        if (kv->empty()) return n_items;
+    }
+
+    llama_pos n_past = n_pos;
+    bool ok = run_on<bool>(memory_scheduler_.get(), seq_id, [this, kv, seq_id, &parts, &n_past]() {
+        llama_context* ctx = context_->prefill_ctx;
+        llama_memory_seq_rm(llama_get_memory(ctx), seq_id, -1, -1);
+        bool ok = kv->empty() || llama_state_seq_set_data(ctx, kv->data(), kv->size(), seq_id) != 0;
+        llama_batch batch = llama_batch_init(context_->n_batch, 0, 1);
+        for (size_t p = 0; ok && p < parts.size(); p++) {
+            const auto* chunk = parts[p].chunk->input_chunk.get();
+            TraceScope trace("prefill_offload", seq_id, (int32_t)(parts[p].i1 - parts[p].i0));
+            if (mtmd_input_chunk_get_type(chunk) != MTMD_INPUT_CHUNK_TYPE_TEXT) {
+                std::shared_ptr<mtmd_context> ctx_vision = context_->vision();  // NOTE: for its decode flags only
+                llama_pos new_past = n_past;
+                ok = ctx_vision && mtmd_helper_decode_image_chunk(ctx_vision.get(), ctx, chunk, parts[p].embd->data(),
+                                                                  n_past, seq_id, context_->n_batch, &new_past) == 0;
+                n_past = new_past;
+                continue;
+            }
+            size_t n_tokens;
+            const llama_token* tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);
+            for (size_t i = parts[p].i0; ok && i < parts[p].i1;) {
+                common_batch_clear(batch);
+                for (; i < parts[p].i1 && batch.n_tokens < context_->n_batch; i++)
+                    common_batch_add(batch, tokens[i], n_past++, {seq_id}, false);
+                ok = llama_decode(ctx, batch) == 0;
+            }
+        }
+        llama_batch_free(batch);
+        kv->clear();
+        if (ok) {
+            kv->resize(llama_state_seq_get_size(ctx, seq_id));
+            kv->resize(llama_state_seq_get_data(ctx, kv->data(), kv->size(), seq_id));
+        }
+        llama_memory_seq_rm(llama_get_memory(ctx), seq_id, -1, -1);
+        return ok && !kv->empty();
+    });
+    if (!ok) {
+        LOG_ERR("%s: seq %d failed on the prefill context, it prefills on the main one\n", __func__, seq_id);
+        return n_items;
+    }
+
+    // NOTE: the kv read replaces the kept prefix, a failed read leaves the sequence empty
+    bool restored = run_on<bool>(ms, seq_id, [this, kv, seq_id]() {
+        return llama_state_seq_set_data(context_->lctx, kv->data(), kv->size(), seq_id) != 0;
+    });
+    if (!restored) {
+        LOG_ERR("%s: seq %d failed to take the kv of the prefill context\n", __func__, seq_id);
+        return 0;
+    }
+    LOG_DBG("%s: seq %d prefilled %d positions, %zu KB kv handed over in %.1f ms\n", __func__, seq_id, n_past - n_pos,
+            kv->size() >> 10, (ggml_time_us() - t_start) / 1000.0);
+    return n_total - 1;
+}
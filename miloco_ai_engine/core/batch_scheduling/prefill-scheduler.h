@@ -0,0 +1,40 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef PREFILL_SCHEDULING_H
+#define PREFILL_SCHEDULING_H
+
+#include <memory>
+
+#include "encoder-scheduler.h"
+#include "scheduler_task_info.h"
+#include "utils/llama-memory-scheduling.h"
+#include "utils/mico-common.h"
+
+// Disaggregated prefill: long prompts are prefilled by the model copy on prefill_devices, on its own context and
+// memory thread, so they never share a graph or the memory thread with the decode steps of the main context. The kv
+// of the sequence moves between the contexts as llama_state_seq data through host memory
+class PrefillScheduler {
+  public:
+    PrefillScheduler(LlamaMicoContext* context, EncoderSheduler* encoder);
+    ~PrefillScheduler();
+
+    // Uncached prompt positions from which a prompt is worth the kv transfers
+    llama_pos n_offload_min() const { return context_->prefill_offload_tokens; }
+
+    // Prefills the items of the prompt chunks past the first n_items, whose n_pos positions are in the main kv of
+    // seq_id, on the prefill context and hands the kv back. The last item is left to the main context for its logits,
+    // so the prompt must end with text. Returns the items in the main kv afterwards: n_items if the prompt stays on
+    // the main context, 0 if the kv was lost in the hand-off
+    // NOTE: blocks until the kv is back, the prefill context serves one prompt at a time
+    size_t prefill(int32_t seq_id, const std::vector<std::shared_ptr<SycChunkTask>>& chunks, size_t n_items,
+                   llama_pos n_pos);
+
+  private:
+    LlamaMicoContext* context_;
+    EncoderSheduler* encoder_;
+    std::unique_ptr<LlamaMemoryScheduler> memory_scheduler_;  // serialises the work of prefill_ctx
+};
+
+#endif  // PREFILL_SCHEDULING_H
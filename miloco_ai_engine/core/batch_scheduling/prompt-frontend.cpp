@@ -0,0 +1,85 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "prompt-frontend.h"
+
+#include <memory>
+
+#include "common/log.h"
+#include "utils/mico-trace.h"
+
+PromptFrontend::PromptFrontend(size_t n_workers, std::function<void()> thread_init) {
+    for (size_t i = 0; i < std::max(n_workers, (size_t)1); i++) {
+        workers_.emplace_back(&PromptFrontend::process_tasks, this, thread_init);
+    }
+}
+
+PromptFrontend::~PromptFrontend() {
+    {
+        std::lock_guard<std::mutex> lock(task_mutex_);
+        stop_flag_.store(true);
+    }
+    task_condition_.notify_all();
+    for (auto& worker : workers_) worker.join();
+}
+
+void PromptFrontend::submit(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(task_mutex_);
+    task_queue_.push(std::move(task));
+    task_condition_.notify_one();
+}
+
+void PromptFrontend::run_all(std::vector<std::function<void()>> tasks) {
+    struct Shared {
+        std::vector<std::function<void()>> tasks;
+        std::atomic<size_t> next{0};
+        size_t n_done{0};
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+    auto shared = std::make_shared<Shared>();
+    shared->tasks = std::move(tasks);
+    size_t n_tasks = shared->tasks.size();
+
+    // NOTE: a helper picked up after every task was claimed finds nothing left, the caller never waits for it
+    auto work = [shared, n_tasks]() {
+        for (size_t i = shared->next.fetch_add(1); i < n_tasks; i = shared->next.fetch_add(1)) {
+            try {
+                shared->tasks[i]();
+            } catch (const std::exception& e) {
+                LOG_ERR("failed to prepare prompt: %s\n", e.what());
+            }
+            std::lock_guard<std::mutex> lock(shared->mutex);
+            if (++shared->n_done == n_tasks) shared->done.notify_all();
+        }
+    };
+    for (size_t i = 1; i < std::min(n_tasks, workers_.size() + 1); i++) submit(work);
+    work();
+
+    std::unique_lock<std::mutex> lock(shared->mutex);
+    shared->done.wait(lock, [&shared, n_tasks]() { return shared->n_done == n_tasks; });
+}
+
+void PromptFrontend::process_tasks(std::function<void()> thread_init) {
+    mico_trace::set_thread_name("prompt_frontend");
+    if (thread_init) thread_init();
+    while (true) {
+        std::function<void()> task = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(task_mutex_);
+            task_condition_.wait(lock, [this] { return !task_queue_.empty() || stop_flag_.load(); });
+            if (stop_flag_.load()) break;
+
+            task = std::move(task_queue_.front());
+            task_queue_.pop();
+        }
+
+        try {
+            task();
+        } catch (const std::exception& e) {
+            LOG_ERR("failed to run prompt task: %s\n", e.what());
+        }
+    }
+}
@@ -0,0 +1,39 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef PROMPT_FRONTEND_H
+#define PROMPT_FRONTEND_H
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Request front-end: chat templating, image decoding, tokenizing and cropping of prompts run on a worker pool of
+// their own, so the next requests are prepared while BatchScheduler prefills and decodes the current ones
+class PromptFrontend {
+  public:
+    // thread_init runs first on every worker, e.g. to pin it
+    explicit PromptFrontend(size_t n_workers, std::function<void()> thread_init = nullptr);
+    ~PromptFrontend();
+
+    void submit(std::function<void()> task);
+    // Runs the tasks on the pool and the calling thread, returns once all of them finished
+    void run_all(std::vector<std::function<void()>> tasks);
+
+  private:
+    void process_tasks(std::function<void()> thread_init);
+
+    std::atomic<bool> stop_flag_{false};
+    std::vector<std::thread> workers_;
+
+    std::mutex task_mutex_;
+    std::queue<std::function<void()>> task_queue_;
+    std::condition_variable task_condition_;
+};
+
+#endif  // PROMPT_FRONTEND_H
@@ -8,6 +8,7 @@
 #include <atomic>
 
 #include "utils/chunk-hash.h"
+#include "utils/request-arena.h"
 
 enum class TaskStatus {
     PENDING = 0,      // Not yet allocated
@@ -17,38 +18,77 @@ enum class TaskStatus {
     FAILED = 4,       // Inference failed
 };
 
+// Latency class of a request from its priority, see LlamaMicoContext::slo_class_priorities
+enum class TaskClass {
+    INTERACTIVE = 0,   // queries a user waits on
+    RULE_TRIGGER = 1,  // rule conditions of camera events
+    BACKGROUND = 2,    // bulk sweeps
+};
+#define TASK_CLASS_COUNT 3
+
 struct SycChunkTask {
     std::shared_ptr<mtmd_input_chunk> input_chunk;
     std::shared_ptr<std::vector<float>> embeddig;
-    std::string chunk_hash{""};
     size_t cmpl_id{0};
     int32_t priority;
     bool is_last_chunk = false;
+    size_t n_prefilled{0};  // text tokens already submitted, a chunk may span several steps
+    int64_t deadline_ms{0};  // request enqueue time + latency target of its class
+    int64_t expire_ms{0};    // deadline of the request itself, the chain is dropped past it, 0 never
+    int64_t queued_us{0};    // submitted to the batch scheduler, 0 once it started
+    // Chain of a prompt: the chunk is submitted once n_deps reaches 0, the decode of the chunk before it (chained) and
+    // its embeddings (images and audio) count one each. The memory thread submits next when this one is decoded
+    std::shared_ptr<SycChunkTask> next;
+    std::atomic<int32_t> n_deps{0};
+    bool chained{false};  // submitted by the chunk before it, scheduled without a batching wait
+    bool kv_reuse{false};  // image or audio decoded from its span pinned in the image kv cache, no embeddings
 
     std::atomic<TaskStatus> status = TaskStatus::PENDING;
 
-    SycChunkTask(std::shared_ptr<mtmd_input_chunk> chunk, size_t cmpl_id, std::string chunk_hash, int32_t priority)
-        : input_chunk(chunk), cmpl_id(cmpl_id), chunk_hash(chunk_hash), priority(priority) {}
+    SycChunkTask(std::shared_ptr<mtmd_input_chunk> chunk, size_t cmpl_id, int32_t priority)
+        : input_chunk(chunk), cmpl_id(cmpl_id), priority(priority) {}
 
-    // sort
+    // sort, earliest deadline is served first: a waiting task ages until it passes newer tasks of a tighter class
     bool operator<(const SycChunkTask& other) const {
+        if (deadline_ms != other.deadline_ms) return deadline_ms > other.deadline_ms;
         if (priority != other.priority) return priority < other.priority;
         return cmpl_id < other.cmpl_id;
     }
     bool operator==(const SycChunkTask& other) const { return cmpl_id == other.cmpl_id && priority == other.priority; }
+    bool expired(int64_t now_ms) const { return expire_ms > 0 && now_ms >= expire_ms; }
+};
+
+// Orders shared tasks by SycChunkTask::operator<, a queue of shared_ptr would compare the pointers
+struct SycChunkTaskLess {
+    bool operator()(const std::shared_ptr<SycChunkTask>& a, const std::shared_ptr<SycChunkTask>& b) const {
+        return *a < *b;
+    }
 };
 
 struct BatchSchedulerInput {
     std::vector<std::shared_ptr<SycChunkTask>> input_chunks;
 
-    BatchSchedulerInput(std::shared_ptr<mtmd::input_chunks> chunks, size_t cmpl_id, int32_t prio = 0) {
+    // arena: the request's one, the tasks and their handles are allocated there instead of malloc when given
+    BatchSchedulerInput(std::shared_ptr<mtmd::input_chunks> chunks, size_t cmpl_id, int32_t prio = 0,
+                        int64_t deadline_ms = 0, int64_t expire_ms = 0,
+                        const std::shared_ptr<RequestArena>& arena = nullptr) {
         if (!chunks) return;
-        auto hashs = chunk_hashs(chunks.get());
+        input_chunks.reserve(chunks->size());
         for (size_t i = 0; i < chunks->size(); ++i) {
             const mtmd_input_chunk* chunk_ptr = (*chunks)[i];
-            // Copy and share to prevent release during inference in other threads
-            auto chunk = std::shared_ptr<mtmd_input_chunk>(mtmd_input_chunk_copy(chunk_ptr), mtmd_input_chunk_free);
-            input_chunks.emplace_back(std::make_shared<SycChunkTask>(chunk, cmpl_id, hashs[i], prio));
+            // Own a copy to prevent release during inference in other threads, it shares the modal tokens refcounted
+            if (arena) {
+                auto chunk = std::shared_ptr<mtmd_input_chunk>(mtmd_input_chunk_copy(chunk_ptr), mtmd_input_chunk_free,
+                                                               ArenaAllocator<mtmd_input_chunk>(arena));
+                input_chunks.emplace_back(
+                    std::allocate_shared<SycChunkTask>(ArenaAllocator<SycChunkTask>(arena), chunk, cmpl_id, prio));
+            } else {
+                auto chunk =
+                    std::shared_ptr<mtmd_input_chunk>(mtmd_input_chunk_copy(chunk_ptr), mtmd_input_chunk_free);
+                input_chunks.emplace_back(std::make_shared<SycChunkTask>(chunk, cmpl_id, prio));
+            }
+            input_chunks.back()->deadline_ms = deadline_ms;
+            input_chunks.back()->expire_ms = expire_ms;
             if (i == chunks->size() - 1) input_chunks.back()->is_last_chunk = true;
         }
     }
@@ -0,0 +1,180 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "chat-template-cache.h"
+
+#include <chrono>
+
+ChatTemplateCache::ChatTemplateCache(LlamaMicoContext* context, size_t max_entries)
+    : context_(context), max_entries_(std::max<size_t>(max_entries, 1)) {}
+
+// NOTE: only a leading system message without images is cached, it holds the tools block in the usual templates
+static bool cacheable(const common_chat_templates_inputs& inputs) {
+    if (inputs.messages.size() < 2 || inputs.messages[0].role != "system") return false;
+    for (const auto& part : inputs.messages[0].content_parts) {
+        if (!part.images.empty()) return false;
+    }
+    return true;
+}
+
+static common_chat_templates_inputs stub_inputs(const common_chat_templates_inputs& inputs) {
+    common_chat_templates_inputs stub = inputs;
+    stub.messages[0] = common_chat_msg();
+    stub.messages[0].role = "system";
+    stub.tools.clear();
+    stub.grammar.clear();
+    stub.json_schema.clear();
+    return stub;
+}
+
+HashKey ChatTemplateCache::entry_key(const common_chat_templates_inputs& inputs, const HashKey& tools_key) {
+    const auto& system = inputs.messages[0];
+    std::string key = system.content;
+    for (const auto& part : system.content_parts) key += '\0' + part.type + '\0' + part.text;
+    if (!tools_key.empty()) {
+        key += '\1';
+        key.append(reinterpret_cast<const char*>(&tools_key), sizeof(tools_key));
+    } else {
+        for (const auto& tool : inputs.tools)
+            key += '\1' + tool.name + '\0' + tool.description + '\0' + tool.parameters;
+    }
+    key += '\2' + inputs.grammar + '\0' + inputs.json_schema;
+    // NOTE: templates may print the date, an entry lasts one day at most
+    auto days = std::chrono::duration_cast<std::chrono::hours>(inputs.now.time_since_epoch()).count() / 24;
+    int64_t options[] = {(int64_t)inputs.tool_choice, inputs.parallel_tool_calls, (int64_t)inputs.reasoning_format,
+                         inputs.enable_thinking, inputs.add_generation_prompt, inputs.use_jinja, days};
+    key.append(reinterpret_cast<const char*>(options), sizeof(options));
+    return hash_bytes(key.data(), key.size());
+}
+
+std::string ChatTemplateCache::render_tail(const common_chat_templates_inputs& inputs, const std::string& stub_prefix,
+                                           bool& ok) const {
+    std::string prompt = common_chat_templates_apply(context_->tmpls.get(), stub_inputs(inputs)).prompt;
+    ok = prompt.compare(0, stub_prefix.size(), stub_prefix) == 0;
+    return ok ? prompt.substr(stub_prefix.size()) : "";
+}
+
+std::shared_ptr<const ChatTemplateCache::Entry> ChatTemplateCache::create_entry(
+    const common_chat_templates_inputs& inputs, const common_chat_params& full) {
+    auto entry = std::make_shared<Entry>();
+    entry->params = full;
+    entry->params.prompt.clear();
+
+    common_chat_templates_inputs head = inputs;
+    head.messages.resize(1);
+    head.add_generation_prompt = false;
+    try {
+        entry->prefix = common_chat_templates_apply(context_->tmpls.get(), head).prompt;
+        entry->stub_prefix = common_chat_templates_apply(context_->tmpls.get(), stub_inputs(head)).prompt;
+    } catch (const std::exception& e) {
+        LOG_WRN("%s: system message not rendered alone, err: %s\n", __func__, e.what());
+        entry->prefix.clear();
+        return entry;
+    }
+    if (full.prompt.compare(0, entry->prefix.size(), entry->prefix) != 0) {
+        entry->prefix.clear();
+        return entry;
+    }
+
+    bool ok = false;
+    std::string tail = render_tail(inputs, entry->stub_prefix, ok);
+    entry->splittable = ok && full.prompt.size() == entry->prefix.size() + tail.size() &&
+                        full.prompt.compare(entry->prefix.size(), std::string::npos, tail) == 0;
+
+    // NOTE: the prefix tokens count only if tokenizing the whole prompt yields them too
+    if (entry->prefix.find(context_->media_marker) == std::string::npos) {
+        auto tokens = common_tokenize(context_->vocab, entry->prefix, true /* add_special */, true /* parse_special */);
+        std::string text = full.prompt.substr(0, full.prompt.find(context_->media_marker));
+        auto full_tokens = common_tokenize(context_->vocab, text, true /* add_special */, true /* parse_special */);
+        if (tokens.size() < full_tokens.size() && std::equal(tokens.begin(), tokens.end(), full_tokens.begin()))
+            entry->prefix_tokens = std::make_shared<const std::vector<llama_token>>(std::move(tokens));
+    }
+    LOG_INF("chat template cache: system prefix of %zu chars, %s, %s\n", entry->prefix.size(),
+            entry->splittable ? "tail rendered alone" : "full render",
+            entry->prefix_tokens ? "tokens kept" : "no tokens");
+    return entry;
+}
+
+common_chat_params ChatTemplateCache::apply(const common_chat_templates_inputs& inputs, ChatPrefix& prefix,
+                                            const HashKey& tools_key) {
+    prefix = ChatPrefix();
+    if (!cacheable(inputs)) return common_chat_templates_apply(context_->tmpls.get(), inputs);
+
+    HashKey key = entry_key(inputs, tools_key);
+    std::shared_ptr<const Entry> entry;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = entries_.find(key);
+        if (it != entries_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second.second);
+            entry = it->second.first;
+        }
+    }
+
+    if (entry && entry->splittable) {
+        bool ok = false;
+        std::string tail = render_tail(inputs, entry->stub_prefix, ok);
+        if (ok) {
+            common_chat_params params = entry->params;
+            params.prompt = entry->prefix + tail;
+            if (entry->prefix_tokens) prefix = {entry->prefix.size(), entry->prefix_tokens};
+            return params;
+        }
+    }
+
+    common_chat_params full = common_chat_templates_apply(context_->tmpls.get(), inputs);
+    if (!entry) {
+        entry = create_entry(inputs, full);
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (entries_.count(key) == 0) {  // NOTE: another request may have added it meanwhile
+            lru_.push_front(key);
+            entries_[key] = {entry, lru_.begin()};
+            if (entries_.size() > max_entries_) {
+                entries_.erase(lru_.back());
+                lru_.pop_back();
+            }
+        }
+    }
+    if (entry->prefix_tokens && full.prompt.compare(0, entry->prefix.size(), entry->prefix) == 0)
+        prefix = {entry->prefix.size(), entry->prefix_tokens};
+    return full;
+}
+
+std::shared_ptr<const ChatTools> ChatTools::parse(std::string_view text) {
+    auto parsed = std::make_shared<ChatTools>();
+    parsed->key = hash_bytes(text.data(), text.size());
+    parsed->text = std::string(text);
+    try {
+        parsed->tools = common_chat_tools_parse_oaicompat(parsed->text);
+    } catch (const std::exception& e) {
+        LOG_ERR("ERR: invalid tools json: %s\n", e.what());
+        return nullptr;
+    }
+    return parsed;
+}
+
+std::shared_ptr<const ChatTools> ChatTemplateCache::tools(std::string_view text) {
+    HashKey key = hash_bytes(text.data(), text.size());
+    {
+        std::lock_guard<std::mutex> lock(tools_mutex_);
+        auto it = tools_.find(key);
+        if (it != tools_.end() && it->second.first->text == text) {
+            tools_lru_.splice(tools_lru_.begin(), tools_lru_, it->second.second);
+            return it->second.first;
+        }
+    }
+    auto parsed = ChatTools::parse(text);  // NOTE: outside the lock, a concurrent miss parses it too
+    if (!parsed) return nullptr;
+    std::lock_guard<std::mutex> lock(tools_mutex_);
+    if (tools_.count(key) == 0) {
+        tools_lru_.push_front(key);
+        tools_[key] = {parsed, tools_lru_.begin()};
+        if (tools_.size() > CHAT_TOOLS_CACHE_ENTRIES) {
+            tools_.erase(tools_lru_.back());
+            tools_lru_.pop_back();
+        }
+    }
+    return parsed;
+}
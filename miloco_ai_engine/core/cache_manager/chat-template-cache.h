@@ -0,0 +1,81 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef CHAT_TEMPLATE_CACHE_H
+#define CHAT_TEMPLATE_CACHE_H
+
+#include <list>
+#include <string_view>
+#include <unordered_map>
+
+#include "common/chat.h"
+#include "utils/chunk-hash.h"
+#include "utils/mico-common.h"
+
+#define CHAT_TEMPLATE_CACHE_ENTRIES 32  // (tools, system message) pairs kept rendered and tokenized
+#define CHAT_TOOLS_CACHE_ENTRIES 32     // distinct tools arrays kept parsed
+
+// OpenAI tools array of a request as sent, parsed once per distinct text and keyed by its hash
+struct ChatTools {
+    HashKey key;
+    std::string text;
+    std::vector<common_chat_tool> tools;
+
+    static std::shared_ptr<const ChatTools> parse(std::string_view text);  // nullptr if invalid
+};
+
+// Leading part of a rendered prompt whose tokens are known, the rest is tokenized per request
+struct ChatPrefix {
+    size_t n_chars{0};
+    std::shared_ptr<const std::vector<llama_token>> tokens;
+};
+
+// Rendered and tokenized system prefix of chat prompts. The system message with the tools block (and the grammar
+// built from the tools) is rendered once per (tools, system message, template options). The remaining messages are
+// rendered behind an empty system message without tools and appended, which the first request of every entry checks
+// against a full render. Templates where the two differ fall back to the full render
+class ChatTemplateCache {
+  public:
+    explicit ChatTemplateCache(LlamaMicoContext* context, size_t max_entries = CHAT_TEMPLATE_CACHE_ENTRIES);
+
+    // Same params as common_chat_templates_apply, prefix gets the tokens of prompt[0, prefix.n_chars), tools_key is
+    // the ChatTools key of inputs.tools (empty hashes them)
+    // NOTE: may throw like common_chat_templates_apply
+    common_chat_params apply(const common_chat_templates_inputs& inputs, ChatPrefix& prefix,
+                             const HashKey& tools_key = HashKey());
+
+    // Parsed tools of a request's tools JSON text, nullptr if invalid
+    std::shared_ptr<const ChatTools> tools(std::string_view text);
+
+  private:
+    struct Entry {
+        bool splittable{false};  // prompt == prefix + tail rendered behind the stub system message
+        std::string prefix;      // system message and tools
+        std::shared_ptr<const std::vector<llama_token>> prefix_tokens;  // nullptr if they merge across the split
+        std::string stub_prefix;    // the stub system message alone
+        common_chat_params params;  // format, grammar, triggers and stops, no prompt
+    };
+
+    static HashKey entry_key(const common_chat_templates_inputs& inputs, const HashKey& tools_key);
+    std::shared_ptr<const Entry> create_entry(const common_chat_templates_inputs& inputs,
+                                              const common_chat_params& full);
+    std::string render_tail(const common_chat_templates_inputs& inputs, const std::string& stub_prefix,
+                            bool& ok) const;
+
+    LlamaMicoContext* context_;
+    size_t max_entries_;
+
+    std::mutex mutex_;
+    std::list<HashKey> lru_;  // most recent first
+    std::unordered_map<HashKey, std::pair<std::shared_ptr<const Entry>, std::list<HashKey>::iterator>, HashKeyHasher>
+        entries_;
+
+    std::mutex tools_mutex_;
+    std::list<HashKey> tools_lru_;  // most recent first
+    std::unordered_map<HashKey, std::pair<std::shared_ptr<const ChatTools>, std::list<HashKey>::iterator>,
+                       HashKeyHasher>
+        tools_;
+};
+
+#endif  // CHAT_TEMPLATE_CACHE_H
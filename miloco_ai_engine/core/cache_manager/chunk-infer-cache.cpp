@@ -4,7 +4,78 @@
  */
 
 #include "chunk-infer-cache.h"
-#define EMTRIES_PROPORTION_LIMIT 0.8f
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include "utils/mico-log.h"
+
+#define CACHE_SNAPSHOT_MAGIC 0x4d4b5643  // "MKVC"
+#define CACHE_SNAPSHOT_VERSION 1
+#define CACHE_SESSION_MAGIC 0x534b564d  // "MVKS"
+#define CACHE_SESSION_VERSION 1
+#define CACHE_IMAGE_POS_COST 4  // recompute cost of an image kv position against a text one, encode and prefill
+#define CACHE_LOG_PERIOD_MS 1000  // per request events, see LOG_INF_EVERY
+
+template <typename T> static void write_pod(std::ofstream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T> static bool read_pod(std::ifstream& in, T& value) {
+    return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+static void write_string(std::ofstream& out, const std::string& str) {
+    write_pod(out, (uint64_t)str.size());
+    out.write(str.data(), str.size());
+}
+
+static bool read_string(std::ifstream& in, std::string& str) {
+    uint64_t size = 0;
+    if (!read_pod(in, size) || size > (1 << 20)) return false;
+    str.resize(size);
+    return (bool)in.read(&str[0], size);
+}
+
+template <typename T> static void append_pod(std::vector<uint8_t>& out, const T& value) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(T));
+}
+
+static void append_string(std::vector<uint8_t>& out, const std::string& str) {
+    append_pod(out, (uint64_t)str.size());
+    out.insert(out.end(), str.begin(), str.end());
+}
+
+// Reads an exported session in place, every read fails once one ran past the end
+struct BufferReader {
+    const uint8_t* data;
+    size_t size;
+    size_t offset{0};
+
+    const uint8_t* bytes(uint64_t n) {
+        if (n > size - offset) {
+            offset = size;
+            return nullptr;
+        }
+        offset += n;
+        return data + offset - n;
+    }
+    template <typename T> bool pod(T& value) {
+        const uint8_t* p = bytes(sizeof(T));
+        if (p) memcpy(&value, p, sizeof(T));
+        return p != nullptr;
+    }
+    bool string(std::string& str) {
+        uint64_t n = 0;
+        const uint8_t* p = pod(n) && n <= (1 << 20) ? bytes(n) : nullptr;
+        if (p) str.assign(reinterpret_cast<const char*>(p), n);
+        return p != nullptr;
+    }
+};
 
 ChunkInferCache::ChunkInferCache(size_t max_cache_seq, LlamaMicoContext* context)
     : context_(context->lctx), model_(context->model) {
@@ -16,216 +87,709 @@ ChunkInferCache::ChunkInferCache(size_t max_cache_seq, LlamaMicoContext* context
         exit(1);
     }
 
-    std::lock_guard<std::mutex> lock(cache_mutex_);
-    for (size_t i = cache_seq_begin; i < seq_max; ++i) use_seq_mem_[i] = std::make_shared<SeqEntryList>(i);
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        for (size_t i = cache_seq_begin; i < seq_max; ++i) cache_seqs_.emplace_back(i);
+    }
+
+    max_pinned_ = context->kv_cache_pin_max;
+    std::copy(context->kv_cache_class_seqs, context->kv_cache_class_seqs + TASK_CLASS_COUNT, class_caps_);
+    host_budget_ = context->kv_cache_host_bytes;
+    next_host_id_ = seq_max;
+    swa_window_ = context->swa_window;
+
+    snapshot_path_ = context->kv_cache_path;
+    if (!snapshot_path_.empty()) {  // NOTE: lazy, requests miss the cache until the memory thread restored it
+        memory_scheduler_->submit_function_use_mem([this]() { load_snapshot(snapshot_path_); });
+    }
 }
 
 ChunkInferCache::~ChunkInferCache() {
+    if (!snapshot_path_.empty()) {  // after every queued copy into the cache sequences
+        std::promise<void> saved;
+        memory_scheduler_->submit_function_use_mem([this, &saved]() {
+            save_snapshot(snapshot_path_);
+            saved.set_value();
+        });
+        saved.get_future().wait();
+    }
+
     std::lock_guard<std::mutex> lock(cache_mutex_);
-    cache_map_.clear();
+    link_modal_cache(nullptr);  // NOTE: a shared embedding cache outlives this one
+    cache_seqs_.clear();
     LOG_INF("Chunk infer cache destroyed\n");
 }
 
-bool ChunkInferCache::prepare(std::string& chunk_hash) {
+void ChunkInferCache::set_modal_cache(std::shared_ptr<ModalEmbeddingCache> modal_cache) {
     std::lock_guard<std::mutex> lock(cache_mutex_);
-    if (cache_wait_set_.count(chunk_hash) > 0) return false;  // already in wait
-    if (cache_map_.count(chunk_hash) > 0) return false;       // already in stored
-    cache_wait_set_.insert(chunk_hash);
-    return true;
+    link_modal_cache(std::move(modal_cache));
 }
 
-void ChunkInferCache::unprepared(std::string& chunk_hash) {
-    std::unique_lock<std::mutex> cache_lock(cache_mutex_);
-    if (cache_wait_set_.count(chunk_hash) > 0) cache_wait_set_.erase(chunk_hash);  // remove from wait set
-    stored_condition_.notify_all();
+void ChunkInferCache::link_modal_cache(std::shared_ptr<ModalEmbeddingCache> modal_cache) {
+    if (modal_cache == modal_cache_) return;
+    for (int32_t delta : {-1, 1}) {  // move the coverage of every stored prompt over
+        const auto& target = delta < 0 ? modal_cache_ : modal_cache;
+        if (!target) continue;
+        for (const auto& cache_seq : cache_seqs_) target->cover(cache_seq.items, delta);
+        for (const auto& host : host_seqs_) target->cover(host.items, delta);
+    }
+    modal_cache_ = std::move(modal_cache);
 }
 
-bool ChunkInferCache::store(std::vector<std::string> chunk_hashs, size_t chunk_id, llama_seq_id seq_id,
-                            llama_token last_token, int32_t n_past) {
-    maintain();  // Try to clean cache
+void ChunkInferCache::index(const std::vector<PrefixItem>& items, int32_t id) {
+    tree_.insert(items, id);
+    if (modal_cache_) modal_cache_->cover(items, 1);
+}
 
-    std::unique_lock<std::mutex> cache_lock(cache_mutex_);
-    if (cache_wait_set_.count(chunk_hashs[chunk_id]) > 0)
-        cache_wait_set_.erase(chunk_hashs[chunk_id]);  // Remove from wait set
-    stored_condition_.notify_all();                    // NOTE: cache_lock controls stored_condition_
+void ChunkInferCache::unindex(const std::vector<PrefixItem>& items, int32_t id) {
+    tree_.erase(items, id);
+    if (modal_cache_) modal_cache_->cover(items, -1);
+}
 
-    std::vector<std::shared_ptr<CacheEntry>> pre_entries;
-    std::vector<size_t> pre_chunk_indexs;
+void ChunkInferCache::save_snapshot(const std::string& path) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    std::string tmp_path = path + ".tmp";
+    std::ofstream out(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        LOG_WRN("failed to open kv cache snapshot %s\n", tmp_path.c_str());
+        return;
+    }
 
-    for (size_t i = 0; i <= chunk_id; ++i) {
-        std::string chunk_hash = chunk_hashs[i];
-        auto it = cache_map_.find(chunk_hash);
-        if (it != cache_map_.end()) {
-            auto entry = it->second;
-            pre_entries.push_back(entry);
-            pre_chunk_indexs.push_back(i);
+    uint32_t n_seqs = 0;
+    for (const auto& cache_seq : cache_seqs_) n_seqs += cache_seq.items.empty() ? 0 : 1;
+    write_pod(out, (uint32_t)CACHE_SNAPSHOT_MAGIC);
+    write_pod(out, (uint32_t)CACHE_SNAPSHOT_VERSION);
+    write_string(out, model_signature(model_));
+    write_pod(out, n_seqs);
+
+    std::vector<uint8_t> kv;
+    for (const auto& cache_seq : cache_seqs_) {
+        if (cache_seq.items.empty()) continue;
+        kv.resize(llama_state_seq_get_size(context_, cache_seq.cache_seq_id));
+        size_t kv_size = llama_state_seq_get_data(context_, kv.data(), kv.size(), cache_seq.cache_seq_id);
+
+        write_pod(out, cache_seq.cache_seq_id);
+        write_pod(out, cache_seq.n_pos);
+        write_string(out, cache_seq.session);
+        write_pod(out, (uint64_t)cache_seq.items.size());
+        for (const auto& item : cache_seq.items) {
+            write_pod(out, item.key);
+            write_pod(out, item.n_pos);
         }
+        write_pod(out, (uint64_t)kv_size);
+        out.write(reinterpret_cast<const char*>(kv.data()), kv_size);
     }
+    out.close();
+    if (!out || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOG_WRN("failed to write kv cache snapshot %s\n", path.c_str());
+        std::remove(tmp_path.c_str());
+        return;
+    }
+    LOG_INF("Saved %u cache sequences to %s\n", n_seqs, path.c_str());
+}
 
-    if (!pre_chunk_indexs.empty() && pre_chunk_indexs.back() == chunk_id) return true;  // has cached
-
-    std::shared_ptr<SeqEntryList> target_seq = nullptr;
+void ChunkInferCache::load_snapshot(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return;  // cold start
 
-    if (!pre_entries.empty()) {
-        for (auto m : use_seq_mem_) {
-            auto seq_entries = m.second->seq_entries;
-            if (seq_entries.empty()) continue;
+    uint32_t magic = 0, version = 0, n_seqs = 0;
+    std::string signature = "";
+    if (!read_pod(in, magic) || magic != CACHE_SNAPSHOT_MAGIC || !read_pod(in, version) ||
+        version != CACHE_SNAPSHOT_VERSION || !read_string(in, signature) || !read_pod(in, n_seqs)) {
+        LOG_WRN("ignore kv cache snapshot %s, unknown format\n", path.c_str());
+        return;
+    }
+    if (signature != model_signature(model_)) {
+        LOG_WRN("ignore kv cache snapshot %s, saved for model %s\n", path.c_str(), signature.c_str());
+        return;
+    }
 
-            if (seq_entries.back() == pre_entries.back()) {
-                target_seq = m.second;
-            }
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    uint32_t n_loaded = 0;
+    std::vector<uint8_t> kv;
+    for (uint32_t s = 0; s < n_seqs; s++) {
+        int32_t cache_seq_id = 0;
+        llama_pos n_pos = 0;
+        std::string session = "";
+        uint64_t n_items = 0, kv_size = 0;
+        if (!read_pod(in, cache_seq_id) || !read_pod(in, n_pos) || !read_string(in, session) ||
+            !read_pod(in, n_items) || n_items > (uint64_t)llama_n_ctx(context_))
+            break;
+        std::vector<PrefixItem> items(n_items);
+        bool ok = true;
+        for (auto& item : items) ok = ok && read_pod(in, item.key) && read_pod(in, item.n_pos);
+        if (!ok || !read_pod(in, kv_size)) break;
+        kv.resize(kv_size);
+        if (!in.read(reinterpret_cast<char*>(kv.data()), kv_size)) break;
+
+        CacheSeq* cache_seq = find_cache_seq(cache_seq_id);  // NOTE: cache_seq_num or n_seq_max may have changed
+        if (!cache_seq || !cache_seq->items.empty()) continue;
+        llama_memory_seq_rm(llama_get_memory(context_), cache_seq_id, -1, -1);
+        if (llama_state_seq_set_data(context_, kv.data(), kv.size(), cache_seq_id) == 0) {
+            LOG_WRN("failed to restore cache sequence %d\n", cache_seq_id);
+            continue;
         }
+
+        cache_seq->items = std::move(items);
+        cache_seq->n_pos = n_pos;
+        cache_seq->session = session;
+        cache_seq->task_class = -1;
+        cache_seq->swa_pos_min = seq_swa_pos_min(cache_seq_id);
+        reset_priority(*cache_seq);
+        index(cache_seq->items, cache_seq->cache_seq_id);
+        n_loaded++;
+    }
+    LOG_INF("Restored %u/%u cache sequences from %s\n", n_loaded, n_seqs, path.c_str());
+}
+
+size_t ChunkInferCache::apply_prefix(const std::vector<PrefixItem>& items, size_t max_items,
+                                     llama_seq_id target_seq_id, llama_pos& n_pos) {
+    std::unique_lock<std::mutex> lock(cache_mutex_);
+    std::vector<int32_t> seq_ids;
+    size_t n_items = tree_.match(items, max_items, seq_ids);
+    n_pos = 0;
+    stats_.queried_pos += prefix_n_pos(items, std::min(max_items, items.size()));
+    stats_.misses++;  // NOTE: moved to the hits below
+    if (n_items == 0 || seq_ids.empty()) return 0;
+
+    CacheSeq* cache_seq = nullptr;
+    for (int32_t seq_id : seq_ids) {
+        cache_seq = find_cache_seq(seq_id);
+        if (cache_seq && !cache_seq->loading) break;
+        cache_seq = nullptr;
+    }
+    if (cache_seq && !swa_holds(cache_seq->swa_pos_min, prefix_n_pos(items, n_items))) {
+        cache_seq = swa_fallback(items, max_items, n_items);
+        if (!cache_seq) return 0;
     }
-    if (target_seq == nullptr) {  // New sequence
-        for (auto m : use_seq_mem_) {
-            if (m.second->seq_entries.empty()) target_seq = m.second;
+    if (!cache_seq) {  // Only in the host tier
+        std::future<bool> loaded;
+        llama_pos n_reuse = prefix_n_pos(items, n_items);
+        CacheSeq* paged = nullptr;
+        for (size_t i = 0; i < seq_ids.size() && !paged; i++)
+            paged = page_in(seq_ids[i], loaded, target_seq_id, n_reuse);
+        if (!paged) return 0;
+
+        // NOTE: the memory thread takes cache_mutex_ too, never wait for it with the lock held
+        lock.unlock();
+        bool ok = loaded.get();
+        lock.lock();
+        paged->loading = false;
+        if (!ok) {
+            LOG_WRN("failed to page in cache sequence %d from host\n", paged->cache_seq_id);
+            unindex(paged->items, paged->cache_seq_id);
+            memory_scheduler_->submit_clear_mem(paged->cache_seq_id, -1, -1);
+            paged->items.clear();
+            paged->n_pos = 0;
+            paged->session.clear();
+            paged->n_hits = 0;
+            return 0;
         }
+        n_pos = n_reuse;
+        stats_.misses--;
+        stats_.host_hits++;
+        stats_.reused_pos += n_pos;
+        LOG_INF_EVERY(CACHE_LOG_PERIOD_MS,
+                      "hit host KV cache prefix, page in to cache_room: %d, reuse %zu/%zu items, npast: %d\n",
+                      paged->cache_seq_id, n_items, items.size(), n_pos);
+        return n_items;
     }
-    if (target_seq == nullptr) {
-        return false;
+    n_pos = prefix_n_pos(items, n_items);
+    // NOTE: queued under cache_mutex_, so it runs before any later store rewrites the cache sequence
+    memory_scheduler_->submit_cache_mem(cache_seq->cache_seq_id, target_seq_id, -1, n_pos);
+    touch(*cache_seq);
+    stats_.misses--;
+    stats_.hits++;
+    stats_.reused_pos += n_pos;
+
+    LOG_INF_EVERY(CACHE_LOG_PERIOD_MS, "hit KV cache prefix, use cache_room: %d, reuse %zu/%zu items, npast: %d\n",
+                  cache_seq->cache_seq_id, n_items, items.size(), n_pos);
+    return n_items;
+}
+
+size_t ChunkInferCache::peek_prefix(const std::vector<PrefixItem>& items, size_t max_items, double& priority) const {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    std::vector<int32_t> seq_ids;
+    size_t n_items = tree_.match(items, max_items, seq_ids);
+    priority = std::numeric_limits<double>::infinity();
+    for (const auto& cache_seq : cache_seqs_) {
+        if (cache_seq.loading || std::find(seq_ids.begin(), seq_ids.end(), cache_seq.cache_seq_id) == seq_ids.end())
+            continue;
+        priority = std::min(priority, cache_seq.priority);
     }
+    return n_items;
+}
 
-    auto entry = std::make_shared<CacheEntry>();
-    entry->prompt_hash = chunk_hashs[chunk_id];
-    entry->pos_begin =
-        pre_entries.empty() ? 0 : pre_entries.back()->pos_end;  // NOTE: May have misalignment issue later
-    entry->pos_end = n_past;
-    entry->last_token = last_token;
-    entry->reference_count = 1;
+KvCacheStats ChunkInferCache::stats() const {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    KvCacheStats stats = stats_;
+    for (const auto& cache_seq : cache_seqs_) stats.n_cache_pos += cache_seq.n_pos;
+    stats.host_bytes = host_bytes_;
+    return stats;
+}
 
-    if (!serialize_kv_cache_state(seq_id, target_seq->cache_seq_id, target_seq->last_pos)) {
-        LOG_WRN("store: empty kv_cache_state, not storing");
-        return false;
+std::vector<CacheEntry> ChunkInferCache::entries() const {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    std::vector<CacheEntry> entries;
+    for (const auto& cache_seq : cache_seqs_) {
+        if (cache_seq.items.empty()) continue;
+        entries.push_back({cache_seq.items, cache_seq.session, cache_seq.priority, cache_seq.pinned});
     }
+    for (const auto& host_seq : host_seqs_)
+        entries.push_back({host_seq.items, host_seq.session, host_seq.priority, false /* pinned */});
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](const CacheEntry& a, const CacheEntry& b) { return a.priority > b.priority; });
+    return entries;
+}
 
-    if (target_seq->seq_entries.empty()) {
-        for (auto& e : pre_entries) e->reference_count++;
-        pre_entries.push_back(entry);
-        target_seq->seq_entries.insert(target_seq->seq_entries.end(), pre_entries.begin(), pre_entries.end());
-    } else {
-        target_seq->seq_entries.push_back(entry);
+bool ChunkInferCache::store(const std::vector<PrefixItem>& items, llama_seq_id seq_id, int32_t task_class,
+                            bool pinned) {
+    if (items.empty()) return false;
+
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    std::vector<int32_t> seq_ids;
+    size_t n_common = tree_.match(items, items.size(), seq_ids);
+    llama_pos n_pos = prefix_n_pos(items, items.size());
+
+    CacheSeq* target = nullptr;
+    for (int32_t cache_seq_id : seq_ids) {
+        CacheSeq* cache_seq = find_cache_seq(cache_seq_id);
+        if (!cache_seq || cache_seq->loading) continue;
+        if (n_common == items.size()) {  // has cached
+            touch(*cache_seq);
+            if (pinned) pin(*cache_seq);
+            return true;
+        }
+        // stored prompt is a prefix, extend it, NOTE: a session keeps its own conversation
+        if (cache_seq->items.size() == n_common && cache_seq->session.empty()) target = cache_seq;
     }
 
-    target_seq->last_pos = n_past;
-    target_seq->last_access = std::chrono::steady_clock::now();
-    cache_map_[chunk_hashs[chunk_id]] = entry;
+    llama_pos p0 = 0;
+    if (target) {
+        unindex(target->items, target->cache_seq_id);
+        p0 = target->n_pos;
+        // NOTE: seq_id pruned its window below p0, the extended sequence would hold a gap in the SWA layers
+        if (swa_window_ > 0) {
+            memory_scheduler_->submit_clear_mem(target->cache_seq_id, -1, -1);
+            p0 = 0;
+        }
+    } else {  // New sequence
+        target = evict_cache_seq(task_class);
+        if (!target) return false;
+        target->task_class = task_class;
+    }
+    memory_scheduler_->submit_cache_mem(seq_id, target->cache_seq_id, p0, n_pos);
+
+    target->items = items;
+    target->n_pos = n_pos;
+    track_swa(*target);
+    reset_priority(*target);  // NOTE: an extended prompt keeps its hits and its pin
+    if (pinned) pin(*target);
+    index(target->items, target->cache_seq_id);
+
+    stats_.stores++;
+    LOG_INF_EVERY(CACHE_LOG_PERIOD_MS, "Stored KV cache prefix of %zu items, use cache_room: %d, npast: %d\n",
+                  items.size(), target->cache_seq_id, target->n_pos);
+    return true;
+}
 
-    LOG_INF("Stored KV cache entry with key: %s, use cache_room: %d, npast: %d\n", chunk_hashs[chunk_id].c_str(),
-            target_seq->cache_seq_id, target_seq->last_pos);
+bool ChunkInferCache::store_session(const std::string& session, const std::vector<PrefixItem>& items,
+                                    llama_seq_id seq_id) {
+    if (session.empty() || items.empty()) return false;
 
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    CacheSeq* target = find_session_seq(session);
+    llama_pos p0 = 0;
+    if (target) {  // Keep the common history of the last turn
+        size_t n_common = 0;
+        while (n_common < target->items.size() && n_common < items.size() &&
+               target->items[n_common].key == items[n_common].key)
+            n_common++;
+        unindex(target->items, target->cache_seq_id);
+        p0 = swa_window_ > 0 ? 0 : prefix_n_pos(items, n_common);  // NOTE: no SWA gap, see store
+        if (p0 < target->n_pos) memory_scheduler_->submit_clear_mem(target->cache_seq_id, p0, -1);
+    } else {
+        target = evict_cache_seq();
+        if (!target) return false;
+        target->task_class = -1;
+    }
+    llama_pos n_pos = prefix_n_pos(items, items.size());
+    memory_scheduler_->submit_cache_mem(seq_id, target->cache_seq_id, p0, n_pos);
+
+    target->items = items;
+    target->n_pos = n_pos;
+    target->session = session;
+    track_swa(*target);
+    touch(*target);  // NOTE: every turn counts as a hit of the session
+    index(target->items, target->cache_seq_id);
+
+    stats_.stores++;
+    LOG_INF_EVERY(CACHE_LOG_PERIOD_MS, "Stored session %s of %zu items, use cache_room: %d, npast: %d\n",
+                  session.c_str(), items.size(), target->cache_seq_id, target->n_pos);
     return true;
 }
 
-std::shared_ptr<CacheEntry> ChunkInferCache::lookup(std::string chunk_hash) {
+bool ChunkInferCache::has_session(const std::string& session) const {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    for (const auto& cache_seq : cache_seqs_)
+        if (cache_seq.session == session) return true;
+    for (const auto& host_seq : host_seqs_)
+        if (host_seq.session == session) return true;
+    return false;
+}
+
+void ChunkInferCache::release_session(const std::string& session) {
     std::lock_guard<std::mutex> lock(cache_mutex_);
+    for (auto it = host_seqs_.begin(); it != host_seqs_.end();) {  // older turns spilled to host
+        if (it->session != session) {
+            ++it;
+            continue;
+        }
+        unindex(it->items, it->host_id);
+        host_bytes_ -= it->kv_size;
+        it = host_seqs_.erase(it);
+    }
 
-    auto it = cache_map_.find(chunk_hash);
-    if (it == cache_map_.end()) return nullptr;
-    auto entry = it->second;
+    CacheSeq* target = find_session_seq(session);
+    if (!target) return;
 
-    if (entry->reference_count != 1) return entry;
-    // Need to maintain unique reference
-    for (auto& seq : use_seq_mem_) {
-        for (const auto& e : seq.second->seq_entries)
-            if (e == entry) seq.second->last_access = std::chrono::steady_clock::now();
+    unindex(target->items, target->cache_seq_id);
+    memory_scheduler_->submit_clear_mem(target->cache_seq_id, -1, -1);
+    LOG_INF("Released session %s, cache_room: %d\n", session.c_str(), target->cache_seq_id);
+
+    target->items.clear();
+    target->n_pos = 0;
+    target->session.clear();
+    target->pinned = false;
+    target->n_hits = 0;
+}
+
+bool ChunkInferCache::export_session(const std::string& session, std::vector<uint8_t>& out) {
+    std::unique_lock<std::mutex> lock(cache_mutex_);
+    std::vector<PrefixItem> items;
+    llama_pos n_pos = 0;
+    uint32_t n_hits = 0;
+    std::shared_ptr<std::vector<uint8_t>> kv;
+    std::promise<void> copied;
+    CacheSeq* cache_seq = find_session_seq(session);
+    if (cache_seq && !cache_seq->loading) {
+        items = cache_seq->items;
+        n_pos = cache_seq->n_pos;
+        n_hits = cache_seq->n_hits;
+        kv = std::make_shared<std::vector<uint8_t>>();
+        int32_t cache_seq_id = cache_seq->cache_seq_id;
+        // NOTE: queued before the lock is released, runs after the copy of the last turn and before any eviction
+        memory_scheduler_->submit_function_use_mem([this, kv, cache_seq_id, &copied]() {
+            kv->resize(llama_state_seq_get_size(context_, cache_seq_id));
+            kv->resize(llama_state_seq_get_data(context_, kv->data(), kv->size(), cache_seq_id));
+            copied.set_value();
+        });
+    } else {  // the latest turn spilled to the host tier
+        for (const auto& host : host_seqs_) {
+            if (host.session != session || !host.ready || host.items.size() <= items.size()) continue;
+            items = host.items;
+            n_pos = host.n_pos;
+            n_hits = host.n_hits;
+            kv = host.kv;
+        }
+        if (!kv) return false;
+        copied.set_value();
     }
-    // LOG_INF("hit KV cache entry with key: %s\n", chunk_hash.c_str());
-    return entry;
+    lock.unlock();
+    copied.get_future().wait();
+    if (kv->empty()) return false;
+
+    out.clear();
+    append_pod(out, (uint32_t)CACHE_SESSION_MAGIC);
+    append_pod(out, (uint32_t)CACHE_SESSION_VERSION);
+    append_string(out, model_signature(model_));
+    append_string(out, session);
+    append_pod(out, n_pos);
+    append_pod(out, n_hits);
+    append_pod(out, (uint64_t)items.size());
+    for (const auto& item : items) {
+        append_pod(out, item.key);
+        append_pod(out, item.n_pos);
+    }
+    append_pod(out, (uint64_t)kv->size());
+    out.insert(out.end(), kv->begin(), kv->end());
+    LOG_INF("Exported session %s of %zu items, %zu bytes\n", session.c_str(), items.size(), out.size());
+    return true;
 }
 
-bool ChunkInferCache::apply_cache_entry(const std::shared_ptr<CacheEntry>& entry, llama_seq_id target_seq_id) {
-    if (!entry) return false;
-    llama_seq_id src_seq_id = -1;
-    for (auto& seq : use_seq_mem_) {
-        for (const auto& e : seq.second->seq_entries)
-            if (e == entry) {
-                src_seq_id = seq.first;
-                break;
-            }
+bool ChunkInferCache::import_session(const uint8_t* data, size_t size, std::string& session) {
+    BufferReader in{data, size};
+    uint32_t magic = 0, version = 0, n_hits = 0;
+    uint64_t n_items = 0, kv_size = 0;
+    llama_pos n_pos = 0;
+    std::string signature;
+    if (!in.pod(magic) || magic != CACHE_SESSION_MAGIC || !in.pod(version) || version != CACHE_SESSION_VERSION ||
+        !in.string(signature) || !in.string(session) || !in.pod(n_pos) || !in.pod(n_hits) || !in.pod(n_items) ||
+        n_items > size / sizeof(PrefixItem)) {
+        LOG_WRN("ignore imported session, unknown format\n");
+        return false;
+    }
+    if (signature != model_signature(model_)) {
+        LOG_WRN("ignore imported session %s, exported for model %s\n", session.c_str(), signature.c_str());
+        return false;
+    }
+    std::vector<PrefixItem> items(n_items);
+    bool ok = !session.empty();
+    for (auto& item : items) ok = ok && in.pod(item.key) && in.pod(item.n_pos);
+    const uint8_t* kv = ok && in.pod(kv_size) ? in.bytes(kv_size) : nullptr;
+    if (!kv || kv_size == 0 || items.empty() || prefix_n_pos(items, items.size()) != n_pos) {
+        LOG_WRN("ignore imported session %s, truncated\n", session.c_str());
+        return false;
     }
 
-    if (src_seq_id == -1) return false;
-    return deserialize_kv_cache_state(src_seq_id, target_seq_id, entry->pos_end);
+    release_session(session);  // NOTE: the imported turn replaces a local one
+    std::unique_lock<std::mutex> lock(cache_mutex_);
+    CacheSeq* target = evict_cache_seq();
+    if (!target) return false;
+    target->loading = true;  // NOTE: never evicted or matched meanwhile
+    int32_t cache_seq_id = target->cache_seq_id;
+    std::promise<bool> loaded;
+    llama_pos swa_pos_min = 0;
+    memory_scheduler_->submit_function_use_mem([this, kv, kv_size, cache_seq_id, &loaded, &swa_pos_min]() {
+        bool ok = llama_state_seq_set_data(context_, kv, kv_size, cache_seq_id) != 0;
+        swa_pos_min = seq_swa_pos_min(cache_seq_id);
+        loaded.set_value(ok);
+    });
+    lock.unlock();
+    ok = loaded.get_future().get();
+    lock.lock();
+    target->loading = false;
+    if (!ok) {
+        LOG_WRN("failed to import session %s into cache_room %d\n", session.c_str(), cache_seq_id);
+        memory_scheduler_->submit_clear_mem(cache_seq_id, -1, -1);
+        return false;
+    }
+    target->items = std::move(items);
+    target->n_pos = n_pos;
+    target->session = session;
+    target->task_class = -1;
+    target->n_hits = n_hits;
+    target->swa_pos_min = swa_pos_min;
+    target->swa_epoch++;
+    touch(*target);
+    index(target->items, target->cache_seq_id);
+    LOG_INF("Imported session %s of %zu items, cache_room: %d, npast: %d\n", session.c_str(), target->items.size(),
+            cache_seq_id, n_pos);
+    return true;
 }
 
-bool ChunkInferCache::waiting(std::string chunk_hash) {
-    std::lock_guard<std::mutex> lock(cache_mutex_);
-    return cache_wait_set_.count(chunk_hash) > 0;
+CacheSeq* ChunkInferCache::find_session_seq(const std::string& session) {
+    for (auto& cache_seq : cache_seqs_)
+        if (cache_seq.session == session) return &cache_seq;
+    return nullptr;
 }
 
-bool ChunkInferCache::storing(std::string chunk_hash) {
-    std::lock_guard<std::mutex> lock(cache_mutex_);
-    return cache_map_.count(chunk_hash) > 0;
+CacheSeq* ChunkInferCache::find_cache_seq(int32_t cache_seq_id) {
+    for (auto& cache_seq : cache_seqs_)
+        if (cache_seq.cache_seq_id == cache_seq_id) return &cache_seq;
+    return nullptr;
 }
 
-void ChunkInferCache::block_waiting(std::string chunk_hash) {
-    std::unique_lock<std::mutex> lock(cache_mutex_);
-    if (cache_wait_set_.count(chunk_hash) == 0) return;
-    stored_condition_.wait(lock, [this, chunk_hash]() { return cache_wait_set_.count(chunk_hash) == 0; });
+double ChunkInferCache::gdsf_priority(const std::vector<PrefixItem>& items, llama_pos n_pos, uint32_t n_hits) const {
+    double cost = 0;
+    for (const auto& item : items) cost += item.key < 0 ? (double)item.n_pos * CACHE_IMAGE_POS_COST : item.n_pos;
+    return clock_ + cost * (1 + n_hits) / std::max<llama_pos>(n_pos, 1);
 }
 
-void ChunkInferCache::block_waiting_and_prepare(std::string chunk_hash) {
-    std::unique_lock<std::mutex> lock(cache_mutex_);
-    if (cache_wait_set_.count(chunk_hash) > 0)
-        stored_condition_.wait(lock, [this, chunk_hash]() { return cache_wait_set_.count(chunk_hash) == 0; });
+void ChunkInferCache::touch(CacheSeq& cache_seq) {
+    cache_seq.n_hits++;
+    cache_seq.priority = gdsf_priority(cache_seq.items, cache_seq.n_pos, cache_seq.n_hits);
+    cache_seq.last_access = std::chrono::steady_clock::now();
+}
 
-    if (cache_map_.count(chunk_hash) == 0) cache_wait_set_.insert(chunk_hash);  // Enter prepare state if not completed
+void ChunkInferCache::reset_priority(CacheSeq& cache_seq) {
+    cache_seq.priority = gdsf_priority(cache_seq.items, cache_seq.n_pos, cache_seq.n_hits);
+    cache_seq.last_access = std::chrono::steady_clock::now();
 }
 
-void ChunkInferCache::maintain() {
-    auto now = std::chrono::steady_clock::now();
-    std::lock_guard<std::mutex> lock(cache_mutex_);
+void ChunkInferCache::pin(CacheSeq& cache_seq) {
+    if (cache_seq.pinned || max_pinned_ <= 0) return;
+    CacheSeq* lowest = nullptr;
+    int32_t n_pinned = 0;
+    for (auto& pinned : cache_seqs_) {
+        if (!pinned.pinned) continue;
+        n_pinned++;
+        if (!lowest || pinned.priority < lowest->priority) lowest = &pinned;
+    }
+    if (n_pinned >= max_pinned_) {  // NOTE: evictable again, the new pin is the hotter prefix
+        lowest->pinned = false;
+        LOG_INF("unpinned cache_room %d, %d pinned\n", lowest->cache_seq_id, n_pinned);
+    }
+    cache_seq.pinned = true;
+}
 
-    size_t used_seq_num = 0;
-    for (auto& seq : use_seq_mem_)
-        if (!seq.second->seq_entries.empty()) used_seq_num++;
-    float limit = EMTRIES_PROPORTION_LIMIT;
-    size_t max_seq_num = use_seq_mem_.size() * limit;
-    int32_t delete_num = (int32_t)used_seq_num - (int32_t)max_seq_num;
-    if (used_seq_num < use_seq_mem_.size()) return;
-
-    // Find sequences to delete
-    std::vector<std::pair<size_t, std::shared_ptr<SeqEntryList>>> sorted_seqs;
-    for (auto& seq : use_seq_mem_) {
-        if (!seq.second->seq_entries.empty()) {
-            sorted_seqs.push_back(seq);
+CacheSeq* ChunkInferCache::evict_cache_seq(int32_t task_class) {
+    // A class at its cap replaces one of its own sequences, so a burst of one class never evicts another
+    bool capped = false;
+    if (task_class >= 0 && task_class < TASK_CLASS_COUNT) {
+        int32_t n_class = 0;
+        for (const auto& cache_seq : cache_seqs_)
+            n_class += !cache_seq.items.empty() && cache_seq.task_class == task_class;
+        capped = n_class >= class_caps_[task_class];
+    }
+    CacheSeq* target = nullptr;
+    for (auto& cache_seq : cache_seqs_) {
+        if (cache_seq.loading) continue;
+        if (cache_seq.items.empty()) {
+            if (capped) continue;
+            return &cache_seq;
         }
+        if (cache_seq.pinned || (capped && cache_seq.task_class != task_class)) continue;
+        if (!target || cache_seq.priority < target->priority ||
+            (cache_seq.priority == target->priority && cache_seq.last_access < target->last_access))
+            target = &cache_seq;
     }
-    std::sort(sorted_seqs.begin(), sorted_seqs.end(),
-              [](const std::pair<size_t, std::shared_ptr<SeqEntryList>>& a,
-                 const std::pair<size_t, std::shared_ptr<SeqEntryList>>& b) {
-                  return a.second->last_access < b.second->last_access;
-              });
-    std::vector<size_t> to_delete;
-    for (size_t i = 0; i < delete_num && i < sorted_seqs.size(); ++i) {
-        to_delete.push_back(sorted_seqs[i].first);
-    }
-
-    // Find entries to delete
-    std::vector<std::string> to_delete_keys;
-    for (size_t seq_id : to_delete) {
-        auto it = use_seq_mem_.find(seq_id);
-        if (it != use_seq_mem_.end()) {
-            for (auto& entry : it->second->seq_entries) {
-                entry->reference_count--;
-                if (entry->reference_count <= 0) to_delete_keys.push_back(entry->prompt_hash);
-            }
-            it->second->seq_entries.clear();
-            it->second->last_pos = 0;
-            memory_scheduler_->submit_clear_mem(seq_id, -1, -1);
-            LOG_INF("maintain deleted sequence %zu from cache\n", seq_id);
+    if (!target) return nullptr;
+    clock_ = std::max(clock_, target->priority);
+
+    unindex(target->items, target->cache_seq_id);
+    if (host_budget_ > 0) spill_to_host(*target);  // queued before the clear
+    memory_scheduler_->submit_clear_mem(target->cache_seq_id, -1, -1);
+    stats_.evictions++;
+    LOG_INF_EVERY(CACHE_LOG_PERIOD_MS, "maintain deleted sequence %d from cache\n", target->cache_seq_id);
+
+    target->items.clear();
+    target->n_pos = 0;
+    target->session.clear();
+    target->n_hits = 0;
+    return target;
+}
+
+llama_pos ChunkInferCache::seq_swa_pos_min(int32_t seq_id) const {
+    if (swa_window_ <= 0) return 0;
+    llama_pos pos_min = llama_memory_seq_pos_min(llama_get_memory(context_), seq_id);
+    return pos_min < 0 ? std::numeric_limits<llama_pos>::max() : pos_min;  // NOTE: empty, nothing to reuse
+}
+
+void ChunkInferCache::track_swa(CacheSeq& cache_seq) {
+    cache_seq.swa_epoch++;
+    if (swa_window_ <= 0) return;
+    cache_seq.swa_pos_min = std::numeric_limits<llama_pos>::max();
+    int32_t cache_seq_id = cache_seq.cache_seq_id;
+    uint32_t epoch = cache_seq.swa_epoch;
+    memory_scheduler_->submit_function_use_mem([this, cache_seq_id, epoch]() {
+        llama_pos pos_min = seq_swa_pos_min(cache_seq_id);
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        CacheSeq* cache_seq = find_cache_seq(cache_seq_id);
+        if (cache_seq && cache_seq->swa_epoch == epoch) cache_seq->swa_pos_min = pos_min;
+    });
+}
+
+CacheSeq* ChunkInferCache::swa_fallback(const std::vector<PrefixItem>& items, size_t max_items, size_t& n_items) {
+    CacheSeq* best = nullptr;
+    n_items = 0;
+    size_t n_max = std::min(max_items, items.size());
+    for (auto& cache_seq : cache_seqs_) {
+        if (cache_seq.loading || cache_seq.items.empty()) continue;
+        size_t n_common = 0;
+        while (n_common < n_max && n_common < cache_seq.items.size() &&
+               cache_seq.items[n_common].key == items[n_common].key)
+            n_common++;
+        if (n_common > n_items && swa_holds(cache_seq.swa_pos_min, prefix_n_pos(items, n_common))) {
+            best = &cache_seq;
+            n_items = n_common;
         }
     }
+    return best;
+}
 
-    for (auto& key : to_delete_keys) cache_map_.erase(key);
+void ChunkInferCache::spill_to_host(const CacheSeq& cache_seq) {
+    HostCacheSeq host;
+    host.host_id = next_host_id_++;
+    host.items = cache_seq.items;
+    host.n_pos = cache_seq.n_pos;
+    host.session = cache_seq.session;
+    host.task_class = cache_seq.task_class;
+    host.kv = std::make_shared<std::vector<uint8_t>>();
+    host.n_hits = cache_seq.n_hits;
+    host.priority = cache_seq.priority;
+    host.swa_pos_min = cache_seq.swa_pos_min;
+    host.last_access = cache_seq.last_access;
+    index(host.items, host.host_id);
+
+    auto kv = host.kv;
+    int32_t host_id = host.host_id;
+    int32_t cache_seq_id = cache_seq.cache_seq_id;
+    host_seqs_.push_back(std::move(host));
+    memory_scheduler_->submit_function_use_mem([this, kv, host_id, cache_seq_id]() {
+        kv->resize(llama_state_seq_get_size(context_, cache_seq_id));
+        kv->resize(llama_state_seq_get_data(context_, kv->data(), kv->size(), cache_seq_id));
+
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        auto it = std::find_if(host_seqs_.begin(), host_seqs_.end(),
+                               [host_id](const HostCacheSeq& host) { return host.host_id == host_id; });
+        if (it == host_seqs_.end()) return;  // paged in again already
+        if (kv->empty()) {
+            unindex(it->items, it->host_id);
+            host_seqs_.erase(it);
+            return;
+        }
+        it->ready = true;
+        it->kv_size = kv->size();
+        host_bytes_ += it->kv_size;
+        stats_.spills++;
+        LOG_INF_EVERY(CACHE_LOG_PERIOD_MS, "spilled cache_room %d to host, host cache %zu/%zu MB\n", cache_seq_id,
+                      host_bytes_ >> 20, host_budget_ >> 20);
+        trim_host();
+    });
 }
 
-bool ChunkInferCache::serialize_kv_cache_state(llama_seq_id src_seq_id, llama_seq_id dst_seq_id, llama_pos pos_begin) {
-    memory_scheduler_->submit_cache_mem(src_seq_id, dst_seq_id, pos_begin, -1);
-    return true;
+CacheSeq* ChunkInferCache::page_in(int32_t host_id, std::future<bool>& loaded, llama_seq_id target_seq_id,
+                                   llama_pos n_pos) {
+    auto host = std::find_if(host_seqs_.begin(), host_seqs_.end(),
+                             [host_id](const HostCacheSeq& host) { return host.host_id == host_id; });
+    if (host == host_seqs_.end() || !swa_holds(host->swa_pos_min, n_pos)) return nullptr;
+    // NOTE: may spill another sequence, list iterators stay valid
+    CacheSeq* target = evict_cache_seq(host->session.empty() ? host->task_class : -1);
+    if (!target) return nullptr;
+
+    unindex(host->items, host->host_id);
+    target->items = std::move(host->items);
+    target->n_pos = host->n_pos;
+    target->session = host->session;
+    target->task_class = host->task_class;
+    target->n_hits = host->n_hits;
+    target->swa_pos_min = host->swa_pos_min;
+    target->swa_epoch++;
+    touch(*target);
+    target->loading = true;
+    index(target->items, target->cache_seq_id);
+
+    auto kv = host->kv;
+    host_bytes_ -= host->kv_size;
+    host_seqs_.erase(host);
+
+    auto promise = std::make_shared<std::promise<bool>>();
+    loaded = promise->get_future();
+    int32_t cache_seq_id = target->cache_seq_id;
+    memory_scheduler_->submit_function_use_mem([this, kv, promise, cache_seq_id, target_seq_id, n_pos]() {
+        // NOTE: runs after the spill filled kv
+        bool ok = !kv->empty() && llama_state_seq_set_data(context_, kv->data(), kv->size(), cache_seq_id) != 0;
+        if (ok) {  // NOTE: the target may hold part of the prefix already, copy the rest like submit_cache_mem
+            llama_memory_t memory = llama_get_memory(context_);
+            llama_pos p0 = llama_memory_seq_pos_max(memory, target_seq_id) + 1;
+            if (p0 < n_pos) llama_memory_seq_cp(memory, cache_seq_id, target_seq_id, p0, n_pos);
+        }
+        promise->set_value(ok);
+    });
+    return target;
 }
 
-bool ChunkInferCache::deserialize_kv_cache_state(llama_seq_id src_seq_id, llama_seq_id dst_seq_id, llama_pos pos_end) {
-    memory_scheduler_->submit_cache_mem(src_seq_id, dst_seq_id, -1, pos_end);
-    return true;
-}
\ No newline at end of file
+void ChunkInferCache::trim_host() {
+    while (host_bytes_ > host_budget_) {  // Drop the lowest priority
+        auto lru = host_seqs_.end();
+        for (auto it = host_seqs_.begin(); it != host_seqs_.end(); ++it) {
+            if (it->ready && (lru == host_seqs_.end() || it->priority < lru->priority)) lru = it;
+        }
+        if (lru == host_seqs_.end()) break;
+        clock_ = std::max(clock_, lru->priority);
+        unindex(lru->items, lru->host_id);
+        host_bytes_ -= lru->kv_size;
+        host_seqs_.erase(lru);
+    }
+}
@@ -4,72 +4,168 @@
  */
 #ifndef CHUNK_INFER_CACHE_H
 #define CHUNK_INFER_CACHE_H
-#include <unordered_set>
+#include <algorithm>
+#include <chrono>
+#include <list>
 
+#include "cache_manager/modal-embedding-cache.h"
+#include "cache_manager/radix-tree.h"
 #include "utils/mico-common.h"
 
 // Forward declarations
 struct llama_context;
 struct llama_model;
 
-struct CacheEntry {
-    std::string prompt_hash;
-    // pos[pos_begin, pos_end)
-    llama_pos pos_begin;
-    llama_pos pos_end;  // n_past
-    llama_token last_token;
+// One reserved kv sequence holding the kv of a stored prompt
+struct CacheSeq {
+    int32_t cache_seq_id;
+    std::vector<PrefixItem> items;  // stored prompt, kv positions [0, n_pos)
+    llama_pos n_pos;
+    std::string session{""};  // pinned to a multi-turn session, holds its whole conversation
+    bool loading{false};      // kv is paged in from the host tier, not usable yet
+    bool pinned{false};       // never evicted, see ChunkInferCache::pin
+    int32_t task_class{-1};   // TaskClass of the prompt that stored it, counted against its cap, -1 for none
+    uint32_t n_hits{0};
+    double priority{0};  // GDSF, the lowest is evicted first
+    llama_pos swa_pos_min{0};  // first position its sliding window layers still hold, see ChunkInferCache::swa_holds
+    uint32_t swa_epoch{0};     // content version, a stale swa_pos_min measure is dropped
 
-    int32_t reference_count;
+    std::chrono::steady_clock::time_point last_access;  // Last access time
 
-    CacheEntry() : reference_count(0), pos_begin{-1}, pos_end{-1}, last_token{-1} {}
+    CacheSeq(int32_t seq_id) : cache_seq_id(seq_id), n_pos(0) {}
 };
 
-struct SeqEntryList {
-    int32_t cache_seq_id;
-    llama_pos last_pos;  // n_past
-    std::vector<std::shared_ptr<CacheEntry>> seq_entries;
+// Evicted cache sequence kept in host memory, paged back into a cache sequence on hit
+struct HostCacheSeq {
+    int32_t host_id;  // radix tree id, above every llama sequence id
+    std::vector<PrefixItem> items;
+    llama_pos n_pos;
+    std::string session;
+    int32_t task_class{-1};
+    std::shared_ptr<std::vector<uint8_t>> kv;  // llama_state_seq data, filled on the memory thread
+    size_t kv_size{0};
+    bool ready{false};  // kv filled by the memory thread
+    uint32_t n_hits{0};
+    double priority{0};
+    llama_pos swa_pos_min{0};
+
+    std::chrono::steady_clock::time_point last_access;
+};
 
-    std::chrono::steady_clock::time_point last_access;  // Last access time
+// Prefix lookups of ChunkInferCache, reported by llama_mico_get_metrics
+struct KvCacheStats {
+    size_t hits{0};         // prefix copied from a cache sequence
+    size_t host_hits{0};    // prefix paged in from the host tier
+    size_t misses{0};
+    size_t reused_pos{0};   // kv positions copied instead of prefilled
+    size_t queried_pos{0};  // kv positions of the looked up prompts
+    size_t n_cache_pos{0};  // kv positions held by the cache sequences
+    size_t stores{0};       // prompts and session turns stored
+    size_t evictions{0};    // cache sequences cleared for another prompt
+    size_t spills{0};       // evicted cache sequences kept in the host tier
+    size_t host_bytes{0};
+};
 
-    SeqEntryList(int32_t seq_id) : cache_seq_id(seq_id), last_pos(0) {}
+// Prompt held by the cache, see ChunkInferCache::entries
+struct CacheEntry {
+    std::vector<PrefixItem> items;
+    std::string session;
+    double priority;
+    bool pinned;
 };
 
+// Token level prefix cache, any common prefix with a stored prompt is reused down to the token
 class ChunkInferCache {
   public:
     ChunkInferCache(size_t max_cache_seq, LlamaMicoContext* context);
     ~ChunkInferCache();
 
-    bool prepare(std::string& chunk_hash);
-    void unprepared(std::string& chunk_hash);
-
-    bool store(std::vector<std::string> chunk_hashs, size_t chunk_id, llama_seq_id seq_id, llama_token last_token,
-               int32_t n_past);
-
-    std::shared_ptr<CacheEntry> lookup(std::string chunk_hash);
-    bool apply_cache_entry(const std::shared_ptr<CacheEntry>& entry, llama_seq_id target_seq_id);
-
-    bool waiting(std::string chunk_hash);
-    bool storing(std::string chunk_hash);
-
-    void block_waiting(std::string chunk_hash);
-    void block_waiting_and_prepare(std::string chunk_hash);
+    // Copies the kv of the longest stored prefix of items[0, max_items) into target_seq_id,
+    // returns the number of reused items and their kv positions in n_pos
+    size_t apply_prefix(const std::vector<PrefixItem>& items, size_t max_items, llama_seq_id target_seq_id,
+                        llama_pos& n_pos);
+    // Longest stored prefix of items[0, max_items) without copying it, priority is the lowest GDSF priority of the
+    // resident sequences holding it (evicted first), infinity if it is only in the host tier
+    size_t peek_prefix(const std::vector<PrefixItem>& items, size_t max_items, double& priority) const;
+
+    // Stores the kv of items, already inferred in seq_id, by a prompt of task_class (TaskClass). A pinned prompt is
+    // never evicted, the lowest priority pin is dropped past the pin limit
+    bool store(const std::vector<PrefixItem>& items, llama_seq_id seq_id, int32_t task_class, bool pinned = false);
+
+    // Keeps the kv of a finished session turn, only the part diverging from the last turn is copied
+    bool store_session(const std::string& session, const std::vector<PrefixItem>& items, llama_seq_id seq_id);
+    void release_session(const std::string& session);
+    bool has_session(const std::string& session) const;  // its kv is resident or in the host tier
+    // Session kv and history in a buffer another instance of the model imports, false if the session is not cached
+    bool export_session(const std::string& session, std::vector<uint8_t>& out);
+    // Stores an exported session as if its last turn ran here, replacing one of the same id, whose id is returned
+    bool import_session(const uint8_t* data, size_t size, std::string& session);
+
+    // Embedding cache told which images the stored prompts hold kv of, so it evicts their embeddings first
+    void set_modal_cache(std::shared_ptr<ModalEmbeddingCache> modal_cache);
+
+    KvCacheStats stats() const;
+    // Prompts of the cache sequences and the host tier, highest priority first
+    std::vector<CacheEntry> entries() const;
 
   private:
-    bool serialize_kv_cache_state(llama_seq_id src_seq_id, llama_seq_id dst_seq_id, llama_pos pos_begin);
-    bool deserialize_kv_cache_state(llama_seq_id src_seq_id, llama_seq_id dst_seq_id, llama_pos pos_end);
-
-    // Maintain cache size
-    void maintain();
+    // Snapshot of the cache sequences and their kv, run on the memory thread
+    void save_snapshot(const std::string& path);
+    void load_snapshot(const std::string& path);
+
+    // Radix tree entries of the cache and host sequences, their images are covered in the embedding cache,
+    // NOTE: cache_mutex_ must be held
+    void index(const std::vector<PrefixItem>& items, int32_t id);
+    void unindex(const std::vector<PrefixItem>& items, int32_t id);
+    void link_modal_cache(std::shared_ptr<ModalEmbeddingCache> modal_cache);
+
+    CacheSeq* find_cache_seq(int32_t cache_seq_id);
+    CacheSeq* find_session_seq(const std::string& session);
+    // Empty or lowest priority unpinned sequence, within task_class once the class holds its cap (-1 for no class)
+    CacheSeq* evict_cache_seq(int32_t task_class = -1);
+    void pin(CacheSeq& cache_seq);  // NOTE: cache_mutex_ must be held
+
+    // GDSF: clock_ + recompute cost x frequency / kv size, NOTE: cache_mutex_ must be held
+    double gdsf_priority(const std::vector<PrefixItem>& items, llama_pos n_pos, uint32_t n_hits) const;
+    void touch(CacheSeq& cache_seq);  // hit
+    void reset_priority(CacheSeq& cache_seq);  // new content
+
+    // Sliding window models (iSWA): a sequence pruned its SWA layers below the window of its last position, a stored
+    // prefix is reusable up to n_pos only if they still hold the window before n_pos, else it is recomputed
+    bool swa_holds(llama_pos pos_min, llama_pos n_pos) const {
+        return swa_window_ <= 0 || pos_min <= std::max<llama_pos>(0, n_pos - swa_window_);
+    }
+    llama_pos seq_swa_pos_min(int32_t seq_id) const;  // NOTE: runs on the memory thread
+    // Measures swa_pos_min once the queued copies into cache_seq ran, never reused meanwhile,
+    // NOTE: cache_mutex_ must be held
+    void track_swa(CacheSeq& cache_seq);
+    // Resident sequence holding the longest SWA reusable prefix of items[0, max_items) and its item count,
+    // NOTE: cache_mutex_ must be held
+    CacheSeq* swa_fallback(const std::vector<PrefixItem>& items, size_t max_items, size_t& n_items);
+
+    // Host tier, NOTE: cache_mutex_ must be held
+    void spill_to_host(const CacheSeq& cache_seq);
+    CacheSeq* page_in(int32_t host_id, std::future<bool>& loaded, llama_seq_id target_seq_id, llama_pos n_pos);
+    void trim_host();
 
     llama_context* context_;
     llama_model* model_;
     LlamaMemoryScheduler* memory_scheduler_;
-
-    std::unordered_set<std::string> cache_wait_set_;
-    std::unordered_map<std::string, std::shared_ptr<CacheEntry>> cache_map_;
-    std::unordered_map<size_t, std::shared_ptr<SeqEntryList>> use_seq_mem_;
+    std::string snapshot_path_;
+    llama_pos swa_window_{0};  // 0 without a sliding window or with a full size SWA cache
+
+    RadixTree tree_;
+    std::shared_ptr<ModalEmbeddingCache> modal_cache_;
+    std::vector<CacheSeq> cache_seqs_;
+    std::list<HostCacheSeq> host_seqs_;
+    int32_t max_pinned_{0};
+    int32_t class_caps_[TASK_CLASS_COUNT];  // cache sequences each task class may hold
+    size_t host_budget_{0};  // bytes
+    size_t host_bytes_{0};
+    int32_t next_host_id_{0};
+    double clock_{0};  // GDSF inflation, priority of the last evicted sequence
+    KvCacheStats stats_;
     mutable std::mutex cache_mutex_;
-    std::condition_variable stored_condition_;
 };
 
-#endif  // CHUNK_INFER_CACHE_H
\ No newline at end of file
+#endif  // CHUNK_INFER_CACHE_H
@@ -0,0 +1,224 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "embd-disk-tier.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "common/log.h"
+
+#define EMBD_DISK_MAGIC 0x424d4545          // "EEMB", segment header
+#define EMBD_DISK_RECORD_MAGIC 0x52424d45   // "EMBR", record header
+#define EMBD_DISK_VERSION 1
+#define EMBD_DISK_MIN_SEGMENT_MB 8
+
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t version;
+    EmbdDiskRecord record;
+};
+
+static size_t align_up(size_t n) { return (n + EMBD_DISK_ALIGN - 1) / EMBD_DISK_ALIGN * EMBD_DISK_ALIGN; }
+
+EmbdDiskTier::EmbdDiskTier(const std::string& dir, size_t max_bytes, const std::string& signature)
+    : dir_(dir), signature_(signature), max_bytes_(max_bytes) {
+    segment_bytes_ = std::min<size_t>((size_t)EMBD_DISK_SEGMENT_MB << 20, max_bytes / 4);
+    segment_bytes_ = std::max<size_t>(segment_bytes_, (size_t)EMBD_DISK_MIN_SEGMENT_MB << 20);
+    header_bytes_ = align_up(3 * sizeof(uint32_t) + signature_.size());
+    char prefix[32];
+    HashKey signature_key = hash_bytes(signature.data(), signature.size());
+    snprintf(prefix, sizeof(prefix), "embd-%016llx-", (unsigned long long)signature_key.lo);
+    prefix_ = prefix;
+    mkdir(dir_.c_str(), 0755);  // NOTE: the parent must exist
+
+    // NOTE: two tiers appending to the same segments would overwrite each other's records
+    std::string lock_path = dir_ + "/embd.lock";
+    lock_fd_ = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd_ < 0 || flock(lock_fd_, LOCK_EX | LOCK_NB) != 0) {
+        LOG_WRN("%s: %s is used by another process or cache, disk tier off\n", __func__, dir_.c_str());
+        if (lock_fd_ >= 0) close(lock_fd_);
+        lock_fd_ = -1;
+        return;
+    }
+
+    std::vector<uint64_t> ids;
+    if (DIR* d = opendir(dir_.c_str())) {
+        while (dirent* entry = readdir(d)) {
+            unsigned long long id = 0;
+            char tail = 0;
+            if (strncmp(entry->d_name, prefix_.c_str(), prefix_.size()) != 0) continue;  // another model
+            if (sscanf(entry->d_name + prefix_.size(), "%llu.se%c", &id, &tail) == 2 && tail == 'g') ids.push_back(id);
+        }
+        closedir(d);
+    }
+    std::sort(ids.begin(), ids.end());
+    if (!ids.empty()) next_id_ = ids.back() + 1;
+    for (uint64_t id : ids) open_segment(id, false /* create */);
+    while (segments_.size() * segment_bytes_ > max_bytes_ && segments_.size() > 1) drop_oldest();
+    LOG_INF("%s: %s, %zu spilled embeddings in %zu segments, %zu of %zu MB\n", __func__, dir_.c_str(), index_.size(),
+            segments_.size(), bytes() >> 20, max_bytes_ >> 20);
+}
+
+EmbdDiskTier::~EmbdDiskTier() {
+    for (auto& segment : segments_) close_segment(segment, false /* remove */);
+    if (lock_fd_ >= 0) close(lock_fd_);  // NOTE: releases the flock
+}
+
+std::string EmbdDiskTier::segment_path(uint64_t id) const {
+    char name[32];
+    snprintf(name, sizeof(name), "%08llu.seg", (unsigned long long)id);
+    return dir_ + "/" + prefix_ + name;
+}
+
+bool EmbdDiskTier::open_segment(uint64_t id, bool create) {
+    std::string path = segment_path(id);
+    Segment segment;
+    segment.id = id;
+    segment.fd = open(path.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+    if (segment.fd < 0) {
+        LOG_WRN("%s: failed to open %s\n", __func__, path.c_str());
+        return false;
+    }
+    uint32_t header[3] = {EMBD_DISK_MAGIC, EMBD_DISK_VERSION, (uint32_t)signature_.size()};
+    std::vector<char> expected(header_bytes_, 0);
+    memcpy(expected.data(), header, sizeof(header));
+    memcpy(expected.data() + sizeof(header), signature_.data(), signature_.size());
+    struct stat st;
+    if (create) {
+        bool ok = ftruncate(segment.fd, (off_t)segment_bytes_) == 0 &&
+                  pwrite(segment.fd, expected.data(), header_bytes_, 0) == (ssize_t)header_bytes_;
+        if (!ok) {
+            LOG_WRN("%s: failed to create %s\n", __func__, path.c_str());
+            close_segment(segment, true /* remove */);
+            return false;
+        }
+        segment.size = segment_bytes_;
+    } else {
+        std::vector<char> found(header_bytes_, 0);
+        bool ok = fstat(segment.fd, &st) == 0 && (size_t)st.st_size >= header_bytes_ &&
+                  pread(segment.fd, found.data(), header_bytes_, 0) == (ssize_t)header_bytes_ && found == expected;
+        // NOTE: magic and version match, the signature hashes of two models collide, the segment is not ours
+        if (!ok && memcmp(found.data(), expected.data(), 2 * sizeof(uint32_t)) == 0) {
+            LOG_WRN("%s: skipping %s, written for another model\n", __func__, path.c_str());
+            close_segment(segment, false /* remove */);
+            return false;
+        }
+        if (!ok) {  // another version or a torn header
+            LOG_WRN("%s: removing %s, torn or of another version\n", __func__, path.c_str());
+            close_segment(segment, true /* remove */);
+            return false;
+        }
+        segment.size = (size_t)st.st_size;
+    }
+    void* map = mmap(nullptr, segment.size, PROT_READ, MAP_SHARED, segment.fd, 0);
+    if (map == MAP_FAILED) {
+        LOG_WRN("%s: failed to map %s\n", __func__, path.c_str());
+        close_segment(segment, false /* remove */);
+        return false;
+    }
+    segment.map = static_cast<uint8_t*>(map);
+    segment.end = header_bytes_;
+    if (!create) scan_segment(segment);
+    segments_.push_back(segment);
+    return true;
+}
+
+// Index of the records of a segment written before, up to the first torn one
+void EmbdDiskTier::scan_segment(Segment& segment) {
+    size_t offset = header_bytes_;
+    while (offset + sizeof(RecordHeader) <= segment.size) {
+        RecordHeader header;
+        memcpy(&header, segment.map + offset, sizeof(header));
+        size_t payload = align_up(sizeof(RecordHeader));
+        if (header.magic != EMBD_DISK_RECORD_MAGIC || header.version != EMBD_DISK_VERSION ||
+            header.record.n_bytes > segment.size - offset - payload)
+            break;
+        index_[header.record.key] = {segment.id, offset};  // NOTE: a later record of a key wins
+        offset = align_up(offset + payload + header.record.n_bytes);
+    }
+    segment.end = std::min(offset, segment.size);
+}
+
+void EmbdDiskTier::close_segment(Segment& segment, bool remove) {
+    if (segment.map) munmap(segment.map, segment.size);
+    if (segment.fd >= 0) close(segment.fd);
+    if (remove) unlink(segment_path(segment.id).c_str());
+    segment.map = nullptr;
+    segment.fd = -1;
+}
+
+void EmbdDiskTier::drop_oldest() {
+    Segment& oldest = segments_.front();
+    for (auto it = index_.begin(); it != index_.end();) {
+        if (it->second.segment == oldest.id)
+            it = index_.erase(it);
+        else
+            ++it;
+    }
+    close_segment(oldest, true /* remove */);
+    segments_.pop_front();
+}
+
+bool EmbdDiskTier::contains(const HashKey& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return index_.count(key) > 0;
+}
+
+bool EmbdDiskTier::spill(const EmbdDiskRecord& record, const void* payload) {
+    size_t header_bytes = align_up(sizeof(RecordHeader));
+    size_t n_bytes = header_bytes + record.n_bytes;
+    if (n_bytes > segment_bytes_ - header_bytes_) return false;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (lock_fd_ < 0) return false;
+    if (index_.count(record.key) > 0) return true;  // faulted back and evicted again
+    if (segments_.empty() || segments_.back().end + n_bytes > segments_.back().size) {
+        while (!segments_.empty() && (segments_.size() + 1) * segment_bytes_ > max_bytes_) drop_oldest();
+        if (!open_segment(next_id_++, true /* create */)) return false;
+    }
+    Segment& segment = segments_.back();
+    std::vector<uint8_t> header(header_bytes, 0);
+    RecordHeader record_header{EMBD_DISK_RECORD_MAGIC, EMBD_DISK_VERSION, record};
+    memcpy(header.data(), &record_header, sizeof(record_header));
+    // NOTE: payload first, a crash in between leaves no valid header behind the last record
+    if (pwrite(segment.fd, payload, record.n_bytes, (off_t)(segment.end + header_bytes)) != (ssize_t)record.n_bytes ||
+        pwrite(segment.fd, header.data(), header_bytes, (off_t)segment.end) != (ssize_t)header_bytes) {
+        LOG_WRN("%s: failed to write %zu bytes to %s\n", __func__, n_bytes, segment_path(segment.id).c_str());
+        return false;
+    }
+    index_[record.key] = {segment.id, segment.end};
+    segment.end = align_up(segment.end + n_bytes);
+    return true;
+}
+
+const uint8_t* EmbdDiskTier::find(const HashKey& key, EmbdDiskRecord& record) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end()) return nullptr;
+    for (const auto& segment : segments_) {
+        if (segment.id != it->second.segment) continue;
+        RecordHeader header;
+        memcpy(&header, segment.map + it->second.offset, sizeof(header));
+        record = header.record;
+        return segment.map + it->second.offset + align_up(sizeof(RecordHeader));
+    }
+    return nullptr;
+}
+
+size_t EmbdDiskTier::bytes() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t n_bytes = 0;
+    for (const auto& segment : segments_) n_bytes += segment.end;
+    return n_bytes;
+}
@@ -0,0 +1,85 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef EMBD_DISK_TIER_H
+#define EMBD_DISK_TIER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "utils/chunk-hash.h"
+
+#define EMBD_DISK_SEGMENT_MB 256  // largest segment file, a quarter of the tier if that is smaller
+#define EMBD_DISK_ALIGN 64        // records start at this alignment in a segment
+
+// Metadata of a spilled embedding, the payload is the stored ModalEmbd bytes
+struct EmbdDiskRecord {
+    HashKey key;
+    int32_t precision{0};  // EmbdPrecision
+    uint32_t nx{0}, ny{0};
+    float encode_ms{0};
+    uint64_t n_values{0};
+    uint64_t n_row{1};
+    uint64_t n_bytes{0};
+};
+
+// Spill tier of the embedding cache on local disk: entries evicted from memory are appended to segment files of a
+// directory, each mapped read only, and an index from the key to the record faults them back on a miss. The oldest
+// segment is dropped when the tier is full (FIFO, an entry faulted back and evicted again is not written twice). The
+// index is rebuilt from the segments at start, so scenes that repeat across days survive a restart. The directory is
+// held by one tier (flock of embd.lock), the segment names carry the model signature and segments written for another
+// model are never touched
+class EmbdDiskTier {
+  public:
+    EmbdDiskTier(const std::string& dir, size_t max_bytes, const std::string& signature);
+    ~EmbdDiskTier();
+
+    bool owned() const { return lock_fd_ >= 0; }  // false if another tier holds the directory, nothing is spilled
+
+    bool contains(const HashKey& key);
+    // Appends a record, payload holds record.n_bytes, false if it could not be written
+    bool spill(const EmbdDiskRecord& record, const void* payload);
+    // Record of key and its mapped payload, valid until the next spill, nullptr if not spilled
+    const uint8_t* find(const HashKey& key, EmbdDiskRecord& record);
+
+    size_t bytes();
+
+  private:
+    struct Segment {
+        uint64_t id{0};
+        int fd{-1};
+        uint8_t* map{nullptr};
+        size_t size{0};  // file and mapping
+        size_t end{0};   // append offset
+    };
+    struct Location {
+        uint64_t segment;
+        size_t offset;  // of the record header
+    };
+
+    bool open_segment(uint64_t id, bool create);
+    void scan_segment(Segment& segment);
+    void drop_oldest();
+    void close_segment(Segment& segment, bool remove);
+    std::string segment_path(uint64_t id) const;
+
+    std::string dir_;
+    std::string signature_;
+    std::string prefix_;  // segment names, "embd-<signature hash>-"
+    int lock_fd_{-1};
+    uint64_t next_id_{0};
+    size_t max_bytes_{0};
+    size_t segment_bytes_{0};
+    size_t header_bytes_{0};
+
+    std::mutex mutex_;
+    std::deque<Segment> segments_;  // oldest first, the last one is appended to
+    std::unordered_map<HashKey, Location, HashKeyHasher> index_;
+};
+
+#endif  // EMBD_DISK_TIER_H
@@ -0,0 +1,196 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "embd-shm-tier.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#include "common/log.h"
+
+#define EMBD_SHM_MAGIC 0x4d534545  // "EESM"
+#define EMBD_SHM_VERSION 1
+#define EMBD_SHM_MIN_SLOTS 1024
+#define EMBD_SHM_PAGE 4096
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the shared index needs lock free 64 bit atomics");
+
+struct EmbdShmTier::Header {
+    uint32_t magic;
+    uint32_t version;
+    HashKey signature;
+    uint64_t n_slots;
+    uint64_t capacity;           // ring bytes
+    std::atomic<uint64_t> head;  // ring bytes reserved so far, never wraps, the position modulo capacity is the offset
+    std::atomic<uint32_t> ready;
+};
+
+struct alignas(64) EmbdShmTier::Slot {
+    std::atomic<uint64_t> seq;  // odd while a writer holds the slot
+    uint64_t pos;               // ring position of the payload
+    EmbdDiskRecord record;      // empty key if the slot was never written
+};
+
+static size_t align_to(size_t n, size_t align) { return (n + align - 1) / align * align; }
+
+size_t EmbdShmTier::layout(uint64_t n_slots, uint64_t capacity, size_t& slots_offset, size_t& ring_offset) {
+    slots_offset = align_to(sizeof(Header), alignof(Slot));
+    ring_offset = align_to(slots_offset + n_slots * sizeof(Slot), EMBD_SHM_PAGE);
+    return ring_offset + capacity;
+}
+
+EmbdShmTier::EmbdShmTier(size_t max_bytes, const std::string& signature) {
+    HashKey sig = hash_bytes(signature.data(), signature.size());
+    name_ = "/miloco-embd-" + hash_to_hex(sig).substr(0, 16);
+    uint64_t n_slots = std::max<uint64_t>(EMBD_SHM_MIN_SLOTS, max_bytes / EMBD_SHM_SLOT_BYTES);
+    uint64_t capacity = align_to(max_bytes, EMBD_SHM_PAGE);
+    size_t slots_offset = 0, ring_offset = 0;
+
+    bool create = true;
+    int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        create = false;
+        fd = shm_open(name_.c_str(), O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        LOG_WRN("%s: failed to open shared memory %s: %s\n", __func__, name_.c_str(), strerror(errno));
+        return;
+    }
+    if (create) {
+        map_bytes_ = layout(n_slots, capacity, slots_offset, ring_offset);
+        if (ftruncate(fd, (off_t)map_bytes_) != 0) {
+            LOG_WRN("%s: failed to size %s to %zu MB\n", __func__, name_.c_str(), map_bytes_ >> 20);
+            close(fd);
+            shm_unlink(name_.c_str());
+            return;
+        }
+    } else {  // NOTE: the creator may not have sized it yet, the sizes are the ones it chose
+        struct stat st;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(EMBD_SHM_ATTACH_MS);
+        while (fstat(fd, &st) == 0 && (size_t)st.st_size < sizeof(Header) &&
+               std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        map_bytes_ = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    }
+    void* map = map_bytes_ >= sizeof(Header) ? mmap(nullptr, map_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                                             : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        LOG_WRN("%s: failed to map shared memory %s\n", __func__, name_.c_str());
+        map_bytes_ = 0;
+        return;
+    }
+    map_ = map;
+    header_ = static_cast<Header*>(map_);
+
+    if (create) {  // NOTE: the pages are zero, every slot is empty and unlocked
+        new (header_) Header();
+        header_->magic = EMBD_SHM_MAGIC;
+        header_->version = EMBD_SHM_VERSION;
+        header_->signature = sig;
+        header_->n_slots = n_slots;
+        header_->capacity = capacity;
+        header_->ready.store(1, std::memory_order_release);
+    } else {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(EMBD_SHM_ATTACH_MS);
+        while (header_->ready.load(std::memory_order_acquire) == 0 && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        n_slots = header_->n_slots;
+        capacity = header_->capacity;
+        bool ok = header_->ready.load(std::memory_order_acquire) == 1 && header_->magic == EMBD_SHM_MAGIC &&
+                  header_->version == EMBD_SHM_VERSION && header_->signature == sig &&
+                  layout(n_slots, capacity, slots_offset, ring_offset) == map_bytes_;
+        if (!ok) {  // a creator that died half way or another version, removing it is left to the operator
+            LOG_WRN("%s: shared memory %s is not a usable embedding segment, not shared\n", __func__, name_.c_str());
+            return;
+        }
+    }
+    n_slots_ = n_slots;
+    capacity_ = capacity;
+    slots_ = reinterpret_cast<Slot*>(static_cast<uint8_t*>(map_) + slots_offset);
+    ring_ = static_cast<uint8_t*>(map_) + ring_offset;
+    LOG_INF("%s: %s embeddings shared in %s, %" PRIu64 " MB, %" PRIu64 " slots\n", __func__,
+            create ? "created" : "attached", name_.c_str(), capacity_ >> 20, n_slots_);
+}
+
+EmbdShmTier::~EmbdShmTier() {
+    if (map_) munmap(map_, map_bytes_);  // NOTE: not unlinked, other processes and the next start keep using it
+}
+
+bool EmbdShmTier::live(uint64_t pos) const {
+    // NOTE: a payload is overwritten once a reservation ends a whole ring past its start
+    return header_->head.load(std::memory_order_acquire) <= pos + capacity_;
+}
+
+bool EmbdShmTier::publish(const EmbdDiskRecord& record, const void* payload) {
+    size_t n_bytes = align_to(record.n_bytes, EMBD_DISK_ALIGN);
+    if (!ring_ || record.key.empty() || n_bytes > capacity_ / 4) return false;
+
+    uint64_t head = header_->head.load(std::memory_order_relaxed);
+    uint64_t pos = 0;
+    do {  // a payload never wraps, it starts the next lap if it does not fit the rest of this one
+        pos = head % capacity_ + n_bytes > capacity_ ? (head / capacity_ + 1) * capacity_ : head;
+    } while (!header_->head.compare_exchange_weak(head, pos + n_bytes, std::memory_order_acq_rel));
+    memcpy(ring_ + pos % capacity_, payload, record.n_bytes);
+
+    // The slot of the key, else an empty one, else the oldest of the probed ones
+    size_t first = HashKeyHasher()(record.key) % n_slots_;
+    Slot* victim = nullptr;
+    for (size_t i = 0; i < EMBD_SHM_PROBES; i++) {
+        Slot* slot = &slots_[(first + i) % n_slots_];
+        if (slot->record.key == record.key || slot->record.key.empty()) {
+            victim = slot;
+            break;
+        }
+        if (!victim || slot->pos < victim->pos) victim = slot;
+    }
+    uint64_t seq = victim->seq.load(std::memory_order_relaxed);
+    if ((seq & 1) || !victim->seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire)) return false;
+    std::atomic_thread_fence(std::memory_order_release);
+    victim->pos = pos;
+    victim->record = record;
+    victim->seq.store(seq + 2, std::memory_order_release);
+    return true;
+}
+
+bool EmbdShmTier::find(const HashKey& key, EmbdDiskRecord& record, uint64_t& pos) const {
+    if (!ring_ || key.empty()) return false;
+    size_t first = HashKeyHasher()(key) % n_slots_;
+    for (size_t i = 0; i < EMBD_SHM_PROBES; i++) {
+        const Slot& slot = slots_[(first + i) % n_slots_];
+        uint64_t seq = slot.seq.load(std::memory_order_acquire);
+        if (seq & 1) continue;
+        EmbdDiskRecord found = slot.record;
+        uint64_t found_pos = slot.pos;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq || found.key != key) continue;
+        if (!live(found_pos)) return false;
+        record = found;
+        pos = found_pos;
+        return true;
+    }
+    return false;
+}
+
+bool EmbdShmTier::read(uint64_t pos, size_t n_bytes, void* dst) const {
+    if (!ring_ || pos % capacity_ + n_bytes > capacity_) return false;
+    memcpy(dst, ring_ + pos % capacity_, n_bytes);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return live(pos);
+}
+
+size_t EmbdShmTier::bytes() const {
+    return ring_ ? std::min<uint64_t>(header_->head.load(std::memory_order_relaxed), capacity_) : 0;
+}
@@ -0,0 +1,59 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef EMBD_SHM_TIER_H
+#define EMBD_SHM_TIER_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "embd-disk-tier.h"
+
+#define EMBD_SHM_PROBES 8               // index slots a key may take, from its hash on
+#define EMBD_SHM_SLOT_BYTES (64 << 10)  // ring bytes per index slot
+#define EMBD_SHM_ATTACH_MS 2000         // wait for another process initialising the segment
+
+// Embeddings shared by every engine process and handle of a host using the same mmproj, in a named POSIX shared
+// memory segment: a ring of payloads written in order and an open addressing index of seqlocked slots, no lock is
+// taken across processes. A writer reserves ring bytes with a CAS on the head, copies the payload and then publishes
+// its slot, a reader copies the payload out and keeps it only if the head has not lapped it meanwhile. The oldest
+// payloads are overwritten as the ring wraps. The segment outlives the processes (a restart finds it warm), it is
+// named from the signature so handles of another mmproj never attach to it
+class EmbdShmTier {
+  public:
+    EmbdShmTier(size_t max_bytes, const std::string& signature);
+    ~EmbdShmTier();
+
+    bool attached() const { return ring_ != nullptr; }
+    // Copies a payload of record.n_bytes into the ring and indexes it, false if it is too large or the slots are busy
+    bool publish(const EmbdDiskRecord& record, const void* payload);
+    // Record of key and the ring position of its payload, false if not published or overwritten
+    bool find(const HashKey& key, EmbdDiskRecord& record, uint64_t& pos) const;
+    // Copies a payload found before to dst, false if it was overwritten meanwhile (dst is garbage then)
+    bool read(uint64_t pos, size_t n_bytes, void* dst) const;
+
+    size_t bytes() const;
+    const std::string& name() const { return name_; }
+
+  private:
+    struct Header;
+    struct Slot;
+
+    // Bytes of a segment and the offsets of its slots and ring
+    static size_t layout(uint64_t n_slots, uint64_t capacity, size_t& slots_offset, size_t& ring_offset);
+    bool live(uint64_t pos) const;
+
+    std::string name_;
+    void* map_{nullptr};
+    size_t map_bytes_{0};
+    Header* header_{nullptr};
+    Slot* slots_{nullptr};
+    uint8_t* ring_{nullptr};
+    uint64_t n_slots_{0};
+    uint64_t capacity_{0};
+};
+
+#endif  // EMBD_SHM_TIER_H
@@ -0,0 +1,108 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "embd-slab.h"
+
+#include <sys/mman.h>
+
+#include "common/log.h"
+
+EmbdSlab::EmbdSlab(size_t capacity) {
+    capacity_ = capacity / EMBD_SLAB_UNIT * EMBD_SLAB_UNIT;
+    if (capacity_ == 0) return;
+    ggml_backend_dev_t gpu = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_GPU);
+    ggml_backend_buffer_type_t buft = gpu ? ggml_backend_dev_host_buffer_type(gpu) : nullptr;
+    if (buft) pinned_ = ggml_backend_buft_alloc_buffer(buft, capacity_);
+    if (pinned_) {
+        base_ = static_cast<uint8_t*>(ggml_backend_buffer_get_base(pinned_));
+    } else {  // NOTE: pages are only backed as the cache fills
+        capacity_ = (capacity_ + EMBD_SLAB_HUGEPAGE - 1) / EMBD_SLAB_HUGEPAGE * EMBD_SLAB_HUGEPAGE;
+        mapped_ = mmap(nullptr, capacity_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mapped_ == MAP_FAILED) {
+            LOG_ERR("%s: failed to reserve %zu MB\n", __func__, capacity_ >> 20);
+            mapped_ = nullptr;
+            capacity_ = 0;
+            return;
+        }
+#ifdef MADV_HUGEPAGE
+        madvise(mapped_, capacity_, MADV_HUGEPAGE);
+#endif
+        base_ = static_cast<uint8_t*>(mapped_);
+    }
+    insert_free(0, capacity_);
+    LOG_INF("%s: %zu MB of embeddings in %s memory\n", __func__, capacity_ >> 20,
+            pinned_ ? ggml_backend_buft_name(buft) : "mapped");
+}
+
+EmbdSlab::~EmbdSlab() {
+    if (pinned_) ggml_backend_buffer_free(pinned_);
+    if (mapped_) munmap(mapped_, capacity_);
+}
+
+size_t EmbdSlab::size_class(size_t bytes) {
+    bytes = std::max<size_t>(bytes, 1);
+    if (bytes <= EMBD_SLAB_SMALL) return (bytes + EMBD_SLAB_UNIT - 1) / EMBD_SLAB_UNIT * EMBD_SLAB_UNIT;
+    size_t step = ((size_t)1 << (63 - __builtin_clzll(bytes))) / EMBD_SLAB_CLASS_STEPS;
+    return (bytes + step - 1) / step * step;
+}
+
+EmbdSlab::Block EmbdSlab::allocate(size_t bytes) {
+    Block block;
+    size_t size = size_class(bytes);
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto fit = free_by_size_.lower_bound(size);
+    if (fit == free_by_size_.end()) return block;
+    size_t offset = fit->second;
+    size_t free_size = fit->first;
+    erase_free(free_by_offset_.find(offset));
+    if (free_size > size) insert_free(offset + size, free_size - size);
+    used_ += size;
+    block.data = base_ + offset;
+    block.size = size;
+    return block;
+}
+
+void EmbdSlab::free(const Block& block) {
+    if (!block.data) return;
+    size_t offset = block.data - base_;
+    size_t size = block.size;
+    std::lock_guard<std::mutex> lock(mutex_);
+    used_ -= size;
+    auto next = free_by_offset_.lower_bound(offset);
+    if (next != free_by_offset_.end() && next->first == offset + size) {  // Coalesce with the neighbours
+        size += next->second;
+        next = std::next(next);
+        erase_free(std::prev(next));
+    }
+    if (next != free_by_offset_.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            offset = prev->first;
+            size += prev->second;
+            erase_free(prev);
+        }
+    }
+    insert_free(offset, size);
+}
+
+size_t EmbdSlab::used() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return used_;
+}
+
+void EmbdSlab::insert_free(size_t offset, size_t size) {
+    free_by_offset_[offset] = size;
+    free_by_size_.emplace(size, offset);
+}
+
+void EmbdSlab::erase_free(std::map<size_t, size_t>::iterator it) {
+    auto range = free_by_size_.equal_range(it->second);
+    for (auto s = range.first; s != range.second; ++s) {
+        if (s->second != it->first) continue;
+        free_by_size_.erase(s);
+        break;
+    }
+    free_by_offset_.erase(it);
+}
@@ -0,0 +1,57 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef EMBD_SLAB_H
+#define EMBD_SLAB_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+
+#include "ggml-backend.h"
+
+#define EMBD_SLAB_UNIT (4 << 10)       // smallest size class, the alignment of every block
+#define EMBD_SLAB_SMALL (64 << 10)     // up to it the classes are EMBD_SLAB_UNIT apart
+#define EMBD_SLAB_CLASS_STEPS 4        // size classes per power of two above EMBD_SLAB_SMALL, <= 25% rounding
+#define EMBD_SLAB_HUGEPAGE (2 << 20)   // alignment of a mapped reservation
+
+// Storage of cached embeddings in one reservation made at init, so churn never grows the heap past the cache budget.
+// Sizes round up to a size class and free blocks coalesce with their neighbours: the embeddings of one image size and
+// precision share a class and reuse each other's blocks exactly. The reservation is pinned host memory of the first
+// GPU if there is one (ready for an async upload), else an anonymous mapping backed by transparent hugepages
+class EmbdSlab {
+  public:
+    struct Block {
+        uint8_t* data{nullptr};  // nullptr if no free block fits
+        size_t size{0};          // size class, the bytes accounted
+    };
+
+    explicit EmbdSlab(size_t capacity);
+    ~EmbdSlab();  // NOTE: after the last block is freed
+
+    Block allocate(size_t bytes);
+    void free(const Block& block);
+
+    size_t capacity() const { return capacity_; }
+    size_t used() const;
+
+    static size_t size_class(size_t bytes);
+
+  private:
+    void insert_free(size_t offset, size_t size);  // NOTE: mutex_ must be held
+    void erase_free(std::map<size_t, size_t>::iterator it);
+
+    ggml_backend_buffer_t pinned_{nullptr};
+    void* mapped_{nullptr};
+    uint8_t* base_{nullptr};
+    size_t capacity_{0};
+
+    mutable std::mutex mutex_;
+    std::map<size_t, size_t> free_by_offset_;     // offset -> size
+    std::multimap<size_t, size_t> free_by_size_;  // size -> offset, best fit
+    size_t used_{0};
+};
+
+#endif  // EMBD_SLAB_H
@@ -0,0 +1,96 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "image-kv-cache.h"
+
+#include "utils/mico-log.h"
+
+ImageKvCache::ImageKvCache(LlamaMicoContext* context, size_t max_entries)
+    : context_(context),
+      memory_(llama_get_memory(context->lctx)),
+      seq_id_(context->image_kv_seq),
+      max_entries_(max_entries),
+      slot_base_((llama_pos)llama_n_ctx(context->lctx)),
+      slot_stride_(context->n_batch) {
+    for (int32_t slot = (int32_t)max_entries - 1; slot >= 0; slot--) free_slots_.push_back(slot);
+    LOG_INF("Image kv cache of %zu spans in sequence %d\n", max_entries, seq_id_);
+}
+
+ImageKvCache::~ImageKvCache() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    LOG_INF("Image kv cache destroyed, %zu hits\n", n_hits_);
+}
+
+ImageKvCache::SpanList::iterator ImageKvCache::find(const mtmd_input_chunk* chunk) {
+    HashKey key = modal_chunk_key(chunk);
+    if (key.empty()) return lru_.end();
+    auto it = spans_.find(key);
+    if (it == spans_.end() || it->second->n_tokens != (int32_t)mtmd_input_chunk_get_n_tokens(chunk)) return lru_.end();
+    return it->second;
+}
+
+bool ImageKvCache::acquire(const mtmd_input_chunk* chunk) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto span = find(chunk);
+    if (span == lru_.end()) return false;
+    span->n_pins++;
+    return true;
+}
+
+void ImageKvCache::release(const mtmd_input_chunk* chunk) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto span = find(chunk);
+    if (span != lru_.end()) span->n_pins--;
+}
+
+bool ImageKvCache::insert(const mtmd_input_chunk* chunk, llama_seq_id seq_id, llama_pos pos) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto span = find(chunk);
+    if (span == lru_.end()) return false;
+    span->n_pins--;
+    llama_pos p0 = slot_pos(span->slot);
+    llama_memory_seq_cp(memory_, seq_id_, seq_id, p0, p0 + span->n_pos);
+    llama_memory_seq_add(memory_, seq_id, p0, p0 + span->n_pos, pos - p0);  // NOTE: splits the cells off the slot
+    lru_.splice(lru_.begin(), lru_, span);
+    n_hits_++;
+    LOG_HOT("reuse image kv %s at pos %d of seq %d\n", hash_to_hex(span->key).c_str(), pos, seq_id);
+    return true;
+}
+
+void ImageKvCache::store(const mtmd_input_chunk* chunk, llama_seq_id seq_id, llama_pos p0) {
+    HashKey key = modal_chunk_key(chunk);
+    llama_pos n_pos = mtmd_input_chunk_get_n_pos(chunk);
+    if (key.empty() || n_pos <= 0 || n_pos > slot_stride_) return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto stored = spans_.find(key);
+    if (stored != spans_.end()) {
+        lru_.splice(lru_.begin(), lru_, stored->second);
+        return;
+    }
+    if (free_slots_.empty()) {  // Evict the least recently used unpinned span
+        auto victim = lru_.end();
+        for (auto it = lru_.rbegin(); it != lru_.rend(); ++it) {
+            if (it->n_pins > 0) continue;
+            victim = std::prev(it.base());
+            break;
+        }
+        if (victim == lru_.end()) return;
+        llama_pos victim_p0 = slot_pos(victim->slot);
+        llama_memory_seq_rm(memory_, seq_id_, victim_p0, victim_p0 + slot_stride_);
+        context_->n_image_kv_pos.fetch_sub(victim->n_pos);
+        free_slots_.push_back(victim->slot);
+        spans_.erase(victim->key);
+        lru_.erase(victim);
+    }
+    int32_t slot = free_slots_.back();
+    free_slots_.pop_back();
+    llama_memory_seq_cp(memory_, seq_id, seq_id_, p0, p0 + n_pos);
+    llama_memory_seq_add(memory_, seq_id_, p0, p0 + n_pos, slot_pos(slot) - p0);
+    context_->n_image_kv_pos.fetch_add(n_pos);
+
+    lru_.push_front({key, (int32_t)mtmd_input_chunk_get_n_tokens(chunk), n_pos, slot, 0});
+    spans_[key] = lru_.begin();
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef IMAGE_KV_CACHE_H
+#define IMAGE_KV_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include "utils/chunk-hash.h"
+#include "utils/mico-common.h"
+
+// Position independent kv of images and audio (CacheBlend style): the kv span of a decoded chunk is kept in the
+// reserved sequence context->image_kv_seq and copied to any position of another sequence by a rope shift, so the same
+// frame after another prompt prefix skips encode and decode. The span attended the prefix it was decoded after, so
+// reuse is approximate. Spans are held in slots past every request position: a copy never overlaps the kv the target
+// sequence holds, and the shift splits the copied cells off the slot first (copy on write).
+// M-RoPE: all sections of a span move by the same delta, the kv shift rotates the whole vector (NEOX order) which is
+// exactly that, and a span covers its n_pos positions, not its tokens (an image is one temporal position)
+class ImageKvCache {
+  public:
+    ImageKvCache(LlamaMicoContext* context, size_t max_entries);
+    ~ImageKvCache();
+
+    // Pins the span of chunk for one insert, false if none is held
+    bool acquire(const mtmd_input_chunk* chunk);
+    void release(const mtmd_input_chunk* chunk);  // unpins it without an insert
+
+    // Run in memory thread
+    // Copies the pinned span of chunk to [pos, pos + n_pos) of seq_id and unpins it
+    bool insert(const mtmd_input_chunk* chunk, llama_seq_id seq_id, llama_pos pos);
+    // Keeps the span of chunk decoded at [p0, p0 + n_pos) of seq_id, the least recently used unpinned one makes room
+    void store(const mtmd_input_chunk* chunk, llama_seq_id seq_id, llama_pos p0);
+
+  private:
+    struct Span {
+        HashKey key;
+        int32_t n_tokens{0};
+        llama_pos n_pos{0};
+        int32_t slot{0};
+        int32_t n_pins{0};
+    };
+    using SpanList = std::list<Span>;
+
+    llama_pos slot_pos(int32_t slot) const { return slot_base_ + slot * slot_stride_; }
+    SpanList::iterator find(const mtmd_input_chunk* chunk);  // NOTE: mutex_ must be held
+
+    LlamaMicoContext* context_;
+    llama_memory_t memory_;
+    llama_seq_id seq_id_;
+    size_t max_entries_;
+    llama_pos slot_base_;    // n_ctx, above every request position
+    llama_pos slot_stride_;  // n_batch, a chunk is decoded in one batch
+    std::vector<int32_t> free_slots_;
+
+    std::mutex mutex_;
+    SpanList lru_;  // most recent first
+    std::unordered_map<HashKey, SpanList::iterator, HashKeyHasher> spans_;
+    size_t n_hits_{0};
+};
+
+#endif  // IMAGE_KV_CACHE_H
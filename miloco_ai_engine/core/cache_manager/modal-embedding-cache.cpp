@@ -0,0 +1,476 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "modal-embedding-cache.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "utils/mico-log.h"
+
+#define EMTRIES_PROPORTION_LIMIT 0.8
+#define MIN_ENCODE_MS 1.0f  // cost of entries stored without a measured encode time
+#define CACHE_LOG_PERIOD_MS 1000  // per eviction events, see LOG_INF_EVERY
+
+EmbdPrecision embd_precision_from_str(const std::string& precision) {
+    if (precision == "f16") return EMBD_PRECISION_F16;
+    if (precision == "q8") return EMBD_PRECISION_Q8;
+    if (!precision.empty() && precision != "f32") LOG_WRN("unknown image cache precision %s\n", precision.c_str());
+    return EMBD_PRECISION_F32;
+}
+
+// int8 values, then the row scales aligned for floats
+static size_t q8_scales_offset(size_t n_values) { return (n_values + sizeof(float) - 1) / sizeof(float) * sizeof(float); }
+
+ModalEmbd::ModalEmbd(const std::vector<float>& embd, EmbdPrecision precision, size_t n_row,
+                     std::shared_ptr<EmbdSlab> slab, EmbdSlab::Block block)
+    : precision(precision), n_values(embd.size()), n_row(std::max<size_t>(n_row, 1)), slab(std::move(slab)),
+      block(block) {
+    if (precision == EMBD_PRECISION_F16) {
+        ggml_fp32_to_fp16_row(embd.data(), reinterpret_cast<ggml_fp16_t*>(block.data), n_values);
+    } else if (precision == EMBD_PRECISION_Q8) {
+        int8_t* q8 = reinterpret_cast<int8_t*>(block.data);
+        float* scales = reinterpret_cast<float*>(block.data + q8_scales_offset(n_values));
+        for (size_t r = 0; r * this->n_row < n_values; r++) {
+            const float* row = embd.data() + r * this->n_row;
+            size_t n = std::min(this->n_row, n_values - r * this->n_row);
+            float amax = 0.0f;
+            for (size_t i = 0; i < n; i++) amax = std::max(amax, std::fabs(row[i]));
+            scales[r] = amax / 127.0f;
+            float inv = amax > 0.0f ? 127.0f / amax : 0.0f;
+            for (size_t i = 0; i < n; i++) q8[r * this->n_row + i] = (int8_t)std::lround(row[i] * inv);
+        }
+    } else {
+        memcpy(block.data, embd.data(), n_values * sizeof(float));
+    }
+}
+
+ModalEmbd::ModalEmbd(EmbdPrecision precision, size_t n_values, size_t n_row, std::shared_ptr<EmbdSlab> slab,
+                     EmbdSlab::Block block)
+    : precision(precision), n_values(n_values), n_row(std::max<size_t>(n_row, 1)), slab(std::move(slab)),
+      block(block) {}
+
+ModalEmbd::~ModalEmbd() { slab->free(block); }
+
+size_t ModalEmbd::n_bytes(size_t n_values, EmbdPrecision precision, size_t n_row) {
+    if (precision == EMBD_PRECISION_F16) return n_values * sizeof(ggml_fp16_t);
+    if (precision == EMBD_PRECISION_Q8) {
+        n_row = std::max<size_t>(n_row, 1);
+        return q8_scales_offset(n_values) + (n_values + n_row - 1) / n_row * sizeof(float);
+    }
+    return n_values * sizeof(float);
+}
+
+std::shared_ptr<std::vector<float>> ModalEmbd::dequantize() const {
+    auto embd = std::make_shared<std::vector<float>>(n_values);
+    if (precision == EMBD_PRECISION_F16) {
+        ggml_fp16_to_fp32_row(reinterpret_cast<const ggml_fp16_t*>(block.data), embd->data(), n_values);
+    } else if (precision == EMBD_PRECISION_Q8) {
+        const int8_t* q8 = reinterpret_cast<const int8_t*>(block.data);
+        const float* scales = reinterpret_cast<const float*>(block.data + q8_scales_offset(n_values));
+        for (size_t i = 0; i < n_values; i++) (*embd)[i] = q8[i] * scales[i / n_row];
+    } else {
+        memcpy(embd->data(), block.data, n_values * sizeof(float));
+    }
+    return embd;
+}
+
+// Metadata of stored embeddings spilled to disk or shared with other processes
+static EmbdDiskRecord embd_record(const HashKey& key, const ModalEmbd& embd, uint32_t nx, uint32_t ny,
+                                  float encode_ms) {
+    return {key, (int32_t)embd.precision, nx, ny, encode_ms, embd.n_values, embd.n_row,
+            ModalEmbd::n_bytes(embd.n_values, embd.precision, embd.n_row)};
+}
+
+ModalEmbeddingCache::ModalEmbeddingCache(size_t max_entries, size_t max_mem, LlamaMicoContext* context)
+    : context_(context->lctx), model_(context->model), last_maintenance_(std::chrono::steady_clock::now()) {
+    LOG_INF("Modal encode cache initialized with max_entries=%zu, max_memory_mb=%zu\n", max_entries, max_mem);
+    max_num_entries_ = max_entries;
+    max_memory_usage_ = max_mem;
+    precision_ = embd_precision_from_str(context->image_cache_precision);
+    n_embd_ = llama_model_n_embd(model_);
+    slab_ = std::make_shared<EmbdSlab>(max_mem << 20);
+    if (!context->image_cache_disk_path.empty() && context->image_cache_disk_mb > 0) {
+        disk_ = std::make_unique<EmbdDiskTier>(context->image_cache_disk_path,
+                                               (size_t)context->image_cache_disk_mb << 20,
+                                               model_signature(model_) + "/" + std::to_string(n_embd_));
+        if (!disk_->owned()) disk_.reset();
+    }
+    if (context->image_cache_shm_mb > 0 && !context->mmproj_signature.empty()) {
+        shm_ = std::make_unique<EmbdShmTier>((size_t)context->image_cache_shm_mb << 20,
+                                             context->mmproj_signature + "/" + std::to_string(n_embd_));
+        if (!shm_->attached()) shm_.reset();
+    }
+}
+
+ModalEmbeddingCache::~ModalEmbeddingCache() {
+    for (auto& shard : wait_shards_) {  // Release anyone still waiting
+        std::lock_guard<std::mutex> shard_lock(shard.mutex);
+        for (auto& [key, wait] : shard.waits) wait->promise.set_value(nullptr);
+        shard.waits.clear();
+    }
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    while (disk_ && evict_one() > 0) {}  // NOTE: the entries in memory are kept across the restart too
+    stored_map_.clear();
+    ranked_.clear();
+    embed_lru_.clear();
+
+    LOG_INF("Modal embedding cache destroyed\n");
+}
+
+bool ModalEmbeddingCache::prepare(const mtmd_input_chunk* chunk) {
+    HashKey key = modal_chunk_key(chunk);
+    if (key.empty()) return false;
+
+    // NOTE: shard lock first, a store in between is either seen here or finishes the new wait
+    auto& shard = wait_shard(key);
+    std::lock_guard<std::mutex> shard_lock(shard.mutex);
+    if (shard.waits.count(key) > 0) return false;  // already in wait
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
+        if (find_stored(key) != embed_lru_.end()) return false;  // already in stored
+    }
+    auto wait = std::make_shared<EmbedWait>();
+    wait->result = wait->promise.get_future().share();
+    shard.waits[key] = wait;
+    return true;
+}
+
+void ModalEmbeddingCache::fail(const mtmd_input_chunk* chunk) {
+    HashKey key = modal_chunk_key(chunk);
+    if (!key.empty()) finish_wait(key, nullptr);
+}
+
+void ModalEmbeddingCache::finish_wait(const HashKey& key, std::shared_ptr<std::vector<float>> embd) {
+    std::shared_ptr<EmbedWait> wait;
+    {
+        auto& shard = wait_shard(key);
+        std::lock_guard<std::mutex> shard_lock(shard.mutex);
+        auto it = shard.waits.find(key);
+        if (it == shard.waits.end()) return;
+        wait = it->second;
+        shard.waits.erase(it);
+    }
+    wait->promise.set_value(embd);
+}
+
+double ModalEmbeddingCache::gdsf_priority(const EmbedEntry& entry) const {
+    double kb = std::max<double>(entry.embd ? entry.embd->bytes() / 1024.0 : 0.0, 1.0);
+    double weight = entry.item_key != 0 && covered_.count(entry.item_key) > 0 ? EMBD_COVERED_WEIGHT : 1.0;
+    return clock_ + weight * std::max(entry.encode_ms, MIN_ENCODE_MS) * (1 + entry.n_hits) / kb;
+}
+
+void ModalEmbeddingCache::rank(EntryIt entry) {
+    unrank(entry);
+    entry->priority = gdsf_priority(*entry);
+    entry->rank = {entry->priority, ++n_ranked_};
+    ranked_.emplace(entry->rank, entry);
+}
+
+void ModalEmbeddingCache::unrank(EntryIt entry) {
+    if (entry->rank.second != 0) ranked_.erase(entry->rank);
+    entry->rank = {0, 0};
+}
+
+void ModalEmbeddingCache::touch(EntryIt entry) {
+    entry->n_hits++;
+    rank(entry);
+}
+
+void ModalEmbeddingCache::link_item(EmbedEntry& entry, const mtmd_input_chunk* chunk) {
+    if (entry.item_key != 0) return;
+    entry.item_key = modal_item_key(chunk);
+    item_entries_[entry.item_key] = entry.key;
+}
+
+void ModalEmbeddingCache::cover(const std::vector<PrefixItem>& items, int32_t delta) {
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    for (const auto& item : items) {
+        if (item.key >= 0) continue;  // text
+        int32_t& n_covered = covered_[item.key];
+        bool was_covered = n_covered > 0;
+        n_covered += delta;
+        bool is_covered = n_covered > 0;
+        if (!is_covered) covered_.erase(item.key);
+        if (was_covered == is_covered) continue;
+        auto linked = item_entries_.find(item.key);
+        if (linked == item_entries_.end()) continue;
+        auto stored = stored_map_.find(linked->second);
+        if (stored != stored_map_.end()) rank(stored->second);
+    }
+}
+
+bool ModalEmbeddingCache::store(const mtmd_input_chunk* chunk, std::shared_ptr<std::vector<float>> embeddings,
+                                float encode_ms) {
+    HashKey key = modal_chunk_key(chunk);
+    if (key.empty()) return false;
+
+    maintain();  // Try to clean cache
+
+    std::unique_lock<std::mutex> cache_lock(cache_mutex_, std::defer_lock);
+    std::unique_lock<std::mutex> stats_lock(stats_mutex_, std::defer_lock);
+    auto now = std::chrono::steady_clock::now();
+
+    // A block of the slab, the entries least worth keeping make room if no free block fits
+    EmbdSlab::Block block = slab_->allocate(ModalEmbd::n_bytes(embeddings->size(), precision_, n_embd_));
+    if (!block.data) {
+        cache_lock.lock();
+        size_t n_evicted = 0;
+        while (!block.data && evict_one() > 0) {
+            n_evicted++;
+            block = slab_->allocate(ModalEmbd::n_bytes(embeddings->size(), precision_, n_embd_));
+        }
+        cache_lock.unlock();
+        stats_lock.lock();
+        stats_.total_entries -= std::min(stats_.total_entries, n_evicted);
+        stats_lock.unlock();
+    }
+    if (!block.data) {
+        LOG_WRN("No slab block for the embeddings of hash %s, not cached\n", hash_to_hex(key).c_str());
+        finish_wait(key, embeddings);
+        return false;
+    }
+    auto stored_embd = std::make_shared<ModalEmbd>(*embeddings, precision_, n_embd_, slab_, block);
+    cache_lock.lock();
+    auto stored = stored_map_.find(key);
+    bool replaced = stored != stored_map_.end();
+    if (replaced) {  // Replace, stays one entry
+        unrank(stored->second);
+        embed_lru_.erase(stored->second);
+    }
+    const mtmd_image_tokens* image_tokens = mtmd_input_chunk_get_tokens_image(chunk);
+    uint32_t nx = image_tokens ? (uint32_t)mtmd_image_tokens_get_nx(image_tokens) : 0;
+    uint32_t ny = image_tokens ? (uint32_t)mtmd_image_tokens_get_ny(image_tokens) : 0;
+    embed_lru_.push_back({key, stored_embd, nx, ny, encode_ms});
+    link_item(embed_lru_.back(), chunk);
+    rank(std::prev(embed_lru_.end()));
+    stored_map_[key] = std::prev(embed_lru_.end());
+
+    stats_lock.lock();
+    stats_.total_entries += replaced ? 0 : 1;
+    stats_lock.unlock();
+
+    cache_lock.unlock();
+
+    finish_wait(key, embeddings);  // NOTE: after it is in the map, late waiters find it there, full precision
+    if (shm_) shm_->publish(embd_record(key, *stored_embd, nx, ny, encode_ms), stored_embd->block.data);
+    return true;
+}
+
+std::shared_ptr<std::vector<float>> ModalEmbeddingCache::lookup(const mtmd_input_chunk* chunk) {
+    HashKey key = modal_chunk_key(chunk);
+    if (key.empty()) {
+        LOG_INF("Chunk hash is empty %p\n", chunk);
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> cache_lock(cache_mutex_);
+    auto it = find_stored(key);
+    if (it != embed_lru_.end()) {  // hit
+        embed_lru_.splice(embed_lru_.end(), embed_lru_, it);  // most recently used, iterator stays valid
+        link_item(*it, chunk);
+        touch(it);
+        update_stats(true);
+        return it->embd->dequantize();
+    }
+
+    update_stats(false);
+    return nullptr;
+}
+
+std::shared_ptr<ModalEmbd> ModalEmbeddingCache::lookup_grid(const HashKey& key, uint32_t& nx, uint32_t& ny) {
+    if (key.empty()) return nullptr;
+
+    std::lock_guard<std::mutex> cache_lock(cache_mutex_);
+    auto it = find_stored(key);
+    if (it == embed_lru_.end() || it->nx == 0) return nullptr;
+    embed_lru_.splice(embed_lru_.end(), embed_lru_, it);
+    touch(it);
+    update_stats(true);
+    nx = it->nx;
+    ny = it->ny;
+    return it->embd;
+}
+
+std::shared_ptr<std::vector<float>> ModalEmbeddingCache::wait(const mtmd_input_chunk* chunk) {
+    HashKey key = modal_chunk_key(chunk);
+    if (key.empty()) return nullptr;
+
+    EmbdResult result;
+    {
+        auto& shard = wait_shard(key);
+        std::lock_guard<std::mutex> shard_lock(shard.mutex);
+        auto it = shard.waits.find(key);
+        if (it != shard.waits.end()) result = it->second->result;
+    }
+    if (!result.valid()) return lookup(chunk);  // stored already (or never prepared)
+
+    auto embd = result.get();
+    update_stats(embd != nullptr);
+    return embd;
+}
+
+bool ModalEmbeddingCache::storing(const mtmd_input_chunk* chunk) {
+    HashKey key = modal_chunk_key(chunk);
+    if (key.empty()) return false;
+    std::lock_guard<std::mutex> cache_lock(cache_mutex_);
+    return find_stored(key) != embed_lru_.end();
+}
+
+HashKey ModalEmbeddingCache::near_frame(uint64_t stream, uint64_t dhash, uint32_t nx, uint32_t ny,
+                                        int32_t max_bits) {
+    std::lock_guard<std::mutex> lock(frames_mutex_);
+    for (auto it = recent_frames_.rbegin(); it != recent_frames_.rend(); ++it) {
+        if (it->stream != stream || it->nx != nx || it->ny != ny) continue;
+        if (__builtin_popcountll(it->dhash ^ dhash) <= max_bits) return it->key;
+    }
+    return HashKey();
+}
+
+void ModalEmbeddingCache::add_frame(uint64_t stream, uint64_t dhash, uint32_t nx, uint32_t ny, const HashKey& key) {
+    std::lock_guard<std::mutex> lock(frames_mutex_);
+    recent_frames_.push_back({stream, dhash, nx, ny, key});
+    if (recent_frames_.size() > NEAR_FRAME_NUM) recent_frames_.pop_front();
+}
+
+void ModalEmbeddingCache::maintain() {
+    auto now = std::chrono::steady_clock::now();
+
+    std::unique_lock<std::mutex> cache_lock(cache_mutex_, std::defer_lock);
+    std::unique_lock<std::mutex> stats_lock(stats_mutex_, std::defer_lock);
+
+    bool need_maintain = true;
+    stats_lock.lock();
+    auto time_since_maintenance = std::chrono::duration_cast<std::chrono::microseconds>(now - last_maintenance_);
+    size_t max_memory_byte = max_memory_usage_ * 1024 * 1024;  // MB to byte
+    size_t total_memory_usage = slab_->used();
+    size_t total_entries = stats_.total_entries;
+
+    if (time_since_maintenance.count() < maintenance_interval_) need_maintain &= false;
+    if (total_entries < max_num_entries_ && total_memory_usage < max_memory_byte) need_maintain &= false;
+    stats_lock.unlock();
+
+    if (!need_maintain) return;
+
+    float max_entries_proportion = EMTRIES_PROPORTION_LIMIT;
+    size_t target_entries = max_num_entries_ * max_entries_proportion;
+    size_t target_memory_usage = max_memory_byte * max_entries_proportion;
+    cache_lock.lock();
+    while (total_entries > target_entries || total_memory_usage > target_memory_usage) {
+        size_t byte_size = evict_one();
+        if (byte_size == 0) break;
+        total_memory_usage -= std::min(total_memory_usage, byte_size);
+        total_entries -= 1;
+    }
+
+    // Prevent cache update
+    stats_lock.lock();
+    stats_.total_entries = embed_lru_.size();
+    last_maintenance_ = now;
+    stats_lock.unlock();
+
+    cache_lock.unlock();
+}
+
+// GDSF: the entry saving the least encode time per byte goes first, least recently used among equals
+size_t ModalEmbeddingCache::evict_one() {
+    auto ranked = ranked_.begin();
+    // NOTE: skips entries pinned by a request tokenized without the image, few are held at a time
+    while (ranked != ranked_.end() && ranked->second->embd.use_count() > 1) ++ranked;
+    if (ranked == ranked_.end()) return 0;
+    EntryIt victim = ranked->second;
+    ranked_.erase(ranked);
+
+    size_t byte_size = victim->embd->bytes();
+    if (disk_) {
+        disk_->spill(embd_record(victim->key, *victim->embd, victim->nx, victim->ny, victim->encode_ms),
+                     victim->embd->block.data);
+    }
+    n_evictions_.fetch_add(1, std::memory_order_relaxed);
+    LOG_INF_EVERY(CACHE_LOG_PERIOD_MS, "Evicted embeddings for hash: %s, size: %zu, encode %.1f ms, hits %u\n",
+                  hash_to_hex(victim->key).c_str(), byte_size, victim->encode_ms, victim->n_hits);
+    clock_ = std::max(clock_, victim->priority);
+    auto linked = item_entries_.find(victim->item_key);
+    if (linked != item_entries_.end() && linked->second == victim->key) item_entries_.erase(linked);
+    stored_map_.erase(victim->key);
+    embed_lru_.erase(victim);  // NOTE: its block goes back to the slab here
+    return byte_size;
+}
+
+std::list<ModalEmbeddingCache::EmbedEntry>::iterator ModalEmbeddingCache::find_stored(const HashKey& key) {
+    auto stored = stored_map_.find(key);
+    if (stored != stored_map_.end()) return stored->second;
+    auto valid = [](const EmbdDiskRecord& record) {
+        return ModalEmbd::n_bytes(record.n_values, (EmbdPrecision)record.precision, record.n_row) == record.n_bytes;
+    };
+    EmbdDiskRecord record;
+    uint64_t pos = 0;
+    if (shm_ && shm_->find(key, record, pos) && valid(record)) {  // encoded by another process or handle
+        EmbdSlab::Block block = allocate_evicting(record.n_bytes);
+        if (block.data && shm_->read(pos, record.n_bytes, block.data)) return insert_read(record, block, true);
+        slab_->free(block);  // NOTE: overwritten while copied, the disk tier may still have it
+    }
+    if (!disk_ || !disk_->find(key, record)) return embed_lru_.end();
+
+    EmbdSlab::Block block = allocate_evicting(record.n_bytes);
+    // NOTE: found again, a spill of the evictions may have dropped its segment
+    const uint8_t* payload = block.data ? disk_->find(key, record) : nullptr;
+    if (!payload || !valid(record)) {
+        slab_->free(block);
+        return embed_lru_.end();
+    }
+    memcpy(block.data, payload, record.n_bytes);
+    return insert_read(record, block, false);
+}
+
+EmbdSlab::Block ModalEmbeddingCache::allocate_evicting(size_t n_bytes) {
+    EmbdSlab::Block block = slab_->allocate(n_bytes);
+    while (!block.data && evict_one() > 0) block = slab_->allocate(n_bytes);
+    return block;
+}
+
+std::list<ModalEmbeddingCache::EmbedEntry>::iterator ModalEmbeddingCache::insert_read(const EmbdDiskRecord& record,
+                                                                                      EmbdSlab::Block block,
+                                                                                      bool shared) {
+    auto embd = std::make_shared<ModalEmbd>((EmbdPrecision)record.precision, record.n_values, record.n_row, slab_,
+                                            block);
+    embed_lru_.push_back({record.key, embd, record.nx, record.ny, record.encode_ms});
+    rank(std::prev(embed_lru_.end()));
+    stored_map_[record.key] = std::prev(embed_lru_.end());
+
+    std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+    (shared ? stats_.shm_hits : stats_.disk_hits)++;
+    stats_.total_entries = embed_lru_.size();
+    return std::prev(embed_lru_.end());
+}
+
+CacheStats ModalEmbeddingCache::stats() const {
+    std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+    CacheStats stats = stats_;
+    stats.total_memory_usage = slab_->used();  // NOTE: exact, blocks of evicted entries still held by a request too
+    stats.disk_bytes = disk_ ? disk_->bytes() : 0;
+    stats.shm_bytes = shm_ ? shm_->bytes() : 0;
+    stats.evictions = n_evictions_.load(std::memory_order_relaxed);
+    return stats;
+}
+
+std::vector<HashKey> ModalEmbeddingCache::top_keys(size_t max_keys) const {
+    std::vector<HashKey> keys;
+    std::lock_guard<std::mutex> lock(cache_mutex_);
+    for (auto it = ranked_.rbegin(); it != ranked_.rend() && keys.size() < max_keys; ++it)
+        keys.push_back(it->second->key);
+    return keys;
+}
+
+void ModalEmbeddingCache::update_stats(bool hit) {
+    std::lock_guard<std::mutex> stats_lock(stats_mutex_);
+    if (hit)
+        stats_.hits++;
+    else
+        stats_.misses++;
+
+    // todo update stats
+}
@@ -0,0 +1,189 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef MODAL_EMBEDDING_CACHE_H
+#define MODAL_EMBEDDING_CACHE_H
+
+#include <deque>
+#include <future>
+#include <list>
+#include <map>
+#include <unordered_map>
+
+#include "embd-disk-tier.h"
+#include "embd-shm-tier.h"
+#include "embd-slab.h"
+#include "utils/chunk-hash.h"
+#include "utils/mico-common.h"
+
+// Forward declarations
+struct llama_context;
+struct llama_model;
+
+#define EMBED_WAIT_SHARDS 16
+#define NEAR_FRAME_NUM 64  // recently encoded frames compared by perceptual hash
+#define EMBD_COVERED_WEIGHT 0.25  // GDSF value of an image whose kv the prefix cache holds, it is reused without them
+
+enum EmbdPrecision {
+    EMBD_PRECISION_F32,
+    EMBD_PRECISION_F16,
+    EMBD_PRECISION_Q8,  // int8 with one scale per embedding row
+};
+
+EmbdPrecision embd_precision_from_str(const std::string& precision);
+
+// Stored embeddings of an image or audio chunk in a block of the cache slab, fp16 and int8 keep 2-4x more frames in the
+// same budget and are dequantised on lookup. The block goes back to the slab with the last reference
+struct ModalEmbd {
+    EmbdPrecision precision{EMBD_PRECISION_F32};
+    size_t n_values{0};
+    size_t n_row{1};  // values per row (n_embd)
+    std::shared_ptr<EmbdSlab> slab;
+    EmbdSlab::Block block;  // f32, f16 or int8 values, the int8 ones followed by a float scale per row
+
+    ModalEmbd(const std::vector<float>& embd, EmbdPrecision precision, size_t n_row, std::shared_ptr<EmbdSlab> slab,
+              EmbdSlab::Block block);
+    // Stored bytes already in block, e.g. read back from the disk tier
+    ModalEmbd(EmbdPrecision precision, size_t n_values, size_t n_row, std::shared_ptr<EmbdSlab> slab,
+              EmbdSlab::Block block);
+    ~ModalEmbd();
+    static size_t n_bytes(size_t n_values, EmbdPrecision precision, size_t n_row);
+    size_t bytes() const { return block.size; }
+    std::shared_ptr<std::vector<float>> dequantize() const;
+};
+
+struct CacheStats {
+    size_t total_entries;  // Total number of cache entries
+    size_t hits;           // Number of cache hits
+    size_t misses;         // Number of cache misses
+    size_t evictions;           // entries evicted for space, spilled to the disk tier if any
+    size_t total_memory_usage;  // Total memory usage in bytes
+    size_t disk_hits;           // hits read back from the disk tier
+    size_t disk_bytes;          // bytes of the disk tier
+    size_t shm_hits;            // hits another process or handle encoded, copied from shared memory
+    size_t shm_bytes;           // bytes of the shared memory tier
+
+    CacheStats()
+        : total_entries(0), hits(0), misses(0), evictions(0), total_memory_usage(0), disk_hits(0), disk_bytes(0),
+          shm_hits(0), shm_bytes(0) {}
+};
+
+class ModalEmbeddingCache {
+  public:
+    explicit ModalEmbeddingCache(size_t max_entries, size_t max_mem, LlamaMicoContext* context);
+    ~ModalEmbeddingCache();
+
+    bool prepare(const mtmd_input_chunk* chunk);  // false if already stored or being encoded
+    // encode_ms is the recompute cost weighing the entry against eviction
+    bool store(const mtmd_input_chunk* chunk, std::shared_ptr<std::vector<float>> embeddings, float encode_ms = 0);
+    void fail(const mtmd_input_chunk* chunk);  // encode failed, waiters get nullptr
+
+    std::shared_ptr<std::vector<float>> lookup(const mtmd_input_chunk* chunk);
+    // Token grid of a stored image, the returned entry is pinned against eviction while held
+    std::shared_ptr<ModalEmbd> lookup_grid(const HashKey& key, uint32_t& nx, uint32_t& ny);
+    // Blocks until the prepared chunk is stored or failed, wakes only the waiters of this chunk
+    std::shared_ptr<std::vector<float>> wait(const mtmd_input_chunk* chunk);
+    bool storing(const mtmd_input_chunk* chunk);
+
+    // Key of a recent frame of the same stream and size within max_bits of dhash, empty if none
+    HashKey near_frame(uint64_t stream, uint64_t dhash, uint32_t nx, uint32_t ny, int32_t max_bits);
+    void add_frame(uint64_t stream, uint64_t dhash, uint32_t nx, uint32_t ny, const HashKey& key);
+
+    // The prefix kv cache now holds (delta 1) or dropped (-1) the kv of items: its images are weighed down while
+    // covered and promoted again once no cached prefix holds them
+    void cover(const std::vector<PrefixItem>& items, int32_t delta);
+
+    CacheStats stats() const;
+    size_t capacity() const { return slab_->capacity(); }  // bytes of the slab reservation
+    // Keys of up to max_keys stored entries, highest priority first
+    std::vector<HashKey> top_keys(size_t max_keys) const;
+
+  private:
+    using EmbdResult = std::shared_future<std::shared_ptr<std::vector<float>>>;
+    struct EmbedWait {
+        std::promise<std::shared_ptr<std::vector<float>>> promise;
+        EmbdResult result;
+    };
+    struct WaitShard {  // chunks being encoded
+        std::mutex mutex;
+        std::unordered_map<HashKey, std::shared_ptr<EmbedWait>, HashKeyHasher> waits;
+    };
+
+    WaitShard& wait_shard(const HashKey& key) { return wait_shards_[key.lo % EMBED_WAIT_SHARDS]; }
+    void finish_wait(const HashKey& key, std::shared_ptr<std::vector<float>> embd);
+    // Maintain cache size
+    void maintain();
+    // Evicts the entry of the lowest priority no request holds to the disk tier, its bytes, 0 if none,
+    // NOTE: cache_mutex_ must be held
+    size_t evict_one();
+    // Update cache statistics
+    void update_stats(bool hit);
+
+    llama_context* context_{nullptr};
+    llama_model* model_{nullptr};
+
+    // cache date, lru list with the least recently used first, indexed by chunk key
+    struct EmbedEntry {
+        HashKey key;
+        std::shared_ptr<ModalEmbd> embd;
+        uint32_t nx{0}, ny{0};  // image token grid, 0 for audio
+        float encode_ms{0};
+        uint32_t n_hits{0};
+        double priority{0};  // GDSF, the lowest is evicted first
+        int64_t item_key{0};  // prefix item of the chunk, 0 until stored or looked up with it
+        std::pair<double, uint64_t> rank{0, 0};  // key in ranked_, {0, 0} while not ranked
+    };
+    using EntryIt = std::list<EmbedEntry>::iterator;
+    // clock_ + encode cost x frequency / size, NOTE: cache_mutex_ must be held
+    double gdsf_priority(const EmbedEntry& entry) const;
+    // (Re)computes the priority of entry and moves it in ranked_, NOTE: cache_mutex_ must be held
+    void rank(EntryIt entry);
+    void unrank(EntryIt entry);
+    void touch(EntryIt entry);
+    void link_item(EmbedEntry& entry, const mtmd_input_chunk* chunk);  // NOTE: cache_mutex_ must be held
+    // Stored entry of key, copied from the shared memory or read back from the disk tier on a miss, embed_lru_.end()
+    // if none, NOTE: cache_mutex_ must be held
+    std::list<EmbedEntry>::iterator find_stored(const HashKey& key);
+    // A slab block of n_bytes, evicting entries until one fits, NOTE: cache_mutex_ must be held
+    EmbdSlab::Block allocate_evicting(size_t n_bytes);
+    // Entry of a block filled with the stored bytes of record, from shared memory or disk,
+    // NOTE: cache_mutex_ must be held
+    std::list<EmbedEntry>::iterator insert_read(const EmbdDiskRecord& record, EmbdSlab::Block block, bool shared);
+    WaitShard wait_shards_[EMBED_WAIT_SHARDS];
+    std::list<EmbedEntry> embed_lru_;
+    // Entries by priority, lowest first and the least recently ranked among equals, so eviction and top_keys do not
+    // scan embed_lru_
+    std::map<std::pair<double, uint64_t>, EntryIt> ranked_;
+    uint64_t n_ranked_{0};
+    double clock_{0};  // GDSF inflation, priority of the last evicted entry, ages entries no longer hit
+    std::shared_ptr<EmbdSlab> slab_;
+    std::unique_ptr<EmbdDiskTier> disk_;  // nullptr without image_cache_disk_path
+    std::unique_ptr<EmbdShmTier> shm_;    // nullptr without image_cache_shm_mb or if the segment is not usable
+    std::unordered_map<HashKey, std::list<EmbedEntry>::iterator, HashKeyHasher> stored_map_;
+    std::unordered_map<int64_t, HashKey> item_entries_;  // prefix item key -> stored entry
+    std::unordered_map<int64_t, int32_t> covered_;       // prefix item key -> cached prefixes holding its kv
+    mutable std::mutex cache_mutex_;
+
+    struct NearFrame {
+        uint64_t stream;  // camera or session key, see MicoRequest::stream_key
+        uint64_t dhash;
+        uint32_t nx, ny;  // pixels
+        HashKey key;
+    };
+    std::deque<NearFrame> recent_frames_;  // newest last
+    std::mutex frames_mutex_;
+
+    // stats info
+    CacheStats stats_;
+    std::chrono::steady_clock::time_point last_maintenance_;
+    mutable std::mutex stats_mutex_;
+    std::atomic<size_t> n_evictions_{0};  // NOTE: evict_one runs with and without stats_mutex_ held
+
+    EmbdPrecision precision_{EMBD_PRECISION_F32};
+    size_t n_embd_{1};
+    size_t max_memory_usage_{0};  // mb
+    size_t max_num_entries_{0};
+    int32_t maintenance_interval_{5000};  // ms
+};
+#endif  // MODAL_EMBEDDING_CACHE_H
\ No newline at end of file
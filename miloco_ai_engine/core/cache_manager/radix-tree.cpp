@@ -0,0 +1,79 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "radix-tree.h"
+
+#include <algorithm>
+
+void RadixTree::insert(const std::vector<PrefixItem>& items, int32_t seq_id) {
+    Node* node = &root_;
+    size_t i = 0;
+    while (i < items.size()) {
+        auto it = node->children.find(items[i].key);
+        if (it == node->children.end()) {  // New leaf with the rest
+            auto leaf = std::make_unique<Node>();
+            leaf->edge.assign(items.begin() + i, items.end());
+            leaf->seq_ids.insert(seq_id);
+            node->children[items[i].key] = std::move(leaf);
+            return;
+        }
+
+        Node* child = it->second.get();
+        size_t k = 1;
+        while (k < child->edge.size() && i + k < items.size() && child->edge[k].key == items[i + k].key) k++;
+        if (k < child->edge.size()) {  // Split the edge at the first mismatch
+            auto mid = std::make_unique<Node>();
+            mid->edge.assign(child->edge.begin(), child->edge.begin() + k);
+            mid->seq_ids = child->seq_ids;
+            child->edge.erase(child->edge.begin(), child->edge.begin() + k);
+            mid->children[child->edge[0].key] = std::move(it->second);
+            it->second = std::move(mid);
+            child = it->second.get();
+        }
+        child->seq_ids.insert(seq_id);
+        i += k;
+        node = child;
+    }
+}
+
+void RadixTree::erase(const std::vector<PrefixItem>& items, int32_t seq_id) {
+    std::vector<std::pair<Node*, int64_t>> path;  // parent, child key
+    Node* node = &root_;
+    size_t i = 0;
+    while (i < items.size()) {
+        auto it = node->children.find(items[i].key);
+        if (it == node->children.end()) break;
+        Node* child = it->second.get();
+        if (child->seq_ids.erase(seq_id) == 0) break;
+        path.emplace_back(node, items[i].key);
+        i += child->edge.size();
+        node = child;
+    }
+
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {  // Drop nodes no sequence uses anymore
+        auto child = it->first->children.find(it->second);
+        if (child->second->seq_ids.empty()) it->first->children.erase(child);
+    }
+}
+
+size_t RadixTree::match(const std::vector<PrefixItem>& items, size_t max_items, std::vector<int32_t>& seq_ids) const {
+    seq_ids.clear();
+    max_items = std::min(max_items, items.size());
+
+    const Node* node = &root_;
+    size_t i = 0;
+    while (i < max_items) {
+        auto it = node->children.find(items[i].key);
+        if (it == node->children.end()) break;
+        const Node* child = it->second.get();
+        size_t k = 1;
+        while (k < child->edge.size() && i + k < max_items && child->edge[k].key == items[i + k].key) k++;
+        i += k;
+        seq_ids.assign(child->seq_ids.begin(), child->seq_ids.end());
+        if (k < child->edge.size()) break;
+        node = child;
+    }
+    return i;
+}
@@ -0,0 +1,34 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef RADIX_TREE_H
+#define RADIX_TREE_H
+
+#include <map>
+#include <memory>
+#include <set>
+
+#include "utils/chunk-hash.h"
+
+// Prefix index over the prompts stored in the cache sequences, each edge holds a run of prefix items
+class RadixTree {
+  public:
+    void insert(const std::vector<PrefixItem>& items, int32_t seq_id);
+    void erase(const std::vector<PrefixItem>& items, int32_t seq_id);
+
+    // Longest prefix of items[0, max_items) stored in any sequence, returns the matched item count and
+    // the sequences holding it
+    size_t match(const std::vector<PrefixItem>& items, size_t max_items, std::vector<int32_t>& seq_ids) const;
+
+  private:
+    struct Node {
+        std::vector<PrefixItem> edge;                       // items from the parent to this node
+        std::map<int64_t, std::unique_ptr<Node>> children;  // keyed by the first item of the child edge
+        std::set<int32_t> seq_ids;                          // sequences containing the whole path to this node
+    };
+
+    Node root_;
+};
+
+#endif  // RADIX_TREE_H
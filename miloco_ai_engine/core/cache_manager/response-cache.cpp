@@ -0,0 +1,60 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "response-cache.h"
+
+#include "ggml.h"
+#include "common/log.h"
+
+ResponseCache::ResponseCache(size_t max_bytes, int32_t ttl_s)
+    : max_bytes_(max_bytes), ttl_us_((int64_t)ttl_s * 1000000) {
+    LOG_INF("Response cache of %zu MB, ttl %d s\n", max_bytes >> 20, ttl_s);
+}
+
+bool ResponseCache::lookup(const HashKey& key, std::vector<llama_token>& tokens) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end() && ttl_us_ > 0 && ggml_time_us() - it->second->t_stored_us > ttl_us_) {
+        erase(it->second);
+        it = entries_.end();
+    }
+    if (it == entries_.end()) {
+        n_misses_++;
+        return false;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second);
+    tokens = it->second->tokens;
+    n_hits_++;
+    return true;
+}
+
+void ResponseCache::store(const HashKey& key, std::vector<llama_token> tokens) {
+    Entry stored{key, std::move(tokens), ggml_time_us()};
+    if (stored.bytes() > max_bytes_) return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) erase(it->second);  // NOTE: a coalesced or concurrent identical request
+    while (!lru_.empty() && n_bytes_ + stored.bytes() > max_bytes_) erase(std::prev(lru_.end()));
+    n_bytes_ += stored.bytes();
+    lru_.push_front(std::move(stored));
+    entries_[key] = lru_.begin();
+}
+
+ResponseCacheStats ResponseCache::stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ResponseCacheStats stats;
+    stats.hits = n_hits_;
+    stats.misses = n_misses_;
+    stats.entries = lru_.size();
+    stats.bytes = n_bytes_;
+    return stats;
+}
+
+void ResponseCache::erase(EntryList::iterator entry) {
+    n_bytes_ -= entry->bytes();
+    entries_.erase(entry->key);
+    lru_.erase(entry);
+}
@@ -0,0 +1,57 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "llama.h"
+#include "utils/chunk-hash.h"
+
+struct ResponseCacheStats {
+    size_t hits{0};
+    size_t misses{0};
+    size_t entries{0};
+    size_t bytes{0};
+};
+
+// Completions of greedy requests by request fingerprint (request_fingerprint), the output of argmax sampling is a
+// function of the input so an identical request replays the stored tokens with no inference. Only completions that
+// reached an end of generation are kept, least recently used ones go past max_bytes and any older than ttl_s
+class ResponseCache {
+  public:
+    ResponseCache(size_t max_bytes, int32_t ttl_s);
+
+    // tokens of the completion of key, ending with the end of generation token, counts a hit or a miss
+    bool lookup(const HashKey& key, std::vector<llama_token>& tokens);
+    void store(const HashKey& key, std::vector<llama_token> tokens);
+    ResponseCacheStats stats();
+
+  private:
+    struct Entry {
+        HashKey key;
+        std::vector<llama_token> tokens;
+        int64_t t_stored_us{0};
+        size_t bytes() const { return sizeof(Entry) + tokens.size() * sizeof(llama_token); }
+    };
+    using EntryList = std::list<Entry>;
+
+    void erase(EntryList::iterator entry);  // NOTE: mutex_ must be held
+
+    size_t max_bytes_;
+    int64_t ttl_us_;  // 0 never expires
+
+    std::mutex mutex_;
+    EntryList lru_;  // most recent first
+    std::unordered_map<HashKey, EntryList::iterator, HashKeyHasher> entries_;
+    size_t n_bytes_{0};
+    size_t n_hits_{0};
+    size_t n_misses_{0};
+};
+
+#endif  // RESPONSE_CACHE_H
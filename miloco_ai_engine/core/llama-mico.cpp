@@ -5,54 +5,74 @@
 
 #include "llama-mico.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
 #include <cstdint>
 #include <cstring>
+#include <future>
+#include <mutex>
+#include <set>
 
+#include "batch_scheduling/async-scheduler.h"
 #include "batch_scheduling/batch-scheduler.h"
+#include "batch_scheduling/prompt-frontend.h"
 #include "common/chat.h"
 #include "common/json-partial.h"
 #include "common/log.h"
 #include "llama-cparams.h"
 #include "llama.h"
+#include "utils/autotune.h"
 #include "utils/llama-memory-scheduling.h"
 #include "utils/mico-config.h"
 #include "utils/mico-dialog-util.h"
+#include "utils/op-profiler.h"
+#include "utils/request-log.h"
 
 using json = nlohmann::ordered_json;
 
 #define CHAT_CMP_ID_PREFIX "local-chatcmpl-"
-#define DEFAULT_ERROR_SEQ_ID -1  // NOTE: error sequence id message not thread-safe
-
-int32_t llama_mico_init(const char* config_json, void** handle) {
-    ggml_time_init();
-    common_params params;
-    if (!config_params_parse_json(config_json, params)) {
-        LOG_ERR("ERR: prase mico config\n");
-        return -1;
-    }
-    common_init();
+#define MICO_STREAM_DEFAULT_BYTES 65536  // ring of llama_mico_stream_open
+#define CACHE_DIGEST_MAX_IMAGES 256      // cached image keys of llama_mico_get_cache_digest
+#define MEMORY_CELLS_WAIT_MS 1000        // longest wait of llama_mico_get_memory for the kv cells behind queued work
 
+// Context and schedulers of one replica, nullptr if the model or its context failed to load
+static LlamaMicoContext* init_replica(common_params& params) {
+    if (params.autotune) autotune_params(params);  // NOTE: per replica, the calibration is keyed by its devices
     LlamaMicoContext* ctx = new LlamaMicoContext(params);
     if (!ctx || !ctx->lctx || !ctx->model) {
         LOG_ERR("ERR: failed to initialize LlamaMicoContext\n");
         delete ctx;
-        return -1;
+        return nullptr;
     }
-    *handle = ctx;
 
     // BatchScheduler
-    BatchScheduler* bs = new BatchScheduler(ctx, 3);
+    BatchScheduler* bs = new BatchScheduler(ctx, ctx->batch_wait_ms);
     ctx->batch_scheduler = bs;
 
-    return 0;
+    // PromptFrontend, prompts are prepared apart from the workers waiting for their prefill
+    ctx->prompt_frontend =
+        new PromptFrontend(ctx->n_prepare_workers, [cpu = ctx->cpu_prepare]() { set_thread_affinity(cpu); });
+
+    // AsyncScheduler, one prompt worker per sequence slot
+    ctx->async_scheduler = new AsyncScheduler(ctx, ctx->n_seq_max);
+    return ctx;
 }
 
-int32_t llama_mico_free(void* handle) {
-    if (!handle) {
-        LOG_ERR("ERR: handle is null\n");
-        return -1;
+static void free_replica(LlamaMicoContext* ctx) {
+    if (ctx->async_scheduler) {  // NOTE: its waiter hands granted prompts to the PromptFrontend
+        static_cast<AsyncScheduler*>(ctx->async_scheduler)->stop_waits();
+    }
+    if (ctx->prompt_frontend) {  // NOTE: first, its tasks hand prepared prompts to the AsyncScheduler
+        delete static_cast<PromptFrontend*>(ctx->prompt_frontend);
+        ctx->prompt_frontend = nullptr;
+    }
+    if (ctx->async_scheduler) {
+        delete static_cast<AsyncScheduler*>(ctx->async_scheduler);
+        ctx->async_scheduler = nullptr;
     }
-    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
     if (ctx->batch_scheduler) {
         delete static_cast<BatchScheduler*>(ctx->batch_scheduler);
         ctx->batch_scheduler = nullptr;
@@ -62,123 +82,1566 @@ int32_t llama_mico_free(void* handle) {
         ctx->memory_scheduler = nullptr;
     }
     delete ctx;
+}
+
+// The handle joins the shared tier of front: registered buffers, frame rings and the image embedding cache
+static void share_host_tier(LlamaMicoContext* front, LlamaMicoContext* ctx) {
+    ctx->modal_buffers = front->modal_buffers;
+    ctx->frame_rings = front->frame_rings;
+    static_cast<BatchScheduler*>(ctx->batch_scheduler)
+        ->share_modal_cache(static_cast<BatchScheduler*>(front->batch_scheduler)->modal_cache());
+}
+
+int32_t llama_mico_init(const char* config_json, void** handle) {
+    ggml_time_init();
+    common_params params;
+    if (!config_params_parse_json(config_json, params)) {
+        LOG_ERR("ERR: prase mico config\n");
+        return -1;
+    }
+    common_init();
+    if (params.numa != GGML_NUMA_STRATEGY_DISABLED) {  // NOTE: before the weights are mapped, the first handle decides
+        static std::once_flag numa_once;
+        std::call_once(numa_once, [&params]() { llama_numa_init(params.numa); });
+    }
+
+    if (params.replica_devices.size() < 2) {
+        LlamaMicoContext* ctx = init_replica(params);
+        if (!ctx) return -1;
+        *handle = ctx;
+        return 0;
+    }
+
+    // Data parallel: a whole copy of the model per device, the first replica is the handle and routes the requests
+    if (!params.prefill_devices.empty()) {
+        LOG_WRN("WRN: prefill_devices is ignored with replica_devices\n");
+        params.prefill_devices.clear();
+    }
+    std::vector<LlamaMicoContext*> replicas;
+    for (ggml_backend_dev_t dev : params.replica_devices) {
+        common_params replica_params = params;
+        replica_params.devices = {dev, nullptr};
+        replica_params.split_mode = LLAMA_SPLIT_MODE_NONE;
+        replica_params.main_gpu = 0;
+        LlamaMicoContext* ctx = init_replica(replica_params);
+        if (!ctx) {
+            LOG_ERR("ERR: failed to initialize the replica on %s\n", ggml_backend_dev_name(dev));
+            for (LlamaMicoContext* replica : replicas) free_replica(replica);
+            return -1;
+        }
+        if (!replicas.empty()) share_host_tier(replicas[0], ctx);
+        replicas.push_back(ctx);
+    }
+    replicas[0]->replicas = replicas;
+    LOG_INF("%s: %zu replicas behind one handle\n", __func__, replicas.size());
+    *handle = replicas[0];
     return 0;
 }
 
-int32_t llama_mico_request_prompt(void* handle, const char* request_json_str, int32_t* is_finished,
-                                  const char** content) {
+int32_t llama_mico_free(void* handle) {
+    if (!handle) {
+        LOG_ERR("ERR: handle is null\n");
+        return -1;
+    }
     LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    for (size_t i = 1; i < ctx->replicas.size(); i++) free_replica(ctx->replicas[i]);
+    free_replica(ctx);
+    return 0;
+}
 
-    json request_json = json::parse(request_json_str);
-    // printf("request_json_str: %s\n", request_json_str);
-    MicoRequest request;
-    if (!from_json_to_request(request_json, request)) {
-        auto& err_state = ctx->get_seq_state(DEFAULT_ERROR_SEQ_ID);
-        std::string err = "ERR: failed to parse request_json\n";
-        return stop_process(false /* success */, err, content, *is_finished, err_state, ctx, DEFAULT_ERROR_SEQ_ID,
-                            false /* stop */);
+#define REPLICA_AFFINITY_SLACK 2  // busy sequences the prompt affinity replica may have over the least loaded one
+
+// Every replica behind the handle, itself alone without replica_devices
+static std::vector<LlamaMicoContext*> replicas_of(LlamaMicoContext* ctx) {
+    return ctx->replicas.empty() ? std::vector<LlamaMicoContext*>{ctx} : ctx->replicas;
+}
+
+// Busy sequences plus the requests queued for one
+static int32_t replica_load(LlamaMicoContext* ctx) {
+    size_t n_free_seqs = 0;
+    {
+        std::lock_guard<std::mutex> lock(ctx->cmpl_to_seq_mutex);
+        n_free_seqs = ctx->free_seqs.size();
     }
+    AdmissionQueue* admission = static_cast<BatchScheduler*>(ctx->batch_scheduler)->admission();
+    return ctx->n_seq_max - (int32_t)n_free_seqs + (admission ? (int32_t)admission->stats().waiting : 0);
+}
+
+static LlamaMicoContext* least_loaded(LlamaMicoContext* ctx) {
+    LlamaMicoContext* least = ctx;
+    int32_t least_load = INT32_MAX;
+    for (LlamaMicoContext* replica : ctx->replicas) {
+        int32_t load = replica_load(replica);
+        if (load < least_load) {
+            least = replica;
+            least_load = load;
+        }
+    }
+    return least;
+}
 
-    int32_t seq_id = ctx->set_seq_id(request.id);                       // Ensure seq_id is within bounds
-    if (seq_id < 0 || ctx->get_seq_state(seq_id).is_infering.load()) {  // sequence request limit
+// Replica serving a new request: the one keeping the kv of its session or video window, else the rendezvous hash
+// of its first message picks one, so requests sharing a system prompt meet its cached prefix, unless that replica
+// is busier than the least loaded one by more than REPLICA_AFFINITY_SLACK
+static LlamaMicoContext* route_request(LlamaMicoContext* ctx, const MicoRequest& request) {
+    if (ctx->replicas.empty()) return ctx;
+    for (LlamaMicoContext* replica : ctx->replicas) {
+        BatchScheduler* bs = static_cast<BatchScheduler*>(replica->batch_scheduler);
+        if (!request.session.empty() && bs->has_session(request.session)) return replica;
+        if (!request.video_session.empty() && replica->has_video_session(request.video_session)) return replica;
+    }
+
+    std::string first;
+    if (!request.chat_msgs.empty())
+        first = request.chat_msgs[0].content;
+    else if (request.messages.is_array() && !request.messages.empty())
+        first = request.messages[0].dump();
+    uint64_t key = std::hash<std::string>{}(first);
+    LlamaMicoContext* preferred = nullptr;
+    LlamaMicoContext* least = nullptr;
+    int32_t preferred_load = 0;
+    int32_t least_load = INT32_MAX;
+    uint64_t best = 0;
+    for (size_t i = 0; i < ctx->replicas.size(); i++) {
+        uint64_t h = (key ^ (i + 1)) * 0x9E3779B97F4A7C15ULL;  // NOTE: splitmix64 finaliser
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+        h ^= h >> 31;
+        int32_t load = replica_load(ctx->replicas[i]);
+        if (!preferred || h > best) {
+            preferred = ctx->replicas[i];
+            preferred_load = load;
+            best = h;
+        }
+        if (load < least_load) {
+            least = ctx->replicas[i];
+            least_load = load;
+        }
+    }
+    return preferred_load <= least_load + REPLICA_AFFINITY_SLACK ? preferred : least;
+}
+
+// Replica holding request_id: inferring, streaming or keeping its unread output, the handle itself if none does
+static LlamaMicoContext* replica_of(LlamaMicoContext* ctx, int32_t request_id) {
+    for (LlamaMicoContext* replica : ctx->replicas) {
+        if (replica->get_cmpl_state(request_id)) return replica;
+        if (static_cast<AsyncScheduler*>(replica->async_scheduler)->has(request_id)) return replica;
+        std::lock_guard<std::mutex> lock(replica->pending_outputs_mutex);
+        if (replica->pending_outputs.count(request_id) > 0) return replica;
+    }
+    return ctx;
+}
+
+#define SWAP_WARM_MIN_ITEMS 16  // shorter cached text is not worth a prefill on a model swap
+
+// Prefills the prompts cached in from into the kv cache of to, highest priority first: sessions stay pinned to their
+// session, a prompt with images keeps its text head only. NOTE: to serves no request yet
+static void warm_kv_cache(LlamaMicoContext* from, LlamaMicoContext* to) {
+    const ChunkInferCache* from_cache = static_cast<BatchScheduler*>(from->batch_scheduler)->kv_cache();
+    BatchScheduler* bs = static_cast<BatchScheduler*>(to->batch_scheduler);
+    if (!from_cache || !bs->kv_cache() || to->n_seq_max <= 0) return;
+    if (llama_vocab_n_tokens(from->vocab) != llama_vocab_n_tokens(to->vocab) ||
+        llama_vocab_type(from->vocab) != llama_vocab_type(to->vocab)) {
+        LOG_WRN("%s: the vocab differs, the kv cache starts cold\n", __func__);
+        return;
+    }
+
+    int64_t t_start = ggml_time_ms();
+    std::vector<CacheEntry> entries = from_cache->entries();
+    if (entries.size() > (size_t)to->kv_cache_seq) entries.resize(to->kv_cache_seq);
+    size_t n_warmed = 0;
+    size_t i = 0;
+    while (i < entries.size()) {
+        std::vector<std::shared_ptr<mtmd::input_chunks>> batch_chunks;
+        std::vector<size_t> batch_seqs;
+        for (; i < entries.size() && batch_seqs.size() < (size_t)to->n_seq_max; i++) {
+            llama_tokens tokens;
+            for (const auto& item : entries[i].items) {
+                if (item.key < 0) break;  // image or audio, not re-encoded
+                tokens.push_back((llama_token)item.key);
+            }
+            if (tokens.size() < SWAP_WARM_MIN_ITEMS) continue;
+            bool whole = tokens.size() == entries[i].items.size();
+            int32_t seq_id = to->set_seq_id(i);
+            if (seq_id < 0) break;
+            auto& state = to->get_seq_state(seq_id);
+            state.n_cache_items = 0;
+            state.session = whole ? entries[i].session : "";
+            state.cache_pin = whole && entries[i].pinned;
+            batch_chunks.push_back(std::make_shared<mtmd::input_chunks>(mtmd_create_text_chunks(tokens)));
+            batch_seqs.push_back(seq_id);
+        }
+        if (batch_seqs.empty()) break;
+        bs->blocking_infer_batch(batch_chunks, batch_seqs, std::vector<int32_t>(batch_seqs.size(), 0));
+        for (size_t seq_id : batch_seqs) {  // stores the sessions, the other prompts are stored by the batch
+            auto& state = to->get_seq_state(seq_id);
+            bool ok = state.last_token.load() >= 0;
+            int32_t is_finished = 0;
+            const char* content = nullptr;
+            std::string res;
+            stop_process(ok, res, &content, is_finished, state, to, (int32_t)seq_id);
+            if (ok) n_warmed++;
+        }
+    }
+    LOG_INF("%s: %zu of %zu cached prompts prefilled in %" PRId64 " ms\n", __func__, n_warmed, entries.size(),
+            ggml_time_ms() - t_start);
+}
+
+int32_t llama_mico_swap_model(void* handle, const char* config_json, void** new_handle) {
+    if (!handle || !config_json || !new_handle) {
+        LOG_ERR("ERR: handle, config_json or new_handle is null\n");
+        return -1;
+    }
+    LlamaMicoContext* from = static_cast<LlamaMicoContext*>(handle);
+    void* created = nullptr;
+    if (llama_mico_init(config_json, &created) != 0) return -1;  // NOTE: handle keeps serving meanwhile
+    LlamaMicoContext* to = static_cast<LlamaMicoContext*>(created);
+
+    // Registered buffers and frame rings do not depend on the model, their ids stay valid on the new handle
+    std::vector<LlamaMicoContext*> from_replicas = replicas_of(from);
+    std::vector<LlamaMicoContext*> to_replicas = replicas_of(to);
+    for (LlamaMicoContext* replica : to_replicas) {
+        replica->modal_buffers = from->modal_buffers;
+        replica->frame_rings = from->frame_rings;
+    }
+    json config = json::parse(config_json, nullptr, false /* allow_exceptions */);
+    bool reuse_vision = config.is_object() ? config.value("reuse_vision", true) : true;
+    const auto& from_params = from->shared_model->params;
+    const auto& to_params = to->shared_model->params;
+    if (reuse_vision && !to_params.mmproj.path.empty() && to_params.mmproj.path == from_params.mmproj.path &&
+        from->image_cache_precision == to->image_cache_precision &&
+        llama_model_n_embd(from->model) == llama_model_n_embd(to->model)) {
+        for (LlamaMicoContext* replica : to_replicas) {
+            static_cast<BatchScheduler*>(replica->batch_scheduler)
+                ->share_modal_cache(static_cast<BatchScheduler*>(from->batch_scheduler)->modal_cache());
+        }
+    }
+    // NOTE: replica i to replica i, the prompt affinity and sessions route there again with as many replicas
+    for (size_t i = 0; i < std::min(from_replicas.size(), to_replicas.size()); i++)
+        warm_kv_cache(from_replicas[i], to_replicas[i]);
+    *new_handle = to;
+    return 0;
+}
+
+// Fails a request whose deadline passed before its prompt was inferred
+static int32_t deadline_exceeded(LlamaMicoContext* ctx, LlamaSeqState& state, int32_t seq_id, int32_t* is_finished,
+                                 const char** content) {
+    ctx->metrics.record_expired();
+    std::string err = "ERR: deadline exceeded\n";
+    stop_process(false /* success */, err, content, *is_finished, state, ctx, seq_id, true /* stop */);
+    return MICO_ERROR_DEADLINE_EXCEEDED;
+}
+
+// Template + tokenize, returns the sequence ready to infer or -1 once the error was reported into ret/content
+// queue: with every sequence busy the request waits in the admission queue, NOTE: never while the caller holds
+// sequences of other requests it has yet to infer, they could not free one
+// waits (async): a wait for a sequence or for kv is not taken here but recorded, -1 without an error for a sequence,
+// the request is prepared again with the sequence the admission queue granted
+static int32_t prepare_prompt(LlamaMicoContext* ctx, MicoRequest& request, std::shared_ptr<mtmd::input_chunks>& chunks,
+                              int32_t* is_finished, const char** content, int32_t& ret, bool queue = true,
+                              AsyncScheduler::PromptWaits* waits = nullptr) {
+    bool granted = waits && waits->granted;
+    if (ctx->request_log && !granted) ctx->request_log->record_prompt(request);  // NOTE: as it arrived, before any crop
+    int64_t t_arrival = granted ? waits->t_arrival_us : ggml_time_us();
+    if (request.expire_ms > 0 && ggml_time_ms() >= request.expire_ms) {  // waited out its deadline in a queue
+        int32_t err_seq_id = granted && waits->admitted >= 0 ? waits->admitted : DEFAULT_ERROR_SEQ_ID;
+        ret = deadline_exceeded(ctx, ctx->get_seq_state(err_seq_id), err_seq_id, is_finished, content);
+        return -1;
+    }
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    bool memoise = bs->response_cache() != nullptr;
+    HashKey fingerprint = ctx->coalesce_requests || memoise ? request_fingerprint(request, ctx) : HashKey();
+    // A stored completion or an identical request in prefill: nothing to prepare or infer
+    if (!fingerprint.empty() && !granted) {
+        int32_t follower_id = memoise ? bs->replay(request.id, fingerprint) : -1;
+        if (follower_id < 0 && ctx->coalesce_requests) follower_id = bs->follow(request.id, fingerprint);
+        if (follower_id >= 0) {
+            auto& follower = ctx->get_seq_state(follower_id);
+            follower.stop_strings = request.stop_strings;
+            follower.max_tokens = request.max_tokens;
+            follower.priority = request.priority;
+            follower.n_generated = 0;
+            follower.timings.reset();
+            if (request.timings) {
+                follower.timings = std::make_unique<RequestTimings>();
+                follower.timings->t_arrival_us = t_arrival;
+                follower.timings->t_prepared_us = ggml_time_us();
+                follower.timings->coalesced = true;
+            }
+            chunks.reset();
+            return follower_id;
+        }
+    }
+    int32_t seq_id = granted ? waits->admitted : ctx->set_seq_id(request.id);  // Reserves a free sequence
+    if (seq_id < 0 && !granted) seq_id = bs->preempt_seq(request.id, request.priority);  // Swaps out a lower class one
+    if (seq_id < 0 && queue && waits && !granted && bs->admission()) {
+        waits->queued = true;
+        waits->priority = request.priority;
+        waits->expire_ms = request.expire_ms;
+        waits->t_arrival_us = t_arrival;
+        return -1;
+    }
+    if (seq_id < 0 && queue && !granted) seq_id = bs->admit(request.id, request.priority, request.expire_ms);
+    if (seq_id < 0 && request.expire_ms > 0 && ggml_time_ms() >= request.expire_ms) {
+        ret = deadline_exceeded(ctx, ctx->get_seq_state(DEFAULT_ERROR_SEQ_ID), DEFAULT_ERROR_SEQ_ID, is_finished,
+                                content);
+        return -1;
+    }
+    if (seq_id < 0) {  // sequence request limit
         auto& err_state = ctx->get_seq_state(DEFAULT_ERROR_SEQ_ID);
-        std::string err = "ERR: excessive concurrent requests\n";
-        return stop_process(false /* success */, err, content, *is_finished, err_state, ctx, DEFAULT_ERROR_SEQ_ID,
-                            false /* stop */);
+        std::string err = seq_id == ADMISSION_CANCELLED ? "ERR: cancelled\n" : "ERR: excessive concurrent requests\n";
+        ret = stop_process(false /* success */, err, content, *is_finished, err_state, ctx, DEFAULT_ERROR_SEQ_ID,
+                           false /* stop */);
+        return -1;
     }
+    int64_t queue_us = ggml_time_us() - t_arrival;
 
     auto& state = ctx->get_seq_state(seq_id);
-    state.is_infering.store(true);
+    state.pinned_embds.clear();
+    TraceScope trace("prepare_prompt", seq_id);
+
+    // NOTE: a context shift session keeps its whole history, the oldest turns are evicted in kv instead of cropped
+    bool shift = ctx->context_shift && !request.session.empty();
+    int32_t n_context = ctx->grant_context(seq_id);
+    int32_t prompt_limit = n_context * PROMPT_PROPORTION_LIMIT;
 
     common_chat_templates_inputs tmpl_inputs;
     common_chat_params formatted_chat;
+    ChatPrefix prefix;
+    int64_t t_template = ggml_time_us();
     try {
-        apply_chat_templates(formatted_chat, tmpl_inputs, ctx, request.messages, request.tools);
+        apply_chat_templates(formatted_chat, tmpl_inputs, ctx, request, &prefix, shift ? 0 : prompt_limit);
     } catch (const std::exception& e) {
         std::string exception(e.what());
         std::string err = "failed to parse messages, err: " + exception + "\n";
-        return stop_process(false /* success */, err, content, *is_finished, state, ctx, seq_id, true /* stop */);
+        ret = stop_process(false /* success */, err, content, *is_finished, state, ctx, seq_id, true /* stop */);
+        return -1;
     }
 
-    if (!ready_modal_bitmaps(request.modal_prts, tmpl_inputs, ctx, state)) {
+    int64_t t_bitmap = ggml_time_us();
+    if (!ready_modal_bitmaps(request, tmpl_inputs, formatted_chat.prompt, ctx, state)) {
         std::string err = "failed to init bitmap from buf\n";
-        return stop_process(false /* success */, err, content, *is_finished, state, ctx, seq_id, true /* stop */);
+        ret = stop_process(false /* success */, err, content, *is_finished, state, ctx, seq_id, true /* stop */);
+        return -1;
     }
+    int64_t t_tokenize = ggml_time_us();
+    ctx->metrics.record(METRIC_BITMAP, t_tokenize - t_bitmap);
 
-    auto chunks = std::make_shared<mtmd::input_chunks>(mtmd_input_chunks_init());
-    if (!from_input_to_token_chunks(formatted_chat, chunks, ctx, state)) {
+    chunks = std::make_shared<mtmd::input_chunks>(mtmd_input_chunks_init());
+    if (!from_input_to_token_chunks(formatted_chat, chunks, ctx, state, prefix)) {
         std::string err = "tokenize failed, chat-cmpl-" + std::to_string(seq_id) + "\n";
-        return stop_process(false /* success */, err, content, *is_finished, state, ctx, seq_id, true /* stop */);
+        ret = stop_process(false /* success */, err, content, *is_finished, state, ctx, seq_id, true /* stop */);
+        return -1;
     }
 
-    limit_prompt_tokens(chunks, ctx->n_usage_context, state, ctx);
+    // NOTE: what the prompt budget estimate missed
+    if (!shift) limit_prompt_tokens(chunks, n_context, state, ctx);
+    int64_t template_us = (t_bitmap - t_template) + (ggml_time_us() - t_tokenize);
+    ctx->metrics.record(METRIC_TEMPLATE, template_us);
 
-    /*================infer=====================*/
+    // NOTE: a free sequence still holding a longer prefix replaces the reserved one
+    std::vector<PrefixItem> items = prefix_items(chunks.get());
+    const LoraAdapter* lora = ctx->find_lora(request.lora);
+    seq_id = ctx->bind_seq_prefix(request.id, seq_id, items, lora, shift ? prompt_limit : 0, request.video_session);
+    if (shift && ctx->get_seq_state(seq_id).n_evicted_items == 0 && prefix_n_pos(items, items.size()) > prompt_limit) {
+        limit_prompt_tokens(chunks, n_context, state, ctx);  // no head in kv to shift behind
+        items = prefix_items(chunks.get());
+        seq_id = ctx->bind_seq_prefix(request.id, seq_id, items, lora, 0, request.video_session);
+    }
+    auto& bound_state = ctx->get_seq_state(seq_id);
+    if (&bound_state != &state) {
+        bound_state.pinned_embds = std::move(state.pinned_embds);
+        bound_state.n_kv_budget.store(state.n_kv_budget.exchange(0));
+        if (state.cancelled.exchange(false)) bound_state.cancelled.store(true);  // cancelled while preparing
+    }
+    if (!init_seq_sampler(request, ctx, bound_state, formatted_chat)) {
+        std::string err = "failed to init sampler\n";
+        ret = stop_process(false /* success */, err, content, *is_finished, bound_state, ctx, seq_id, true /* stop */);
+        return -1;
+    }
+    bound_state.call_syntax = common_chat_syntax();
+    if (request.tools && request.grammar.empty()) {  // NOTE: parallel_tool_calls is off, one call ends the answer
+        bound_state.call_syntax.format = formatted_chat.format;
+        bound_state.call_syntax.thinking_forced_open = formatted_chat.thinking_forced_open;
+    }
+    if (request.max_tokens > 0) ctx->trim_context(bound_state, prefix_n_pos(items, items.size()) + request.max_tokens);
+    if (ctx->kv_admission) {  // the prompt and what it may generate must fit the kv cells no other request claimed
+        int32_t n_projected =
+            prefix_n_pos(items, items.size()) + (request.max_tokens > 0 ? request.max_tokens : ctx->kv_output_reserve);
+        int64_t until_ms = ggml_time_ms();  // NOTE: waits like a request queued for a sequence, if queued at all
+        if (queue && ctx->admission_queue_max > 0) {
+            until_ms = ctx->admission_wait_ms > 0 ? until_ms + ctx->admission_wait_ms : INT64_MAX;
+            if (request.expire_ms > 0) until_ms = std::min(until_ms, request.expire_ms);
+        }
+        int64_t t_reserve = ggml_time_us();
+        bool reserved = ctx->reserve_kv(seq_id, n_projected, waits ? ggml_time_ms() : until_ms);
+        queue_us += ggml_time_us() - t_reserve;
+        if (!reserved && waits && until_ms > ggml_time_ms()) {  // claimed before the prompt is inferred
+            waits->kv_seq = seq_id;
+            waits->kv_pos = n_projected;
+            waits->kv_until_ms = until_ms;
+        } else if (!reserved) {
+            std::string err = "kv cache full, " + std::to_string(n_projected) + " projected positions do not fit\n";
+            ret = stop_process(false /* success */, err, content, *is_finished, bound_state, ctx, seq_id,
+                               true /* stop */);
+            return -1;
+        }
+    }
+    bound_state.n_cache_items = cache_prefix_items(request, tmpl_inputs, items, ctx);
+    bound_state.prompt_items = std::move(items);
+    bound_state.session = request.session;
+    bound_state.cache_pin = request.cache_pin;
+    bound_state.priority = request.priority;
+    bound_state.stop_strings = request.stop_strings;
+    bound_state.max_tokens = request.max_tokens;
+    bound_state.expire_ms = request.expire_ms;
+    bound_state.n_generated = 0;
+    bound_state.response_key = memoise ? fingerprint : HashKey();
+    bound_state.response_tokens.clear();
+    bound_state.arena = std::make_shared<RequestArena>();
+    bound_state.timings.reset();
+    if (request.timings) {
+        bound_state.timings = std::make_unique<RequestTimings>();
+        bound_state.timings->t_arrival_us = t_arrival;
+        bound_state.timings->t_prepared_us = ggml_time_us();
+        bound_state.timings->queue_us = queue_us;
+        bound_state.timings->template_us = template_us;
+        bound_state.timings->bitmap_us = t_tokenize - t_bitmap;
+    }
+    // NOTE: a leader past its deadline would fail its followers, a request with one only follows
+    if (!fingerprint.empty() && ctx->coalesce_requests && request.expire_ms == 0) bs->lead(bound_state, fingerprint);
+    return seq_id;
+}
+
+// Appends the piece of a token to the held text, res gets the part that can be returned, true on a stop string
+// NOTE: res is state.respone on the generate path, both buffers keep their capacity across tokens
+static bool take_held_text(LlamaSeqState& state, std::string_view piece, std::string& res) {
+    state.held_text.append(piece.data(), piece.size());
+    bool stopped = false;
+    size_t len = held_text_len(state.held_text, state.stop_strings, stopped);
+    res.assign(state.held_text, 0, len);
+    state.held_text.erase(0, len);
+    return stopped;
+}
+
+// First token of an inferred prompt, joins the decode loop unless finished
+static int32_t finish_prompt(LlamaMicoContext* ctx, int32_t seq_id, int32_t* is_finished, const char** content,
+                             std::function<void(llama_token)> token_sink) {
     BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
-    bs->blocking_infer(chunks, seq_id, request.priority);
-    llama_token token_id = ctx->get_seq_state(seq_id).last_token.load();
+    auto& state = ctx->get_seq_state(seq_id);
+    llama_token token_id = state.last_token.load();
+    if (state.timings && token_id >= 0) state.timings->t_first_token_us = ggml_time_us();
 
     std::string res = "";
+    if (token_id < 0 && state.expire_ms > 0 && ggml_time_ms() >= state.expire_ms)  // dropped by the scheduler
+        return deadline_exceeded(ctx, state, seq_id, is_finished, content);
     if (llama_vocab_is_eog(ctx->vocab, token_id) || token_id < 0) {
         return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, true /* stop */);
     }
-    res = common_token_to_piece(ctx->lctx, token_id);
+    std::string_view piece = ctx->token_piece(token_id);
+    if (token_sink) {  // NOTE: the async stream holds back partial utf8 and stop strings itself
+        res = piece;
+    } else if (take_held_text(state, piece, res)) {
+        return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, true /* stop */);
+    }
+    if (state.max_tokens == 1) {  // the prompt token is the whole answer
+        if (!token_sink) res += state.held_text;
+        return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, true /* stop */);
+    }
+    bs->start_decoding(seq_id, token_sink);  // Join the continuous decode loop
     return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, false /* stop */);
 }
 
-LLAMA_MICO_API int32_t llama_mico_request_generate(void* handle, const char* request_json_str, int32_t* is_finished,
-                                                   const char** content) {
-    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+// NOTE: on the caller thread, ctypes releases the GIL around the call so callers prepare in parallel
+static int32_t request_prompt(LlamaMicoContext* ctx, MicoRequest& request, int32_t* is_finished,
+                              const char** content) {
+    int32_t ret = MICO_SUCCESS;
+    std::shared_ptr<mtmd::input_chunks> chunks;
+    int32_t seq_id = prepare_prompt(ctx, request, chunks, is_finished, content, ret);
+    if (seq_id < 0) return ret;
 
-    json request_json = json::parse(request_json_str);
-    // printf("request_json_str: %s\n", request_json_str);
-    MicoRequest request;
-    if (!from_json_to_request(request_json, request)) {
-        auto& err_state = ctx->get_seq_state(DEFAULT_ERROR_SEQ_ID);
-        std::string err = "ERR: failed to parse request_json\n";
-        return stop_process(false /* success */, err, content, *is_finished, err_state, ctx, DEFAULT_ERROR_SEQ_ID,
-                            false /* stop */);
-    }
+    /*================infer=====================*/
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    bs->blocking_infer(chunks, seq_id, request.priority);
+    return finish_prompt(ctx, seq_id, is_finished, content, nullptr);
+}
 
-    int32_t seq_id = ctx->get_seq_id(request.id);                        // Ensure seq_id is within bounds
-    if (seq_id < 0 || !ctx->get_seq_state(seq_id).is_infering.load()) {  // sequence request limit
+static int32_t request_generate(LlamaMicoContext* ctx, MicoRequest& request, int32_t* is_finished,
+                                const char** content) {
+    LlamaSeqState* found = ctx->get_cmpl_state(request.id);  // NOTE: may be swapped out by preemption
+    if (!found) {                                            // sequence request limit
         auto& err_state = ctx->get_seq_state(DEFAULT_ERROR_SEQ_ID);
-        std::string err = "chat-cmpl-" + std::to_string(seq_id) + " is not in infering, please request prompt\n";
+        std::string err = "chat-cmpl-" + std::to_string(request.id) + " is not in infering, please request prompt\n";
         return stop_process(false /* success */, err, content, *is_finished, err_state, ctx, DEFAULT_ERROR_SEQ_ID,
                             true /* stop */);
     }
 
-    auto& state = ctx->get_seq_state(seq_id);
+    auto& state = *found;
+    int32_t seq_id = state.seq_id;  // NOTE: stop_process looks the current id up again
     if (request.stop) {
         std::string res = "";
         return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, true /* stop */);
     }
-    // exceed max context
-    if (state.n_past.load() >= ctx->n_usage_context) {
-        std::string res = "";
-        return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, true /* stop */,
-                            true /* too long */);
-    }
-
-    llama_token last_token = state.last_token;
-    std::vector<llama_token> tokens_text{last_token};
-    mtmd_input_chunks* text_chunks = mtmd_create_text_chunks(tokens_text);
-    auto chunks = std::make_shared<mtmd::input_chunks>(text_chunks);
 
     /*================infer=====================*/
     BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
-    bs->blocking_infer(chunks, seq_id);
-
-    llama_token token_id = ctx->get_seq_state(seq_id).last_token.load();
+    llama_token token_id = -1;
+    if (!bs->wait_next_token(state, token_id)) {  // retired by the decode loop: max_tokens, tool call or full
+        std::string res = state.held_text;
+        return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, true /* stop */,
+                            !bs->reached_max_tokens(state) && !state.call_done /* too long */);
+    }
     if (token_id < 0) {
         std::string err = "chat-cmpl-" + std::to_string(seq_id) + " last token is invalid, please request prompt\n";
         return stop_process(false /* success */, err, content, *is_finished, state, ctx, seq_id, true /* stop */);
     }
 
-    std::string res = "";
     if (llama_vocab_is_eog(ctx->vocab, token_id)) {
+        std::string res = state.held_text;  // NOTE: flushed as is, a partial stop string never completes
         return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, true /* stop */);
     }
-    res = common_token_to_piece(ctx->lctx, token_id);
+    std::string& res = state.respone;  // NOTE: written in place, stop_process assigns it to itself
+    bool stopped = take_held_text(state, ctx->token_piece(token_id), res);
+    return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, stopped /* stop */);
+}
+
+static int32_t parse_failed(LlamaMicoContext* ctx, int32_t* is_finished, const char** content) {
+    auto& err_state = ctx->get_seq_state(DEFAULT_ERROR_SEQ_ID);
+    std::string err = "ERR: failed to parse request\n";
+    return stop_process(false /* success */, err, content, *is_finished, err_state, ctx, DEFAULT_ERROR_SEQ_ID,
+                        false /* stop */);
+}
+
+// Entries failing in one call each keep their error, the next failure on the thread (or request on the sequence)
+// reuses the buffer stop_process reported it into. NOTE: errors is sized up front, kept until the next call
+static void keep_entry_error(std::vector<std::string>& errors, int32_t i, const char** contents) {
+    errors[i] = contents[i] ? contents[i] : "";
+    contents[i] = errors[i].c_str();
+}
+
+int32_t llama_mico_request_prompt(void* handle, const char* request_json_str, int32_t* is_finished,
+                                  const char** content) {
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+
+    MicoRequest request;
+    if (!parse_request_json(request_json_str, request, ctx)) return parse_failed(ctx, is_finished, content);
+    return request_prompt(route_request(ctx, request), request, is_finished, content);
+}
+
+LLAMA_MICO_API int32_t llama_mico_request_generate(void* handle, const char* request_json_str, int32_t* is_finished,
+                                                   const char** content) {
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+
+    MicoRequest request;
+    if (!parse_request_json(request_json_str, request, ctx)) return parse_failed(ctx, is_finished, content);
+    return request_generate(replica_of(ctx, request.id), request, is_finished, content);
+}
+
+LLAMA_MICO_API int32_t llama_mico_request_prompt_batch(void* handle, const char** request_json_strs, int32_t n_requests,
+                                                       int32_t* is_finished, const char** contents) {
+    LlamaMicoContext* ctx = least_loaded(static_cast<LlamaMicoContext*>(handle));  // NOTE: the batch stays together
+
+    int32_t ret = MICO_SUCCESS;
+    std::vector<int32_t> seq_ids(n_requests, -1);
+    std::vector<int32_t> request_rets(n_requests, MICO_SUCCESS);
+    std::vector<int32_t> priorities(n_requests, 0);
+    std::vector<std::shared_ptr<mtmd::input_chunks>> prepared(n_requests);
+    thread_local std::vector<std::string> batch_errors;  // NOTE: of the caller, the tasks run on the front-end too
+    std::vector<std::string>& errors = batch_errors;
+    errors.assign(n_requests, "");
+    std::vector<std::function<void()>> tasks;
+    for (int32_t i = 0; i < n_requests; i++) {  // Prepare all in parallel before the first chunk is scheduled
+        tasks.push_back([&, i]() {
+            MicoRequest request;
+            if (!parse_request_json(request_json_strs[i], request, ctx)) {
+                request_rets[i] = parse_failed(ctx, &is_finished[i], &contents[i]);
+                keep_entry_error(errors, i, contents);
+                return;
+            }
+            priorities[i] = request.priority;
+            seq_ids[i] = prepare_prompt(ctx, request, prepared[i], &is_finished[i], &contents[i], request_rets[i],
+                                        false /* queue */);
+            if (seq_ids[i] < 0) keep_entry_error(errors, i, contents);
+        });
+    }
+    static_cast<PromptFrontend*>(ctx->prompt_frontend)->run_all(std::move(tasks));
+
+    std::vector<std::shared_ptr<mtmd::input_chunks>> batch_chunks;
+    std::vector<size_t> batch_seqs;
+    std::vector<int32_t> batch_priorities;
+    for (int32_t i = 0; i < n_requests; i++) {
+        if (request_rets[i] != MICO_SUCCESS) ret = MICO_ERROR;
+        if (seq_ids[i] < 0) continue;
+        batch_chunks.push_back(prepared[i]);
+        batch_seqs.push_back(seq_ids[i]);
+        batch_priorities.push_back(priorities[i]);
+    }
+
+    /*================infer=====================*/
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    if (!batch_seqs.empty()) bs->blocking_infer_batch(batch_chunks, batch_seqs, batch_priorities);
+    for (int32_t i = 0; i < n_requests; i++) {
+        if (seq_ids[i] < 0) continue;
+        if (finish_prompt(ctx, seq_ids[i], &is_finished[i], &contents[i], nullptr) != MICO_SUCCESS) ret = MICO_ERROR;
+    }
+    return ret;
+}
+
+LLAMA_MICO_API int32_t llama_mico_request_prompt_n(void* handle, const char* request_json_str, int32_t n,
+                                                   int32_t* is_finished, const char** contents) {
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    if (n < 1) {
+        LOG_ERR("ERR: n must be at least 1\n");
+        return MICO_ERROR;
+    }
+    MicoRequest request;
+    if (!parse_request_json(request_json_str, request, ctx)) {
+        for (int32_t i = 0; i < n; i++) parse_failed(ctx, &is_finished[i], &contents[i]);
+        return MICO_ERROR;
+    }
+    ctx = route_request(ctx, request);  // NOTE: the completions share the prefill of one replica
+    if (n == 1) return request_prompt(ctx, request, &is_finished[0], &contents[0]);
+    if (!request.session.empty() || !request.video_session.empty()) {
+        auto& err_state = ctx->get_seq_state(DEFAULT_ERROR_SEQ_ID);
+        std::string err = "ERR: n > 1 is not supported with a session or video_session\n";
+        for (int32_t i = 0; i < n; i++) {
+            stop_process(false /* success */, err, &contents[i], is_finished[i], err_state, ctx, DEFAULT_ERROR_SEQ_ID,
+                         false /* stop */);
+        }
+        return MICO_ERROR;
+    }
+    request.coalesce = false;  // NOTE: every completion samples on its own
+
+    int32_t ret = MICO_SUCCESS;
+    std::vector<int32_t> seq_ids(n, -1);
+    std::vector<std::shared_ptr<mtmd::input_chunks>> prepared(n);
+    thread_local std::vector<std::string> completion_errors;
+    completion_errors.assign(n, "");
+    int32_t base_id = request.id;
+    for (int32_t i = 0; i < n; i++) {  // NOTE: only the first may queue, the others would hold sequences meanwhile
+        request.id = base_id + i;
+        request.seed_offset = (uint32_t)i;
+        int32_t request_ret = MICO_SUCCESS;
+        seq_ids[i] = prepare_prompt(ctx, request, prepared[i], &is_finished[i], &contents[i], request_ret, i == 0);
+        if (request_ret != MICO_SUCCESS) ret = MICO_ERROR;
+        if (seq_ids[i] < 0) keep_entry_error(completion_errors, i, contents);
+    }
+
+    std::vector<std::shared_ptr<mtmd::input_chunks>> batch_chunks;
+    std::vector<size_t> batch_seqs;
+    for (int32_t i = 0; i < n; i++) {
+        if (seq_ids[i] < 0) continue;
+        batch_chunks.push_back(prepared[i]);
+        batch_seqs.push_back(seq_ids[i]);
+    }
+
+    /*================infer=====================*/
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    if (!batch_seqs.empty()) bs->blocking_infer_fork(batch_chunks, batch_seqs, request.priority);
+    for (int32_t i = 0; i < n; i++) {
+        if (seq_ids[i] < 0) continue;
+        if (finish_prompt(ctx, seq_ids[i], &is_finished[i], &contents[i], nullptr) != MICO_SUCCESS) ret = MICO_ERROR;
+    }
+    return ret;
+}
+
+LLAMA_MICO_API int32_t llama_mico_request_prompt_struct(void* handle, const llama_mico_request* request,
+                                                        int32_t* is_finished, const char** content) {
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+
+    MicoRequest mico_request;
+    if (!request || !from_struct_to_request(*request, mico_request, ctx))
+        return parse_failed(ctx, is_finished, content);
+    return request_prompt(route_request(ctx, mico_request), mico_request, is_finished, content);
+}
+
+LLAMA_MICO_API int32_t llama_mico_request_generate_struct(void* handle, const llama_mico_request* request,
+                                                          int32_t* is_finished, const char** content) {
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+
+    MicoRequest mico_request;
+    if (!request || !from_struct_to_request(*request, mico_request, ctx))
+        return parse_failed(ctx, is_finished, content);
+    return request_generate(replica_of(ctx, mico_request.id), mico_request, is_finished, content);
+}
+
+// Copies an output null-terminated into the caller's buffer. Text that does not fit is kept for the request and
+// n_written is set to the bytes it needs, an error message is cut to fit instead
+static int32_t copy_output(LlamaMicoContext* ctx, int32_t request_id, int32_t ret, int32_t* is_finished,
+                           const char* content, char* buffer, int32_t size, int32_t* n_written) {
+    size_t len = content ? strlen(content) : 0;
+    if (len >= (size_t)std::max(size, 0) && ret != MICO_ERROR && ret != MICO_ERROR_DEADLINE_EXCEEDED) {
+        std::lock_guard<std::mutex> lock(ctx->pending_outputs_mutex);
+        ctx->pending_outputs[request_id] = {std::string(content, len), *is_finished, ret};
+        ctx->n_pending_outputs.store(ctx->pending_outputs.size());
+        *is_finished = 0;
+        *n_written = (int32_t)len + 1;
+        return MICO_ERROR_BUFFER_TOO_SMALL;
+    }
+    len = std::min(len, (size_t)std::max(size - 1, 0));
+    if (size > 0) {
+        memcpy(buffer, content, len);
+        buffer[len] = '\0';
+    }
+    *n_written = (int32_t)len;
+    return ret;
+}
+
+static bool take_pending_output(LlamaMicoContext* ctx, int32_t request_id, LlamaMicoContext::PendingOutput& output) {
+    if (ctx->n_pending_outputs.load() == 0) return false;
+    std::lock_guard<std::mutex> lock(ctx->pending_outputs_mutex);
+    auto it = ctx->pending_outputs.find(request_id);
+    if (it == ctx->pending_outputs.end()) return false;
+    output = std::move(it->second);
+    ctx->pending_outputs.erase(it);
+    ctx->n_pending_outputs.store(ctx->pending_outputs.size());
+    return true;
+}
+
+LLAMA_MICO_API int32_t llama_mico_request_prompt_into(void* handle, const char* request_json_str, int32_t* is_finished,
+                                                      char* buffer, int32_t size, int32_t* n_written) {
+    if (!handle || !is_finished || !n_written || (!buffer && size > 0)) {
+        LOG_ERR("ERR: handle, is_finished, n_written or buffer is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    const char* content = nullptr;
+    MicoRequest request;
+    bool parsed = parse_request_json(request_json_str, request, ctx);
+    if (parsed) ctx = route_request(ctx, request);  // NOTE: output kept for generate_into stays on the replica
+    int32_t ret =
+        parsed ? request_prompt(ctx, request, is_finished, &content) : parse_failed(ctx, is_finished, &content);
+    return copy_output(ctx, request.id, ret, is_finished, content, buffer, size, n_written);
+}
+
+LLAMA_MICO_API int32_t llama_mico_request_generate_into(void* handle, int32_t request_id, int32_t stop,
+                                                        int32_t* is_finished, char* buffer, int32_t size,
+                                                        int32_t* n_written) {
+    if (!handle || !is_finished || !n_written || (!buffer && size > 0)) {
+        LOG_ERR("ERR: handle, is_finished, n_written or buffer is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = replica_of(static_cast<LlamaMicoContext*>(handle), request_id);
+    LlamaMicoContext::PendingOutput pending;
+    if (take_pending_output(ctx, request_id, pending) && !stop) {  // NOTE: a stop drops the kept text
+        *is_finished = pending.is_finished;
+        return copy_output(ctx, request_id, pending.ret, is_finished, pending.text.c_str(), buffer, size, n_written);
+    }
+    const char* content = nullptr;
+    MicoRequest request;
+    request.id = request_id;
+    request.stop = stop != 0;
+    int32_t ret = request_generate(ctx, request, is_finished, &content);
+    return copy_output(ctx, request_id, ret, is_finished, content, buffer, size, n_written);
+}
+
+LLAMA_MICO_API int32_t llama_mico_request_generate_n(void* handle, int32_t request_id, int32_t max_tokens,
+                                                     const char** stop_strings, int32_t n_stop_strings,
+                                                     llama_mico_piece_callback callback, void* user_data,
+                                                     int32_t* is_finished, const char** content) {
+    LlamaMicoContext* ctx = replica_of(static_cast<LlamaMicoContext*>(handle), request_id);
+
+    LlamaSeqState* found = ctx->get_cmpl_state(request_id);  // NOTE: may be swapped out by preemption
+    if (!found) {                                            // sequence request limit
+        auto& err_state = ctx->get_seq_state(DEFAULT_ERROR_SEQ_ID);
+        std::string err = "chat-cmpl-" + std::to_string(request_id) + " is not in infering, please request prompt\n";
+        return stop_process(false /* success */, err, content, *is_finished, err_state, ctx, DEFAULT_ERROR_SEQ_ID,
+                            true /* stop */);
+    }
+    auto& state = *found;
+    int32_t seq_id = state.seq_id;  // NOTE: stop_process looks the current id up again
+
+    std::vector<std::string> stops = state.stop_strings;
+    for (int32_t i = 0; stop_strings && i < n_stop_strings; i++) {
+        if (stop_strings[i] && stop_strings[i][0] != '\0') stops.emplace_back(stop_strings[i]);
+    }
+
+    std::string res = "";
+    std::string& held = state.held_text;  // NOTE: not returned yet, kept across calls
+    std::string piece;                    // NOTE: reused, its capacity grows to the longest emit
+    auto emit = [&](size_t len) {         // false if the caller asked to stop
+        if (len == 0) return true;
+        piece.assign(held, 0, len);
+        held.erase(0, len);
+        res += piece;
+        return !callback || callback(piece.c_str(), user_data) == 0;
+    };
+
+    /*================infer=====================*/
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    for (int32_t n = 0; max_tokens <= 0 || n < max_tokens; n++) {
+        llama_token token_id = -1;
+        if (!bs->wait_next_token(state, token_id)) {  // retired by the decode loop: max_tokens, tool call or full
+            emit(held.size());
+            return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, true /* stop */,
+                                !bs->reached_max_tokens(state) && !state.call_done /* too long */);
+        }
+        if (token_id < 0) {
+            std::string err = "chat-cmpl-" + std::to_string(seq_id) + " last token is invalid, please request prompt\n";
+            return stop_process(false /* success */, err, content, *is_finished, state, ctx, seq_id, true /* stop */);
+        }
+        if (llama_vocab_is_eog(ctx->vocab, token_id)) {
+            emit(held.size());
+            return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, true /* stop */);
+        }
+        held.append(ctx->token_piece(token_id));
+
+        bool stopped = false;
+        size_t len = held_text_len(held, stops, stopped);  // Hold back text that may still become a stop string
+        if (stopped) {
+            emit(len);
+            return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, true /* stop */);
+        }
+        if (!emit(len)) {  // stopped by callback
+            return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, true /* stop */);
+        }
+    }
     return stop_process(true /* success */, res, content, *is_finished, state, ctx, seq_id, false /* stop */);
-}
\ No newline at end of file
+}
+
+static int32_t submit_request(LlamaMicoContext* ctx, const char* request_json_str, llama_mico_piece_callback on_token,
+                              void* user_data, std::shared_ptr<SpscByteRing> ring, int32_t* ticket) {
+    int32_t is_finished = 0;
+    const char* content = nullptr;
+
+    MicoRequest request;
+    if (!parse_request_json(request_json_str, request, ctx)) return parse_failed(ctx, &is_finished, &content);
+    ctx = route_request(ctx, request);
+
+    AsyncScheduler* as = static_cast<AsyncScheduler*>(ctx->async_scheduler);
+    struct Prepared {
+        MicoRequest request;
+        std::shared_ptr<mtmd::input_chunks> chunks;
+        int32_t seq_id{-1};
+    };
+    auto prepared = std::make_shared<Prepared>();
+    prepared->request = std::move(request);
+    // NOTE: waits for neither a sequence nor kv, AsyncScheduler runs it again once granted one
+    auto prepare = [ctx, prepared](AsyncScheduler::PromptWaits& waits, int32_t& finished, std::string& res) {
+        const char* prompt_content = nullptr;
+        int32_t ret = MICO_SUCCESS;
+        prepared->seq_id = prepare_prompt(ctx, prepared->request, prepared->chunks, &finished, &prompt_content, ret,
+                                          true /* queue */, &waits);
+        if (prepared->seq_id < 0) res = prompt_content ? prompt_content : "";
+        return ret;
+    };
+    auto prompt = [ctx, prepared](AsyncScheduler::TokenSink sink, int32_t& finished, std::string& res) {
+        BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+        bs->blocking_infer(prepared->chunks, prepared->seq_id, prepared->request.priority);
+        prepared->chunks.reset();
+        const char* prompt_content = nullptr;
+        int32_t ret = finish_prompt(ctx, prepared->seq_id, &finished, &prompt_content, sink);
+        res = prompt_content ? prompt_content : "";
+        return ret;
+    };
+    const MicoRequest& submitted = prepared->request;
+    if (!as->submit(submitted.id, prepare, prompt, on_token, user_data, ring, submitted.stop_strings)) {
+        auto& err_state = ctx->get_seq_state(DEFAULT_ERROR_SEQ_ID);
+        std::string err = "ERR: request " + std::to_string(submitted.id) + " is already submitted\n";
+        return stop_process(false /* success */, err, &content, is_finished, err_state, ctx, DEFAULT_ERROR_SEQ_ID,
+                            false /* stop */);
+    }
+    *ticket = submitted.id;
+    return MICO_SUCCESS;
+}
+
+LLAMA_MICO_API int32_t llama_mico_submit(void* handle, const char* request_json_str, llama_mico_piece_callback on_token,
+                                         void* user_data, int32_t* ticket) {
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    return submit_request(ctx, request_json_str, on_token, user_data, nullptr, ticket);
+}
+
+struct MicoStream {
+    std::shared_ptr<SpscByteRing> ring;  // NOTE: shared with the decode loop, which may outlive the stream
+};
+
+LLAMA_MICO_API int32_t llama_mico_stream_open(void* handle, const char* request_json_str, int32_t capacity,
+                                              void** stream) {
+    if (!handle || !request_json_str || !stream) {
+        LOG_ERR("ERR: handle, request or stream is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    auto ring = std::make_shared<SpscByteRing>(capacity > 0 ? (size_t)capacity : MICO_STREAM_DEFAULT_BYTES);
+    int32_t ticket = 0;
+    int32_t ret = submit_request(ctx, request_json_str, nullptr, nullptr, ring, &ticket);
+    if (ret != MICO_SUCCESS) return ret;
+    *stream = new MicoStream{ring};
+    return MICO_SUCCESS;
+}
+
+LLAMA_MICO_API int32_t llama_mico_stream_read(void* stream, char* buffer, int32_t size, int32_t timeout_ms,
+                                              int32_t* n_read, int32_t* is_finished) {
+    if (!stream || !buffer || size <= 0 || !n_read || !is_finished) {
+        LOG_ERR("ERR: stream or buffer is null\n");
+        return MICO_ERROR;
+    }
+    MicoStream* s = static_cast<MicoStream*>(stream);
+    bool closed = false;
+    int32_t result = MICO_SUCCESS;
+    *n_read = (int32_t)s->ring->pop(buffer, (size_t)size, timeout_ms, closed, result);
+    *is_finished = closed ? 1 : 0;
+    return closed ? result : MICO_SUCCESS;
+}
+
+LLAMA_MICO_API int32_t llama_mico_stream_close(void* stream) {
+    if (!stream) return MICO_ERROR;
+    MicoStream* s = static_cast<MicoStream*>(stream);
+    s->ring->cancel();  // NOTE: an unfinished request stops at its next token
+    delete s;
+    return MICO_SUCCESS;
+}
+
+LLAMA_MICO_API int32_t llama_mico_poll(void* handle, int32_t ticket, int32_t* is_finished, const char** content) {
+    LlamaMicoContext* ctx = replica_of(static_cast<LlamaMicoContext*>(handle), ticket);
+    thread_local std::string polled = "";  // NOTE: valid until the next poll of the calling thread
+
+    AsyncScheduler* as = static_cast<AsyncScheduler*>(ctx->async_scheduler);
+    int32_t ret = as->poll(ticket, *is_finished, polled);
+    *content = polled.c_str();
+    return ret;
+}
+
+LLAMA_MICO_API int32_t llama_mico_prime(void* handle, const char* request_json_str) {
+    if (!handle || !request_json_str) {
+        LOG_ERR("ERR: handle or request is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    if (!bs->kv_cache()) {
+        LOG_ERR("ERR: no kv cache to prime, cache_seq_num is 0\n");
+        return MICO_ERROR;
+    }
+    MicoRequest request;
+    if (!parse_request_json(request_json_str, request, ctx)) {
+        LOG_ERR("ERR: failed to parse prime request\n");
+        return MICO_ERROR;
+    }
+    ctx = route_request(ctx, request);  // NOTE: where the requests of the prefix go
+    bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    request.session.clear();  // NOTE: the prefix is shared, never kept with a session
+    request.coalesce = false;  // NOTE: infers a part of the prompt only, no request can share its tokens
+
+    int32_t is_finished = 0;
+    const char* content = nullptr;
+    int32_t ret = MICO_SUCCESS;
+    std::shared_ptr<mtmd::input_chunks> chunks;
+    int32_t seq_id = prepare_prompt(ctx, request, chunks, &is_finished, &content, ret);
+    if (seq_id < 0) return ret;
+
+    // Only the cacheable prefix is prefilled, the infer stores it and the sampled token is dropped
+    auto& state = ctx->get_seq_state(seq_id);
+    if (state.n_cache_items > 0 && state.n_cache_items < state.prompt_items.size()) {
+        keep_prefix_chunks(chunks, state.n_cache_items);
+        state.prompt_items.resize(state.n_cache_items);
+    }
+    int32_t priority = std::min(request.priority, ctx->slo_class_priorities[TASK_CLASS_COUNT - 2] - 1);  // background
+    bs->blocking_infer(chunks, seq_id, priority);
+    bool ok = state.last_token.load() >= 0;
+    std::string res = ok ? "" : "prime prefill failed\n";
+    return stop_process(ok, res, &content, is_finished, state, ctx, seq_id, true /* stop */);
+}
+
+LLAMA_MICO_API int32_t llama_mico_video_append(void* handle, const char* request_json_str) {
+    if (!handle || !request_json_str) {
+        LOG_ERR("ERR: handle or request is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    MicoRequest request;
+    if (!parse_request_json(request_json_str, request, ctx)) {
+        LOG_ERR("ERR: failed to parse video append request\n");
+        return MICO_ERROR;
+    }
+    if (request.video_session.empty() || ctx->video_session_max <= 0) {
+        LOG_ERR("ERR: no video_session in the request or video_sessions is 0\n");
+        return MICO_ERROR;
+    }
+    ctx = route_request(ctx, request);
+    bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    request.session.clear();   // NOTE: the window is kept in its own sequence, never with a session
+    request.coalesce = false;  // NOTE: infers the frames only, no request can share its tokens
+
+    int32_t is_finished = 0;
+    const char* content = nullptr;
+    int32_t ret = MICO_SUCCESS;
+    std::shared_ptr<mtmd::input_chunks> chunks;
+    int32_t seq_id = prepare_prompt(ctx, request, chunks, &is_finished, &content, ret);
+    if (seq_id < 0) return ret;
+
+    // Only the prompt up to the last frame is prefilled, the text after it is the next question's
+    auto& state = ctx->get_seq_state(seq_id);
+    size_t n_keep = state.prompt_items.size();
+    while (n_keep > 0 && state.prompt_items[n_keep - 1].key >= 0) n_keep--;
+    if (n_keep == 0) {
+        std::string err = "no frame to append\n";
+        return stop_process(false /* success */, err, &content, is_finished, state, ctx, seq_id, true /* stop */);
+    }
+    bool ok = true;
+    if (state.n_resident_items < n_keep) {  // NOTE: otherwise the window already holds every frame
+        keep_prefix_chunks(chunks, n_keep);
+        state.prompt_items.resize(n_keep);
+        state.last_token.store(0);
+        bs->blocking_infer(chunks, seq_id, request.priority);
+        ok = state.last_token.load() >= 0;
+    }
+    std::string res = ok ? "" : "video append prefill failed\n";
+    return stop_process(ok, res, &content, is_finished, state, ctx, seq_id, true /* stop */);
+}
+
+LLAMA_MICO_API int32_t llama_mico_score(void* handle, const char* request_json_str, const char** candidates,
+                                        int32_t n_candidates, float* logprobs) {
+    if (!handle || !request_json_str || !candidates || n_candidates <= 0 || !logprobs) {
+        LOG_ERR("ERR: handle, request, candidates or logprobs is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    std::vector<llama_tokens> candidate_tokens;
+    size_t max_tokens = 0;
+    for (int32_t c = 0; c < n_candidates; c++) {
+        candidate_tokens.push_back(candidates[c] ? common_tokenize(ctx->vocab, candidates[c], false, true)
+                                                 : llama_tokens());
+        max_tokens = std::max(max_tokens, candidate_tokens.back().size());
+        if (candidate_tokens.back().empty() || candidate_tokens.back().size() > (size_t)ctx->n_batch) {
+            LOG_ERR("ERR: candidate %d is empty or longer than n_batch\n", c);
+            return MICO_ERROR;
+        }
+    }
+    MicoRequest request;
+    if (!parse_request_json(request_json_str, request, ctx)) {
+        LOG_ERR("ERR: failed to parse score request\n");
+        return MICO_ERROR;
+    }
+    ctx = route_request(ctx, request);
+    bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    request.session.clear();   // NOTE: the candidates are never kept with a session
+    request.coalesce = false;  // NOTE: infers all but the last prompt token, no request can share its tokens
+
+    int32_t is_finished = 0;
+    const char* content = nullptr;
+    int32_t ret = MICO_SUCCESS;
+    std::shared_ptr<mtmd::input_chunks> chunks;
+    int32_t seq_id = prepare_prompt(ctx, request, chunks, &is_finished, &content, ret);
+    if (seq_id < 0) return ret;
+
+    // The last prompt token is left out of the prefill, its logits are the first row of every candidate
+    auto& state = ctx->get_seq_state(seq_id);
+    size_t n_chunks = mtmd_input_chunks_size(chunks->ptr.get());
+    const mtmd_input_chunk* last = n_chunks > 0 ? mtmd_input_chunks_get(chunks->ptr.get(), n_chunks - 1) : nullptr;
+    size_t n_last = 0;
+    const llama_token* last_tokens = last && mtmd_input_chunk_get_type(last) == MTMD_INPUT_CHUNK_TYPE_TEXT
+                                         ? mtmd_input_chunk_get_tokens_text(last, &n_last)
+                                         : nullptr;
+    size_t n_items = state.prompt_items.size();
+    if (!last_tokens || n_last == 0 || n_items < 2 ||
+        prefix_n_pos(state.prompt_items, n_items) + (llama_pos)max_tokens > ctx->seq_context_limit(seq_id)) {
+        std::string err = "prompt does not end with text or the candidates exceed the context\n";
+        return stop_process(false /* success */, err, &content, is_finished, state, ctx, seq_id, true /* stop */);
+    }
+    llama_token last_token = last_tokens[n_last - 1];
+    keep_prefix_chunks(chunks, n_items - 1);
+    state.prompt_items.resize(n_items - 1);
+    state.last_token.store(0);  // NOTE: nothing is inferred if the sequence kept the whole prefix
+    bs->blocking_infer(chunks, seq_id, request.priority);
+
+    std::vector<float> scores;
+    bool ok = state.last_token.load() >= 0 && bs->score(seq_id, last_token, candidate_tokens, scores);
+    if (ok) std::copy(scores.begin(), scores.end(), logprobs);
+    std::string res = ok ? "" : "score decode failed\n";
+    return stop_process(ok, res, &content, is_finished, state, ctx, seq_id, true /* stop */);
+}
+
+LLAMA_MICO_API int32_t llama_mico_cancel(void* handle, int32_t request_id) {
+    if (!handle) {
+        LOG_ERR("ERR: handle is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = replica_of(static_cast<LlamaMicoContext*>(handle), request_id);
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    return bs->cancel((size_t)request_id) ? MICO_SUCCESS : MICO_ERROR;
+}
+
+LLAMA_MICO_API int32_t llama_mico_release_session(void* handle, const char* session) {
+    if (!handle || !session) {
+        LOG_ERR("ERR: handle or session is null\n");
+        return MICO_ERROR;
+    }
+    for (LlamaMicoContext* ctx : replicas_of(static_cast<LlamaMicoContext*>(handle)))
+        static_cast<BatchScheduler*>(ctx->batch_scheduler)->release_session(session);
+    return MICO_SUCCESS;
+}
+
+LLAMA_MICO_API int32_t llama_mico_session_export(void* handle, const char* session, const uint8_t** data,
+                                                 size_t* size) {
+    if (!handle || !session || !data || !size) {
+        LOG_ERR("ERR: handle, session, data or size is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    for (LlamaMicoContext* replica : ctx->replicas) {
+        if (!static_cast<BatchScheduler*>(replica->batch_scheduler)->has_session(session)) continue;
+        bs = static_cast<BatchScheduler*>(replica->batch_scheduler);
+        break;
+    }
+    thread_local std::vector<uint8_t> exported;  // NOTE: valid until the next call of the calling thread
+    if (!bs->export_session(session, exported)) {
+        LOG_WRN("session %s is not cached, nothing exported\n", session);
+        return MICO_ERROR;
+    }
+    *data = exported.data();
+    *size = exported.size();
+    return MICO_SUCCESS;
+}
+
+LLAMA_MICO_API int32_t llama_mico_session_import(void* handle, const uint8_t* data, size_t size) {
+    if (!handle || !data || size == 0) {
+        LOG_ERR("ERR: handle or data is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = least_loaded(static_cast<LlamaMicoContext*>(handle));
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    std::string session;
+    return bs->import_session(data, size, session) ? MICO_SUCCESS : MICO_ERROR;
+}
+
+LLAMA_MICO_API int32_t llama_mico_register_buffer(void* handle, size_t size, int32_t format, uint32_t nx, uint32_t ny,
+                                                  uint8_t** data, int32_t* buffer_id) {
+    if (!handle || !data || !buffer_id || size == 0 || size > INT32_MAX) {
+        LOG_ERR("ERR: handle, data or buffer_id is null or size is invalid\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    *buffer_id = ctx->modal_buffers->acquire(size, format, nx, ny, data);
+    return *buffer_id > 0 ? MICO_SUCCESS : MICO_ERROR;
+}
+
+LLAMA_MICO_API int32_t llama_mico_release_buffer(void* handle, int32_t buffer_id) {
+    if (!handle) {
+        LOG_ERR("ERR: handle is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    return ctx->modal_buffers->release(buffer_id) ? MICO_SUCCESS : MICO_ERROR;
+}
+
+LLAMA_MICO_API int32_t llama_mico_pre_encode(void* handle, const llama_mico_modal_buffer* frame,
+                                             const char* content_id) {
+    if (!handle || !frame) {
+        LOG_ERR("ERR: handle or frame is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = least_loaded(static_cast<LlamaMicoContext*>(handle));  // NOTE: the cache is shared
+    if (!ctx->shared_model->has_vision()) return MICO_ERROR;
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    bool cached = false;
+    auto images = frame_image_chunks(*frame, content_id, ctx, cached);
+    if (cached) return MICO_SUCCESS;
+    if (images.empty()) return MICO_ERROR;
+    for (auto& image : images) {
+        if (!bs->encode_ahead(image)) return MICO_ERROR;
+    }
+    return MICO_SUCCESS;
+}
+
+LLAMA_MICO_API int32_t llama_mico_embed(void* handle, const char* text, const llama_mico_modal_buffer* image,
+                                        float* embd, int32_t n_embd_max, int32_t* n_embd) {
+    if (!handle || !text == !image || !embd || !n_embd) {
+        LOG_ERR("ERR: handle or output is null, or not exactly one of text and image\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = least_loaded(static_cast<LlamaMicoContext*>(handle));
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    int32_t n_model_embd = llama_model_n_embd(ctx->model);
+    if (n_embd_max < n_model_embd) {
+        LOG_ERR("ERR: embd holds %d of %d floats\n", n_embd_max, n_model_embd);
+        return MICO_ERROR;
+    }
+
+    std::vector<float> pooled;
+    if (text) {
+        llama_tokens tokens = common_tokenize(ctx->vocab, text, true, false);
+        if (tokens.empty() || !bs->embed(tokens, pooled)) {
+            LOG_ERR("ERR: failed to embed a text of %zu tokens\n", tokens.size());
+            return MICO_ERROR;
+        }
+    } else {
+        if (!ctx->shared_model->has_vision()) return MICO_ERROR;
+        bool cached = false;
+        auto images = frame_image_chunks(*image, nullptr, ctx, cached, true /* with_cached */);
+        std::vector<double> sum(n_model_embd, 0.0);
+        size_t n_encoded = 0;
+        for (auto& chunk : images) {
+            auto embeddings = bs->encode(chunk);  // NOTE: null if a cached entry was evicted after the tokenize
+            if (!embeddings) break;
+            for (size_t i = 0; i < embeddings->size(); i++) sum[i % n_model_embd] += (*embeddings)[i];
+            n_encoded++;
+        }
+        if (images.empty() || n_encoded < images.size()) {
+            LOG_ERR("ERR: failed to encode an image to embed\n");
+            return MICO_ERROR;
+        }
+        double norm = 0.0;
+        for (double v : sum) norm += v * v;
+        norm = norm > 0.0 ? std::sqrt(norm) : 1.0;
+        pooled.clear();
+        for (double v : sum) pooled.push_back((float)(v / norm));
+    }
+    std::copy(pooled.begin(), pooled.end(), embd);
+    *n_embd = (int32_t)pooled.size();
+    return MICO_SUCCESS;
+}
+
+LLAMA_MICO_API int32_t llama_mico_get_metrics(void* handle, const char** json_str) {
+    if (!handle || !json_str) {
+        LOG_ERR("ERR: handle or json is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    thread_local std::string metrics = "";  // NOTE: valid until the next call of the calling thread
+
+    json j = ctx->metrics.to_json();
+    auto hit_rate = [](size_t hits, size_t misses) { return hits + misses > 0 ? (double)hits / (hits + misses) : 0.0; };
+    CacheStats image = bs->modal_cache()->stats();
+    j["image_cache"] = {{"hits", image.hits},
+                        {"misses", image.misses},
+                        {"hit_rate", hit_rate(image.hits, image.misses)},
+                        {"entries", image.total_entries},
+                        {"evictions", image.evictions},
+                        {"bytes", image.total_memory_usage},
+                        {"disk_hits", image.disk_hits},
+                        {"disk_bytes", image.disk_bytes},
+                        {"shm_hits", image.shm_hits},
+                        {"shm_bytes", image.shm_bytes}};
+    if (const ChunkInferCache* kv_cache = bs->kv_cache()) {
+        KvCacheStats kv = kv_cache->stats();
+        j["kv_cache"] = {{"hits", kv.hits},
+                         {"host_hits", kv.host_hits},
+                         {"misses", kv.misses},
+                         {"hit_rate", hit_rate(kv.hits + kv.host_hits, kv.misses)},
+                         {"reused_ratio", kv.queried_pos > 0 ? (double)kv.reused_pos / kv.queried_pos : 0.0},
+                         {"cache_pos", kv.n_cache_pos},
+                         {"stores", kv.stores},
+                         {"evictions", kv.evictions},
+                         {"spills", kv.spills},
+                         {"host_bytes", kv.host_bytes}};
+    }
+    if (ResponseCache* response_cache = bs->response_cache()) {
+        ResponseCacheStats response = response_cache->stats();
+        j["response_cache"] = {{"hits", response.hits},
+                               {"misses", response.misses},
+                               {"hit_rate", hit_rate(response.hits, response.misses)},
+                               {"entries", response.entries},
+                               {"bytes", response.bytes}};
+    }
+    if (AdmissionQueue* admission = bs->admission()) {
+        AdmissionStats queue = admission->stats();
+        j["admission"] = {{"waiting", queue.waiting},
+                          {"max_waiting", queue.max_waiting},
+                          {"admitted", queue.admitted},
+                          {"rejected", queue.rejected},
+                          {"timed_out", queue.timed_out}};
+    }
+    if (!ctx->replicas.empty()) {  // NOTE: the top level counts the first replica, the image cache is shared
+        json replicas = json::array();
+        for (LlamaMicoContext* replica : ctx->replicas) {
+            json r = replica->metrics.to_json();
+            r["load"] = replica_load(replica);
+            replicas.push_back(r);
+        }
+        j["replicas"] = replicas;
+    }
+    if (ctx->op_profiler) j["ops"] = ctx->op_profiler->to_json();
+    metrics = j.dump();
+    *json_str = metrics.c_str();
+    return MICO_SUCCESS;
+}
+
+// Adds the buffers of a context or an encoder to the device of their buffer type, or to the host for host memory.
+// The llm ones ("" prefix) are model, kv, output and compute, others the weights as prefix and prefix_kv and so on
+static void add_breakdown(json& report, const std::vector<llama_memory_breakdown_data>& entries,
+                          const std::string& prefix, bool with_model) {
+    auto add = [](json& to, const std::string& key, size_t bytes) {
+        if (bytes > 0) to[key] = to.value(key, (size_t)0) + bytes;
+    };
+    for (const auto& e : entries) {
+        // NOTE: pinned host buffers of a GPU name the GPU as their device, they count as host memory
+        ggml_backend_dev_t dev = e.device ? ggml_backend_dev_by_name(e.device) : nullptr;
+        ggml_backend_buffer_type_t host_buft = dev ? ggml_backend_dev_host_buffer_type(dev) : nullptr;
+        bool host = !dev || ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU ||
+                    (host_buft && strcmp(ggml_backend_buft_name(host_buft), e.buft) == 0);
+        json& to = host ? report["host"] : report["devices"][e.device];
+        std::string p = prefix.empty() ? "" : prefix + "_";
+        if (with_model) add(to, prefix.empty() ? "model" : prefix, e.model);
+        add(to, prefix.empty() ? "kv" : p + "kv", e.memory);
+        add(to, p + "output", e.output);
+        add(to, p + "compute", e.compute);
+    }
+}
+
+// KV cells of a replica: request sequences hold the used ones, cache sequences (prompt cache, image kv) the cached
+// ones. Read on the memory scheduler thread between its commands, false if it did not get to it in time
+static bool replica_kv_cells(LlamaMicoContext* ctx, uint32_t& n_total, uint32_t& n_used, uint32_t& n_cached) {
+    auto* memory_scheduler = static_cast<LlamaMemoryScheduler*>(ctx->memory_scheduler);
+    if (!memory_scheduler) return false;
+    auto cells = std::make_shared<std::promise<std::array<uint32_t, 3>>>();
+    std::future<std::array<uint32_t, 3>> done = cells->get_future();
+    std::vector<llama_seq_id> seq_ids(std::max(ctx->n_seq_max, 0));
+    for (int32_t i = 0; i < (int32_t)seq_ids.size(); i++) seq_ids[i] = i;
+    memory_scheduler->submit_function_use_mem([lctx = ctx->lctx, cells, seq_ids]() {
+        std::array<uint32_t, 3> n = {0, 0, 0};  // total, used, used by seq_ids
+        if (!llama_memory_cells(llama_get_memory(lctx), seq_ids.data(), (int32_t)seq_ids.size(), &n[0], &n[1], &n[2]))
+            n = {0, 0, 0};
+        cells->set_value(n);
+    });
+    if (done.wait_for(std::chrono::milliseconds(MEMORY_CELLS_WAIT_MS)) != std::future_status::ready) return false;
+    std::array<uint32_t, 3> n = done.get();
+    n_total = n[0];
+    n_used = n[2];
+    n_cached = n[1] - n[2];
+    return n_total > 0;
+}
+
+LLAMA_MICO_API int32_t llama_mico_get_memory(void* handle, const char** json_str) {
+    if (!handle || !json_str) {
+        LOG_ERR("ERR: handle or json is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    thread_local std::string memory = "";  // NOTE: valid until the next call of the calling thread
+
+    json j;
+    j["devices"] = json::object();
+    for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU) continue;
+        size_t free = 0, total = 0;
+        ggml_backend_dev_memory(dev, &free, &total);
+        j["devices"][ggml_backend_dev_name(dev)] = {{"free", free}, {"total", total}};
+    }
+    j["host"] = json::object();
+
+    auto breakdown = [](const llama_context* lctx) {
+        std::vector<llama_memory_breakdown_data> entries(llama_memory_breakdown(lctx, nullptr, 0));
+        llama_memory_breakdown(lctx, entries.data(), (int32_t)entries.size());
+        return entries;
+    };
+    std::set<const llama_model*> models;  // NOTE: weights shared by contexts count once
+    std::set<const mtmd_context*> encoders;
+    std::set<const void*> caches;
+    uint32_t n_total = 0, n_used = 0, n_cached = 0;
+    size_t kv_bytes = 0, host_tier = 0, swapped = 0;
+    bool cells_known = true;
+    for (LlamaMicoContext* replica : replicas_of(ctx)) {
+        auto contexts = {std::make_pair(replica->lctx, ""), std::make_pair(replica->draft_ctx, "draft"),
+                         std::make_pair(replica->prefill_ctx, "prefill")};
+        for (const auto& [lctx, prefix] : contexts) {
+            if (!lctx) continue;
+            std::vector<llama_memory_breakdown_data> entries = breakdown(lctx);
+            if (lctx == replica->lctx)
+                for (const auto& e : entries) kv_bytes += e.memory;
+            add_breakdown(j, entries, prefix, models.insert(llama_get_model(lctx)).second);
+        }
+        if (replica->shared_model) {
+            std::vector<std::shared_ptr<mtmd_context>> vision;
+            {
+                std::lock_guard<std::mutex> lock(replica->shared_model->vision_mutex);
+                vision = replica->shared_model->vision_contexts;  // NOTE: never loads an unloaded projector
+            }
+            for (const auto& mctx : vision) {
+                if (!mctx || !encoders.insert(mctx.get()).second) continue;
+                std::vector<llama_memory_breakdown_data> entries(mtmd_memory_breakdown(mctx.get(), nullptr, 0));
+                mtmd_memory_breakdown(mctx.get(), entries.data(), (int32_t)entries.size());
+                add_breakdown(j, entries, "mmproj", true);
+            }
+        }
+
+        uint32_t total = 0, used = 0, cached = 0;
+        cells_known = replica_kv_cells(replica, total, used, cached) && cells_known;
+        n_total += total;
+        n_used += used;
+        n_cached += cached;
+
+        BatchScheduler* bs = static_cast<BatchScheduler*>(replica->batch_scheduler);
+        if (const ChunkInferCache* kv_cache = bs->kv_cache()) host_tier += kv_cache->stats().host_bytes;
+        swapped += bs->swapped_bytes();
+        std::shared_ptr<ModalEmbeddingCache> modal_cache = bs->modal_cache();
+        if (modal_cache && caches.insert(modal_cache.get()).second) {
+            CacheStats image = modal_cache->stats();
+            json& host = j["host"];
+            host["embedding_cache"] = host.value("embedding_cache", (size_t)0) + image.total_memory_usage;
+            host["embedding_cache_capacity"] =
+                host.value("embedding_cache_capacity", (size_t)0) + modal_cache->capacity();
+            if (image.shm_bytes > 0) host["embedding_cache_shm"] = image.shm_bytes;
+            if (image.disk_bytes > 0) j["disk"]["embedding_cache"] = image.disk_bytes;
+        }
+    }
+    if (host_tier > 0) j["host"]["kv_host_tier"] = host_tier;
+    if (swapped > 0) j["host"]["preempt_swap"] = swapped;
+    if (ctx->modal_buffers) {
+        j["host"]["modal_buffers"] = ctx->modal_buffers->bytes();
+        j["host"]["modal_buffers_free"] = ctx->modal_buffers->free_bytes();
+    }
+
+    if (n_total > 0) {
+        j["kv_cells"] = {{"total", n_total},
+                         {"used", n_used},
+                         {"cached", n_cached},
+                         {"free", n_total - n_used - n_cached},
+                         {"bytes_per_cell", kv_bytes / n_total}};
+        if (!cells_known) j["kv_cells"]["partial"] = true;  // NOTE: a replica did not answer in time
+    }
+    memory = j.dump();
+    *json_str = memory.c_str();
+    return MICO_SUCCESS;
+}
+
+static std::string bytes_to_hex(const uint8_t* data, size_t n_bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(2 * n_bytes, '0');
+    for (size_t i = 0; i < n_bytes; i++) {
+        hex[2 * i] = digits[data[i] >> 4];
+        hex[2 * i + 1] = digits[data[i] & 15];
+    }
+    return hex;
+}
+
+LLAMA_MICO_API int32_t llama_mico_get_timings(void* handle, int32_t request_id, const char** json_str) {
+    if (!handle || !json_str) {
+        LOG_ERR("ERR: handle or json is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    thread_local std::string timings = "";  // NOTE: valid until the next call of the calling thread
+    bool found = ctx->take_timings(request_id, timings);
+    for (LlamaMicoContext* replica : ctx->replicas) found = found || replica->take_timings(request_id, timings);
+    if (!found) return MICO_ERROR;
+    *json_str = timings.c_str();
+    return MICO_SUCCESS;
+}
+
+static json digest_hashes(const std::vector<uint64_t>& hashes) {
+    json array = json::array();
+    for (uint64_t h : hashes) {
+        char buf[17];
+        snprintf(buf, sizeof(buf), "%016" PRIx64, h);
+        array.push_back(buf);
+    }
+    return array;
+}
+
+LLAMA_MICO_API int32_t llama_mico_get_cache_digest(void* handle, const char** json_str) {
+    if (!handle || !json_str) {
+        LOG_ERR("ERR: handle or json is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    BatchScheduler* bs = static_cast<BatchScheduler*>(ctx->batch_scheduler);
+    thread_local std::string digest = "";  // NOTE: valid until the next call of the calling thread
+
+    // NOTE: the replicas sum up to one instance, a router sends the request here and the handle routes it on
+    size_t n_waiting = 0, n_free_seqs = 0;
+    int32_t n_seq = 0, n_kv = 0, n_free_kv = 0;
+    std::vector<uint64_t> hashes;
+    for (LlamaMicoContext* replica : replicas_of(ctx)) {
+        BatchScheduler* replica_bs = static_cast<BatchScheduler*>(replica->batch_scheduler);
+        {
+            std::lock_guard<std::mutex> lock(replica->cmpl_to_seq_mutex);
+            n_free_seqs += replica->free_seqs.size();
+        }
+        int32_t n_replica_kv = (int32_t)llama_n_ctx(replica->lctx);
+        AdmissionQueue* admission = replica_bs->admission();
+        n_waiting += admission ? admission->stats().waiting : 0;
+        n_seq += replica->n_seq_max;
+        n_kv += n_replica_kv;
+        n_free_kv += std::max(0, n_replica_kv - replica->kv_claimed(-1));
+
+        // NOTE: a block hash covers the whole prefix before it, the blocks of all cached prompts go in one filter
+        if (const ChunkInferCache* kv_cache = replica_bs->kv_cache()) {
+            for (const auto& entry : kv_cache->entries()) {
+                std::vector<uint64_t> blocks = prefix_digest(entry.items);
+                hashes.insert(hashes.end(), blocks.begin(), blocks.end());
+            }
+        }
+    }
+    json j;
+    j["load"] = {{"waiting", n_waiting},
+                 {"free_seqs", n_free_seqs},
+                 {"n_seq", n_seq},
+                 {"free_kv", n_free_kv},
+                 {"n_kv", n_kv}};
+    std::sort(hashes.begin(), hashes.end());
+    hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+    size_t n_bits = 0;
+    std::vector<uint8_t> bloom = digest_bloom(hashes, n_bits);
+    j["prefix"] = {{"block", PREFIX_DIGEST_BLOCK},
+                   {"n_blocks", hashes.size()},
+                   {"n_bits", n_bits},
+                   {"n_hashes", PREFIX_BLOOM_HASHES},
+                   {"bloom", bytes_to_hex(bloom.data(), bloom.size())}};
+
+    json images = json::array();
+    for (const HashKey& key : bs->modal_cache()->top_keys(CACHE_DIGEST_MAX_IMAGES)) images.push_back(hash_to_hex(key));
+    j["images"] = images;
+    digest = j.dump();
+    *json_str = digest.c_str();
+    return MICO_SUCCESS;
+}
+
+LLAMA_MICO_API int32_t llama_mico_get_request_digest(void* handle, const char* request_json_str,
+                                                     const char** json_str) {
+    if (!handle || !request_json_str || !json_str) {
+        LOG_ERR("ERR: handle, request or json is null\n");
+        return MICO_ERROR;
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+    thread_local std::string digest = "";  // NOTE: valid until the next call of the calling thread
+    MicoRequest request;
+    if (!parse_request_json(request_json_str, request, ctx)) {
+        LOG_ERR("ERR: failed to parse digest request\n");
+        return MICO_ERROR;
+    }
+    common_chat_templates_inputs tmpl_inputs;
+    common_chat_params formatted_chat;
+    try {
+        apply_chat_templates(formatted_chat, tmpl_inputs, ctx, request);
+    } catch (const std::exception& e) {
+        LOG_ERR("ERR: failed to render digest request: %s\n", e.what());
+        return MICO_ERROR;
+    }
+
+    // Only the text before the first image is keyed, as prefix_digest stops there
+    const std::string& prompt = formatted_chat.prompt;
+    size_t n_text = std::min(prompt.find(MICO_DEFAULT_IMAGE_MARKER), prompt.find(mtmd_default_marker()));
+    std::vector<llama_token> tokens = common_tokenize(ctx->vocab, prompt.substr(0, n_text), true, true);
+    json images = json::array();
+    for (size_t i = 0; i < request.modal_prts.size(); i++) {
+        HashKey key = modal_cache_key(request, i, ctx);
+        if (!key.empty()) images.push_back(hash_to_hex(key));
+    }
+    json j = {{"block", PREFIX_DIGEST_BLOCK}, {"blocks", digest_hashes(prefix_digest(tokens))}, {"images", images}};
+    digest = j.dump();
+    *json_str = digest.c_str();
+    return MICO_SUCCESS;
+}
+
+LLAMA_MICO_API int32_t llama_mico_trace_start(void* handle, int32_t n_events) {
+    if (!handle) {
+        LOG_ERR("ERR: handle is null\n");
+        return MICO_ERROR;
+    }
+    mico_trace::start(n_events > 0 ? (size_t)n_events : TRACE_DEFAULT_EVENTS);
+    return MICO_SUCCESS;
+}
+
+LLAMA_MICO_API int32_t llama_mico_trace_dump(void* handle, const char* path) {
+    if (!handle || !path) {
+        LOG_ERR("ERR: handle or path is null\n");
+        return MICO_ERROR;
+    }
+    return mico_trace::dump(path) ? MICO_SUCCESS : MICO_ERROR;
+}
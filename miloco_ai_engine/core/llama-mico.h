@@ -14,6 +14,80 @@
 extern "C" {
 #endif
 
+/**
+ * @brief Pre-rendered chat message, content is plain text with one image marker per modal buffer
+ */
+typedef struct llama_mico_message {
+    const char *role;
+    const char *content;
+} llama_mico_message;
+
+#define LLAMA_MICO_MODAL_ENCODED 0  // encoded image (jpeg/png...) or audio file
+#define LLAMA_MICO_MODAL_RGB 1      // packed RGB24 frame, nx * ny * 3 bytes
+#define LLAMA_MICO_MODAL_NV12 2     // NV12 frame (Y plane then interleaved UV), nx * ny * 3 / 2 bytes
+
+/**
+ * @brief Image buffer, must stay valid until llama_mico_request_prompt_struct returns. Raw frames are wrapped in a
+ * bitmap without any codec, a zero-initialised format means encoded. With a NULL data the registered buffer buffer_id
+ * is used instead, see llama_mico_register_buffer
+ */
+typedef struct llama_mico_modal_buffer {
+    const uint8_t *data;
+    size_t size;
+    int32_t format;     // LLAMA_MICO_MODAL_*
+    uint32_t nx;        // raw frame width in pixels, unused for encoded buffers
+    uint32_t ny;        // raw frame height in pixels, unused for encoded buffers
+    int32_t buffer_id;  // registered buffer of a NULL data, its size, format and frame size are used
+    int32_t pool;       // vision token pooling of this image, 0 for the vision_pool of the request
+    // Region of interest in source pixels, only it is encoded (clipped to the image), roi_w 0 for the whole image.
+    // Regions and a thumbnail of one image are grouped behind its marker by modal_frames, in a JSON modal
+    // {"roi": [[x, y, w, h], ...], "thumbnail": side} expands into them
+    int32_t roi_x;
+    int32_t roi_y;
+    int32_t roi_w;
+    int32_t roi_h;
+    int32_t max_side;  // longest side of this image, e.g. a global thumbnail, 0 for the image sides of the request
+    // Stable id of the content (e.g. camera id and frame sequence number), the cache key comes from it and the
+    // content is never hashed. NULL or empty hashes the content, "content_id" of a JSON modal
+    const char* content_id;
+} llama_mico_modal_buffer;
+
+/**
+ * @brief Binary request, same fields as the OpenAI format JSON request without serialising
+ */
+typedef struct llama_mico_request {
+    int32_t id;        // request id, "local-chatcmpl-<id>" in the JSON request
+    int32_t priority;  // larger is scheduled first
+    const llama_mico_message *messages;
+    int32_t n_messages;
+    const char *tools_json;  // OpenAI tools array in JSON, NULL for no tools
+    const llama_mico_modal_buffer *modal_buffers;
+    int32_t n_modal_buffers;
+    int32_t stop;          // 1 to stop the request (generate only)
+    int32_t cache_prefix;  // leading messages (and tools) kept as a shared kv prefix, 0 caches the whole prompt
+    const char *session;   // multi-turn session id, NULL for none, see llama_mico_release_session
+    // Modal buffers behind each image marker in order, a marker with several is a video clip whose unchanged frames
+    // are dropped, NULL for one buffer per marker
+    const int32_t *modal_frames;
+    int32_t n_modal_frames;
+    const uint8_t *keyframes;  // n_modal_buffers flags, clip keyframes are never dropped, NULL keeps first and last
+    int32_t cache_pin;         // 1 pins the cached prefix in the kv cache (up to cache_pin_max prompts)
+    int32_t max_tokens;        // generated tokens before the decode loop retires the request, 0 for no limit, with
+                               // kv_admission the kv it may need is claimed up front (kv_output_reserve if 0)
+    int32_t deadline_ms;       // ms from the call, a prompt not inferred by then fails with -3, 0 for none
+    // Vision tokens of each image averaged over vision_pool x vision_pool cells after the projector (2 takes a quarter
+    // of the prefill and kv of full resolution), M-RoPE models only, 0 or 1 keeps every token
+    int32_t vision_pool;
+    // Longest image side in pixels, 0 for the input size, lowered down to image_min_side as the encoder load grows
+    // (see adaptive_resolution_step), 0 keeps image_max_side
+    int32_t image_max_side;
+    int32_t image_min_side;
+    const char *lora;  // name of a configured LoRA adapter, NULL or empty for the base model
+    // live video stream id, NULL for none: the frames of its requests stay in kv as a window, see
+    // llama_mico_video_append
+    const char *video_session;
+} llama_mico_request;
+
 /**
  * @brief Initialize Llama Mico context
  * @param config_json JSON configuration string containing model path, multimodal projection path, etc. (currently not
@@ -21,6 +95,9 @@ extern "C" {
  * @param handle Output parameter, returns the initialized context handle
  * @return 0 on success, -1 on failure
  *
+ * Handles of the same model, mmproj and placement share the loaded weights and vision contexts, each with its own
+ * llama_context, kv and schedulers. The weights are released with the last of them.
+ *
  * Configuration JSON format example:
  * {
  *   "model_path": "/path/to/model.gguf",
@@ -29,8 +106,138 @@ extern "C" {
  *   "n_gpu_layers": 50,
  *   "total_context_num": 32768,
  *   "chunk_size": 1024,
+ *   "prefill_ubatch": 512,  // optional, tokens per prompt graph run (physical batch), default chunk_size
+ *   "decode_ubatch": 64,  // optional, tokens per step while sequences decode, its graph reserved at init, 0 for
+ *                         // chunk_size
+ *   "weight_stream_tokens": 256,  // optional, with n_gpu_layers below the layer count prompt graphs of at least this
+ *                                 // many tokens stream the weights of the CPU layers to the GPU and run there, decode
+ *                                 // steps stay on the CPU layers. The CPU weights move to pinned memory, 0 off
  *   "n_seq_max": 35,
  *   "cache_seq_num": 8,
+ *   "autotune": true,  // optional, chunk_size, total_context_num (only lowered), n_seq_max and cache_seq_num from a
+ *                      // calibration on the devices at init, kept in <model>.autotune per devices and options
+ *   "autotune_latency_ms": 100,  // optional, longest prefill chunk and decode step the calibration picks
+ *   "cache_path": "/path/to/kv-cache.bin",  // optional, cache sequences are saved at free and restored at init
+ *   "kv_defrag_thold": 0.3,  // optional, kv cells compacted in idle gaps above this fragmentation, 0 disables
+ *   "kv_defrag_idle_ms": 200,  // optional, memory scheduler quiet time before compacting
+ *   "kv_swa_full": false,  // optional, sliding window layers keep every position, a cached prefix is always
+ *                          // reusable at the kv size of a model without window. Else one is reused only if the
+ *                          // window before its end was kept, see ChunkInferCache::swa_holds
+ *   "cache_type_k": "q8_0",  // optional, KV cache K type, "f16" (default), "q8_0", "q4_0", ...
+ *   "cache_type_v": "q8_0",  // optional, KV cache V type, quantized types turn on flash_attn
+ *   "flash_attn": false,  // optional, flash attention in the LLM
+ *   "cache_host_mb": 4096,  // optional, host memory keeping evicted cache sequences
+ *   "cache_pin_max": 2,  // optional, cache sequences pinned prompts ("cache_pin") may hold, -1 for half of them
+ *   "cache_class_seqs": [8, 4, 1],  // optional, cache sequences interactive, rule and background prompts may hold
+ *   "park_context_num": 4096,  // optional, kv tokens finished sequences keep for a request with the same prefix
+ *   "video_sessions": 2,  // optional, sequences keeping the frame window of a live video ("video_session"), 0 disables
+ *   "preempt_host_mb": 1024,  // optional, host memory of kv swapped out to admit higher class requests, 0 rejects
+ *   "coalesce_requests": false,  // optional, a greedy request identical to one in prefill reads its tokens instead
+ *                                // of taking a sequence, it ends when that request is stopped
+ *   "response_cache_mb": 8,  // optional, completions of greedy requests replayed for identical requests with no
+ *                            // inference, 0 disables (default)
+ *   "response_cache_ttl_s": 60,  // optional, age of a replayed completion, 0 keeps it until evicted
+ *   "admission_queue_max": 64,  // optional, requests with no free sequence wait for one (earliest deadline, then
+ *                               // priority first) instead of failing, 0 rejects them at once (default)
+ *   "admission_wait_ms": 30000,  // optional, longest wait of a queued request, 0 until its deadline_ms
+ *   "kv_admission": false,  // optional, a tokenized request runs once its prompt plus max_tokens fit the kv cells no
+ *                           // other request holds or claimed, else it waits like a queued one or fails with kv cache
+ *                           // full, instead of failing to decode mid-response
+ *   "kv_output_reserve": 512,  // optional, output tokens projected for a request without max_tokens
+ *   "encoder_workers": 2,  // optional, vision encoder workers sharing the image queue
+ *   "prepare_workers": 2,  // optional, threads templating and tokenizing batch and async prompts ahead of inference
+ *   "request_log_path": "/path/to/requests.bin",  // optional, records requests (hashes, sizes) for llama-mico-replay
+ *   "op_profile": false,  // optional, times every ggml op of the llm and vision graphs for llama_mico_get_metrics,
+ *                         // each op is waited for so inference slows down, default false
+ *   "encoder_devices": ["CUDA0", "CUDA1"],  // optional, backend device of each encoder worker, "CPU" for a CPU one
+ *                                           // next to GPUs, each job goes to the worker finishing it first
+ *   "mmproj_flash_attn": "auto",  // optional, fused attention in the vision encoder, "auto", "on" or "off"
+ *   "mmproj_weight_type": "q8_0",  // optional, vision encoder linear weights converted on load, "f16", "q8_0", "q4_k"
+ *                                  // or "q4_0", on a CPU encoder q8_0 runs the AMX and q4_0 the KleidiAI / repacked
+ *                                  // kernels where the CPU backend has them
+ *   "mmproj_f16_activations": false,  // optional, F16 K/V in the vision encoder attention
+ *   "load_threads": 8,  // optional, threads reading the weights of the model and the mmproj in parallel into
+ *                       // pinned staging buffers while their device copies run, 0 loads them in order (default)
+ *   "mmap_prefetch_async": true,  // optional, the CPU weights of the mapped GGUF are read in and faulted into the
+ *                                // page tables by a background thread after the load instead of during it
+ *   "mmap_hugepages": true,  // optional, transparent hugepages on the mapped GGUF, fewer TLB misses in the CPU
+ *                           // layers; a GGUF on a hugetlbfs mount maps with explicit hugepages anyway
+ *   "repack_cache": true,  // optional, CPU weights repacked for the SIMD kernels are kept in <model>.repack and
+ *                          // <mmproj>.repack and copied from there on the next load instead of repacked again
+ *   "mmproj_lazy": true,  // optional, the vision encoder loads on the first image or audio request
+ *   "mmproj_idle_unload_s": 600,  // optional, the vision encoder unloads after this long without modal requests
+ *   "decode_graphs": 32,  // optional, CUDA graphs captured per decode shape and replayed, process wide
+ *   "pipeline_cache_dir": "/data/vk",  // optional, compiled Vulkan pipelines kept across restarts, per device and
+ *                                      // driver, process wide
+ *   "kv_pad": 1024,  // optional, attended kv cells padded to this multiple, fewer decode shapes
+ *   "encoder_rpc_servers": ["10.0.0.2:50052"],  // optional, ggml rpc-servers the encoders run on, one per handle
+ *   "model_devices": ["CUDA0"],  // optional, GPUs of the LLM, default all, with encoder_devices apart from them
+ *   "main_gpu": 0,  // optional, index in model_devices of the GPU holding the whole model (split_mode none)
+ *   "split_mode": "none",  // optional, "none", "layer" or "row" split of the LLM over model_devices
+ *   "tensor_split": [3, 1],  // optional, share of the LLM on each of model_devices
+ *   "pipeline_microbatches": 4,  // optional, with split_mode layer and every layer offloaded a prompt batch runs as
+ *                                // this many prefill_ubatch graphs overlapped across the GPUs, 0 for one. Keep
+ *                                // chunk_size / it at least the tokens of an image for non-causal vision models
+ *   "prefill_devices": ["CUDA1"],  // optional, GPUs of a second copy of the LLM (own kv and memory thread) that
+ *                                  // prefills long prompts, the kv moves to the model_devices as llama_state_seq data
+ *   "prefill_offload_tokens": 1024,  // optional, uncached prompt positions from which a prompt goes to prefill_devices
+ *   "replica_devices": ["CUDA0", "CUDA1"],  // optional, one whole copy of the LLM per GPU with its own context,
+ *                                          // schedulers and kv cache, behind the one handle. A request goes to the
+ *                                          // replica keeping its session, else by load and prompt affinity; the
+ *                                          // image embedding cache and registered buffers are shared
+ *   "threads": 16,  // optional, ggml compute threads of CPU layers, default physical cores
+ *   "threads_batch": 16,  // optional, ggml compute threads of prompt batches, default threads
+ *   "encoder_threads": 4,  // optional, ggml compute threads of the vision encoder CPU graphs, split between the
+ *                          // encoder workers, default threads. All compute threads start once at init; give the
+ *                          // encoder cores apart from threads (encoder_cpu_mask) so the two do not oversubscribe
+ *   "sample_threads": 4,  // optional, threads selecting the top_k candidates of decode rows sampled by top_k, top_p,
+ *                         // min_p and temperature only (top_k <= 1024), 0 samples every row by its chain, default 4
+ *   "repeat_penalty": 1.1,  // optional, logits of the last penalty_last_n sampled tokens scaled down, default 1 (off)
+ *   "presence_penalty": 0.5,  // optional, subtracted once from the logits of those tokens, default 0; a request sets
+ *                             // its own by "repeat_penalty", "presence_penalty" and "frequency_penalty"
+ *   "frequency_penalty": 0.5,  // optional, subtracted per occurrence, default 0
+ *   "penalty_last_n": 64,  // optional, sampled tokens of a request the penalties count, default 64
+ *   "cpu_mask": "0-27,56-83",  // optional, CPUs of the compute threads, comma separated ranges or 0x hex masks
+ *   "cpu_mask_batch": "0-27",  // optional, CPUs of the prompt batch compute threads, default cpu_mask
+ *   "cpu_strict": false,  // optional, one CPU of the mask per compute thread
+ *   "encoder_cpu_mask": "28-31",  // optional, CPUs of the vision encoder workers and their compute threads
+ *   "scheduler_cpu_mask": "32-32",  // optional, CPUs of the batch scheduler thread
+ *   "prepare_cpu_mask": "33-35",  // optional, CPUs of the prompt templating, tokenizing and image decoding workers
+ *   "numa": "distribute",  // optional, distribute, isolate or numactl placement of compute threads and weights,
+ *                          // process wide, the first handle decides
+ *   "image_cache_precision": "f16",  // optional, f32 (default), f16 or q8 storage of cached image embeddings
+ *   "frame_dedup_threshold": 4,  // optional, frames within this perceptual hash distance (of 64 bits) reuse embeddings
+ *                                // of a recent frame of the same camera, video session or session, others never match
+ *   "warmup_image_sizes": [448, 224],  // optional, image sizes encoded and decoded once at init
+ *   "warmup_ubatch": true,  // optional, a full n_ubatch and a single-token step decoded once at init
+ *   "image_cache_entries": 100,  // optional, cached image embeddings, -1 sizes from free host memory
+ *   "image_cache_mb": 1024,  // optional, host memory of cached image embeddings, -1 sizes from free host memory
+ *   "image_cache_disk_path": "/data/embd",  // optional, directory (NVMe) evicted image embeddings spill to, read
+ *                                           // back on a miss and kept across restarts, empty disables. One
+ *                                           // process uses a directory, another one runs without the tier
+ *   "image_cache_disk_mb": 4096,  // optional, size of the disk tier, the oldest segment file is dropped past it
+ *   "image_cache_shm_mb": 0,  // optional, shared memory (/dev/shm) of image embeddings, every process of the host
+ *                             // with the same mmproj reads and adds to it, so a frame is encoded once, 0 disables
+ *   "image_kv_entries": 0,  // optional, image kv reused after any prefix by a rope shift (approximate), reserves a
+ *                           // sequence of seq_max, 0 disables
+ *   "adaptive_resolution_step": 1.0,  // optional, queued encodes per encoder lowering the image side of requests with
+ *                                     // image_min_side one of 4 levels towards it, 0 keeps image_max_side
+ *   "image_kv_keep": 0,  // optional, fraction of the kv cells of each prompt image kept after prefill, the ones the
+ *                        // last prompt token attends most (SnapKV), smaller kv and faster decode of multi-frame
+ *                        // prompts, approximate; unified kv cache only, 0 keeps all
+ *   "batch_wait_ms": 3,  // optional, longest wait of a partial batch, adapted to arrival rate and decode time
+ *   "text_batch_size": 512,  // optional, prefill tokens submitted together, 0 for chunk_size
+ *   "image_batch_size": 0,  // optional, image tokens decoded together, 0 for chunk_size
+ *   "slo_class_priorities": [10, 5],  // optional, lowest request priority of the interactive and rule classes
+ *   "slo_target_ms": [300, 2000, 10000],  // optional, latency target of interactive, rule and background requests
+ *   "context_shift": false,  // optional, full sequences evict their oldest items in kv instead of stopping
+ *   "context_sink_tokens": 4,  // optional, first tokens a context shift always keeps (attention sinks)
+ *   "draft_model_path": "/path/to/draft.gguf",  // optional, small model of the same vocab drafting tokens to verify
+ *   "draft_max_tokens": 4,  // optional, draft tokens per sequence and decode step
+ *   "draft_gpu_layers": 99,  // optional, draft model layers on GPU
+ *   "lookup_ngram_size": 3,  // optional, without a draft model drafts continue n-grams found in the sequence
+ *   "lora_adapters": [{"name": "doorbell", "path": "/path/to/lora.gguf", "scale": 1.0}],  // optional, LoRA adapters
+ *                    // of the model, a request selects one by "lora" and is batched with requests of other adapters
  * }
  */
 int32_t llama_mico_init(const char *config_json, void **handle);
@@ -42,13 +249,27 @@ int32_t llama_mico_init(const char *config_json, void **handle);
  */
 int32_t llama_mico_free(void *handle);
 
+/**
+ * @brief Loads a new model into a new handle while handle keeps serving, for a model upgrade without downtime
+ * The new handle starts with the prompts and sessions cached in handle prefilled into its kv cache (same vocab only,
+ * prompts with images keep their text head), registered buffers and frame rings stay valid on it. Route new requests
+ * to new_handle, then free handle with llama_mico_free once its requests are done
+ * NOTE: both models are in memory until handle is freed, the new weights are mmapped while handle infers
+ * @param handle Context handle serving now
+ * @param config_json Configuration of the new handle, as llama_mico_init, plus
+ *   "reuse_vision": true,  // optional, keep the image embeddings cached by handle if both use the same mmproj
+ * @param new_handle Output parameter, returns the new context handle
+ * @return 0 on success, -1 on failure, handle is untouched either way
+ */
+int32_t llama_mico_swap_model(void *handle, const char *config_json, void **new_handle);
+
 /**
  * @brief Process initial prompt request (OpenAI compatible format)
  * @param handle Context handle
  * @param request_json_str Request JSON string in OpenAI format
  * @param is_finished Output parameter, returns whether generation is finished (1 for finished, 0 to continue)
  * @param content Output parameter, returns generated content (error message if return is -1, otherwise normal text)
- * @return 0 on success, -1 on failure
+ * @return 0 on success, -1 on failure, -3 if its deadline_ms passed before the prompt was inferred
  */
 int32_t llama_mico_request_prompt(void *handle, const char *request_json_str, int32_t *is_finished,
                                   const char **content);
@@ -59,11 +280,380 @@ int32_t llama_mico_request_prompt(void *handle, const char *request_json_str, in
  * @param request_json_str Request JSON string in OpenAI format
  * @param is_finished Output parameter, returns whether generation is finished (1 for finished, 0 to continue)
  * @param content Output parameter, returns generated content (error message if return is -1, otherwise normal text)
+ *                complete utf8 (may be empty), a partial utf8 sequence or stop string is returned by a later call
  * @return 0 on success, -1 on failure
  */
 int32_t llama_mico_request_generate(void *handle, const char *request_json_str, int32_t *is_finished,
                                     const char **content);
 
+/**
+ * @brief Process several prompt requests together, their chunks are scheduled at once to share prefill and encoder work
+ * A long prefix several requests share (e.g. system prompt and question, one frame per camera) is forked: prefilled
+ * once and copied into each of them while their images are encoded, then their tails are prefilled together
+ * @param handle Context handle
+ * @param request_json_strs Request JSON strings in OpenAI format
+ * @param n_requests Number of requests
+ * @param is_finished Output array of n_requests, whether each generation is finished (1 for finished, 0 to continue)
+ * @param contents Output array of n_requests, generated content of each request (error message if it failed, kept until
+ *        the next call on the thread)
+ * @return 0 if every request succeeded, -1 if any failed
+ */
+int32_t llama_mico_request_prompt_batch(void *handle, const char **request_json_strs, int32_t n_requests,
+                                        int32_t *is_finished, const char **contents);
+
+/**
+ * @brief Process a prompt request for n completions (OpenAI n): the prompt is prefilled once and its kv copied into n
+ * sequences that sample their own tokens and decode together. Completion i has the request id + i, continue each
+ * with llama_mico_request_generate of its id. A configured seed is offset by i so the completions differ
+ * @param handle Context handle
+ * @param request_json_str Request JSON string in OpenAI format, without session or video_session if n > 1
+ * @param n Number of completions
+ * @param is_finished Output array of n, whether each generation is finished (1 for finished, 0 to continue)
+ * @param contents Output array of n, generated content of each completion (error message if it failed, kept until the
+ *        next call on the thread)
+ * @return 0 if every completion succeeded, -1 if any failed
+ */
+int32_t llama_mico_request_prompt_n(void *handle, const char *request_json_str, int32_t n, int32_t *is_finished,
+                                    const char **contents);
+
+/**
+ * @brief Process initial prompt request from a binary request
+ * @param handle Context handle
+ * @param request Request, messages and modal buffers are only read during the call
+ * @param is_finished Output parameter, returns whether generation is finished (1 for finished, 0 to continue)
+ * @param content Output parameter, returns generated content (error message if return is -1, otherwise normal text)
+ * @return 0 on success, -1 on failure, -3 if its deadline_ms passed before the prompt was inferred
+ */
+int32_t llama_mico_request_prompt_struct(void *handle, const llama_mico_request *request, int32_t *is_finished,
+                                         const char **content);
+
+/**
+ * @brief Generate next token from a binary request, only id and stop are used
+ * @param handle Context handle
+ * @param request Request
+ * @param is_finished Output parameter, returns whether generation is finished (1 for finished, 0 to continue)
+ * @param content Output parameter, returns generated content (error message if return is -1, otherwise normal text)
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_request_generate_struct(void *handle, const llama_mico_request *request, int32_t *is_finished,
+                                           const char **content);
+
+/**
+ * @brief llama_mico_request_prompt writing into a buffer of the caller instead of returning a string of the engine
+ * @param handle Context handle
+ * @param request_json_str Request JSON string in OpenAI format
+ * @param is_finished Output parameter, returns whether generation is finished (1 for finished, 0 to continue)
+ * @param buffer Receives the content null-terminated (an error message is cut to fit)
+ * @param size Buffer bytes
+ * @param n_written Output parameter, returns the bytes written without the terminator, or the bytes needed on -4
+ * @return as llama_mico_request_prompt, -4 if the content does not fit: it is kept, take it with
+ * llama_mico_request_generate_into of the request id and a buffer of n_written bytes
+ */
+int32_t llama_mico_request_prompt_into(void *handle, const char *request_json_str, int32_t *is_finished, char *buffer,
+                                       int32_t size, int32_t *n_written);
+
+/**
+ * @brief Generate next token into a buffer of the caller: no request to parse and no string handed over, a loop
+ * reusing one buffer allocates nothing per token and never reads a string another thread may write
+ * @param handle Context handle
+ * @param request_id Request id passed to llama_mico_request_prompt
+ * @param stop Non-zero to stop the request (content kept by an earlier -4 is dropped)
+ * @param is_finished Output parameter, returns whether generation is finished (1 for finished, 0 to continue)
+ * @param buffer Receives the content null-terminated (an error message is cut to fit)
+ * @param size Buffer bytes
+ * @param n_written Output parameter, returns the bytes written without the terminator, or the bytes needed on -4
+ * @return as llama_mico_request_generate, -4 if the content does not fit: it is kept and returned by the next call
+ * for the request
+ */
+int32_t llama_mico_request_generate_into(void *handle, int32_t request_id, int32_t stop, int32_t *is_finished,
+                                         char *buffer, int32_t size, int32_t *n_written);
+
+/**
+ * @brief Callback receiving generated text from llama_mico_request_generate_n
+ * @param piece Null-terminated utf8 text, never splits a utf8 sequence or a stop string
+ * @param user_data Pointer passed to llama_mico_request_generate_n
+ * @return 0 to continue, non-zero to stop the request
+ */
+typedef int32_t (*llama_mico_piece_callback)(const char *piece, void *user_data);
+
+/**
+ * @brief Generate up to max_tokens tokens in one call, streaming text through callback
+ * @param handle Context handle
+ * @param request_id Request id passed to llama_mico_request_prompt
+ * @param max_tokens Maximum tokens to generate in this call, <= 0 to run until the request stops
+ * @param stop_strings Stop strings, the matched stop string is not returned (may be NULL)
+ * @param n_stop_strings Number of stop strings
+ * @param callback Receives text as it is generated (may be NULL)
+ * @param user_data Passed to callback
+ * @param is_finished Output parameter, returns whether generation is finished (1 for finished, 0 to continue)
+ * @param content Output parameter, returns all text generated in this call (error message if return is -1)
+ * @return 0 on success, -1 on failure, -2 if the request exceeds the max context
+ */
+int32_t llama_mico_request_generate_n(void *handle, int32_t request_id, int32_t max_tokens, const char **stop_strings,
+                                      int32_t n_stop_strings, llama_mico_piece_callback callback, void *user_data,
+                                      int32_t *is_finished, const char **content);
+
+/**
+ * @brief Submit a prompt request (OpenAI compatible format) without blocking
+ * @param handle Context handle
+ * @param request_json_str Request JSON string in OpenAI format
+ * @param on_token Receives generated text from the engine thread (may be NULL, then use llama_mico_poll)
+ * @param user_data Passed to on_token
+ * @param ticket Output parameter, returns the ticket for llama_mico_poll (the request id)
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_submit(void *handle, const char *request_json_str, llama_mico_piece_callback on_token,
+                          void *user_data, int32_t *ticket);
+
+/**
+ * @brief Poll a submitted request without blocking, must be polled until finished to release the ticket
+ * @param handle Context handle
+ * @param ticket Ticket returned by llama_mico_submit
+ * @param is_finished Output parameter, returns whether generation is finished (1 for finished, 0 to continue)
+ * @param content Output parameter, returns text generated since the last poll (error message if return is -1),
+ * valid until the next poll of the calling thread
+ * @return 0 on success, -1 on failure, -2 if the request exceeds the max context, -3 past its deadline_ms
+ */
+int32_t llama_mico_poll(void *handle, int32_t ticket, int32_t *is_finished, const char **content);
+
+/**
+ * @brief Submit a prompt request (OpenAI compatible format) whose text streams into a lock-free ring, read in bulk by
+ * llama_mico_stream_read, so a reader makes one call per batch of tokens instead of one per token
+ * @param handle Context handle
+ * @param request_json_str Request JSON string in OpenAI format
+ * @param capacity Ring bytes (<= 0 for 64 KB), text past a full ring waits until read
+ * @param stream Output parameter, returns the stream, NOTE: must be closed with llama_mico_stream_close
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_stream_open(void *handle, const char *request_json_str, int32_t capacity, void **stream);
+
+/**
+ * @brief Read the text generated since the last read, waiting up to timeout_ms for it
+ * @param stream Stream returned by llama_mico_stream_open
+ * @param buffer Receives up to size bytes, not null-terminated, a full buffer may end inside a utf8 sequence (the
+ * error message if the result is -1)
+ * @param size Buffer bytes
+ * @param timeout_ms Longest wait if no text is ready, 0 returns at once
+ * @param n_read Output parameter, returns the bytes written to buffer
+ * @param is_finished Output parameter, returns 1 once the request finished and all of its text was read
+ * @return 0 on success, -1 on failure, -2 if the request exceeds the max context, -3 past its deadline_ms (with
+ * is_finished)
+ */
+int32_t llama_mico_stream_read(void *stream, char *buffer, int32_t size, int32_t timeout_ms, int32_t *n_read,
+                               int32_t *is_finished);
+
+/**
+ * @brief Release a stream, an unfinished request is stopped
+ * @param stream Stream returned by llama_mico_stream_open
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_stream_close(void *stream);
+
+/**
+ * @brief Prefill the cacheable prefix of a request into the kv cache ahead of traffic, nothing is generated. The
+ * prefix is request.cache_prefix messages (and tools) if set, else the whole prompt. Runs at background priority and
+ * blocks until the prefix is stored, a later request with the same prefix copies it instead of prefilling
+ * @param handle Context handle
+ * @param request_json_str Request JSON string in OpenAI format, "session" is ignored
+ * @return 0 on success, -1 on failure (also without cache sequences)
+ */
+int32_t llama_mico_prime(void *handle, const char *request_json_str);
+
+/**
+ * @brief Append new frames of a live video to the kv window of its "video_session", nothing is generated. The window
+ * is the frames of the request: kv of frames before them is removed and the window moved down to their positions,
+ * the new ones are prefilled. A question with the same frames and "video_session" then only prefills its text
+ * @param handle Context handle
+ * @param request_json_str Request JSON string in OpenAI format with "video_session", text after the last frame is
+ * ignored
+ * @return 0 on success, -1 on failure (also with video_sessions 0)
+ */
+int32_t llama_mico_video_append(void *handle, const char *request_json_str);
+
+/**
+ * @brief Score candidate answers of a request (yes/no, one of N) instead of generating them. The prompt is prefilled
+ * once, then every candidate is evaluated in a fork of the sequence sharing the prompt kv, all of them in one decode
+ * @param handle Context handle
+ * @param request_json_str Request JSON string in OpenAI format, "session" is ignored
+ * @param candidates Candidate continuations of the assistant turn, text tokenized as is
+ * @param n_candidates Number of candidates
+ * @param logprobs Output, n_candidates sums of the log probabilities of the candidate tokens (not length normalized)
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_score(void *handle, const char *request_json_str, const char **candidates, int32_t n_candidates,
+                         float *logprobs);
+
+/**
+ * @brief Cancel a request: its queued prompt chunks and encodes are dropped and a decoding one leaves the decode loop
+ * with its kv cleared at once. Its consumer gets "ERR: cancelled" (-1) at its next call, which releases the sequence
+ * @param handle Context handle
+ * @param request_id Id of the request, waiting for a sequence or holding one
+ * @return 0 on success, -1 if no such request is in progress
+ */
+int32_t llama_mico_cancel(void *handle, int32_t request_id);
+
+/**
+ * @brief Release the kv of a multi-turn session, requests with "session" keep it cached until released or evicted.
+ * Also releases the frame window of a "video_session" of the same id
+ * @param handle Context handle
+ * @param session Session id
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_release_session(void *handle, const char *session);
+
+/**
+ * @brief Serialise a multi-turn session cached between turns (its kv and prompt history) for another engine instance
+ * of the same model, e.g. to move it to a less loaded node. After llama_mico_session_import there, its next turn
+ * continues without prefilling the history. The session stays cached here until released
+ * @param handle Context handle
+ * @param session Session id
+ * @param data Output parameter, the buffer, valid until the next export of the calling thread
+ * @param size Output parameter, bytes of data
+ * @return 0 on success, -1 if the session is not cached (released, evicted, or cache_seq 0)
+ */
+int32_t llama_mico_session_export(void *handle, const char *session, const uint8_t **data, size_t *size);
+
+/**
+ * @brief Cache a session exported by llama_mico_session_export as if its last turn ran here, replacing a session of
+ * the same id
+ * @param handle Context handle
+ * @param data Exported buffer
+ * @param size Bytes of data
+ * @return 0 on success, -1 if the buffer is of another model or malformed, or no cache sequence is free
+ */
+int32_t llama_mico_session_import(void *handle, const uint8_t *data, size_t size);
+
+/**
+ * @brief Register a modal buffer owned by the engine, the producer writes the frame (or encoded image) into data once
+ * and requests refer to it by id: {"buffer": id} in modal_prts, or buffer_id of llama_mico_modal_buffer. The memory is
+ * pinned host memory when there is a GPU, reused after release
+ * @param handle Context handle
+ * @param size Bytes of the buffer
+ * @param format LLAMA_MICO_MODAL_*
+ * @param nx Raw frame width in pixels, unused for encoded buffers
+ * @param ny Raw frame height in pixels, unused for encoded buffers
+ * @param data Output parameter, returns the memory to write, valid until the buffer is released
+ * @param buffer_id Output parameter, returns the id of the buffer
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_register_buffer(void *handle, size_t size, int32_t format, uint32_t nx, uint32_t ny, uint8_t **data,
+                                   int32_t *buffer_id);
+
+/**
+ * @brief Release a registered buffer, its id is invalid afterwards. Requests already referring to it keep it until
+ * they are done, so it may be released right after the request is submitted
+ * @param handle Context handle
+ * @param buffer_id Id returned by llama_mico_register_buffer
+ * @return 0 on success, -1 for an unknown id
+ */
+int32_t llama_mico_release_buffer(void *handle, int32_t buffer_id);
+
+/**
+ * @brief Encode a frame into the modal embedding cache as it arrives, before any question refers to it. It is encoded
+ * while no request image is queued, newest first, and the oldest waiting frames are dropped once a few per encoder
+ * worker wait. A request referring to it while it waits takes it over at the request's priority. The cache key is the
+ * one of a default request: pool, roi and max_side of frame must match the question's, and an image_min_side the
+ * encoder load lowers the side to gives another key
+ * @param handle Context handle
+ * @param frame Frame, its data or a registered buffer_id, copied before the call returns
+ * @param content_id Stable id of the frame, NULL for the content_id of frame (or the hash of the content if none)
+ * @return 0 once queued or if already cached, -1 on failure or without a vision model
+ */
+int32_t llama_mico_pre_encode(void *handle, const llama_mico_modal_buffer *frame, const char *content_id);
+
+/**
+ * @brief Pooled embedding of a text or of an image with the loaded model, for retrieval and deduplication. A text is
+ * prefilled without sampling in a free sequence, its decodes interleave with the decode steps of running requests,
+ * and the final hidden states are mean pooled. An image is only encoded (its embeddings come from the modal cache if
+ * cached), the projector outputs of all its slices are mean pooled. The vector is L2 normalised. NOTE: a text vector
+ * is in the space of the last layer and an image vector in the input space of the LLM, only compare like with like
+ * @param handle Context handle
+ * @param text Text to embed, NULL to embed image
+ * @param image Image to embed, its data or a registered buffer_id, NULL to embed text
+ * @param embd Output vector, n_embd of the model floats
+ * @param n_embd_max Capacity of embd
+ * @param n_embd Set to the length of the vector
+ * @return 0 on success, -1 on failure, if no sequence is free or without a vision model for an image
+ */
+int32_t llama_mico_embed(void *handle, const char *text, const llama_mico_modal_buffer *image, float *embd,
+                         int32_t n_embd_max, int32_t *n_embd);
+
+/**
+ * @brief Engine metrics as JSON: "latency" histograms per stage (count, mean, min, max, p50, p90, p99, p999 in ms),
+ * "batch" fill ratio of the decode steps, "image_cache" and "kv_cache" hit rates and bytes, with op_profile "ops" of
+ * the "llm" and "vision" graphs: total "ms" and per op type and backend count, ms, share and MB read and written
+ * @param handle Context handle
+ * @param json Output parameter, returns the metrics, valid until the next call of the calling thread
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_get_metrics(void *handle, const char **json);
+
+/**
+ * @brief Memory breakdown as JSON, read live for capacity planning: "devices" by name with "free" and "total" bytes
+ * and "host", each with the bytes of the buffers placed there: "model" weights, "kv" cache, llm "compute" and "output"
+ * buffers, "mmproj" weights with "mmproj_compute" and "mmproj_output" (pinned staging), and the same of the "draft"
+ * and "prefill" contexts. The host also counts the "embedding_cache" slab in use and its "embedding_cache_capacity",
+ * "modal_buffers", "kv_host_tier" and "preempt_swap". "kv_cells": "total", "used" by request sequences, "cached" by
+ * prompt cache and image kv sequences only, "free", and "bytes_per_cell"
+ * @param handle Context handle
+ * @param json Output parameter, returns the breakdown, valid until the next call of the calling thread
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_get_memory(void *handle, const char **json);
+
+/**
+ * @brief Stage times and cache use of a stopped request that asked for them ("timings": true), taken once:
+ * "queue_ms" waiting for a sequence (and kv with kv_admission), "template_ms", "bitmap_ms", "prefill_ms" to the
+ * prompt token with "encode_wait_ms" of it spent waiting for image embeddings, "decode_ms", "total_ms", "prompt"
+ * positions ("resident" in the sequence from its last request, copied from the "kv_cache", "computed"), "images"
+ * ("encoded", embeddings "cached", "kv_reused") and "generated_tokens". "coalesced" requests took the tokens of an
+ * identical one. The last TIMINGS_KEPT_MAX (1024) stopped requests are kept
+ * @param handle Context handle
+ * @param request_id Request id
+ * @param json Output parameter, returns the timings, valid until the next call of the calling thread
+ * @return 0 on success, -1 if the request did not ask for timings, has not stopped or they were taken
+ */
+int32_t llama_mico_get_timings(void *handle, int32_t request_id, const char **json);
+
+/**
+ * @brief Cache digest for a router spreading requests over engine instances of the same model: "load" (admission
+ * "waiting", "free_seqs" of "n_seq", "free_kv" of "n_kv" positions), "prefix" a bloom filter of the block hashes of
+ * the cached prompts ("block" tokens per hash, "n_bits", "n_hashes", "bloom" hex, bit j of hash h is
+ * (h + j * (fmix64(h) | 1)) mod n_bits, least significant bit of a byte first) and "images" the hex keys of the
+ * highest priority cached embeddings
+ * @param handle Context handle
+ * @param json Output parameter, returns the digest, valid until the next call of the calling thread
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_get_cache_digest(void *handle, const char **json);
+
+/**
+ * @brief Digest of a request to match against llama_mico_get_cache_digest of any instance: "blocks" the hex hashes
+ * of its whole prompt blocks before the first image, in order, and "images" the embedding keys of its modal buffers.
+ * The longest run of leading blocks in an instance's bloom filter estimates the prefix it has cached. Does not infer
+ * @param handle Context handle
+ * @param request_json Request as for llama_mico_request_prompt
+ * @param json Output parameter, returns the digest, valid until the next call of the calling thread
+ * @return 0 on success, -1 if the request is invalid
+ */
+int32_t llama_mico_get_request_digest(void *handle, const char *request_json, const char **json);
+
+/**
+ * @brief Start recording begin/end events of the scheduler threads into per-thread ring buffers
+ * @param handle Context handle
+ * @param n_events Events kept per thread (<= 0 for the default), the oldest are overwritten
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_trace_start(void *handle, int32_t n_events);
+
+/**
+ * @brief Stop tracing and write the recorded events as a chrome://tracing / Perfetto json file
+ * @param handle Context handle
+ * @param path Output file path
+ * @return 0 on success, -1 on failure
+ */
+int32_t llama_mico_trace_dump(void *handle, const char *path);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,266 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+// Offline batch inference for throughput, e.g. nightly summaries of recorded clips. Reads a JSONL of requests,
+// keeps --concurrency of them in flight through llama_mico_stream_open so the encoders and the LLM stay busy, and
+// writes one JSONL result per request as it finishes:
+//   llama-mico-batch --config engine.json --in requests.jsonl --out results.jsonl [--concurrency 64]
+// A request line is an OpenAI format request plus "frame_files": one image file per image marker, or an array of
+// files for a video clip behind one marker. "id" is any JSON value, copied to the result. The engine runs with no
+// batching window (batch_wait_ms 0) and full chunk_size batches, requests over the free sequences wait in the
+// admission queue instead of failing.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llama-mico.h"
+#include "nlohmann/json.hpp"
+#include "tool-common.h"
+
+using json = nlohmann::ordered_json;
+
+#define BATCH_REQUEST_ID_BASE 200000  // above the ids of the python service and llama-mico-bench
+#define BATCH_READ_BYTES 4096         // text taken from a stream per read
+#define BATCH_IDLE_SLEEP_US 500       // no stream had text in a pass
+#define BATCH_DEFAULT_CONCURRENCY 64  // without n_seq_max in the config
+
+struct BatchParams {
+    std::string config_path;
+    std::string in_path;
+    std::string out_path;
+    std::string report_path;
+    std::string frames_dir;  // base of relative frame_files
+    int32_t concurrency{0};  // requests in flight, 0 for twice n_seq_max
+};
+
+struct BatchRequest {
+    json id;
+    // NOTE: the engine refers to the frame data until the request is done, it stays put as frames grows
+    std::vector<std::vector<uint8_t>> frames;
+    void* stream{nullptr};
+    std::string text;
+    double t_start{0};
+};
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s --config <engine.json> --in <requests.jsonl> --out <results.jsonl> [--concurrency N]\n"
+            "       [--frames-dir <dir>] [--report <file>]\n",
+            argv0);
+}
+
+static bool parse_args(int argc, char** argv, BatchParams& params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "missing value of %s\n", arg.c_str());
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--config")
+            params.config_path = value;
+        else if (arg == "--in")
+            params.in_path = value;
+        else if (arg == "--out")
+            params.out_path = value;
+        else if (arg == "--report")
+            params.report_path = value;
+        else if (arg == "--frames-dir")
+            params.frames_dir = value;
+        else if (arg == "--concurrency")
+            params.concurrency = std::max(1, atoi(value));
+        else {
+            fprintf(stderr, "unknown argument %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return !params.config_path.empty() && !params.in_path.empty() && !params.out_path.empty();
+}
+
+static bool read_file(const std::string& path, std::vector<uint8_t>& data) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+    data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return !data.empty();
+}
+
+// Encoded frame of a modal_prts entry, read into request.frames
+static bool frame_modal(const std::string& file, const BatchParams& params, BatchRequest& request, json& modal) {
+    std::string path = params.frames_dir.empty() || file.empty() || file[0] == '/' ? file
+                                                                                   : params.frames_dir + "/" + file;
+    request.frames.emplace_back();
+    if (!read_file(path, request.frames.back())) {
+        fprintf(stderr, "failed to read frame %s\n", path.c_str());
+        return false;
+    }
+    modal = {{"data", std::to_string((uintptr_t)request.frames.back().data())},
+             {"size", request.frames.back().size()}};
+    return true;
+}
+
+// Engine request of one input line, the frame files become modal_prts of the frames read into request
+static bool build_request(json line, int32_t index, const BatchParams& params, BatchRequest& request,
+                          std::string& request_json) {
+    request.id = line.contains("id") ? line["id"] : json(index);
+    json modal_prts = json::array();
+    if (line.contains("frame_files")) {
+        for (const auto& entry : line["frame_files"]) {
+            json modal;
+            if (!entry.is_array()) {
+                if (!frame_modal(entry.get<std::string>(), params, request, modal)) return false;
+            } else {
+                modal["frames"] = json::array();
+                for (const auto& file : entry) {
+                    json frame;
+                    if (!frame_modal(file.get<std::string>(), params, request, frame)) return false;
+                    modal["frames"].push_back(frame);
+                }
+            }
+            modal_prts.push_back(modal);
+        }
+        line.erase("frame_files");
+    }
+    line["id"] = "local-chatcmpl-" + std::to_string(BATCH_REQUEST_ID_BASE + index);
+    line["modal_prts"] = modal_prts;
+    request_json = line.dump();
+    return true;
+}
+
+// Throughput settings over the given config: no batching window, full batches, a queue instead of rejections
+static std::string offline_config(json config, int32_t concurrency) {
+    config["batch_wait_ms"] = 0;
+    if (!config.contains("text_batch_size")) config["text_batch_size"] = 0;
+    if (!config.contains("image_batch_size")) config["image_batch_size"] = 0;
+    if (!config.contains("admission_queue_max")) config["admission_queue_max"] = concurrency;
+    if (!config.contains("admission_wait_ms")) config["admission_wait_ms"] = 0;
+    return config.dump();
+}
+
+int main(int argc, char** argv) {
+    BatchParams params;
+    if (!parse_args(argc, argv, params)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    std::ifstream config_file(params.config_path);
+    std::ifstream in_file(params.in_path);
+    std::ofstream out_file(params.out_path);
+    if (!config_file || !in_file || !out_file) {
+        fprintf(stderr, "failed to open %s, %s or %s\n", params.config_path.c_str(), params.in_path.c_str(),
+                params.out_path.c_str());
+        return 1;
+    }
+    std::stringstream config;
+    config << config_file.rdbuf();
+    json config_json = json::parse(config.str(), nullptr, false /* allow_exceptions */);
+    if (!config_json.is_object()) {
+        fprintf(stderr, "invalid config %s\n", params.config_path.c_str());
+        return 1;
+    }
+    int32_t concurrency = params.concurrency;
+    if (concurrency <= 0)
+        concurrency = config_json.contains("n_seq_max") ? 2 * config_json["n_seq_max"].get<int32_t>()
+                                                        : BATCH_DEFAULT_CONCURRENCY;
+
+    void* handle = nullptr;
+    if (llama_mico_init(offline_config(config_json, concurrency).c_str(), &handle) != 0 || !handle) {
+        fprintf(stderr, "failed to init llama-mico\n");
+        return 1;
+    }
+
+    std::list<BatchRequest> in_flight;
+    int32_t n_read = 0, n_done = 0, n_failed = 0;
+    size_t n_bytes = 0;
+    std::vector<double> latency;
+    auto write_result = [&](const BatchRequest& request, bool ok, int32_t result) {
+        double ms = now_ms() - request.t_start;
+        json out = {{"id", request.id}, {"ok", ok}, {ok ? "content" : "error", request.text}, {"ms", ms}};
+        if (!ok) out["result"] = result;
+        out_file << out.dump() << "\n";
+        out_file.flush();
+        n_done++;
+        n_failed += ok ? 0 : 1;
+        n_bytes += ok ? request.text.size() : 0;
+        if (ok) latency.push_back(ms);
+    };
+
+    double t_start = now_ms();
+    std::string line;
+    bool input_done = false;
+    char buffer[BATCH_READ_BYTES];
+    while (!input_done || !in_flight.empty()) {
+        while (!input_done && (int32_t)in_flight.size() < concurrency) {  // Refill, the engine queues what it can't run
+            if (!std::getline(in_file, line)) {
+                input_done = true;
+                break;
+            }
+            if (line.empty()) continue;
+            int32_t index = n_read++;
+            in_flight.emplace_back();
+            auto& request = in_flight.back();
+            request.t_start = now_ms();
+            json parsed = json::parse(line, nullptr, false /* allow_exceptions */);
+            std::string request_json;
+            if (!parsed.is_object() || !build_request(parsed, index, params, request, request_json)) {
+                request.text = "invalid request line " + std::to_string(index + 1);
+                write_result(request, false, -1);
+                in_flight.pop_back();
+                continue;
+            }
+            int32_t ret = llama_mico_stream_open(handle, request_json.c_str(), 0, &request.stream);
+            if (ret != 0) {
+                request.text = "failed to submit";
+                write_result(request, false, ret);
+                in_flight.pop_back();
+            }
+        }
+
+        bool progress = false;
+        for (auto it = in_flight.begin(); it != in_flight.end();) {
+            int32_t n = 0, is_finished = 0;
+            int32_t ret = llama_mico_stream_read(it->stream, buffer, sizeof(buffer), 0, &n, &is_finished);
+            if (n > 0) it->text.append(buffer, n);
+            progress |= n > 0 || is_finished;
+            if (!is_finished) {
+                ++it;
+                continue;
+            }
+            llama_mico_stream_close(it->stream);
+            write_result(*it, ret == 0, ret);
+            it = in_flight.erase(it);
+        }
+        if (!progress) std::this_thread::sleep_for(std::chrono::microseconds(BATCH_IDLE_SLEEP_US));
+    }
+    double wall_ms = now_ms() - t_start;
+
+    json report;
+    report["requests"] = n_done;
+    report["failed"] = n_failed;
+    report["concurrency"] = concurrency;
+    report["wall_s"] = wall_ms / 1000.0;
+    report["requests_per_s"] = wall_ms > 0 ? n_done * 1000.0 / wall_ms : 0.0;
+    report["output_bytes"] = n_bytes;
+    report["latency_ms"] = latency_summary(latency);
+    const char* metrics = nullptr;
+    if (llama_mico_get_metrics(handle, &metrics) == 0 && metrics) report["engine"] = json::parse(metrics);
+    llama_mico_free(handle);
+
+    std::string out = report.dump(2);
+    if (params.report_path.empty()) {
+        fprintf(stderr, "%s\n", out.c_str());
+    } else {
+        std::ofstream report_file(params.report_path);
+        report_file << out << "\n";
+    }
+    return n_done > 0 && n_failed == n_done ? 1 : 0;
+}
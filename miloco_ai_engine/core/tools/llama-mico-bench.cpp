@@ -0,0 +1,108 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+// Replays concurrent synthetic sessions through the llama-mico API and reports TTFT, ITL, throughput and the
+// engine metrics as JSON:
+//   llama-mico-bench --config engine.json --sessions 8 --requests 4 --images 2 --image-size 448x448 \
+//                    --prompt-tokens 512 --shared-prefix 0.5 --output-tokens 64 --out bench.json
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include "llama-mico.h"
+#include "nlohmann/json.hpp"
+#include "tool-common.h"
+
+using json = nlohmann::ordered_json;
+
+struct BenchParams {
+    std::string config_path;
+    std::string out_path;
+    SyntheticWorkload workload;
+};
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s --config <engine.json> [--sessions N] [--requests N] [--images N] [--image-size WxH]\n"
+            "       [--prompt-tokens N] [--shared-prefix R] [--output-tokens N] [--priority N] [--out <file>]\n",
+            argv0);
+}
+
+static bool parse_args(int argc, char** argv, BenchParams& params) {
+    SyntheticWorkload& workload = params.workload;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "missing value of %s\n", arg.c_str());
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--config")
+            params.config_path = value;
+        else if (arg == "--out")
+            params.out_path = value;
+        else if (arg == "--sessions")
+            workload.n_sessions = std::max(1, atoi(value));
+        else if (arg == "--requests")
+            workload.n_requests = std::max(1, atoi(value));
+        else if (arg == "--images")
+            workload.n_images = std::max(0, atoi(value));
+        else if (arg == "--image-size") {
+            if (sscanf(value, "%ux%u", &workload.image_nx, &workload.image_ny) != 2) return false;
+        } else if (arg == "--prompt-tokens")
+            workload.prompt_tokens = std::max(1, atoi(value));
+        else if (arg == "--shared-prefix")
+            workload.shared_prefix = std::min(std::max((float)atof(value), 0.0f), 1.0f);
+        else if (arg == "--output-tokens")
+            workload.output_tokens = std::max(1, atoi(value));
+        else if (arg == "--priority")
+            workload.priority = atoi(value);
+        else {
+            fprintf(stderr, "unknown argument %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return !params.config_path.empty();
+}
+
+int main(int argc, char** argv) {
+    BenchParams params;
+    if (!parse_args(argc, argv, params)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    std::ifstream config_file(params.config_path);
+    if (!config_file) {
+        fprintf(stderr, "failed to read %s\n", params.config_path.c_str());
+        return 1;
+    }
+    std::stringstream config;
+    config << config_file.rdbuf();
+
+    void* handle = nullptr;
+    if (llama_mico_init(config.str().c_str(), &handle) != 0 || !handle) {
+        fprintf(stderr, "failed to init llama-mico\n");
+        return 1;
+    }
+
+    json report = run_synthetic_workload(handle, params.workload, BENCH_REQUEST_ID_BASE);
+    const char* metrics = nullptr;
+    if (llama_mico_get_metrics(handle, &metrics) == 0 && metrics) report["engine"] = json::parse(metrics);
+
+    llama_mico_free(handle);
+
+    std::string out = report.dump(2);
+    if (params.out_path.empty()) {
+        printf("%s\n", out.c_str());
+    } else {
+        std::ofstream out_file(params.out_path);
+        out_file << out << "\n";
+    }
+    return report["failed"] == report["requests"] ? 1 : 0;
+}
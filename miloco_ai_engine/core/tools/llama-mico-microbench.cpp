@@ -0,0 +1,417 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+// Microbenchmarks of the per request hot paths, output in the Google Benchmark JSON format so runs can be compared
+// with its tools/compare.py. Hashing, the radix tree and bitmap decode run without a model, the caches, prefix
+// items and crop_by_query need an engine config. The MpscQueue submission path is stress checked first, a lost or
+// reordered chunk fails the run:
+//   llama-mico-microbench [--config engine.json] [--image photo.jpg] [--filter radix] [--min-time 0.5] [--out mb.json]
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch_scheduling/batch-scheduler.h"
+#include "cache_manager/chunk-infer-cache.h"
+#include "cache_manager/modal-embedding-cache.h"
+#include "cache_manager/radix-tree.h"
+#include "llama-mico.h"
+#include "nlohmann/json.hpp"
+#include "tool-common.h"
+#include "utils/mico-common.h"
+#include "utils/mico-dialog-util.h"
+#include "utils/mpsc-queue.h"
+
+using json = nlohmann::ordered_json;
+
+#define MPSC_CHECK_PRODUCERS 8
+#define MPSC_CHECK_ITEMS 100000  // per producer
+
+struct MicrobenchParams {
+    std::string config_path;
+    std::string image_path;
+    std::string filter;
+    std::string out_path;
+    double min_time_s{0.3};
+};
+
+// Per thread loop of a benchmark, setup inside an iteration runs between pause() and resume()
+class BenchTimer {
+  public:
+    void pause() { paused_ms_ -= now_ms(); }
+    void resume() { paused_ms_ += now_ms(); }
+    double paused_ms() const { return paused_ms_; }
+
+  private:
+    double paused_ms_{0};
+};
+using BenchFn = std::function<void(int64_t n_iters, BenchTimer& timer)>;
+
+class Microbench {
+  public:
+    explicit Microbench(const MicrobenchParams& params) : params_(params) {}
+
+    // Doubles the iterations until a run takes min_time, every thread runs them concurrently
+    void run(const std::string& name, BenchFn fn, int32_t n_threads = 1) {
+        std::string full_name = n_threads > 1 ? name + "/threads:" + std::to_string(n_threads) : name;
+        if (!params_.filter.empty() && full_name.find(params_.filter) == std::string::npos) return;
+        int64_t n_iters = 1;
+        double real_ms = 0, cpu_ms = 0;
+        while (true) {
+            std::vector<BenchTimer> timers(n_threads);
+            std::clock_t cpu_start = std::clock();
+            double t_start = now_ms();
+            std::vector<std::thread> threads;
+            for (int32_t t = 1; t < n_threads; t++) threads.emplace_back([&, t]() { fn(n_iters, timers[t]); });
+            fn(n_iters, timers[0]);
+            for (auto& thread : threads) thread.join();
+            double paused_ms = 0;
+            for (const auto& timer : timers) paused_ms += timer.paused_ms();
+            real_ms = now_ms() - t_start - paused_ms / n_threads;
+            cpu_ms = (double)(std::clock() - cpu_start) * 1000.0 / CLOCKS_PER_SEC - paused_ms;
+            if (real_ms >= params_.min_time_s * 1000 || n_iters >= (1LL << 30)) break;
+            n_iters = real_ms > 0 ? std::max(n_iters * 2, (int64_t)(n_iters * params_.min_time_s * 1100 / real_ms))
+                                  : n_iters * 10;
+        }
+        double real_ns = real_ms * 1e6 / n_iters;
+        double cpu_ns = cpu_ms * 1e6 / n_iters / n_threads;
+        fprintf(stderr, "%-48s %14.0f ns %14.0f ns %12" PRId64 "\n", full_name.c_str(), real_ns, cpu_ns, n_iters);
+        results_.push_back({{"name", full_name},
+                            {"run_name", full_name},
+                            {"run_type", "iteration"},
+                            {"iterations", n_iters},
+                            {"real_time", real_ns},
+                            {"cpu_time", cpu_ns},
+                            {"time_unit", "ns"},
+                            {"threads", n_threads}});
+    }
+
+    json report() const {
+        json j;
+        j["context"] = {{"executable", "llama-mico-microbench"},
+                        {"num_cpus", std::thread::hardware_concurrency()},
+                        {"library_build_type", "release"}};
+        j["benchmarks"] = results_;
+        return j;
+    }
+
+  private:
+    const MicrobenchParams& params_;
+    json results_ = json::array();
+};
+
+static bool parse_args(int argc, char** argv, MicrobenchParams& params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "missing value of %s\n", arg.c_str());
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--config")
+            params.config_path = value;
+        else if (arg == "--image")
+            params.image_path = value;
+        else if (arg == "--filter")
+            params.filter = value;
+        else if (arg == "--min-time")
+            params.min_time_s = std::max(atof(value), 0.01);
+        else if (arg == "--out")
+            params.out_path = value;
+        else {
+            fprintf(stderr, "unknown argument %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// 24 bit BMP of a random frame, decoded by stb_image when no jpeg is given
+static std::vector<uint8_t> bmp_image(uint32_t nx, uint32_t ny) {
+    std::mt19937 rng(7);
+    std::vector<uint8_t> rgb = random_frame(rng, nx, ny);
+    uint32_t row = (nx * 3 + 3) & ~3u;
+    uint32_t n_pixels = row * ny, n_file = 54 + n_pixels;
+    std::vector<uint8_t> bmp(n_file, 0);
+    auto put32 = [&bmp](size_t at, uint32_t v) {
+        for (int b = 0; b < 4; b++) bmp[at + b] = (uint8_t)(v >> (8 * b));
+    };
+    bmp[0] = 'B';
+    bmp[1] = 'M';
+    put32(2, n_file);
+    put32(10, 54);
+    put32(14, 40);
+    put32(18, nx);
+    put32(22, ny);
+    bmp[26] = 1;
+    bmp[28] = 24;
+    put32(34, n_pixels);
+    for (uint32_t y = 0; y < ny; y++) {
+        for (uint32_t x = 0; x < nx; x++) {
+            const uint8_t* p = &rgb[((size_t)(ny - 1 - y) * nx + x) * 3];
+            uint8_t* q = &bmp[54 + (size_t)y * row + x * 3];
+            q[0] = p[2];
+            q[1] = p[1];
+            q[2] = p[0];
+        }
+    }
+    return bmp;
+}
+
+// Producers push (producer, i) while one consumer drains concurrently: every item has to arrive once and in push
+// order per producer, as the chunks of one prompt reach the batch scheduler
+static bool check_mpsc_queue(int32_t n_producers, int64_t n_items) {
+    MpscQueue<std::pair<int32_t, int64_t>> queue;
+    std::atomic<int32_t> n_running{n_producers};
+    std::vector<std::thread> producers;
+    for (int32_t p = 0; p < n_producers; p++) {
+        producers.emplace_back([&, p]() {
+            for (int64_t i = 0; i < n_items; i++) queue.push({p, i});
+            n_running.fetch_sub(1);
+        });
+    }
+    std::vector<int64_t> next(n_producers, 0);
+    bool ok = true;
+    auto consume = [&]() {
+        for (const auto& [p, i] : queue.drain()) {
+            if (i != next[p]) ok = false;
+            next[p] = i + 1;
+        }
+    };
+    while (n_running.load() > 0) consume();
+    consume();
+    for (auto& producer : producers) producer.join();
+    for (int32_t p = 0; p < n_producers; p++) ok = ok && next[p] == n_items;
+    fprintf(stderr, "mpsc_queue check: %d producers, %" PRId64 " items, %s\n", n_producers, n_items * n_producers,
+            ok ? "ok" : "lost or reordered items");
+    return ok;
+}
+
+static std::vector<PrefixItem> random_items(std::mt19937& rng, size_t n_items) {
+    std::uniform_int_distribution<int64_t> token(0, 150000);
+    std::vector<PrefixItem> items(n_items);
+    for (auto& item : items) item = {token(rng), 1};
+    return items;
+}
+
+static void bench_standalone(Microbench& bench, const MicrobenchParams& params, mtmd_context* ctx_vision) {
+    for (uint32_t side : {224u, 448u, 896u}) {
+        std::mt19937 rng(1);
+        auto rgb = random_frame(rng, side, side);
+        std::string size = std::to_string(side) + "x" + std::to_string(side);
+        bench.run("hash_bytes/" + size, [&rgb](int64_t n, BenchTimer&) {
+            for (int64_t i = 0; i < n; i++) hash_bytes(rgb.data(), rgb.size());
+        });
+        bench.run("image_dhash/" + size, [&rgb, side](int64_t n, BenchTimer&) {
+            for (int64_t i = 0; i < n; i++) image_dhash(rgb.data(), side, side);
+        });
+    }
+
+    // ChunkInferCache lookups: prompts sharing a system head, diverging after it
+    for (size_t n_prompts : {64, 1024}) {
+        std::mt19937 rng(2);
+        auto head = random_items(rng, 512);
+        std::vector<std::vector<PrefixItem>> prompts;
+        for (size_t p = 0; p < n_prompts; p++) {
+            auto prompt = head;
+            auto tail = random_items(rng, 1536);
+            prompt.insert(prompt.end(), tail.begin(), tail.end());
+            prompts.push_back(std::move(prompt));
+        }
+        RadixTree tree;
+        for (size_t p = 0; p < n_prompts; p++) tree.insert(prompts[p], (int32_t)p);
+        std::string suffix = "/" + std::to_string(n_prompts);
+        bench.run("radix_tree_match" + suffix, [&](int64_t n, BenchTimer&) {
+            std::vector<int32_t> seq_ids;
+            for (int64_t i = 0; i < n; i++) {
+                const auto& items = prompts[i % n_prompts];
+                tree.match(items, items.size(), seq_ids);
+            }
+        });
+        bench.run("radix_tree_insert_erase" + suffix, [&](int64_t n, BenchTimer&) {
+            for (int64_t i = 0; i < n; i++) {
+                const auto& items = prompts[i % n_prompts];
+                tree.erase(items, (int32_t)(i % n_prompts));
+                tree.insert(items, (int32_t)(i % n_prompts));
+            }
+        });
+    }
+
+    std::vector<uint8_t> image;
+    std::string image_name = "bmp_448x448";
+    if (!params.image_path.empty()) {
+        std::ifstream file(params.image_path, std::ios::binary);
+        image.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        image_name = "file";
+    }
+    if (image.empty()) image = bmp_image(448, 448);
+    bench.run("bitmap_init_from_buf/" + image_name, [&](int64_t n, BenchTimer&) {
+        for (int64_t i = 0; i < n; i++) {
+            mtmd::bitmap bitmap(mtmd_helper_bitmap_init_from_buf(ctx_vision, image.data(), image.size(), 0, 0));
+        }
+    });
+}
+
+// Image chunks of distinct random frames, tokenized by the vision context
+static std::vector<std::shared_ptr<mtmd::input_chunks>> image_chunks(LlamaMicoContext* ctx, size_t n_images,
+                                                                     uint32_t side) {
+    std::vector<std::shared_ptr<mtmd::input_chunks>> all;
+    std::mt19937 rng(3);
+    for (size_t i = 0; i < n_images; i++) {
+        auto rgb = random_frame(rng, side, side);
+        mtmd::bitmap bitmap(mtmd_bitmap_init(side, side, rgb.data()));
+        std::string id = hash_to_hex(hash_bytes(rgb.data(), rgb.size()));
+        bitmap.set_id(id.c_str());
+        auto chunks = std::make_shared<mtmd::input_chunks>(mtmd_input_chunks_init());
+        std::string prompt = ctx->media_marker;
+        mtmd_input_text text{prompt.c_str(), false, true};
+        const mtmd_bitmap* bitmaps[] = {bitmap.ptr.get()};
+        if (mtmd_tokenize(ctx->vision().get(), chunks->ptr.get(), &text, bitmaps, 1) != 0) break;
+        all.push_back(chunks);
+    }
+    return all;
+}
+
+static const mtmd_input_chunk* first_image(mtmd::input_chunks& chunks) {
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (mtmd_input_chunk_get_type(chunks[i]) == MTMD_INPUT_CHUNK_TYPE_IMAGE) return chunks[i];
+    }
+    return nullptr;
+}
+
+static void bench_engine(Microbench& bench, LlamaMicoContext* ctx) {
+    int32_t n_embd = llama_model_n_embd(ctx->model);
+    auto images = image_chunks(ctx, 256, 448);
+    std::vector<const mtmd_input_chunk*> chunks;
+    for (const auto& c : images) {
+        if (const mtmd_input_chunk* image = first_image(*c)) chunks.push_back(image);
+    }
+    if (!chunks.empty()) {
+        size_t n_tokens = mtmd_input_chunk_get_n_tokens(chunks[0]);
+        auto embd = std::make_shared<std::vector<float>>(n_tokens * n_embd, 0.5f);
+        size_t n_bytes = embd->size() * sizeof(float);
+
+        // NOTE: room for half of the images, every store past it evicts through maintain()
+        ModalEmbeddingCache evicting(chunks.size() / 2, (chunks.size() / 2) * n_bytes, ctx);
+        bench.run("image_cache_store/evicting", [&](int64_t n, BenchTimer&) {
+            for (int64_t i = 0; i < n; i++) evicting.store(chunks[i % chunks.size()], embd);
+        });
+
+        ModalEmbeddingCache cache(chunks.size(), chunks.size() * n_bytes * 2, ctx);
+        for (const auto* chunk : chunks) cache.store(chunk, embd);
+        for (int32_t n_threads : {1, 4, 8}) {
+            std::atomic<int64_t> next{0};
+            bench.run("image_cache_lookup", [&](int64_t n, BenchTimer&) {
+                for (int64_t i = 0; i < n; i++) cache.lookup(chunks[next.fetch_add(1) % chunks.size()]);
+            }, n_threads);
+            bench.run("image_cache_lookup_store", [&](int64_t n, BenchTimer&) {
+                for (int64_t i = 0; i < n; i++) {
+                    int64_t k = next.fetch_add(1);
+                    if (k % 8 == 0)
+                        cache.store(chunks[k % chunks.size()], embd);
+                    else
+                        cache.lookup(chunks[k % chunks.size()]);
+                }
+            }, n_threads);
+        }
+
+        bench.run("prefix_items/image", [&](int64_t n, BenchTimer&) {
+            for (int64_t i = 0; i < n; i++) prefix_items(images[i % images.size()].get());
+        });
+    }
+
+    // NOTE: a separate cache over the reserved sequences, the engine is idle while it runs
+    if (ctx->kv_cache_seq > 0) {
+        ChunkInferCache kv_cache(ctx->kv_cache_seq, ctx);
+        std::mt19937 rng(4);
+        auto head = random_items(rng, 256);
+        std::vector<std::vector<PrefixItem>> prompts;
+        for (int32_t p = 0; p < ctx->kv_cache_seq * 4; p++) {
+            auto prompt = head;
+            auto tail = random_items(rng, 256);
+            prompt.insert(prompt.end(), tail.begin(), tail.end());
+            prompts.push_back(std::move(prompt));
+        }
+        bench.run("kv_cache_store/" + std::to_string(prompts.size()), [&](int64_t n, BenchTimer&) {
+            for (int64_t i = 0; i < n; i++)
+                kv_cache.store(prompts[i % prompts.size()], 0, (int32_t)TaskClass::INTERACTIVE);
+        });
+        bench.run("kv_cache_apply_prefix/" + std::to_string(prompts.size()), [&](int64_t n, BenchTimer&) {
+            llama_pos n_pos = 0;
+            for (int64_t i = 0; i < n; i++) {
+                const auto& items = prompts[i % prompts.size()];
+                kv_cache.apply_prefix(items, items.size() - 1, 0, n_pos);
+            }
+        });
+    }
+
+    // crop_by_query: many user turns, the oldest are cropped until the prompt fits
+    if (!ctx->crop_tokens_lable.empty()) {
+        std::string label = common_detokenize(ctx->lctx, ctx->crop_tokens_lable, true);
+        for (int32_t n_turns : {16, 256}) {
+            std::mt19937 rng(5);
+            std::string prompt;
+            for (int32_t t = 0; t < n_turns; t++) prompt += label + random_words(rng, 60) + "\n";
+            mtmd_input_text text{prompt.c_str(), false, true};
+            int32_t n_prompt = 0;
+            bench.run("crop_by_query/" + std::to_string(n_turns), [&](int64_t n, BenchTimer& timer) {
+                for (int64_t i = 0; i < n; i++) {
+                    timer.pause();
+                    auto chunks = std::make_shared<mtmd::input_chunks>(mtmd_input_chunks_init());
+                    mtmd_tokenize(ctx->vision().get(), chunks->ptr.get(), &text, nullptr, 0);
+                    n_prompt = (int32_t)mtmd_helper_get_n_tokens(chunks->ptr.get());
+                    timer.resume();
+                    crop_by_query(chunks, n_prompt, n_prompt / 2, ctx);
+                }
+            });
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    MicrobenchParams params;
+    if (!parse_args(argc, argv, params)) {
+        fprintf(stderr, "usage: %s [--config <engine.json>] [--image <file>] [--filter <substr>] [--min-time <s>]\n"
+                        "       [--out <file>]\n", argv[0]);
+        return 1;
+    }
+    ggml_time_init();
+    if (!check_mpsc_queue(MPSC_CHECK_PRODUCERS, MPSC_CHECK_ITEMS)) return 1;
+
+    void* handle = nullptr;
+    if (!params.config_path.empty()) {
+        std::ifstream config_file(params.config_path);
+        std::stringstream config;
+        config << config_file.rdbuf();
+        if (llama_mico_init(config.str().c_str(), &handle) != 0 || !handle) {
+            fprintf(stderr, "failed to init llama-mico\n");
+            return 1;
+        }
+    }
+    LlamaMicoContext* ctx = static_cast<LlamaMicoContext*>(handle);
+
+    Microbench bench(params);
+    fprintf(stderr, "%-48s %17s %17s %12s\n", "benchmark", "time", "cpu", "iterations");
+    std::shared_ptr<mtmd_context> ctx_vision = ctx ? ctx->vision() : nullptr;
+    bench_standalone(bench, params, ctx_vision.get());
+    if (ctx_vision) bench_engine(bench, ctx);
+    if (handle) llama_mico_free(handle);
+
+    std::string out = bench.report().dump(2);
+    if (params.out_path.empty()) {
+        printf("%s\n", out.c_str());
+    } else {
+        std::ofstream out_file(params.out_path);
+        out_file << out << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,255 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+// Re-drives a request log ("request_log_path" of the engine config) through llama_mico_request_prompt and
+// llama_mico_request_generate with the recorded inter-arrival times. Text and images are rebuilt from their hashes,
+// equal content in the log is equal content in the replay, so prefix and image cache hits repeat:
+//   llama-mico-replay --config engine.json --log requests.bin [--speed 2] [--out replay.json]
+
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llama-mico.h"
+#include "nlohmann/json.hpp"
+#include "tool-common.h"
+#include "utils/request-log.h"
+
+using json = nlohmann::ordered_json;
+
+struct ReplayParams {
+    std::string config_path;
+    std::string log_path;
+    std::string out_path;
+    double speed{1.0};          // arrival time scale, 2 replays twice as fast
+    uint32_t image_nx{448};     // size of encoded images, the log has none
+    uint32_t image_ny{448};
+    int32_t output_tokens{64};  // of requests the log has no finish record for
+    int32_t max_requests{0};    // 0 replays all
+};
+
+struct ReplayResult {
+    bool ok{false};
+    double ttft_ms{0};
+    double e2e_ms{0};
+    std::vector<double> itl_ms;
+    int32_t n_tokens{0};
+};
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s --config <engine.json> --log <requests.bin> [--speed X] [--image-size WxH]\n"
+            "       [--output-tokens N] [--max-requests N] [--out <file>]\n",
+            argv0);
+}
+
+static bool parse_args(int argc, char** argv, ReplayParams& params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "missing value of %s\n", arg.c_str());
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--config")
+            params.config_path = value;
+        else if (arg == "--log")
+            params.log_path = value;
+        else if (arg == "--out")
+            params.out_path = value;
+        else if (arg == "--speed")
+            params.speed = std::max(atof(value), 1e-3);
+        else if (arg == "--image-size") {
+            if (sscanf(value, "%ux%u", &params.image_nx, &params.image_ny) != 2) return false;
+        } else if (arg == "--output-tokens")
+            params.output_tokens = std::max(1, atoi(value));
+        else if (arg == "--max-requests")
+            params.max_requests = std::max(0, atoi(value));
+        else {
+            fprintf(stderr, "unknown argument %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return !params.config_path.empty() && !params.log_path.empty();
+}
+
+static const char* role_name(uint8_t role) {
+    static const char* ROLES[] = {"system", "user", "assistant", "tool"};
+    return role < 4 ? ROLES[role] : "user";
+}
+
+// Same hash and size, same text: the image markers then words seeded by the hash
+static std::string message_text(const LoggedMessage& msg) {
+    std::string text;
+    for (uint16_t i = 0; i < msg.n_markers; i++) text += TOOL_IMAGE_MARKER "\n";
+    std::mt19937 rng((uint32_t)(msg.hash ^ (msg.hash >> 32)));
+    while (text.size() < msg.n_bytes) text += random_words(rng, 1) + " ";
+    return text;
+}
+
+static std::string hex64(uint64_t value) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016" PRIx64, value);
+    return buf;
+}
+
+static ReplayResult replay_request(void* handle, const ReplayParams& params, const LoggedRequest& logged) {
+    ReplayResult result;
+    std::vector<std::vector<uint8_t>> frames;
+    json modals = json::array();
+    for (const auto& image : logged.images) {
+        uint32_t nx = image.nx > 0 ? image.nx : params.image_nx;
+        uint32_t ny = image.ny > 0 ? image.ny : params.image_ny;
+        std::mt19937 rng((uint32_t)(image.key.lo ^ (image.key.hi >> 32)));
+        frames.push_back(random_frame(rng, nx, ny));
+        json modal = {{"data", std::to_string((uintptr_t)frames.back().data())},
+                      {"size", frames.back().size()},
+                      {"format", "rgb"},
+                      {"nx", nx},
+                      {"ny", ny}};
+        modals.push_back(modal);
+    }
+    if (!logged.modal_frames.empty()) {  // video clips: the frames behind each marker
+        json clips = json::array();
+        size_t next = 0;
+        for (int32_t n_frames : logged.modal_frames) {
+            json clip = {{"frames", json::array()}};
+            for (int32_t k = 0; k < n_frames && next < modals.size(); k++) clip["frames"].push_back(modals[next++]);
+            clips.push_back(n_frames == 1 ? clip["frames"][0] : clip);
+        }
+        modals = clips;
+    }
+
+    json request = {{"id", "local-chatcmpl-" + std::to_string(logged.id)},
+                    {"priority", logged.priority},
+                    {"cache_prefix", logged.cache_prefix}};
+    request["messages"] = json::array();
+    for (const auto& msg : logged.messages)
+        request["messages"].push_back({{"role", role_name(msg.role)}, {"content", message_text(msg)}});
+    if (!modals.empty()) request["modal_prts"] = modals;
+    if (logged.session != 0) request["session"] = "replay-" + hex64(logged.session);
+    if (logged.n_tools_bytes > 0) {
+        std::string description = message_text({0, logged.n_tools_bytes, logged.tools_hash, 0});
+        request["tools"] = json::array({{{"type", "function"},
+                                         {"function",
+                                          {{"name", "tool_" + hex64(logged.tools_hash)},
+                                           {"description", description},
+                                           {"parameters", {{"type", "object"}, {"properties", json::object()}}}}}}});
+    }
+
+    int32_t is_finished = 0;
+    const char* content = nullptr;
+    double t_start = now_ms();
+    if (llama_mico_request_prompt(handle, request.dump().c_str(), &is_finished, &content) != 0) {
+        fprintf(stderr, "request %d failed: %s\n", logged.id, content ? content : "");
+        return result;
+    }
+    double t_last = now_ms();
+    result.ttft_ms = t_last - t_start;
+    result.n_tokens = 1;
+    result.ok = true;
+
+    // NOTE: the recorded count is of the tokens after the first, one per generate call
+    int32_t n_generate = logged.n_generated >= 0 ? logged.n_generated : params.output_tokens - 1;
+    std::string next = json({{"id", request["id"]}}).dump();
+    for (int32_t n = 0; !is_finished && n < n_generate; n++) {
+        if (llama_mico_request_generate(handle, next.c_str(), &is_finished, &content) != 0) break;
+        double t = now_ms();
+        result.itl_ms.push_back(t - t_last);
+        t_last = t;
+        result.n_tokens++;
+    }
+    if (!is_finished) {
+        std::string stop = json({{"id", request["id"]}, {"stop", true}}).dump();
+        llama_mico_request_generate(handle, stop.c_str(), &is_finished, &content);
+    }
+    result.e2e_ms = now_ms() - t_start;
+    return result;
+}
+
+int main(int argc, char** argv) {
+    ReplayParams params;
+    if (!parse_args(argc, argv, params)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    std::vector<LoggedRequest> logged;
+    if (!RequestLog::read(params.log_path, logged)) return 1;
+    if (params.max_requests > 0 && logged.size() > (size_t)params.max_requests) logged.resize(params.max_requests);
+    if (logged.empty()) {
+        fprintf(stderr, "no requests in %s\n", params.log_path.c_str());
+        return 1;
+    }
+
+    std::ifstream config_file(params.config_path);
+    if (!config_file) {
+        fprintf(stderr, "failed to read %s\n", params.config_path.c_str());
+        return 1;
+    }
+    std::stringstream config;
+    config << config_file.rdbuf();
+    void* handle = nullptr;
+    if (llama_mico_init(config.str().c_str(), &handle) != 0 || !handle) {
+        fprintf(stderr, "failed to init llama-mico\n");
+        return 1;
+    }
+
+    std::vector<ReplayResult> results(logged.size());
+    std::vector<std::thread> requests;
+    double t_start = now_ms();
+    for (size_t i = 0; i < logged.size(); i++) {
+        // NOTE: arrivals keep their recorded gaps, a request never waits for the ones before it
+        double t_arrival = t_start + (logged[i].t_us - logged[0].t_us) / 1000.0 / params.speed;
+        double wait_ms = t_arrival - now_ms();
+        if (wait_ms > 0) std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(wait_ms));
+        requests.emplace_back([&, i]() { results[i] = replay_request(handle, params, logged[i]); });
+    }
+    for (auto& request : requests) request.join();
+    double wall_ms = now_ms() - t_start;
+
+    std::vector<double> ttft, itl, e2e;
+    int64_t n_tokens = 0, n_failed = 0;
+    for (const auto& result : results) {
+        if (!result.ok) {
+            n_failed++;
+            continue;
+        }
+        ttft.push_back(result.ttft_ms);
+        e2e.push_back(result.e2e_ms);
+        itl.insert(itl.end(), result.itl_ms.begin(), result.itl_ms.end());
+        n_tokens += result.n_tokens;
+    }
+
+    json report;
+    report["log"] = params.log_path;
+    report["speed"] = params.speed;
+    report["requests"] = results.size();
+    report["failed"] = n_failed;
+    report["recorded_s"] = (logged.back().t_us - logged.front().t_us) / 1e6;
+    report["wall_s"] = wall_ms / 1000.0;
+    report["ttft_ms"] = latency_summary(ttft);
+    report["itl_ms"] = latency_summary(itl);
+    report["e2e_ms"] = latency_summary(e2e);
+    report["generated_tokens"] = n_tokens;
+    report["tokens_per_s"] = wall_ms > 0 ? n_tokens * 1000.0 / wall_ms : 0.0;
+    const char* metrics = nullptr;
+    if (llama_mico_get_metrics(handle, &metrics) == 0 && metrics) report["engine"] = json::parse(metrics);
+
+    llama_mico_free(handle);
+
+    std::string out = report.dump(2);
+    if (params.out_path.empty()) {
+        printf("%s\n", out.c_str());
+    } else {
+        std::ofstream out_file(params.out_path);
+        out_file << out << "\n";
+    }
+    return n_failed == (int64_t)results.size() ? 1 : 0;
+}
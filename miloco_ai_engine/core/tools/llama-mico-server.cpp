@@ -0,0 +1,382 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+// HTTP front end linked against llama-mico, requests go from the socket to the engine with no interpreter in between:
+//   llama-mico-server --config engine.json [--host 127.0.0.1] [--port 8080] [--threads 16] [--model-name mico]
+// Endpoints:
+//   POST   /v1/chat/completions  OpenAI chat request, "stream": true answers with server-sent events. Content parts
+//                                {"type": "image_url", "image_url": {"url": "data:...;base64,..."}} and
+//                                {"type": "frame", "buffer": id} become image markers, engine fields (priority,
+//                                session, video_session, lora, ...) pass through. "timings": true adds the stage
+//                                times and cache use of the request to the response (the last chunk of a stream)
+//   POST   /v1/frames            binary frame upload, ?format=rgb|nv12|encoded&width=W&height=H, returns {"buffer": id}
+//   DELETE /v1/frames/<id>       release an uploaded frame, requests already referring to it keep it until done
+//   DELETE /v1/sessions/<id>     release the kv of a session or video session
+//   GET    /metrics, /memory, /health
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cpp-httplib/httplib.h"
+#include "llama-mico.h"
+#include "nlohmann/json.hpp"
+#include "tool-common.h"
+
+using json = nlohmann::ordered_json;
+
+#define SERVER_REQUEST_ID_BASE 300000  // above the ids of the python service, llama-mico-bench and llama-mico-batch
+#define SERVER_READ_BYTES 4096         // text taken from a stream per read
+#define SERVER_READ_TIMEOUT_MS 50      // longest wait of a read, a closed connection is noticed in between
+
+struct ServerParams {
+    std::string config_path;
+    std::string host{"127.0.0.1"};
+    std::string model_name{"llama-mico"};
+    int32_t port{8080};
+    int32_t n_threads{0};  // connections served at once, 0 for the httplib default
+};
+
+struct ServerContext {
+    void* handle{nullptr};
+    std::string model_name;
+    std::atomic<int32_t> next_id{SERVER_REQUEST_ID_BASE};
+};
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s --config <engine.json> [--host <addr>] [--port N] [--threads N] [--model-name <name>]\n",
+            argv0);
+}
+
+static bool parse_args(int argc, char** argv, ServerParams& params) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            fprintf(stderr, "missing value of %s\n", arg.c_str());
+            return false;
+        }
+        const char* value = argv[++i];
+        if (arg == "--config")
+            params.config_path = value;
+        else if (arg == "--host")
+            params.host = value;
+        else if (arg == "--port")
+            params.port = atoi(value);
+        else if (arg == "--threads")
+            params.n_threads = std::max(1, atoi(value));
+        else if (arg == "--model-name")
+            params.model_name = value;
+        else {
+            fprintf(stderr, "unknown argument %s\n", arg.c_str());
+            return false;
+        }
+    }
+    return !params.config_path.empty();
+}
+
+static bool base64_decode(const std::string& in, size_t begin, std::vector<uint8_t>& out) {
+    static int8_t table[256];
+    static bool init = [] {
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        memset(table, -1, sizeof(table));
+        for (int i = 0; i < 64; i++) table[(uint8_t)alphabet[i]] = (int8_t)i;
+        return true;
+    }();
+    (void)init;
+    out.clear();
+    out.reserve((in.size() - begin) / 4 * 3);
+    uint32_t bits = 0;
+    int32_t n_bits = 0;
+    for (size_t i = begin; i < in.size() && in[i] != '='; i++) {
+        int8_t v = table[(uint8_t)in[i]];
+        if (v < 0) return false;
+        bits = (bits << 6) | (uint32_t)v;
+        n_bits += 6;
+        if (n_bits >= 8) {
+            n_bits -= 8;
+            out.push_back((uint8_t)(bits >> n_bits));
+        }
+    }
+    return !out.empty();
+}
+
+// Bytes of text up to the last complete utf8 sequence, a read may end inside one
+static size_t utf8_complete(const std::string& text) {
+    size_t n = text.size();
+    for (size_t back = 1; back <= std::min<size_t>(3, n); back++) {
+        uint8_t c = (uint8_t)text[n - back];
+        if ((c & 0xC0) == 0x80) continue;  // continuation byte
+        size_t len = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        return len > back ? n - back : n;
+    }
+    return n;
+}
+
+static void send_error(httplib::Response& res, int status, const std::string& message) {
+    json err = {{"error", {{"message", message}, {"code", status}}}};
+    res.status = status;
+    res.set_content(err.dump(), "application/json");
+}
+
+static int status_of(int32_t result) {
+    return result == -2 ? 400 : result == -3 ? 504 : 500;  // exceeds the context, past its deadline_ms
+}
+
+// Uploaded encoded image as a registered buffer, released once the request is submitted
+static bool register_encoded(ServerContext& server, const std::vector<uint8_t>& data, int32_t& buffer_id) {
+    uint8_t* dst = nullptr;
+    if (llama_mico_register_buffer(server.handle, data.size(), LLAMA_MICO_MODAL_ENCODED, 0, 0, &dst, &buffer_id) != 0)
+        return false;
+    memcpy(dst, data.data(), data.size());
+    return true;
+}
+
+// Engine request of an OpenAI chat request: content parts become text with image markers and modal_prts entries,
+// the buffers registered for inline images are returned to be released after the submit
+static bool build_request(json body, ServerContext& server, int32_t& request_id, std::string& request_json,
+                          std::vector<int32_t>& owned, std::string& err) {
+    if (!body.contains("messages") || !body["messages"].is_array()) {
+        err = "messages is required";
+        return false;
+    }
+    json modal_prts = json::array();
+    for (auto& message : body["messages"]) {
+        if (!message.contains("content") || !message["content"].is_array()) continue;
+        std::string text;
+        for (const auto& part : message["content"]) {
+            std::string type = part.value("type", "");
+            if (type == "text") {
+                text += part.value("text", "");
+            } else if (type == "frame") {
+                modal_prts.push_back({{"buffer", part.value("buffer", -1)}});
+                text += TOOL_IMAGE_MARKER;
+            } else if (type == "image_url") {
+                std::string url = part.contains("image_url") ? part["image_url"].value("url", "") : "";
+                size_t comma = url.find(',');
+                std::vector<uint8_t> data;
+                int32_t buffer_id = -1;
+                if (url.rfind("data:", 0) != 0 || comma == std::string::npos || !base64_decode(url, comma + 1, data)) {
+                    err = "image_url must be a base64 data url";
+                    return false;
+                }
+                if (!register_encoded(server, data, buffer_id)) {
+                    err = "failed to register an image of " + std::to_string(data.size()) + " bytes";
+                    return false;
+                }
+                owned.push_back(buffer_id);
+                modal_prts.push_back({{"buffer", buffer_id}});
+                text += TOOL_IMAGE_MARKER;
+            } else {
+                err = "unsupported content part " + type;
+                return false;
+            }
+        }
+        message["content"] = text;
+    }
+    if (!modal_prts.empty() && body.contains("modal_prts") && !body["modal_prts"].empty()) {
+        err = "images in both content parts and modal_prts";
+        return false;
+    }
+    if (!modal_prts.empty()) body["modal_prts"] = modal_prts;
+    if (!body.contains("tools")) body["tools"] = json::array();
+    body.erase("stream");
+    body.erase("model");
+    request_id = server.next_id.fetch_add(1);
+    body["id"] = "local-chatcmpl-" + std::to_string(request_id);
+    request_json = body.dump();
+    return true;
+}
+
+static json completion_chunk(const ServerContext& server, const std::string& id, const json& delta,
+                             const char* finish_reason) {
+    json choice = {{"index", 0}, {"delta", delta}, {"finish_reason", nullptr}};
+    if (finish_reason) choice["finish_reason"] = finish_reason;
+    return {{"id", id},
+            {"object", "chat.completion.chunk"},
+            {"created", (int64_t)time(nullptr)},
+            {"model", server.model_name},
+            {"choices", json::array({choice})}};
+}
+
+// Stage times and cache use of a stopped request that asked for them, null if the engine kept none
+static json request_timings(const ServerContext& server, int32_t request_id) {
+    const char* timings = nullptr;
+    if (llama_mico_get_timings(server.handle, request_id, &timings) != 0 || !timings) return nullptr;
+    json j = json::parse(timings, nullptr, false);
+    return j.is_discarded() ? json(nullptr) : j;
+}
+
+static void chat_completions(ServerContext& server, const httplib::Request& req, httplib::Response& res) {
+    json body = json::parse(req.body, nullptr, false /* allow_exceptions */);
+    if (!body.is_object()) return send_error(res, 400, "invalid json");
+    bool stream = body.value("stream", false);
+    bool timings = body.value("timings", false);
+    std::string request_json, err;
+    std::vector<int32_t> owned;
+    int32_t request_id = 0;
+    bool built = build_request(body, server, request_id, request_json, owned, err);
+    void* handle_stream = nullptr;
+    int32_t ret = built ? llama_mico_stream_open(server.handle, request_json.c_str(), 0, &handle_stream) : -1;
+    for (int32_t buffer_id : owned) llama_mico_release_buffer(server.handle, buffer_id);  // NOTE: kept until done
+    if (!built) return send_error(res, 400, err);
+    if (ret != 0) return send_error(res, 503, "failed to submit");
+    std::string id = "chatcmpl-" + std::to_string(request_id);
+
+    if (!stream) {
+        std::string text;
+        char buffer[SERVER_READ_BYTES];
+        int32_t n = 0, is_finished = 0;
+        while (!is_finished) {
+            ret = llama_mico_stream_read(handle_stream, buffer, sizeof(buffer), SERVER_READ_TIMEOUT_MS, &n,
+                                         &is_finished);
+            if (n > 0) text.append(buffer, n);
+            if (ret != 0) break;
+        }
+        llama_mico_stream_close(handle_stream);
+        if (ret != 0) return send_error(res, status_of(ret), text);
+        json choice = {{"index", 0},
+                       {"message", {{"role", "assistant"}, {"content", text}}},
+                       {"finish_reason", "stop"}};
+        json out = {{"id", id},
+                    {"object", "chat.completion"},
+                    {"created", (int64_t)time(nullptr)},
+                    {"model", server.model_name},
+                    {"choices", json::array({choice})}};
+        if (timings) out["timings"] = request_timings(server, request_id);
+        res.set_content(out.dump(), "application/json");
+        return;
+    }
+
+    // NOTE: the stream is closed by the release callback, a dropped connection stops the request there
+    std::string pending;  // text read up to an incomplete utf8 sequence
+    bool started = false;
+    res.set_chunked_content_provider(
+        "text/event-stream",
+        [&server, handle_stream, id, request_id, timings, pending, started](size_t, httplib::DataSink& sink) mutable {
+            auto send = [&sink](const json& event) {
+                std::string data = "data: " + event.dump() + "\n\n";
+                return sink.write(data.data(), data.size());
+            };
+            if (!started) {
+                started = true;
+                return send(completion_chunk(server, id, {{"role", "assistant"}, {"content", ""}}, nullptr));
+            }
+            char buffer[SERVER_READ_BYTES];
+            int32_t n = 0, is_finished = 0;
+            int32_t ret = llama_mico_stream_read(handle_stream, buffer, sizeof(buffer), SERVER_READ_TIMEOUT_MS, &n,
+                                                 &is_finished);
+            if (n > 0) pending.append(buffer, n);
+            if (ret != 0) {
+                json err = {{"error", {{"message", pending}, {"code", status_of(ret)}}}};
+                send(err);
+                sink.done();
+                return true;
+            }
+            size_t n_complete = is_finished ? pending.size() : utf8_complete(pending);
+            if (n_complete > 0) {
+                if (!send(completion_chunk(server, id, {{"content", pending.substr(0, n_complete)}}, nullptr)))
+                    return false;
+                pending.erase(0, n_complete);
+            }
+            if (!is_finished) return true;
+            json last = completion_chunk(server, id, json::object(), "stop");
+            if (timings) last["timings"] = request_timings(server, request_id);
+            send(last);
+            static const char done[] = "data: [DONE]\n\n";
+            sink.write(done, sizeof(done) - 1);
+            sink.done();
+            return true;
+        },
+        [handle_stream](bool) { llama_mico_stream_close(handle_stream); });
+}
+
+static void upload_frame(ServerContext& server, const httplib::Request& req, httplib::Response& res) {
+    std::string format = req.has_param("format") ? req.get_param_value("format") : "encoded";
+    int32_t modal_format = format == "rgb" ? LLAMA_MICO_MODAL_RGB : format == "nv12" ? LLAMA_MICO_MODAL_NV12
+                                                                                     : LLAMA_MICO_MODAL_ENCODED;
+    uint32_t nx = req.has_param("width") ? (uint32_t)atoi(req.get_param_value("width").c_str()) : 0;
+    uint32_t ny = req.has_param("height") ? (uint32_t)atoi(req.get_param_value("height").c_str()) : 0;
+    size_t expected = modal_format == LLAMA_MICO_MODAL_RGB    ? (size_t)nx * ny * 3
+                      : modal_format == LLAMA_MICO_MODAL_NV12 ? (size_t)nx * ny * 3 / 2
+                                                              : req.body.size();
+    if (req.body.empty() || req.body.size() != expected) return send_error(res, 400, "frame size mismatch");
+    uint8_t* data = nullptr;
+    int32_t buffer_id = -1;
+    if (llama_mico_register_buffer(server.handle, req.body.size(), modal_format, nx, ny, &data, &buffer_id) != 0)
+        return send_error(res, 500, "failed to register the frame");
+    memcpy(data, req.body.data(), req.body.size());
+    res.set_content(json({{"buffer", buffer_id}}).dump(), "application/json");
+}
+
+int main(int argc, char** argv) {
+    ServerParams params;
+    if (!parse_args(argc, argv, params)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    std::ifstream config_file(params.config_path);
+    if (!config_file) {
+        fprintf(stderr, "failed to open %s\n", params.config_path.c_str());
+        return 1;
+    }
+    std::stringstream config;
+    config << config_file.rdbuf();
+
+    ServerContext server;
+    server.model_name = params.model_name;
+    if (llama_mico_init(config.str().c_str(), &server.handle) != 0 || !server.handle) {
+        fprintf(stderr, "failed to init llama-mico\n");
+        return 1;
+    }
+
+    httplib::Server http;
+    if (params.n_threads > 0) {
+        int32_t n_threads = params.n_threads;
+        http.new_task_queue = [n_threads] { return new httplib::ThreadPool(n_threads); };
+    }
+    http.Post("/v1/chat/completions", [&server](const httplib::Request& req, httplib::Response& res) {
+        chat_completions(server, req, res);
+    });
+    http.Post("/v1/frames", [&server](const httplib::Request& req, httplib::Response& res) {
+        upload_frame(server, req, res);
+    });
+    http.Delete(R"(/v1/frames/(-?\d+))", [&server](const httplib::Request& req, httplib::Response& res) {
+        if (llama_mico_release_buffer(server.handle, atoi(req.matches[1].str().c_str())) != 0)
+            return send_error(res, 404, "unknown frame");
+        res.set_content("{}", "application/json");
+    });
+    http.Delete(R"(/v1/sessions/(.+))", [&server](const httplib::Request& req, httplib::Response& res) {
+        if (llama_mico_release_session(server.handle, req.matches[1].str().c_str()) != 0)
+            return send_error(res, 500, "failed to release the session");
+        res.set_content("{}", "application/json");
+    });
+    http.Get("/metrics", [&server](const httplib::Request&, httplib::Response& res) {
+        const char* metrics = nullptr;
+        if (llama_mico_get_metrics(server.handle, &metrics) != 0 || !metrics)
+            return send_error(res, 500, "failed to get metrics");
+        res.set_content(metrics, "application/json");
+    });
+    http.Get("/memory", [&server](const httplib::Request&, httplib::Response& res) {
+        const char* memory = nullptr;
+        if (llama_mico_get_memory(server.handle, &memory) != 0 || !memory)
+            return send_error(res, 500, "failed to get memory");
+        res.set_content(memory, "application/json");
+    });
+    http.Get("/health", [](const httplib::Request&, httplib::Response& res) {
+        res.set_content(R"({"status": "ok"})", "application/json");
+    });
+
+    fprintf(stderr, "listening on %s:%d\n", params.host.c_str(), params.port);
+    bool ok = http.listen(params.host, params.port);
+    if (!ok) fprintf(stderr, "failed to listen on %s:%d\n", params.host.c_str(), params.port);
+    llama_mico_free(server.handle);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,211 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+// Runs the synthetic camera workload of llama-mico-bench over a matrix of engine configs, image sizes and
+// concurrencies and reports the scaling curves as JSON, with where each curve saturates and what bounds it:
+//   llama-mico-sweep --config engine.json --sweep sweep.json --out sweep-report.json
+// sweep.json:
+//   {
+//     "engine": {"n_seq_max": [8, 16], "chunk_size": [256, 512], "cache_seq_num": [2, 5]},  // any config keys
+//     "image_sizes": ["224x224", "448x448"],
+//     "concurrency": [1, 2, 4, 8, 16],
+//     "requests": 4, "images": 1, "prompt_tokens": 256, "shared_prefix": 0.5, "output_tokens": 64
+//   }
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "llama-mico.h"
+#include "nlohmann/json.hpp"
+#include "tool-common.h"
+
+using json = nlohmann::ordered_json;
+
+#define SWEEP_GAIN_MIN 0.1        // a concurrency step adding less throughput than this saturates the curve
+#define SWEEP_BUSY_SATURATED 0.8  // a thread busy this part of the wall time is the bottleneck
+#define SWEEP_IDS_PER_POINT 100000
+
+static void print_usage(const char* argv0) {
+    fprintf(stderr, "usage: %s --config <engine.json> --sweep <sweep.json> [--out <file>]\n", argv0);
+}
+
+static bool read_json(const std::string& path, json& out) {
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "failed to read %s\n", path.c_str());
+        return false;
+    }
+    out = json::parse(file, nullptr, false);
+    if (out.is_discarded() || !out.is_object()) {
+        fprintf(stderr, "%s is not a JSON object\n", path.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Every combination of the values of grid, one object of key and value each
+static std::vector<json> grid_points(const json& grid) {
+    std::vector<json> points = {json::object()};
+    for (const auto& axis : grid.items()) {
+        std::vector<json> next;
+        const json values = axis.value().is_array() ? axis.value() : json::array({axis.value()});
+        for (const auto& point : points) {
+            for (const auto& value : values) {
+                json extended = point;
+                extended[axis.key()] = value;
+                next.push_back(std::move(extended));
+            }
+        }
+        points = std::move(next);
+    }
+    return points;
+}
+
+// Total milliseconds of a latency stage of the engine metrics
+static double stage_ms(const json& metrics, const char* stage) {
+    if (!metrics.contains("latency") || !metrics["latency"].contains(stage)) return 0.0;
+    const json& histogram = metrics["latency"][stage];
+    return histogram.value("count", 0.0) * histogram.value("mean_ms", 0.0);
+}
+
+static json engine_metrics(void* handle) {
+    const char* metrics = nullptr;
+    if (llama_mico_get_metrics(handle, &metrics) != 0 || !metrics) return json::object();
+    json j = json::parse(metrics, nullptr, false);
+    return j.is_discarded() ? json::object() : j;
+}
+
+// Busy part of the wall time of the encoder workers and of the decode thread, from the metrics before and after a
+// point. NOTE: the decode thread counts its image and token decode steps, text prefill steps are not timed apart
+static json utilization(const json& before, const json& after, double wall_ms, int32_t n_encoder_workers) {
+    double encode_ms = stage_ms(after, "encode") - stage_ms(before, "encode");
+    double decode_ms = stage_ms(after, "image_decode") - stage_ms(before, "image_decode") +
+                       stage_ms(after, "token_decode") - stage_ms(before, "token_decode");
+    double encoder = wall_ms > 0 ? encode_ms / (wall_ms * std::max(n_encoder_workers, 1)) : 0.0;
+    double decode = wall_ms > 0 ? decode_ms / wall_ms : 0.0;
+    const char* bottleneck = "none";
+    if (std::max(encoder, decode) >= SWEEP_BUSY_SATURATED) bottleneck = encoder >= decode ? "encoder" : "decode";
+    return {{"encoder", encoder}, {"decode", decode}, {"bottleneck", bottleneck}};
+}
+
+// Concurrency where more sessions stop adding throughput, the peak and what bounds the curve there
+static json saturation(const json& points) {
+    json summary;
+    double peak = 0.0;
+    size_t saturated = points.size() - 1;
+    for (size_t i = 0; i < points.size(); i++) {
+        double rate = points[i].value("tokens_per_s", 0.0);
+        if (i > 0 && rate < peak * (1.0 + SWEEP_GAIN_MIN)) {
+            saturated = i - 1;
+            break;
+        }
+        peak = std::max(peak, rate);
+    }
+    summary["saturated_at"] = points[saturated]["params"]["sessions"];
+    summary["peak_tokens_per_s"] = peak;
+    summary["ttft_p90_ms"] = points[saturated]["ttft_ms"].value("p90", 0.0);
+    summary["bottleneck"] = points[saturated]["utilization"]["bottleneck"];
+    return summary;
+}
+
+int main(int argc, char** argv) {
+    std::string config_path, sweep_path, out_path;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string arg = argv[i];
+        if (arg == "--config")
+            config_path = argv[i + 1];
+        else if (arg == "--sweep")
+            sweep_path = argv[i + 1];
+        else if (arg == "--out")
+            out_path = argv[i + 1];
+        else
+            fprintf(stderr, "unknown argument %s\n", arg.c_str());
+    }
+    json base, sweep;
+    if (config_path.empty() || sweep_path.empty()) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (!read_json(config_path, base) || !read_json(sweep_path, sweep)) return 1;
+
+    SyntheticWorkload workload;
+    workload.n_requests = std::max(1, sweep.value("requests", workload.n_requests));
+    workload.n_images = std::max(0, sweep.value("images", workload.n_images));
+    workload.prompt_tokens = std::max(1, sweep.value("prompt_tokens", workload.prompt_tokens));
+    workload.shared_prefix = std::min(std::max(sweep.value("shared_prefix", workload.shared_prefix), 0.0f), 1.0f);
+    workload.output_tokens = std::max(1, sweep.value("output_tokens", workload.output_tokens));
+    std::vector<std::string> image_sizes = sweep.value("image_sizes", std::vector<std::string>{"448x448"});
+    std::vector<int32_t> concurrency = sweep.value("concurrency", std::vector<int32_t>{1, 2, 4, 8});
+    std::sort(concurrency.begin(), concurrency.end());
+
+    json report;
+    report["sweep"] = sweep;
+    report["runs"] = json::array();
+    int32_t id_base = BENCH_REQUEST_ID_BASE;
+    for (const json& engine : grid_points(sweep.value("engine", json::object()))) {
+        json config = base;
+        config.update(engine);
+        json run;
+        run["engine"] = engine;
+        void* handle = nullptr;
+        if (llama_mico_init(config.dump().c_str(), &handle) != 0 || !handle) {
+            fprintf(stderr, "failed to init llama-mico with %s\n", engine.dump().c_str());
+            run["error"] = "init failed";
+            report["runs"].push_back(run);
+            continue;
+        }
+        const int32_t n_encoder_workers = config.value("encoder_workers", 1);
+
+        // NOTE: one request first, so the first point does not pay for graph builds and kernel compiles
+        SyntheticWorkload warmup = workload;
+        warmup.n_sessions = 1;
+        warmup.n_requests = 1;
+        run_synthetic_workload(handle, warmup, id_base);
+        id_base += SWEEP_IDS_PER_POINT;
+
+        run["curves"] = json::array();
+        for (const std::string& size : image_sizes) {
+            SyntheticWorkload point = workload;
+            if (sscanf(size.c_str(), "%ux%u", &point.image_nx, &point.image_ny) != 2) {
+                fprintf(stderr, "bad image size %s\n", size.c_str());
+                continue;
+            }
+            json points = json::array();
+            for (int32_t sessions : concurrency) {
+                point.n_sessions = std::max(1, sessions);
+                json before = engine_metrics(handle);
+                json result = run_synthetic_workload(handle, point, id_base);
+                id_base += SWEEP_IDS_PER_POINT;
+                result["utilization"] =
+                    utilization(before, engine_metrics(handle), result["wall_s"].get<double>() * 1000.0,
+                                n_encoder_workers);
+                fprintf(stderr, "%s %s x%d: %.1f tokens/s, ttft p90 %.0f ms, %s bound\n", engine.dump().c_str(),
+                        size.c_str(), point.n_sessions, result["tokens_per_s"].get<double>(),
+                        result["ttft_ms"].value("p90", 0.0),
+                        result["utilization"]["bottleneck"].get<std::string>().c_str());
+                points.push_back(std::move(result));
+            }
+            if (points.empty()) continue;
+            json curve = {{"image_size", size}, {"points", points}};
+            curve["saturation"] = saturation(points);
+            run["curves"].push_back(std::move(curve));
+        }
+        llama_mico_free(handle);
+        report["runs"].push_back(std::move(run));
+    }
+
+    std::string out = report.dump(2);
+    if (out_path.empty()) {
+        printf("%s\n", out.c_str());
+    } else {
+        std::ofstream out_file(out_path);
+        out_file << out << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,197 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef TOOL_COMMON_H
+#define TOOL_COMMON_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "llama-mico.h"
+#include "nlohmann/json.hpp"
+
+#define TOOL_IMAGE_MARKER "<__image__>"  // MICO_DEFAULT_IMAGE_MARKER
+#define BENCH_REQUEST_ID_BASE 100000     // above the ids of the python service
+
+static inline double now_ms() {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// count, mean, p50, p90, p99, max of latency samples
+static inline nlohmann::ordered_json latency_summary(std::vector<double> values) {
+    nlohmann::ordered_json j;
+    j["count"] = values.size();
+    if (values.empty()) return j;
+    std::sort(values.begin(), values.end());
+    double sum = 0;
+    for (double v : values) sum += v;
+    auto at = [&values](double q) { return values[std::min((size_t)(q * values.size()), values.size() - 1)]; };
+    j["mean"] = sum / values.size();
+    j["p50"] = at(0.5);
+    j["p90"] = at(0.9);
+    j["p99"] = at(0.99);
+    j["max"] = values.back();
+    return j;
+}
+
+static inline std::string random_words(std::mt19937& rng, int32_t n_words) {
+    static const char* WORDS[] = {"camera", "kitchen", "door",  "light", "person", "window", "table", "garden",
+                                  "motion", "evening", "cat",   "sofa",  "child",  "water",  "knock", "morning"};
+    std::uniform_int_distribution<size_t> pick(0, sizeof(WORDS) / sizeof(WORDS[0]) - 1);
+    std::string text;
+    for (int32_t i = 0; i < n_words; i++) {
+        if (i > 0) text += ' ';
+        text += WORDS[pick(rng)];
+    }
+    return text;
+}
+
+static inline std::vector<uint8_t> random_frame(std::mt19937& rng, uint32_t nx, uint32_t ny) {
+    std::vector<uint8_t> rgb((size_t)nx * ny * 3);
+    std::uniform_int_distribution<int> value(0, 255);
+    for (auto& byte : rgb) byte = (uint8_t)value(rng);
+    return rgb;
+}
+
+// Synthetic camera workload: concurrent sessions, each sending requests with random frames and a prompt of which a
+// part is a system message every session shares
+struct SyntheticWorkload {
+    int32_t n_sessions{4};
+    int32_t n_requests{4};  // per session
+    int32_t n_images{1};    // per request
+    uint32_t image_nx{448};
+    uint32_t image_ny{448};
+    int32_t prompt_tokens{256};  // approximate, one word per token
+    float shared_prefix{0.5f};   // part of the prompt every session shares as a cached system message
+    int32_t output_tokens{64};
+    int32_t priority{0};
+};
+
+struct RequestResult {
+    bool ok{false};
+    double ttft_ms{0};
+    std::vector<double> itl_ms;
+    int32_t n_tokens{0};
+};
+
+static inline RequestResult run_synthetic_request(void* handle, const SyntheticWorkload& workload,
+                                                  const std::string& system_prompt, int32_t id, int32_t session,
+                                                  int32_t request_index) {
+    RequestResult result;
+    std::mt19937 rng((uint32_t)(session * 7919 + request_index * 104729 + 1));
+    int32_t n_shared = (int32_t)(workload.prompt_tokens * workload.shared_prefix);
+    std::string user_prompt;
+    for (int32_t i = 0; i < workload.n_images; i++) user_prompt += TOOL_IMAGE_MARKER "\n";
+    user_prompt += random_words(rng, std::max(workload.prompt_tokens - n_shared, 1));
+
+    std::vector<std::vector<uint8_t>> frames;
+    std::vector<llama_mico_modal_buffer> modal_buffers;
+    for (int32_t i = 0; i < workload.n_images; i++)
+        frames.push_back(random_frame(rng, workload.image_nx, workload.image_ny));
+    for (const auto& frame : frames) {
+        modal_buffers.push_back(
+            {frame.data(), frame.size(), LLAMA_MICO_MODAL_RGB, workload.image_nx, workload.image_ny});
+    }
+
+    std::vector<llama_mico_message> messages;
+    if (!system_prompt.empty()) messages.push_back({"system", system_prompt.c_str()});
+    messages.push_back({"user", user_prompt.c_str()});
+
+    llama_mico_request request{};
+    request.id = id;
+    request.priority = workload.priority;
+    request.messages = messages.data();
+    request.n_messages = (int32_t)messages.size();
+    request.modal_buffers = modal_buffers.data();
+    request.n_modal_buffers = (int32_t)modal_buffers.size();
+    request.cache_prefix = system_prompt.empty() ? 0 : 1;
+
+    int32_t is_finished = 0;
+    const char* content = nullptr;
+    double t_start = now_ms();
+    if (llama_mico_request_prompt_struct(handle, &request, &is_finished, &content) != 0) {
+        fprintf(stderr, "request %d failed: %s\n", request.id, content ? content : "");
+        return result;
+    }
+    double t_last = now_ms();
+    result.ttft_ms = t_last - t_start;
+    result.n_tokens = 1;
+    result.ok = true;
+
+    // NOTE: one token per call, so every inter-token latency is measured
+    while (!is_finished && result.n_tokens < workload.output_tokens) {
+        if (llama_mico_request_generate_n(handle, request.id, 1, nullptr, 0, nullptr, nullptr, &is_finished,
+                                          &content) != 0)
+            break;
+        double t = now_ms();
+        result.itl_ms.push_back(t - t_last);
+        t_last = t;
+        result.n_tokens++;
+    }
+    if (!is_finished) {
+        request.stop = 1;
+        llama_mico_request_generate_struct(handle, &request, &is_finished, &content);
+    }
+    return result;
+}
+
+// Runs every session of workload on its own thread, request ids from id_base, and reports TTFT, ITL and throughput
+static inline nlohmann::ordered_json run_synthetic_workload(void* handle, const SyntheticWorkload& workload,
+                                                            int32_t id_base) {
+    std::mt19937 shared_rng(42);
+    int32_t n_shared = (int32_t)(workload.prompt_tokens * workload.shared_prefix);
+    std::string system_prompt = n_shared > 0 ? random_words(shared_rng, n_shared) : "";
+
+    std::mutex results_mutex;
+    std::vector<RequestResult> results;
+    double t_start = now_ms();
+    std::vector<std::thread> sessions;
+    for (int32_t s = 0; s < workload.n_sessions; s++) {
+        sessions.emplace_back([&, s]() {
+            for (int32_t r = 0; r < workload.n_requests; r++) {
+                int32_t id = id_base + s * workload.n_requests + r;
+                RequestResult result = run_synthetic_request(handle, workload, system_prompt, id, s, r);
+                std::lock_guard<std::mutex> lock(results_mutex);
+                results.push_back(std::move(result));
+            }
+        });
+    }
+    for (auto& session : sessions) session.join();
+    double wall_ms = now_ms() - t_start;
+
+    std::vector<double> ttft, itl;
+    int64_t n_tokens = 0, n_failed = 0;
+    for (const auto& result : results) {
+        if (!result.ok) {
+            n_failed++;
+            continue;
+        }
+        ttft.push_back(result.ttft_ms);
+        itl.insert(itl.end(), result.itl_ms.begin(), result.itl_ms.end());
+        n_tokens += result.n_tokens;
+    }
+
+    nlohmann::ordered_json report;
+    report["params"] = {{"sessions", workload.n_sessions},         {"requests", workload.n_requests},
+                        {"images", workload.n_images},             {"image_nx", workload.image_nx},
+                        {"image_ny", workload.image_ny},           {"prompt_tokens", workload.prompt_tokens},
+                        {"shared_prefix", workload.shared_prefix}, {"output_tokens", workload.output_tokens}};
+    report["requests"] = results.size();
+    report["failed"] = n_failed;
+    report["wall_s"] = wall_ms / 1000.0;
+    report["ttft_ms"] = latency_summary(ttft);
+    report["itl_ms"] = latency_summary(itl);
+    report["generated_tokens"] = n_tokens;
+    report["tokens_per_s"] = wall_ms > 0 ? n_tokens * 1000.0 / wall_ms : 0.0;
+    return report;
+}
+
+#endif  // TOOL_COMMON_H
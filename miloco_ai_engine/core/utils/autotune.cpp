@@ -0,0 +1,251 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "autotune.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include "common/log.h"
+#include "json-partial.h"
+#include "utils/model-registry.h"
+
+using json = nlohmann::ordered_json;
+
+struct AutotuneResult {
+    int32_t n_ubatch{0};
+    int32_t n_ctx{0};
+    int32_t n_parallel{0};
+    int32_t cache_seq{0};
+};
+
+// GPUs the model is placed on, all of them without model_devices
+static std::vector<ggml_backend_dev_t> model_gpus(const common_params& params) {
+    std::vector<ggml_backend_dev_t> gpus;
+    for (ggml_backend_dev_t dev : params.devices) {
+        if (dev && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU) gpus.push_back(dev);
+    }
+    if (!params.devices.empty() || params.n_gpu_layers == 0) return gpus;
+    for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+        ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+        if (ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_GPU) gpus.push_back(dev);
+    }
+    return gpus;
+}
+
+static size_t free_memory(const std::vector<ggml_backend_dev_t>& gpus) {
+    size_t sum = 0;
+    for (ggml_backend_dev_t dev : gpus) {
+        size_t free = 0, total = 0;
+        ggml_backend_dev_memory(dev, &free, &total);
+        sum += free;
+    }
+    return sum;
+}
+
+// Model file, devices and the options the calibration depends on
+static std::string autotune_key(const common_params& params, const std::vector<ggml_backend_dev_t>& gpus) {
+    std::ostringstream key;
+    key << std::hex << weights_file_key(params.model.path) << std::dec << "|" << params.n_gpu_layers << "|"
+        << (int)params.split_mode << "|" << params.cache_type_k << "," << params.cache_type_v << ","
+        << params.flash_attn << "|" << params.autotune_latency_ms << "|" << params.n_ctx << ","
+        << params.n_usage_context << "," << params.n_ubatch << "|";
+    for (ggml_backend_dev_t dev : gpus) {
+        size_t free = 0, total = 0;
+        ggml_backend_dev_memory(dev, &free, &total);
+        key << ggml_backend_dev_description(dev) << "/" << (total >> 20) << ",";
+    }
+    return key.str();
+}
+
+static json read_cache(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) return json::object();
+    json cache = json::parse(file, nullptr, false);
+    return cache.is_object() ? cache : json::object();
+}
+
+// NOTE: write then rename, another process starting on the same model never reads a partial file
+static void write_cache(const std::string& path, const json& cache) {
+    const std::string tmp = path + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::trunc);
+        if (!(file << cache.dump(2))) {
+            LOG_WRN("%s: cannot write %s\n", __func__, tmp.c_str());
+            std::remove(tmp.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmp.c_str(), path.c_str()) != 0) LOG_WRN("%s: cannot write %s\n", __func__, path.c_str());
+}
+
+static llama_context* calibration_context(llama_model* model, const common_params& params, uint32_t n_ctx,
+                                          uint32_t n_batch, uint32_t n_seq) {
+    llama_context_params cparams = common_context_params_to_llama(params);
+    cparams.n_ctx = n_ctx;
+    cparams.n_batch = n_batch;
+    cparams.n_ubatch = n_batch;
+    cparams.n_seq_max = n_seq;
+    cparams.no_perf = true;
+    return llama_init_from_model(model, cparams);
+}
+
+// Decodes n_tokens on each of seqs [seq, seq + n_seqs) from pos in one batch
+static bool decode_tokens(llama_context* lctx, llama_token token, int32_t seq, int32_t n_seqs, int32_t pos,
+                          int32_t n_tokens) {
+    llama_batch batch = llama_batch_init(n_seqs * n_tokens, 0, 1);
+    for (int32_t s = seq; s < seq + n_seqs; s++) {
+        for (int32_t i = 0; i < n_tokens; i++) common_batch_add(batch, token, pos + i, {s}, i == n_tokens - 1);
+    }
+    bool ok = llama_decode(lctx, batch) == 0;
+    llama_synchronize(lctx);
+    llama_batch_free(batch);
+    return ok;
+}
+
+// Device bytes per kv cell from two contexts apart by AUTOTUNE_KV_PROBE cells, and the bytes the smaller one takes
+// besides its kv (compute buffers), 0 if the memory is not on a GPU
+static size_t measure_kv_bytes(llama_model* model, const common_params& params,
+                               const std::vector<ggml_backend_dev_t>& gpus, size_t& fixed_bytes) {
+    fixed_bytes = 0;
+    if (gpus.empty()) return 0;
+    size_t used[2] = {0, 0};
+    for (int i = 0; i < 2; i++) {
+        size_t before = free_memory(gpus);
+        llama_context* lctx = calibration_context(model, params, AUTOTUNE_KV_BASE + i * AUTOTUNE_KV_PROBE,
+                                                  AUTOTUNE_UBATCH_MIN, 1);
+        if (!lctx) return 0;
+        size_t after = free_memory(gpus);
+        used[i] = before > after ? before - after : 0;
+        llama_free(lctx);
+    }
+    if (used[1] <= used[0]) return 0;
+    size_t kv_bytes = (used[1] - used[0]) / AUTOTUNE_KV_PROBE;
+    fixed_bytes = used[0] > kv_bytes * AUTOTUNE_KV_BASE ? used[0] - kv_bytes * AUTOTUNE_KV_BASE : 0;
+    return kv_bytes;
+}
+
+static AutotuneResult calibrate(llama_model* model, const common_params& params,
+                                const std::vector<ggml_backend_dev_t>& gpus) {
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    const llama_token token = llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL ? llama_vocab_bos(vocab) : 0;
+    const int64_t latency_us = (int64_t)std::max(params.autotune_latency_ms, 1) * 1000;
+    const int32_t n_ctx = params.n_ctx > 0 ? params.n_ctx : (int32_t)llama_model_n_ctx_train(model);
+    AutotuneResult result;
+    result.n_ctx = n_ctx;
+
+    size_t free_before = free_memory(gpus);
+    size_t fixed_bytes = 0;
+    size_t kv_bytes = measure_kv_bytes(model, params, gpus, fixed_bytes);
+    if (kv_bytes > 0) {
+        size_t budget = (size_t)(free_before * AUTOTUNE_MEMORY_HEADROOM);
+        int64_t cells = budget > fixed_bytes ? (int64_t)((budget - fixed_bytes) / kv_bytes) : 0;
+        result.n_ctx = (int32_t)std::max<int64_t>(std::min<int64_t>(cells / 256 * 256, n_ctx), AUTOTUNE_KV_BASE);
+        LOG_INF("%s: %.1f KiB kv per token, %.1f MiB besides, %" PRId64 " cells fit\n", __func__, kv_bytes / 1024.0,
+                fixed_bytes / 1048576.0, cells);
+    }
+
+    // Prefill, the fastest chunk per token whose ubatch stalls decode no longer than the target. NOTE: the image
+    // tokens of a vision model must fit one ubatch, its configured n_ubatch is the floor
+    const int32_t ubatch_min = params.mmproj.path.empty() ? AUTOTUNE_UBATCH_MIN : std::max(params.n_ubatch, 1);
+    double best_rate = 0.0;
+    for (int32_t ubatch = AUTOTUNE_UBATCH_MIN; ubatch <= std::min(AUTOTUNE_UBATCH_MAX, result.n_ctx / 2);
+         ubatch *= 2) {
+        if (ubatch < ubatch_min) continue;
+        llama_context* lctx = calibration_context(model, params, 2 * ubatch, ubatch, 1);
+        if (!lctx) break;
+        bool ok = decode_tokens(lctx, token, 0, 1, 0, ubatch);  // NOTE: the first grows buffers and JITs kernels
+        int64_t t_start = ggml_time_us();
+        ok = ok && decode_tokens(lctx, token, 0, 1, ubatch, ubatch);
+        int64_t elapsed_us = std::max<int64_t>(ggml_time_us() - t_start, 1);
+        llama_free(lctx);
+        if (!ok) break;
+        double rate = ubatch * 1e6 / elapsed_us;
+        LOG_INF("%s: prefill ubatch %d in %.1f ms, %.0f tokens/s\n", __func__, ubatch, elapsed_us / 1000.0, rate);
+        if (result.n_ubatch == 0) result.n_ubatch = ubatch;  // NOTE: the smallest if none fits the target
+        if (elapsed_us <= latency_us && rate > best_rate) {
+            result.n_ubatch = ubatch;
+            best_rate = rate;
+        }
+    }
+    if (result.n_ubatch == 0) result.n_ubatch = std::max(ubatch_min, params.n_ubatch);
+
+    // Decode, the batch of most tokens per second whose step stays within the target
+    const int32_t parallel_max = AUTOTUNE_PARALLEL_MAX;
+    llama_context* lctx = calibration_context(model, params,
+                                              parallel_max * (AUTOTUNE_DECODE_HISTORY + AUTOTUNE_DECODE_STEPS + 1),
+                                              std::max(AUTOTUNE_DECODE_HISTORY, parallel_max), parallel_max);
+    result.n_parallel = 1;
+    best_rate = 0.0;
+    bool ok = lctx != nullptr;
+    for (int32_t s = 0; ok && s < parallel_max; s++) ok = decode_tokens(lctx, token, s, 1, 0, AUTOTUNE_DECODE_HISTORY);
+    for (int32_t parallel = 1; ok && parallel <= parallel_max; parallel *= 2) {
+        ok = decode_tokens(lctx, token, 0, parallel, AUTOTUNE_DECODE_HISTORY, 1);
+        int64_t t_start = ggml_time_us();
+        for (int32_t step = 1; ok && step <= AUTOTUNE_DECODE_STEPS; step++)
+            ok = decode_tokens(lctx, token, 0, parallel, AUTOTUNE_DECODE_HISTORY + step, 1);
+        int64_t step_us = std::max<int64_t>((ggml_time_us() - t_start) / AUTOTUNE_DECODE_STEPS, 1);
+        for (int32_t s = 0; s < parallel; s++)
+            llama_memory_seq_rm(llama_get_memory(lctx), s, AUTOTUNE_DECODE_HISTORY, -1);
+        if (!ok) break;
+        double rate = parallel * 1e6 / step_us;
+        LOG_INF("%s: decode %d sequences in %.1f ms a step, %.0f tokens/s\n", __func__, parallel, step_us / 1000.0,
+                rate);
+        if (step_us <= latency_us && rate > best_rate) {
+            result.n_parallel = parallel;
+            best_rate = rate;
+        }
+    }
+    if (lctx) llama_free(lctx);
+
+    // NOTE: each cache sequence claims one context_per_seq share, the decode batch keeps its guaranteed shares
+    const int32_t n_shares = result.n_ctx / std::max(params.n_usage_context, 1);
+    result.cache_seq = std::max(n_shares - result.n_parallel, 0);
+    return result;
+}
+
+static void apply(common_params& params, const AutotuneResult& result) {
+    params.n_ubatch = result.n_ubatch;
+    params.n_batch = result.n_ubatch;
+    params.n_ctx = result.n_ctx;
+    params.cache_seq = (size_t)result.cache_seq;
+    params.n_seq_max = result.n_parallel + result.cache_seq + (params.image_kv_entries > 0 ? 1 : 0);
+    LOG_INF("autotune: chunk_size %d, total_context_num %d, n_seq_max %d, cache_seq_num %d\n", result.n_ubatch,
+            result.n_ctx, params.n_seq_max, result.cache_seq);
+}
+
+bool autotune_params(common_params& params) {
+    std::shared_ptr<SharedModel> shared = acquire_shared_model(params);  // NOTE: the context acquires it again
+    if (!shared) return false;
+    std::vector<ggml_backend_dev_t> gpus = model_gpus(params);
+    const std::string path = params.model.path + ".autotune";
+    const std::string key = autotune_key(params, gpus);
+    json cache = read_cache(path);
+    if (cache.contains(key)) {
+        const json& entry = cache[key];
+        AutotuneResult result;
+        result.n_ubatch = entry.value("chunk_size", params.n_ubatch);
+        result.n_ctx = entry.value("total_context_num", params.n_ctx);
+        result.n_parallel = entry.value("parallel_seq_num", 1);
+        result.cache_seq = entry.value("cache_seq_num", 0);
+        LOG_INF("%s: calibration of %s\n", __func__, path.c_str());
+        apply(params, result);
+        return true;
+    }
+
+    int64_t t_start = ggml_time_ms();
+    AutotuneResult result = calibrate(shared->model.get(), params, gpus);
+    LOG_INF("%s: calibrated in %" PRId64 " ms\n", __func__, ggml_time_ms() - t_start);
+    apply(params, result);
+    cache[key] = {{"chunk_size", result.n_ubatch},
+                  {"total_context_num", result.n_ctx},
+                  {"parallel_seq_num", result.n_parallel},
+                  {"cache_seq_num", result.cache_seq}};
+    write_cache(path, cache);
+    return true;
+}
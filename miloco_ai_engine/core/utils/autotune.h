@@ -0,0 +1,28 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "common/common.h"
+
+#define AUTOTUNE_UBATCH_MIN 64        // smallest prefill chunk timed
+#define AUTOTUNE_UBATCH_MAX 2048      // largest prefill chunk timed
+#define AUTOTUNE_PARALLEL_MAX 32      // most sequences decoded together
+#define AUTOTUNE_DECODE_HISTORY 128   // tokens each timed decode sequence attends
+#define AUTOTUNE_DECODE_STEPS 4       // decode steps timed per batch size
+#define AUTOTUNE_KV_BASE 1024         // cells of the smaller kv probe context
+#define AUTOTUNE_KV_PROBE 4096        // cells more in the larger one, their memory difference is the kv per token
+#define AUTOTUNE_MEMORY_HEADROOM 0.9  // fraction of the free device memory the kv may take
+
+// Startup calibration of chunk_size (n_batch, n_ubatch), n_seq_max and cache_seq on the actual devices instead of
+// the static VRAM tables of config_optimizer.py. Prefill is timed at several ubatch sizes and decode at several batch
+// sizes, the kv bytes per token are measured from the device memory two contexts take. The chunk and the decode
+// batch of most tokens per second within autotune_latency_ms are chosen, n_ctx shrinks to the kv that fits and the
+// context_per_seq shares left over after the decode batch become prompt cache sequences.
+// The result is kept in <model>.autotune per model file, devices and options, so later starts skip the calibration.
+// Returns false if the model failed to load, params are left as configured then
+bool autotune_params(common_params& params);
+
+#endif  // AUTOTUNE_H
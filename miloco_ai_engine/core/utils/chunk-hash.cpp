@@ -5,54 +5,149 @@
 
 #include "chunk-hash.h"
 
-#include <sstream>
-#include <vector>
-
-uint64_t simple_hash(const std::string& str) {
-    uint64_t hash = 0x811c9dc5;
-    for (char c : str) {
-        hash ^= static_cast<uint64_t>(c);
-        hash *= 0x01000193;
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t fmix64(uint64_t k) {  // murmur3 finalizer
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+HashKey hash_bytes(const void* data, size_t n_bytes) {
+    HashKey key;
+    mtmd_hash_bytes(data, n_bytes, &key.hi, &key.lo);
+    return key;
+}
+
+static bool parse_hex64(const char* hex, uint64_t& value) {
+    value = 0;
+    for (int i = 0; i < 16; i++) {
+        char c = hex[i];
+        int digit = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+        if (digit < 0) return false;
+        value = (value << 4) | digit;
     }
-    return hash;
+    return true;
 }
 
-std::string hash_to_hex(uint64_t hash) {
-    std::stringstream ss;
-    ss << std::hex << std::setfill('0') << std::setw(16) << hash;
-    return ss.str();
+HashKey modal_chunk_key(const mtmd_input_chunk* chunk) {
+    HashKey key;
+    if (!chunk || mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) return key;
+
+    const char* id = mtmd_input_chunk_get_id(chunk);
+    if (!id || id[0] == '\0') return key;
+
+    size_t len = std::strlen(id);
+    if (len == 32 && parse_hex64(id, key.hi) && parse_hex64(id + 16, key.lo) && !key.empty()) return key;
+    return hash_bytes(id, len);  // id set by the caller
 }
 
-std::string get_chunk_description(const mtmd_input_chunk* chunk) {
-    std::stringstream ss;
-    if (chunk == nullptr) return "";
+uint64_t image_dhash(const unsigned char* rgb, uint32_t nx, uint32_t ny) {
+    if (!rgb || nx == 0 || ny == 0) return 0;
 
-    if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
-        size_t n_tokens;
-        const llama_token* tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);
-        if (tokens && n_tokens > 0) {
-            for (size_t j = 0; j < n_tokens; ++j) {
-                ss << tokens[j] << ",";
+    // 9x8 luma grid, each cell averaged over at most 4x4 samples, NOTE: a few hundred reads per frame
+    float luma[8][9];
+    for (int gy = 0; gy < 8; gy++) {
+        for (int gx = 0; gx < 9; gx++) {
+            uint32_t x0 = gx * nx / 9, x1 = std::max(x0 + 1, (gx + 1) * nx / 9);
+            uint32_t y0 = gy * ny / 8, y1 = std::max(y0 + 1, (gy + 1) * ny / 8);
+            uint32_t sx = std::max(1u, (x1 - x0) / 4), sy = std::max(1u, (y1 - y0) / 4);
+            float sum = 0.0f;
+            int n = 0;
+            for (uint32_t y = y0; y < y1 && y < ny; y += sy) {
+                for (uint32_t x = x0; x < x1 && x < nx; x += sx) {
+                    const unsigned char* p = rgb + 3 * ((size_t)y * nx + x);
+                    sum += 0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2];
+                    n++;
+                }
             }
-        }
-    } else if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_IMAGE) {
-        // For images, we use the image ID as part of the hash
-        const mtmd_image_tokens* image_tokens = mtmd_input_chunk_get_tokens_image(chunk);
-        if (image_tokens) {
-            const char* id = mtmd_image_tokens_get_id(image_tokens);
-            ss << "IMG:" << id << ",";
+            luma[gy][gx] = n > 0 ? sum / n : 0.0f;
         }
     }
-    return ss.str();
+
+    uint64_t hash = 0;
+    for (int gy = 0; gy < 8; gy++)
+        for (int gx = 0; gx < 8; gx++) hash = (hash << 1) | (luma[gy][gx] > luma[gy][gx + 1] ? 1 : 0);
+    return hash;
+}
+
+std::string hash_to_hex(const HashKey& key) {
+    char buf[33];
+    std::snprintf(buf, sizeof(buf), "%016" PRIx64 "%016" PRIx64, key.hi, key.lo);
+    return buf;
+}
+
+size_t chunk_n_items(const mtmd_input_chunk* chunk) {
+    if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) return mtmd_input_chunk_get_n_tokens(chunk);
+    return 1;
 }
 
-std::vector<std::string> chunk_hashs(mtmd::input_chunks* input_chunks) {
-    std::vector<std::string> hashes;
-    std::string prompt_string = "";
+int64_t modal_item_key(const mtmd_input_chunk* chunk) {
+    int32_t n_pos = (int32_t)mtmd_input_chunk_get_n_pos(chunk);
+    HashKey key = modal_chunk_key(chunk);
+    uint64_t hash = fmix64(key.lo ^ rotl64(key.hi, 17) ^ ((uint64_t)n_pos * 0x9e3779b97f4a7c15ULL));
+    return -(int64_t)(hash >> 1) - 1;  // NOTE: negative, never equal to a token id
+}
+
+std::vector<PrefixItem> prefix_items(mtmd::input_chunks* input_chunks) {
+    size_t n_items = 0;
+    for (size_t i = 0; i < input_chunks->size(); ++i) n_items += chunk_n_items((*input_chunks)[i]);
+    std::vector<PrefixItem> items;
+    items.reserve(n_items);
     for (size_t i = 0; i < input_chunks->size(); ++i) {
         const mtmd_input_chunk* chunk = (*input_chunks)[i];
-        prompt_string += get_chunk_description(chunk);
-        hashes.push_back(hash_to_hex(simple_hash(prompt_string)));
+        if (mtmd_input_chunk_get_type(chunk) == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            size_t n_tokens;
+            const llama_token* tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);
+            for (size_t j = 0; j < n_tokens; ++j) items.push_back({(int64_t)tokens[j], 1});  // NOTE: token is the key
+        } else {
+            items.push_back({modal_item_key(chunk), (int32_t)mtmd_input_chunk_get_n_pos(chunk)});
+        }
+    }
+    return items;
+}
+
+int32_t prefix_n_pos(const std::vector<PrefixItem>& items, size_t n_items) {
+    int32_t n_pos = 0;
+    for (size_t i = 0; i < n_items && i < items.size(); i++) n_pos += items[i].n_pos;
+    return n_pos;
+}
+
+std::vector<uint64_t> prefix_digest(const std::vector<PrefixItem>& items) {
+    std::vector<uint64_t> hashes;
+    uint64_t h = PREFIX_DIGEST_BLOCK;
+    for (size_t i = 0; i < items.size() && items[i].key >= 0; i++) {
+        h = fmix64(h * 0x9e3779b97f4a7c15ULL ^ (uint64_t)items[i].key);
+        if ((i + 1) % PREFIX_DIGEST_BLOCK == 0) hashes.push_back(h);
     }
     return hashes;
-}
\ No newline at end of file
+}
+
+std::vector<uint64_t> prefix_digest(const std::vector<int32_t>& tokens) {
+    std::vector<PrefixItem> items;
+    items.reserve(tokens.size());
+    for (int32_t token : tokens) items.push_back({(int64_t)token, 1});
+    return prefix_digest(items);
+}
+
+std::vector<uint8_t> digest_bloom(const std::vector<uint64_t>& hashes, size_t& n_bits) {
+    n_bits = 1024;
+    while (n_bits < hashes.size() * 10) n_bits *= 2;
+    std::vector<uint8_t> bits(n_bits / 8, 0);
+    for (uint64_t h : hashes) {
+        uint64_t step = fmix64(h) | 1;
+        for (uint64_t j = 0; j < PREFIX_BLOOM_HASHES; j++) {
+            uint64_t bit = (h + j * step) & (n_bits - 1);
+            bits[bit / 8] |= (uint8_t)(1u << (bit % 8));
+        }
+    }
+    return bits;
+}
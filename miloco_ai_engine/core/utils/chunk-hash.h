@@ -5,21 +5,66 @@
 #ifndef CHUNK_HASH_H
 #define CHUNK_HASH_H
 
+#include <cstddef>
 #include <cstdint>
-#include <iomanip>
-#include <ios>
 #include <string>
+#include <vector>
 
 #include "mutil-modal/mtmd.h"
 
-// Simple hash function for strings
-uint64_t simple_hash(const std::string& str);
+// 128 bit content hash, POD so it keys the caches without allocations
+struct HashKey {
+    uint64_t hi{0};
+    uint64_t lo{0};
 
-// Convert hash to hex string
-std::string hash_to_hex(uint64_t hash);
+    bool empty() const { return hi == 0 && lo == 0; }
+    bool operator==(const HashKey& other) const { return hi == other.hi && lo == other.lo; }
+    bool operator!=(const HashKey& other) const { return !(*this == other); }
+};
 
-std::string get_chunk_description(const mtmd_input_chunk* chunk);
+struct HashKeyHasher {
+    size_t operator()(const HashKey& key) const { return (size_t)(key.lo ^ (key.hi * 0x9e3779b97f4a7c15ULL)); }
+};
 
-std::vector<std::string> chunk_hashs(mtmd::input_chunks* input_chunks);
+HashKey hash_bytes(const void* data, size_t n_bytes);
+
+// Key of an image or audio chunk from its mtmd id (32 hex digits of the content hash, "<id>/<k>" the hash of the
+// whole id for slice k of an image), empty for text
+HashKey modal_chunk_key(const mtmd_input_chunk* chunk);
+
+// 64 bit difference hash of a packed RGB image, frames differing only by compression noise differ in few bits
+uint64_t image_dhash(const unsigned char* rgb, uint32_t nx, uint32_t ny);
+
+// Hex string of a key, only for logs
+std::string hash_to_hex(const HashKey& key);
+
+// One kv cache unit of a prompt: a text token, or a whole image or audio chunk (they can not be split)
+struct PrefixItem {
+    int64_t key;    // text token id, negative hash for images
+    int32_t n_pos;  // kv positions covered
+};
+
+// Number of prefix items of a chunk: tokens for text, 1 for image and audio
+size_t chunk_n_items(const mtmd_input_chunk* chunk);
+
+// Prefix item key of an image or audio chunk, from its content hash and kv positions
+int64_t modal_item_key(const mtmd_input_chunk* chunk);
+
+std::vector<PrefixItem> prefix_items(mtmd::input_chunks* input_chunks);
+
+// Kv positions of items[0, n_items)
+int32_t prefix_n_pos(const std::vector<PrefixItem>& items, size_t n_items);
+
+#define PREFIX_DIGEST_BLOCK 64  // text tokens per digest block
+#define PREFIX_BLOOM_HASHES 4   // bits set per block hash in a digest bloom filter
+
+// Chained hashes of the leading text tokens, one per whole block of PREFIX_DIGEST_BLOCK: two prompts share block b
+// iff they share its hash. Stops at the first image or audio item, a router can not key its kv from the request
+std::vector<uint64_t> prefix_digest(const std::vector<PrefixItem>& items);
+std::vector<uint64_t> prefix_digest(const std::vector<int32_t>& tokens);
+
+// Bloom filter of block hashes, n_bits a power of two of at least 10 bits per hash. Bit j of hash h is
+// (h + j * (fmix64(h) | 1)) mod n_bits, j < PREFIX_BLOOM_HASHES, bytes little endian bit order
+std::vector<uint8_t> digest_bloom(const std::vector<uint64_t>& hashes, size_t& n_bits);
 
 #endif  // CHUNK_HASH_H
\ No newline at end of file
@@ -0,0 +1,114 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "frame-ring.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cinttypes>
+#include <cstring>
+
+#include "common/log.h"
+
+struct FrameSlotHeader {
+    uint64_t version;
+    uint64_t seq;
+    uint32_t format;
+    uint32_t nx;
+    uint32_t ny;
+    uint32_t reserved;
+    uint64_t size;
+    uint64_t timestamp;
+};
+static_assert(sizeof(FrameSlotHeader) <= FRAME_RING_SLOT_HEADER_BYTES, "frame slot header");
+
+static uint64_t load_acquire(const uint8_t* addr) {
+    return reinterpret_cast<const std::atomic<uint64_t>*>(addr)->load(std::memory_order_acquire);
+}
+
+FrameRings::~FrameRings() {
+    for (auto& [camera, ring] : rings_) munmap(ring.base, ring.n_bytes);
+}
+
+const FrameRings::Ring* FrameRings::open(const std::string& camera) {
+    auto it = rings_.find(camera);
+    if (it != rings_.end()) return &it->second;
+    if (camera.empty() || camera.find('/') != std::string::npos) return nullptr;
+
+    std::string name = FRAME_RING_SHM_PREFIX + camera;
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0) {
+        LOG_ERR("%s: no frame ring %s\n", __func__, name.c_str());
+        return nullptr;
+    }
+    struct stat st;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= FRAME_RING_HEADER_BYTES)
+        base = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED) {
+        LOG_ERR("%s: failed to map frame ring %s\n", __func__, name.c_str());
+        return nullptr;
+    }
+
+    Ring ring;
+    ring.base = static_cast<uint8_t*>(base);
+    ring.n_bytes = (size_t)st.st_size;
+    std::memcpy(&ring.n_slots, ring.base + 8, sizeof(ring.n_slots));
+    std::memcpy(&ring.slot_bytes, ring.base + 16, sizeof(ring.slot_bytes));
+    size_t need = FRAME_RING_HEADER_BYTES + (size_t)ring.n_slots * (FRAME_RING_SLOT_HEADER_BYTES + ring.slot_bytes);
+    if (std::memcmp(ring.base, FRAME_RING_MAGIC, 8) != 0 || ring.n_slots == 0 || need > ring.n_bytes) {
+        LOG_ERR("%s: invalid frame ring %s\n", __func__, name.c_str());
+        munmap(base, ring.n_bytes);
+        return nullptr;
+    }
+    LOG_INF("%s: frame ring %s, %u slots of %" PRIu64 " bytes\n", __func__, name.c_str(), ring.n_slots,
+            ring.slot_bytes);
+    return &rings_.emplace(camera, ring).first->second;
+}
+
+void FrameRings::close(const std::string& camera) {
+    auto it = rings_.find(camera);
+    if (it == rings_.end()) return;
+    munmap(it->second.base, it->second.n_bytes);
+    rings_.erase(it);
+}
+
+// NOTE: a request only refers to frames written before, a slot written meanwhile is taken by a later frame
+bool FrameRings::copy_frame(const Ring& ring, uint64_t seq, ModalBufferPool& pool,
+                            ModalBufferPool::BufferRef& frame) {
+    const uint8_t* slot = ring.base + FRAME_RING_HEADER_BYTES +
+                          (size_t)(seq % ring.n_slots) * (FRAME_RING_SLOT_HEADER_BYTES + ring.slot_bytes);
+    uint64_t version = load_acquire(slot);
+    if (version & 1) return false;
+    FrameSlotHeader header;
+    std::memcpy(&header, slot, sizeof(header));
+    if (header.seq != seq || header.size == 0 || header.size > ring.slot_bytes) return false;
+    frame = pool.allocate(header.size, header.format, header.nx, header.ny);
+    if (!frame) return false;
+    std::memcpy(frame->data, slot + FRAME_RING_SLOT_HEADER_BYTES, header.size);
+    std::atomic_thread_fence(std::memory_order_acquire);  // NOTE: the copy is done before the version is checked
+    if (load_acquire(slot) == version) return true;
+    frame.reset();
+    return false;
+}
+
+ModalBufferPool::BufferRef FrameRings::read(const std::string& camera, uint64_t seq, ModalBufferPool& pool) {
+    ModalBufferPool::BufferRef frame;
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Ring* ring = open(camera);
+    if (ring && copy_frame(*ring, seq, pool, frame)) return frame;
+    if (ring && seq >= load_acquire(ring->base + 24)) {  // NOTE: not written yet, the writer may have recreated it
+        close(camera);
+        ring = open(camera);
+        if (ring && copy_frame(*ring, seq, pool, frame)) return frame;
+    }
+    LOG_ERR("%s: frame %" PRIu64 " of camera %s is not in its ring\n", __func__, seq, camera.c_str());
+    return nullptr;
+}
@@ -0,0 +1,54 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "utils/modal-buffer-pool.h"
+
+// Decoded camera frames shared by the ingest process in POSIX shared memory "/miloco-frames-<camera>", one ring per
+// camera channel, see miloco_server/utils/frame_ring.py for the writer. Little endian layout:
+//   header  FRAME_RING_HEADER_BYTES: magic[8], n_slots u32, reserved u32, slot_bytes u64, head u64 (next seq)
+//   slot i  FRAME_RING_HEADER_BYTES + i * (FRAME_RING_SLOT_HEADER_BYTES + slot_bytes), frame seq is in slot
+//           seq % n_slots: version u64 (odd while written), seq u64, format u32, nx u32, ny u32, reserved u32,
+//           size u64, timestamp u64, then slot_bytes of frame
+#define FRAME_RING_MAGIC "MICOFRM1"
+#define FRAME_RING_SHM_PREFIX "/miloco-frames-"
+#define FRAME_RING_HEADER_BYTES 64
+#define FRAME_RING_SLOT_HEADER_BYTES 64
+
+// Reader side of the frame rings, requests refer to frames by (camera, seq) and a frame is copied out of the ring
+// when its request is parsed, so the writer may overwrite the slot right after
+class FrameRings {
+  public:
+    ~FrameRings();
+
+    // Frame seq of the ring of camera in a pool buffer, nullptr if the ring does not hold it (any more)
+    ModalBufferPool::BufferRef read(const std::string& camera, uint64_t seq, ModalBufferPool& pool);
+
+  private:
+    struct Ring {
+        uint8_t* base{nullptr};
+        size_t n_bytes{0};
+        uint32_t n_slots{0};
+        uint64_t slot_bytes{0};
+    };
+
+    // Maps the ring of camera, NOTE: mutex_ must be held
+    const Ring* open(const std::string& camera);
+    void close(const std::string& camera);  // NOTE: mutex_ must be held
+    // Copies a frame under the slot version, false if it is overwritten meanwhile or holds another seq
+    static bool copy_frame(const Ring& ring, uint64_t seq, ModalBufferPool& pool, ModalBufferPool::BufferRef& frame);
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, Ring> rings_;  // NOTE: mapped until the engine is freed or a ring is recreated
+};
+
+#endif  // FRAME_RING_H
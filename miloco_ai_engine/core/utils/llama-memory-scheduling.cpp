@@ -5,9 +5,19 @@
 
 #include "llama-memory-scheduling.h"
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <limits>
 
-LlamaMemoryScheduler::LlamaMemoryScheduler(const llama_context* ctx) : thread_(nullptr) {
+#include "mico-trace.h"
+
+LlamaMemoryScheduler::LlamaMemoryScheduler(llama_context* ctx, float defrag_thold, int32_t defrag_idle_ms)
+    : ctx_(ctx),
+      defrag_thold_(defrag_thold),
+      defrag_idle_ms_(std::max(defrag_idle_ms, 1)),
+      ring_(MEMORY_RING_CAPACITY),
+      thread_(nullptr) {
     memory_ = llama_get_memory(ctx);
     thread_ = new std::thread(&LlamaMemoryScheduler::process, this);
 }
@@ -22,57 +32,197 @@ LlamaMemoryScheduler::~LlamaMemoryScheduler() {
     }
 }
 
-void LlamaMemoryScheduler::submit_clear_mem(size_t seq_id, llama_pos p0, llama_pos p1) {
+void LlamaMemoryScheduler::submit(MemoryCommand&& command) {
     {
         std::lock_guard<std::mutex> lock(task_queue_mutex_);
-        std::function<void()> task = [this, seq_id, p0, p1]() { llama_memory_seq_rm(memory_, seq_id, p0, p1); };
-        tasks_.push(task);
+        if (ring_size_ == ring_.size() || !overflow_.empty()) {
+            overflow_.push(std::move(command));
+        } else {
+            ring_[(ring_head_ + ring_size_) % ring_.size()] = std::move(command);
+            ring_size_++;
+        }
     }
     condition_.notify_one();
 }
 
+void LlamaMemoryScheduler::submit_clear_mem(size_t seq_id, llama_pos p0, llama_pos p1) {
+    MemoryCommand command;
+    command.type = MemoryCommandType::RM;
+    command.seq_id = (llama_seq_id)seq_id;
+    command.p0 = p0;
+    command.p1 = p1;
+    submit(std::move(command));
+}
+
 void LlamaMemoryScheduler::submit_cache_mem(size_t src_seq_id, size_t dest_seq_id, llama_pos p0, llama_pos p1) {
-    {
-        std::lock_guard<std::mutex> lock(task_queue_mutex_);
-        std::function<void()> task = [this, src_seq_id, dest_seq_id, p0, p1]() {
-            llama_pos max_pos = llama_memory_seq_pos_max(memory_, dest_seq_id);
-            llama_pos p_0 = std::max(p0, max_pos + 1);
+    MemoryCommand command;
+    command.type = MemoryCommandType::CP;
+    command.seq_id = (llama_seq_id)dest_seq_id;
+    command.src_seq_id = (llama_seq_id)src_seq_id;
+    command.p0 = p0;
+    command.p1 = p1;
+    submit(std::move(command));
+}
 
-            if (p_0 <= p1 || p1 == -1) llama_memory_seq_cp(memory_, src_seq_id, dest_seq_id, p_0, p1);
-        };
-        tasks_.push(task);
+void LlamaMemoryScheduler::submit_keep_mem(size_t seq_id) {
+    MemoryCommand command;
+    command.type = MemoryCommandType::KEEP;
+    command.seq_id = (llama_seq_id)seq_id;
+    submit(std::move(command));
+}
+
+void LlamaMemoryScheduler::submit_shift_mem(size_t seq_id, llama_pos p0, llama_pos p1, llama_pos delta) {
+    MemoryCommand command;
+    command.type = MemoryCommandType::SHIFT;
+    command.seq_id = (llama_seq_id)seq_id;
+    command.p0 = p0;
+    command.p1 = p1;
+    command.delta = delta;
+    submit(std::move(command));
+}
+
+void LlamaMemoryScheduler::submit_function_use_mem(std::function<void()> func, std::vector<llama_seq_id> seqs) {
+    MemoryCommand command;
+    command.func = std::move(func);
+    command.seqs = std::move(seqs);
+    submit(std::move(command));
+}
+
+void LlamaMemoryScheduler::run(MemoryCommand& command) {
+    switch (command.type) {
+        case MemoryCommandType::FUNCTION:
+            if (command.func) command.func();
+            break;
+        case MemoryCommandType::RM:
+            llama_memory_seq_rm(memory_, command.seq_id, command.p0, command.p1);
+            break;
+        case MemoryCommandType::CP: {
+            llama_pos max_pos = llama_memory_seq_pos_max(memory_, command.seq_id);
+            llama_pos p_0 = std::max(command.p0, max_pos + 1);
+            if (p_0 <= command.p1 || command.p1 == -1)
+                llama_memory_seq_cp(memory_, command.src_seq_id, command.seq_id, p_0, command.p1);
+            break;
+        }
+        case MemoryCommandType::KEEP:
+            llama_memory_seq_keep(memory_, command.seq_id);
+            break;
+        case MemoryCommandType::SHIFT:
+            llama_memory_seq_add(memory_, command.seq_id, command.p0, command.p1, command.delta);
+            break;
     }
-    condition_.notify_one();
 }
 
-void LlamaMemoryScheduler::submit_function_use_mem(std::function<void()> func) {
-    {
-        std::lock_guard<std::mutex> lock(task_queue_mutex_);
-        tasks_.push(func);
+// Adjacent seq_rm of one sequence over overlapping or touching ranges become one, negative bounds are open
+void LlamaMemoryScheduler::merge_rm(std::vector<MemoryCommand>& commands) {
+    const llama_pos open_end = std::numeric_limits<llama_pos>::max();
+    size_t n_kept = 0;
+    for (size_t i = 0; i < commands.size(); i++) {
+        auto& command = commands[i];
+        if (n_kept > 0 && command.type == MemoryCommandType::RM) {
+            auto& last = commands[n_kept - 1];
+            llama_pos p0 = std::max(command.p0, 0), p1 = command.p1 < 0 ? open_end : command.p1;
+            llama_pos last_p0 = std::max(last.p0, 0), last_p1 = last.p1 < 0 ? open_end : last.p1;
+            bool mergeable = last.type == MemoryCommandType::RM && last.seq_id == command.seq_id && p0 <= last_p1 &&
+                             last_p0 <= p1;
+            if (mergeable) {
+                last.p0 = std::min(p0, last_p0);
+                last_p1 = std::max(p1, last_p1);
+                last.p1 = last_p1 == open_end ? -1 : last_p1;
+                continue;
+            }
+        }
+        if (n_kept != i) commands[n_kept] = std::move(command);
+        n_kept++;
     }
-    condition_.notify_one();
+    commands.resize(n_kept);
+}
+
+// Returns true while the cells stay fragmented and the last compaction helped, i.e. another idle pass is worth it
+bool LlamaMemoryScheduler::idle_defrag() {
+    float fragmentation = llama_memory_fragmentation(memory_);
+    if (fragmentation <= defrag_thold_) return false;
+    TraceScope trace("kv_defrag", -1, (int32_t)(fragmentation * 100));
+    bool updated = false;
+    try {
+        updated = llama_memory_defrag(ctx_);
+    } catch (const std::exception& e) {
+        LOG_ERR("failed to defrag kv cache: %s\n", e.what());
+    }
+    float after = llama_memory_fragmentation(memory_);
+    LOG_DBG("%s: kv fragmentation %.2f -> %.2f\n", __func__, fragmentation, after);
+    return updated && after > defrag_thold_ && after < fragmentation;
 }
 
 void LlamaMemoryScheduler::process() {
+    std::vector<MemoryCommand> commands;  // NOTE: reused, holds up to one ring without allocation
+    commands.reserve(MEMORY_RING_CAPACITY);
+    std::vector<size_t> deferred;
+    std::vector<llama_seq_id> blocked_seqs;  // touched by deferred commands
+    mico_trace::set_thread_name("memory_scheduler");
+    bool defrag_due = false;  // commands ran since the last idle defrag check
     while (true) {
-        std::function<void()> task = nullptr;
-
         {  // lock task_queue_mutex
             std::unique_lock<std::mutex> lock(task_queue_mutex_);
-            condition_.wait(lock, [this] { return !tasks_.empty() || stop_flag_.load(); });
+            auto ready = [this] { return ring_size_ > 0 || !overflow_.empty() || stop_flag_.load(); };
+            if (defrag_thold_ > 0.0f && defrag_due) {
+                if (!condition_.wait_for(lock, std::chrono::milliseconds(defrag_idle_ms_), ready)) {
+                    lock.unlock();
+                    defrag_due = idle_defrag();
+                    continue;
+                }
+            } else {
+                condition_.wait(lock, ready);
+            }
             if (stop_flag_.load()) {
                 break;
             }
-            task = std::move(tasks_.front());
-            tasks_.pop();
+            for (; ring_size_ > 0; ring_size_--, ring_head_ = (ring_head_ + 1) % ring_.size()) {
+                commands.push_back(std::move(ring_[ring_head_]));
+            }
+            for (; !overflow_.empty(); overflow_.pop()) commands.push_back(std::move(overflow_.front()));
         }
+        TraceScope trace("memory_commands", -1, (int32_t)commands.size());
+        merge_rm(commands);
 
-        if (task == nullptr) continue;  // Skip if task is null
-
-        try {
-            task();
-        } catch (const std::exception& e) {
-            LOG_ERR("failed to use llama api\n");
+        // Functions wait for a second pass, a kv op runs first when it touches none of the sequences of the
+        // commands deferred before it
+        bool barrier = false;  // a deferred command touches every sequence
+        auto touched = [&blocked_seqs, &barrier](llama_seq_id seq_id) {
+            if (barrier || seq_id < 0) return barrier || !blocked_seqs.empty();
+            return std::find(blocked_seqs.begin(), blocked_seqs.end(), seq_id) != blocked_seqs.end();
+        };
+        for (size_t i = 0; i < commands.size(); i++) {
+            auto& command = commands[i];
+            bool kv_op = command.type != MemoryCommandType::FUNCTION;
+            bool cp = command.type == MemoryCommandType::CP;
+            if (kv_op && !touched(command.seq_id) && (!cp || !touched(command.src_seq_id))) {
+                try {
+                    run(command);
+                } catch (const std::exception& e) {
+                    LOG_ERR("failed to use llama api\n");
+                }
+                continue;
+            }
+            deferred.push_back(i);
+            if (kv_op) {
+                barrier |= command.seq_id < 0;
+                blocked_seqs.push_back(command.seq_id);
+                if (cp) blocked_seqs.push_back(command.src_seq_id);
+            } else {
+                barrier |= command.seqs.empty();
+                blocked_seqs.insert(blocked_seqs.end(), command.seqs.begin(), command.seqs.end());
+            }
+        }
+        for (size_t i : deferred) {
+            try {
+                run(commands[i]);
+            } catch (const std::exception& e) {
+                LOG_ERR("failed to use llama api\n");
+            }
         }
+        commands.clear();
+        deferred.clear();
+        blocked_seqs.clear();
+        defrag_due = true;
     }
 }
@@ -19,14 +19,41 @@
 #include "common/log.h"
 #include "llama.h"
 
+#define MEMORY_RING_CAPACITY 1024  // queued commands without allocation, more spill into an overflow queue
+
+enum class MemoryCommandType {
+    FUNCTION = 0,  // decode or any other llama_context work
+    RM = 1,        // llama_memory_seq_rm
+    CP = 2,        // llama_memory_seq_cp past the positions dest already holds
+    KEEP = 3,      // llama_memory_seq_keep
+    SHIFT = 4,     // llama_memory_seq_add
+};
+
+struct MemoryCommand {
+    MemoryCommandType type{MemoryCommandType::FUNCTION};
+    llama_seq_id seq_id{-1};      // RM/KEEP/SHIFT target, CP destination
+    llama_seq_id src_seq_id{-1};  // CP source
+    llama_pos p0{-1};
+    llama_pos p1{-1};
+    llama_pos delta{0};  // SHIFT
+    std::function<void()> func;
+    std::vector<llama_seq_id> seqs;  // sequences a FUNCTION touches, empty touches every sequence
+};
+
+// Serialises all llama_context work on one thread. Commands queue in a fixed ring, the thread takes every queued
+// command at once: adjacent seq_rm of a sequence merge, and kv ops run ahead of earlier functions touching other
+// sequences only (a decode declares its sequences). With defrag_thold > 0 the kv cells are compacted once no command
+// came for defrag_idle_ms and the fragmentation is above defrag_thold, never between the commands of a burst
 class LlamaMemoryScheduler {
   public:
-    LlamaMemoryScheduler(const llama_context* ctx);
+    LlamaMemoryScheduler(llama_context* ctx, float defrag_thold = 0.0f, int32_t defrag_idle_ms = 200);
     ~LlamaMemoryScheduler();
 
     void submit_clear_mem(size_t seq_id, llama_pos p0, llama_pos p1);
     void submit_cache_mem(size_t src_seq_id, size_t dest_seq_id, llama_pos p0, llama_pos p1);
-    void submit_function_use_mem(std::function<void()> func);
+    void submit_keep_mem(size_t seq_id);
+    void submit_shift_mem(size_t seq_id, llama_pos p0, llama_pos p1, llama_pos delta);
+    void submit_function_use_mem(std::function<void()> func, std::vector<llama_seq_id> seqs = {});
 
     // Delete copy and move constructors/assignment
     LlamaMemoryScheduler(const LlamaMemoryScheduler&) = delete;
@@ -35,12 +62,23 @@ class LlamaMemoryScheduler {
     LlamaMemoryScheduler& operator=(LlamaMemoryScheduler&&) = delete;
 
   private:
+    void submit(MemoryCommand&& command);
     void process();
+    void run(MemoryCommand& command);
+    static void merge_rm(std::vector<MemoryCommand>& commands);
+    bool idle_defrag();
+
+    llama_context* ctx_;
     llama_memory_t memory_;
+    float defrag_thold_;
+    int32_t defrag_idle_ms_;
     std::atomic<bool> stop_flag_{false};
     mutable std::mutex task_queue_mutex_;
     std::condition_variable condition_;
-    std::queue<std::function<void()>> tasks_;
+    std::vector<MemoryCommand> ring_;
+    size_t ring_head_{0};
+    size_t ring_size_{0};
+    std::queue<MemoryCommand> overflow_;  // NOTE: only used while the ring is full, keeps submission order
     std::thread* thread_;
 };
 
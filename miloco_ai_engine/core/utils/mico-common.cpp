@@ -5,25 +5,135 @@
 
 #include "mico-common.h"
 
-LlamaMicoContext::LlamaMicoContext(common_params& params) : llama_init(common_init_from_params(params)) {
-    model = llama_init.model.get();
+#include <pthread.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+
+#include "cache_manager/chat-template-cache.h"
+#include "ggml-cpu.h"
+#include "utils/frame-ring.h"
+#include "utils/op-profiler.h"
+#include "utils/modal-buffer-pool.h"
+#include "utils/prompt-budget.h"
+#include "utils/request-log.h"
+
+#define IMAGE_CACHE_AUTO_MEM_DIV 8     // auto image cache takes this fraction of the available host memory
+#define IMAGE_CACHE_AUTO_MAX_MB 8192
+#define IMAGE_CACHE_AUTO_TOKENS 64     // tokens of the smallest expected image, bounds the auto entry count
+#define KV_ADMISSION_POLL_MS 20        // a request waiting for kv looks again this often without a release
+
+// File name and size of the mmproj and the options changing what it computes, empty without one
+static std::string mmproj_file_signature(const common_params& params) {
+    if (params.mmproj.path.empty() || params.no_mmproj) return "";
+    struct stat st;
+    size_t size = stat(params.mmproj.path.c_str(), &st) == 0 ? (size_t)st.st_size : 0;
+    return params.mmproj.path.substr(params.mmproj.path.find_last_of('/') + 1) + "/" + std::to_string(size) + "/" +
+           std::to_string((int)params.mmproj_weight_type) + "/" + std::to_string(params.mmproj_f16_activations);
+}
+
+LlamaMicoContext::LlamaMicoContext(common_params& params)
+    : shared_model(acquire_shared_model(params)),
+      llama_init(shared_model ? common_init_from_model(params, shared_model->model.get()) : common_init_result()) {
+    model = shared_model ? shared_model->model.get() : nullptr;
     lctx = llama_init.context.get();
+    if (!model || !lctx) {  // NOTE: llama_mico_init reports it, a failed model swap keeps the serving handle alive
+        LOG_ERR("%s: failed to load the model\n", __func__);
+        return;
+    }
     vocab = llama_model_get_vocab(model);
+    if (params.pipeline_microbatches > 1 && params.n_gpu_layers <= llama_model_n_layer(model)) {
+        LOG_WRN("%s: pipeline_microbatches needs the output layer offloaded too, n_gpu_layers > %d\n", __func__,
+                llama_model_n_layer(model));
+    }
+    for (const auto& lora : params.lora_adapters) lora_adapters.push_back({lora.name, lora.ptr, lora.scale});
+    attach_threadpools(params);
+    cpu_encoder = params.cpuparams_encoder;
+    cpu_scheduler = params.cpuparams_scheduler;
+    cpu_prepare = params.cpuparams_prepare;
     smpl = common_sampler_init(model, params.sampling);
+    sampling = params.sampling;
     n_threads = params.cpuparams.n_threads;
+    sample_threads = params.sample_threads;
     n_batch = params.n_batch;
     n_usage_context = params.n_usage_context;
+    context_shift = params.ctx_shift;
+    n_sink_tokens = std::max(0, params.n_keep);
+    swa_window = params.swa_full ? 0 : std::max(0, llama_model_n_swa(model));
 
     n_seq_max = params.n_seq_max;
     n_seq_max -= params.cache_seq;  // reserved space for cache
+    image_kv_entries = std::max(params.image_kv_entries, 0);
+    if (image_kv_entries > 0 && n_seq_max > 1) image_kv_seq = --n_seq_max;
+    adaptive_resolution_step = std::max(params.adaptive_resolution_step, 0.0f);
+    image_kv_keep = params.image_kv_keep > 0.0f && params.image_kv_keep < 1.0f ? params.image_kv_keep : 0.0f;
+    seq_slots.reset(new std::atomic<LlamaSeqState*>[std::max(n_seq_max, 0)]);
+    for (int32_t i = n_seq_max - 1; i >= 0; i--) {  // NOTE: all sequences are free, admission takes the lowest first
+        auto& state = process_seqs[i];
+        state = std::make_unique<LlamaSeqState>();
+        state->seq_id = i;
+        seq_slots[i].store(state.get(), std::memory_order_release);
+        free_seqs.push_back(i);
+    }
 
     kv_cache_seq = params.cache_seq;
+    kv_cache_path = params.cache_path;
+    kv_cache_host_bytes = params.cache_host_mb << 20;
+    kv_cache_pin_max = params.cache_pin_max < 0 ? kv_cache_seq / 2 : std::min(params.cache_pin_max, kv_cache_seq);
+    if (!params.cache_class_seqs.empty() && params.cache_class_seqs.size() != TASK_CLASS_COUNT) {
+        LOG_WRN("%s: cache_class_seqs needs %d values, classes are not capped\n", __func__, TASK_CLASS_COUNT);
+        params.cache_class_seqs.clear();
+    }
+    for (int32_t c = 0; c < TASK_CLASS_COUNT; c++)
+        kv_cache_class_seqs[c] = params.cache_class_seqs.empty() ? kv_cache_seq : params.cache_class_seqs[c];
+    n_park_context = params.park_context;
+    video_session_max = std::max(0, std::min(params.video_session_max, n_seq_max - 1));
+    image_cache_precision = params.image_cache_precision;
+    frame_dedup_bits = params.frame_dedup_bits;
+    image_cache_entries = params.image_cache_entries;
+    image_cache_mb = params.image_cache_mb;
+    image_cache_disk_path = params.image_cache_disk_path;
+    image_cache_disk_mb = std::max(params.image_cache_disk_mb, 0);
+    image_cache_shm_mb = std::max(params.image_cache_shm_mb, 0);
+    mmproj_signature = mmproj_file_signature(params);
+    preempt_host_bytes = params.preempt_host_mb << 20;
+    coalesce_requests = params.coalesce_requests;
+    response_cache_bytes = (size_t)std::max(0, params.response_cache_mb) << 20;
+    response_cache_ttl_s = std::max(0, params.response_cache_ttl_s);
+    admission_queue_max = (size_t)std::max(0, params.admission_queue_max);
+    admission_wait_ms = std::max(0, params.admission_wait_ms);
+    kv_admission = params.kv_admission;
+    kv_output_reserve = std::max(0, params.kv_output_reserve);
+    batch_wait_ms = std::max(0, params.batch_wait_ms);
+    n_prepare_workers = std::max(1, params.n_prepare_workers);
+    text_batch_size = params.text_batch_size > 0 ? std::min(params.text_batch_size, n_batch) : n_batch;
+    decode_step_size = params.n_ubatch_decode > 0 ? std::min(params.n_ubatch_decode, n_batch) : n_batch;
+    image_batch_size = params.image_batch_size > 0 ? std::min(params.image_batch_size, n_batch) : n_batch;
+    if (image_cache_entries < 0 || image_cache_mb < 0) auto_size_modal_cache();
+    if (params.slo_class_priorities.size() != TASK_CLASS_COUNT - 1 || params.slo_target_ms.size() != TASK_CLASS_COUNT) {
+        LOG_WRN("%s: slo_class_priorities needs %d values, slo_target_ms %d, using defaults\n", __func__,
+                TASK_CLASS_COUNT - 1, TASK_CLASS_COUNT);
+        params.slo_class_priorities = common_params().slo_class_priorities;
+        params.slo_target_ms = common_params().slo_target_ms;
+    }
+    std::copy(params.slo_class_priorities.begin(), params.slo_class_priorities.end(), slo_class_priorities);
+    std::copy(params.slo_target_ms.begin(), params.slo_target_ms.end(), slo_target_ms);
 
     // memory_scheduler
-    memory_scheduler = new LlamaMemoryScheduler(lctx);
+    memory_scheduler = new LlamaMemoryScheduler(lctx, params.kv_defrag_thold, params.kv_defrag_idle_ms);
 
-    if (!model || !lctx) {
-        exit(1);
+    {
+        const int32_t n_embd_kv = llama_model_n_embd(model) / llama_model_n_head(model) * llama_model_n_head_kv(model);
+        const size_t token_bytes = llama_model_n_layer(model) * (ggml_row_size(params.cache_type_k, n_embd_kv) +
+                                                                 ggml_row_size(params.cache_type_v, n_embd_kv));
+        const uint32_t n_ctx = llama_n_ctx(lctx);
+        LOG_INF("%s: kv cache K %s V %s%s, %.1f KiB per token, %.1f MiB for %u cells, %u tokens per sequence\n",
+                __func__, ggml_type_name(params.cache_type_k), ggml_type_name(params.cache_type_v),
+                params.flash_attn ? " (flash attention)" : "", token_bytes / 1024.0, token_bytes * n_ctx / 1048576.0,
+                n_ctx, n_ctx / std::max(1u, llama_n_seq_max(lctx)));
     }
 
     if (!llama_model_chat_template(model, nullptr) && params.chat_template.empty()) {
@@ -35,7 +145,21 @@ LlamaMicoContext::LlamaMicoContext(common_params& params) : llama_init(common_in
     }
 
     tmpls = common_chat_templates_init(model, params.chat_template);
-    LOG_INF("%s: chat template example:\n%s\n", __func__,
+    chat_cache = std::make_shared<ChatTemplateCache>(this);
+    prompt_budget = std::make_shared<PromptBudget>();
+    modal_buffers = std::make_shared<ModalBufferPool>();
+    frame_rings = std::make_shared<FrameRings>();
+    if (!params.request_log_path.empty()) {
+        request_log = std::make_shared<RequestLog>(params.request_log_path);
+        if (!request_log->is_open()) request_log.reset();
+    }
+    if (params.op_profile) {
+        op_profiler = std::make_shared<OpProfiler>();
+        llama_set_eval_callback(lctx, OpProfiler::eval_callback, op_profiler->probe(OP_GRAPH_LLM));
+        LOG_WRN("%s: op_profile synchronises every ggml op, inference is slower\n", __func__);
+    }
+    // NOTE: only rendered with debug logs, startup does not wait for it
+    LOG_DBG("%s: chat template example:\n%s\n", __func__,
             common_chat_format_example(tmpls.get(), params.use_jinja).c_str());
 
     std::string placeholder = "*=*";
@@ -56,8 +180,17 @@ LlamaMicoContext::LlamaMicoContext(common_params& params) : llama_init(common_in
             break;
         }
     }
+    crop_lable_next.assign(crop_tokens_lable.size(), 0);
+    for (size_t i = 1, k = 0; i < crop_tokens_lable.size(); i++) {
+        while (k > 0 && crop_tokens_lable[i] != crop_tokens_lable[k]) k = crop_lable_next[k - 1];
+        if (crop_tokens_lable[i] == crop_tokens_lable[k]) k++;
+        crop_lable_next[i] = (int32_t)k;
+    }
 
-    init_vision_context(params);
+    init_draft_model(params);
+    init_prefill_model(params);
+    // NOTE: images would load the lazy vision model
+    warmup(params.mmproj_lazy ? std::vector<int32_t>() : params.warmup_image_sizes, params.warmup_ubatch);
 
     // load antiprompt tokens for legacy templates
     if (params.chat_template == "vicuna") {
@@ -67,54 +200,686 @@ LlamaMicoContext::LlamaMicoContext(common_params& params) : llama_init(common_in
     }
 }
 
-LlamaMicoContext::~LlamaMicoContext() { common_sampler_free(smpl); }
+// Function of the ggml CPU backend, which may be a dynamically loaded backend
+static void* cpu_proc_address(const char* name) {
+    ggml_backend_dev_t cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    return cpu_dev ? ggml_backend_reg_get_proc_address(ggml_backend_dev_backend_reg(cpu_dev), name) : nullptr;
+}
+
+LlamaMicoContext::~LlamaMicoContext() {
+    common_sampler_free(smpl);
+    if (threadpool) {  // NOTE: lctx is freed after this body, it must not refer to the freed pools
+        llama_detach_threadpool(lctx);
+        auto* threadpool_free = (decltype(ggml_threadpool_free)*)cpu_proc_address("ggml_threadpool_free");
+        threadpool_free(threadpool);
+        if (threadpool_batch) threadpool_free(threadpool_batch);
+    }
+}
+
+void LlamaMicoContext::attach_threadpools(const common_params& params) {
+    // NOTE: without a pool ggml starts and joins the compute threads of every graph, every decode step
+    auto* threadpool_new = (decltype(ggml_threadpool_new)*)cpu_proc_address("ggml_threadpool_new");
+    if (!threadpool_new) {
+        LOG_WRN("%s: no ggml CPU backend, compute threads start per graph\n", __func__);
+        return;
+    }
+    ggml_threadpool_params tpp = ggml_threadpool_params_from_cpu_params(params.cpuparams);
+    ggml_threadpool_params tpp_batch = ggml_threadpool_params_from_cpu_params(params.cpuparams_batch);
+    if (!ggml_threadpool_params_match(&tpp, &tpp_batch)) {
+        threadpool_batch = threadpool_new(&tpp_batch);
+        tpp.paused = true;  // NOTE: only one pool spins at a time
+    }
+    threadpool = threadpool_new(&tpp);
+    llama_attach_threadpool(lctx, threadpool, threadpool_batch);
+    LOG_INF("%s: persistent ggml compute, %d threads, %d batch threads\n", __func__, tpp.n_threads,
+            tpp_batch.n_threads);
+}
+
+std::string model_signature(const llama_model* model) {
+    char desc[256] = {0};
+    llama_model_desc(model, desc, sizeof(desc));
+    return std::string(desc) + "/" + std::to_string(llama_model_n_params(model)) + "/" +
+           std::to_string(llama_model_size(model));
+}
+
+void set_thread_affinity(const cpu_params& cpu) {
+    if (!cpu.mask_valid) return;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int i = 0; i < GGML_MAX_N_THREADS && i < CPU_SETSIZE; i++) {
+        if (cpu.cpumask[i]) CPU_SET(i, &set);
+    }
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) LOG_WRN("%s: failed to pin the thread, error %d\n", __func__, err);
+#else
+    LOG_WRN("%s: thread pinning needs Linux, ignored\n", __func__);
+#endif
+}
+
+std::vector<llama_token> LlamaSeqState::text_tokens() const {
+    std::vector<llama_token> tokens;
+    tokens.reserve(kv_items.size());
+    for (const auto& item : kv_items) {
+        if (item.key >= 0) tokens.push_back((llama_token)item.key);
+    }
+    return tokens;
+}
 
 LlamaSeqState& LlamaMicoContext::get_seq_state(size_t seq_id) {
+    if (seq_id < (size_t)n_seq_max) return *seq_slots[seq_id].load(std::memory_order_acquire);
+    if (seq_id == (size_t)DEFAULT_ERROR_SEQ_ID) return error_state;
     std::lock_guard<std::mutex> lock(process_seqs_mutex);
-    return process_seqs[seq_id];
+    auto& state = process_seqs[seq_id];
+    if (!state) {
+        state = std::make_unique<LlamaSeqState>();
+        state->seq_id = (int32_t)seq_id;
+    }
+    return *state;
+}
+
+void LlamaMicoContext::move_state(size_t from_id, size_t to_id) {
+    auto& state = process_seqs[to_id];
+    state = std::move(process_seqs[from_id]);
+    state->seq_id = (int32_t)to_id;
+    if (to_id < (size_t)n_seq_max) seq_slots[to_id].store(state.get(), std::memory_order_release);
+}
+
+int32_t LlamaMicoContext::find_free_seq() {  // Keep parked kv for bind_seq_prefix if possible
+    if (!free_seqs.empty()) return free_seqs.back();
+    for (int32_t parked : parked_seqs) {  // oldest parked
+        if (!get_seq_state(parked).is_infering.load()) return parked;
+    }
+    return -1;
+}
+
+void LlamaMicoContext::release_slot(int32_t seq_id) {
+    if (seq_id < 0 || seq_id >= n_seq_max || get_seq_state(seq_id).is_infering.load()) return;
+    if (std::find(parked_seqs.begin(), parked_seqs.end(), seq_id) != parked_seqs.end()) return;
+    const auto& video_session = get_seq_state(seq_id).video_session;
+    if (!video_session.empty() && video_seq(video_session) == seq_id) return;
+    if (std::find(free_seqs.begin(), free_seqs.end(), seq_id) == free_seqs.end()) free_seqs.push_back(seq_id);
+}
+
+void LlamaMicoContext::bind_cmpl(size_t cmpl_id, int32_t seq_id) {
+    auto it = cmpl_to_seq.find(cmpl_id);
+    if (it != cmpl_to_seq.end()) seq_to_cmpl.erase(it->second);
+    cmpl_to_seq[cmpl_id] = seq_id;
+    seq_to_cmpl[seq_id] = cmpl_id;
 }
 
 int32_t LlamaMicoContext::set_seq_id(size_t cmpl_id) {
     std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
-    int32_t seq_id = -1;
-    for (int i = 0; i < n_seq_max; i++)
-        if (!get_seq_state(i).is_infering.load()) {
-            seq_id = i;
-            break;
-        }
-    if (seq_id != -1) cmpl_to_seq[cmpl_id] = seq_id;
+    int32_t seq_id = find_free_seq();
+    if (seq_id != -1) {
+        if (!free_seqs.empty() && free_seqs.back() == seq_id) free_seqs.pop_back();
+        get_seq_state(seq_id).is_infering.store(true);  // NOTE: reserved under the lock
+        bind_cmpl(cmpl_id, seq_id);
+    }
     return seq_id;
 }
 int32_t LlamaMicoContext::get_seq_id(size_t cmpl_id) {
     std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
-    int32_t has = (cmpl_to_seq.count(cmpl_id) > 0 ? cmpl_to_seq[cmpl_id] : -1);
-    return has;
+    auto it = cmpl_to_seq.find(cmpl_id);
+    return it != cmpl_to_seq.end() ? it->second : -1;
+}
+LlamaSeqState* LlamaMicoContext::get_cmpl_state(size_t cmpl_id) {
+    std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);  // NOTE: the sequence can not move meanwhile
+    auto it = cmpl_to_seq.find(cmpl_id);
+    if (it == cmpl_to_seq.end()) return nullptr;
+    auto& state = get_seq_state(it->second);
+    return state.is_infering.load() ? &state : nullptr;
+}
+void LlamaMicoContext::keep_timings(int32_t request_id, std::string timings) {
+    std::lock_guard<std::mutex> lock(finished_timings_mutex);
+    if (finished_timings.count(request_id) == 0) finished_timings_order.push_back(request_id);
+    finished_timings[request_id] = std::move(timings);
+    while (finished_timings_order.size() > TIMINGS_KEPT_MAX) {  // NOTE: taken ids leave the order here too
+        finished_timings.erase(finished_timings_order.front());
+        finished_timings_order.pop_front();
+    }
+}
+
+bool LlamaMicoContext::take_timings(int32_t request_id, std::string& timings) {
+    std::lock_guard<std::mutex> lock(finished_timings_mutex);
+    auto it = finished_timings.find(request_id);
+    if (it == finished_timings.end()) return false;
+    timings = std::move(it->second);
+    finished_timings.erase(it);
+    return true;
 }
+
 bool LlamaMicoContext::erase_seq(int32_t seq_id) {
     std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
-    size_t to_erase = -1;
-    for (auto& it : cmpl_to_seq) {
-        if (it.second == seq_id) {
-            to_erase = it.first;
-            break;
+    auto it = seq_to_cmpl.find(seq_id);
+    if (it == seq_to_cmpl.end()) return false;
+    cmpl_to_seq.erase(it->second);
+    seq_to_cmpl.erase(it);
+    return true;
+}
+
+int32_t LlamaMicoContext::seq_context_limit(int32_t seq_id) {
+    int32_t n_budget = get_seq_state(seq_id).n_kv_budget.load();
+    if (n_budget > 0) return n_budget;  // NOTE: no scan, the decode loop asks for every sequence at every step
+    return std::max(n_usage_context, (int32_t)llama_n_ctx(lctx) - kv_held() - n_kv_granted.load());
+}
+
+int32_t LlamaMicoContext::grant_context(int32_t seq_id) {
+    auto& state = get_seq_state(seq_id);
+    std::lock_guard<std::mutex> lock(kv_admission_mutex);
+    n_kv_granted.fetch_sub(state.n_kv_budget.exchange(0));  // NOTE: a request prepared again is granted anew
+    int32_t n_budget = std::max(n_usage_context, (int32_t)llama_n_ctx(lctx) - kv_held() - n_kv_granted.load());
+    state.n_kv_budget.store(n_budget);
+    n_kv_granted.fetch_add(n_budget);
+    return n_budget;
+}
+
+void LlamaMicoContext::trim_context(LlamaSeqState& state, int32_t n_pos) {
+    std::lock_guard<std::mutex> lock(kv_admission_mutex);
+    int32_t n_budget = state.n_kv_budget.load();
+    int32_t n_trimmed = std::max(n_usage_context, n_pos);
+    if (n_budget <= n_trimmed) return;
+    state.n_kv_budget.store(n_trimmed);
+    n_kv_granted.fetch_sub(n_budget - n_trimmed);
+}
+
+int32_t LlamaMicoContext::kv_held() {
+    int32_t n_held = kv_cache_seq * n_usage_context;  // NOTE: prompt cache sequences hold at most one share each
+    n_held += n_image_kv_pos.load();
+    std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
+    for (int32_t parked : parked_seqs) n_held += prefix_n_pos(get_seq_state(parked).kv_items, SIZE_MAX);
+    for (const auto& video : video_seqs) {
+        auto& state = get_seq_state(video.second);
+        if (!state.is_infering.load()) n_held += prefix_n_pos(state.kv_items, SIZE_MAX);
+    }
+    return n_held;
+}
+
+int32_t LlamaMicoContext::kv_claimed(int32_t seq_id) {
+    int32_t n_claimed = kv_held();
+    for (int32_t i = 0; i < n_seq_max; i++) {
+        if (i == seq_id) continue;
+        auto& state = get_seq_state(i);
+        if (!state.is_infering.load()) continue;
+        // NOTE: an admitted request claims exactly its projection, one waiting for kv only what it holds
+        int32_t n_reserved = state.n_kv_reserved.load();
+        int32_t n_guaranteed = n_reserved > 0 ? n_reserved : n_reserved < 0 ? 0 : n_usage_context;
+        n_claimed += std::max((int32_t)state.n_past.load(), n_guaranteed);
+    }
+    return n_claimed;
+}
+
+bool LlamaMicoContext::reserve_kv(int32_t seq_id, int32_t n_pos, int64_t until_ms) {
+    auto& state = get_seq_state(seq_id);
+    int32_t n_most = (int32_t)llama_n_ctx(lctx) - kv_cache_seq * n_usage_context - n_image_kv_pos.load();
+    if (n_pos > n_most) return false;  // NOTE: not even with every request finished
+    state.n_kv_reserved.store(-1);
+    std::unique_lock<std::mutex> lock(kv_admission_mutex);
+    while (true) {
+        if (n_pos <= (int32_t)llama_n_ctx(lctx) - kv_claimed(seq_id)) {
+            state.n_kv_reserved.store(n_pos);
+            return true;
         }
+        int64_t now_ms = ggml_time_ms();
+        if (state.cancelled.load() || now_ms >= until_ms) {
+            state.n_kv_reserved.store(0);
+            return false;
+        }
+        // NOTE: parked and cached kv shrink without a release, look again now and then
+        int64_t wait_ms = std::min<int64_t>(KV_ADMISSION_POLL_MS, until_ms - now_ms);
+        kv_released.wait_for(lock, std::chrono::milliseconds(wait_ms));
     }
-    if (to_erase >= 0) cmpl_to_seq.erase(to_erase);
-    return to_erase >= 0;
 }
 
-void LlamaMicoContext::init_vision_context(common_params& params) {
-    const char* clip_path = params.mmproj.path.c_str();
-    mtmd_context_params mparams = mtmd_context_params_default();
-    mparams.use_gpu = params.mmproj_use_gpu;
-    mparams.print_timings = true;
-    mparams.n_threads = params.cpuparams.n_threads;
-    mparams.verbosity = params.verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
-    ctx_vision.reset(mtmd_init_from_file(clip_path, model, mparams));
-    if (!ctx_vision.get()) {
-        LOG_ERR("Failed to load vision model from %s\n", clip_path);
-        exit(1);
+void LlamaMicoContext::release_kv(LlamaSeqState& state) {
+    n_kv_granted.fetch_sub(state.n_kv_budget.exchange(0));
+    if (state.n_kv_reserved.exchange(0) == 0) return;
+    std::lock_guard<std::mutex> lock(kv_admission_mutex);
+    kv_released.notify_all();
+}
+
+int32_t LlamaMicoContext::bind_seq_prefix(size_t cmpl_id, int32_t seq_id, const std::vector<PrefixItem>& items,
+                                          const LoraAdapter* lora, int32_t shift_limit,
+                                          const std::string& video_session) {
+    std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
+    // kv items [0, n_prefix) match the prompt from the start, [n_prefix, n_prefix + n_tail) match the prompt again
+    // n_gap items later, the gap was evicted by a context shift of an earlier turn. A video window matches the prompt
+    // after n_stale kv items instead, the frames that left the window
+    struct Reuse {
+        size_t n_prefix{0};
+        size_t n_gap{0};
+        size_t n_stale{0};
+        size_t n_tail{0};
+    };
+    bool can_shift = llama_memory_can_shift(llama_get_memory(lctx));
+    // at least the last item is inferred
+    auto reused_items = [this, &items, lora, shift_limit, can_shift](int32_t candidate, bool window = false) {
+        const auto& kv_items = get_seq_state(candidate).kv_items;
+        Reuse reuse;
+        if (get_seq_state(candidate).lora != lora) return reuse;
+        size_t& n_items = reuse.n_prefix;
+        while (n_items + 1 < items.size() && n_items < kv_items.size() && kv_items[n_items].key == items[n_items].key)
+            n_items++;
+        size_t n_tail = kv_items.size() - n_items;
+        if (window && can_shift && n_tail > 0) {  // the longest run of kv with a frame continuing the prompt prefix
+            for (size_t j = n_items + 1; j < kv_items.size(); j++) {
+                if (kv_items[j].key != items[n_items].key) continue;
+                size_t n_run = 0, n_frames = 0;
+                while (j + n_run < kv_items.size() && n_items + n_run + 1 < items.size() &&
+                       kv_items[j + n_run].key == items[n_items + n_run].key)
+                    n_frames += kv_items[j + n_run++].key < 0;
+                if (n_frames == 0 || n_run <= reuse.n_tail) continue;
+                reuse.n_stale = j - n_items;
+                reuse.n_tail = n_run;
+            }
+            return reuse;
+        }
+        if (shift_limit <= 0 || n_tail == 0 || n_items < (size_t)n_sink_tokens || n_items + n_tail + 1 >= items.size())
+            return reuse;
+        auto same = [](const PrefixItem& a, const PrefixItem& b) { return a.key == b.key; };
+        auto it = std::search(items.begin() + n_items + 1, items.end() - 1, kv_items.begin() + n_items, kv_items.end(),
+                              same);
+        if (it == items.end() - 1) return reuse;
+        reuse.n_gap = it - items.begin() - n_items;
+        reuse.n_tail = n_tail;
+        return reuse;
+    };
+
+    int32_t best_seq_id = seq_id;
+    Reuse best = reused_items(seq_id);
+    int32_t window_seq_id = video_session.empty() ? -1 : video_seq(video_session);
+    if (window_seq_id >= 0 && window_seq_id != seq_id && !get_seq_state(window_seq_id).is_infering.load()) {
+        best_seq_id = window_seq_id;  // NOTE: always, the window stays in one sequence even if the prompt changed
+        best = reused_items(window_seq_id, true /* window */);
+    }
+    for (int32_t parked : parked_seqs) {
+        if (best_seq_id == window_seq_id) break;
+        if (parked == seq_id || get_seq_state(parked).is_infering.load()) continue;
+        Reuse reuse = reused_items(parked);
+        if (reuse.n_prefix + reuse.n_tail > best.n_prefix + best.n_tail) {
+            best_seq_id = parked;
+            best = reuse;
+        }
+    }
+    if (best_seq_id != seq_id) {  // reserved sequence goes back, parked kv and all
+        get_seq_state(best_seq_id).is_infering.store(true);
+        get_seq_state(seq_id).is_infering.store(false);
+        bind_cmpl(cmpl_id, best_seq_id);
+    }
+    parked_seqs.remove(best_seq_id);
+    release_slot(seq_id);
+
+    auto& state = get_seq_state(best_seq_id);
+    auto& kv_items = state.kv_items;
+    LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(memory_scheduler);
+    size_t n_kept = best.n_prefix + best.n_tail;
+    ms->submit_clear_mem(best_seq_id, prefix_n_pos(kv_items, n_kept + best.n_stale), -1);
+    if (best.n_stale > 0) {  // Frames before the window leave, the positions of the window move down (M-RoPE too)
+        llama_pos p0 = prefix_n_pos(kv_items, best.n_prefix);
+        llama_pos p1 = prefix_n_pos(kv_items, best.n_prefix + best.n_stale);
+        ms->submit_clear_mem(best_seq_id, p0, p1);
+        ms->submit_shift_mem(best_seq_id, p1, -1, p0 - p1);
+        kv_items.erase(kv_items.begin() + best.n_prefix, kv_items.begin() + best.n_prefix + best.n_stale);
+        LOG_INF("video session %s: seq %d drops %zu stale items (%d positions), keeps %zu window items\n",
+                video_session.c_str(), best_seq_id, best.n_stale, p1 - p0, best.n_tail);
+    }
+    kv_items.resize(n_kept);
+    state.video_session = video_session;
+    route_lora(best_seq_id, lora);  // NOTE: always, a preempted sequence leaves its route behind
+    state.n_resident_items = best.n_prefix + best.n_gap + best.n_tail;
+    state.n_head_items = 0;
+    state.n_evicted_items = 0;
+    if (shift_limit > 0 && best.n_prefix >= (size_t)n_sink_tokens && best.n_prefix > 0) {
+        // Oldest items after the head go until the prompt fits, the resident ones leave the kv in place
+        llama_pos n_pos = prefix_n_pos(items, items.size()) - prefix_n_pos(items, best.n_prefix + best.n_gap) +
+                          prefix_n_pos(items, best.n_prefix);
+        size_t n_evicted = best.n_gap, n_dropped = 0;
+        while (n_pos > shift_limit && best.n_prefix + n_evicted + 1 < items.size()) {
+            n_pos -= items[best.n_prefix + n_evicted].n_pos;
+            if (n_evicted >= best.n_gap && n_evicted < best.n_gap + best.n_tail) n_dropped++;
+            n_evicted++;
+        }
+        if (n_dropped > 0) {
+            llama_pos p0 = prefix_n_pos(kv_items, best.n_prefix);
+            llama_pos p1 = prefix_n_pos(kv_items, best.n_prefix + n_dropped);
+            ms->submit_clear_mem(best_seq_id, p0, p1);
+            ms->submit_shift_mem(best_seq_id, p1, -1, p0 - p1);
+            kv_items.erase(kv_items.begin() + best.n_prefix, kv_items.begin() + best.n_prefix + n_dropped);
+        }
+        state.n_resident_items = std::max(state.n_resident_items, best.n_prefix + n_evicted);
+        state.n_head_items = best.n_prefix;
+        state.n_evicted_items = n_evicted;
+        if (n_evicted > 0)
+            LOG_INF("context shift: seq %d keeps %zu head items, evicts %zu items (%zu from kv)\n", best_seq_id,
+                    best.n_prefix, n_evicted, n_dropped);
+    }
+    if (n_kept > 0) LOG_INF("reuse %zu/%zu items kept in seq %d\n", n_kept, items.size(), best_seq_id);
+    return best_seq_id;
+}
+
+bool LlamaMicoContext::shift_seq_context(LlamaSeqState& state) {
+    if (!context_shift || !llama_memory_can_shift(llama_get_memory(lctx))) return false;
+    auto& kv_items = state.kv_items;
+    size_t n_head = std::min(std::max(state.n_head_items, state.n_cache_items), kv_items.size());
+    while (n_head < kv_items.size() && prefix_n_pos(kv_items, n_head) < n_sink_tokens) n_head++;
+
+    llama_pos p0 = prefix_n_pos(kv_items, n_head);
+    llama_pos n_discard = ((llama_pos)state.n_past.load() - p0) / 2;  // NOTE: evict whole items, images included
+    llama_pos p1 = p0;
+    size_t n_dropped = 0;
+    while (n_head + n_dropped + 1 < kv_items.size() && p1 - p0 < n_discard) p1 += kv_items[n_head + n_dropped++].n_pos;
+    if (n_dropped == 0) return false;
+
+    LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(memory_scheduler);
+    ms->submit_clear_mem(state.seq_id, p0, p1);
+    ms->submit_shift_mem(state.seq_id, p1, -1, p0 - p1);
+    kv_items.erase(kv_items.begin() + n_head, kv_items.begin() + n_head + n_dropped);
+    state.n_past.fetch_sub(p1 - p0);
+    LOG_INF("context shift: seq %d keeps %d head positions, evicts %d positions\n", state.seq_id, p0, p1 - p0);
+    return true;
+}
+
+int32_t LlamaMicoContext::video_seq(const std::string& session) {
+    auto it = video_seqs.find(session);
+    // NOTE: preemption may have moved the state of the session away since
+    if (it == video_seqs.end() || get_seq_state(it->second).video_session != session) return -1;
+    return it->second;
+}
+
+bool LlamaMicoContext::keep_video_window(int32_t seq_id) {
+    auto& state = get_seq_state(seq_id);
+    const std::string& session = state.video_session;
+    if (session.empty() || video_session_max <= 0) return false;
+    auto& kv_items = state.kv_items;
+    size_t n_window = kv_items.size();
+    while (n_window > 0 && kv_items[n_window - 1].key >= 0) n_window--;  // the question and the answer leave
+    int32_t previous = video_seq(session);
+    if (n_window == 0 || (previous < 0 && (int32_t)video_seqs.size() >= video_session_max)) {
+        if (previous == seq_id) video_seqs.erase(session);
+        return false;
+    }
+    if (previous >= 0 && previous != seq_id) {  // a newer window of the session, the older one is a parked prefix
+        auto& older = get_seq_state(previous);
+        older.video_session.clear();
+        if (!older.is_infering.load() && !older.kv_items.empty()) parked_seqs.push_back(previous);
+    }
+    LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(memory_scheduler);
+    ms->submit_clear_mem(seq_id, prefix_n_pos(kv_items, n_window), -1);
+    kv_items.resize(n_window);
+    video_seqs[session] = seq_id;
+    return true;
+}
+
+bool LlamaMicoContext::has_video_session(const std::string& session) {
+    std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
+    return video_seq(session) >= 0;
+}
+
+void LlamaMicoContext::release_video_session(const std::string& session) {
+    std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
+    int32_t seq_id = video_seq(session);
+    video_seqs.erase(session);
+    if (seq_id < 0) return;
+    auto& state = get_seq_state(seq_id);
+    state.video_session.clear();
+    if (state.is_infering.load()) return;  // NOTE: parked as usual once its request stops
+    state.kv_items.clear();
+    static_cast<LlamaMemoryScheduler*>(memory_scheduler)->submit_clear_mem(seq_id, -1, -1);
+    release_slot(seq_id);
+    LOG_INF("Released video session %s, seq %d\n", session.c_str(), seq_id);
+}
+
+void LlamaMicoContext::park_seq(int32_t seq_id) {
+    std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
+    LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(memory_scheduler);
+    auto& state = get_seq_state(seq_id);
+    parked_seqs.remove(seq_id);
+    if (keep_video_window(seq_id)) {
+        state.is_infering.store(false);
+        return;
+    }
+    state.video_session.clear();
+    if (!state.kv_items.empty()) parked_seqs.push_back(seq_id);
+    state.is_infering.store(false);
+    release_slot(seq_id);
+
+    int32_t n_parked = 0;
+    for (int32_t parked : parked_seqs) n_parked += prefix_n_pos(get_seq_state(parked).kv_items, SIZE_MAX);
+    while (n_parked > n_park_context && !parked_seqs.empty()) {  // Drop the oldest
+        int32_t oldest = parked_seqs.front();
+        parked_seqs.pop_front();
+        auto& oldest_state = get_seq_state(oldest);
+        n_parked -= prefix_n_pos(oldest_state.kv_items, SIZE_MAX);
+        oldest_state.kv_items.clear();
+        ms->submit_clear_mem(oldest, -1, -1);
+        release_slot(oldest);
+    }
+}
+
+// NOTE: states move by pointer, references held by a waiting consumer stay valid
+void LlamaMicoContext::swap_out_seq(int32_t seq_id, int32_t swap_id, size_t cmpl_id) {
+    std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
+    auto victim = seq_to_cmpl.find(seq_id);
+    if (victim != seq_to_cmpl.end()) {
+        size_t victim_cmpl = victim->second;
+        seq_to_cmpl.erase(victim);
+        bind_cmpl(victim_cmpl, swap_id);
+    }
+    bind_cmpl(cmpl_id, seq_id);
+
+    std::lock_guard<std::mutex> seqs_lock(process_seqs_mutex);
+    process_seqs.erase(swap_id);  // left by a preempted request stopped before it resumed
+    move_state(seq_id, swap_id);
+    auto& reserved = process_seqs[seq_id];
+    reserved = std::make_unique<LlamaSeqState>();
+    reserved->seq_id = seq_id;
+    reserved->is_infering.store(true);
+    seq_slots[seq_id].store(reserved.get(), std::memory_order_release);
+}
+
+int32_t LlamaMicoContext::swap_in_seq(int32_t swap_id) {
+    std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
+    int32_t seq_id = find_free_seq();
+    if (seq_id == -1) return -1;
+    free_seqs.erase(std::remove(free_seqs.begin(), free_seqs.end(), seq_id), free_seqs.end());
+    parked_seqs.remove(seq_id);  // NOTE: restoring the swapped kv replaces the parked one
+    auto swapped = seq_to_cmpl.find(swap_id);
+    if (swapped != seq_to_cmpl.end()) {
+        size_t swapped_cmpl = swapped->second;
+        seq_to_cmpl.erase(swapped);
+        bind_cmpl(swapped_cmpl, seq_id);
+    }
+
+    std::lock_guard<std::mutex> seqs_lock(process_seqs_mutex);
+    auto free_state = std::move(process_seqs[seq_id]);
+    move_state(swap_id, seq_id);
+    free_state->seq_id = swap_id;
+    free_state->kv_items.clear();
+    process_seqs[swap_id] = std::move(free_state);
+    route_lora(seq_id, process_seqs[seq_id]->lora);
+    return seq_id;
+}
+
+int32_t LlamaMicoContext::bind_follower(size_t cmpl_id) {
+    std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
+    int32_t follower_id = FOLLOWER_SEQ_BASE;  // NOTE: a stopping follower is unbound before it stops inferring
+    while (seq_to_cmpl.count(follower_id) > 0 || get_seq_state(follower_id).is_infering.load()) follower_id++;
+    get_seq_state(follower_id).is_infering.store(true);
+    bind_cmpl(cmpl_id, follower_id);
+    return follower_id;
+}
+
+std::vector<int32_t> LlamaMicoContext::reserve_forks(size_t n) {
+    std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
+    std::vector<int32_t> forks;
+    while (forks.size() < n && !free_seqs.empty()) {
+        forks.push_back(free_seqs.back());
+        free_seqs.pop_back();
+        get_seq_state(forks.back()).is_infering.store(true);
+    }
+    return forks;
+}
+
+void LlamaMicoContext::release_forks(const std::vector<int32_t>& forks) {
+    std::lock_guard<std::mutex> lock(cmpl_to_seq_mutex);
+    for (int32_t fork : forks) {
+        get_seq_state(fork).is_infering.store(false);
+        release_slot(fork);
+    }
+}
+
+const LoraAdapter* LlamaMicoContext::find_lora(const std::string& name) const {
+    if (name.empty()) return nullptr;
+    for (const auto& lora : lora_adapters) {
+        if (lora.name == name) return &lora;
+    }
+    return nullptr;
+}
+
+void LlamaMicoContext::route_lora(int32_t seq_id, const LoraAdapter* lora) {
+    if (lora_adapters.empty() || seq_id < 0 || seq_id >= n_seq_max) return;
+    get_seq_state(seq_id).lora = lora;
+    llama_adapter_lora* adapter = lora ? lora->adapter : nullptr;
+    float scale = lora ? lora->scale : 0.0f;
+    LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(memory_scheduler);
+    ms->submit_function_use_mem([this, seq_id, adapter, scale]() {
+        llama_set_adapter_lora_seq(lctx, seq_id, adapter, scale);
+    }, {seq_id});
+}
+
+// Draft model with its own kv, one sequence per llama sequence, NOTE: a vocab mismatch disables speculative decode
+// Without a draft model, prompt lookup drafts from the token history of each sequence if lookup_ngram is set
+void LlamaMicoContext::init_draft_model(common_params& params) {
+    if (params.speculative.n_max <= 0) return;
+    if (params.speculative.model.path.empty()) {
+        if (params.lookup_ngram <= 0) return;
+        n_lookup_ngram = params.lookup_ngram;
+        n_draft_max = params.speculative.n_max;
+        LOG_INF("prompt lookup drafting, %d-gram, %d draft tokens per step\n", n_lookup_ngram, n_draft_max);
+        return;
+    }
+    common_params params_dft = params;
+    params_dft.model = params.speculative.model;
+    params_dft.n_gpu_layers = params.speculative.n_gpu_layers;
+    params_dft.n_ctx = params.speculative.n_ctx > 0 ? params.speculative.n_ctx : params.n_ctx;
+    params_dft.n_seq_max = std::max(n_seq_max, 1);
+    params_dft.lora_adapters.clear();
+    params_dft.speculative.model.path.clear();
+    draft_init = common_init_from_params(params_dft);
+    draft_ctx = draft_init.context.get();
+    if (!draft_ctx) {
+        LOG_ERR("Failed to load draft model from %s\n", params.speculative.model.path.c_str());
+        return;
+    }
+    const llama_vocab* vocab_dft = llama_model_get_vocab(draft_init.model.get());
+    if (llama_vocab_n_tokens(vocab_dft) != llama_vocab_n_tokens(vocab) ||
+        llama_vocab_type(vocab_dft) != llama_vocab_type(vocab)) {
+        LOG_WRN("draft model vocab differs from the model, speculative decode disabled\n");
+        draft_ctx = nullptr;
+        draft_init = common_init_result();
+        return;
+    }
+    n_draft_max = params.speculative.n_max;
+    LOG_INF("draft model %s, %d draft tokens per step\n", params.speculative.model.path.c_str(), n_draft_max);
+}
+
+// Second copy of the model on prefill_devices with a context of the same cells and sequences, so the llama_state_seq
+// data of a sequence moves between the two contexts as it is. NOTE: lora adapters stay with the main context
+void LlamaMicoContext::init_prefill_model(common_params& params) {
+    if (params.prefill_devices.empty()) return;
+    common_params params_pf = params;
+    params_pf.devices = params.prefill_devices;
+    // NOTE: the device list ends with nullptr
+    params_pf.split_mode = params.prefill_devices.size() > 2 ? LLAMA_SPLIT_MODE_LAYER : LLAMA_SPLIT_MODE_NONE;
+    params_pf.main_gpu = 0;
+    std::fill(std::begin(params_pf.tensor_split), std::end(params_pf.tensor_split), 0.0f);
+    params_pf.lora_adapters.clear();
+    params_pf.speculative.model.path.clear();
+    prefill_init = common_init_from_params(params_pf);
+    prefill_ctx = prefill_init.context.get();
+    if (!prefill_ctx) {
+        LOG_ERR("Failed to load the prefill model on prefill_devices, prompts prefill on the model devices\n");
+        prefill_init = common_init_result();
+        return;
+    }
+    prefill_offload_tokens = std::max(1, params.prefill_offload_tokens);
+    LOG_INF("prefill model on %zu devices, prompts of %d uncached positions or more\n",
+            params.prefill_devices.size() - 1, prefill_offload_tokens);
+}
+
+// Image cache sized from the host memory available at init (the embeddings live in host memory), entries from the
+// budget over the embeddings of a small image
+void LlamaMicoContext::auto_size_modal_cache() {
+    size_t avail_mb = (size_t)sysconf(_SC_AVPHYS_PAGES) * (size_t)sysconf(_SC_PAGESIZE) >> 20;
+    if (image_cache_mb < 0) {
+        image_cache_mb = (int32_t)std::min<size_t>(avail_mb / IMAGE_CACHE_AUTO_MEM_DIV, IMAGE_CACHE_AUTO_MAX_MB);
+    }
+    if (image_cache_entries < 0) {
+        size_t image_bytes = (size_t)llama_model_n_embd(model) * IMAGE_CACHE_AUTO_TOKENS * sizeof(float);
+        if (image_cache_precision == "f16") image_bytes /= 2;
+        if (image_cache_precision == "q8") image_bytes /= 4;
+        image_cache_entries = (int32_t)std::max<size_t>(((size_t)image_cache_mb << 20) / image_bytes, 1);
+    }
+    LOG_INF("%s: %zu MB host memory available, image cache of %d entries, %d MB\n", __func__, avail_mb,
+            image_cache_entries, image_cache_mb);
+}
+
+// Decode a full n_ubatch and a single-token step on sequence 0
+static void warmup_ubatch(llama_context* lctx, const llama_vocab* vocab) {
+    const int32_t n_tokens = (int32_t)std::min(llama_n_ubatch(lctx), llama_n_ctx(lctx) - 1);
+    const llama_token token = llama_vocab_bos(vocab) != LLAMA_TOKEN_NULL ? llama_vocab_bos(vocab) : 0;
+    llama_batch batch = llama_batch_init(n_tokens, 0, 1);
+    for (int32_t i = 0; i < n_tokens; i++) common_batch_add(batch, token, i, {0}, i == n_tokens - 1);
+    bool ok = llama_decode(lctx, batch) == 0;
+    common_batch_clear(batch);
+    common_batch_add(batch, token, n_tokens, {0}, true);
+    ok = ok && llama_decode(lctx, batch) == 0;
+    llama_batch_free(batch);
+    if (!ok) LOG_WRN("%s: warmup failed at %d tokens\n", __func__, n_tokens);
+    llama_memory_seq_rm(llama_get_memory(lctx), 0, -1, -1);
+}
+
+// Encode a gray image of each size on every encoder, then decode it with some text on sequence 0, so the first request
+// does not build graphs, grow compute buffers or JIT kernels (Vulkan pipelines, see pipeline_cache_dir)
+void LlamaMicoContext::warmup(const std::vector<int32_t>& image_sizes, bool ubatch) {
+    if (!ubatch && (image_sizes.empty() || !shared_model->has_vision())) return;
+    int64_t t_start = ggml_time_ms();
+    if (ubatch) warmup_ubatch(lctx, vocab);
+    std::shared_ptr<mtmd_context> ctx_vision =
+        image_sizes.empty() || !shared_model->has_vision() ? nullptr : vision();
+    std::vector<int32_t> sizes = ctx_vision ? image_sizes : std::vector<int32_t>();
+    std::sort(sizes.begin(), sizes.end(), std::greater<int32_t>());  // NOTE: the largest reserves the buffers once
+    for (int32_t size : sizes) {
+        if (size <= 0) continue;
+        std::vector<unsigned char> gray((size_t)size * size * 3, 128);
+        mtmd::bitmap bitmap(size, size, gray.data());
+        const mtmd_bitmap* bitmaps[] = {bitmap.ptr.get()};
+        std::string prompt = std::string("warmup ") + MICO_DEFAULT_IMAGE_MARKER;
+        mtmd_input_text text{prompt.c_str(), false /* add_special */, true /* parse_special */};
+        mtmd::input_chunks chunks(mtmd_input_chunks_init());
+        if (mtmd_tokenize(ctx_vision.get(), chunks.ptr.get(), &text, bitmaps, 1) != 0) {
+            LOG_WRN("%s: failed to tokenize a %dx%d image, skip warmup\n", __func__, size, size);
+            return;
+        }
+
+        for (size_t worker = 1; worker < shared_model->n_vision_workers(); worker++) {
+            std::shared_ptr<mtmd_context> encoder = vision(worker);
+            std::lock_guard<std::mutex> lock(shared_model->encode_mutex(encoder.get()));
+            for (size_t i = 0; i < chunks.size(); i++) {
+                if (mtmd_input_chunk_get_type(chunks[i]) == MTMD_INPUT_CHUNK_TYPE_TEXT) continue;
+                if (mtmd_encode_chunk(encoder.get(), chunks[i]) != 0)
+                    LOG_WRN("%s: encoder warmup failed at %dx%d\n", __func__, size, size);
+            }
+        }
+        std::lock_guard<std::mutex> lock(shared_model->encode_mutex(ctx_vision.get()));
+        llama_pos n_past = 0;
+        if (mtmd_helper_eval_chunks(ctx_vision.get(), lctx, chunks.ptr.get(), 0, 0, n_batch, false, &n_past) != 0)
+            LOG_WRN("%s: warmup failed at %dx%d\n", __func__, size, size);
+        llama_memory_seq_rm(llama_get_memory(lctx), 0, -1, -1);
     }
+    llama_synchronize(lctx);
+    llama_perf_context_reset(lctx);
+    LOG_INF("%s: warmed up in %" PRId64 " ms\n", __func__, ggml_time_ms() - t_start);
 }
 
 bool LlamaMicoContext::check_antiprompt(const llama_tokens& generated_tokens) {
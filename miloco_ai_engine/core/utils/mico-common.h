@@ -6,65 +6,341 @@
 #define MICO_COMMON_H
 #include <limits.h>
 
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
 #include <map>
+#include <memory>
 #include <mutex>
+#include <unordered_map>
 
+#include "batch_scheduling/scheduler_task_info.h"
+#include "common/chat.h"
 #include "common/sampling.h"
 #include "mutil-modal/mtmd-helper.h"
 #include "mutil-modal/mtmd.h"
+#include "utils/chunk-hash.h"
 #include "utils/llama-memory-scheduling.h"
+#include "utils/mico-metrics.h"
+#include "utils/mico-trace.h"
+#include "utils/model-registry.h"
+#include "utils/request-arena.h"
+#include "utils/row-sampler.h"
 
-struct LlamaSeqState {
+#define PREEMPT_SEQ_BASE (1 << 20)  // ids of preempted sequences swapped to host, above every llama sequence id
+#define FOLLOWER_SEQ_BASE (1 << 24)  // ids of coalesced requests reading the tokens of another sequence, no kv
+#define DEFAULT_ERROR_SEQ_ID -1      // requests failed before they got a sequence, messages per calling thread
+#define SEQ_STATE_ALIGN 64           // cache line, states of different sequences never share one
+#define TIMINGS_KEPT_MAX 1024        // finished request timings kept for llama_mico_get_timings
+
+struct ModalEmbd;
+class ChatTemplateCache;
+class PromptBudget;
+class RequestLog;
+class OpProfiler;
+class ModalBufferPool;
+class FrameRings;
+
+// LoRA adapter of lora_adapters, a request selecting it routes its sequence to the adapter in the shared batches
+struct LoraAdapter {
+    std::string name;
+    llama_adapter_lora* adapter{nullptr};
+    float scale{1.0f};
+};
+
+// Pins the calling thread to the CPUs of its role, nothing if the role has no mask
+void set_thread_affinity(const cpu_params& cpu);
+
+// Identifies the model weights, state saved to disk is only valid for the same signature
+std::string model_signature(const llama_model* model);
+
+struct alignas(SEQ_STATE_ALIGN) LlamaSeqState {
+    int32_t seq_id{-1};  // key in process_seqs, a preempted sequence moves to an id >= PREEMPT_SEQ_BASE
+    int32_t priority{0};  // request priority, lower latency classes are preempted first
     std::atomic<llama_token> last_token{-1};
     std::atomic<size_t> n_past{0};
     // int n_max_genarate{INT_MAX};
     std::atomic<bool> is_infering{false};  // true if this sequence is already inferred
     std::string respone{""};               // last text generated for this sequence
+    std::string held_text{""};             // partial utf8 / stop string kept for the next generate call
+    std::vector<std::string> stop_strings;  // of the request, generated text ends before the first match
+    std::string stop_tail{""};              // decode loop: end of the generated text, a stop string may complete in it
+    int32_t max_tokens{0};                  // of the request, the decode loop retires the sequence once reached
+    // tool requests: chat format of the template, the decode loop parses call_text with it and retires the sequence
+    // once a whole tool call was generated (call_done), the format is CONTENT_ONLY for other requests
+    common_chat_syntax call_syntax;
+    std::string call_text{""};
+    bool call_done{false};
+    std::atomic<int32_t> n_kv_reserved{0};  // kv positions the request claimed at admission, -1 while it waits for
+                                            // them, 0 without kv_admission
+    std::atomic<int32_t> n_kv_budget{0};    // context limit granted to the request, 0 before grant_context
+    int64_t expire_ms{0};                   // of the request, its queued prompt chunks are dropped past it
+    std::atomic<bool> cancelled{false};     // llama_mico_cancel, the request fails at its stop
     mtmd::bitmaps bitmaps;
+    std::vector<std::shared_ptr<ModalEmbd>> pinned_embds;  // cached images tokenized without pixels
+    common_sampler* smpl{nullptr};  // per request sampler, nullptr falls back to LlamaMicoContext::smpl
+    bool greedy{false};             // smpl always picks the argmax, sampled on device
+    RowSampling row_sampling;       // smpl as plain top_k sampling, drawn by LlmScheduler's RowSampler with rng
+    std::mt19937 rng;
+    TokenPenalties penalties;       // of smpl, applied to the logits of RowSampler rows, fed every emitted token
+    size_t n_cache_items{0};        // prompt prefix items stored in the kv cache, 0 stores the whole prompt
+    std::string session{""};        // kv is kept in a session cache sequence when the request stops
+    // the kv is kept in this sequence as the frame window of the video session when the request stops, see video_seqs
+    std::string video_session{""};
+    bool cache_pin{false};          // the stored prompt prefix is never evicted from the kv cache
+    std::vector<PrefixItem> prompt_items;  // prefix items of the prompt, computed once when it is tokenized
+    std::vector<PrefixItem> kv_items;      // items in the kv of this sequence, prompt then decoded tokens
+    size_t n_resident_items{0};        // prompt items not prefilled: in the kv kept from the last request or evicted
+    size_t n_head_items{0};            // context shift: prompt items kept in kv before the evicted ones
+    size_t n_evicted_items{0};         // context shift: prompt items after the head never prefilled
+    // image_kv_keep: kv items before it are exact, an image from it on may have been thinned, so the kv past it is
+    // reused by this sequence only and never stored for other requests
+    size_t n_exact_items{SIZE_MAX};
+    // speculative decode: draft tokens of the in-flight step and the tokens its verification produced
+    int32_t n_drafted{0};
+    std::vector<llama_token> step_tokens;
+    std::vector<llama_token> forced_tokens;  // jump-forward: emitted, decoded ahead of last_token in the next step
+    int32_t n_generated{0};                  // tokens emitted by the decode loop for the request
+    const LoraAdapter* lora{nullptr};        // the kv of the sequence was decoded with, nullptr for the base model
+    std::unique_ptr<RequestTimings> timings;  // of a request asking for "timings", nullptr otherwise
+    std::shared_ptr<RequestArena> arena;      // scratch of the prompt of the request, its chunk tasks outlive it
+
+    // Token history of the sequence: the text tokens in its kv, prompt then decoded, images skipped
+    std::vector<llama_token> text_tokens() const;
+
+    // continuous decode loop output, filled by BatchScheduler and consumed by request_generate
+    std::deque<llama_token> generated_tokens;
+    bool decode_done{false};  // true once the decode loop retired this sequence
+    std::mutex token_mutex;
+    std::condition_variable token_condition;
+    // async request: receives tokens on the decode loop instead of generated_tokens, LLAMA_TOKEN_NULL once retired
+    std::function<void(llama_token)> token_sink;
+
+    // request coalescing, NOTE: guarded by the follow mutex of BatchScheduler
+    HashKey fingerprint;                    // leader until its prompt is inferred, identical requests join it
+    std::vector<LlamaSeqState*> followers;  // get every token of this sequence
+    LlamaSeqState* leader{nullptr};         // of a follower
+    // response memoisation: fingerprint of a greedy request and its tokens so far, stored once it ends generation
+    HashKey response_key;
+    std::vector<llama_token> response_tokens;
+
+    ~LlamaSeqState() {
+        if (smpl) common_sampler_free(smpl);
+    }
 };
 
 struct LlamaMicoContext {
-    mtmd::context_ptr ctx_vision;   // for modal
-    common_init_result llama_init;  // initialize/release llama_context manually
+    std::shared_ptr<SharedModel> shared_model;  // weights and vision contexts, shared with other handles of the model
+    common_init_result llama_init;  // initialize/release llama_context manually, the model is in shared_model
+    common_init_result draft_init;  // optional draft model of speculative decode, sharing the vocab
+    llama_context* draft_ctx{nullptr};
+    int32_t n_draft_max{0};  // draft tokens per sequence and step
+    int32_t n_lookup_ngram{0};  // prompt lookup drafting without draft_ctx, longest n-gram matched
+    common_init_result prefill_init;  // optional copy of the model on prefill_devices, prefilling long prompts
+    llama_context* prefill_ctx{nullptr};
+    int32_t prefill_offload_tokens{0};  // uncached prompt positions from which a prompt prefills on prefill_ctx
+    // data parallel replicas on replica_devices, the handle is the first and routes the requests, empty for one
+    std::vector<LlamaMicoContext*> replicas;
+    std::vector<LoraAdapter> lora_adapters;  // loaded in llama_init, routed per sequence
 
-    llama_model* model;
-    llama_context* lctx;
-    const llama_vocab* vocab;
+    llama_model* model{nullptr};
+    llama_context* lctx{nullptr};
+    const llama_vocab* vocab{nullptr};
     std::vector<llama_token> crop_tokens_lable;
+    std::vector<int32_t> crop_lable_next;  // KMP table of crop_tokens_lable: longest proper border of each prefix
 
-    common_sampler* smpl;
+    common_sampler* smpl{nullptr};
+    common_params_sampling sampling;  // defaults of per request samplers
     int32_t n_batch;
     int32_t n_seq_max;
     int32_t n_usage_context;
+    // StreamingLLM style context shift: a full sequence keeps its head (system prompt, at least n_sink_tokens) and
+    // evicts the oldest items after it in kv, positions of the rest move down with no re-prefill
+    bool context_shift;
+    int32_t n_sink_tokens;
 
     // cache
     int32_t kv_cache_seq;
+    std::string kv_cache_path;  // snapshot file, empty disables
+    size_t kv_cache_host_bytes;  // host tier of the cache, 0 disables
+    int32_t kv_cache_pin_max;    // cache sequences pinned prompts may hold
+    int32_t kv_cache_class_seqs[TASK_CLASS_COUNT];  // cache sequences prompts of each latency class may hold
+    std::string image_cache_precision;  // f32, f16 or q8 storage of cached image embeddings
+    int32_t frame_dedup_bits;           // perceptual hash distance of near-duplicate frames, 0 disables
+    int32_t image_cache_entries;
+    int32_t image_cache_mb;
+    std::string image_cache_disk_path;  // disk tier of evicted image embeddings, empty disables
+    int32_t image_cache_disk_mb;
+    int32_t image_cache_shm_mb;    // shared memory tier of image embeddings across processes, 0 disables
+    std::string mmproj_signature;  // names the shared tier, processes of the same mmproj share it
+    int32_t image_kv_entries;
+    int32_t image_kv_seq{-1};  // sequence holding the reused image kv, after the request ones, -1 if disabled
+    std::atomic<int32_t> n_image_kv_pos{0};  // kv positions it holds
+    float adaptive_resolution_step;  // queued encodes per worker lowering the image side one level, 0 disables
+    float image_kv_keep;  // fraction of the kv cells of each prompt image kept after prefill (SnapKV), 0 disables
+    size_t preempt_host_bytes;  // host memory of swapped out preempted sequences, 0 disables preemption
+    bool coalesce_requests;     // identical greedy requests in prefill share one sequence
+    size_t response_cache_bytes;  // completions of greedy requests replayed for identical ones, 0 disables
+    int32_t response_cache_ttl_s;
+    size_t admission_queue_max;  // requests waiting for a free sequence, 0 rejects them at once
+    int32_t admission_wait_ms;   // longest wait of one, 0 until its deadline
+    bool kv_admission;           // a request is admitted once its projected kv fits, see reserve_kv
+    int32_t kv_output_reserve;   // output tokens projected for a request without max_tokens
+    int32_t swa_window{0};       // positions the sliding window layers attend, 0 without them or with kv_swa_full
+
+    // batching
+    int32_t batch_wait_ms;     // longest wait of a partial prefill or image batch for more requests
+    int32_t text_batch_size;   // prefill tokens, <= n_batch
+    int32_t decode_step_size;  // tokens of a step with decoding sequences, <= n_batch
+    int32_t sample_threads;    // select the top_k candidates of plain sampled rows, 0 samples every row by its chain
+    int32_t image_batch_size;  // image tokens, <= n_batch
+
+    // latency classes, a request with priority >= slo_class_priorities[0] is interactive, >= [1] rule trigger,
+    // background otherwise, queued work is served earliest (enqueue + slo_target_ms[class]) first
+    int32_t slo_class_priorities[TASK_CLASS_COUNT - 1];
+    int32_t slo_target_ms[TASK_CLASS_COUNT];
+
+    ggml_threadpool* threadpool{nullptr};        // persistent ggml compute threads on cpu_mask, nullptr without CPU
+    ggml_threadpool* threadpool_batch{nullptr};  // prompt batches, cpu_mask_batch, nullptr if the same as threadpool
+    cpu_params cpu_encoder;    // masks of the engine thread roles, see set_thread_affinity
+    cpu_params cpu_scheduler;
+    cpu_params cpu_prepare;
 
     void* batch_scheduler{nullptr};   // batch scheduler
     void* memory_scheduler{nullptr};  // batch scheduler
+    void* async_scheduler{nullptr};   // async request scheduler
+    void* prompt_frontend{nullptr};   // prompt preparing worker pool
+    MicoMetrics metrics;              // stage latencies and batch fill, see llama_mico_get_metrics
+    int32_t n_prepare_workers;
 
-    // state for sequences
-    std::map<size_t, LlamaSeqState> process_seqs;
+    // state for sequences, slots [0, n_seq_max) are read without a lock, other ids (errors, swapped out) in the map
+    std::unique_ptr<std::atomic<LlamaSeqState*>[]> seq_slots;
+    std::map<size_t, std::unique_ptr<LlamaSeqState>> process_seqs;  // owns every state, slot states included
+    LlamaSeqState error_state;  // DEFAULT_ERROR_SEQ_ID, requests failed before they got a sequence
     mutable std::mutex process_seqs_mutex;
 
-    std::map<size_t, int32_t> cmpl_to_seq;
+    // Output of a request that did not fit the buffer of an _into call, kept by request id until taken
+    struct PendingOutput {
+        std::string text;
+        int32_t is_finished{0};
+        int32_t ret{0};
+    };
+    std::unordered_map<int32_t, PendingOutput> pending_outputs;
+    std::atomic<size_t> n_pending_outputs{0};  // NOTE: read without the lock, no lookup while nothing is kept
+    std::mutex pending_outputs_mutex;
+
+    // "timings" of finished requests by request id until taken, the oldest dropped past TIMINGS_KEPT_MAX
+    std::unordered_map<int32_t, std::string> finished_timings;
+    std::deque<int32_t> finished_timings_order;
+    std::mutex finished_timings_mutex;
+
+    std::unordered_map<size_t, int32_t> cmpl_to_seq;
+    std::unordered_map<int32_t, size_t> seq_to_cmpl;
+    std::vector<int32_t> free_seqs;  // slots neither inferring nor parked, next admission from the back
     mutable std::mutex cmpl_to_seq_mutex;
+    std::mutex seq_move_mutex;  // held while a sequence is stopped or moves to another id, see swap_out_seq
+    std::mutex kv_admission_mutex;  // one request claims kv or is granted a context budget at a time
+    std::atomic<int32_t> n_kv_granted{0};  // sum of the n_kv_budget of the requests
+    std::condition_variable kv_released;
+
+    // finished sequences keeping their kv for a request with the same prefix, oldest first
+    std::list<int32_t> parked_seqs;
+    int32_t n_park_context;  // kv positions all parked sequences may keep
+    // video sessions and the sequence keeping the kv of their frame window (head and frames up to the last one) between
+    // requests, neither free nor parked, at most video_session_max
+    std::unordered_map<std::string, int32_t> video_seqs;
+    int32_t video_session_max;
 
     std::string media_marker = MICO_DEFAULT_IMAGE_MARKER;
     common_chat_templates_ptr tmpls;
+    std::shared_ptr<ChatTemplateCache> chat_cache;  // rendered and tokenized system prefixes of prompts
+    std::shared_ptr<PromptBudget> prompt_budget;    // prompt token estimates, turns over budget are never rendered
+    std::shared_ptr<RequestLog> request_log;        // recorded traffic for replay, nullptr when off
+    std::shared_ptr<OpProfiler> op_profiler;        // per op times of the llm and vision graphs, nullptr when off
+    std::shared_ptr<ModalBufferPool> modal_buffers;  // registered modal buffers, see llama_mico_register_buffer
+    std::shared_ptr<FrameRings> frame_rings;         // camera frames shared by the ingest process
     llama_tokens antiprompt_tokens;
     int n_threads = 1;
 
     LlamaMicoContext(common_params& params);
     ~LlamaMicoContext();
 
-    LlamaSeqState& get_seq_state(size_t seq_id);
+    LlamaSeqState& get_seq_state(size_t seq_id);  // NOTE: no lock for slot ids and DEFAULT_ERROR_SEQ_ID
     int32_t set_seq_id(size_t cmpl_id);
     int32_t get_seq_id(size_t cmpl_id);
+    // State of an inferring request wherever preemption moved it, nullptr if it is not inferring
+    LlamaSeqState* get_cmpl_state(size_t cmpl_id);
     bool erase_seq(int32_t seq_id);
+    // "timings" JSON of a finished request, kept until taken or TIMINGS_KEPT_MAX newer ones replaced it
+    void keep_timings(int32_t request_id, std::string timings);
+    bool take_timings(int32_t request_id, std::string& timings);
+    // Elastic context budget of a sequence: n_usage_context is guaranteed, beyond it the request is granted the kv
+    // cells of the shared pool no cache holds and no other request was granted. A budget is granted once when the
+    // prompt is prepared and kept until the request stops, later requests only get what is left
+    int32_t seq_context_limit(int32_t seq_id);  // the granted budget, what a grant would give without one
+    int32_t grant_context(int32_t seq_id);
+    void trim_context(LlamaSeqState& state, int32_t n_pos);  // the request needs at most n_pos, the rest goes back
+    int32_t kv_held();                   // kv positions of prompt cache, image kv, parked and video sequences
+    int32_t kv_claimed(int32_t seq_id);  // kv positions held or guaranteed by everything but seq_id
+    // kv admission: claims n_pos kv positions (prompt plus the output it may generate) for seq_id once they fit the
+    // cells no other sequence or cache holds or has claimed, waiting for releases until until_ms (ms, ggml_time_ms).
+    // False if they do not fit by then, the request was cancelled or they could never fit
+    bool reserve_kv(int32_t seq_id, int32_t n_pos, int64_t until_ms);
+    void release_kv(LlamaSeqState& state);  // the stopped request gives its claim and budget back
+    // Moves the request from its reserved seq_id to the free sequence whose kv holds the longest prefix of items,
+    // kv past that prefix is dropped and the reused item count kept in n_resident_items
+    // shift_limit > 0 (context shift): kv after the prefix is also reused where it matches later items (the items in
+    // between were evicted before), then the oldest items after the prefix are evicted until the prompt fits
+    // Only kv decoded with the same lora adapter is reused, the bound sequence is routed to lora
+    // video_session: the sequence keeping its window is taken, kv frames before the first frame of items leave and
+    // the frames after them slide down to the prefix, so only the new frames and the question are prefilled
+    int32_t bind_seq_prefix(size_t cmpl_id, int32_t seq_id, const std::vector<PrefixItem>& items,
+                            const LoraAdapter* lora, int32_t shift_limit = 0,
+                            const std::string& video_session = std::string());
+    // Context shift of a full decoding sequence: the older half after its head leaves the kv, false if nothing could
+    bool shift_seq_context(LlamaSeqState& state);
+    // Releases a finished sequence and keeps its kv, the oldest parked sequences are cleared over n_park_context
+    // A video session request keeps its frame window in the sequence instead, see video_seqs
+    void park_seq(int32_t seq_id);
+    void release_video_session(const std::string& session);
+    bool has_video_session(const std::string& session);  // a sequence keeps its frame window
+    // Preemption, NOTE: seq_move_mutex must be held and the kv already moved
+    // Moves the state of seq_id to swap_id and reserves seq_id for cmpl_id
+    void swap_out_seq(int32_t seq_id, int32_t swap_id, size_t cmpl_id);
+    // Moves the state of swap_id back into a free sequence, -1 if there is none
+    int32_t swap_in_seq(int32_t swap_id);
+    // Binds cmpl_id to a free follower id (>= FOLLOWER_SEQ_BASE), its state is marked inferring
+    int32_t bind_follower(size_t cmpl_id);
+    // Up to n free sequences (never parked ones) bound to no request, marked inferring, see BatchScheduler::score
+    std::vector<int32_t> reserve_forks(size_t n);
+    void release_forks(const std::vector<int32_t>& forks);
+    // Adapter of lora_adapters named name, nullptr for an empty or unknown name
+    const LoraAdapter* find_lora(const std::string& name) const;
+    // Decodes of seq_id add the delta of lora from the next memory command on, nullptr for the base model
+    void route_lora(int32_t seq_id, const LoraAdapter* lora);
 
-    void init_vision_context(common_params& params);
+    // Vision context of encoder worker i, loaded on demand (mmproj_lazy), nullptr if the model is text only
+    // NOTE: hold the pointer while using it, an idle unload may drop the context meanwhile
+    std::shared_ptr<mtmd_context> vision(size_t i = 0) { return shared_model->vision(i); }
+    // Text of a generated token out of the shared piece table, no allocation
+    std::string_view token_piece(llama_token token) const { return shared_model->pieces->piece(token); }
+    void init_draft_model(common_params& params);
+    void init_prefill_model(common_params& params);
+    void warmup(const std::vector<int32_t>& image_sizes, bool ubatch);
+    void auto_size_modal_cache();
     bool check_antiprompt(const llama_tokens& generated_tokens);
+
+  private:
+    void attach_threadpools(const common_params& params);  // persistent ggml compute threads of cpu_mask(_batch)
+    // NOTE: cmpl_to_seq_mutex must be held for the slot helpers below
+    int32_t find_free_seq();  // a free slot, else the oldest parked one
+    void release_slot(int32_t seq_id);  // back to free_seqs unless parked, inferring or keeping a video window
+    int32_t video_seq(const std::string& session);  // sequence keeping the window of session, -1 for none
+    bool keep_video_window(int32_t seq_id);  // kv of a finished request becomes the window of its video session
+    void bind_cmpl(size_t cmpl_id, int32_t seq_id);
+    // Moves the state owned under from_id to to_id and publishes it in its slot, NOTE: process_seqs_mutex must be held
+    void move_state(size_t from_id, size_t to_id);
 };
 
 #endif  // MICO_COMMON_H
\ No newline at end of file
@@ -5,6 +5,8 @@
 
 #include "mico-config.h"
 
+#include <algorithm>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
 
@@ -33,6 +35,111 @@ using json = nlohmann::ordered_json;
 }
 */
 
+// Registers a ggml-rpc device of each endpoint, named RPC[endpoint], NOTE: needs a GGML_RPC build
+static bool add_rpc_devices(const std::vector<std::string>& endpoints) {
+    ggml_backend_reg_t rpc_reg = ggml_backend_reg_by_name("RPC");
+    if (!rpc_reg) {
+        LOG_ERR("ERR: ggml-rpc backend not built, GGML_RPC is off\n");
+        return false;
+    }
+    typedef ggml_backend_dev_t (*ggml_backend_rpc_add_device_t)(const char* endpoint);
+    auto add_device =
+        (ggml_backend_rpc_add_device_t)ggml_backend_reg_get_proc_address(rpc_reg, "ggml_backend_rpc_add_device");
+    if (!add_device) return false;
+    for (const auto& endpoint : endpoints) {
+        std::string name = "RPC[" + endpoint + "]";
+        if (ggml_backend_dev_by_name(name.c_str())) continue;  // registered by an earlier handle
+        ggml_backend_dev_t dev = add_device(endpoint.c_str());
+        if (!dev) {
+            LOG_ERR("ERR: failed to connect the encoder rpc server %s\n", endpoint.c_str());
+            return false;
+        }
+        ggml_backend_device_register(dev);
+    }
+    return true;
+}
+
+// Keeps a captured CUDA graph per decode shape (batch size, n_kv) instead of one, NOTE: process wide
+static bool set_decode_graphs(int n_graphs) {
+    ggml_backend_reg_t cuda_reg = ggml_backend_reg_by_name("CUDA");
+    if (!cuda_reg) {
+        LOG_WRN("WRN: decode_graphs needs the CUDA backend, ignored\n");
+        return true;
+    }
+    typedef void (*ggml_backend_cuda_set_graph_cache_t)(int n_graphs);
+    auto set_graph_cache = (ggml_backend_cuda_set_graph_cache_t)ggml_backend_reg_get_proc_address(
+        cuda_reg, "ggml_backend_cuda_set_graph_cache");
+    if (!set_graph_cache) return false;
+    set_graph_cache(n_graphs);
+    return true;
+}
+
+// Persists compiled Vulkan pipelines in dir, keyed by device and driver, NOTE: process wide, before the first model
+static bool set_pipeline_cache(const std::string& dir) {
+    ggml_backend_reg_t vk_reg = ggml_backend_reg_by_name("Vulkan");
+    if (!vk_reg) {
+        LOG_WRN("WRN: pipeline_cache_dir needs the Vulkan backend, ignored\n");
+        return true;
+    }
+    typedef void (*ggml_backend_vk_set_pipeline_cache_t)(const char* dir);
+    auto set_cache = (ggml_backend_vk_set_pipeline_cache_t)ggml_backend_reg_get_proc_address(
+        vk_reg, "ggml_backend_vk_set_pipeline_cache");
+    if (!set_cache) return false;
+    std::error_code ec;
+    if (!dir.empty() && !std::filesystem::create_directories(dir, ec) && ec) {
+        LOG_ERR("ERR: cannot create pipeline_cache_dir %s: %s\n", dir.c_str(), ec.message().c_str());
+        return false;
+    }
+    set_cache(dir.c_str());
+    return true;
+}
+
+// KV cache types of the unified cache, the quantized ones need flash attention for V
+static bool parse_cache_type(const std::string& name, ggml_type& type) {
+    static const ggml_type types[] = {GGML_TYPE_F32,  GGML_TYPE_F16,  GGML_TYPE_BF16, GGML_TYPE_Q8_0,
+                                      GGML_TYPE_Q4_0, GGML_TYPE_Q4_1, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1};
+    for (ggml_type t : types) {
+        if (name == ggml_type_name(t)) {
+            type = t;
+            return true;
+        }
+    }
+    LOG_WRN("WRN: unknown kv cache type %s, using %s\n", name.c_str(), ggml_type_name(type));
+    return false;
+}
+
+// CPU mask of a thread role: comma separated "<first>-<last>" ranges or "0x" hex masks, e.g. "0-27,56-83"
+static bool parse_cpu_affinity(const std::string& spec, cpu_params& cpu) {
+    std::fill(std::begin(cpu.cpumask), std::end(cpu.cpumask), false);
+    size_t begin = 0;
+    bool ok = !spec.empty();
+    while (ok && begin <= spec.size()) {
+        size_t end = std::min(spec.find(',', begin), spec.size());
+        std::string part = spec.substr(begin, end - begin);
+        bool range = part.find('-') != std::string::npos;
+        ok = range ? parse_cpu_range(part, cpu.cpumask) : parse_cpu_mask(part, cpu.cpumask);
+        begin = end + 1;
+    }
+    cpu.mask_valid = ok;
+    if (!ok) LOG_WRN("WRN: invalid cpu mask %s, threads are not pinned\n", spec.c_str());
+    return ok;
+}
+
+// NUMA placement of the ggml compute threads and of the weights they first touch, NOTE: process wide
+static bool parse_numa(const std::string& name, ggml_numa_strategy& numa) {
+    static const std::pair<const char*, ggml_numa_strategy> strategies[] = {
+        {"distribute", GGML_NUMA_STRATEGY_DISTRIBUTE}, {"isolate", GGML_NUMA_STRATEGY_ISOLATE},
+        {"numactl", GGML_NUMA_STRATEGY_NUMACTL}};
+    for (const auto& [strategy_name, strategy] : strategies) {
+        if (name == strategy_name) {
+            numa = strategy;
+            return true;
+        }
+    }
+    LOG_WRN("WRN: unknown numa strategy %s, NUMA placement is off\n", name.c_str());
+    return false;
+}
+
 bool config_params_parse_json(const char* config_json, common_params& params) {
     if (!config_json) {
         LOG_ERR("ERR: config json is empty\n");
@@ -61,6 +168,43 @@ bool config_params_parse_json(const char* config_json, common_params& params) {
         if (config.contains("n_gpu_layers")) {
             params.n_gpu_layers = config["n_gpu_layers"].get<int32_t>();
         }
+        if (config.contains("model_devices")) {  // NOTE: the LLM only, encoders are placed by encoder_devices
+            params.devices.clear();
+            for (const auto& name : config["model_devices"].get<std::vector<std::string>>()) {
+                ggml_backend_dev_t dev = ggml_backend_dev_by_name(name.c_str());
+                if (!dev || ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_GPU) {
+                    LOG_ERR("ERR: model device %s not found\n", name.c_str());
+                    res = false;
+                    continue;
+                }
+                params.devices.push_back(dev);
+            }
+            params.devices.push_back(nullptr);
+        }
+        if (config.contains("main_gpu")) {
+            params.main_gpu = config["main_gpu"].get<int32_t>();
+        }
+        if (config.contains("split_mode")) {
+            std::string mode = config["split_mode"].get<std::string>();
+            if (mode == "none")
+                params.split_mode = LLAMA_SPLIT_MODE_NONE;
+            else if (mode == "layer")
+                params.split_mode = LLAMA_SPLIT_MODE_LAYER;
+            else if (mode == "row")
+                params.split_mode = LLAMA_SPLIT_MODE_ROW;
+            else
+                LOG_WRN("WRN: unknown split_mode %s, using none\n", mode.c_str());
+        }
+        if (config.contains("tensor_split")) {
+            auto split = config["tensor_split"].get<std::vector<float>>();
+            if (split.size() > llama_max_devices()) {
+                LOG_ERR("ERR: tensor_split has %zu values, at most %zu devices\n", split.size(), llama_max_devices());
+                res = false;
+            } else {
+                std::fill(std::begin(params.tensor_split), std::end(params.tensor_split), 0.0f);
+                std::copy(split.begin(), split.end(), params.tensor_split);
+            }
+        }
         if (config.contains("total_context_num")) {
             params.n_ctx = config["total_context_num"].get<int32_t>();
         }
@@ -72,6 +216,54 @@ bool config_params_parse_json(const char* config_json, common_params& params) {
         if (config.contains("n_ubatch")) {
             params.n_ubatch = config["n_ubatch"].get<int32_t>();
         }
+        if (config.contains("prefill_ubatch")) {
+            params.n_ubatch = config["prefill_ubatch"].get<int32_t>();
+        }
+        if (config.contains("decode_ubatch")) {
+            params.n_ubatch_decode = config["decode_ubatch"].get<int32_t>();
+        }
+        if (config.contains("weight_stream_tokens")) {
+            params.weight_stream_tokens = config["weight_stream_tokens"].get<int32_t>();
+        }
+        if (config.contains("pipeline_microbatches")) {
+            params.pipeline_microbatches = config["pipeline_microbatches"].get<int32_t>();
+        }
+        if (config.contains("prefill_devices")) {
+            params.prefill_devices.clear();
+            for (const auto& name : config["prefill_devices"].get<std::vector<std::string>>()) {
+                ggml_backend_dev_t dev = ggml_backend_dev_by_name(name.c_str());
+                if (!dev || ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_GPU) {
+                    LOG_ERR("ERR: prefill device %s not found\n", name.c_str());
+                    res = false;
+                    continue;
+                }
+                params.prefill_devices.push_back(dev);
+            }
+            if (!params.prefill_devices.empty()) params.prefill_devices.push_back(nullptr);
+        }
+        if (config.contains("prefill_offload_tokens")) {
+            params.prefill_offload_tokens = config["prefill_offload_tokens"].get<int32_t>();
+        }
+        if (config.contains("replica_devices")) {  // NOTE: each replica holds the whole LLM, model_devices is ignored
+            params.replica_devices.clear();
+            for (const auto& name : config["replica_devices"].get<std::vector<std::string>>()) {
+                ggml_backend_dev_t dev = ggml_backend_dev_by_name(name.c_str());
+                if (!dev || ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_GPU) {
+                    LOG_ERR("ERR: replica device %s not found\n", name.c_str());
+                    res = false;
+                    continue;
+                }
+                params.replica_devices.push_back(dev);
+            }
+        }
+        // NOTE: llama_decode runs the ubatches of a batch back to back, with layer split each GPU starts the next
+        // one while the later layers of this one run on the other GPU. An explicit prefill_ubatch wins
+        if (params.pipeline_microbatches > 1 && !config.contains("prefill_ubatch") && !config.contains("n_ubatch")) {
+            if (params.split_mode == LLAMA_SPLIT_MODE_LAYER)
+                params.n_ubatch = std::max(params.n_batch / params.pipeline_microbatches, 32);
+            else
+                LOG_WRN("WRN: pipeline_microbatches needs split_mode layer, ignored\n");
+        }
 
         if (config.contains("n_seq_max")) {
             params.n_seq_max = config["n_seq_max"].get<int32_t>();
@@ -79,9 +271,245 @@ bool config_params_parse_json(const char* config_json, common_params& params) {
         if (config.contains("cache_seq_num")) {
             params.cache_seq = config["cache_seq_num"].get<int32_t>();
         }
+        if (config.contains("autotune")) {
+            params.autotune = config["autotune"].get<bool>();
+        }
+        if (config.contains("autotune_latency_ms")) {
+            params.autotune_latency_ms = config["autotune_latency_ms"].get<int32_t>();
+        }
+        if (config.contains("kv_defrag_thold")) {
+            params.kv_defrag_thold = config["kv_defrag_thold"].get<float>();
+        }
+        if (config.contains("kv_defrag_idle_ms")) {
+            params.kv_defrag_idle_ms = config["kv_defrag_idle_ms"].get<int32_t>();
+        }
+        if (config.contains("kv_swa_full")) {
+            params.swa_full = config["kv_swa_full"].get<bool>();
+        }
+        if (config.contains("flash_attn")) {
+            params.flash_attn = config["flash_attn"].get<bool>();
+        }
+        if (config.contains("cache_type_k")) {
+            parse_cache_type(config["cache_type_k"].get<std::string>(), params.cache_type_k);
+        }
+        if (config.contains("cache_type_v")) {
+            parse_cache_type(config["cache_type_v"].get<std::string>(), params.cache_type_v);
+        }
+        if (ggml_is_quantized(params.cache_type_v) && !params.flash_attn) {
+            LOG_INF("INF: quantized V cache %s, enabling flash attention\n", ggml_type_name(params.cache_type_v));
+            params.flash_attn = true;
+        }
+        if (config.contains("cache_path")) {
+            params.cache_path = config["cache_path"].get<std::string>();
+        }
+        if (config.contains("cache_host_mb")) {
+            params.cache_host_mb = config["cache_host_mb"].get<size_t>();
+        }
+        if (config.contains("cache_pin_max")) {
+            params.cache_pin_max = config["cache_pin_max"].get<int32_t>();
+        }
+        if (config.contains("cache_class_seqs")) {
+            params.cache_class_seqs = config["cache_class_seqs"].get<std::vector<int32_t>>();
+        }
+        if (config.contains("preempt_host_mb")) {
+            params.preempt_host_mb = config["preempt_host_mb"].get<size_t>();
+        }
+        if (config.contains("coalesce_requests")) {
+            params.coalesce_requests = config["coalesce_requests"].get<bool>();
+        }
+        if (config.contains("response_cache_mb")) {
+            params.response_cache_mb = config["response_cache_mb"].get<int32_t>();
+        }
+        if (config.contains("response_cache_ttl_s")) {
+            params.response_cache_ttl_s = config["response_cache_ttl_s"].get<int32_t>();
+        }
+        if (config.contains("admission_queue_max")) {
+            params.admission_queue_max = config["admission_queue_max"].get<int32_t>();
+        }
+        if (config.contains("admission_wait_ms")) {
+            params.admission_wait_ms = config["admission_wait_ms"].get<int32_t>();
+        }
+        if (config.contains("kv_admission")) {
+            params.kv_admission = config["kv_admission"].get<bool>();
+        }
+        if (config.contains("kv_output_reserve")) {
+            params.kv_output_reserve = config["kv_output_reserve"].get<int32_t>();
+        }
+        if (config.contains("park_context_num")) {
+            params.park_context = config["park_context_num"].get<int32_t>();
+        }
+        if (config.contains("video_sessions")) {
+            params.video_session_max = config["video_sessions"].get<int32_t>();
+        }
+        if (config.contains("encoder_workers")) {
+            params.n_encoder_workers = config["encoder_workers"].get<int32_t>();
+        }
+        if (config.contains("prepare_workers")) {
+            params.n_prepare_workers = config["prepare_workers"].get<int32_t>();
+        }
+        if (config.contains("request_log_path")) {
+            params.request_log_path = config["request_log_path"].get<std::string>();
+        }
+        if (config.contains("op_profile")) {
+            params.op_profile = config["op_profile"].get<bool>();
+        }
+        if (config.contains("encoder_devices")) {
+            params.encoder_devices = config["encoder_devices"].get<std::vector<std::string>>();
+        }
+        if (config.contains("encoder_rpc_servers")) {
+            auto endpoints = config["encoder_rpc_servers"].get<std::vector<std::string>>();
+            res &= add_rpc_devices(endpoints);
+            // NOTE: llama_model_load puts every registered RPC device first, the LLM stays on the local GPUs
+            if (params.devices.empty()) {
+                for (size_t i = 0; i < ggml_backend_dev_count(); i++) {
+                    ggml_backend_dev_t dev = ggml_backend_dev_get(i);
+                    if (ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_GPU) continue;
+                    if (std::string(ggml_backend_reg_name(ggml_backend_dev_backend_reg(dev))) == "RPC") continue;
+                    params.devices.push_back(dev);
+                }
+                params.devices.push_back(nullptr);
+            }
+            if (!config.contains("encoder_devices")) {  // NOTE: each remote GPU takes its share of the encoder workers
+                for (const auto& endpoint : endpoints) params.encoder_devices.push_back("RPC[" + endpoint + "]");
+            }
+        }
+        if (config.contains("kv_pad")) {
+            params.n_kv_pad = config["kv_pad"].get<int32_t>();
+        }
+        if (config.contains("decode_graphs")) {
+            res &= set_decode_graphs(config["decode_graphs"].get<int32_t>());
+        }
+        if (config.contains("pipeline_cache_dir")) {
+            res &= set_pipeline_cache(config["pipeline_cache_dir"].get<std::string>());
+        }
+        if (config.contains("image_cache_precision")) {
+            params.image_cache_precision = config["image_cache_precision"].get<std::string>();
+        }
+        if (config.contains("frame_dedup_threshold")) {
+            params.frame_dedup_bits = config["frame_dedup_threshold"].get<int32_t>();
+        }
+        if (config.contains("warmup_image_sizes")) {
+            params.warmup_image_sizes = config["warmup_image_sizes"].get<std::vector<int32_t>>();
+        }
+        if (config.contains("warmup_ubatch")) {
+            params.warmup_ubatch = config["warmup_ubatch"].get<bool>();
+        }
+        if (config.contains("image_cache_entries")) {
+            params.image_cache_entries = config["image_cache_entries"].get<int32_t>();
+        }
+        if (config.contains("image_cache_mb")) {
+            params.image_cache_mb = config["image_cache_mb"].get<int32_t>();
+        }
+        if (config.contains("image_cache_disk_path")) {
+            params.image_cache_disk_path = config["image_cache_disk_path"].get<std::string>();
+        }
+        if (config.contains("image_cache_disk_mb")) {
+            params.image_cache_disk_mb = config["image_cache_disk_mb"].get<int32_t>();
+        }
+        if (config.contains("image_cache_shm_mb")) {
+            params.image_cache_shm_mb = config["image_cache_shm_mb"].get<int32_t>();
+        }
+        if (config.contains("image_kv_entries")) {
+            params.image_kv_entries = config["image_kv_entries"].get<int32_t>();
+        }
+        if (config.contains("adaptive_resolution_step")) {
+            params.adaptive_resolution_step = config["adaptive_resolution_step"].get<float>();
+        }
+        if (config.contains("image_kv_keep")) {
+            params.image_kv_keep = config["image_kv_keep"].get<float>();
+        }
+        if (config.contains("batch_wait_ms")) {
+            params.batch_wait_ms = config["batch_wait_ms"].get<int32_t>();
+        }
+        if (config.contains("text_batch_size")) {
+            params.text_batch_size = config["text_batch_size"].get<int32_t>();
+        }
+        if (config.contains("image_batch_size")) {
+            params.image_batch_size = config["image_batch_size"].get<int32_t>();
+        }
+        if (config.contains("slo_class_priorities")) {
+            params.slo_class_priorities = config["slo_class_priorities"].get<std::vector<int32_t>>();
+        }
+        if (config.contains("slo_target_ms")) {
+            params.slo_target_ms = config["slo_target_ms"].get<std::vector<int32_t>>();
+        }
+        params.speculative.n_max = 4;
+        if (config.contains("draft_model_path")) {
+            params.speculative.model.path = config["draft_model_path"].get<std::string>();
+        }
+        if (config.contains("draft_max_tokens")) {
+            params.speculative.n_max = config["draft_max_tokens"].get<int32_t>();
+        }
+        if (config.contains("lookup_ngram_size")) {
+            params.lookup_ngram = config["lookup_ngram_size"].get<int32_t>();
+        }
+        if (config.contains("lora_adapters")) {  // NOTE: loaded next to the base weights, applied per request
+            for (const auto& adapter : config["lora_adapters"]) {
+                common_adapter_lora_info lora{adapter.at("path").get<std::string>(), adapter.value("scale", 1.0f),
+                                              nullptr, adapter.at("name").get<std::string>()};
+                params.lora_adapters.push_back(std::move(lora));
+            }
+            params.lora_init_without_apply = true;
+        }
+        if (config.contains("draft_gpu_layers")) {
+            params.speculative.n_gpu_layers = config["draft_gpu_layers"].get<int32_t>();
+        }
+        params.ctx_shift = false;  // NOTE: opt-in, sessions crop and re-prefill by default
+        if (config.contains("context_shift")) {
+            params.ctx_shift = config["context_shift"].get<bool>();
+        }
+        params.n_keep = 4;
+        if (config.contains("context_sink_tokens")) {
+            params.n_keep = config["context_sink_tokens"].get<int32_t>();
+        }
         if (config.contains("mmproj_use_gpu")) {
             params.mmproj_use_gpu = config["mmproj_use_gpu"].get<bool>();
         }
+        if (config.contains("mmproj_flash_attn")) {
+            std::string mode = config["mmproj_flash_attn"].get<std::string>();
+            if (mode == "auto")
+                params.mmproj_flash_attn = -1;
+            else if (mode == "off")
+                params.mmproj_flash_attn = 0;
+            else if (mode == "on")
+                params.mmproj_flash_attn = 1;
+            else
+                LOG_WRN("WRN: unknown mmproj_flash_attn %s, using auto\n", mode.c_str());
+        }
+        if (config.contains("mmproj_weight_type")) {
+            std::string type = config["mmproj_weight_type"].get<std::string>();
+            if (type == "f16")
+                params.mmproj_weight_type = GGML_TYPE_F16;
+            else if (type == "q8_0")
+                params.mmproj_weight_type = GGML_TYPE_Q8_0;
+            else if (type == "q4_k")
+                params.mmproj_weight_type = GGML_TYPE_Q4_K;
+            else if (type == "q4_0")
+                params.mmproj_weight_type = GGML_TYPE_Q4_0;
+            else
+                LOG_WRN("WRN: unknown mmproj_weight_type %s, keeping the mmproj types\n", type.c_str());
+        }
+        if (config.contains("mmproj_f16_activations")) {
+            params.mmproj_f16_activations = config["mmproj_f16_activations"].get<bool>();
+        }
+        if (config.contains("load_threads")) {
+            params.n_load_threads = config["load_threads"].get<int32_t>();
+        }
+        if (config.contains("mmap_prefetch_async")) {
+            params.mmap_prefetch_async = config["mmap_prefetch_async"].get<bool>();
+        }
+        if (config.contains("mmap_hugepages")) {
+            params.mmap_hugepages = config["mmap_hugepages"].get<bool>();
+        }
+        if (config.contains("repack_cache")) {
+            params.repack_cache = config["repack_cache"].get<bool>();
+        }
+        if (config.contains("mmproj_lazy")) {
+            params.mmproj_lazy = config["mmproj_lazy"].get<bool>();
+        }
+        if (config.contains("mmproj_idle_unload_s")) {
+            params.mmproj_idle_unload_s = config["mmproj_idle_unload_s"].get<int32_t>();
+        }
         if (config.contains("context_per_seq")) {
             params.n_usage_context = config["context_per_seq"].get<int32_t>();
         }
@@ -97,6 +525,18 @@ bool config_params_parse_json(const char* config_json, common_params& params) {
         if (config.contains("top_p")) {
             params.sampling.top_p = config["top_p"].get<float>();
         }
+        if (config.contains("repeat_penalty")) {
+            params.sampling.penalty_repeat = config["repeat_penalty"].get<float>();
+        }
+        if (config.contains("presence_penalty")) {
+            params.sampling.penalty_present = config["presence_penalty"].get<float>();
+        }
+        if (config.contains("frequency_penalty")) {
+            params.sampling.penalty_freq = config["frequency_penalty"].get<float>();
+        }
+        if (config.contains("penalty_last_n")) {
+            params.sampling.penalty_last_n = config["penalty_last_n"].get<int32_t>();
+        }
         if (config.contains("seed")) {
             params.sampling.seed = config["seed"].get<uint32_t>();
         }
@@ -110,9 +550,47 @@ bool config_params_parse_json(const char* config_json, common_params& params) {
             if (log_level == LOG_DEBUG_NAME) common_log_set_verbosity_thold(LOG_DEFAULT_DEBUG);
         }
 
-        // params.cpuparams.n_threads = 10;
+        if (config.contains("threads")) {
+            params.cpuparams.n_threads = config["threads"].get<int32_t>();
+        }
+        if (config.contains("threads_batch")) {
+            params.cpuparams_batch.n_threads = config["threads_batch"].get<int32_t>();
+        }
+        if (config.contains("encoder_threads")) {
+            params.cpuparams_encoder.n_threads = config["encoder_threads"].get<int32_t>();
+        }
+        if (config.contains("sample_threads")) {
+            params.sample_threads = std::max(0, config["sample_threads"].get<int32_t>());
+        }
+        if (config.contains("cpu_mask")) {
+            parse_cpu_affinity(config["cpu_mask"].get<std::string>(), params.cpuparams);
+        }
+        if (config.contains("cpu_mask_batch")) {
+            parse_cpu_affinity(config["cpu_mask_batch"].get<std::string>(), params.cpuparams_batch);
+        }
+        if (config.contains("cpu_strict")) {
+            params.cpuparams.strict_cpu = config["cpu_strict"].get<bool>();
+            params.cpuparams_batch.strict_cpu = params.cpuparams.strict_cpu;
+        }
+        if (config.contains("encoder_cpu_mask")) {
+            parse_cpu_affinity(config["encoder_cpu_mask"].get<std::string>(), params.cpuparams_encoder);
+        }
+        if (config.contains("scheduler_cpu_mask")) {
+            parse_cpu_affinity(config["scheduler_cpu_mask"].get<std::string>(), params.cpuparams_scheduler);
+        }
+        if (config.contains("prepare_cpu_mask")) {
+            parse_cpu_affinity(config["prepare_cpu_mask"].get<std::string>(), params.cpuparams_prepare);
+        }
+        if (config.contains("numa")) {
+            parse_numa(config["numa"].get<std::string>(), params.numa);
+        }
+
         postprocess_cpu_params(params.cpuparams, nullptr);
+        if (params.cpuparams_batch.mask_valid && params.cpuparams_batch.n_threads < 0) {  // NOTE: keeps its own mask
+            params.cpuparams_batch.n_threads = params.cpuparams.n_threads;
+        }
         postprocess_cpu_params(params.cpuparams_batch, &params.cpuparams);
+        if (params.cpuparams_encoder.n_threads <= 0) params.cpuparams_encoder.n_threads = params.cpuparams.n_threads;
         return res;
     } catch (const std::exception& e) {
         LOG_ERR("ERR: Failed to parse config JSON: %s\n", e.what());
@@ -5,15 +5,263 @@
 
 #include "mico-dialog-util.h"
 
-/** return code **/
-#define MICO_SUCCESS 0
-#define MICO_ERROR -1
-#define MICO_ERROR_EXCEED_MAX_CONTEXT -2
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <unordered_map>
+
+#include "batch_scheduling/batch-scheduler.h"
+#include "utils/frame-ring.h"
+#include "utils/prompt-budget.h"
+#include "utils/request-log.h"
 
 #define CHAT_CMP_ID_PREFIX "local-chatcmpl-"
-#define PROMPT_PROPORTION_LIMIT 0.8
+#define ADAPTIVE_RESOLUTION_LEVELS 4  // image sides from image_max_side to image_min_side
+
+static bool parse_address(const std::string& str, const uint8_t*& data) {
+    std::uintptr_t addr_value = 0;
+    try {
+        addr_value = static_cast<std::uintptr_t>(std::stoull(str, nullptr, 10));
+    } catch (const std::exception&) {
+        LOG_ERR("ERR: invalid address in modal_prts: %s\n", str.c_str());
+        return false;
+    }
+    data = reinterpret_cast<const uint8_t*>(addr_value);
+    return true;
+}
+
+// An engine-owned buffer in place of an address, pinned by the request until it is done
+static bool refer_buffer(ModalBufferPool::BufferRef owned, llama_mico_modal_buffer& buffer, MicoRequest& r) {
+    if (!owned) return false;
+    buffer.data = owned->data;
+    buffer.size = owned->size;
+    buffer.format = owned->format;
+    buffer.nx = owned->nx;
+    buffer.ny = owned->ny;
+    r.modal_refs.push_back(std::move(owned));
+    return true;
+}
+
+static bool resolve_buffer(llama_mico_modal_buffer& buffer, MicoRequest& r, LlamaMicoContext* context) {
+    if (!refer_buffer(context ? context->modal_buffers->get(buffer.buffer_id) : nullptr, buffer, r)) {
+        LOG_ERR("ERR: unknown modal buffer %d\n", buffer.buffer_id);
+        return false;
+    }
+    return true;
+}
+
+// {"data": "<addr>", "size": n, "format": "rgb" | "nv12" | "encoded", "nx": w, "ny": h}, {"buffer": id} of a buffer
+// registered by llama_mico_register_buffer, {"camera": name, "seq": n} of a frame in a camera frame ring, or
+// {"<addr>": size} of encoded images. All but the last take "pool", the vision token pooling of the image
+// {"roi": [[x, y, w, h], ...], "thumbnail": side} of an image: its regions, after a whole image thumbnail of that
+// longest side if any, all behind its marker
+static bool expand_roi(const json& modal, MicoRequest& r) {
+    if (!modal.contains("roi")) return true;
+    llama_mico_modal_buffer image = r.modal_prts.back();
+    r.modal_prts.pop_back();
+    try {
+        int32_t thumbnail = modal.value("thumbnail", 0);
+        if (thumbnail > 0) {
+            r.modal_prts.push_back(image);
+            r.modal_prts.back().max_side = thumbnail;
+        }
+        for (const auto& roi : modal.at("roi")) {
+            auto box = roi.get<std::vector<int32_t>>();
+            if (box.size() != 4 || box[0] < 0 || box[1] < 0 || box[2] <= 0 || box[3] <= 0) {
+                LOG_ERR("ERR: invalid roi %s, [x, y, w, h] expected\n", roi.dump().c_str());
+                return false;
+            }
+            r.modal_prts.push_back(image);
+            auto& region = r.modal_prts.back();
+            region.roi_x = box[0];
+            region.roi_y = box[1];
+            region.roi_w = box[2];
+            region.roi_h = box[3];
+        }
+    } catch (const std::exception& e) {
+        LOG_ERR("ERR: invalid roi in modal_prts: %s\n", e.what());
+        return false;
+    }
+    return true;
+}
+
+static bool modal_buffers_from_json(const json& modal, MicoRequest& r, LlamaMicoContext* context) {
+    if (modal.contains("camera")) {
+        llama_mico_modal_buffer buffer{};
+        uint64_t stream = 0;
+        try {
+            std::string camera = modal.at("camera").get<std::string>();
+            uint64_t seq = modal.at("seq").get<uint64_t>();
+            buffer.pool = modal.value("pool", 0);
+            if (!context || !refer_buffer(context->frame_rings->read(camera, seq, *context->modal_buffers), buffer, r))
+                return false;
+            stream = hash_bytes(camera.data(), camera.size()).lo;
+        } catch (const std::exception& e) {
+            LOG_ERR("ERR: invalid camera frame in modal_prts: %s\n", e.what());
+            return false;
+        }
+        size_t first = r.modal_prts.size();
+        r.modal_prts.push_back(buffer);
+        if (!expand_roi(modal, r)) return false;
+        r.modal_streams.resize(first, 0);
+        r.modal_streams.resize(r.modal_prts.size(), stream);  // NOTE: the regions of the frame too
+        return true;
+    }
+    if (modal.contains("buffer")) {
+        llama_mico_modal_buffer buffer{};
+        try {
+            buffer.buffer_id = modal.at("buffer").get<int32_t>();
+            buffer.pool = modal.value("pool", 0);
+        } catch (const std::exception& e) {
+            LOG_ERR("ERR: invalid modal in modal_prts: %s\n", e.what());
+            return false;
+        }
+        if (!resolve_buffer(buffer, r, context)) return false;
+        r.modal_prts.push_back(buffer);
+        return expand_roi(modal, r);
+    }
+    if (!modal.contains("data")) {
+        for (const auto& [key, value] : modal.items()) {
+            llama_mico_modal_buffer buffer{};
+            if (!parse_address(key, buffer.data)) return false;
+            buffer.size = value.get<size_t>();
+            r.modal_prts.push_back(buffer);
+        }
+        return true;
+    }
+
+    llama_mico_modal_buffer buffer{};
+    try {
+        const auto& data = modal.at("data");
+        if (!parse_address(data.is_string() ? data.get<std::string>() : std::to_string(data.get<uint64_t>()),
+                           buffer.data))
+            return false;
+        buffer.size = modal.at("size").get<size_t>();
+        std::string format = modal.value("format", "encoded");
+        if (format == "rgb")
+            buffer.format = LLAMA_MICO_MODAL_RGB;
+        else if (format == "nv12")
+            buffer.format = LLAMA_MICO_MODAL_NV12;
+        else if (format != "encoded") {
+            LOG_ERR("ERR: unknown modal format %s\n", format.c_str());
+            return false;
+        }
+        buffer.nx = modal.value("nx", 0u);
+        buffer.ny = modal.value("ny", 0u);
+        buffer.pool = modal.value("pool", 0);
+    } catch (const std::exception& e) {
+        LOG_ERR("ERR: invalid modal in modal_prts: %s\n", e.what());
+        return false;
+    }
+    r.modal_prts.push_back(buffer);
+    return expand_roi(modal, r);
+}
+
+// "content_id" of a modal is a stable id of its content (e.g. camera and frame sequence number), the cache key comes
+// from it and the content is never hashed
+static bool modal_from_json(const json& modal, MicoRequest& r, LlamaMicoContext* context) {
+    if (!modal_buffers_from_json(modal, r, context)) return false;
+    HashKey id;
+    try {
+        std::string content_id = modal.value("content_id", std::string());
+        if (!content_id.empty()) id = hash_bytes(content_id.data(), content_id.size());
+    } catch (const std::exception& e) {
+        LOG_ERR("ERR: invalid content_id in modal_prts: %s\n", e.what());
+        return false;
+    }
+    r.modal_ids.resize(r.modal_prts.size(), id);  // NOTE: regions of an image share its id
+    return true;
+}
+
+static std::shared_ptr<const ChatTools> request_tools(std::string_view text, LlamaMicoContext* context) {
+    return context && context->chat_cache ? context->chat_cache->tools(text) : ChatTools::parse(text);
+}
+
+// Skips the JSON string at text[i] (its opening quote), false if it is not terminated
+static bool skip_json_string(std::string_view text, size_t& i) {
+    for (i++;;) {
+        i = text.find_first_of("\"\\", i);
+        if (i == std::string_view::npos) return false;
+        if (text[i] == '"') break;
+        i += 2;  // the escaped character
+    }
+    i++;
+    return true;
+}
+
+// Skips the JSON value at text[i], a primitive ends before the next ',', '}' or ']'
+static bool skip_json_value(std::string_view text, size_t& i) {
+    int32_t depth = 0;
+    while (i < text.size()) {
+        char c = text[i];
+        if (c == '"') {
+            if (!skip_json_string(text, i)) return false;
+            if (depth == 0) return true;
+            continue;
+        }
+        if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (depth == 0) return true;
+            if (--depth == 0) {
+                i++;
+                return true;
+            }
+        } else if (c == ',' && depth == 0) {
+            return true;
+        }
+        i++;
+    }
+    return depth == 0;
+}
+
+// Value text of a top level key of a JSON object, false if the key is not found or the structure is broken before
+// it. NOTE: only the structure is checked, the full parse of the rest rejects invalid requests
+static bool find_json_field(std::string_view text, std::string_view key, size_t& begin, size_t& end) {
+    static const char* ws = " \t\r\n";
+    size_t i = text.find_first_not_of(ws);
+    if (i == std::string_view::npos || text[i] != '{') return false;
+    for (i++;;) {
+        i = text.find_first_not_of(" \t\r\n,", i);
+        if (i == std::string_view::npos || text[i] != '"') return false;
+        size_t key_begin = i + 1;
+        if (!skip_json_string(text, i)) return false;
+        bool match = text.substr(key_begin, i - 1 - key_begin) == key;
+        i = text.find_first_not_of(ws, i);
+        if (i == std::string_view::npos || text[i] != ':') return false;
+        i = text.find_first_not_of(ws, i + 1);
+        if (i == std::string_view::npos) return false;
+        begin = i;
+        if (!skip_json_value(text, i)) return false;
+        if (match) {
+            end = text.find_last_not_of(ws, i - 1) + 1;
+            return true;
+        }
+    }
+}
 
-bool from_json_to_request(const json& j, MicoRequest& r) {
+bool parse_request_json(const char* text, MicoRequest& r, LlamaMicoContext* context) {
+    if (!text) return false;
+    std::string_view view(text);
+    std::string_view tools;
+    std::string rest;  // the request with null for its tools
+    size_t begin = 0, end = 0;
+    if (find_json_field(view, "tools", begin, end)) {
+        tools = view.substr(begin, end - begin);
+        rest.reserve(view.size() - tools.size() + 4);
+        rest.append(view.substr(0, begin)).append("null").append(view.substr(end));
+        view = rest;
+    }
+    json j = json::parse(view.begin(), view.end(), nullptr, false /* allow_exceptions */);
+    if (j.is_discarded() || !j.is_object() || !from_json_to_request(j, r, context)) return false;
+    if (!tools.empty() && tools != "null") {
+        r.tools = request_tools(tools, context);
+        if (!r.tools) return false;
+    }
+    return true;
+}
+
+bool from_json_to_request(const json& j, MicoRequest& r, LlamaMicoContext* context) {
     std::string chat_cmpl_id = j.value("id", "local-chatcmpl-0");
     std::string prefix = CHAT_CMP_ID_PREFIX;
     if (chat_cmpl_id.substr(0, prefix.size()) == prefix) {
@@ -22,42 +270,210 @@ bool from_json_to_request(const json& j, MicoRequest& r) {
 
     r.priority = j.value("priority", r.priority);
     if (j.contains("messages")) r.messages = j.at("messages");
-    if (j.contains("tools")) r.tools = j.at("tools");
+    if (j.contains("tools") && !j.at("tools").is_null()) {
+        r.tools = request_tools(j.at("tools").dump(), context);
+        if (!r.tools) return false;
+    }
     if (j.contains("modal_prts")) {
+        bool has_clip = false;
         for (const auto& modal : j.at("modal_prts")) {
-            std::map<const unsigned char*, int32_t> modal_map;
-            for (const auto& [key, value] : modal.items()) {
-                std::uintptr_t addr_value = 0;
-                try {
-                    addr_value = static_cast<std::uintptr_t>(std::stoull(key, nullptr, 10));
-                } catch (const std::exception&) {
-                    LOG_ERR("ERR: invalid address in modal_prts: %s\n", key.c_str());
+            if (!modal.contains("frames")) {
+                size_t n_prev = r.modal_prts.size();
+                if (!modal_from_json(modal, r, context)) return false;
+                r.modal_frames.push_back((int32_t)(r.modal_prts.size() - n_prev));
+                r.keyframes.resize(r.modal_prts.size(), 1);
+                has_clip |= r.modal_frames.back() > 1;  // NOTE: regions of an image are grouped like a clip
+                continue;
+            }
+            // {"frames": [...], "keyframes": [1, 0, ...]} of a video clip
+            const auto& frames = modal.at("frames");
+            std::vector<uint8_t> keys = modal.value("keyframes", std::vector<uint8_t>());
+            if (frames.empty() || (!keys.empty() && keys.size() != frames.size())) {
+                LOG_ERR("ERR: invalid video clip in modal_prts\n");
+                return false;
+            }
+            for (size_t i = 0; i < frames.size(); i++) {
+                if (frames[i].contains("roi") || !modal_from_json(frames[i], r, context) ||
+                    r.modal_prts.size() != r.keyframes.size() + 1) {
+                    LOG_ERR("ERR: invalid frame %zu of a video clip\n", i);
                     return false;
                 }
-                modal_map[reinterpret_cast<const unsigned char*>(addr_value)] = value;
+                r.keyframes.push_back(keys.empty() ? (i == 0 || i + 1 == frames.size()) : keys[i]);
+            }
+            r.modal_frames.push_back((int32_t)frames.size());
+            has_clip = true;
+        }
+        if (!has_clip) {  // NOTE: plain images, one per marker
+            r.modal_frames.clear();
+            r.keyframes.clear();
+        }
+    }
+    // NOTE: a boolean "stop" stops the request, a string or an array is the OpenAI stop sequences
+    r.stop = j.contains("stop") && j["stop"].is_boolean() && j["stop"].get<bool>();
+    for (const char* key : {"stop_strings", "stop"}) {
+        if (!j.contains(key)) continue;
+        json stops = j[key].is_string() ? json::array({j[key]}) : j[key];
+        if (!stops.is_array()) continue;
+        for (const auto& stop : stops) {
+            if (stop.is_string() && !stop.get<std::string>().empty()) r.stop_strings.push_back(stop.get<std::string>());
+        }
+    }
+    r.max_tokens = std::max(0, j.value("max_tokens", j.value("max_completion_tokens", r.max_tokens)));
+    int32_t deadline_ms = j.value("deadline_ms", 0);
+    if (deadline_ms > 0) r.expire_ms = ggml_time_ms() + deadline_ms;
+    r.vision_pool = std::max(1, j.value("vision_pool", r.vision_pool));
+    r.image_max_side = std::max(0, j.value("image_max_side", r.image_max_side));
+    r.image_min_side = std::max(0, j.value("image_min_side", r.image_min_side));
+    r.cache_prefix = j.value("cache_prefix", r.cache_prefix);
+    r.session = j.value("session", r.session);
+    r.cache_pin = j.value("cache_pin", r.cache_pin);
+    r.temperature = j.value("temperature", r.temperature);
+    r.top_p = j.value("top_p", r.top_p);
+    r.top_k = j.value("top_k", r.top_k);
+    r.repeat_penalty = j.value("repeat_penalty", r.repeat_penalty);
+    r.presence_penalty = j.value("presence_penalty", r.presence_penalty);
+    r.frequency_penalty = j.value("frequency_penalty", r.frequency_penalty);
+    r.grammar = j.value("grammar", r.grammar);
+    r.lora = j.value("lora", r.lora);
+    r.video_session = j.value("video_session", r.video_session);
+    r.timings = j.value("timings", r.timings);
+    if (!r.lora.empty() && context && !context->find_lora(r.lora)) {
+        LOG_ERR("ERR: unknown lora adapter %s\n", r.lora.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool from_struct_to_request(const llama_mico_request& s, MicoRequest& r, LlamaMicoContext* context) {
+    r.id = s.id;
+    r.priority = s.priority;
+    if (s.n_messages > 0 && !s.messages) return false;
+    for (int32_t i = 0; i < s.n_messages; i++) {
+        common_chat_msg msg;
+        msg.role = s.messages[i].role ? s.messages[i].role : "";
+        msg.content = s.messages[i].content ? s.messages[i].content : "";
+        r.chat_msgs.push_back(std::move(msg));
+    }
+    if (s.tools_json && s.tools_json[0] != '\0') {
+        r.tools = request_tools(s.tools_json, context);
+        if (!r.tools) return false;
+    }
+    if (s.n_modal_buffers > 0 && !s.modal_buffers) return false;
+    for (int32_t i = 0; i < s.n_modal_buffers; i++) {
+        auto buffer = s.modal_buffers[i];
+        if (!buffer.data && buffer.buffer_id > 0 && !resolve_buffer(buffer, r, context)) return false;
+        if (!buffer.data || buffer.size == 0 || buffer.size > INT32_MAX) {
+            LOG_ERR("ERR: invalid modal buffer %d\n", i);
+            return false;
+        }
+        const char* content_id = buffer.content_id;
+        r.modal_ids.push_back(content_id && content_id[0] ? hash_bytes(content_id, strlen(content_id)) : HashKey());
+        buffer.content_id = nullptr;  // NOTE: the caller string does not outlive the call
+        r.modal_prts.push_back(buffer);
+    }
+    if (s.n_modal_frames > 0) {
+        if (!s.modal_frames) return false;
+        int32_t n_frames = 0;
+        for (int32_t i = 0; i < s.n_modal_frames; i++) {
+            if (s.modal_frames[i] <= 0) return false;
+            n_frames += s.modal_frames[i];
+            r.modal_frames.push_back(s.modal_frames[i]);
+        }
+        if (n_frames != s.n_modal_buffers) {
+            LOG_ERR("ERR: modal_frames cover %d of %d modal buffers\n", n_frames, s.n_modal_buffers);
+            return false;
+        }
+        for (int32_t n : r.modal_frames) {
+            for (int32_t i = 0; i < n; i++) {
+                size_t k = r.keyframes.size();
+                r.keyframes.push_back(s.keyframes ? s.keyframes[k] != 0 : (i == 0 || i + 1 == n));
             }
-            r.modal_prts.push_back(modal_map);
         }
     }
-    r.stop = j.value("stop", false);
+    r.stop = s.stop != 0;
+    r.cache_prefix = s.cache_prefix;
+    r.session = s.session ? s.session : "";
+    r.cache_pin = s.cache_pin != 0;
+    r.max_tokens = std::max(0, s.max_tokens);
+    if (s.deadline_ms > 0) r.expire_ms = ggml_time_ms() + s.deadline_ms;
+    r.vision_pool = std::max(1, s.vision_pool);
+    r.image_max_side = std::max(0, s.image_max_side);
+    r.image_min_side = std::max(0, s.image_min_side);
+    r.lora = s.lora ? s.lora : "";
+    r.video_session = s.video_session ? s.video_session : "";
+    if (!r.lora.empty() && context && !context->find_lora(r.lora)) {
+        LOG_ERR("ERR: unknown lora adapter %s\n", r.lora.c_str());
+        return false;
+    }
     return true;
 }
 
 int32_t stop_process(bool sucess, std::string& respone, const char** content, int32_t& is_finished,
                      LlamaSeqState& state, LlamaMicoContext* context, int32_t seq_id, bool stop_infer,
                      bool too_long) {  // End seq_id
-    state.respone = respone;
-    *content = state.respone.c_str();
+    if (stop_infer && seq_id >= 0 && state.cancelled.exchange(false) && sucess) {
+        sucess = false;  // NOTE: its kv may be cleared already, never parked as a prefix or stored
+        respone = "ERR: cancelled\n";
+    }
+    // NOTE: a request failing without a sequence reports into a string of the calling thread, never a shared one
+    thread_local std::string error_respone;
+    std::string& out = seq_id == DEFAULT_ERROR_SEQ_ID ? error_respone : state.respone;
+    out = respone;
+    *content = out.c_str();
 
     if (stop_infer) {
         is_finished = 1;
-        state.is_infering.store(false);
-        state.n_past.store(0);
+        if (seq_id >= 0) {  // NOTE: seq_id -1 would clear the memory of every sequence
+            BatchScheduler* bs = static_cast<BatchScheduler*>(context->batch_scheduler);
+            {
+                std::lock_guard<std::mutex> move_lock(context->seq_move_mutex);
+                seq_id = state.seq_id;  // NOTE: preemption may have moved the sequence since the caller looked it up
+                bs->stop_decoding(seq_id);  // Leave the decode loop before releasing KV
+                if (context->request_log || state.timings) {
+                    std::lock_guard<std::mutex> lock(context->cmpl_to_seq_mutex);
+                    auto it = context->seq_to_cmpl.find(seq_id);
+                    if (it != context->seq_to_cmpl.end() && context->request_log)
+                        context->request_log->record_finish((int32_t)it->second, state.n_generated, sucess);
+                    if (it != context->seq_to_cmpl.end() && state.timings) {
+                        auto timings = state.timings->to_json(ggml_time_us(), state.n_generated);
+                        context->keep_timings((int32_t)it->second, timings.dump());
+                    }
+                }
+                state.timings.reset();
+                state.arena.reset();  // NOTE: recycled once the chunk tasks still queued are dropped too
 
-        LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(context->memory_scheduler);
-        ms->submit_clear_mem(seq_id, -1, -1);
+                state.n_past.store(0);
+                state.held_text.clear();
+                state.stop_strings.clear();
+                state.stop_tail.clear();
+                state.max_tokens = 0;
+                state.expire_ms = 0;
+                context->release_kv(state);
+                state.n_resident_items = 0;
+                state.n_head_items = 0;
+                state.n_evicted_items = 0;
+                state.prompt_items.clear();
+                state.pinned_embds.clear();
+                if (sucess) bs->store_session(seq_id);
+                state.session.clear();
+                context->erase_seq(seq_id);
 
-        context->erase_seq(seq_id);
+                if (seq_id >= PREEMPT_SEQ_BASE) {  // still swapped out, nothing in kv
+                    bs->drop_preempted(seq_id);
+                    state.kv_items.clear();
+                    state.is_infering.store(false);
+                } else {
+                    if (!sucess) {  // kv may be partial
+                        state.kv_items.clear();
+                        LlamaMemoryScheduler* ms = static_cast<LlamaMemoryScheduler*>(context->memory_scheduler);
+                        ms->submit_clear_mem(seq_id, -1, -1);
+                    }
+                    context->park_seq(seq_id);  // kv is kept for a request with the same prefix
+                }
+            }
+            bs->resume_preempted();  // the freed sequence goes to a preempted one first
+            bs->admit_waiting();     // then to a queued request
+        }
     } else {
         is_finished = 0;
     }
@@ -72,42 +488,513 @@ int32_t stop_process(bool sucess, std::string& respone, const char** content, in
     return MICO_SUCCESS;  // success
 }
 
-void apply_chat_templates(common_chat_params& formatted_chat, common_chat_templates_inputs& tmpl_inputs,
-                          LlamaMicoContext* context, json messages, json tools) {
-    tmpl_inputs.messages = common_chat_msgs_parse_oaicompat(messages);
-    if (!tools.is_null() && !tools.empty()) {
-        tmpl_inputs.tools = common_chat_tools_parse_oaicompat(tools);
+// Tool call grammar of the chat template, special tokens of one token become token triggers
+static void apply_chat_grammar(const common_chat_params& chat, LlamaMicoContext* context,
+                               common_params_sampling& sparams) {
+    sparams.grammar = chat.grammar;
+    sparams.grammar_lazy = chat.grammar_lazy;
+    for (const auto& text : chat.preserved_tokens) {
+        auto ids = common_tokenize(context->vocab, text, false /* add_special */, true /* parse_special */);
+        if (ids.size() == 1) sparams.preserved_tokens.insert(ids[0]);
     }
+    sparams.grammar_triggers.clear();
+    for (const auto& trigger : chat.grammar_triggers) {
+        if (trigger.type == COMMON_GRAMMAR_TRIGGER_TYPE_WORD) {
+            auto ids =
+                common_tokenize(context->vocab, trigger.value, false /* add_special */, true /* parse_special */);
+            if (ids.size() == 1 && sparams.preserved_tokens.count(ids[0]) > 0) {
+                sparams.grammar_triggers.push_back({COMMON_GRAMMAR_TRIGGER_TYPE_TOKEN, trigger.value, ids[0]});
+                continue;
+            }
+        }
+        sparams.grammar_triggers.push_back(trigger);
+    }
+}
+
+bool init_seq_sampler(const MicoRequest& request, LlamaMicoContext* context, LlamaSeqState& state,
+                      const common_chat_params& chat) {
+    common_params_sampling sparams = context->sampling;
+    if (request.temperature >= 0) sparams.temp = request.temperature;
+    if (request.top_p >= 0) sparams.top_p = request.top_p;
+    if (request.top_k >= 0) sparams.top_k = request.top_k;
+    if (request.repeat_penalty > 0) sparams.penalty_repeat = request.repeat_penalty;
+    if (!std::isnan(request.presence_penalty)) sparams.penalty_present = request.presence_penalty;
+    if (!std::isnan(request.frequency_penalty)) sparams.penalty_freq = request.frequency_penalty;
+    if (!request.grammar.empty())
+        sparams.grammar = request.grammar;
+    else if (!chat.grammar.empty())
+        apply_chat_grammar(chat, context, sparams);
+    if (sparams.seed != LLAMA_DEFAULT_SEED) sparams.seed += request.seed_offset;
+
+    if (state.smpl) common_sampler_free(state.smpl);
+    state.smpl = common_sampler_init(context->model, sparams);
+
+    // NOTE: every sampler that can drop or reweight the max logit must be disabled
+    state.greedy = sparams.temp <= 0 && sparams.mirostat == 0 && sparams.grammar.empty() &&
+                   sparams.logit_bias.empty() && !sparams.ignore_eos && sparams.penalty_repeat == 1.0f &&
+                   sparams.penalty_freq == 0.0f && sparams.penalty_present == 0.0f && sparams.dry_multiplier == 0.0f &&
+                   sparams.xtc_probability == 0.0f && sparams.typ_p >= 1.0f;
+    state.row_sampling = row_sampling_of(sparams);
+    state.penalties.reset(sparams);
+    state.rng.seed(sparams.seed == LLAMA_DEFAULT_SEED ? std::random_device()() : sparams.seed);
+    return state.smpl != nullptr;
+}
+
+size_t utf8_complete_len(const std::string& text, size_t len) {
+    len = std::min(len, text.size());
+    for (size_t back = 1; back <= 4 && back <= len; back++) {  // find the last lead byte
+        unsigned char c = (unsigned char)text[len - back];
+        if ((c & 0xC0) == 0x80) continue;  // continuation byte
+        size_t need = 1;
+        if ((c & 0xE0) == 0xC0)
+            need = 2;
+        else if ((c & 0xF0) == 0xE0)
+            need = 3;
+        else if ((c & 0xF8) == 0xF0)
+            need = 4;
+        return back < need ? len - back : len;
+    }
+    return len;
+}
+
+size_t held_text_len(const std::string& held, const std::vector<std::string>& stops, bool& stopped) {
+    size_t len = held.size();
+    stopped = false;
+    for (const auto& stop : stops) {
+        size_t pos = held.find(stop);
+        if (pos != std::string::npos) {
+            stopped = true;
+            len = std::min(len, pos);
+            continue;
+        }
+        pos = string_find_partial_stop(held, stop);
+        if (pos != std::string::npos) len = std::min(len, pos);
+    }
+    return stopped ? len : utf8_complete_len(held, len);
+}
+
+void apply_chat_templates(common_chat_params& formatted_chat, common_chat_templates_inputs& tmpl_inputs,
+                          LlamaMicoContext* context, MicoRequest& request, ChatPrefix* prefix, int32_t prompt_limit) {
+    if (!request.chat_msgs.empty())
+        tmpl_inputs.messages = request.chat_msgs;
+    else
+        tmpl_inputs.messages = common_chat_msgs_parse_oaicompat(request.messages);
+    if (request.tools) tmpl_inputs.tools = request.tools->tools;
     tmpl_inputs.add_generation_prompt = true;
     tmpl_inputs.use_jinja = true;  // jinja not support yet
     tmpl_inputs.enable_thinking = false;
-    formatted_chat = common_chat_templates_apply(context->tmpls.get(), tmpl_inputs);
+    context->prompt_budget->fit(request, tmpl_inputs, prompt_limit);
+    ChatPrefix unused;
+    HashKey tools_key = request.tools ? request.tools->key : HashKey();
+    formatted_chat = context->chat_cache->apply(tmpl_inputs, prefix ? *prefix : unused, tools_key);
 }
 
-bool ready_modal_bitmaps(std::vector<std::map<const unsigned char*, int32_t>>& modal_prts,
-                         common_chat_templates_inputs& tmpl_inputs, LlamaMicoContext* context, LlamaSeqState& state) {
-    if (!modal_prts.empty()) {
-        for (const auto& modal : modal_prts) {
-            for (const auto& [p, len] : modal) {
-                auto bitmap_ptr = mtmd_helper_bitmap_init_from_buf(context->ctx_vision.get(), p, len, 0, 0);
-                if (!bitmap_ptr) {
-                    return false;
+static uint32_t modal_pool(const MicoRequest& request, const llama_mico_modal_buffer* modal) {
+    return (uint32_t)(modal && modal->pool > 0 ? modal->pool : request.vision_pool);
+}
+
+// How an image is fed to the encoder: its region (w 0 for the whole image), longest side (0 for the input size) and
+// vision token pooling
+struct ImageVariant {
+    int32_t roi[4]{0, 0, 0, 0};
+    int32_t max_side{0};
+    uint32_t pool{1};
+    uint64_t stream{0};  // MicoRequest::stream_key, not part of the key
+};
+
+// Load adaptive resolution: image_max_side while the encoders keep up, one of ADAPTIVE_RESOLUTION_LEVELS lower per
+// adaptive_resolution_step encodes queued per worker, down to image_min_side under a burst
+static ImageVariant image_variant(const MicoRequest& request, const llama_mico_modal_buffer* modal,
+                                  LlamaMicoContext* context) {
+    ImageVariant variant;
+    variant.max_side = request.image_max_side;
+    variant.pool = modal_pool(request, modal);
+    variant.stream = request.stream_key(modal ? modal - request.modal_prts.data() : request.modal_prts.size());
+    if (modal && modal->roi_w > 0 && modal->roi_h > 0) {
+        variant.roi[0] = modal->roi_x;
+        variant.roi[1] = modal->roi_y;
+        variant.roi[2] = modal->roi_w;
+        variant.roi[3] = modal->roi_h;
+    }
+    if (modal && modal->max_side > 0) {
+        variant.max_side = modal->max_side;
+        return variant;
+    }
+    int32_t min_side = request.image_min_side;
+    if (variant.max_side <= 0 || min_side <= 0 || min_side >= variant.max_side ||
+        context->adaptive_resolution_step <= 0)
+        return variant;
+    BatchScheduler* bs = static_cast<BatchScheduler*>(context->batch_scheduler);
+    float backlog = bs->encoder_load() - 1.0f;  // NOTE: 1 keeps every worker busy with nothing queued
+    int32_t level = (int32_t)std::ceil(std::max(0.0f, backlog) / context->adaptive_resolution_step);
+    level = std::min(level, ADAPTIVE_RESOLUTION_LEVELS - 1);
+    variant.max_side -= (variant.max_side - min_side) * level / (ADAPTIVE_RESOLUTION_LEVELS - 1);
+    return variant;
+}
+
+// Embeddings of a region, a downscaled or a pooled image are cached apart from the full ones of the same input
+static HashKey variant_key(const HashKey& key, const ImageVariant& variant) {
+    if (variant.pool <= 1 && variant.max_side <= 0 && variant.roi[2] <= 0) return key;
+    uint64_t words[5] = {key.hi, key.lo, (uint64_t)variant.max_side << 32 | variant.pool,
+                         (uint64_t)variant.roi[0] << 32 | (uint32_t)variant.roi[1],
+                         (uint64_t)variant.roi[2] << 32 | (uint32_t)variant.roi[3]};
+    return hash_bytes(words, variant.roi[2] > 0 ? sizeof(words) : 3 * sizeof(uint64_t));
+}
+
+// Area average downscale so the longer side is at most max_side, the bitmap is replaced then
+static mtmd_bitmap* cap_bitmap_side(mtmd_bitmap* bitmap, int32_t max_side) {
+    uint32_t nx = mtmd_bitmap_get_nx(bitmap), ny = mtmd_bitmap_get_ny(bitmap);
+    uint32_t side = std::max(nx, ny);
+    if (max_side <= 0 || side <= (uint32_t)max_side) return bitmap;
+    uint32_t out_nx = std::max(1u, (uint32_t)((uint64_t)nx * max_side / side));
+    uint32_t out_ny = std::max(1u, (uint32_t)((uint64_t)ny * max_side / side));
+    const unsigned char* src = mtmd_bitmap_get_data(bitmap);
+    std::vector<unsigned char> dst((size_t)out_nx * out_ny * 3);
+    for (uint32_t y = 0; y < out_ny; y++) {
+        uint32_t y0 = y * ny / out_ny, y1 = std::max(y0 + 1, (y + 1) * ny / out_ny);
+        for (uint32_t x = 0; x < out_nx; x++) {
+            uint32_t x0 = x * nx / out_nx, x1 = std::max(x0 + 1, (x + 1) * nx / out_nx);
+            uint32_t sum[3] = {0, 0, 0};
+            for (uint32_t sy = y0; sy < y1; sy++) {
+                const unsigned char* row = src + ((size_t)sy * nx + x0) * 3;
+                for (uint32_t sx = 0; sx < x1 - x0; sx++) {
+                    sum[0] += row[3 * sx];
+                    sum[1] += row[3 * sx + 1];
+                    sum[2] += row[3 * sx + 2];
                 }
-                state.bitmaps.entries.emplace_back(bitmap_ptr);
             }
+            uint32_t n = (y1 - y0) * (x1 - x0);
+            unsigned char* out = dst.data() + ((size_t)y * out_nx + x) * 3;
+            for (int c = 0; c < 3; c++) out[c] = (unsigned char)((sum[c] + n / 2) / n);
+        }
+    }
+    mtmd_bitmap* scaled = mtmd_bitmap_init(out_nx, out_ny, dst.data());
+    mtmd_bitmap_free(bitmap);
+    return scaled;
+}
+
+// Pixel-less bitmap of a cached image, nullptr on a miss
+static mtmd_bitmap* cached_image_bitmap(const HashKey& key, LlamaMicoContext* context, LlamaSeqState& state) {
+    BatchScheduler* bs = static_cast<BatchScheduler*>(context->batch_scheduler);
+    uint32_t nx = 0, ny = 0;
+    auto embd = bs->modal_cache()->lookup_grid(key, nx, ny);
+    if (!embd) return nullptr;
+    state.pinned_embds.push_back(embd);  // NOTE: held until the request stops, it cannot be encoded again
+    return mtmd_bitmap_init_cached(nx, ny, hash_to_hex(key).c_str());
+}
+
+// A frame within frame_dedup_bits of a recent frame of the same stream (perceptual hash) reuses the embeddings of
+// that frame, the bitmap is freed then. NOTE: pooled frames and frames of no known stream are left out, a near frame
+// could differ in pooling, and similar scenes of two cameras must not answer for each other
+static mtmd_bitmap* dedup_frame_bitmap(mtmd_bitmap* bitmap, const HashKey& key, uint64_t stream,
+                                       LlamaMicoContext* context, LlamaSeqState& state) {
+    if (context->frame_dedup_bits <= 0 || stream == 0 || mtmd_bitmap_is_audio(bitmap) ||
+        mtmd_bitmap_get_pool(bitmap) > 1)
+        return bitmap;
+    BatchScheduler* bs = static_cast<BatchScheduler*>(context->batch_scheduler);
+    uint32_t nx = mtmd_bitmap_get_nx(bitmap), ny = mtmd_bitmap_get_ny(bitmap);
+    uint64_t dhash = image_dhash(mtmd_bitmap_get_data(bitmap), nx, ny);
+    HashKey near = bs->modal_cache()->near_frame(stream, dhash, nx, ny, context->frame_dedup_bits);
+    mtmd_bitmap* cached = near.empty() || near == key ? nullptr : cached_image_bitmap(near, context, state);
+    if (cached) {
+        mtmd_bitmap_free(bitmap);
+        return cached;
+    }
+    bs->modal_cache()->add_frame(stream, dhash, nx, ny, key);  // NOTE: matched frames are not added, no drift
+    return bitmap;
+}
+
+// Id from the encoded bytes, so the bitmap is never hashed after decoding. On an embedding cache hit the image is
+// neither decoded nor preprocessed, the chunk is rebuilt from the cached token grid
+static mtmd_bitmap* init_image_bitmap(const unsigned char* buf, size_t len, const HashKey& content_id,
+                                      const ImageVariant& variant, LlamaMicoContext* context, LlamaSeqState& state) {
+    std::shared_ptr<mtmd_context> ctx_vision = context->vision();
+    if (!ctx_vision) {
+        LOG_ERR("ERR: no vision model for an image\n");
+        return nullptr;
+    }
+    HashKey key = variant_key(content_id.empty() ? hash_bytes(buf, len) : content_id, variant);
+    bool cachable = mtmd_support_cached_bitmap(ctx_vision.get());
+    if (cachable) {
+        mtmd_bitmap* cached = cached_image_bitmap(key, context, state);
+        if (cached) return cached;
+    }
+
+    const int32_t* roi = variant.roi;
+    mtmd_bitmap* bitmap = roi[2] > 0 ? mtmd_helper_bitmap_init_region(ctx_vision.get(), buf, len, roi[0], roi[1],
+                                                                      roi[2], roi[3])
+                                     : mtmd_helper_bitmap_init_from_buf(ctx_vision.get(), buf, len, 0, 0);
+    if (!bitmap) return nullptr;
+    if (!mtmd_bitmap_is_audio(bitmap)) bitmap = cap_bitmap_side(bitmap, variant.max_side);
+    mtmd_bitmap_set_id(bitmap, hash_to_hex(key).c_str());
+    mtmd_bitmap_set_pool(bitmap, variant.pool);
+    return cachable ? dedup_frame_bitmap(bitmap, key, variant.stream, context, state) : bitmap;
+}
+
+static inline uint8_t clamp_u8(int32_t v) { return (uint8_t)(v < 0 ? 0 : (v > 255 ? 255 : v)); }
+
+// BT.601 limited range NV12 to packed RGB24, fixed point
+static void nv12_to_rgb(const uint8_t* src, uint32_t nx, uint32_t ny, uint8_t* rgb) {
+    const uint8_t* uv_plane = src + (size_t)nx * ny;
+    for (uint32_t y = 0; y < ny; y++) {
+        const uint8_t* y_row = src + (size_t)y * nx;
+        const uint8_t* uv_row = uv_plane + (size_t)(y / 2) * nx;
+        uint8_t* out = rgb + (size_t)y * nx * 3;
+        for (uint32_t x = 0; x < nx; x++) {
+            int32_t c = 298 * ((int32_t)y_row[x] - 16);
+            int32_t d = (int32_t)uv_row[x & ~1u] - 128;
+            int32_t e = (int32_t)uv_row[x | 1u] - 128;
+            out[3 * x + 0] = clamp_u8((c + 409 * e + 128) >> 8);
+            out[3 * x + 1] = clamp_u8((c - 100 * d - 208 * e + 128) >> 8);
+            out[3 * x + 2] = clamp_u8((c + 516 * d + 128) >> 8);
+        }
+    }
+}
+
+// The region of a packed RGB24 frame clipped to it, nullptr if it holds no pixel
+static mtmd_bitmap* init_region_bitmap(const uint8_t* rgb, uint32_t nx, uint32_t ny, const int32_t* roi) {
+    uint32_t x0 = std::min((uint32_t)roi[0], nx), y0 = std::min((uint32_t)roi[1], ny);
+    uint32_t x1 = (uint32_t)std::min<int64_t>(nx, (int64_t)roi[0] + roi[2]);
+    uint32_t y1 = (uint32_t)std::min<int64_t>(ny, (int64_t)roi[1] + roi[3]);
+    if (x1 <= x0 || y1 <= y0) {
+        LOG_ERR("ERR: roi %d,%d %dx%d is outside of the frame %ux%u\n", roi[0], roi[1], roi[2], roi[3], nx, ny);
+        return nullptr;
+    }
+    std::vector<uint8_t> region((size_t)(x1 - x0) * (y1 - y0) * 3);
+    for (uint32_t y = y0; y < y1; y++) {
+        memcpy(region.data() + (size_t)(y - y0) * (x1 - x0) * 3, rgb + ((size_t)y * nx + x0) * 3, (x1 - x0) * 3);
+    }
+    return mtmd_bitmap_init(x1 - x0, y1 - y0, region.data());
+}
+
+// Pixel bytes of a raw RGB / NV12 frame, 0 for another format or odd NV12 sides
+static size_t raw_frame_bytes(const llama_mico_modal_buffer& frame) {
+    size_t n_pixels = (size_t)frame.nx * frame.ny;
+    if (frame.format == LLAMA_MICO_MODAL_RGB) return n_pixels * 3;
+    if (frame.format == LLAMA_MICO_MODAL_NV12 && frame.nx % 2 == 0 && frame.ny % 2 == 0) return n_pixels * 3 / 2;
+    return 0;
+}
+
+// Raw RGB / NV12 frame wrapped in a bitmap, no codec in between. The id is the hash of the raw frame
+static mtmd_bitmap* init_frame_bitmap(const llama_mico_modal_buffer& frame, const HashKey& content_id,
+                                      const ImageVariant& variant, LlamaMicoContext* context, LlamaSeqState& state) {
+    size_t n_pixels = (size_t)frame.nx * frame.ny;
+    size_t expected = raw_frame_bytes(frame);
+    if (n_pixels == 0 || expected == 0 || frame.size < expected) {
+        LOG_ERR("ERR: invalid raw frame, format %d %ux%u with %zu bytes\n", frame.format, frame.nx, frame.ny,
+                frame.size);
+        return nullptr;
+    }
+
+    std::shared_ptr<mtmd_context> ctx_vision = context->vision();
+    if (!ctx_vision) {
+        LOG_ERR("ERR: no vision model for a raw frame\n");
+        return nullptr;
+    }
+    HashKey key = variant_key(content_id.empty() ? hash_bytes(frame.data, expected) : content_id, variant);
+    bool cachable = mtmd_support_cached_bitmap(ctx_vision.get());
+    if (cachable) {
+        mtmd_bitmap* cached = cached_image_bitmap(key, context, state);
+        if (cached) return cached;
+    }
+
+    mtmd_bitmap* bitmap = nullptr;
+    std::vector<uint8_t> rgb;
+    if (frame.format == LLAMA_MICO_MODAL_NV12) {
+        rgb.resize(n_pixels * 3);
+        nv12_to_rgb(frame.data, frame.nx, frame.ny, rgb.data());
+    }
+    const uint8_t* pixels = rgb.empty() ? frame.data : rgb.data();
+    if (variant.roi[2] > 0) {
+        bitmap = init_region_bitmap(pixels, frame.nx, frame.ny, variant.roi);
+    } else {
+        bitmap = mtmd_bitmap_init(frame.nx, frame.ny, pixels);
+    }
+    if (!bitmap) return nullptr;
+    bitmap = cap_bitmap_side(bitmap, variant.max_side);
+    mtmd_bitmap_set_id(bitmap, hash_to_hex(key).c_str());
+    mtmd_bitmap_set_pool(bitmap, variant.pool);
+    return cachable ? dedup_frame_bitmap(bitmap, key, variant.stream, context, state) : bitmap;
+}
+
+// id empty: the bitmap id is the hash of the bytes
+static mtmd_bitmap* init_modal_bitmap(const MicoRequest& request, size_t i, const HashKey& id,
+                                      const ImageVariant& variant, LlamaMicoContext* context, LlamaSeqState& state) {
+    const auto& modal = request.modal_prts[i];
+    return modal.format == LLAMA_MICO_MODAL_ENCODED
+               ? init_image_bitmap(modal.data, modal.size, id, variant, context, state)
+               : init_frame_bitmap(modal, id, variant, context, state);
+}
+
+static mtmd_bitmap* init_modal_bitmap(const MicoRequest& request, size_t i, LlamaMicoContext* context,
+                                      LlamaSeqState& state) {
+    ImageVariant variant = image_variant(request, &request.modal_prts[i], context);
+    return init_modal_bitmap(request, i, request.content_id(i), variant, context, state);
+}
+
+uint64_t MicoRequest::stream_key(size_t i) const {
+    if (i < modal_streams.size() && modal_streams[i] != 0) return modal_streams[i];
+    const std::string& name = !video_session.empty() ? video_session : session;
+    return name.empty() ? 0 : hash_bytes(name.data(), name.size()).lo;
+}
+
+// Content id of modal buffer i, else the hash of its bytes, empty if they are invalid
+static HashKey modal_content_id(const MicoRequest& request, size_t i) {
+    const auto& modal = request.modal_prts[i];
+    HashKey id = request.content_id(i);
+    if (id.empty() && modal.data) {
+        size_t n_bytes = modal.format == LLAMA_MICO_MODAL_ENCODED ? modal.size : raw_frame_bytes(modal);
+        if (n_bytes == 0 || n_bytes > modal.size) return HashKey();
+        id = hash_bytes(modal.data, n_bytes);
+    }
+    return id;
+}
+
+HashKey modal_cache_key(const MicoRequest& request, size_t i, LlamaMicoContext* context) {
+    HashKey id = modal_content_id(request, i);
+    return id.empty() ? id : variant_key(id, image_variant(request, &request.modal_prts[i], context));
+}
+
+// Image bitmap decoded before for another occurrence in the request, its pixels copied (a cached bitmap has none),
+// nullptr for audio
+static mtmd_bitmap* copy_image_bitmap(const mtmd_bitmap* bitmap) {
+    if (mtmd_bitmap_is_audio(bitmap)) return nullptr;
+    uint32_t nx = mtmd_bitmap_get_nx(bitmap), ny = mtmd_bitmap_get_ny(bitmap);
+    mtmd_bitmap* copy = mtmd_bitmap_get_n_bytes(bitmap) == 0
+                            ? mtmd_bitmap_init_cached(nx, ny, mtmd_bitmap_get_id(bitmap))
+                            : mtmd_bitmap_init(nx, ny, mtmd_bitmap_get_data(bitmap));
+    mtmd_bitmap_set_id(copy, mtmd_bitmap_get_id(bitmap));
+    mtmd_bitmap_set_pool(copy, mtmd_bitmap_get_pool(bitmap));
+    return copy;
+}
+
+// Bitmap of an image with cache key key, a copy of the bitmap decoded for an earlier occurrence in the request (a
+// frame repeated across turns, a snapshot several rules share) if any, else decoded by init
+static bool add_image_bitmap(const HashKey& key, std::unordered_map<HashKey, size_t, HashKeyHasher>& decoded,
+                             LlamaSeqState& state, const std::function<mtmd_bitmap*()>& init) {
+    auto seen = key.empty() ? decoded.end() : decoded.find(key);
+    mtmd_bitmap* bitmap = nullptr;
+    if (seen != decoded.end()) bitmap = copy_image_bitmap(state.bitmaps.entries[seen->second].ptr.get());
+    if (!bitmap) bitmap = init();
+    if (!bitmap) return false;
+    if (!key.empty()) decoded.emplace(key, state.bitmaps.entries.size());
+    state.bitmaps.entries.emplace_back(bitmap);
+    return true;
+}
+
+std::vector<std::shared_ptr<mtmd_input_chunk>> frame_image_chunks(llama_mico_modal_buffer frame, const char* content_id,
+                                                                  LlamaMicoContext* context, bool& cached,
+                                                                  bool with_cached) {
+    cached = false;
+    MicoRequest request;
+    if (!frame.data && frame.buffer_id > 0 && !resolve_buffer(frame, request, context)) return {};
+    if (!frame.data || frame.size == 0 || frame.size > INT32_MAX) {
+        LOG_ERR("ERR: invalid frame to encode\n");
+        return {};
+    }
+    if (!content_id || !content_id[0]) content_id = frame.content_id;
+    request.modal_ids.push_back(content_id && content_id[0] ? hash_bytes(content_id, strlen(content_id)) : HashKey());
+    frame.content_id = nullptr;
+    request.modal_prts.push_back(frame);
+
+    auto state = std::make_unique<LlamaSeqState>();  // NOTE: holds the pin of a cached bitmap until the return
+    mtmd_bitmap* bitmap = init_modal_bitmap(request, 0, context, *state);
+    if (!bitmap) return {};
+    state->bitmaps.entries.emplace_back(bitmap);
+    if (mtmd_bitmap_get_n_bytes(bitmap) == 0) {  // a cached bitmap has no pixels
+        cached = true;
+        if (!with_cached) return {};
+    }
+    std::shared_ptr<mtmd_context> ctx_vision = context->vision();
+    mtmd::input_chunks chunks(mtmd_input_chunks_init());
+    mtmd_input_text text;
+    text.text = mtmd_default_marker();
+    text.add_special = false;
+    text.parse_special = true;
+    auto bitmaps_c_ptr = state->bitmaps.c_ptr();
+    if (!ctx_vision || mtmd_tokenize(ctx_vision.get(), chunks.ptr.get(), &text, bitmaps_c_ptr.data(), 1) != 0) {
+        LOG_ERR("ERR: failed to tokenize a frame to encode\n");
+        return {};
+    }
+    std::vector<std::shared_ptr<mtmd_input_chunk>> images;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        if (mtmd_input_chunk_get_type(chunks[i]) == MTMD_INPUT_CHUNK_TYPE_TEXT) continue;
+        images.emplace_back(mtmd_input_chunk_copy(chunks[i]), mtmd_input_chunk_free);
+    }
+    return images;
+}
+
+// Bitmaps of a video clip, a frame equal to the last kept one (same id, or within frame_dedup_bits of its perceptual
+// hash) is dropped unless it is a keyframe. Returns the number of kept frames, -1 on error
+static int32_t ready_clip_bitmaps(const MicoRequest& request, size_t first, int32_t n_frames,
+                                  LlamaMicoContext* context, LlamaSeqState& state) {
+    int32_t n_kept = 0;
+    std::string last_id;
+    uint64_t last_dhash = 0;
+    bool has_dhash = false;
+    for (int32_t i = 0; i < n_frames; i++) {
+        mtmd_bitmap* bitmap = init_modal_bitmap(request, first + i, context, state);
+        if (!bitmap) return -1;
+
+        std::string id = mtmd_bitmap_get_id(bitmap);
+        // NOTE: cached bitmaps have no pixels
+        const unsigned char* rgb = mtmd_bitmap_get_n_bytes(bitmap) > 0 ? mtmd_bitmap_get_data(bitmap) : nullptr;
+        bool near = context->frame_dedup_bits > 0 && rgb;
+        uint64_t dhash = near ? image_dhash(rgb, mtmd_bitmap_get_nx(bitmap), mtmd_bitmap_get_ny(bitmap)) : 0;
+        int bits = __builtin_popcountll(dhash ^ last_dhash);
+        bool unchanged = n_kept > 0 && (id == last_id || (near && has_dhash && bits <= context->frame_dedup_bits));
+        if (unchanged && !request.keyframes[first + i]) {
+            mtmd_bitmap_free(bitmap);
+            continue;
+        }
+        last_id = std::move(id);
+        last_dhash = dhash;
+        has_dhash = near;
+        state.bitmaps.entries.emplace_back(bitmap);
+        n_kept++;
+    }
+    return n_kept;
+}
+
+bool ready_modal_bitmaps(const MicoRequest& request, common_chat_templates_inputs& tmpl_inputs, std::string& prompt,
+                         LlamaMicoContext* context, LlamaSeqState& state) {
+    if (!request.modal_frames.empty()) {
+        const std::string marker = MICO_DEFAULT_IMAGE_MARKER;
+        size_t i_modal = 0, pos = 0;
+        for (int32_t n_frames : request.modal_frames) {
+            if (i_modal + n_frames > request.modal_prts.size()) return false;
+            int32_t n_kept = ready_clip_bitmaps(request, i_modal, n_frames, context, state);
+            if (n_kept < 0) return false;
+            i_modal += n_frames;
+
+            pos = prompt.find(marker, pos);
+            if (pos == std::string::npos) return false;  // NOTE: more clips than markers
+            std::string markers;
+            for (int32_t k = 0; k < n_kept; k++) markers += marker;
+            prompt.replace(pos, marker.size(), markers);
+            pos += markers.size();
+        }
+    } else if (!request.modal_prts.empty()) {
+        // NOTE: the id is hashed here once instead of in init_modal_bitmap
+        std::unordered_map<HashKey, size_t, HashKeyHasher> decoded;
+        for (size_t i = 0; i < request.modal_prts.size(); i++) {
+            HashKey id = modal_content_id(request, i);
+            ImageVariant variant = image_variant(request, &request.modal_prts[i], context);
+            HashKey key = id.empty() ? id : variant_key(id, variant);
+            auto init = [&]() { return init_modal_bitmap(request, i, id, variant, context, state); };
+            if (!add_image_bitmap(key, decoded, state, init)) return false;
         }
     } else {
         // Images converted from base64
+        std::unordered_map<HashKey, size_t, HashKeyHasher> decoded;
         for (const auto& m : tmpl_inputs.messages) {
             for (const auto& p : m.content_parts) {
                 for (const auto& img : p.images) {
-                    auto bitmap_ptr = mtmd_helper_bitmap_init_from_buf(
-                        context->ctx_vision.get(), reinterpret_cast<const unsigned char*>(img.c_str()), img.size(), 0,
-                        0);
-                    if (!bitmap_ptr) {
-                        return false;
-                    }
-                    state.bitmaps.entries.emplace_back(bitmap_ptr);
+                    const unsigned char* buf = reinterpret_cast<const unsigned char*>(img.c_str());
+                    HashKey id = hash_bytes(buf, img.size());
+                    ImageVariant variant = image_variant(request, nullptr, context);
+                    auto init = [&]() { return init_image_bitmap(buf, img.size(), id, variant, context, state); };
+                    if (!add_image_bitmap(variant_key(id, variant), decoded, state, init)) return false;
                 }
             }
         }
@@ -115,17 +1002,53 @@ bool ready_modal_bitmaps(std::vector<std::map<const unsigned char*, int32_t>>& m
     return true;
 }
 
+// A prompt without media markers is one text chunk, tokenized as mtmd_tokenize would without the vision model
+static bool has_media_marker(const char* text) {
+    return std::strstr(text, MICO_DEFAULT_IMAGE_MARKER) || std::strstr(text, MTMD_DEFAULT_IMAGE_MARKER);
+}
+
 bool from_input_to_token_chunks(common_chat_params& formatted_chat, std::shared_ptr<mtmd::input_chunks> chunks,
-                                LlamaMicoContext* context, LlamaSeqState& state) {
+                                LlamaMicoContext* context, LlamaSeqState& state, const ChatPrefix& prefix) {
+    bool cached = prefix.tokens && prefix.n_chars <= formatted_chat.prompt.size();
     mtmd_input_text text;
-    text.text = formatted_chat.prompt.c_str();
-    text.add_special = true;
+    text.text = formatted_chat.prompt.c_str() + (cached ? prefix.n_chars : 0);
+    text.add_special = !cached;  // NOTE: the cached tokens begin with the special ones
     text.parse_special = true;
     auto bitmaps_c_ptr = state.bitmaps.c_ptr();
-    int32_t ret =
-        mtmd_tokenize(context->ctx_vision.get(), chunks->ptr.get(), &text, bitmaps_c_ptr.data(), bitmaps_c_ptr.size());
+    int32_t ret = 0;
+    if (bitmaps_c_ptr.empty() && !has_media_marker(text.text)) {  // NOTE: text only, never loads the vision model
+        chunks->ptr.reset(mtmd_input_chunks_init());
+        std::vector<llama_token> tokens = common_tokenize(context->vocab, text.text, text.add_special,
+                                                          text.parse_special);
+        if (!tokens.empty()) chunks->ptr.reset(mtmd_create_text_chunks(std::move(tokens)));
+    } else {
+        std::shared_ptr<mtmd_context> ctx_vision = context->vision();
+        ret = ctx_vision ? mtmd_tokenize(ctx_vision.get(), chunks->ptr.get(), &text, bitmaps_c_ptr.data(),
+                                         bitmaps_c_ptr.size())
+                         : -1;
+    }
+    if (ret == 0) context->prompt_budget->record(text.text, state.bitmaps, chunks->ptr.get());
     state.bitmaps.entries.clear();
-    return ret == 0;
+    if (ret != 0 || !cached) return ret == 0;
+
+    // The prefix tokens join the first text chunk, the chunks look the same as from tokenizing the whole prompt
+    mtmd_input_chunks* new_chunks = mtmd_input_chunks_init();
+    std::vector<llama_token> tokens = *prefix.tokens;
+    size_t n_chunks = mtmd_input_chunks_size(chunks->ptr.get()), i = 0;
+    if (n_chunks > 0 && mtmd_input_chunk_get_type(mtmd_input_chunks_get(chunks->ptr.get(), 0)) ==
+                            MTMD_INPUT_CHUNK_TYPE_TEXT) {
+        size_t n_tokens;
+        const llama_token* first = mtmd_input_chunk_get_tokens_text(mtmd_input_chunks_get(chunks->ptr.get(), 0),
+                                                                    &n_tokens);
+        tokens.insert(tokens.end(), first, first + n_tokens);
+        i = 1;
+    }
+    mtmd_input_chunk* text_chunk = mtmd_create_text_chunk(std::move(tokens));
+    mtmd_input_chunks_add_chunk(new_chunks, text_chunk);
+    mtmd_input_chunk_free(text_chunk);
+    for (; i < n_chunks; i++) mtmd_input_chunks_add_chunk(new_chunks, mtmd_input_chunks_get(chunks->ptr.get(), i));
+    chunks->ptr.reset(new_chunks);
+    return true;
 }
 
 bool crop_by_query(std::shared_ptr<mtmd::input_chunks> chunks, int32_t current_tokens, int32_t prompt_limit,
@@ -133,86 +1056,41 @@ bool crop_by_query(std::shared_ptr<mtmd::input_chunks> chunks, int32_t current_t
     LOG_INF("Attemp crop by user query\n");
 
     int32_t chunk_size = mtmd_input_chunks_size(chunks->ptr.get());
-    auto find_lable = [&](std::vector<llama_token> source, std::vector<llama_token> lable, int32_t left_index) {
-        if (left_index < 0 || left_index >= source.size()) return -1;
-        for (int i = left_index; i < source.size(); i++) {
-            if (source[i] == lable[0]) {
-                int j = 0;
-                for (j; j < lable.size(); ++j) {
-                    if (source[i + j] != lable[j]) {
-                        break;
-                    }
-                }
-                if (j == lable.size()) {
-                    return i;
-                }
+    const auto& lable = context->crop_tokens_lable;
+    const auto& next = context->crop_lable_next;
+    if (lable.empty()) return false;
+
+    // every user turn label (chunk, token) in one KMP pass over the text chunks, non-overlapping and within a chunk
+    std::vector<std::pair<int32_t, int32_t>> lables;
+    std::vector<int32_t> chunk_offsets(chunk_size + 1, 0);  // prompt position of each chunk
+    for (int32_t c = 0; c < chunk_size; c++) {
+        auto chunk = mtmd_input_chunks_get(chunks->ptr.get(), c);
+        size_t n_tokens = mtmd_input_chunk_get_n_tokens(chunk);
+        chunk_offsets[c + 1] = chunk_offsets[c] + (int32_t)n_tokens;
+        if (mtmd_input_chunk_get_type(chunk) != MTMD_INPUT_CHUNK_TYPE_TEXT) continue;
+        const llama_token* tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);  // NOTE: a view, no copy
+        for (size_t t = 0, k = 0; t < n_tokens; t++) {
+            while (k > 0 && tokens[t] != lable[k]) k = next[k - 1];
+            if (tokens[t] == lable[k]) k++;
+            if (k == lable.size()) {
+                lables.emplace_back(c, (int32_t)(t + 1 - k));
+                k = 0;
             }
         }
-        return -1;
-    };
-
-    auto find_lable_chunk = [&](std::shared_ptr<mtmd::input_chunks> chunks, int32_t left_chunk_index,
-                                int32_t left_token_index) {
-        int32_t chunk_index = -1, chunk_token = -1, index = left_chunk_index, token_index = left_token_index;
-        while (index < chunk_size) {
-            auto chunk = mtmd_input_chunks_get(chunks->ptr.get(), index);
-            if (mtmd_input_chunk_get_type(chunk) != MTMD_INPUT_CHUNK_TYPE_TEXT) {
-                index++;
-                token_index = 0;
-                continue;
-            }
-            size_t n_tokens_chunk = mtmd_input_chunk_get_n_tokens(chunk);
-            const llama_token* tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens_chunk);
-            std::vector<llama_token> tokens_vector(tokens, tokens + n_tokens_chunk);
-            int32_t find_token = find_lable(tokens_vector, context->crop_tokens_lable, token_index);
-            if (find_token != -1) {
-                chunk_index = index;
-                chunk_token = find_token;
-                break;
-            }
+    }
+    if (lables.empty()) return false;
 
-            index++;
-            token_index = 0;
-        }
-        return std::tuple<int32_t, int32_t>(chunk_index, chunk_token);
-    };
-
-    // find crop range
-    int32_t f_chunk_index = -1, f_token_index = -1;
-    int32_t s_chunk_index = -1, s_token_index = -1;
-    auto lable_idx = find_lable_chunk(chunks, 0, 0);
-    f_chunk_index = std::get<0>(lable_idx);
-    f_token_index = std::get<1>(lable_idx);
-    int32_t start_chunk_index = f_chunk_index, end_chunk_index = f_chunk_index;
-    int32_t end_token_index = f_token_index, start_token_index = f_token_index;
+    // find crop range: drop whole turns from the first label on until the prompt fits
+    int32_t start_chunk_index = lables[0].first, start_token_index = lables[0].second;
+    int32_t end_chunk_index = start_chunk_index, end_token_index = start_token_index;
     int32_t crop_token = 0;
-    while (current_tokens > prompt_limit && f_chunk_index != -1) {
-        auto idx = find_lable_chunk(chunks, f_chunk_index, f_token_index + context->crop_tokens_lable.size());
-        s_chunk_index = std::get<0>(idx);
-        s_token_index = std::get<1>(idx);
-        if (s_chunk_index == -1) break;
-
-        int32_t new_corp = 0;
-        if (f_chunk_index == s_chunk_index) {
-            new_corp += s_token_index - f_token_index;
-        } else {
-            auto f_chunk = mtmd_input_chunks_get(chunks->ptr.get(), f_chunk_index);
-            size_t f_tokens = mtmd_input_chunk_get_n_tokens(f_chunk);
-            new_corp += f_tokens - f_token_index;
-            for (int i = f_chunk_index + 1; i < s_chunk_index; ++i) {
-                auto chunk = mtmd_input_chunks_get(chunks->ptr.get(), i);
-                size_t tokens = mtmd_input_chunk_get_n_tokens(chunk);
-                new_corp += tokens;
-            }
-            new_corp += s_token_index;
-        }
+    for (size_t l = 1; l < lables.size() && current_tokens > prompt_limit; l++) {
+        int32_t new_corp = chunk_offsets[lables[l].first] + lables[l].second - chunk_offsets[end_chunk_index] -
+                           end_token_index;
         crop_token += new_corp;
         current_tokens -= new_corp;
-
-        f_chunk_index = s_chunk_index;
-        f_token_index = s_token_index;
-        end_chunk_index = f_chunk_index;
-        end_token_index = f_token_index;
+        end_chunk_index = lables[l].first;
+        end_token_index = lables[l].second;
     }
 
     // last query is too long, could not crop by query
@@ -222,9 +1100,7 @@ bool crop_by_query(std::shared_ptr<mtmd::input_chunks> chunks, int32_t current_t
     mtmd_input_chunks* new_chunks = mtmd_input_chunks_init();
     int index = 0;
     for (index; index < start_chunk_index; ++index) {
-        auto chunk = mtmd_input_chunks_get(chunks->ptr.get(), index);
-        mtmd_input_chunk* copied_chunk = mtmd_input_chunk_copy(chunk);
-        mtmd_input_chunks_add_chunk(new_chunks, copied_chunk);
+        mtmd_input_chunks_add_chunk(new_chunks, mtmd_input_chunks_get(chunks->ptr.get(), index));
     }
 
     auto start_chunk = mtmd_input_chunks_get(chunks->ptr.get(), index);
@@ -290,9 +1166,7 @@ bool crop_by_tokens(std::shared_ptr<mtmd::input_chunks> chunks, int32_t current_
             }
         } else {
             if (n_tokens_chunk <= remaining_tokens) {
-                mtmd_input_chunk* copied_chunk = mtmd_input_chunk_copy(chunk);
-                mtmd_input_chunks_insert_chunk_front(new_chunks, copied_chunk);
-                mtmd_input_chunk_free(copied_chunk);
+                mtmd_input_chunks_insert_chunk_front(new_chunks, chunk);  // NOTE: shares the modal tokens
                 remaining_tokens -= n_tokens_chunk;
             } else {
                 // Discard modal tokens
@@ -327,4 +1201,88 @@ void limit_prompt_tokens(std::shared_ptr<mtmd::input_chunks> chunks, int32_t n_u
     if (crop_by_query(chunks, current_tokens, prompt_limit, context)) return;
 
     crop_by_tokens(chunks, current_tokens, prompt_limit, context);
-}
\ No newline at end of file
+}
+
+HashKey request_fingerprint(const MicoRequest& request, LlamaMicoContext* context) {
+    float temp = request.temperature >= 0 ? request.temperature : context->sampling.temp;
+    if (!request.coalesce || temp > 0 || context->sampling.mirostat != 0 || !request.session.empty() ||
+        !request.video_session.empty() || context->context_shift) {
+        return HashKey();
+    }
+    std::string text = request.messages.dump() + '\x1f' + request.grammar + '\x1f' + request.lora;
+    for (const auto& msg : request.chat_msgs) text += '\x1f' + msg.role + '\x1e' + msg.content;
+    uint64_t sides = (uint64_t)request.image_max_side << 32 | (uint32_t)request.image_min_side;
+    std::vector<HashKey> parts = {hash_bytes(text.data(), text.size()), {(uint64_t)request.vision_pool, sides},
+                                  request.tools ? request.tools->key : HashKey()};
+    for (size_t i = 0; i < request.modal_prts.size(); i++) {
+        const auto& modal = request.modal_prts[i];
+        HashKey id = request.content_id(i);
+        parts.push_back(!id.empty() ? id : modal.data ? hash_bytes(modal.data, modal.size) : HashKey());
+        uint64_t format = (uint64_t)modal.format << 32 | modal_pool(request, &modal);
+        parts.push_back({format, (uint64_t)modal.nx << 32 | modal.ny});  // NOTE: not the buffer id
+        if (modal.roi_w > 0 || modal.max_side > 0) parts.push_back(hash_bytes(&modal.roi_x, 5 * sizeof(int32_t)));
+    }
+    parts.push_back(hash_bytes(request.modal_frames.data(), request.modal_frames.size() * sizeof(int32_t)));
+    parts.push_back(hash_bytes(request.keyframes.data(), request.keyframes.size()));
+    std::string limits = std::to_string(request.max_tokens);  // NOTE: the decode loop ends a request at either
+    for (const auto& stop : request.stop_strings) limits += '\x1f' + stop;
+    parts.push_back(hash_bytes(limits.data(), limits.size()));
+    return hash_bytes(parts.data(), parts.size() * sizeof(HashKey));
+}
+
+void keep_prefix_chunks(std::shared_ptr<mtmd::input_chunks> chunks, size_t n_items) {
+    chunks->ptr = std::move(prefix_chunks(*chunks, n_items)->ptr);
+}
+
+std::shared_ptr<mtmd::input_chunks> prefix_chunks(const mtmd::input_chunks& chunks, size_t n_items) {
+    mtmd_input_chunks* kept = mtmd_input_chunks_init();
+    size_t n_chunks = mtmd_input_chunks_size(chunks.ptr.get());
+    for (size_t i = 0; i < n_chunks && n_items > 0; i++) {
+        const mtmd_input_chunk* chunk = mtmd_input_chunks_get(chunks.ptr.get(), i);
+        size_t n_chunk_items = chunk_n_items(chunk);
+        if (n_chunk_items <= n_items) {
+            mtmd_input_chunks_add_chunk(kept, chunk);
+            n_items -= n_chunk_items;
+            continue;
+        }
+        if (mtmd_input_chunk_get_type(chunk) != MTMD_INPUT_CHUNK_TYPE_TEXT) break;
+        size_t n_tokens;
+        const llama_token* tokens = mtmd_input_chunk_get_tokens_text(chunk, &n_tokens);
+        mtmd_input_chunk* head = mtmd_create_text_chunk(std::vector<llama_token>(tokens, tokens + n_items));
+        mtmd_input_chunks_add_chunk(kept, head);
+        mtmd_input_chunk_free(head);
+        break;
+    }
+    return std::make_shared<mtmd::input_chunks>(kept);
+}
+
+size_t cache_prefix_items(const MicoRequest& request, const common_chat_templates_inputs& tmpl_inputs,
+                          const std::vector<PrefixItem>& items, LlamaMicoContext* context) {
+    if (request.cache_prefix <= 0 || (size_t)request.cache_prefix >= tmpl_inputs.messages.size()) return 0;
+
+    common_chat_templates_inputs prefix_inputs = tmpl_inputs;
+    prefix_inputs.messages.resize(request.cache_prefix);
+    prefix_inputs.add_generation_prompt = false;
+    std::string prompt = "";
+    ChatPrefix prefix;
+    try {
+        prompt = context->chat_cache->apply(prefix_inputs, prefix).prompt;
+    } catch (const std::exception& e) {
+        LOG_WRN("failed to render cache prefix, cache the whole prompt, err: %s\n", e.what());
+        return 0;
+    }
+
+    // NOTE: the last tokens may merge across the split, keep only the part tokenized the same way
+    std::vector<llama_token> tokens;
+    if (prefix.tokens) {
+        tokens = *prefix.tokens;
+        auto rest = common_tokenize(context->vocab, prompt.substr(prefix.n_chars), false /* add_special */,
+                                    true /* parse_special */);
+        tokens.insert(tokens.end(), rest.begin(), rest.end());
+    } else {
+        tokens = common_tokenize(context->vocab, prompt, true /* add_special */, true /* parse_special */);
+    }
+    size_t n_items = 0;
+    while (n_items < tokens.size() && n_items < items.size() && items[n_items].key == tokens[n_items]) n_items++;
+    return n_items;
+}
@@ -4,34 +4,111 @@
  */
 
 #pragma once
+#include <cmath>
+
+#include "cache_manager/chat-template-cache.h"
 #include "common/json-partial.h"
+#include "llama-mico.h"
 #include "utils/mico-common.h"
+#include "utils/modal-buffer-pool.h"
 
 using json = nlohmann::ordered_json;
 
+/** return code **/
+#define MICO_SUCCESS 0
+#define MICO_ERROR -1
+#define MICO_ERROR_EXCEED_MAX_CONTEXT -2
+#define MICO_ERROR_DEADLINE_EXCEEDED -3
+#define MICO_ERROR_BUFFER_TOO_SMALL -4
+
+#define PROMPT_PROPORTION_LIMIT 0.8  // prompts are kept within this share of the context limit
+
 struct MicoRequest {
     int32_t id{0};
     int32_t priority{0};
     json messages;
-    json tools;
-    std::vector<std::map<const unsigned char*, int32_t>> modal_prts;
+    std::shared_ptr<const ChatTools> tools;  // nullptr for no tools
+    std::vector<common_chat_msg> chat_msgs;  // pre-rendered messages, used instead of messages if not empty
+    std::vector<llama_mico_modal_buffer> modal_prts;  // encoded images or raw frames, referenced not copied
+    std::vector<int32_t> modal_frames;  // modal_prts behind each image marker (video clips), empty for one each
+    std::vector<uint8_t> keyframes;     // per modal_prts, clip keyframes are never dropped, empty keeps first and last
+    std::vector<ModalBufferPool::BufferRef> modal_refs;  // registered buffers of modal_prts, pinned while it lives
+    std::vector<HashKey> modal_ids;  // per modal_prts, key of the caller content id, empty (or missing) hashes content
+    std::vector<uint64_t> modal_streams;  // per modal_prts, camera key of a frame ring frame, 0 (or missing) if none
     bool stop = false;
+    int32_t cache_prefix{0};  // leading messages (and tools) kept as a shared kv prefix, 0 caches the whole prompt
+    std::string session{""};  // multi-turn session, its kv stays cached until released or evicted
+    bool cache_pin{false};    // the cached prefix is pinned in the kv cache, see cache_pin_max
+    bool coalesce{true};      // may share the tokens of an identical or memoised request, see request_fingerprint
+    std::string lora{""};     // LoRA adapter of lora_adapters, empty for the base model
+    std::string video_session{""};  // live video stream, its frame window stays in kv between questions
+    bool timings{false};  // stage times and cache use are kept for llama_mico_get_timings when it stops
+
+    // sampling, negative / empty keeps the configured default
+    float temperature{-1};
+    float top_p{-1};
+    int32_t top_k{-1};
+    float repeat_penalty{-1};
+    float presence_penalty{NAN};  // NaN keeps the default, negative values favour repeats
+    float frequency_penalty{NAN};
+    std::string grammar{""};
+    uint32_t seed_offset{0};  // added to a configured seed, completions of one prompt draw apart
+    std::vector<std::string> stop_strings;  // generated text ends before the first one, the match is not returned
+    int32_t max_tokens{0};                  // generated tokens, the prompt token included, 0 for no limit
+    int64_t expire_ms{0};  // arrival + deadline_ms (ggml_time_ms), the prompt is dropped if not inferred by then
+    int32_t vision_pool{1};  // vision token pooling of images without their own pool
+    // longest image side, 0 for the input size. The engine lowers it down to image_min_side as the encoder load
+    // grows, 0 keeps image_max_side
+    int32_t image_max_side{0};
+    int32_t image_min_side{0};
+
+    // Caller content id key of modal_prts[i], empty if its content is hashed
+    HashKey content_id(size_t i) const { return i < modal_ids.size() ? modal_ids[i] : HashKey(); }
+    // Stream modal_prts[i] (i past the end for base64 images) was captured from: its camera, else the video or
+    // multi-turn session of the request, 0 if unknown. Near-duplicate frames only match within one stream
+    uint64_t stream_key(size_t i) const;
 };
 
-bool from_json_to_request(const json& j, MicoRequest& r);
+// Registered modal buffers and camera frames are looked up in context, nullptr rejects them
+bool from_json_to_request(const json& j, MicoRequest& r, LlamaMicoContext* context = nullptr);
+
+// Request JSON text to r. The tools array is cut out of the text by a structural scan and handed to the tools cache
+// of context as is, only the rest of the request is parsed into a DOM. False if the text or the request is invalid
+bool parse_request_json(const char* text, MicoRequest& r, LlamaMicoContext* context = nullptr);
+
+bool from_struct_to_request(const llama_mico_request& s, MicoRequest& r, LlamaMicoContext* context = nullptr);
 
 int32_t stop_process(bool sucess, std::string& respone, const char** content, int32_t& is_finished,
                      LlamaSeqState& state, LlamaMicoContext* context, int32_t seq_id, bool stop_infer = true,
                      bool too_lang = false);
 
+// Replace the sequence sampler with one built from the request sampling parameters, without a request grammar the
+// tool call grammar of the rendered chat (if any) constrains it
+bool init_seq_sampler(const MicoRequest& request, LlamaMicoContext* context, LlamaSeqState& state,
+                      const common_chat_params& chat);
+
+// Longest prefix of text[0, len) that does not end inside a utf8 sequence
+size_t utf8_complete_len(const std::string& text, size_t len);
+
+// Bytes of held that can be returned: the text before the first stop string (stopped is set), else all of it but a
+// partial stop string at its end and an unfinished utf8 sequence
+size_t held_text_len(const std::string& held, const std::vector<std::string>& stops, bool& stopped);
+
+// prefix (optional) gets the cached tokens of the system prefix of the prompt. prompt_limit > 0 drops the oldest
+// turns (and their images) estimated over it before rendering, see PromptBudget
 void apply_chat_templates(common_chat_params& formatted_chat, common_chat_templates_inputs& tmpl_inputs,
-                          LlamaMicoContext* context, json messages, json tools);
+                          LlamaMicoContext* context, MicoRequest& request, ChatPrefix* prefix = nullptr,
+                          int32_t prompt_limit = 0);
 
-bool ready_modal_bitmaps(std::vector<std::map<const unsigned char*, int32_t>>& modal_prts,
-                         common_chat_templates_inputs& tmpl_inputs, LlamaMicoContext* context, LlamaSeqState& state);
+// Bitmaps of the request images in marker order. A video clip drops frames unchanged since its last kept frame and
+// expands its marker in prompt into one marker per kept frame
+bool ready_modal_bitmaps(const MicoRequest& request, common_chat_templates_inputs& tmpl_inputs, std::string& prompt,
+                         LlamaMicoContext* context, LlamaSeqState& state);
 
+// NOTE: prompt[0, prefix.n_chars) takes the cached prefix tokens, only the rest is tokenized
 bool from_input_to_token_chunks(common_chat_params& formatted_chat, std::shared_ptr<mtmd::input_chunks> chunks,
-                                LlamaMicoContext* context, LlamaSeqState& state);
+                                LlamaMicoContext* context, LlamaSeqState& state,
+                                const ChatPrefix& prefix = ChatPrefix());
 
 bool crop_by_query(std::shared_ptr<mtmd::input_chunks> chunks, int32_t current_tokens, int32_t prompt_limit,
                    LlamaMicoContext* context);
@@ -41,3 +118,27 @@ bool crop_by_tokens(std::shared_ptr<mtmd::input_chunks> chunks, int32_t current_
 
 void limit_prompt_tokens(std::shared_ptr<mtmd::input_chunks> chunks, int32_t n_usage_context, LlamaSeqState& state,
                          LlamaMicoContext* context);
+
+// Fingerprint of a request whose output only depends on its prompt (greedy, no session, no context shift): messages,
+// tools, grammar, modal buffer contents, max_tokens and stop strings, empty if it can not be coalesced or memoised
+HashKey request_fingerprint(const MicoRequest& request, LlamaMicoContext* context);
+
+// Embedding cache key of modal buffer i of request as prepare_prompt would store it, empty if it has no content.
+// NOTE: images of a slicing model are cached per slice under other keys
+HashKey modal_cache_key(const MicoRequest& request, size_t i, LlamaMicoContext* context);
+
+// Image chunks (slices) of a frame as the prompt of a request with default options tokenizes it, the options of the
+// frame (pool, roi, max_side) apply. Empty on error and if its embeddings are cached already (cached is set then)
+// unless with_cached, the chunks of a cached frame only find their embeddings in the cache
+std::vector<std::shared_ptr<mtmd_input_chunk>> frame_image_chunks(llama_mico_modal_buffer frame, const char* content_id,
+                                                                  LlamaMicoContext* context, bool& cached,
+                                                                  bool with_cached = false);
+
+// Keeps the first n_items prefix items of chunks, a text chunk is cut inside, see prefix_items
+void keep_prefix_chunks(std::shared_ptr<mtmd::input_chunks> chunks, size_t n_items);
+// The first n_items prefix items of chunks as new chunks, chunks is left as is
+std::shared_ptr<mtmd::input_chunks> prefix_chunks(const mtmd::input_chunks& chunks, size_t n_items);
+
+// Prompt prefix items rendered from the first request.cache_prefix messages, 0 if unset or not a text prefix
+size_t cache_prefix_items(const MicoRequest& request, const common_chat_templates_inputs& tmpl_inputs,
+                          const std::vector<PrefixItem>& items, LlamaMicoContext* context);
@@ -0,0 +1,56 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef MICO_LOG_H
+#define MICO_LOG_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "common/log.h"
+#include "ggml.h"
+
+// Logs of the scheduler and cache threads. common_log writes from its own worker thread but the message is still
+// formatted on the calling one, so events of every request log through LOG_INF_EVERY, events of every batch or token
+// through LOG_HOT, and their counts go to llama_mico_get_metrics
+
+namespace mico_log {
+
+// True at most once per period_ms for one next_us, the call site that wins the exchange logs
+inline bool admit(std::atomic<int64_t>& next_us, int64_t period_ms) {
+    int64_t now_us = ggml_time_us();
+    int64_t due_us = next_us.load(std::memory_order_relaxed);
+    return now_us >= due_us &&
+           next_us.compare_exchange_strong(due_us, now_us + period_ms * 1000, std::memory_order_relaxed);
+}
+
+}  // namespace mico_log
+
+// INFO at most once per period_ms per call site, the next printed message reports how many were dropped.
+// A dropped message costs a clock read and an atomic add, its arguments are not evaluated
+#define LOG_INF_EVERY(period_ms, ...)                                                                 \
+    do {                                                                                              \
+        static std::atomic<int64_t> log_next_us_{0};                                                  \
+        static std::atomic<uint32_t> log_dropped_{0};                                                 \
+        if (!mico_log::admit(log_next_us_, (period_ms))) {                                            \
+            log_dropped_.fetch_add(1, std::memory_order_relaxed);                                     \
+            break;                                                                                    \
+        }                                                                                             \
+        uint32_t log_n_dropped_ = log_dropped_.exchange(0, std::memory_order_relaxed);                \
+        LOG_INF(__VA_ARGS__);                                                                         \
+        if (log_n_dropped_ > 0) LOG_INF("  ... %u more like the above suppressed\n", log_n_dropped_); \
+    } while (0)
+
+// DEBUG of a batch or token step, compiled out of release (NDEBUG) builds. NOTE: kept as dead code there, so the
+// format is still checked and values computed only for the message do not warn as unused
+#ifdef NDEBUG
+#define LOG_HOT(...)                     \
+    do {                                 \
+        if (false) LOG_DBG(__VA_ARGS__); \
+    } while (0)
+#else
+#define LOG_HOT(...) LOG_DBG(__VA_ARGS__)
+#endif
+
+#endif  // MICO_LOG_H
@@ -0,0 +1,99 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "mico-metrics.h"
+
+#include <algorithm>
+#include <cmath>
+
+static const char* STAGE_NAMES[METRIC_STAGE_COUNT] = {"queue_wait",   "template", "bitmap",       "encode",
+                                                      "image_decode", "prefill",  "token_decode", "sampling",
+                                                      "admission_wait"};
+
+size_t LatencyHistogram::bucket_of(uint64_t us) {
+    us = std::min(us, ((uint64_t)1 << HISTOGRAM_MAX_BITS) - 1);
+    if (us < 2 * HISTOGRAM_SUB_BUCKETS) return (size_t)us;  // exact
+    int32_t shift = 63 - __builtin_clzll(us) - HISTOGRAM_SUB_BITS;
+    return (size_t)shift * HISTOGRAM_SUB_BUCKETS + (size_t)(us >> shift);
+}
+
+uint64_t LatencyHistogram::bucket_mid(size_t bucket) {
+    if (bucket < 2 * HISTOGRAM_SUB_BUCKETS) return bucket;
+    int32_t shift = (int32_t)(bucket / HISTOGRAM_SUB_BUCKETS) - 1;
+    uint64_t lower = (uint64_t)(bucket % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS) << shift;
+    return lower + ((1ULL << shift) >> 1);
+}
+
+void LatencyHistogram::record(int64_t us) {
+    uint64_t value = us > 0 ? (uint64_t)us : 0;
+    buckets_[bucket_of(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t seen = min_.load(std::memory_order_relaxed);
+    while (value < seen && !min_.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+    seen = max_.load(std::memory_order_relaxed);
+    while (value > seen && !max_.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {}
+}
+
+nlohmann::ordered_json LatencyHistogram::to_json() const {
+    // NOTE: read while recording, the buckets may count a few more values than count
+    uint64_t count = count_.load(std::memory_order_relaxed);
+    nlohmann::ordered_json j;
+    j["count"] = count;
+    if (count == 0) return j;
+    j["mean_ms"] = sum_.load(std::memory_order_relaxed) / 1000.0 / count;
+    j["min_ms"] = min_.load(std::memory_order_relaxed) / 1000.0;
+    j["max_ms"] = max_.load(std::memory_order_relaxed) / 1000.0;
+
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    const char* names[] = {"p50_ms", "p90_ms", "p99_ms", "p999_ms"};
+    size_t q = 0;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HISTOGRAM_BUCKETS && q < 4; b++) {
+        seen += buckets_[b].load(std::memory_order_relaxed);
+        while (q < 4 && seen >= (uint64_t)std::ceil(quantiles[q] * count)) j[names[q++]] = bucket_mid(b) / 1000.0;
+    }
+    for (; q < 4; q++) j[names[q]] = max_.load(std::memory_order_relaxed) / 1000.0;
+    return j;
+}
+
+void MicoMetrics::record_step_fill(int32_t n_tokens, int32_t capacity) {
+    n_steps_.fetch_add(1, std::memory_order_relaxed);
+    n_step_tokens_.fetch_add(std::max(n_tokens, 0), std::memory_order_relaxed);
+    n_step_capacity_.fetch_add(std::max(capacity, 0), std::memory_order_relaxed);
+}
+
+nlohmann::ordered_json MicoMetrics::to_json() const {
+    nlohmann::ordered_json j;
+    for (int32_t s = 0; s < METRIC_STAGE_COUNT; s++) j["latency"][STAGE_NAMES[s]] = stages_[s].to_json();
+
+    uint64_t capacity = n_step_capacity_.load(std::memory_order_relaxed);
+    j["batch"]["steps"] = n_steps_.load(std::memory_order_relaxed);
+    j["batch"]["tokens"] = n_step_tokens_.load(std::memory_order_relaxed);
+    j["batch"]["fill_ratio"] = capacity > 0 ? (double)n_step_tokens_.load(std::memory_order_relaxed) / capacity : 0.0;
+    j["deadline"]["expired"] = n_expired_.load(std::memory_order_relaxed);
+    return j;
+}
+
+nlohmann::ordered_json RequestTimings::to_json(int64_t t_end_us, int32_t n_generated) const {
+    int64_t t_prefilled_us = t_first_token_us > 0 ? t_first_token_us : t_end_us;  // NOTE: failed in its prefill
+    int32_t n_computed = std::max(n_prompt_pos - n_resident_pos - n_cached_pos, 0);
+    nlohmann::ordered_json j;
+    j["queue_ms"] = queue_us / 1000.0;
+    j["template_ms"] = template_us / 1000.0;
+    j["bitmap_ms"] = bitmap_us / 1000.0;
+    j["prefill_ms"] = std::max(t_prefilled_us - t_prepared_us, (int64_t)0) / 1000.0;
+    j["encode_wait_ms"] = encode_wait_us / 1000.0;
+    j["decode_ms"] = (t_end_us - t_prefilled_us) / 1000.0;
+    j["total_ms"] = (t_end_us - t_arrival_us) / 1000.0;
+    j["prompt"] = {{"positions", n_prompt_pos},
+                   {"resident", n_resident_pos},
+                   {"kv_cache", n_cached_pos},
+                   {"computed", coalesced ? 0 : n_computed}};
+    j["images"] = {{"encoded", n_images_encoded}, {"cached", n_images_cached}, {"kv_reused", n_images_kv_reused}};
+    j["generated_tokens"] = n_generated + (t_first_token_us > 0 ? 1 : 0);  // NOTE: the prompt token included
+    j["coalesced"] = coalesced;
+    return j;
+}
@@ -0,0 +1,90 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef MICO_METRICS_H
+#define MICO_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "nlohmann/json.hpp"
+
+#define HISTOGRAM_SUB_BITS 4                                 // linear buckets per power of two: 16, <= 6.25% error
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40                                // values up to 2^40 us, about 12 days
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+enum MetricStage {
+    METRIC_QUEUE_WAIT = 0,    // a chunk submitted to the batch scheduler until its first step
+    METRIC_TEMPLATE,          // chat template, tokenize and crop of a prompt
+    METRIC_BITMAP,            // decode of the request images and frames into bitmaps
+    METRIC_ENCODE,            // vision encoder of one image
+    METRIC_IMAGE_DECODE,      // llm decode of a batch of image embeddings
+    METRIC_PREFILL,           // whole prompt of a request in kv, first token sampled
+    METRIC_TOKEN_DECODE,      // decode step without prefill tokens, one token (and the accepted drafts) per sequence
+    METRIC_SAMPLING,          // sampling and draft verification of a step
+    METRIC_ADMISSION_WAIT,    // a request waiting in the admission queue for a free sequence
+    METRIC_STAGE_COUNT,
+};
+
+// HDR style latency histogram in us: each power of two range is split into HISTOGRAM_SUB_BUCKETS linear buckets,
+// so percentiles keep the same relative precision from microseconds to minutes. Recording is lock-free
+class LatencyHistogram {
+  public:
+    void record(int64_t us);
+    // count, mean, min, max, p50, p90, p99, p999 in ms
+    nlohmann::ordered_json to_json() const;
+
+  private:
+    static size_t bucket_of(uint64_t us);
+    static uint64_t bucket_mid(size_t bucket);
+
+    std::atomic<uint64_t> buckets_[HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> min_{UINT64_MAX};
+    std::atomic<uint64_t> max_{0};
+};
+
+// Engine wide latency and batching metrics, caches report their own counters, see llama_mico_get_metrics
+class MicoMetrics {
+  public:
+    void record(MetricStage stage, int64_t us) { stages_[stage].record(us); }
+    // tokens of a decode step against the step token budget
+    void record_step_fill(int32_t n_tokens, int32_t capacity);
+    void record_expired() { n_expired_.fetch_add(1, std::memory_order_relaxed); }  // a request failed at its deadline
+
+    nlohmann::ordered_json to_json() const;
+
+  private:
+    LatencyHistogram stages_[METRIC_STAGE_COUNT];
+    std::atomic<uint64_t> n_steps_{0};
+    std::atomic<uint64_t> n_step_tokens_{0};
+    std::atomic<uint64_t> n_step_capacity_{0};
+    std::atomic<uint64_t> n_expired_{0};
+};
+
+// Stages and cache use of one request, its "timings" (see llama_mico_get_timings). Written as the request advances,
+// the prefill fields by the scheduler thread before it hands the first token back
+struct RequestTimings {
+    int64_t t_arrival_us{0};
+    int64_t t_prepared_us{0};     // sequence bound and prompt tokenized
+    int64_t t_first_token_us{0};  // 0 until the prompt token
+    int64_t queue_us{0};          // waiting for a sequence, and for kv with kv_admission
+    int64_t template_us{0};
+    int64_t bitmap_us{0};
+    int64_t encode_wait_us{0};  // prefill waiting for the embeddings of its images
+    int32_t n_prompt_pos{0};
+    int32_t n_resident_pos{0};  // kept in the sequence from its last request
+    int32_t n_cached_pos{0};    // copied from the prompt kv cache
+    int32_t n_images_encoded{0};
+    int32_t n_images_cached{0};     // embeddings found in the image cache
+    int32_t n_images_kv_reused{0};  // image kv reused, see image_kv_entries
+    bool coalesced{false};          // took the tokens of an identical or memoised request, nothing prefilled
+
+    // ms per stage, prompt positions computed vs reused, images encoded vs cached and the tokens generated
+    nlohmann::ordered_json to_json(int64_t t_end_us, int32_t n_generated) const;
+};
+
+#endif  // MICO_METRICS_H
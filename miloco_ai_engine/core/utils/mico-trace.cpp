@@ -0,0 +1,141 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "mico-trace.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "common/log.h"
+
+namespace mico_trace {
+
+std::atomic<bool> g_enabled{false};
+
+namespace {
+
+struct TraceRing {
+    std::mutex mutex;  // NOTE: only contended while dumping
+    std::vector<TraceEvent> events;  // allocated on the first event recorded while tracing, freed by dump
+    size_t next{0};
+    size_t n_events{0};
+    int32_t tid{0};
+    std::string name;
+    bool owned{true};  // its thread is alive, NOTE: guarded by g_rings_mutex
+};
+
+std::mutex g_rings_mutex;
+std::vector<std::unique_ptr<TraceRing>> g_rings;  // NOTE: a ring of an exited thread stays until its events are dumped
+int32_t g_next_tid = 0;
+std::atomic<size_t> g_capacity{TRACE_DEFAULT_EVENTS};
+thread_local std::string t_name;
+
+// Gives the ring back when its thread exits, a new thread takes it over once it holds no events
+struct RingOwner {
+    TraceRing* ring{nullptr};
+    ~RingOwner() {
+        if (!ring) return;
+        std::lock_guard<std::mutex> lock(g_rings_mutex);
+        ring->owned = false;
+    }
+};
+thread_local RingOwner t_owner;
+
+TraceRing* thread_ring() {
+    if (t_owner.ring) return t_owner.ring;
+    std::lock_guard<std::mutex> lock(g_rings_mutex);
+    TraceRing* ring = nullptr;
+    for (auto& idle : g_rings) {
+        std::lock_guard<std::mutex> ring_lock(idle->mutex);
+        if (!idle->owned && idle->n_events == 0) {
+            ring = idle.get();
+            break;
+        }
+    }
+    if (!ring) {
+        g_rings.push_back(std::make_unique<TraceRing>());
+        ring = g_rings.back().get();
+    }
+    std::lock_guard<std::mutex> ring_lock(ring->mutex);
+    ring->owned = true;
+    ring->tid = ++g_next_tid;
+    ring->name = t_name.empty() ? "thread-" + std::to_string(ring->tid) : t_name;
+    t_owner.ring = ring;
+    return ring;
+}
+
+}  // namespace
+
+void start(size_t n_events) {
+    std::lock_guard<std::mutex> lock(g_rings_mutex);
+    g_capacity.store(std::max(n_events, (size_t)1));
+    for (auto& ring : g_rings) {
+        std::lock_guard<std::mutex> ring_lock(ring->mutex);
+        std::vector<TraceEvent>().swap(ring->events);  // NOTE: reallocated at the new capacity by the next event
+        ring->next = 0;
+        ring->n_events = 0;
+    }
+    g_enabled.store(true);
+    LOG_INF("trace started, %zu events per thread\n", g_capacity.load());
+}
+
+void set_thread_name(const char* name) {
+    t_name = name;
+    TraceRing* ring = t_owner.ring;
+    if (!ring) return;  // NOTE: named once its first event takes a ring
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    ring->name = name;
+}
+
+void record(const TraceEvent& event) {
+    if (!enabled()) return;  // NOTE: a scope begun before the dump may end after it
+    TraceRing* ring = thread_ring();
+    std::lock_guard<std::mutex> lock(ring->mutex);
+    if (ring->events.empty()) ring->events.resize(g_capacity.load());
+    ring->events[ring->next] = event;
+    ring->next = (ring->next + 1) % ring->events.size();
+    ring->n_events = std::min(ring->n_events + 1, ring->events.size());
+}
+
+bool dump(const std::string& path) {
+    g_enabled.store(false);
+    FILE* file = fopen(path.c_str(), "w");
+    if (!file) {
+        LOG_ERR("failed to open trace file %s\n", path.c_str());
+        return false;
+    }
+
+    size_t n_written = 0;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    std::lock_guard<std::mutex> lock(g_rings_mutex);
+    for (auto& ring : g_rings) {
+        std::lock_guard<std::mutex> ring_lock(ring->mutex);
+        fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                n_written++ ? ",\n" : "", ring->tid, ring->name.c_str());
+        size_t first = (ring->next + ring->events.size() - ring->n_events) % std::max(ring->events.size(), (size_t)1);
+        for (size_t k = 0; k < ring->n_events; k++) {  // oldest first
+            const TraceEvent& e = ring->events[(first + k) % ring->events.size()];
+            fprintf(file,
+                    ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%" PRId64 ",\"dur\":%" PRId64
+                    ",\"args\":{\"seq_id\":%d,\"n_tokens\":%d,\"hash\":\"%016" PRIx64 "\",\"batch\":%" PRId64 "}}",
+                    e.name, ring->tid, e.ts_us, e.dur_us, e.seq_id, e.n_tokens, e.hash, e.batch_id);
+        }
+        std::vector<TraceEvent>().swap(ring->events);  // NOTE: tracing stopped, nothing is kept
+        ring->next = 0;
+        ring->n_events = 0;
+    }
+    fprintf(file, "\n]}\n");
+    bool ok = fclose(file) == 0;
+    LOG_INF("trace of %zu threads written to %s\n", g_rings.size(), path.c_str());
+    g_rings.erase(std::remove_if(g_rings.begin(), g_rings.end(), [](const auto& ring) { return !ring->owned; }),
+                  g_rings.end());
+    return ok;
+}
+
+}  // namespace mico_trace
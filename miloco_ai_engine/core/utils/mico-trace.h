@@ -0,0 +1,71 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef MICO_TRACE_H
+#define MICO_TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "ggml.h"
+
+#define TRACE_DEFAULT_EVENTS 65536  // events kept per thread, the oldest are overwritten
+
+// One complete event ("ph": "X") of the chrome trace format, begin and duration in us
+struct TraceEvent {
+    const char* name;  // string literal, never freed
+    int64_t ts_us;
+    int64_t dur_us;
+    int32_t seq_id;
+    int32_t n_tokens;
+    uint64_t hash;  // chunk hash, 0 if none
+    int64_t batch_id;
+};
+
+// Per-thread ring buffer tracer of the scheduler threads, dumped as a chrome://tracing / Perfetto json file.
+// Off by default: a scope then costs one relaxed load and a branch
+namespace mico_trace {
+
+extern std::atomic<bool> g_enabled;
+
+inline bool enabled() { return g_enabled.load(std::memory_order_relaxed); }
+
+// Clears the buffers and records up to n_events per thread
+void start(size_t n_events);
+// Stops recording and writes the events of all threads, false if the file can not be written
+bool dump(const std::string& path);
+// Name of the calling thread in the trace
+void set_thread_name(const char* name);
+void record(const TraceEvent& event);
+
+}  // namespace mico_trace
+
+// Records the time from construction to destruction as one event
+class TraceScope {
+  public:
+    explicit TraceScope(const char* name, int32_t seq_id = -1, int32_t n_tokens = 0, uint64_t hash = 0,
+                        int64_t batch_id = -1)
+        : active_(mico_trace::enabled()) {
+        if (!active_) return;
+        event_ = {name, ggml_time_us(), 0, seq_id, n_tokens, hash, batch_id};
+    }
+    ~TraceScope() {
+        if (!active_) return;
+        event_.dur_us = ggml_time_us() - event_.ts_us;
+        mico_trace::record(event_);
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+    // NOTE: known only once the scope ran
+    void set_tokens(int32_t n_tokens) { event_.n_tokens = n_tokens; }
+    void set_batch(int64_t batch_id) { event_.batch_id = batch_id; }
+
+  private:
+    bool active_;
+    TraceEvent event_{};
+};
+
+#endif  // MICO_TRACE_H
@@ -0,0 +1,105 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "modal-buffer-pool.h"
+
+#include "common/log.h"
+
+ModalBufferPool::ModalBufferPool() {
+    ggml_backend_dev_t gpu = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_GPU);
+    if (gpu) buft_ = ggml_backend_dev_host_buffer_type(gpu);
+    if (!buft_) buft_ = ggml_backend_cpu_buffer_type();
+    LOG_INF("%s: modal buffers in %s memory\n", __func__, ggml_backend_buft_name(buft_));
+}
+
+ModalBufferPool::~ModalBufferPool() {
+    registered_.clear();
+    for (auto& [size, memory] : free_) ggml_backend_buffer_free(memory);
+}
+
+ModalBufferPool::BufferRef ModalBufferPool::allocate(size_t size, int32_t format, uint32_t nx, uint32_t ny) {
+    if (size == 0) return nullptr;
+    ggml_backend_buffer_t memory = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = free_.find(size);  // NOTE: frames of a camera come in one size, an exact fit is the common case
+        if (it != free_.end()) {
+            memory = it->second;
+            free_bytes_ -= size;
+            free_.erase(it);
+        }
+    }
+    if (!memory) {
+        memory = ggml_backend_buft_alloc_buffer(buft_, size);
+        if (!memory) {
+            LOG_ERR("%s: failed to allocate %zu bytes\n", __func__, size);
+            return nullptr;
+        }
+        bytes_.fetch_add(size, std::memory_order_relaxed);
+    }
+
+    auto* buffer = new Buffer();
+    buffer->data = static_cast<uint8_t*>(ggml_backend_buffer_get_base(memory));
+    buffer->size = size;
+    buffer->format = format;
+    buffer->nx = nx;
+    buffer->ny = ny;
+    buffer->memory = memory;
+    return BufferRef(buffer, [this](const Buffer* b) { recycle(const_cast<Buffer*>(b)); });
+}
+
+int32_t ModalBufferPool::acquire(size_t size, int32_t format, uint32_t nx, uint32_t ny, uint8_t** data) {
+    if (!data) return 0;
+    BufferRef buffer = allocate(size, format, nx, ny);
+    if (!buffer) return 0;
+    *data = buffer->data;
+    std::lock_guard<std::mutex> lock(mutex_);
+    int32_t id = next_id_;
+    next_id_ = next_id_ == INT32_MAX ? 1 : next_id_ + 1;
+    registered_[id] = std::move(buffer);
+    return id;
+}
+
+bool ModalBufferPool::release(int32_t id) {
+    BufferRef buffer;  // NOTE: recycled after the lock is dropped
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = registered_.find(id);
+    if (it == registered_.end()) return false;
+    buffer = std::move(it->second);
+    registered_.erase(it);
+    return true;
+}
+
+ModalBufferPool::BufferRef ModalBufferPool::get(int32_t id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = registered_.find(id);
+    return it == registered_.end() ? nullptr : it->second;
+}
+
+size_t ModalBufferPool::free_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return free_bytes_;
+}
+
+void ModalBufferPool::recycle(Buffer* buffer) {
+    ggml_backend_buffer_t memory = buffer->memory;
+    size_t size = buffer->size;
+    delete buffer;
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (free_bytes_ + size > ((size_t)MODAL_BUFFER_POOL_FREE_MB << 20) && !free_.empty()) {
+        auto largest = std::prev(free_.end());
+        free_bytes_ -= largest->first;
+        bytes_.fetch_sub(largest->first, std::memory_order_relaxed);
+        ggml_backend_buffer_free(largest->second);
+        free_.erase(largest);
+    }
+    if (free_bytes_ + size > ((size_t)MODAL_BUFFER_POOL_FREE_MB << 20)) {
+        bytes_.fetch_sub(size, std::memory_order_relaxed);
+        ggml_backend_buffer_free(memory);
+        return;
+    }
+    free_.emplace(size, memory);
+    free_bytes_ += size;
+}
@@ -0,0 +1,64 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef MODAL_BUFFER_POOL_H
+#define MODAL_BUFFER_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "ggml-backend.h"
+
+#define MODAL_BUFFER_POOL_FREE_MB 256  // released memory kept for reuse, the rest goes back to the backend
+
+// Engine-owned memory of modal inputs: the producer writes a frame once into a registered buffer and requests refer to
+// it by id, the engine reads it in place. A request pins the buffers it refers to, so a release while it runs only
+// returns the memory once the request is done. Memory is pinned host memory of the first GPU if there is one (host to
+// device copies skip the staging copy), released buffers are reused by size
+class ModalBufferPool {
+  public:
+    struct Buffer {
+        uint8_t* data{nullptr};
+        size_t size{0};
+        int32_t format{0};  // LLAMA_MICO_MODAL_*
+        uint32_t nx{0};
+        uint32_t ny{0};
+        ggml_backend_buffer_t memory{nullptr};
+    };
+    using BufferRef = std::shared_ptr<const Buffer>;
+
+    ModalBufferPool();
+    ~ModalBufferPool();  // NOTE: after the schedulers, no request pins a buffer any more
+
+    // A buffer of size bytes that is not registered, freed with its last reference, nullptr if out of memory
+    BufferRef allocate(size_t size, int32_t format, uint32_t nx, uint32_t ny);
+    // Registers a buffer of size bytes, returns its id (> 0) and memory, 0 if out of memory
+    int32_t acquire(size_t size, int32_t format, uint32_t nx, uint32_t ny, uint8_t** data);
+    // Drops the id, the memory is reused once no request pins it, false for an unknown id
+    bool release(int32_t id);
+    // Pins a registered buffer, nullptr for an unknown id
+    BufferRef get(int32_t id);
+
+    size_t bytes() const { return bytes_.load(std::memory_order_relaxed); }  // memory held, in use or kept for reuse
+    size_t free_bytes() const;                                                // memory kept for reuse
+    ggml_backend_buffer_type_t buft() const { return buft_; }
+
+  private:
+    void recycle(Buffer* buffer);  // the last reference of a buffer is gone
+
+    ggml_backend_buffer_type_t buft_{nullptr};
+    std::atomic<size_t> bytes_{0};
+    mutable std::mutex mutex_;
+    int32_t next_id_{1};
+    std::unordered_map<int32_t, BufferRef> registered_;
+    std::multimap<size_t, ggml_backend_buffer_t> free_;  // by size
+    size_t free_bytes_{0};
+};
+
+#endif  // MODAL_BUFFER_POOL_H
@@ -0,0 +1,231 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "model-registry.h"
+
+#include <cinttypes>
+#include <fstream>
+#include <future>
+#include <map>
+#include <sstream>
+
+#include "common/log.h"
+#include "ggml-cpu.h"
+#include "utils/chunk-hash.h"
+
+#define REPACK_KEY_HEADER_BYTES (1 << 20)
+#define REPACK_KEY_SAMPLES 64
+#define REPACK_KEY_SAMPLE_BYTES 4096
+
+static std::mutex g_registry_mutex;
+static std::map<std::string, std::weak_ptr<SharedModel>> g_registry;  // NOTE: a model leaves with its last handle
+
+std::mutex& SharedModel::encode_mutex(const mtmd_context* ctx) {
+    std::lock_guard<std::mutex> lock(vision_mutex);
+    for (size_t i = 0; i < vision_contexts.size(); i++) {
+        if (vision_contexts[i].get() == ctx) return *encode_mutexes[i];
+    }
+    return *encode_mutexes[0];  // NOTE: a context dropped by an idle unload that a request still holds
+}
+
+// Everything the loaded weights and their placement depend on, context parameters are left to each handle
+static std::string model_key(const common_params& params) {
+    std::ostringstream key;
+    key << params.model.path << "|" << params.n_gpu_layers << "|" << params.main_gpu << "|" << (int)params.split_mode
+        << "|" << params.use_mmap << params.use_mlock << params.check_tensors << params.repack_cache
+        << params.mmap_hugepages << (params.weight_stream_tokens > 0) << "|";
+    for (auto* dev : params.devices) {
+        if (dev) key << ggml_backend_dev_name(dev) << ",";
+    }
+    for (float split : params.tensor_split) key << split << ",";
+    for (const auto& kv : params.kv_overrides) {
+        key << kv.key << "=" << (int)kv.tag << ":";
+        switch (kv.tag) {
+            case LLAMA_KV_OVERRIDE_TYPE_INT:
+                key << kv.val_i64;
+                break;
+            case LLAMA_KV_OVERRIDE_TYPE_FLOAT:
+                key << std::hexfloat << kv.val_f64 << std::defaultfloat;  // NOTE: exact
+                break;
+            case LLAMA_KV_OVERRIDE_TYPE_BOOL:
+                key << kv.val_bool;
+                break;
+            case LLAMA_KV_OVERRIDE_TYPE_STR:
+                key << kv.val_str;
+                break;
+        }
+        key << ",";
+    }
+    for (const auto& buft : params.tensor_buft_overrides) {  // NOTE: the list ends with a null pattern
+        if (buft.pattern) key << buft.pattern << "=" << (buft.buft ? ggml_backend_buft_name(buft.buft) : "") << ",";
+    }
+    key << "|" << params.mmproj.path << "|" << params.mmproj_use_gpu << params.mmproj_flash_attn << ","
+        << params.mmproj_weight_type << params.mmproj_f16_activations << "|"
+        << params.n_encoder_workers << "," << params.cpuparams_encoder.n_threads << "|";
+    for (const auto& dev : params.encoder_devices) key << dev << ",";
+    return key.str();
+}
+
+// Key of a weights file from its size, header (the GGUF metadata and tensor infos) and samples spread over the tensor
+// data, reads about 1 MB instead of the whole file
+uint64_t weights_file_key(const std::string& path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) return 0;
+    uint64_t size = (uint64_t)file.tellg();
+    std::string bytes((const char*)&size, sizeof(size));
+    std::vector<char> sample(REPACK_KEY_HEADER_BYTES);
+    for (uint64_t i = 0; i < REPACK_KEY_SAMPLES; i++) {
+        file.seekg((std::streamoff)(size * i / REPACK_KEY_SAMPLES));
+        file.read(sample.data(), i == 0 ? REPACK_KEY_HEADER_BYTES : REPACK_KEY_SAMPLE_BYTES);
+        bytes.append(sample.data(), (size_t)file.gcount());
+        file.clear();
+    }
+    HashKey key = hash_bytes(bytes.data(), bytes.size());
+    return key.hi ^ key.lo;
+}
+
+// CPU repacked weights loaded on this thread while it lives are copied from <path>.repack, or written to it
+class RepackCacheScope {
+  public:
+    RepackCacheScope(bool enabled, const std::string& path) {
+        ggml_backend_dev_t cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+        if (!enabled || !cpu_dev) return;
+        ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(cpu_dev);
+        auto* begin = (decltype(ggml_backend_cpu_repack_cache_begin)*)ggml_backend_reg_get_proc_address(
+            reg, "ggml_backend_cpu_repack_cache_begin");
+        end_ = (decltype(ggml_backend_cpu_repack_cache_end)*)ggml_backend_reg_get_proc_address(
+            reg, "ggml_backend_cpu_repack_cache_end");
+        if (!begin || !end_) return;
+        begin((path + ".repack").c_str(), weights_file_key(path));
+    }
+    ~RepackCacheScope() {
+        if (end_) end_();
+    }
+
+  private:
+    void (*end_)() = nullptr;
+};
+
+static std::vector<mtmd::context_ptr> load_vision(const common_params& params) {
+    mtmd_context_params mparams = mtmd_context_params_default();
+    mparams.use_gpu = params.mmproj_use_gpu;
+    mparams.flash_attn = params.mmproj_flash_attn;
+    mparams.weight_type = params.mmproj_weight_type;
+    mparams.f16_activations = params.mmproj_f16_activations;
+    mparams.print_timings = true;
+    mparams.n_threads = params.cpuparams.n_threads;
+    mparams.n_load_threads = params.n_load_threads;
+    mparams.verbosity = params.verbosity > 0 ? GGML_LOG_LEVEL_DEBUG : GGML_LOG_LEVEL_INFO;
+    int32_t n_workers = std::max(1, params.n_encoder_workers);
+    cpu_params cpu = params.cpuparams_encoder;  // NOTE: persistent threads per worker, encoder_threads split among them
+    cpu.n_threads = std::max(1, cpu.n_threads / n_workers);
+    ggml_threadpool_params tpp = ggml_threadpool_params_from_cpu_params(cpu);
+    mparams.threadpool = &tpp;
+    const auto& devices = params.encoder_devices;
+    std::vector<mtmd::context_ptr> contexts;
+    for (int32_t i = 0; i < n_workers; i++) {  // NOTE: every worker needs its own output buffer, so its own context
+        mparams.device = devices.empty() ? nullptr : devices[i % devices.size()].c_str();
+        RepackCacheScope repack_cache(params.repack_cache, params.mmproj.path);
+        mtmd::context_ptr ctx(mtmd_load_from_file(params.mmproj.path.c_str(), mparams));
+        if (!ctx.get()) {
+            LOG_ERR("Failed to load vision model from %s\n", params.mmproj.path.c_str());
+            return {};
+        }
+        contexts.push_back(std::move(ctx));
+    }
+    return contexts;
+}
+
+static std::vector<std::shared_ptr<mtmd_context>> bind_vision(std::vector<mtmd::context_ptr> contexts,
+                                                              const llama_model* model) {
+    std::vector<std::shared_ptr<mtmd_context>> vision;
+    for (auto& ctx : contexts) {
+        if (mtmd_bind_text_model(ctx.get(), model) != 0) {
+            LOG_ERR("Failed to bind the vision model to the text model\n");
+            return {};
+        }
+        vision.emplace_back(ctx.release(), mtmd_free);
+    }
+    if (vision.size() > 1) LOG_INF("%zu vision encoder workers\n", vision.size());
+    return vision;
+}
+
+static std::shared_ptr<SharedModel> load_model(common_params& params) {
+    // NOTE: the mmproj reads and uploads while the text model does
+    bool load_vision_now = !params.mmproj.path.empty() && !params.mmproj_lazy;
+    std::future<std::vector<mtmd::context_ptr>> vision_load;
+    if (load_vision_now) vision_load = std::async(std::launch::async, [&params]() { return load_vision(params); });
+
+    auto shared = std::make_shared<SharedModel>();
+    shared->params = params;
+    {
+        RepackCacheScope repack_cache(params.repack_cache, params.model.path);
+        shared->model.reset(
+            llama_model_load_from_file(params.model.path.c_str(), common_model_params_to_llama(params)));
+    }
+    std::vector<mtmd::context_ptr> contexts;
+    if (load_vision_now) contexts = vision_load.get();
+    if (!shared->model) {
+        LOG_ERR("%s: failed to load model '%s'\n", __func__, params.model.path.c_str());
+        return nullptr;
+    }
+    shared->pieces = std::make_unique<TokenPieces>(llama_model_get_vocab(shared->model.get()));
+    for (int32_t i = 0; i < std::max(1, params.n_encoder_workers); i++)
+        shared->encode_mutexes.push_back(std::make_unique<std::mutex>());
+    shared->vision_used_ms = ggml_time_ms();
+    if (!load_vision_now) {
+        LOG_INF("%s: %s\n", __func__, shared->has_vision() ? "vision model loads on the first modal request"
+                                                               : "no mmproj_path, text only");
+        return shared;
+    }
+    if (contexts.empty()) return nullptr;
+    shared->vision_contexts = bind_vision(std::move(contexts), shared->model.get());
+    if (shared->vision_contexts.empty()) return nullptr;
+    shared->vision_mrope = mtmd_decode_use_mrope(shared->vision_contexts[0].get());
+    shared->vision_non_causal = mtmd_decode_use_non_causal(shared->vision_contexts[0].get());
+    return shared;
+}
+
+std::shared_ptr<mtmd_context> SharedModel::vision(size_t i) {
+    std::lock_guard<std::mutex> lock(vision_mutex);  // NOTE: held over a load, other callers wait for it
+    vision_used_ms = ggml_time_ms();
+    if (vision_contexts.empty() && has_vision() && !vision_failed) {
+        vision_contexts = bind_vision(load_vision(params), model.get());
+        vision_failed = vision_contexts.empty();
+        if (!vision_failed) {
+            vision_mrope = mtmd_decode_use_mrope(vision_contexts[0].get());
+            vision_non_causal = mtmd_decode_use_non_causal(vision_contexts[0].get());
+            LOG_INF("%s: vision model loaded in %" PRId64 " ms\n", __func__, ggml_time_ms() - vision_used_ms);
+        }
+    }
+    if (vision_contexts.empty()) return nullptr;
+    return vision_contexts[i % vision_contexts.size()];
+}
+
+bool SharedModel::unload_idle_vision() {
+    if (params.mmproj_idle_unload_s <= 0) return false;
+    std::lock_guard<std::mutex> lock(vision_mutex);
+    int64_t idle_ms = ggml_time_ms() - vision_used_ms;
+    if (vision_contexts.empty() || idle_ms < (int64_t)params.mmproj_idle_unload_s * 1000) return false;
+    vision_contexts.clear();  // NOTE: freed with the last request holding one
+    LOG_INF("%s: vision model unloaded after %" PRId64 " s without modal requests\n", __func__, idle_ms / 1000);
+    return true;
+}
+
+std::shared_ptr<SharedModel> acquire_shared_model(common_params& params) {
+    std::string key = model_key(params);
+    // NOTE: held over the load, a second handle of a loading model waits for it instead of loading it again
+    std::lock_guard<std::mutex> lock(g_registry_mutex);
+    auto it = g_registry.find(key);
+    if (it != g_registry.end()) {
+        if (auto shared = it->second.lock()) {
+            LOG_INF("%s: sharing the loaded %s\n", __func__, params.model.path.c_str());
+            return shared;
+        }
+    }
+    auto shared = load_model(params);
+    if (shared) g_registry[key] = shared;
+    return shared;
+}
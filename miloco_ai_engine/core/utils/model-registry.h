@@ -0,0 +1,53 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef MODEL_REGISTRY_H
+#define MODEL_REGISTRY_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common/common.h"
+#include "mutil-modal/mtmd.h"
+#include "utils/token-pieces.h"
+
+// Weights of one model and projector, shared by every handle loaded with the same files and placement
+// Each handle still creates its own llama_context, so isolation costs only its kv
+// With mmproj_lazy the projector loads on the first modal request instead, and with mmproj_idle_unload_s it is
+// dropped again once no modal request came for that long, so text-only traffic leaves its memory to the kv
+struct SharedModel {
+    llama_model_ptr model;
+    common_params params;  // of the first handle, NOTE: a lazy load of the projector reads the mmproj options
+    std::unique_ptr<TokenPieces> pieces;  // text of the vocab tokens, detokenizes generated tokens
+
+    // Vision context of encoder worker i (cycled), loaded first if it is not, nullptr without an mmproj or if the
+    // load failed. NOTE: hold the returned pointer while using it, an idle unload only drops the registry's one
+    std::shared_ptr<mtmd_context> vision(size_t i = 0);
+    bool has_vision() const { return !params.mmproj.path.empty(); }
+    size_t n_vision_workers() const { return encode_mutexes.size(); }
+    // Drops the vision contexts if none was asked for within mmproj_idle_unload_s, true if they were dropped
+    bool unload_idle_vision();
+
+    std::mutex& encode_mutex(const mtmd_context* ctx);  // NOTE: handles encode on a vision context in turn
+
+    std::mutex vision_mutex;
+    std::vector<std::shared_ptr<mtmd_context>> vision_contexts;  // one per encoder worker, empty while not loaded
+    std::vector<std::unique_ptr<std::mutex>> encode_mutexes;     // one per encoder worker
+    bool vision_mrope{false};       // of the projector, kept over an unload
+    bool vision_non_causal{false};  // of the projector, kept over an unload
+    int64_t vision_used_ms{0};
+    bool vision_failed{false};  // NOTE: a failed lazy load is not retried
+};
+
+// The loaded model of params, shared with the live handles of the same model, nullptr if the load failed
+// NOTE: the text model and the mmproj load concurrently, the mmproj needs the text model only once bound, without
+// mmproj_path the model is text only
+std::shared_ptr<SharedModel> acquire_shared_model(common_params& params);
+
+// Key of a weights file from its size, header and sampled tensor data, 0 if it cannot be read
+uint64_t weights_file_key(const std::string& path);
+
+#endif  // MODEL_REGISTRY_H
@@ -0,0 +1,53 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+// Lock-free multi-producer single-consumer queue: producers push onto an atomic stack, the consumer takes all of it at
+// once and restores submission order, so a push never waits for the consumer
+template <typename T>
+class MpscQueue {
+  public:
+    MpscQueue() = default;
+    ~MpscQueue() { drain(); }
+
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T value) {
+        Node* node = new Node{std::move(value), head_.load(std::memory_order_relaxed)};
+        while (!head_.compare_exchange_weak(node->next, node)) {
+        }
+    }
+
+    bool empty() const { return head_.load() == nullptr; }
+
+    // Everything pushed so far, oldest first, NOTE: consumer only
+    std::vector<T> drain() {
+        std::vector<T> values;
+        Node* node = head_.exchange(nullptr);
+        while (node) {
+            values.push_back(std::move(node->value));
+            Node* next = node->next;
+            delete node;
+            node = next;
+        }
+        std::reverse(values.begin(), values.end());
+        return values;
+    }
+
+  private:
+    struct Node {
+        T value;
+        Node* next;
+    };
+    std::atomic<Node*> head_{nullptr};
+};
+
+#endif  // MPSC_QUEUE_H
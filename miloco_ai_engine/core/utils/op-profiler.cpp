@@ -0,0 +1,77 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "op-profiler.h"
+
+#include <algorithm>
+#include <vector>
+
+static const char* KIND_NAMES[OP_GRAPH_KIND_COUNT] = {"llm", "vision"};
+
+// Views and reshapes compute nothing, asking for them would only split the graph
+static bool op_is_empty(const ggml_tensor* t) {
+    switch (t->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+OpProfiler::OpProfiler() {
+    for (int32_t kind = 0; kind < OP_GRAPH_KIND_COUNT; kind++) probes_[kind] = {this, (OpGraphKind)kind};
+}
+
+bool OpProfiler::eval_callback(ggml_tensor* t, bool ask, void* user_data) {
+    thread_local int64_t t_ask = 0;  // NOTE: the scheduler computes the op asked for right away, then calls back
+    if (ask) {
+        if (op_is_empty(t)) return false;
+        t_ask = ggml_time_us();
+        return true;
+    }
+    auto* probe = static_cast<Probe*>(user_data);
+    probe->profiler->record(probe->kind, t, ggml_time_us() - t_ask);
+    return true;
+}
+
+void OpProfiler::record(OpGraphKind kind, const ggml_tensor* t, int64_t us) {
+    size_t bytes = ggml_nbytes(t);
+    for (int32_t i = 0; i < GGML_MAX_SRC && t->src[i]; i++) bytes += ggml_nbytes(t->src[i]);
+    const ggml_backend_buffer_t buffer = t->view_src ? t->view_src->buffer : t->buffer;
+    std::lock_guard<std::mutex> lock(mutex_);
+    OpStats& stats = stats_[kind][{ggml_op_desc(t), buffer ? ggml_backend_buffer_name(buffer) : "?"}];
+    stats.count++;
+    stats.us += (uint64_t)std::max<int64_t>(us, 0);
+    stats.bytes += bytes;
+}
+
+nlohmann::ordered_json OpProfiler::to_json() const {
+    nlohmann::ordered_json j;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (int32_t kind = 0; kind < OP_GRAPH_KIND_COUNT; kind++) {
+        std::vector<std::pair<const std::pair<std::string, std::string>*, const OpStats*>> ops;
+        uint64_t total_us = 0;
+        for (const auto& [key, stats] : stats_[kind]) {
+            ops.push_back({&key, &stats});
+            total_us += stats.us;
+        }
+        std::sort(ops.begin(), ops.end(), [](const auto& a, const auto& b) { return a.second->us > b.second->us; });
+        nlohmann::ordered_json list = nlohmann::ordered_json::array();
+        for (const auto& [key, stats] : ops) {
+            list.push_back({{"op", key->first},
+                            {"backend", key->second},
+                            {"count", stats->count},
+                            {"ms", stats->us / 1000.0},
+                            {"share", total_us > 0 ? (double)stats->us / total_us : 0.0},
+                            {"mb", stats->bytes / 1048576.0}});
+        }
+        j[KIND_NAMES[kind]] = {{"ms", total_us / 1000.0}, {"ops", list}};
+    }
+    return j;
+}
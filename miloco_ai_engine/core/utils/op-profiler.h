@@ -0,0 +1,55 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef OP_PROFILER_H
+#define OP_PROFILER_H
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "ggml-backend.h"
+#include "nlohmann/json.hpp"
+
+enum OpGraphKind {
+    OP_GRAPH_LLM = 0,  // llama_decode of the handle, text and image embeddings
+    OP_GRAPH_VISION,   // encodes of the vision and audio projector
+    OP_GRAPH_KIND_COUNT,
+};
+
+// Time, bytes and backend of the ggml ops of a handle per op type, from the eval callback of the backend schedulers.
+// Every op that computes runs alone and is waited for, its time is the kernel with its launch and sync, the copies
+// of split inputs are not counted. NOTE: the per op sync slows the graphs down, for profiling runs only
+class OpProfiler {
+  public:
+    // user_data of eval_callback, the graphs of one kind
+    struct Probe {
+        OpProfiler* profiler{nullptr};
+        OpGraphKind kind{OP_GRAPH_LLM};
+    };
+
+    OpProfiler();
+    Probe* probe(OpGraphKind kind) { return &probes_[kind]; }
+    // ggml_backend_sched_eval_callback
+    static bool eval_callback(ggml_tensor* t, bool ask, void* user_data);
+
+    // per kind, the op types by time: count, ms, share of the kind, MB read and written, backend
+    nlohmann::ordered_json to_json() const;
+
+  private:
+    struct OpStats {
+        uint64_t count{0};
+        uint64_t us{0};
+        uint64_t bytes{0};
+    };
+    void record(OpGraphKind kind, const ggml_tensor* t, int64_t us);
+
+    Probe probes_[OP_GRAPH_KIND_COUNT];
+    mutable std::mutex mutex_;
+    std::map<std::pair<std::string, std::string>, OpStats> stats_[OP_GRAPH_KIND_COUNT];  // by op and backend
+};
+
+#endif  // OP_PROFILER_H
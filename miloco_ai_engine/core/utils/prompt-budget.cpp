@@ -0,0 +1,136 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "prompt-budget.h"
+
+#include <cmath>
+#include <cstring>
+
+static size_t count_markers(const std::string& text, const std::string& marker) {
+    size_t n = 0;
+    for (size_t pos = text.find(marker); pos != std::string::npos; pos = text.find(marker, pos + marker.size())) n++;
+    return n;
+}
+
+static uint64_t size_key(uint32_t nx, uint32_t ny) { return ((uint64_t)nx << 32) | ny; }
+
+void PromptBudget::record(const char* text, mtmd::bitmaps& bitmaps, const mtmd_input_chunks* chunks) {
+    const std::string marker = MICO_DEFAULT_IMAGE_MARKER;
+    size_t n_bytes = strlen(text);
+    n_bytes -= std::min(n_bytes, count_markers(text, marker) * marker.size());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t n_text = 0, i_image = 0;
+    for (size_t i = 0; i < mtmd_input_chunks_size(chunks); i++) {
+        const mtmd_input_chunk* chunk = mtmd_input_chunks_get(chunks, i);
+        auto type = mtmd_input_chunk_get_type(chunk);
+        size_t n_tokens = mtmd_input_chunk_get_n_tokens(chunk);
+        if (type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
+            n_text += n_tokens;
+            continue;
+        }
+        if (type != MTMD_INPUT_CHUNK_TYPE_IMAGE || i_image >= bitmaps.entries.size()) continue;
+        const mtmd_bitmap* bitmap = bitmaps.entries[i_image++].ptr.get();
+        image_tokens_max_ = std::max(image_tokens_max_, (int32_t)n_tokens);
+        // NOTE: a cached bitmap holds the token grid, not the input size, pooled images stay over estimated
+        if (mtmd_bitmap_get_n_bytes(bitmap) > 0 && mtmd_bitmap_get_pool(bitmap) == 1)
+            image_tokens_[size_key(mtmd_bitmap_get_nx(bitmap), mtmd_bitmap_get_ny(bitmap))] = (int32_t)n_tokens;
+    }
+    if (n_text > 0 && n_bytes > 0) bytes_per_token_ = 0.9f * bytes_per_token_ + 0.1f * n_bytes / n_text;
+}
+
+int32_t PromptBudget::text_tokens(size_t n_bytes) const {
+    return (int32_t)std::ceil(n_bytes / std::max(bytes_per_token_, 1.0f));
+}
+
+int32_t PromptBudget::image_tokens(const llama_mico_modal_buffer* modal) const {
+    if (modal && modal->roi_w > 0 && modal->roi_h > 0 && modal->max_side <= 0) {  // NOTE: unless clipped
+        auto it = image_tokens_.find(size_key(modal->roi_w, modal->roi_h));
+        if (it != image_tokens_.end()) return it->second;
+    } else if (modal && modal->format != LLAMA_MICO_MODAL_ENCODED && modal->max_side <= 0) {
+        auto it = image_tokens_.find(size_key(modal->nx, modal->ny));
+        if (it != image_tokens_.end()) return it->second;
+    }
+    return image_tokens_max_;
+}
+
+size_t PromptBudget::fit(MicoRequest& request, common_chat_templates_inputs& inputs, int32_t prompt_limit) {
+    auto& messages = inputs.messages;
+    if (prompt_limit <= 0 || messages.size() < 2) return 0;
+    const std::string marker = MICO_DEFAULT_IMAGE_MARKER;
+
+    // modal buffers behind each marker: one, or a video clip of modal_frames[i]
+    bool clips = !request.modal_frames.empty();
+    size_t n_groups = clips ? request.modal_frames.size() : request.modal_prts.size();
+    std::vector<size_t> group_offsets(n_groups + 1, 0);
+    for (size_t g = 0; g < n_groups; g++) {
+        group_offsets[g + 1] = group_offsets[g] + (clips ? request.modal_frames[g] : 1);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t n_tools_bytes = 0;
+    for (const auto& tool : inputs.tools) {
+        n_tools_bytes += tool.name.size() + tool.description.size() + tool.parameters.size();
+    }
+    int32_t total = text_tokens(n_tools_bytes);
+    std::vector<int32_t> costs(messages.size(), 0);
+    std::vector<size_t> markers(messages.size() + 1, 0);  // markers before each message
+    for (size_t i = 0; i < messages.size(); i++) {
+        const auto& msg = messages[i];
+        size_t n_bytes = msg.content.size() + msg.reasoning_content.size(), n_images = 0;
+        size_t n_markers = count_markers(msg.content, marker);
+        for (const auto& part : msg.content_parts) {
+            n_bytes += part.text.size();
+            n_markers += count_markers(part.text, marker);
+            n_images += part.images.size();  // NOTE: base64 images of unknown size
+        }
+        for (const auto& call : msg.tool_calls) n_bytes += call.name.size() + call.arguments.size();
+        n_bytes -= std::min(n_bytes, n_markers * marker.size());
+
+        int32_t cost = PROMPT_MESSAGE_TOKENS + text_tokens(n_bytes) + (int32_t)n_images * image_tokens(nullptr);
+        markers[i + 1] = markers[i] + n_markers;
+        for (size_t g = markers[i]; g < markers[i + 1] && g < n_groups; g++) {
+            for (size_t k = group_offsets[g]; k < group_offsets[g + 1] && k < request.modal_prts.size(); k++)
+                cost += image_tokens(&request.modal_prts[k]);
+        }
+        costs[i] = cost;
+        total += cost;
+    }
+    if (total <= prompt_limit) return 0;
+
+    size_t n_head = 0;  // leading system messages, always kept
+    while (n_head < messages.size() && messages[n_head].role == "system") n_head++;
+    size_t last_user = n_head;
+    for (size_t i = messages.size(); i-- > n_head;) {
+        if (messages[i].role == "user") {
+            last_user = i;
+            break;
+        }
+    }
+
+    // whole turns only, a kept history starts with a user message
+    int32_t estimated = total;
+    size_t cut = n_head;
+    while (cut < last_user && (total > prompt_limit || messages[cut].role != "user")) total -= costs[cut++];
+    if (cut == n_head) return 0;
+
+    size_t g0 = std::min(markers[n_head], n_groups), g1 = std::min(markers[cut], n_groups);
+    size_t b0 = std::min(group_offsets[g0], request.modal_prts.size());
+    size_t b1 = std::min(group_offsets[g1], request.modal_prts.size());
+    request.modal_prts.erase(request.modal_prts.begin() + b0, request.modal_prts.begin() + b1);
+    if (b1 <= request.modal_ids.size())
+        request.modal_ids.erase(request.modal_ids.begin() + b0, request.modal_ids.begin() + b1);
+    if (clips) {
+        request.modal_frames.erase(request.modal_frames.begin() + g0, request.modal_frames.begin() + g1);
+        if (b1 <= request.keyframes.size())
+            request.keyframes.erase(request.keyframes.begin() + b0, request.keyframes.begin() + b1);
+    }
+    messages.erase(messages.begin() + n_head, messages.begin() + cut);
+    if (request.cache_prefix > (int32_t)n_head) request.cache_prefix = (int32_t)n_head;  // its messages changed
+
+    LOG_INF("prompt budget: estimated %d tokens > %d, dropped %zu oldest messages and %zu images before rendering\n",
+            estimated, prompt_limit, cut - n_head, b1 - b0);
+    return cut - n_head;
+}
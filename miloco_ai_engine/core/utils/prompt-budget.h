@@ -0,0 +1,38 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef PROMPT_BUDGET_H
+#define PROMPT_BUDGET_H
+
+#include <mutex>
+#include <unordered_map>
+
+#include "utils/mico-dialog-util.h"
+
+#define PROMPT_BYTES_PER_TOKEN 3.0f  // text estimate until a prompt was tokenized, about one CJK character a token
+#define PROMPT_MESSAGE_TOKENS 8      // role and turn markup around each message
+
+// Token estimates of prompts before they are rendered, learned from the prompts tokenized so far: text bytes per
+// token and image tokens per input size. Turns estimated over the budget are dropped before the template, tokenizer
+// or encoder sees them, limit_prompt_tokens still crops whatever the estimate missed
+class PromptBudget {
+  public:
+    // From a tokenized prompt tail (text without the cached prefix), bitmaps in marker order
+    void record(const char* text, mtmd::bitmaps& bitmaps, const mtmd_input_chunks* chunks);
+
+    // Drops the oldest turns after the leading system messages, with the images of their markers, until the estimate
+    // fits prompt_limit. The last user turn is always kept, returns the dropped message count
+    size_t fit(MicoRequest& request, common_chat_templates_inputs& inputs, int32_t prompt_limit);
+
+  private:
+    int32_t text_tokens(size_t n_bytes) const;
+    int32_t image_tokens(const llama_mico_modal_buffer* modal) const;  // nullptr for an image of unknown size
+
+    std::mutex mutex_;
+    float bytes_per_token_{PROMPT_BYTES_PER_TOKEN};   // moving average
+    std::unordered_map<uint64_t, int32_t> image_tokens_;  // by input pixels (nx << 32 | ny)
+    int32_t image_tokens_max_{0};                     // largest image seen, for images of unknown size
+};
+
+#endif  // PROMPT_BUDGET_H
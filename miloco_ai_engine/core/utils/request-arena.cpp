@@ -0,0 +1,67 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "request-arena.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+// Idle blocks of every arena, NOTE: intentionally leaked, arenas may die during static destruction
+struct BlockPool {
+    std::mutex mutex;
+    std::vector<char*> blocks;
+
+    char* take() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!blocks.empty()) {
+                char* block = blocks.back();
+                blocks.pop_back();
+                return block;
+            }
+        }
+        return static_cast<char*>(::operator new(REQUEST_ARENA_BLOCK));
+    }
+
+    void give(std::vector<char*>& returned) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (char* block : returned) {
+            if (blocks.size() < REQUEST_ARENA_POOL_BLOCKS)
+                blocks.push_back(block);
+            else
+                ::operator delete(block);
+        }
+    }
+};
+
+BlockPool& block_pool() {
+    static BlockPool* pool = new BlockPool();
+    return *pool;
+}
+
+}  // namespace
+
+RequestArena::~RequestArena() {
+    block_pool().give(blocks_);
+    for (char* object : large_) ::operator delete(object);
+}
+
+void* RequestArena::allocate(size_t bytes, size_t align) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (bytes > REQUEST_ARENA_BLOCK / 4) {
+        large_.push_back(static_cast<char*>(::operator new(bytes)));  // NOTE: aligned for any fundamental type
+        return large_.back();
+    }
+    size_t offset = (used_ + align - 1) & ~(align - 1);
+    if (blocks_.empty() || offset + bytes > REQUEST_ARENA_BLOCK) {
+        blocks_.push_back(block_pool().take());
+        offset = 0;
+    }
+    used_ = offset + bytes;
+    return blocks_.back() + offset;
+}
@@ -0,0 +1,57 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef REQUEST_ARENA_H
+#define REQUEST_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define REQUEST_ARENA_BLOCK (16 * 1024)  // bytes of an arena block, an object above a quarter of it gets its own
+#define REQUEST_ARENA_POOL_BLOCKS 512    // idle blocks kept for the next requests, further ones are freed
+
+// Monotonic arena of the scratch objects of one request: its prompt chunk tasks and their handles. An allocation
+// moves a pointer in the current block and is never freed on its own, the blocks go back to a process wide pool once
+// the last object allocated from the arena died. A request allocates on its caller thread and its objects die on the
+// scheduler and encoder threads, so these frees never meet in malloc
+class RequestArena {
+  public:
+    RequestArena() = default;
+    RequestArena(const RequestArena&) = delete;
+    RequestArena& operator=(const RequestArena&) = delete;
+    ~RequestArena();
+
+    void* allocate(size_t bytes, size_t align);
+
+  private:
+    std::mutex mutex_;
+    std::vector<char*> blocks_;  // pooled REQUEST_ARENA_BLOCK blocks, the last one in use
+    std::vector<char*> large_;   // objects of their own block, freed with the arena
+    size_t used_{REQUEST_ARENA_BLOCK};  // bytes taken of the last block
+};
+
+// Allocator of objects in a RequestArena, every copy keeps the arena alive (e.g. the one in the control block of
+// std::allocate_shared), deallocate returns nothing
+template <typename T>
+struct ArenaAllocator {
+    using value_type = T;
+
+    std::shared_ptr<RequestArena> arena;
+
+    explicit ArenaAllocator(std::shared_ptr<RequestArena> arena) : arena(std::move(arena)) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T*, size_t) {}
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+#endif  // REQUEST_ARENA_H
@@ -0,0 +1,214 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "request-log.h"
+
+#include <cstring>
+#include <unordered_map>
+
+#include "common/log.h"
+#include "ggml.h"
+#include "utils/mico-dialog-util.h"
+
+template <typename T> static void put(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <typename T> static bool get(FILE* file, T& value) { return fread(&value, sizeof(T), 1, file) == 1; }
+
+static uint64_t hash64(const std::string& text) {
+    HashKey key = hash_bytes(text.data(), text.size());
+    return key.lo ^ key.hi;
+}
+
+static uint8_t role_code(const std::string& role) {
+    if (role == "system") return 0;
+    if (role == "user") return 1;
+    if (role == "assistant") return 2;
+    if (role == "tool") return 3;
+    return 4;
+}
+
+static LoggedMessage logged_message(const std::string& role, const std::string& content) {
+    LoggedMessage msg;
+    msg.role = role_code(role);
+    msg.n_bytes = (uint32_t)content.size();
+    msg.hash = hash64(content);
+    const std::string marker = MICO_DEFAULT_IMAGE_MARKER;
+    for (size_t pos = content.find(marker); pos != std::string::npos; pos = content.find(marker, pos + marker.size()))
+        msg.n_markers++;
+    return msg;
+}
+
+// Text of an OpenAI message content: the string, or its text parts
+static std::string message_text(const json& content) {
+    if (content.is_string()) return content.get<std::string>();
+    if (!content.is_array()) return content.is_null() ? "" : content.dump();
+    std::string text;
+    for (const auto& part : content) {
+        if (!part.is_object() || !part.contains("text") || !part["text"].is_string()) continue;
+        text += part["text"].get<std::string>();
+    }
+    return text;
+}
+
+RequestLog::RequestLog(const std::string& path) {
+    file_ = fopen(path.c_str(), "ab");
+    if (!file_) {
+        LOG_ERR("%s: failed to open request log %s\n", __func__, path.c_str());
+        return;
+    }
+    t_open_us_ = ggml_time_us();
+    // NOTE: a reopened log gets a new header, arrival times restart from it
+    fwrite(REQUEST_LOG_MAGIC, 1, strlen(REQUEST_LOG_MAGIC), file_);
+    fflush(file_);
+    LOG_INF("%s: recording requests to %s\n", __func__, path.c_str());
+}
+
+RequestLog::~RequestLog() {
+    if (file_) fclose(file_);
+}
+
+void RequestLog::write(const std::string& record) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    fwrite(record.data(), 1, record.size(), file_);
+    fflush(file_);
+}
+
+void RequestLog::record_prompt(const MicoRequest& request) {
+    if (!file_) return;
+    std::vector<LoggedMessage> messages;
+    if (!request.chat_msgs.empty()) {
+        for (const auto& msg : request.chat_msgs) messages.push_back(logged_message(msg.role, msg.content));
+    } else if (request.messages.is_array()) {
+        for (const auto& msg : request.messages) {
+            std::string role = msg.is_object() ? msg.value("role", "") : "";
+            messages.push_back(logged_message(role, msg.is_object() && msg.contains("content")
+                                                        ? message_text(msg["content"])
+                                                        : std::string()));
+        }
+    }
+    static const std::string no_tools;
+    const std::string& tools = request.tools ? request.tools->text : no_tools;
+
+    std::string record;
+    put<uint8_t>(record, REQUEST_LOG_PROMPT);
+    put<int64_t>(record, ggml_time_us() - t_open_us_);
+    put<int32_t>(record, request.id);
+    put<int32_t>(record, request.priority);
+    put<int32_t>(record, request.cache_prefix);
+    put<uint64_t>(record, request.session.empty() ? 0 : hash64(request.session));
+    put<uint32_t>(record, (uint32_t)tools.size());
+    put<uint64_t>(record, tools.empty() ? 0 : hash64(tools));
+    put<uint16_t>(record, (uint16_t)messages.size());
+    for (const auto& msg : messages) {
+        put<uint8_t>(record, msg.role);
+        put<uint32_t>(record, msg.n_bytes);
+        put<uint64_t>(record, msg.hash);
+        put<uint16_t>(record, msg.n_markers);
+    }
+    put<uint16_t>(record, (uint16_t)request.modal_prts.size());
+    for (size_t i = 0; i < request.modal_prts.size(); i++) {
+        const auto& modal = request.modal_prts[i];
+        HashKey key = request.content_id(i);
+        if (key.empty()) key = hash_bytes(modal.data, modal.size);
+        put<uint64_t>(record, key.hi);
+        put<uint64_t>(record, key.lo);
+        put<int32_t>(record, modal.format);
+        put<uint32_t>(record, modal.nx);
+        put<uint32_t>(record, modal.ny);
+        put<uint32_t>(record, (uint32_t)modal.size);
+    }
+    put<uint16_t>(record, (uint16_t)request.modal_frames.size());
+    for (int32_t n_frames : request.modal_frames) put<int32_t>(record, n_frames);
+    write(record);
+}
+
+void RequestLog::record_finish(int32_t request_id, int32_t n_generated, bool success) {
+    if (!file_) return;
+    std::string record;
+    put<uint8_t>(record, REQUEST_LOG_FINISH);
+    put<int64_t>(record, ggml_time_us() - t_open_us_);
+    put<int32_t>(record, request_id);
+    put<int32_t>(record, n_generated);
+    put<uint8_t>(record, success ? 1 : 0);
+    write(record);
+}
+
+static bool read_prompt(FILE* file, LoggedRequest& r) {
+    uint16_t n_messages = 0, n_images = 0, n_frames = 0;
+    if (!get(file, r.id) || !get(file, r.priority) || !get(file, r.cache_prefix) || !get(file, r.session) ||
+        !get(file, r.n_tools_bytes) || !get(file, r.tools_hash) || !get(file, n_messages))
+        return false;
+    r.messages.resize(n_messages);
+    for (auto& msg : r.messages) {
+        if (!get(file, msg.role) || !get(file, msg.n_bytes) || !get(file, msg.hash) || !get(file, msg.n_markers))
+            return false;
+    }
+    if (!get(file, n_images)) return false;
+    r.images.resize(n_images);
+    for (auto& image : r.images) {
+        if (!get(file, image.key.hi) || !get(file, image.key.lo) || !get(file, image.format) || !get(file, image.nx) ||
+            !get(file, image.ny) || !get(file, image.n_bytes))
+            return false;
+    }
+    if (!get(file, n_frames)) return false;
+    r.modal_frames.resize(n_frames);
+    for (auto& frames : r.modal_frames) {
+        if (!get(file, frames)) return false;
+    }
+    return true;
+}
+
+bool RequestLog::read(const std::string& path, std::vector<LoggedRequest>& requests) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        LOG_ERR("%s: failed to open request log %s\n", __func__, path.c_str());
+        return false;
+    }
+    const size_t n_magic = strlen(REQUEST_LOG_MAGIC);
+    char magic[16] = {0};
+    if (fread(magic, 1, n_magic, file) != n_magic || memcmp(magic, REQUEST_LOG_MAGIC, n_magic) != 0) {
+        LOG_ERR("%s: %s is not a request log\n", __func__, path.c_str());
+        fclose(file);
+        return false;
+    }
+
+    std::unordered_map<int32_t, size_t> open;  // request id -> unfinished request
+    int64_t t_base = 0;                         // arrival times of a reopened log continue after the last one
+    int64_t t_last = 0;
+    uint8_t type = 0;
+    while (get(file, type)) {
+        if (type == REQUEST_LOG_MAGIC[0]) {  // header of a reopened log
+            if (fread(magic + 1, 1, n_magic - 1, file) != n_magic - 1) break;
+            t_base = t_last;
+            continue;
+        }
+        int64_t t_us = 0;
+        if (!get(file, t_us)) break;
+        t_last = t_base + t_us;
+        if (type == REQUEST_LOG_PROMPT) {
+            LoggedRequest r;
+            r.t_us = t_last;
+            if (!read_prompt(file, r)) break;
+            open[r.id] = requests.size();
+            requests.push_back(std::move(r));
+        } else if (type == REQUEST_LOG_FINISH) {
+            int32_t id = 0, n_generated = 0;
+            uint8_t success = 0;
+            if (!get(file, id) || !get(file, n_generated) || !get(file, success)) break;
+            auto it = open.find(id);
+            if (it == open.end()) continue;
+            requests[it->second].n_generated = n_generated;
+            requests[it->second].success = success != 0;
+            open.erase(it);
+        } else {
+            LOG_WRN("%s: unknown record %d, log read up to it\n", __func__, type);
+            break;
+        }
+    }
+    fclose(file);
+    return true;
+}
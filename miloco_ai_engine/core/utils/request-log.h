@@ -0,0 +1,77 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef REQUEST_LOG_H
+#define REQUEST_LOG_H
+
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "utils/chunk-hash.h"
+
+#define REQUEST_LOG_MAGIC "MICOREQ1"
+#define REQUEST_LOG_PROMPT 1  // record types
+#define REQUEST_LOG_FINISH 2
+
+struct MicoRequest;
+
+// Recorded traffic without its content: text and images are kept as hashes and sizes, so a replay can rebuild
+// a request with the same prefix sharing and image cache hits
+struct LoggedMessage {
+    uint8_t role{0};  // 0 system, 1 user, 2 assistant, 3 tool, 4 other
+    uint32_t n_bytes{0};
+    uint64_t hash{0};
+    uint16_t n_markers{0};  // image markers in the content
+};
+
+struct LoggedImage {
+    HashKey key;
+    int32_t format{0};  // LLAMA_MICO_MODAL_*
+    uint32_t nx{0};     // 0 for encoded images
+    uint32_t ny{0};
+    uint32_t n_bytes{0};
+};
+
+struct LoggedRequest {
+    int64_t t_us{0};  // arrival since the log was opened
+    int32_t id{0};
+    int32_t priority{0};
+    int32_t cache_prefix{0};
+    uint64_t session{0};  // hash of the session id, 0 for none
+    uint32_t n_tools_bytes{0};
+    uint64_t tools_hash{0};
+    std::vector<LoggedMessage> messages;
+    std::vector<LoggedImage> images;
+    std::vector<int32_t> modal_frames;
+    // from the finish record
+    int32_t n_generated{-1};  // -1 if the log ended before the request finished
+    bool success{false};
+};
+
+// Compact binary log of the prompt requests and their output lengths, "request_log_path" in the engine config.
+// Records are flushed one by one, a log cut by a crash stays readable up to its last record
+class RequestLog {
+  public:
+    explicit RequestLog(const std::string& path);
+    ~RequestLog();
+
+    bool is_open() const { return file_ != nullptr; }
+    void record_prompt(const MicoRequest& request);
+    void record_finish(int32_t request_id, int32_t n_generated, bool success);
+
+    // Requests of a log in arrival order with their finish records applied, false if it is not a request log
+    static bool read(const std::string& path, std::vector<LoggedRequest>& requests);
+
+  private:
+    void write(const std::string& record);
+
+    FILE* file_{nullptr};
+    int64_t t_open_us_{0};
+    std::mutex mutex_;
+};
+
+#endif  // REQUEST_LOG_H
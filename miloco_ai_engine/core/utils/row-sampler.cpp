@@ -0,0 +1,183 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "row-sampler.h"
+
+#include <algorithm>
+#include <cmath>
+
+RowSampling row_sampling_of(const common_params_sampling& sparams) {
+    RowSampling row;
+    bool plain = sparams.mirostat == 0 && sparams.grammar.empty() && sparams.logit_bias.empty() &&
+                 !sparams.ignore_eos && sparams.dry_multiplier == 0.0f && sparams.xtc_probability == 0.0f &&
+                 sparams.typ_p >= 1.0f && sparams.top_n_sigma <= 0.0f && sparams.dynatemp_range == 0.0f &&
+                 sparams.samplers == common_params_sampling().samplers;
+    if (!plain) return row;
+    if (sparams.temp <= 0) {  // argmax of the penalised logits
+        row.top_k = 1;
+        return row;
+    }
+    if (sparams.top_k <= 0 || sparams.top_k > ROW_SAMPLER_MAX_K) return row;
+    row.top_k = sparams.top_k;
+    row.top_p = sparams.top_p;
+    row.min_p = sparams.min_p;
+    row.temp = sparams.temp;
+    row.min_keep = sparams.min_keep;
+    return row;
+}
+
+void TokenPenalties::reset(const common_params_sampling& sparams) {
+    last_n_ = std::max(sparams.penalty_last_n, 0);
+    repeat_ = sparams.penalty_repeat;
+    freq_ = sparams.penalty_freq;
+    present_ = sparams.penalty_present;
+    window_.clear();
+    counts_.clear();
+}
+
+void TokenPenalties::accept(llama_token token) {
+    if (!active() || token < 0) return;
+    counts_[token]++;
+    window_.push_back(token);
+    if ((int32_t)window_.size() > last_n_) {
+        auto it = counts_.find(window_.front());
+        if (--it->second == 0) counts_.erase(it);
+        window_.pop_front();
+    }
+}
+
+void TokenPenalties::apply(float* logits) const {
+    if (!active()) return;
+    for (const auto& [token, count] : counts_) {
+        float& logit = logits[token];
+        logit = logit <= 0 ? logit * repeat_ : logit / repeat_;
+        logit -= float(count) * freq_ + present_;
+    }
+}
+
+static bool by_logit(const llama_token_data& a, const llama_token_data& b) { return a.logit > b.logit; }
+
+// Top k logits of a row, highest first. A block whose max is not above the k-th logit so far is skipped after one
+// vectorised pass, the candidates are cut back to k whenever they reach 2k
+static void select_top_k(const float* logits, int32_t n_vocab, int32_t k, std::vector<llama_token_data>& out) {
+    out.clear();
+    k = std::min(k, n_vocab);
+    float threshold = -INFINITY;
+    auto cut = [&]() {
+        std::nth_element(out.begin(), out.begin() + (k - 1), out.end(), by_logit);
+        out.resize(k);
+        threshold = out[k - 1].logit;
+    };
+    for (int32_t b = 0; b < n_vocab; b += ROW_SAMPLER_BLOCK) {
+        const float* block = logits + b;
+        int32_t n = std::min(ROW_SAMPLER_BLOCK, n_vocab - b);
+        float lanes[8] = {-INFINITY, -INFINITY, -INFINITY, -INFINITY, -INFINITY, -INFINITY, -INFINITY, -INFINITY};
+        int32_t j = 0;
+        for (; j + 8 <= n; j += 8) {
+            for (int32_t l = 0; l < 8; l++) lanes[l] = lanes[l] > block[j + l] ? lanes[l] : block[j + l];
+        }
+        for (; j < n; j++) lanes[0] = std::max(lanes[0], block[j]);
+        if (*std::max_element(lanes, lanes + 8) <= threshold) continue;
+        for (j = 0; j < n; j++) {
+            if (block[j] > threshold) out.push_back({b + j, block[j], 0.0f});
+        }
+        if ((int32_t)out.size() >= 2 * k) cut();
+    }
+    if ((int32_t)out.size() > k) cut();
+    std::sort(out.begin(), out.end(), by_logit);
+}
+
+RowSampler::RowSampler(int32_t n_threads) {
+    for (int32_t t = 1; t < n_threads; t++) workers_.emplace_back([this]() { work(); });
+}
+
+RowSampler::~RowSampler() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (auto& worker : workers_) worker.join();
+}
+
+void RowSampler::select(const std::vector<const float*>& rows, int32_t n_vocab, const std::vector<int32_t>& ks) {
+    n_vocab_ = n_vocab;
+    tasks_.clear();
+    for (size_t i = 0; i < rows.size(); i++) tasks_.push_back({rows[i], ks[i]});
+    if (candidates_.size() < tasks_.size()) candidates_.resize(tasks_.size());
+    next_task_.store(0);
+    if (tasks_.size() < 2 || workers_.empty()) {
+        run_tasks();
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        n_busy_ = workers_.size();
+        generation_++;
+    }
+    wake_.notify_all();
+    run_tasks();
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_.wait(lock, [this]() { return n_busy_ == 0; });
+}
+
+void RowSampler::work() {
+    uint64_t seen = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            wake_.wait(lock, [&]() { return stop_ || generation_ != seen; });
+            if (stop_) return;
+            seen = generation_;
+        }
+        run_tasks();
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (--n_busy_ == 0) done_.notify_one();
+    }
+}
+
+void RowSampler::run_tasks() {
+    for (size_t i = next_task_.fetch_add(1); i < tasks_.size(); i = next_task_.fetch_add(1)) {
+        if (tasks_[i].logits) select_top_k(tasks_[i].logits, n_vocab_, tasks_[i].k, candidates_[i]);
+    }
+}
+
+llama_token RowSampler::sample(size_t i, const RowSampling& params, std::mt19937& rng) {
+    const auto& cand = candidates_[i];
+    if (cand.empty()) return LLAMA_TOKEN_NULL;
+    size_t n = cand.size();
+    if (n == 1) return cand[0].id;
+
+    // NOTE: the order and the cut rules of llama_sampler_top_p and llama_sampler_min_p, on the untempered logits
+    float max_logit = cand[0].logit;
+    if (params.top_p < 1.0f) {
+        double sum = 0.0;
+        for (size_t j = 0; j < n; j++) sum += std::exp(cand[j].logit - max_logit);
+        double cum = 0.0;
+        for (size_t j = 0; j < n; j++) {
+            cum += std::exp(cand[j].logit - max_logit) / sum;
+            if (cum >= params.top_p && j + 1 >= params.min_keep) {
+                n = j + 1;
+                break;
+            }
+        }
+    }
+    if (params.min_p > 0.0f) {
+        float min_logit = max_logit + logf(params.min_p);
+        size_t j = 1;
+        while (j < n && (cand[j].logit >= min_logit || j < params.min_keep)) j++;
+        n = j;
+    }
+
+    double sum = 0.0;
+    std::vector<double> weights(n);
+    for (size_t j = 0; j < n; j++) sum += weights[j] = std::exp((cand[j].logit - max_logit) / params.temp);
+    double draw = std::uniform_real_distribution<double>(0.0, sum)(rng);
+    for (size_t j = 0; j < n; j++) {
+        draw -= weights[j];
+        if (draw < 0) return cand[j].id;
+    }
+    return cand[n - 1].id;
+}
@@ -0,0 +1,91 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef ROW_SAMPLER_H
+#define ROW_SAMPLER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "common/sampling.h"
+#include "llama.h"
+
+#define ROW_SAMPLER_MAX_K 1024  // a larger top_k keeps the sampler chain
+#define ROW_SAMPLER_BLOCK 64    // logits per block max, a block under the running k-th logit is skipped
+
+// The default common_sampler chain of a request reduced to what it does to the logits: penalties (TokenPenalties),
+// top_k, then top_p and min_p on the untempered probabilities, then temperature and a draw. top_k is 0 if the chain
+// does more (grammar, logit bias, ...), a greedy request is top_k 1
+struct RowSampling {
+    int32_t top_k{0};
+    float top_p{1.0f};
+    float min_p{0.0f};
+    float temp{1.0f};
+    size_t min_keep{0};
+};
+
+RowSampling row_sampling_of(const common_params_sampling& sparams);
+
+// Repetition, frequency and presence penalties of a sequence over its last penalty_last_n sampled tokens, the counts
+// are kept up to date per accepted token and only the logits of counted tokens are touched
+class TokenPenalties {
+  public:
+    void reset(const common_params_sampling& sparams);
+    bool active() const { return last_n_ > 0 && (repeat_ != 1.0f || freq_ != 0.0f || present_ != 0.0f); }
+    void accept(llama_token token);
+    // NOTE: in place, the rules of llama_sampler_penalties
+    void apply(float* logits) const;
+
+  private:
+    int32_t last_n_{0};
+    float repeat_{1.0f};
+    float freq_{0.0f};
+    float present_{0.0f};
+    std::deque<llama_token> window_;
+    std::unordered_map<llama_token, int32_t> counts_;  // of window_
+};
+
+// Batched sampling of the output rows of a decode step: the top_k candidates of every row are selected on worker
+// threads in one pass over its logits instead of a sort of the whole vocabulary per row, then each sequence filters
+// its candidates and draws with its own generator. NOTE: one caller at a time
+class RowSampler {
+  public:
+    explicit RowSampler(int32_t n_threads);
+    ~RowSampler();
+
+    // Candidates of the output rows rows[i] (n_vocab logits each) for top_k ks[i], the calling thread selects along
+    void select(const std::vector<const float*>& rows, int32_t n_vocab, const std::vector<int32_t>& ks);
+    // Token drawn from the candidates of rows[i]
+    llama_token sample(size_t i, const RowSampling& params, std::mt19937& rng);
+
+  private:
+    struct Task {
+        const float* logits;
+        int32_t k;
+    };
+    void work();
+    void run_tasks();
+
+    std::vector<Task> tasks_;
+    std::vector<std::vector<llama_token_data>> candidates_;  // per task, sorted by logit, highest first
+    int32_t n_vocab_{0};
+    std::atomic<size_t> next_task_{0};
+
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    uint64_t generation_{0};
+    size_t n_busy_{0};
+    bool stop_{false};
+};
+
+#endif  // ROW_SAMPLER_H
@@ -0,0 +1,125 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Lock-free single-producer single-consumer byte ring: the producer (decode loop) never blocks, bytes past a full ring
+// wait in an overflow string until the consumer catches up, and the consumer is only signalled while it waits, so a
+// busy consumer costs the producer no syscall per token
+class SpscByteRing {
+  public:
+    explicit SpscByteRing(size_t capacity) {
+        size_t n = 64;
+        while (n < capacity) n <<= 1;
+        data_.resize(n);
+        mask_ = n - 1;
+    }
+
+    SpscByteRing(const SpscByteRing&) = delete;
+    SpscByteRing& operator=(const SpscByteRing&) = delete;
+
+    // Producer, false once the consumer cancelled
+    bool push(const char* data, size_t n) {
+        if (cancelled_.load()) return false;
+        if (n > 0) {
+            uint64_t tail = tail_.load(std::memory_order_relaxed);
+            uint64_t head = head_.load(std::memory_order_acquire);
+            if (has_overflow_.load(std::memory_order_relaxed) || data_.size() - (tail - head) < n) {
+                std::lock_guard<std::mutex> lock(mutex_);  // NOTE: in order after the ring bytes
+                overflow_.append(data, n);
+                has_overflow_.store(true, std::memory_order_release);
+            } else {
+                for (size_t i = 0; i < n; i++) data_[(tail + i) & mask_] = data[i];
+                tail_.store(tail + n, std::memory_order_release);
+            }
+        }
+        wake();
+        return true;
+    }
+
+    // Producer, no more bytes after these
+    void close(int32_t result) {
+        result_ = result;
+        closed_.store(true, std::memory_order_release);
+        wake();
+    }
+
+    // Consumer, the producer stops at its next push
+    void cancel() { cancelled_.store(true); }
+
+    // Consumer: waits up to timeout_ms for bytes or close, moves up to n of them into out and returns their count,
+    // closed is only set once every byte was read
+    size_t pop(char* out, size_t n, int32_t timeout_ms, bool& closed, int32_t& result) {
+        size_t n_read = read(out, n);
+        if (n_read == 0 && timeout_ms > 0) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            waiting_.store(true);
+            cond_.wait_for(lock, std::chrono::milliseconds(timeout_ms), [this] {
+                return tail_.load() != head_.load(std::memory_order_relaxed) || has_overflow_.load() || closed_.load();
+            });
+            waiting_.store(false);
+            lock.unlock();
+            n_read = read(out, n);
+        }
+        closed = false;
+        if (n_read < n && closed_.load(std::memory_order_acquire)) {
+            n_read += read(out + n_read, n - n_read);
+            closed = tail_.load() == head_.load() && !has_overflow_.load();
+            result = result_;
+        }
+        return n_read;
+    }
+
+  private:
+    size_t read(char* out, size_t n) {
+        bool overflow = has_overflow_.load(std::memory_order_acquire);  // NOTE: before the tail it is ordered after
+        uint64_t head = head_.load(std::memory_order_relaxed);
+        uint64_t tail = tail_.load(std::memory_order_acquire);
+        size_t n_read = std::min((size_t)(tail - head), n);
+        for (size_t i = 0; i < n_read; i++) out[i] = data_[(head + i) & mask_];
+        head_.store(head + n_read, std::memory_order_release);
+        if (!overflow || n_read == n || tail - head > n_read) return n_read;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t n_overflow = std::min(overflow_.size(), n - n_read);
+        memcpy(out + n_read, overflow_.data(), n_overflow);
+        overflow_.erase(0, n_overflow);
+        if (overflow_.empty()) has_overflow_.store(false, std::memory_order_release);
+        return n_read + n_overflow;
+    }
+
+    void wake() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);  // NOTE: the bytes are visible before waiting_ is read
+        if (!waiting_.load()) return;
+        std::lock_guard<std::mutex> lock(mutex_);
+        cond_.notify_one();
+    }
+
+    std::vector<char> data_;
+    size_t mask_{0};
+    alignas(64) std::atomic<uint64_t> head_{0};  // bytes consumed, written by the consumer
+    alignas(64) std::atomic<uint64_t> tail_{0};  // bytes produced, written by the producer
+    std::atomic<bool> has_overflow_{false};
+    std::atomic<bool> closed_{false};
+    std::atomic<bool> cancelled_{false};
+    std::atomic<bool> waiting_{false};
+    int32_t result_{0};
+
+    std::mutex mutex_;  // overflow and the consumer wait
+    std::condition_variable cond_;
+    std::string overflow_;
+};
+
+#endif  // SPSC_RING_H
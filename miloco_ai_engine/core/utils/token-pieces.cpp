@@ -0,0 +1,30 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+
+#include "token-pieces.h"
+
+#include "common/log.h"
+
+TokenPieces::TokenPieces(const llama_vocab* vocab) {
+    int32_t n_vocab = llama_vocab_n_tokens(vocab);
+    offsets_.reserve((size_t)n_vocab + 1);
+    data_.reserve((size_t)n_vocab * 8);
+    char buf[64];
+    std::vector<char> large;
+    for (llama_token token = 0; token < n_vocab; token++) {
+        offsets_.push_back((uint32_t)data_.size());
+        int32_t n = llama_token_to_piece(vocab, token, buf, sizeof(buf), 0, true /* special */);
+        if (n >= 0) {
+            data_.append(buf, n);
+            continue;
+        }
+        large.resize(-n);  // NOTE: a long special token
+        n = llama_token_to_piece(vocab, token, large.data(), (int32_t)large.size(), 0, true /* special */);
+        if (n > 0) data_.append(large.data(), n);
+    }
+    offsets_.push_back((uint32_t)data_.size());
+    data_.shrink_to_fit();
+    LOG_INF("Token piece table of %d tokens, %zu KB\n", n_vocab, bytes() >> 10);
+}
@@ -0,0 +1,33 @@
+/**
+ * Copyright (C) 2025 Xiaomi Corporation
+ * This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+ */
+#ifndef TOKEN_PIECES_H
+#define TOKEN_PIECES_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "llama.h"
+
+// Text of every vocab token (special ones rendered) in one contiguous buffer, built once per model so the generate
+// path appends a piece to its per sequence text instead of calling llama_token_to_piece into a new std::string
+class TokenPieces {
+  public:
+    explicit TokenPieces(const llama_vocab* vocab);
+
+    // empty for a token out of the vocab
+    std::string_view piece(llama_token token) const {
+        if (token < 0 || (size_t)token + 1 >= offsets_.size()) return {};
+        return std::string_view(data_.data() + offsets_[token], offsets_[token + 1] - offsets_[token]);
+    }
+    size_t bytes() const { return data_.size() + offsets_.size() * sizeof(uint32_t); }
+
+  private:
+    std::string data_;
+    std::vector<uint32_t> offsets_;  // n_vocab + 1, piece i is [offsets_[i], offsets_[i + 1])
+};
+
+#endif  // TOKEN_PIECES_H
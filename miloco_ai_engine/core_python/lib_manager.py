@@ -17,6 +17,59 @@ logger = logging.getLogger(__name__)
 
 LLAMA_MICO_LIB_NAME = "llama-mico"  # Library name
 
+class LlamaMicoMessage(ctypes.Structure):
+    """llama_mico_message"""
+    _fields_ = [("role", ctypes.c_char_p), ("content", ctypes.c_char_p)]
+
+
+class LlamaMicoModalBuffer(ctypes.Structure):
+    """llama_mico_modal_buffer"""
+    _fields_ = [
+        ("data", ctypes.POINTER(ctypes.c_uint8)),
+        ("size", ctypes.c_size_t),
+        ("format", ctypes.c_int32),  # LLAMA_MICO_MODAL_*, 0 encoded, 1 RGB, 2 NV12
+        ("nx", ctypes.c_uint32),
+        ("ny", ctypes.c_uint32),
+        ("buffer_id", ctypes.c_int32),  # registered buffer used when data is NULL
+        ("pool", ctypes.c_int32),  # vision token pooling of this image, 0 for the request vision_pool
+        ("roi_x", ctypes.c_int32),  # region of interest in source pixels, roi_w 0 for the whole image
+        ("roi_y", ctypes.c_int32),
+        ("roi_w", ctypes.c_int32),
+        ("roi_h", ctypes.c_int32),
+        ("max_side", ctypes.c_int32),  # longest side of this image, 0 for the request image sides
+        ("content_id", ctypes.c_char_p),  # stable id of the content used as cache key, None hashes the content
+    ]
+
+
+class LlamaMicoRequest(ctypes.Structure):
+    """llama_mico_request"""
+    _fields_ = [
+        ("id", ctypes.c_int32),
+        ("priority", ctypes.c_int32),
+        ("messages", ctypes.POINTER(LlamaMicoMessage)),
+        ("n_messages", ctypes.c_int32),
+        ("tools_json", ctypes.c_char_p),
+        ("modal_buffers", ctypes.POINTER(LlamaMicoModalBuffer)),
+        ("n_modal_buffers", ctypes.c_int32),
+        ("stop", ctypes.c_int32),
+        ("cache_prefix", ctypes.c_int32),
+        ("session", ctypes.c_char_p),
+        ("modal_frames", ctypes.POINTER(ctypes.c_int32)),  # modal buffers per image marker, video clips
+        ("n_modal_frames", ctypes.c_int32),
+        ("keyframes", ctypes.POINTER(ctypes.c_uint8)),
+        ("cache_pin", ctypes.c_int32),
+        ("max_tokens", ctypes.c_int32),
+        ("deadline_ms", ctypes.c_int32),
+        ("vision_pool", ctypes.c_int32),
+        ("image_max_side", ctypes.c_int32),
+        ("image_min_side", ctypes.c_int32),
+        ("lora", ctypes.c_char_p),  # configured LoRA adapter name, None for the base model
+        ("video_session", ctypes.c_char_p),  # live video id keeping its frame window in kv, None for none
+    ]
+
+# int32_t (*llama_mico_piece_callback)(const char *piece, void *user_data)
+LLAMA_MICO_PIECE_CALLBACK = ctypes.CFUNCTYPE(ctypes.c_int32, ctypes.c_char_p, ctypes.c_void_p)
+
 class LibraryManager:
     """Library manager - Singleton pattern"""
 
@@ -110,6 +163,14 @@ class LibraryManager:
             self._library.llama_mico_free.restype = ctypes.c_int32
             self._library.llama_mico_free.argtypes = [ctypes.c_void_p]
 
+            # Model swap function
+            self._library.llama_mico_swap_model.restype = ctypes.c_int32
+            self._library.llama_mico_swap_model.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p,  # config_json
+                ctypes.POINTER(ctypes.c_void_p)  # new_handle
+            ]
+
             # Prompt request function
             self._library.llama_mico_request_prompt.restype = ctypes.c_int32
             self._library.llama_mico_request_prompt.argtypes = [
@@ -128,6 +189,215 @@ class LibraryManager:
                 ctypes.POINTER(ctypes.c_char_p)  # content
             ]
 
+            # Requests writing into a buffer of the caller
+            self._library.llama_mico_request_prompt_into.restype = ctypes.c_int32
+            self._library.llama_mico_request_prompt_into.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p,  # request_json_str
+                ctypes.POINTER(ctypes.c_int32),  # is_finished
+                ctypes.c_char_p,  # buffer
+                ctypes.c_int32,  # size
+                ctypes.POINTER(ctypes.c_int32)  # n_written
+            ]
+            self._library.llama_mico_request_generate_into.restype = ctypes.c_int32
+            self._library.llama_mico_request_generate_into.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_int32,  # request_id
+                ctypes.c_int32,  # stop
+                ctypes.POINTER(ctypes.c_int32),  # is_finished
+                ctypes.c_char_p,  # buffer
+                ctypes.c_int32,  # size
+                ctypes.POINTER(ctypes.c_int32)  # n_written
+            ]
+
+            # Batch prompt request function
+            self._library.llama_mico_request_prompt_batch.restype = ctypes.c_int32
+            self._library.llama_mico_request_prompt_batch.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.POINTER(ctypes.c_char_p),  # request_json_strs
+                ctypes.c_int32,  # n_requests
+                ctypes.POINTER(ctypes.c_int32),  # is_finished
+                ctypes.POINTER(ctypes.c_char_p)  # contents
+            ]
+            self._library.llama_mico_request_prompt_n.restype = ctypes.c_int32
+            self._library.llama_mico_request_prompt_n.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p,  # request_json_str
+                ctypes.c_int32,  # n
+                ctypes.POINTER(ctypes.c_int32),  # is_finished
+                ctypes.POINTER(ctypes.c_char_p)  # contents
+            ]
+
+            # Binary request functions
+            for name in ("llama_mico_request_prompt_struct", "llama_mico_request_generate_struct"):
+                func = getattr(self._library, name)
+                func.restype = ctypes.c_int32
+                func.argtypes = [
+                    ctypes.c_void_p,  # handle
+                    ctypes.POINTER(LlamaMicoRequest),  # request
+                    ctypes.POINTER(ctypes.c_int32),  # is_finished
+                    ctypes.POINTER(ctypes.c_char_p)  # content
+                ]
+
+            # Multi-token generate function
+            self._library.llama_mico_request_generate_n.restype = ctypes.c_int32
+            self._library.llama_mico_request_generate_n.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_int32,  # request_id
+                ctypes.c_int32,  # max_tokens
+                ctypes.POINTER(ctypes.c_char_p),  # stop_strings
+                ctypes.c_int32,  # n_stop_strings
+                LLAMA_MICO_PIECE_CALLBACK,  # callback
+                ctypes.c_void_p,  # user_data
+                ctypes.POINTER(ctypes.c_int32),  # is_finished
+                ctypes.POINTER(ctypes.c_char_p)  # content
+            ]
+
+            # Async request functions
+            self._library.llama_mico_submit.restype = ctypes.c_int32
+            self._library.llama_mico_submit.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p,  # request_json_str
+                LLAMA_MICO_PIECE_CALLBACK,  # on_token
+                ctypes.c_void_p,  # user_data
+                ctypes.POINTER(ctypes.c_int32)  # ticket
+            ]
+            self._library.llama_mico_poll.restype = ctypes.c_int32
+            self._library.llama_mico_poll.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_int32,  # ticket
+                ctypes.POINTER(ctypes.c_int32),  # is_finished
+                ctypes.POINTER(ctypes.c_char_p)  # content
+            ]
+            self._library.llama_mico_stream_open.restype = ctypes.c_int32
+            self._library.llama_mico_stream_open.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p,  # request_json_str
+                ctypes.c_int32,  # capacity
+                ctypes.POINTER(ctypes.c_void_p)  # stream
+            ]
+            self._library.llama_mico_stream_read.restype = ctypes.c_int32
+            self._library.llama_mico_stream_read.argtypes = [
+                ctypes.c_void_p,  # stream
+                ctypes.c_char_p,  # buffer
+                ctypes.c_int32,  # size
+                ctypes.c_int32,  # timeout_ms
+                ctypes.POINTER(ctypes.c_int32),  # n_read
+                ctypes.POINTER(ctypes.c_int32)  # is_finished
+            ]
+            self._library.llama_mico_stream_close.restype = ctypes.c_int32
+            self._library.llama_mico_stream_close.argtypes = [
+                ctypes.c_void_p  # stream
+            ]
+            self._library.llama_mico_cancel.restype = ctypes.c_int32
+            self._library.llama_mico_cancel.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_int32  # request_id
+            ]
+            self._library.llama_mico_release_session.restype = ctypes.c_int32
+            self._library.llama_mico_release_session.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p  # session
+            ]
+            self._library.llama_mico_session_export.restype = ctypes.c_int32
+            self._library.llama_mico_session_export.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p,  # session
+                ctypes.POINTER(ctypes.POINTER(ctypes.c_uint8)),  # data
+                ctypes.POINTER(ctypes.c_size_t)  # size
+            ]
+            self._library.llama_mico_session_import.restype = ctypes.c_int32
+            self._library.llama_mico_session_import.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p,  # data
+                ctypes.c_size_t  # size
+            ]
+            self._library.llama_mico_prime.restype = ctypes.c_int32
+            self._library.llama_mico_prime.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p  # request_json_str
+            ]
+            self._library.llama_mico_video_append.restype = ctypes.c_int32
+            self._library.llama_mico_video_append.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p  # request_json_str
+            ]
+            self._library.llama_mico_score.restype = ctypes.c_int32
+            self._library.llama_mico_score.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p,  # request_json_str
+                ctypes.POINTER(ctypes.c_char_p),  # candidates
+                ctypes.c_int32,  # n_candidates
+                ctypes.POINTER(ctypes.c_float)  # logprobs
+            ]
+            self._library.llama_mico_register_buffer.restype = ctypes.c_int32
+            self._library.llama_mico_register_buffer.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_size_t,  # size
+                ctypes.c_int32,  # format
+                ctypes.c_uint32,  # nx
+                ctypes.c_uint32,  # ny
+                ctypes.POINTER(ctypes.POINTER(ctypes.c_uint8)),  # data
+                ctypes.POINTER(ctypes.c_int32)  # buffer_id
+            ]
+            self._library.llama_mico_release_buffer.restype = ctypes.c_int32
+            self._library.llama_mico_release_buffer.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_int32  # buffer_id
+            ]
+            self._library.llama_mico_pre_encode.restype = ctypes.c_int32
+            self._library.llama_mico_pre_encode.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.POINTER(LlamaMicoModalBuffer),  # frame
+                ctypes.c_char_p  # content_id
+            ]
+            self._library.llama_mico_embed.restype = ctypes.c_int32
+            self._library.llama_mico_embed.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p,  # text
+                ctypes.POINTER(LlamaMicoModalBuffer),  # image
+                ctypes.POINTER(ctypes.c_float),  # embd
+                ctypes.c_int32,  # n_embd_max
+                ctypes.POINTER(ctypes.c_int32)  # n_embd
+            ]
+            self._library.llama_mico_get_metrics.restype = ctypes.c_int32
+            self._library.llama_mico_get_metrics.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.POINTER(ctypes.c_char_p)  # json
+            ]
+            self._library.llama_mico_get_memory.restype = ctypes.c_int32
+            self._library.llama_mico_get_memory.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.POINTER(ctypes.c_char_p)  # json
+            ]
+            self._library.llama_mico_get_timings.restype = ctypes.c_int32
+            self._library.llama_mico_get_timings.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_int32,  # request_id
+                ctypes.POINTER(ctypes.c_char_p)  # json
+            ]
+            self._library.llama_mico_get_cache_digest.restype = ctypes.c_int32
+            self._library.llama_mico_get_cache_digest.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.POINTER(ctypes.c_char_p)  # json
+            ]
+            self._library.llama_mico_get_request_digest.restype = ctypes.c_int32
+            self._library.llama_mico_get_request_digest.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p,  # request_json
+                ctypes.POINTER(ctypes.c_char_p)  # json
+            ]
+            self._library.llama_mico_trace_start.restype = ctypes.c_int32
+            self._library.llama_mico_trace_start.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_int32  # n_events
+            ]
+            self._library.llama_mico_trace_dump.restype = ctypes.c_int32
+            self._library.llama_mico_trace_dump.argtypes = [
+                ctypes.c_void_p,  # handle
+                ctypes.c_char_p  # path
+            ]
+
             logger.info("Function signatures setup successfully")
             self._function_loaded = True
             return True
@@ -6,6 +6,7 @@ LLaMA-MICO Core Interface
 Directly calls LLaMA-MICO C API using ctypes
 """
 
+import codecs
 import ctypes
 import json
 from typing import List, Optional, Dict, Any, Union, Iterator
@@ -16,9 +17,8 @@ import contextlib
 from miloco_ai_engine.utils.mico_content_util import MicoContentUtil
 from miloco_ai_engine.utils.image_process import ImageProcess
 from miloco_ai_engine.middleware.exceptions import CoreNormalException, InvalidArgException
-from miloco_ai_engine.core_python.lib_manager import get_library
+from miloco_ai_engine.core_python.lib_manager import get_library, LlamaMicoModalBuffer
 from miloco_ai_engine.config import config as c
-import numpy as np
 
 import logging
 logger = logging.getLogger(__name__)
@@ -27,17 +27,21 @@ class LlamaMico:
     """LLaMA-MICO core interface class - Adapts llama-mico.h interface"""
 
     _HIGH_PROCESS_IMAGE_SIZE = (448, 448)
-    _LOW_PROCESS_IMAGE_SIZE = (224, 224)
+    _LOW_PRECISION_POOL = 2  # engine side 2x2 vision token pooling, a quarter of the tokens like a 224px frame
     _VIDEO_CONTINUOUS_FRAMES_NUM = 6
-    _MAX_BYTE_BUFFER_SIZE = 4
-    _DEFAULT_DECODED_TEXT = "@"
+    _STREAM_READ_BYTES = 65536  # text taken per llama_mico_stream_read
+    _STREAM_WAIT_MS = 100  # longest wait of a read for new text
+    _MODAL_RGB = 1  # LLAMA_MICO_MODAL_RGB
+    _EMBED_MAX_DIM = 16384  # floats reserved for llama_mico_embed, above n_embd of the supported models
+    _CHAT_CMPL_PREFIX = "local-chatcmpl-"  # CHAT_CMP_ID_PREFIX of the engine
+    _GENERATE_BUFFER_BYTES = 4096  # per thread for llama_mico_request_generate_into, grown on demand
+    _thread_buffers = threading.local()
 
     def __init__(self):
         self.request_id_counter = 0
         self._counter_lock = threading.Lock()
         self.mico_content_util = MicoContentUtil()
-        self._active_modal_buffers = {}  # Keep image buffers alive
-        self._byte_buffers = {}  # Cache incomplete bytes, key is request_id
+        self._active_modal_buffers = {}  # Registered engine buffers of each request, released once it is parsed
 
     def init(self, config: Dict[str, Any]) -> Optional[ctypes.c_void_p]:
         """
@@ -63,6 +67,28 @@ class LlamaMico:
         logger.info("LLaMA-MICO context initialized successfully, handle: %s", handle)
         return handle
 
+    def swap_model(self, handle: ctypes.c_void_p, config: Dict[str, Any]) -> Optional[ctypes.c_void_p]:
+        """
+        Load the model of config into a new handle while handle keeps serving, its cached prompts and sessions are
+        prefilled into the new one. Free handle once its requests are done
+        """
+        llama_mico_lib = get_library()
+
+        config["log_file"] = str(c.LOG_FILE_NAME)
+        config["log_level"] = c.LOGGING_CONFIG["log_level"].lower()
+
+        config_json = json.dumps(config, ensure_ascii=False)
+        handle_ptr = ctypes.c_void_p()
+        ret = llama_mico_lib.llama_mico_swap_model(handle, config_json.encode("utf-8"), ctypes.byref(handle_ptr))
+        if ret != 0:
+            err = f"Model swap failed: {ret}"
+            logger.error(err)
+            raise CoreNormalException(err)
+
+        new_handle = handle_ptr.value
+        logger.info("LLaMA-MICO model swapped, handle: %s, new handle: %s", handle, new_handle)
+        return new_handle
+
     def cleanup(self, handle: ctypes.c_void_p):
         """
         Clean up resources
@@ -79,49 +105,320 @@ class LlamaMico:
             raise CoreNormalException(err)
         logger.info("LLaMA-MICO context freed, handle: %d", handle)
 
-    def _parse_content(
-            self,
-            content_ptr: ctypes.c_char_p,
-            current_id: int) -> Union[str, List[Dict[str, Any]]]:
+    def cancel(self, handle: ctypes.c_void_p, request_id: int) -> bool:
         """
-        Parse LLaMA-MICO response content
+        Cancel a request in progress, its queued prompt work is dropped and its KV released at once.
+        False if no such request is in progress
         """
-        res = ""
-        if not content_ptr or not content_ptr.value:
-            return res
-        if current_id not in self._byte_buffers:
-            self._byte_buffers[current_id] = b""
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        llama_mico_lib = get_library()
+        return llama_mico_lib.llama_mico_cancel(handle, request_id) == 0
+
+    def release_session(self, handle: ctypes.c_void_p, session: str):
+        """
+        Release the cached KV of a multi-turn session
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        llama_mico_lib = get_library()
+        ret = llama_mico_lib.llama_mico_release_session(handle, session.encode("utf-8"))
+        if ret != 0:
+            err = f"Failed to release session {session}: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+
+    def session_export(self, handle: ctypes.c_void_p, session: str) -> bytes:
+        """
+        Serialise a cached multi-turn session (kv and history) for session_import on another instance of the model
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        llama_mico_lib = get_library()
+        data = ctypes.POINTER(ctypes.c_uint8)()
+        size = ctypes.c_size_t()
+        ret = llama_mico_lib.llama_mico_session_export(handle, session.encode("utf-8"), ctypes.byref(data),
+                                                       ctypes.byref(size))
+        if ret != 0:
+            err = f"Failed to export session {session}: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+        return ctypes.string_at(data, size.value)
 
-        self._byte_buffers[current_id] += content_ptr.value
-        decoded_text = ""
+    def session_import(self, handle: ctypes.c_void_p, data: bytes):
+        """
+        Cache a session exported by session_export, its next turn continues without prefilling the history
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
 
+        llama_mico_lib = get_library()
+        ret = llama_mico_lib.llama_mico_session_import(handle, data, len(data))
+        if ret != 0:
+            err = f"Failed to import session: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+
+    def prime(self, handle: ctypes.c_void_p, messages: List[Dict[str, Any]], tools: List[Dict[str, Any]],
+              cache_prefix: int = 0, cache_pin: bool = True):
+        """
+        Prefill the kv cache with the prefix of a text prompt ahead of traffic, e.g. the system prompt and tools of a
+        new rule, so its first request hits a warm cache. cache_prefix and cache_pin as chat_completion, nothing is
+        generated
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        with self._counter_lock:
+            current_id = self.request_id_counter
+            self.request_id_counter += 1
+        request_data = {
+            "id": f"local-chatcmpl-{current_id}",
+            "messages": [{k: v for k, v in msg.items() if v is not None} for msg in messages],
+            "tools": tools,
+            "cache_prefix": cache_prefix,
+            "cache_pin": cache_pin
+        }
+        llama_mico_lib = get_library()
+        ret = llama_mico_lib.llama_mico_prime(handle, json.dumps(request_data, ensure_ascii=False).encode("utf-8"))
+        if ret != 0:
+            err = f"Failed to prime the kv cache: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+
+    def video_append(self, handle: ctypes.c_void_p, messages: List[Dict[str, Any]], video_session: str,
+                     priority: int = 0):
+        """
+        Prefill the frames of messages into the kv window of a live video as they arrive, frames before them leave
+        the window. A chat_completion with the same frames and video_session then only prefills its question
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+        if not messages or not video_session:
+            raise InvalidArgException("messages and video_session cannot be empty")
+
+        address_list, buffer_ids = self._prepare_modal_frames(handle, messages)
+        with self._counter_lock:
+            current_id = self.request_id_counter
+            self.request_id_counter += 1
+        request_data = {
+            "id": f"local-chatcmpl-{current_id}",
+            "messages": messages,
+            "tools": [],
+            "modal_prts": address_list,
+            "priority": priority,
+            "video_session": video_session
+        }
+        llama_mico_lib = get_library()
         try:
-            decoded_text = self._byte_buffers[current_id].decode("utf-8")
-            self._byte_buffers[current_id] = b""
-            return decoded_text
-        except UnicodeDecodeError:
-            pass
-
-        # Try reverse splitting and decode character by character
-        for i in range(len(self._byte_buffers[current_id]), 0, -1):
-            try:
-                decoded_text = self._byte_buffers[current_id][:i].decode("utf-8")
-                self._byte_buffers[current_id] = self._byte_buffers[current_id][i:]
-                return decoded_text
-            except UnicodeDecodeError:
-                continue
-
-        # If remaining bytes still exceed UTF-8 decode threshold, discard directly
-        if len(self._byte_buffers[current_id]) > self._MAX_BYTE_BUFFER_SIZE:
-            logger.warning("Byte buffer exceeds 4 bytes and still cannot be UTF-8 decoded: %s", 
-                           self._byte_buffers[current_id])
-            try:
-                decoded_text = self._byte_buffers[current_id].decode("utf-8", errors="replace")
-            except UnicodeDecodeError:
-                decoded_text = self._DEFAULT_DECODED_TEXT
-            self._byte_buffers[current_id] = b""
-
-        return decoded_text
+            ret = llama_mico_lib.llama_mico_video_append(
+                handle, json.dumps(request_data, ensure_ascii=False).encode("utf-8"))
+        finally:
+            for buffer_id in buffer_ids:
+                llama_mico_lib.llama_mico_release_buffer(handle, buffer_id)
+        if ret != 0:
+            err = f"Failed to append frames to video session {video_session}: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+
+    def score(self, handle: ctypes.c_void_p, messages: List[Dict[str, Any]], tools: List[Dict[str, Any]],
+              candidates: List[str], priority: int = 0) -> List[float]:
+        """
+        Log probability of each candidate answer (e.g. ["yes", "no"]) as the assistant reply to messages, from one
+        prefill and one decode instead of generating the answer. Sums over the candidate tokens, not length normalized
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+        if not candidates:
+            raise InvalidArgException("candidates cannot be empty")
+
+        with self._counter_lock:
+            current_id = self.request_id_counter
+            self.request_id_counter += 1
+        request_data = {
+            "id": f"local-chatcmpl-{current_id}",
+            "messages": [{k: v for k, v in msg.items() if v is not None} for msg in messages],
+            "tools": tools,
+            "priority": priority
+        }
+        encoded = [candidate.encode("utf-8") for candidate in candidates]
+        candidates_arr = (ctypes.c_char_p * len(encoded))(*encoded)
+        logprobs = (ctypes.c_float * len(encoded))()
+        llama_mico_lib = get_library()
+        ret = llama_mico_lib.llama_mico_score(handle, json.dumps(request_data, ensure_ascii=False).encode("utf-8"),
+                                              candidates_arr, len(encoded), logprobs)
+        if ret != 0:
+            err = f"Failed to score candidates: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+        return list(logprobs)
+
+    def get_metrics(self, handle: ctypes.c_void_p) -> Dict[str, Any]:
+        """
+        Get stage latency histograms, batch fill and cache hit rates
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        llama_mico_lib = get_library()
+        json_ptr = ctypes.c_char_p()
+        ret = llama_mico_lib.llama_mico_get_metrics(handle, ctypes.byref(json_ptr))
+        if ret != 0 or not json_ptr.value:
+            err = f"Failed to get metrics: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+        return json.loads(json_ptr.value.decode("utf-8"))
+
+    def get_memory(self, handle: ctypes.c_void_p) -> Dict[str, Any]:
+        """
+        Get the bytes of weights, kv cache, compute buffers and caches per device and on the host, and the kv cells
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        llama_mico_lib = get_library()
+        json_ptr = ctypes.c_char_p()
+        ret = llama_mico_lib.llama_mico_get_memory(handle, ctypes.byref(json_ptr))
+        if ret != 0 or not json_ptr.value:
+            err = f"Failed to get memory: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+        return json.loads(json_ptr.value.decode("utf-8"))
+
+    def get_timings(self, handle: ctypes.c_void_p, request_id: int) -> Optional[Dict[str, Any]]:
+        """
+        Get the stage times, prompt positions computed vs reused, images encoded vs cached and the tokens generated of
+        a stopped request sent with timings, taken once. None if the engine kept none
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        llama_mico_lib = get_library()
+        json_ptr = ctypes.c_char_p()
+        ret = llama_mico_lib.llama_mico_get_timings(handle, request_id, ctypes.byref(json_ptr))
+        if ret != 0 or not json_ptr.value:
+            return None
+        return json.loads(json_ptr.value.decode("utf-8"))
+
+    def get_cache_digest(self, handle: ctypes.c_void_p) -> Dict[str, Any]:
+        """
+        Get the load, a bloom filter of the cached prompt blocks and the cached image keys, for a cache-aware router
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        llama_mico_lib = get_library()
+        json_ptr = ctypes.c_char_p()
+        ret = llama_mico_lib.llama_mico_get_cache_digest(handle, ctypes.byref(json_ptr))
+        if ret != 0 or not json_ptr.value:
+            err = f"Failed to get cache digest: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+        return json.loads(json_ptr.value.decode("utf-8"))
+
+    def get_request_digest(self, handle: ctypes.c_void_p, messages: List[Dict[str, Any]],
+                           tools: Optional[List[Dict[str, Any]]] = None) -> Dict[str, Any]:
+        """
+        Get the prompt block hashes and image keys of a request, to match against get_cache_digest of each instance
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        request_data = {"messages": [{k: v for k, v in msg.items() if v is not None} for msg in messages]}
+        if tools:
+            request_data["tools"] = tools
+        llama_mico_lib = get_library()
+        json_ptr = ctypes.c_char_p()
+        ret = llama_mico_lib.llama_mico_get_request_digest(
+            handle, json.dumps(request_data, ensure_ascii=False).encode("utf-8"), ctypes.byref(json_ptr))
+        if ret != 0 or not json_ptr.value:
+            err = f"Failed to get request digest: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+        return json.loads(json_ptr.value.decode("utf-8"))
+
+    @staticmethod
+    def digest_match(request_digest: Dict[str, Any], cache_digest: Dict[str, Any]) -> Dict[str, int]:
+        """
+        Leading prompt blocks of a request probably cached by an instance (bloom filter, rare false positives) and
+        its images with cached embeddings
+        """
+        mask = (1 << 64) - 1
+
+        def fmix64(k: int) -> int:
+            k ^= k >> 33
+            k = (k * 0xff51afd7ed558ccd) & mask
+            k ^= k >> 33
+            k = (k * 0xc4ceb9fe1a85ec53) & mask
+            return k ^ (k >> 33)
+
+        prefix = cache_digest["prefix"]
+        bloom = bytes.fromhex(prefix["bloom"])
+        n_bits = prefix["n_bits"]
+        n_blocks = 0
+        for block in request_digest["blocks"]:
+            h = int(block, 16)
+            step = fmix64(h) | 1
+            bits = [((h + j * step) & mask) % n_bits for j in range(prefix["n_hashes"])]
+            if not all(bloom[bit // 8] >> (bit % 8) & 1 for bit in bits):
+                break
+            n_blocks += 1
+        images = set(cache_digest["images"])
+        return {
+            "prefix_tokens": n_blocks * prefix["block"],
+            "images": sum(1 for key in request_digest["images"] if key in images)
+        }
+
+    def trace_start(self, handle: ctypes.c_void_p, n_events: int = 0):
+        """
+        Start recording scheduler thread events, n_events per thread (0 for the default)
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        llama_mico_lib = get_library()
+        ret = llama_mico_lib.llama_mico_trace_start(handle, n_events)
+        if ret != 0:
+            err = f"Failed to start trace: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+
+    def trace_dump(self, handle: ctypes.c_void_p, path: str):
+        """
+        Stop tracing and write a chrome://tracing / Perfetto json file
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        llama_mico_lib = get_library()
+        ret = llama_mico_lib.llama_mico_trace_dump(handle, path.encode("utf-8"))
+        if ret != 0:
+            err = f"Failed to dump trace to {path}: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+
+    def _release_modal_buffers(self, handle: ctypes.c_void_p, current_id: int):
+        """
+        Release the registered buffers of a request, the engine keeps them until the request is done
+        """
+        with self._counter_lock:
+            buffer_ids = self._active_modal_buffers.pop(current_id, None) or []
+        llama_mico_lib = get_library()
+        for buffer_id in buffer_ids:
+            llama_mico_lib.llama_mico_release_buffer(handle, buffer_id)
+
+    def _parse_content(
+            self,
+            content_ptr: ctypes.c_char_p) -> Union[str, List[Dict[str, Any]]]:
+        """
+        Parse LLaMA-MICO response content, the engine only returns complete UTF-8
+        """
+        if not content_ptr or not content_ptr.value:
+            return ""
+        return content_ptr.value.decode("utf-8", errors="replace")
 
     def _request_prompt(
             self, handle: ctypes.c_void_p,
@@ -144,13 +441,12 @@ class LlamaMico:
             handle, request_json_bytes, ctypes.byref(is_finished_ptr),
             ctypes.byref(content_ptr))
 
-        content = self._parse_content(content_ptr, current_id)
+        content = self._parse_content(content_ptr)
         # todo: Process the ret code uniformly
-        if ret == -1:
+        if ret in (-1, -3):  # -3: deadline_ms passed before the prompt was inferred
             err = f"Prompt request failed: {content}"
             logger.error(err)
-            with self._counter_lock:
-                self._active_modal_buffers.pop(current_id, None)
+            self._release_modal_buffers(handle, current_id)
             raise CoreNormalException(err)
 
         is_finished = is_finished_ptr.value
@@ -171,8 +467,7 @@ class LlamaMico:
 
         # logger.debug(
         #     f"Prompt request processed successfully, is_finished: {is_finished}, content: {content}")
-        with self._counter_lock:
-            self._active_modal_buffers.pop(current_id, None)
+        self._release_modal_buffers(handle, current_id)
         return response
 
     def _request_generate(
@@ -184,20 +479,27 @@ class LlamaMico:
         if not handle:
             raise InvalidArgException("handle cannot be empty")
 
-        request_json = json.dumps(request_data, ensure_ascii=False)
-        request_json_bytes = request_json.encode("utf-8")
+        chat_cmpl_id = str(request_data.get("id", "local-chatcmpl-0"))
+        request_id = int(chat_cmpl_id[len(self._CHAT_CMPL_PREFIX):]) \
+            if chat_cmpl_id.startswith(self._CHAT_CMPL_PREFIX) else 0
+        stop = 1 if request_data.get("stop") is True else 0
 
-        # Allocate output parameter pointers
+        # Written into a buffer of the calling thread, grown if a piece does not fit (the engine keeps it meanwhile)
+        buffer = getattr(self._thread_buffers, "generate", None)
+        if buffer is None:
+            buffer = self._thread_buffers.generate = ctypes.create_string_buffer(self._GENERATE_BUFFER_BYTES)
         is_finished_ptr = ctypes.c_int32()
-        content_ptr = ctypes.c_char_p()
-
+        n_written = ctypes.c_int32()
         llama_mico_lib = get_library()
-        ret = llama_mico_lib.llama_mico_request_generate(
-            handle, request_json_bytes, ctypes.byref(is_finished_ptr),
-            ctypes.byref(content_ptr))
+        while True:
+            ret = llama_mico_lib.llama_mico_request_generate_into(
+                handle, request_id, stop, ctypes.byref(is_finished_ptr), buffer, len(buffer),
+                ctypes.byref(n_written))
+            if ret != -4:
+                break
+            buffer = self._thread_buffers.generate = ctypes.create_string_buffer(n_written.value)
 
-        current_id = int(request_data["id"].split("-")[-1])
-        content = self._parse_content(content_ptr, current_id)
+        content = buffer.raw[:n_written.value].decode("utf-8", errors="replace")
         # todo: Process the ret code uniformly
         if ret == -1:
             err = f"Generate request failed: {content}"
@@ -226,24 +528,57 @@ class LlamaMico:
         #     f"Generate request processed successfully, is_finished: {is_finished}, content: {content}")
         return response
 
-    def chat_completion(
-        self,
-        handle: ctypes.c_void_p,
-        messages: List[Dict[str, Any]],
-        tools: List[Dict[str, Any]],
-        priority: int = 0,
-        temperature: float = -1.0,
-        stream: bool = False
-    ) -> Iterator[ChatCompletionResponse] | ChatCompletionResponse:
+    def pre_encode(self, handle: ctypes.c_void_p, image: bytes, content_id: Optional[str] = None, pool: int = 0):
         """
-        Chat completion interface - Simplified usage
+        Encode a frame into the embedding cache as it arrives, a later question on it skips the vision encoder. It is
+        cropped like a question frame, pool must match the pool the question uses for it
         """
         if not handle:
             raise InvalidArgException("handle cannot be empty")
+        rgb, width, height = ImageProcess.center_crop_to_rgb(image, self._HIGH_PROCESS_IMAGE_SIZE)
+        data = (ctypes.c_uint8 * len(rgb)).from_buffer_copy(rgb)
+        frame = LlamaMicoModalBuffer(data=ctypes.cast(data, ctypes.POINTER(ctypes.c_uint8)), size=len(rgb),
+                                     format=self._MODAL_RGB, nx=width, ny=height, pool=pool)
+        ret = get_library().llama_mico_pre_encode(
+            handle, ctypes.byref(frame), content_id.encode("utf-8") if content_id else None)
+        if ret != 0:
+            err = f"Failed to encode a frame ahead: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
 
-        if not messages:
-            raise InvalidArgException("Message list cannot be empty")
+    def embed(self, handle: ctypes.c_void_p, text: Optional[str] = None, image: Optional[bytes] = None,
+              pool: int = 0) -> List[float]:
+        """
+        L2 normalised pooled embedding of a text (prefilled, final hidden states) or of an image (encoded, projector
+        outputs) with the loaded model, exactly one of them. Text and image vectors are in different spaces
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+        if (text is None) == (image is None):
+            raise InvalidArgException("exactly one of text and image is needed")
+        frame = None
+        if image is not None:
+            rgb, width, height = ImageProcess.center_crop_to_rgb(image, self._HIGH_PROCESS_IMAGE_SIZE)
+            data = (ctypes.c_uint8 * len(rgb)).from_buffer_copy(rgb)
+            frame = LlamaMicoModalBuffer(data=ctypes.cast(data, ctypes.POINTER(ctypes.c_uint8)), size=len(rgb),
+                                         format=self._MODAL_RGB, nx=width, ny=height, pool=pool)
+        n_embd_max = self._EMBED_MAX_DIM
+        embd = (ctypes.c_float * n_embd_max)()
+        n_embd = ctypes.c_int32(0)
+        ret = get_library().llama_mico_embed(
+            handle, text.encode("utf-8") if text is not None else None,
+            ctypes.byref(frame) if frame is not None else None, embd, n_embd_max, ctypes.byref(n_embd))
+        if ret != 0:
+            err = f"Failed to embed: {ret}"
+            logger.warning(err)
+            raise CoreNormalException(err)
+        return list(embd[:n_embd.value])
 
+    def _prepare_modal_frames(self, handle: ctypes.c_void_p, messages: List[Dict[str, Any]]):
+        """
+        Frames of messages written into engine-owned buffers, the modal_prts of the request and the buffer ids to
+        release once it is done
+        """
         # Handle None values in message list
         for msg in messages:
             keys_to_remove = []
@@ -253,7 +588,7 @@ class LlamaMico:
             for key in keys_to_remove:
                 msg.pop(key, None)
 
-        modal_bytes = []
+        modal_frames = []
         for msg in messages:
             content = msg.get("content", None)
             if content:
@@ -263,31 +598,99 @@ class LlamaMico:
                 msg["content"], bytes_list = self.mico_content_util.mutilmodal_message_to_bytes(
                     msg["content"])
                 for ide, bytes_item in enumerate(bytes_list):
-                    # Default to JPEG for now
-                    bytes_item = ImageProcess.center_crop_to_size(
-                        bytes_item, self._HIGH_PROCESS_IMAGE_SIZE)  # Crop to high precision size
+                    if isinstance(bytes_item, dict):  # frame ring frame, decoded and cropped by the ingest
+                        modal_frames.append(bytes_item)
+                        continue
                     # Process frames that are not at the start or end of video segments
-                    if (ide % self._VIDEO_CONTINUOUS_FRAMES_NUM != 0 and
-                            ide % self._VIDEO_CONTINUOUS_FRAMES_NUM !=
-                            self._VIDEO_CONTINUOUS_FRAMES_NUM - 1):
-                        bytes_item = ImageProcess.resize_low_precision(
-                            bytes_item,
-                            self._LOW_PROCESS_IMAGE_SIZE)  # Compress to low precision size
+                    low_precision = (ide % self._VIDEO_CONTINUOUS_FRAMES_NUM != 0 and
+                                     ide % self._VIDEO_CONTINUOUS_FRAMES_NUM !=
+                                     self._VIDEO_CONTINUOUS_FRAMES_NUM - 1)
+                    # Crop to high precision size, kept as raw RGB so the engine does not decode it again, low
+                    # precision frames are pooled to fewer vision tokens by the engine
+                    rgb, width, height = ImageProcess.center_crop_to_rgb(bytes_item, self._HIGH_PROCESS_IMAGE_SIZE)
+                    modal_frames.append((rgb, width, height, self._LOW_PRECISION_POOL if low_precision else 0))
+
+        # Frames are written once into engine-owned buffers, requests refer to them by id
+        address_list = []
+        buffer_ids = []
+        llama_mico_lib = get_library()
+        try:
+            for frame in modal_frames:
+                if isinstance(frame, dict):
+                    address_list.append(frame)
+                    continue
+                rgb, width, height, pool = frame
+                data = ctypes.POINTER(ctypes.c_uint8)()
+                buffer_id = ctypes.c_int32()
+                ret = llama_mico_lib.llama_mico_register_buffer(
+                    handle, len(rgb), self._MODAL_RGB, width, height, ctypes.byref(data), ctypes.byref(buffer_id))
+                if ret != 0:
+                    raise CoreNormalException(f"Failed to register a modal buffer of {len(rgb)} bytes")
+                buffer_ids.append(buffer_id.value)
+                ctypes.memmove(data, rgb, len(rgb))
+                address_list.append({"buffer": buffer_id.value, "pool": pool})
+        except Exception:
+            for buffer_id in buffer_ids:
+                llama_mico_lib.llama_mico_release_buffer(handle, buffer_id)
+            raise
+        return address_list, buffer_ids
+
+    def chat_completion(
+        self,
+        handle: ctypes.c_void_p,
+        messages: List[Dict[str, Any]],
+        tools: List[Dict[str, Any]],
+        priority: int = 0,
+        temperature: float = -1.0,
+        stream: bool = False,
+        cache_prefix: int = 0,
+        session: str = "",
+        stop_strings: Optional[List[str]] = None,
+        cache_pin: bool = False,
+        max_tokens: int = 0,
+        deadline_ms: int = 0,
+        vision_pool: int = 1,
+        image_max_side: int = 0,
+        image_min_side: int = 0,
+        lora: str = "",
+        video_session: str = "",
+        presence_penalty: Optional[float] = None,
+        frequency_penalty: Optional[float] = None,
+        n: int = 1,
+        timings: bool = False
+    ) -> Iterator[ChatCompletionResponse] | ChatCompletionResponse:
+        """
+        Chat completion interface - Simplified usage
+        cache_prefix: leading messages (and tools) kept as a shared kv prefix, 0 caches the whole prompt
+        session: multi-turn session id, its kv stays cached until release_session or eviction
+        cache_pin: the cached prefix is never evicted by other prompts, up to cache_pin_max pinned prefixes
+        stop_strings: generation ends before the first one, matched in the engine and not returned
+        max_tokens: the engine retires the request after this many tokens, 0 for no limit
+        deadline_ms: the prompt is dropped if not inferred within it and the request fails, 0 for none
+        vision_pool: vision tokens of each image averaged over vision_pool x vision_pool cells, 1 keeps them all
+        image_max_side: longest image side fed to the encoder, 0 for the input size
+        image_min_side: the engine lowers image_max_side down to it as the encoder queue grows, 0 keeps image_max_side
+        lora: name of a LoRA adapter of lora_adapters, empty for the base model
+        video_session: live video id, frames already appended with video_append are not prefilled again
+        presence_penalty, frequency_penalty: OpenAI logit penalties of generated tokens, None keeps the engine default
+        n: choices generated from one prefill of the prompt, non-streaming only
+        timings: the response (the last chunk of a stream) gets the stage times and cache use of the request
+        """
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
 
-                    modal_bytes.append(bytes_item)
+        if not messages:
+            raise InvalidArgException("Message list cannot be empty")
 
-        # Convert modal_bytes to C language memory address list char*
-        address_list = []
-        buffers = []
-        for single_bytes in modal_bytes:
-            arr = np.frombuffer(single_bytes, dtype=np.uint8).copy()
-            address_list.append({str(int(arr.ctypes.data)): arr.nbytes})
-            buffers.append(arr)
+        if n < 1 or (n > 1 and (stream or session or video_session)):
+            raise InvalidArgException("n must be 1 with stream, session or video_session")
+
+        address_list, buffer_ids = self._prepare_modal_frames(handle, messages)
 
         with self._counter_lock:
             current_id = self.request_id_counter
-            self.request_id_counter += 1
-            self._active_modal_buffers[current_id] = buffers  # Keep memory alive during C++ runtime
+            self.request_id_counter += n  # NOTE: choice i is request current_id + i in the engine
+            self._active_modal_buffers[current_id] = buffer_ids
 
         # ======================= request_data ======================= #
         request_data = {
@@ -297,71 +700,127 @@ class LlamaMico:
             "stop": False,
             "modal_prts": address_list,
             "priority": priority,
-            "temperature": temperature
+            "temperature": temperature,
+            "cache_prefix": cache_prefix,
+            "session": session,
+            "cache_pin": cache_pin,
+            "stop_strings": stop_strings or [],
+            "max_tokens": max_tokens,
+            "deadline_ms": deadline_ms,
+            "vision_pool": vision_pool,
+            "image_max_side": image_max_side,
+            "image_min_side": image_min_side,
+            "lora": lora,
+            "video_session": video_session,
+            "timings": timings
         }
+        if presence_penalty is not None:
+            request_data["presence_penalty"] = presence_penalty
+        if frequency_penalty is not None:
+            request_data["frequency_penalty"] = frequency_penalty
         # ======================= request_data ======================= #
 
         try:
             if stream:
                 # Streaming output mode
                 return self._stream_chat_completion(handle, request_data)
+            elif n > 1:
+                return self._non_stream_chat_completion_n(handle, request_data, n)
             else:
                 # Non-streaming output mode
                 return self._non_stream_chat_completion(handle, request_data)
         except Exception as e:
-            with contextlib.suppress(Exception):
-                self._request_generate(handle, {
-                    "id": request_data["id"],
-                    "stop": True
-                })
+            for choice_id in range(current_id, current_id + n):
+                with contextlib.suppress(Exception):
+                    self._request_generate(handle, {
+                        "id": f"local-chatcmpl-{choice_id}",
+                        "stop": True
+                    })
             raise e
-        finally:
-            self._byte_buffers.pop(current_id, None)
 
     def _stream_chat_completion(
             self, handle: ctypes.c_void_p,
             request_data: Dict[str, Any]) -> Iterator[ChatCompletionResponse]:
         """
-        Streaming chat completion
+        Streaming chat completion, the engine writes the text into a ring that is read in bulk, so there is one call
+        per batch of tokens and the wait for them runs without the GIL
         """
-        request_generate_data = {
-            "id": request_data["id"],
-            "stop": request_data["stop"]
-        }
+        if not handle:
+            raise InvalidArgException("handle cannot be empty")
+
+        current_id = int(request_data["id"].split("-")[-1])
+        request_json_bytes = json.dumps(request_data, ensure_ascii=False).encode("utf-8")
+        llama_mico_lib = get_library()
+        stream = ctypes.c_void_p()
+        ret = llama_mico_lib.llama_mico_stream_open(handle, request_json_bytes, 0, ctypes.byref(stream))
+        self._release_modal_buffers(handle, current_id)  # NOTE: the request keeps them until it is done
+        if ret != 0:
+            err = f"Prompt request failed: {ret}"
+            logger.error(err)
+            raise CoreNormalException(err)
+
+        buffer = ctypes.create_string_buffer(self._STREAM_READ_BYTES)
+        n_read = ctypes.c_int32()
+        is_finished_ptr = ctypes.c_int32()
+        decoder = codecs.getincrementaldecoder("utf-8")(errors="replace")  # a full buffer may split utf8
         # Accumulate content to detect tool calls
         accumulated_content = ""
         tool_use_detected = False
         tool_wait = False
         first = True
+        response = None
+        abandoned = True  # the consumer stopped iterating or it raised
 
-        while True:
-            if first:
-                response = self._request_prompt(handle, request_data)
+        try:
+            while True:
+                ret = llama_mico_lib.llama_mico_stream_read(
+                    stream, buffer, self._STREAM_READ_BYTES, self._STREAM_WAIT_MS, ctypes.byref(n_read),
+                    ctypes.byref(is_finished_ptr))
+                is_finished = is_finished_ptr.value
+                current_token = decoder.decode(buffer.raw[:n_read.value], final=bool(is_finished))
+                if ret in (-1, -3):
+                    err = f"Generate request failed: {current_token}"
+                    logger.error(err)
+                    raise CoreNormalException(err)
+                if not current_token and not is_finished:
+                    continue
+
+                finish_reason = FinishReason.STOP if is_finished else None
+                finish_reason = FinishReason.LENGTH if is_finished and ret == -2 else finish_reason
+                if finish_reason == FinishReason.LENGTH:
+                    logger.error("Generate tokens too long")
+                delta = ChatMessage(role=Role.ASSISTANT, content=current_token) if first else ChatMessage(
+                    content=current_token)
                 first = False
-            else:
-                response = self._request_generate(handle,
-                                                  request_generate_data)
-
-            response.object = "chat.completion.chunk"
-            current_token = response.choices[0].delta.content
-            accumulated_content += current_token
-
-            tool_wait, tool_use_detected, accumulated_content, res = self.mico_content_util.process_tool_calls(
-                tool_wait, tool_use_detected, accumulated_content)
-
-            if isinstance(res, ChatCompletionResponse):
-                response.choices[0].delta = res.choices[0].message
-                response.choices[0].finish_reason = res.choices[
-                    0].finish_reason
-                yield response
-            elif isinstance(res, str):
-                response.choices[0].delta.content = res
-                yield response
-
-            if response.choices[0].finish_reason is not None:
-                break
-            # Add small delay to avoid too frequent requests
-            time.sleep(0.001)
+                response = ChatCompletionResponse(
+                    id=request_data.get("id", "local-chatcmpl-0"),
+                    object="chat.completion.chunk",
+                    created=int(time.time()),
+                    choices=[ChatCompletionChoice(index=0, delta=delta, finish_reason=finish_reason)])
+                if is_finished and request_data.get("timings"):  # NOTE: the engine stopped the request before
+                    response.timings = self.get_timings(handle, current_id)
+                accumulated_content += current_token
+
+                tool_wait, tool_use_detected, accumulated_content, res = self.mico_content_util.process_tool_calls(
+                    tool_wait, tool_use_detected, accumulated_content)
+
+                if isinstance(res, ChatCompletionResponse):
+                    response.choices[0].delta = res.choices[0].message
+                    response.choices[0].finish_reason = res.choices[
+                        0].finish_reason
+                    yield response
+                elif isinstance(res, str):
+                    response.choices[0].delta.content = res
+                    yield response
+
+                if response.choices[0].finish_reason is not None:
+                    abandoned = False
+                    break
+        finally:
+            # Stops a request ended early, e.g. by a complete tool call, an abandoned one drops its prompt work too
+            if abandoned:
+                llama_mico_lib.llama_mico_cancel(handle, current_id)
+            llama_mico_lib.llama_mico_stream_close(stream)
 
         # Exceeded generation length
         if response.choices[0].finish_reason is None or response.choices[0].finish_reason is FinishReason.LENGTH:
@@ -370,15 +829,6 @@ class LlamaMico:
 
             yield response
 
-        # Add stop signal for non-stop endings
-        if response.choices[0].finish_reason is FinishReason.TOOL_CALL:
-            logger.debug("Actively stopping seq %s", request_data["id"])
-            with contextlib.suppress(Exception):
-                self._request_generate(handle, {
-                    "id": request_data["id"],
-                    "stop": True
-                })
-
     def _non_stream_chat_completion(
             self, handle: ctypes.c_void_p,
             request_data: Dict[str, Any]) -> ChatCompletionResponse:
@@ -439,9 +889,60 @@ class LlamaMico:
                     "id": request_data["id"],
                     "stop": True
                 })
+        if request_data.get("timings"):
+            response.timings = self.get_timings(handle, int(request_data["id"].split("-")[-1]))
 
         return response
 
+    def _non_stream_chat_completion_n(
+            self, handle: ctypes.c_void_p,
+            request_data: Dict[str, Any], n: int) -> ChatCompletionResponse:
+        """
+        Non-streaming chat completion of n choices, the engine prefills the prompt once and decodes the choices
+        together. They are read in turns, a choice not read falls behind the decode loop lookahead and stalls
+        """
+        current_id = int(request_data["id"].split("-")[-1])
+        is_finished = (ctypes.c_int32 * n)()
+        contents = (ctypes.c_char_p * n)()
+        llama_mico_lib = get_library()
+        ret = llama_mico_lib.llama_mico_request_prompt_n(
+            handle, json.dumps(request_data, ensure_ascii=False).encode("utf-8"), n, is_finished, contents)
+        self._release_modal_buffers(handle, current_id)
+        if ret != 0:  # NOTE: the caller stops the choices that did start
+            err = f"Prompt request failed: {ret}"
+            logger.error(err)
+            raise CoreNormalException(err)
+
+        choices = []
+        tool_states = []  # tool_wait, tool_use_detected, accumulated_content of each choice
+        for i in range(n):
+            content = contents[i].decode("utf-8", errors="replace") if contents[i] else ""
+            choices.append(ChatCompletionChoice(index=i, message=ChatMessage(role=Role.ASSISTANT, content=content),
+                                                finish_reason=FinishReason.STOP if is_finished[i] else None))
+            tool_states.append([False, False, ""])
+        while any(choice.finish_reason is None for choice in choices):
+            for i, choice in enumerate(choices):
+                if choice.finish_reason is not None:
+                    continue
+                generate_response = self._request_generate(handle, {"id": f"local-chatcmpl-{current_id + i}"})
+                choice.finish_reason = generate_response.choices[0].finish_reason
+                tool_states[i][2] += generate_response.choices[0].delta.content
+                tool_wait, tool_use_detected, accumulated_content, res = self.mico_content_util.process_tool_calls(
+                    *tool_states[i])
+                tool_states[i] = [tool_wait, tool_use_detected, accumulated_content]
+                if isinstance(res, ChatCompletionResponse):
+                    choice.message.content += res.choices[0].message.content
+                    choice.message.tool_calls = res.choices[0].message.tool_calls
+                    choice.finish_reason = res.choices[0].finish_reason
+                elif isinstance(res, str):
+                    choice.message.content += res
+        for i, choice in enumerate(choices):
+            if choice.finish_reason is FinishReason.TOOL_CALL:  # stopped before the engine ended it
+                with contextlib.suppress(Exception):
+                    self._request_generate(handle, {"id": f"local-chatcmpl-{current_id + i}", "stop": True})
+        return ChatCompletionResponse(id=request_data["id"], object="chat.completion", created=int(time.time()),
+                                      choices=choices)
+
 
 # Global instance
 llama_mico = LlamaMico()
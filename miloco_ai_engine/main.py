@@ -179,6 +179,12 @@ async def unload_model(model_name: str):
     await model_manager.auto_unload_model(model_name)
 
 
+@app.post("/models/swap")
+async def swap_model(model_name: str, model_path: str, mmproj_path: Optional[str] = None):
+    """Swap the weights of a loaded model without dropping requests or sessions"""
+    await model_manager.swap_model(model_name, model_path, mmproj_path)
+
+
 @app.get("/cuda_info", response_model=VramUsage)
 async def get_cuda_info():
     """Get CUDA information"""
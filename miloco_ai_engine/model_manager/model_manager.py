@@ -2,7 +2,7 @@
 from enum import Enum
 from thespian.actors import ActorAddress
 import asyncio
-from typing import Dict, AsyncGenerator, List
+from typing import Dict, AsyncGenerator, List, Optional
 from collections import deque
 from miloco_ai_engine.config.config import MODELS_CONFIG
 from miloco_ai_engine.model_manager.model_wrapper import ModelWrapper
@@ -95,6 +95,27 @@ class ModelManager():
         """
         await self._unload_model(model_name)
 
+    async def swap_model(self, model_name: str, model_path: str, mmproj_path: Optional[str] = None):
+        """
+        Swap the weights of a loaded model, requests keep being served and its cached sessions move along
+        """
+        if model_name not in self.loaded_models:
+            raise ModelManagerException(f"Model not loaded: {model_name}")
+
+        update = {"model_path": model_path}
+        if mmproj_path:
+            update["mmproj_path"] = mmproj_path
+        model_config = self.model_configs[model_name].model_copy(update=update)
+        logger.info("Swapping model %s to %s", model_name, model_path)
+        future: asyncio.Future = actor_system.ask(
+            self.models[model_name],
+            RequestMessage(action=ModelAction.SWAP, data=model_config))
+        future = self._mirror_future_to_loop(future, asyncio.get_running_loop())
+        result_message: ResultMessage = await future  # NOTE: no timeout, the new weights load while serving
+        if not result_message.result:
+            raise ModelSchedulerException(result_message.error)
+        self.model_configs[model_name] = model_config
+
     def model_list(self) -> List[str]:
         """
         Get model list
@@ -8,7 +8,7 @@ import time
 from thespian.actors import Actor, ActorAddress
 from miloco_ai_engine.config.config_info import ModelConfig
 from miloco_ai_engine.core_python.llama_mico import llama_mico
-from typing import AsyncGenerator, Dict
+from typing import AsyncGenerator, Dict, Optional
 from miloco_ai_engine.schema.models_schema import ChatCompletionRequest, ChatCompletionResponse, StreamErrorChunkMessage, StreamErrorChunk
 from miloco_ai_engine.schema.actor_message import actor_system, ModelAction, ModelActorResponse, RequestMessage, ResultMessage, CallbackMessage
 from miloco_ai_engine.task_scheduler.model_scheduler import TaskScheduler, TaskSchedulerAction
@@ -78,6 +78,11 @@ class ModelWrapper(Actor):
         elif msg.action == ModelAction.CHAT_RESPONSE:
             self._handle_chat_response(msg.data)  # Write response data
 
+        elif msg.action == ModelAction.SWAP:
+            future = asyncio.Future()
+            self.send(sender, future)
+            asyncio.create_task(self._handle_swap(msg.data, future))  # Non-blocking swap, the old model keeps serving
+
         else:
             logger.error("Unknown model action: %s", msg.action)
 
@@ -146,6 +151,31 @@ class ModelWrapper(Actor):
         logger.info("Model %s unloaded", self.model_name)
         return ResultMessage(result=True, error="", data={})
 
+    async def _handle_swap(self, model_config: ModelConfig, future: asyncio.Future):
+        """
+        Swap the model weights, requests keep running on the old handle until the new one is ready
+        """
+        if self.status == ModelStatus.NOT_LOAD or not self.handle:
+            future.set_result(ResultMessage(result=False, error=f"Model {self.model_name} not loaded", data={}))
+            return
+        if not self._model_path_valid(model_config):
+            future.set_result(ResultMessage(result=False, error="Invalid model path", data={}))
+            return
+
+        try:
+            new_handle = await asyncio.to_thread(llama_mico.swap_model, self.handle, model_config.to_dict())
+            actor_system.tell(
+                self.task_scheduler,
+                RequestMessage(action=TaskSchedulerAction.SWAP_HANDLE,
+                               data=new_handle))
+            self.handle = new_handle  # NOTE: the task scheduler frees the old handle once drained
+            self.model_config = model_config
+            self.last_used = time.time()
+            future.set_result(ResultMessage(result=True, error="", data={}))
+        except Exception as e:  # pylint: disable=broad-except
+            logger.error("Model %s swap failed: %s", self.model_name, e)
+            future.set_result(ResultMessage(result=False, error=str(e), data={}))
+
     async def _handle_chat(self, data: ChatCompletionRequest,
                            future: asyncio.Future):
         """
@@ -164,7 +194,7 @@ class ModelWrapper(Actor):
         self.use_count += 1
 
         request_id = str(uuid.uuid4())
-        data.max_tokens = self.model_config.context_per_seq
+        data.max_tokens = min(data.max_tokens or self.model_config.context_per_seq, self.model_config.context_per_seq)
 
         self.request_task[request_id] = asyncio.Queue(maxsize=1)
         self.request_loop[request_id] = asyncio.get_running_loop()
@@ -217,9 +247,9 @@ class ModelWrapper(Actor):
         self.use_count += 1
 
         request_id = str(uuid.uuid4())
-        data.max_tokens = self.model_config.context_per_seq
+        data.max_tokens = min(data.max_tokens or self.model_config.context_per_seq, self.model_config.context_per_seq)
 
-        self.request_task[request_id] = asyncio.Queue(maxsize=data.max_tokens)
+        self.request_task[request_id] = asyncio.Queue(maxsize=data.max_tokens + 1)
         self.request_loop[request_id] = asyncio.get_running_loop()
         queue = self.request_task[request_id]
 
@@ -236,7 +266,7 @@ class ModelWrapper(Actor):
         async def stream_response(
         ) -> AsyncGenerator[ChatCompletionResponse, None]:
             try:
-                for _ in range(data.max_tokens):
+                for _ in range(data.max_tokens + 1):  # the last chunk only carries the finish reason
                     response: ChatCompletionResponse = await asyncio.wait_for(
                         queue.get(), timeout=self.MODEL_REQUER_TIMEOUT)
                     yield response
@@ -290,20 +320,21 @@ class ModelWrapper(Actor):
         elif queue and not loop:
             queue.put_nowait(message.response)
 
-    def _model_path_valid(self) -> bool:
+    def _model_path_valid(self, model_config: Optional[ModelConfig] = None) -> bool:
         """
         Check if model path is valid
         """
-        if not self.model_config.model_path:
+        model_config = model_config or self.model_config
+        if not model_config.model_path:
             logger.error("Model %s path not set", self.model_name)
             return False
 
-        if not os.path.exists(self.model_config.model_path) or not os.path.isfile(self.model_config.model_path):
-            logger.error("Model %s file not exists", self.model_config.model_path)
+        if not os.path.exists(model_config.model_path) or not os.path.isfile(model_config.model_path):
+            logger.error("Model %s file not exists", model_config.model_path)
             return False
-        if self.model_config.mmproj_path and not (
-            os.path.exists(self.model_config.mmproj_path) and os.path.isfile(self.model_config.mmproj_path)):
-            logger.error("Model %s mmproj file not exists", self.model_config.mmproj_path)
+        if model_config.mmproj_path and not (
+            os.path.exists(model_config.mmproj_path) and os.path.isfile(model_config.mmproj_path)):
+            logger.error("Model %s mmproj file not exists", model_config.mmproj_path)
             return False
 
         return True
@@ -24,6 +24,7 @@ class TaskSchedulerAction(Enum):
     STOP = "stop"
     CLEANUP = "cleanup"
     SUBMIT_TASK = "submit_task"
+    SWAP_HANDLE = "swap_handle"  # New requests go to the new handle, the old one is freed once drained
 
 
 class ModelAction(Enum):
@@ -35,6 +36,7 @@ class ModelAction(Enum):
     GET_STATUS = "get_status"  # Get status
     CLEANUP = "cleanup"  # Cleanup
     CHAT_RESPONSE = "chat_response"  # Chat response
+    SWAP = "swap"  # Swap the model weights while serving
 
 Action = Union[TaskAction, TaskSchedulerAction, ModelAction]
 
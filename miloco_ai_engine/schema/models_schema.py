@@ -103,6 +103,7 @@ class ChatCompletionResponse(BaseModel):
     model: str = Field(default="default", description="Model name")
     choices: List[ChatCompletionChoice] = Field(..., description="Choices")
     usage: Optional[Dict[str, int]] = Field(None, description="Token usage")
+    timings: Optional[Dict[str, Any]] = Field(None, description="Stage times and cache use, if requested")
 
 class ChatCompletionRequest(BaseModel):
     """Chat completion request model"""
@@ -113,6 +114,7 @@ class ChatCompletionRequest(BaseModel):
     top_p: Optional[float] = Field(default=1.0, le=1.0)
     top_k: Optional[int] = Field(default=40)
     max_tokens: Optional[int] = Field(default=2048, ge=1)
+    n: Optional[int] = Field(default=1, ge=1, description="Choices, one prefill of the prompt, non-streaming only")
     stop: Optional[Union[str, List[str]]] = None
     stream: Optional[bool] = False
     presence_penalty: Optional[float] = Field(default=0.0, ge=-2.0, le=2.0)
@@ -120,6 +122,7 @@ class ChatCompletionRequest(BaseModel):
     logit_bias: Optional[Dict[str, float]] = None
     user: Optional[str] = None
     seed: Optional[int] = None
+    timings: Optional[bool] = Field(default=False, description="Adds stage times and cache use to the response")
 
 class ModelInfo(BaseModel):
     """Model information model"""
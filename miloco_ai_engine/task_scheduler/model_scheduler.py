@@ -14,6 +14,7 @@ from miloco_ai_engine.schema.models_schema import ChatCompletionRequest, Content
 import asyncio
 from miloco_ai_engine.task_scheduler.scheduler_task import Task
 from miloco_ai_engine.utils.prompt_matcher import PromptMatcher
+from miloco_ai_engine.core_python.llama_mico import llama_mico
 from miloco_ai_engine.middleware.exceptions import ModelSchedulerException
 import time
 from concurrent.futures import Future
@@ -26,12 +27,15 @@ class TaskScheduler(Actor):
     """Task Scheduler"""
 
     _MAX_IDLE_TIME = 10 * 60  # Thread idle time 10 minutes
+    _DRAIN_POLL_TIME = 0.5  # Check interval of a swapped out handle still running tasks
     # _DEFAULT_WORKER_COUNT = 10  # Default number of threads
 
     def __init__(self, _model_name: str, model_config: ModelConfig):
         super().__init__()
         # Mapping from task ID to task
         self.tasks: Dict[str, ActorAddress] = {}
+        # Mapping from task ID to the handle it runs on, a swapped out handle is freed once no task refers to it
+        self.task_handles: Dict[str, int] = {}
 
         # model_config cannot be transferred properly during Actor init
         self.model_config = model_config
@@ -71,6 +75,9 @@ class TaskScheduler(Actor):
         elif msg.action == TaskSchedulerAction.CLEANUP:
             self._cleanup()
 
+        elif msg.action == TaskSchedulerAction.SWAP_HANDLE:
+            self._swap_handle(msg.data)
+
         else:
             logger.error("Unknown task scheduler action: %s", msg.action)
 
@@ -113,6 +120,25 @@ class TaskScheduler(Actor):
 
         logger.info("Task scheduler %s stopped", self.model_config.model_name)
 
+    def _swap_handle(self, handle):
+        """
+        Submit new tasks to handle, the old handle is freed once its tasks are done
+        """
+        if not self.running:
+            return
+        old_handle, self.handle = self.handle, handle
+        threading.Thread(target=self._drain_handle, name="HandleDrain", args=(old_handle, ), daemon=True).start()
+        logger.info("Task scheduler %s swapped to handle %s", self.model_config.model_name, handle)
+
+    def _drain_handle(self, handle):
+        """
+        Free a swapped out handle once no task runs on it
+        """
+        while handle in list(self.task_handles.values()):
+            time.sleep(self._DRAIN_POLL_TIME)
+        llama_mico.cleanup(handle)
+        logger.info("Task scheduler %s freed the swapped out handle %s", self.model_config.model_name, handle)
+
     def _create_worker_loop(self, worker_name: str):
         """
         Manage event loop
@@ -152,6 +178,7 @@ class TaskScheduler(Actor):
             last_task_time = time.time()
             task = self.tasks.get(task_id)
             if not task:
+                self.task_handles.pop(task_id, None)
                 continue
 
             future: Future = actor_system.ask(
@@ -170,6 +197,7 @@ class TaskScheduler(Actor):
                     "Worker thread %s failed to get task response: %s %s", worker_name, task_id, e)
             finally:
                 self.tasks.pop(task_id, None)
+                self.task_handles.pop(task_id, None)
 
     def _create_worker(self, worker_name: str):
         """
@@ -218,10 +246,13 @@ class TaskScheduler(Actor):
             lambda: Task(task_id, task_label, self.handle, self.myAddress, request, message
                          .call_back_message, task_priority))
         self.tasks[task_id] = task
+        self.task_handles[task_id] = self.handle
 
         try:
             self.task_queue.put_nowait((-task_priority, task_id))
         except Exception as exc: # pylint: disable=broad-exception-caught
+            self.tasks.pop(task_id, None)
+            self.task_handles.pop(task_id, None)
             logger.error("Task %s-%s queue full, submit failed: %s", task_id, task_label, exc)
             raise ModelSchedulerException(f"Task queue full, submit failed: {str(exc)}") from exc
 
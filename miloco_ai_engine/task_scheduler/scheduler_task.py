@@ -177,6 +177,26 @@ class Task(Actor):
         else:
             res["temperature"] = -1.0
 
+        if self.task_info.request.max_tokens:
+            res["max_tokens"] = self.task_info.request.max_tokens
+
+        if self.task_info.request.presence_penalty:
+            res["presence_penalty"] = self.task_info.request.presence_penalty
+        if self.task_info.request.frequency_penalty:
+            res["frequency_penalty"] = self.task_info.request.frequency_penalty
+        if self.task_info.request.n and self.task_info.request.n > 1:
+            res["n"] = self.task_info.request.n
+        if self.task_info.request.timings:
+            res["timings"] = True
+
+        stop = self.task_info.request.stop
+        if stop:
+            res["stop_strings"] = [stop] if isinstance(stop, str) else list(stop)
+
+        # Leading system prompt (with tools) is shared by the rule prompts, cache it on its own
+        if res["messages"] and res["messages"][0].get("role") == "system":
+            res["cache_prefix"] = 1
+
         return res
 
     def _generate_chat_fail_response(self,
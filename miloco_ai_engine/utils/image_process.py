@@ -3,7 +3,7 @@
 
 """Image processing utilities."""
 from io import BytesIO
-from typing import Tuple
+from typing import Optional, Tuple
 from PIL import Image
 from miloco_ai_engine.middleware.exceptions import InvalidArgException
 
@@ -187,3 +187,47 @@ class ImageProcess:
                     )
 
                 return out.getvalue()
+
+    @staticmethod
+    def center_crop_to_rgb(
+        image_data: bytes,
+        target_size: Tuple[int, int],
+        low_size: Optional[Tuple[int, int]] = None,
+    ) -> Tuple[bytes, int, int]:
+        """
+        Center crop and resize like center_crop_to_size, optionally resized again to low_size, returned as packed
+        RGB24 bytes with (width, height), no codec round trip.
+        """
+        target_width, target_height = target_size
+        target_ratio = target_width / float(target_height)
+
+        with BytesIO(image_data) as bio:
+            with Image.open(bio) as img:
+                # Correct orientation
+                try:
+                    img = Image.Image.transpose(img, Image.Transpose.EXIF)
+                except Exception: # pylint: disable=broad-exception-caught
+                    pass
+
+                src_width, src_height = img.width, img.height
+                if src_width == 0 or src_height == 0:
+                    raise InvalidArgException(
+                        "Invalid image size: width/height is zero")
+
+                if src_width / float(src_height) > target_ratio:
+                    new_width = int(round(src_height * target_ratio))
+                    new_height = src_height
+                else:
+                    new_width = src_width
+                    new_height = int(round(src_width / target_ratio))
+
+                left = int(round((src_width - new_width) / 2))
+                top = int(round((src_height - new_height) / 2))
+                cropped = img.crop((left, top, left + new_width, top + new_height))
+
+                resized = cropped.resize((target_width, target_height), Image.Resampling.LANCZOS)
+                if low_size is not None:
+                    resized = resized.resize(low_size, Image.Resampling.LANCZOS)
+
+                rgb = resized.convert("RGB")
+                return rgb.tobytes(), rgb.width, rgb.height
@@ -15,6 +15,9 @@ import uuid
 import logging
 logger = logging.getLogger(__name__)
 
+# Camera frame in the shared memory frame ring of the ingest, miloco-frame://<camera>/<seq>
+FRAME_RING_URL_PREFIX = "miloco-frame://"
+
 # TODO: only support qwen, should use model config
 QWEN_TOOL_CALL_START = "<tool_call>"
 QWEN_TOOL_CALL_END = "</tool_call>"
@@ -114,7 +117,7 @@ class MicoContentUtil:
                     continue
 
                 url: str = item["image_url"].get("url", "")
-                if url.startswith("data:image/"):  # base64
+                if url.startswith("data:image/") or url.startswith(FRAME_RING_URL_PREFIX):  # base64 or frame ring
                     image_item = {"type": "image", "image": url}
                     processed_content.append(image_item)
                 elif url.startswith("http"):  # http resource
@@ -148,9 +151,10 @@ class MicoContentUtil:
 
     def mutilmodal_message_to_bytes(
         self,
-        content: List[Dict[str, Any]]) -> tuple[List[Dict[str, Any]], List[bytes]]:
+        content: List[Dict[str, Any]]) -> tuple[List[Dict[str, Any]], List[Union[bytes, Dict[str, Any]]]]:
         """
-        Convert base64-encoded multimodal messages to byte streams
+        Convert base64-encoded multimodal messages to byte streams, frame ring images become
+        {"camera": name, "seq": n} read by the engine in place
         """
         if not isinstance(content, list):
             raise CoreResponeException("Invalid content information type")
@@ -167,6 +171,11 @@ class MicoContentUtil:
                 if "image" not in item or not isinstance(item["image"], str):
                     logger.warning("Invalid content information type")
                     continue
+                frame = self._frame_ref(item["image"])
+                if frame is not None:
+                    bytes_list.append(frame)
+                    item["image"] = FRAME_RING_URL_PREFIX
+                    continue
                 tables = item["image"].split(base64_table)
                 base64_image = tables[1]
                 bytes_list.append(base64.b64decode(base64_image))
@@ -177,6 +186,11 @@ class MicoContentUtil:
                     logger.warning("Invalid content information type")
                     continue
                 for i, video_item in enumerate(item["video"]):
+                    frame = self._frame_ref(video_item)
+                    if frame is not None:
+                        bytes_list.append(frame)
+                        item["video"][i] = FRAME_RING_URL_PREFIX
+                        continue
                     tables = video_item.split(base64_table)
                     base64_image = tables[1]
                     bytes_list.append(base64.b64decode(base64_image))
@@ -184,6 +198,15 @@ class MicoContentUtil:
 
         return content, bytes_list
 
+    def _frame_ref(self, url: str) -> Union[None, Dict[str, Any]]:
+        """Frame ring reference of a miloco-frame:// url, None for other urls"""
+        if not url.startswith(FRAME_RING_URL_PREFIX):
+            return None
+        camera, _, seq = url[len(FRAME_RING_URL_PREFIX):].rpartition("/")
+        if not camera or not seq.isdigit():
+            raise CoreResponeException(f"Invalid frame ring url: {url}")
+        return {"camera": camera, "seq": int(seq)}
+
     def _get_mime_type(self, file_path: str) -> str:
         """Get MIME type based on file extension"""
         ext = os.path.splitext(file_path)[1].lower()
@@ -101,6 +101,7 @@ TRIGGER_RULE_RUNNER_CONFIG = {
 # Camera configuration
 CAMERA_CONFIG = {
     "frame_interval": _config["camera"]["frame_interval"],
+    "frame_ring_slots": _config["camera"].get("frame_ring_slots", 0),
     "camera_img_cache_max_size": max(
         TRIGGER_RULE_RUNNER_CONFIG["vision_use_img_count"],
         CHAT_CONFIG["vision_use_img_count"]
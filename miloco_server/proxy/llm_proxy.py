@@ -17,9 +17,11 @@ class LLMProxy(ABC):
     """Abstract base class for large language model proxy."""
 
     def __init__(self,
-                 model_name: str):
+                 model_name: str,
+                 local: bool = False):
         logger.info("LLMProxy init model_name: %s", model_name)
         self.model_name = model_name
+        self.local = local  # local AI engine, reads camera frames from the shared memory frame rings
 
 
     @abstractmethod
@@ -78,8 +80,9 @@ class OpenAIProxy(LLMProxy):
     """OpenAI compatible LLM proxy implementation."""
     def __init__(self, base_url: str,
                  api_key: str,
-                 model_name: str):
-        super().__init__(model_name)
+                 model_name: str,
+                 local: bool = False):
+        super().__init__(model_name, local)
         self.base_url = base_url
         self.api_key = api_key
 
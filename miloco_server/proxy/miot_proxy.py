@@ -47,6 +47,7 @@ class MiotProxy:
         self._token_refresh_task = None
         self._frame_interval: int = CAMERA_CONFIG["frame_interval"]
         self._camera_img_cache_max_size: int = CAMERA_CONFIG["camera_img_cache_max_size"]
+        self._frame_ring_slots: int = CAMERA_CONFIG["frame_ring_slots"]
 
         # two times cache ttl, at least 1 second
         # frame_interval * cache_max_size / 1000 * 2 = seconds
@@ -177,7 +178,8 @@ class MiotProxy:
         if camera_instance is not None:
             await camera_instance.start_async(enable_reconnect=True)
             camera_img_manager = CameraVisionHandler(
-                camera_info, camera_instance, max_size=self._camera_img_cache_max_size, ttl=self._camera_img_cache_ttl
+                camera_info, camera_instance, max_size=self._camera_img_cache_max_size, ttl=self._camera_img_cache_ttl,
+                frame_ring_slots=self._frame_ring_slots
             )
             self._camera_img_managers[camera_info.did] = camera_img_manager
             return camera_img_manager
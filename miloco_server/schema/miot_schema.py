@@ -10,6 +10,7 @@ from typing import Optional
 
 from pydantic import BaseModel, Field
 
+from miloco_server.utils.frame_ring import frame_ring_camera, frame_url
 from miloco_server.utils.media import image_manager
 from miloco_server.utils.normal_util import bytes_to_base64
 from miot.types import MIoTCameraInfo
@@ -57,6 +58,7 @@ class SceneInfo(BaseModel):
 class CameraImgInfo(BaseModel):
     data: bytes = Field(..., description="Image byte stream")
     timestamp: int = Field(..., description="Timestamp (millisecond Unix timestamp)")
+    frame_seq: Optional[int] = Field(None, description="Sequence number in the camera frame ring")
 
 class CameraImgInfoBase64(CameraImgInfo):
     data: str = Field(..., description="Base64 encoded image")
@@ -80,6 +82,13 @@ class CameraImgSeq(BaseModel):
             ) for img in self.img_list]
         )
 
+    def to_image_urls(self, frame_ring: bool = False) -> list[str]:
+        """Image urls, frames still in the camera frame ring are referred to by sequence number if frame_ring"""
+        if frame_ring and self.img_list and all(img.frame_seq is not None for img in self.img_list):
+            camera = frame_ring_camera(self.camera_info.did, self.channel)
+            return [frame_url(camera, img.frame_seq) for img in self.img_list]
+        return [bytes_to_base64(img.data) for img in self.img_list]
+
     async def store_to_path(self) -> "CameraImgPathSeq":
         """Store images to file paths"""
         paths = await image_manager.save_image_list_async(
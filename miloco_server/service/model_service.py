@@ -100,7 +100,8 @@ class ModelService:
             purpose:
             OpenAIProxy(base_url=model_info.base_url,
                         api_key=model_info.api_key,
-                        model_name=model_info.model_name)
+                        model_name=model_info.model_name,
+                        local=model_id_by_purpose[purpose.value].startswith(LOCAL_MODEL_ID_PREFIX))
             for purpose, model_info in llm_proxy_by_purpose.items()
         }
 
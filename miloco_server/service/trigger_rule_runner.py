@@ -362,7 +362,7 @@ class TriggerRuleRunner:
                 last_happened_img_seq = self._last_happened_cache.get((rule.id, camera_id, channel))
                 messages = TriggerRuleConditionPromptBuilder.build_trigger_rule_prompt(
                     camera_img_seq, rule.condition, self._get_language(),
-                    last_happened_img_seq=last_happened_img_seq)
+                    last_happened_img_seq=last_happened_img_seq, frame_ring=llm_proxy.local)
                 task = self._call_vision_understaning(llm_proxy, messages.get_messages())
                 tasks.append(task)
 
@@ -14,6 +14,7 @@ from collections import deque
 from typing import Any, Callable, Coroutine, List
 
 from miloco_server.schema.miot_schema import CameraImgInfo, CameraImgSeq, CameraInfo
+from miloco_server.utils.frame_ring import FRAME_SIZE, FrameRingWriter, decode_frame, frame_ring_camera
 from miot.camera import MIoTCameraInstance
 from miot.types import MIoTCameraInfo
 
@@ -118,14 +119,23 @@ class SizeLimitedQueue:
 class CameraVisionHandler:
     """Camera vision handler for managing camera image streams"""
 
-    def __init__(self, camera_info: MIoTCameraInfo, miot_camera_instance: MIoTCameraInstance, max_size: int, ttl: int):
+    def __init__(self, camera_info: MIoTCameraInfo, miot_camera_instance: MIoTCameraInstance, max_size: int, ttl: int,
+                 frame_ring_slots: int = 0):
         # ttl seconds
         self.camera_info = camera_info
         self.miot_camera_instance = miot_camera_instance
         self.camera_img_queues: dict[int, SizeLimitedQueue] = {}
+        # Decoded frames for a local AI engine, slots outlast the queue so queued frames are still in the ring
+        self.frame_rings: dict[int, FrameRingWriter] = {}
 
         for channel in range(self.camera_info.channel_count or 1):
             self.camera_img_queues[channel] = SizeLimitedQueue(max_size=max_size, ttl=ttl)
+            if frame_ring_slots > 0:
+                try:
+                    self.frame_rings[channel] = FrameRingWriter(
+                        frame_ring_camera(self.camera_info.did, channel), max(frame_ring_slots, max_size * 2))
+                except Exception as e: # pylint: disable=broad-exception-caught
+                    logger.error("Failed to create frame ring of camera %s: %s", self.camera_info.did, e)
             asyncio.create_task(self.miot_camera_instance.register_decode_jpg_async(self.add_camera_img, channel))
 
         logger.info("CameraImgManager init success, camera did: %s", self.camera_info.did)
@@ -138,7 +148,15 @@ class CameraVisionHandler:
 
     async def add_camera_img(self, did: str, data: bytes, ts: int, channel: int):
         logger.debug("add_camera_img camera_id: %s, camera timestamp: %d, image_size: %d", did, ts, len(data))
-        self.camera_img_queues[channel].put(CameraImgInfo(data=data, timestamp=int(time.time())))
+        frame_seq = None
+        frame_ring = self.frame_rings.get(channel)
+        if frame_ring is not None:
+            try:
+                frame = await asyncio.to_thread(decode_frame, data)
+                frame_seq = frame_ring.write(frame, FRAME_SIZE[0], FRAME_SIZE[1], ts)
+            except Exception as e: # pylint: disable=broad-exception-caught
+                logger.warning("Failed to write frame of camera %s to its ring: %s", did, e)
+        self.camera_img_queues[channel].put(CameraImgInfo(data=data, timestamp=int(time.time()), frame_seq=frame_seq))
 
     async def update_camera_info(self, camera_info: MIoTCameraInfo) -> None:
         self.camera_info = camera_info
@@ -167,5 +185,8 @@ class CameraVisionHandler:
             await self.miot_camera_instance.unregister_decode_jpg_async(channel=channel)
             await self.miot_camera_instance.unregister_raw_video_async(channel=channel)
             self.camera_img_queues[channel].clear()
+        for frame_ring in self.frame_rings.values():
+            frame_ring.close()
+        self.frame_rings.clear()
 
         await self.miot_camera_instance.destroy_async()
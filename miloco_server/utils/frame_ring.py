@@ -0,0 +1,110 @@
+# Copyright (C) 2025 Xiaomi Corporation
+# This software may be used and distributed according to the terms of the Xiaomi Miloco License Agreement.
+
+"""
+Camera frame ring in POSIX shared memory.
+Decoded frames are written once by the camera ingest and read in place by a local AI engine, requests refer to them
+by (camera, sequence number) instead of carrying base64 images. Layout in miloco_ai_engine/core/utils/frame-ring.h.
+"""
+
+import logging
+import struct
+import time
+from io import BytesIO
+from multiprocessing import shared_memory
+from typing import Tuple
+
+from PIL import Image
+
+logger = logging.getLogger(__name__)
+
+FRAME_RING_MAGIC = b"MICOFRM1"
+FRAME_RING_SHM_PREFIX = "miloco-frames-"  # shared memory "/miloco-frames-<camera>"
+FRAME_RING_URL_PREFIX = "miloco-frame://"  # image url of a frame, miloco-frame://<camera>/<seq>
+FRAME_RING_HEADER_BYTES = 64
+FRAME_RING_SLOT_HEADER_BYTES = 64
+FRAME_FORMAT_RGB = 1  # LLAMA_MICO_MODAL_RGB
+FRAME_SIZE = (448, 448)  # frames are center cropped to the high precision input of the local model
+
+_HEADER = struct.Struct("<8sIIQQ")  # magic, n_slots, reserved, slot_bytes, head
+_SLOT_HEADER = struct.Struct("<QQIIIIQQ")  # version, seq, format, nx, ny, reserved, size, timestamp
+_U64 = struct.Struct("<Q")
+
+
+def decode_frame(jpeg: bytes, size: Tuple[int, int] = FRAME_SIZE) -> bytes:
+    """Decode a JPEG frame, center crop it to the aspect of size and resize, returned as packed RGB24"""
+    target_width, target_height = size
+    with BytesIO(jpeg) as bio:
+        with Image.open(bio) as img:
+            src_width, src_height = img.width, img.height
+            if src_width / float(src_height) > target_width / float(target_height):
+                crop_width, crop_height = int(round(src_height * target_width / target_height)), src_height
+            else:
+                crop_width, crop_height = src_width, int(round(src_width * target_height / target_width))
+            left = (src_width - crop_width) // 2
+            top = (src_height - crop_height) // 2
+            cropped = img.crop((left, top, left + crop_width, top + crop_height))
+            return cropped.resize(size, Image.Resampling.LANCZOS).convert("RGB").tobytes()
+
+
+def frame_ring_camera(did: str, channel: int) -> str:
+    """Ring name of a camera channel"""
+    return f"{did}.{channel}"
+
+
+def frame_url(camera: str, seq: int) -> str:
+    """Image url of a frame in the ring of camera"""
+    return f"{FRAME_RING_URL_PREFIX}{camera}/{seq}"
+
+
+class FrameRingWriter:
+    """
+    Writer of one camera channel ring, the only writer. A slot version is odd while the slot is written, readers copy
+    a frame and check the version did not change. NOTE: relies on the ordered stores of x86 and aligned 8 byte writes
+    """
+
+    def __init__(self, camera: str, n_slots: int, slot_bytes: int = FRAME_SIZE[0] * FRAME_SIZE[1] * 3):
+        if n_slots <= 0 or slot_bytes <= 0:
+            raise ValueError("n_slots and slot_bytes must be positive")
+        self.camera = camera
+        self.n_slots = n_slots
+        self.slot_bytes = slot_bytes
+        self._head = time.time_ns() // 1000000  # NOTE: past every seq of an earlier ring of the camera
+        size = FRAME_RING_HEADER_BYTES + n_slots * (FRAME_RING_SLOT_HEADER_BYTES + slot_bytes)
+        name = FRAME_RING_SHM_PREFIX + camera
+        try:
+            self._shm = shared_memory.SharedMemory(name=name, create=True, size=size)
+        except FileExistsError:  # left by an earlier process, readers map it again once they miss a frame
+            stale = shared_memory.SharedMemory(name=name)
+            stale.unlink()
+            stale.close()
+            self._shm = shared_memory.SharedMemory(name=name, create=True, size=size)
+        self._buf = self._shm.buf
+        _HEADER.pack_into(self._buf, 0, FRAME_RING_MAGIC, n_slots, 0, slot_bytes, self._head)
+        logger.info("Frame ring %s created, %d slots of %d bytes", name, n_slots, slot_bytes)
+
+    def write(self, frame: bytes, width: int, height: int, timestamp: int) -> int:
+        """Write a packed RGB24 frame, returns its sequence number"""
+        if len(frame) > self.slot_bytes:
+            raise ValueError(f"frame of {len(frame)} bytes exceeds the slot size {self.slot_bytes}")
+        seq = self._head
+        offset = FRAME_RING_HEADER_BYTES + (seq % self.n_slots) * (FRAME_RING_SLOT_HEADER_BYTES + self.slot_bytes)
+        version = _U64.unpack_from(self._buf, offset)[0]
+        _U64.pack_into(self._buf, offset, version + 1)
+        _SLOT_HEADER.pack_into(self._buf, offset, version + 1, seq, FRAME_FORMAT_RGB, width, height, 0, len(frame),
+                               timestamp)
+        data_offset = offset + FRAME_RING_SLOT_HEADER_BYTES
+        self._buf[data_offset:data_offset + len(frame)] = frame
+        _U64.pack_into(self._buf, offset, version + 2)
+        self._head = seq + 1
+        _U64.pack_into(self._buf, 24, self._head)
+        return seq
+
+    def close(self) -> None:
+        """Release the ring, readers keep their mapping until they miss a frame"""
+        self._buf = None
+        self._shm.close()
+        try:
+            self._shm.unlink()
+        except FileNotFoundError:
+            pass
@@ -35,7 +35,8 @@ class VisionUnderstander(BaseLLMUtil):
 
     def _init_conversation(self) -> None:
         self._chat_history = VisionUnderstandToolPromptBuilder.build_prompt(
-            self._camera_img_seqs, self._query, self._language)
+            self._camera_img_seqs, self._query, self._language,
+            frame_ring=self._llm_proxy is not None and self._llm_proxy.local)
 
     async def run(self) -> str | None:
         """Run agent to process user query"""
@@ -30,11 +30,10 @@ class TriggerRuleConditionPromptBuilder:
         condition: str,
         language: UserLanguage = UserLanguage.CHINESE,
         last_happened_img_seq: Optional[CameraImgSeq] = None,
+        frame_ring: bool = False,
     ) -> ChatHistoryMessages:
         chat_history_messages = ChatHistoryMessages()
 
-        img_seq_base64 = img_seq.to_base64()
-
         # Get system prompt from config
         system_prompt = PromptConfig.get_prompt(PromptType.TRIGGER_RULE_CONDITION, language)
         chat_history_messages.add_content("system", system_prompt)
@@ -60,15 +59,15 @@ class TriggerRuleConditionPromptBuilder:
                 frame_interval=CAMERA_IMG_FRAME_INTERVAL
             )
         })
-        for image_data in img_seq_base64.img_list:
+        for url in img_seq.to_image_urls(frame_ring):
             user_content.append({
                 "type": "image_url",
                 "image_url": {
-                    "url": image_data.data
+                    "url": url
                 }
             })
 
-        # last_happened_frames and last_happened_time
+        # last_happened_frames and last_happened_time, NOTE: base64, older frames may have left the frame ring
         if last_happened_img_seq is not None and last_happened_img_seq.img_list:
             logger.info("Last Image Detected")
             last_happened_base64 = last_happened_img_seq.to_base64()
@@ -121,7 +120,8 @@ class VisionUnderstandToolPromptBuilder:
     def build_prompt(
         camera_img_seqs: list[CameraImgSeq],
         query: str,
-        language: UserLanguage = UserLanguage.CHINESE) -> ChatHistoryMessages:
+        language: UserLanguage = UserLanguage.CHINESE,
+        frame_ring: bool = False) -> ChatHistoryMessages:
 
         chat_history_messages = ChatHistoryMessages()
         chat_history_messages.add_content("system", VisionUnderstandToolPromptBuilder._get_system_prompt(language))
@@ -136,18 +136,17 @@ class VisionUnderstandToolPromptBuilder:
         user_content = []
 
         for image_seq in camera_img_seqs:
-            img_seq_base64 = image_seq.to_base64()
             user_content.append({
                 "type": "text",
-                "text": (f"\n{camera_prefix}{img_seq_base64.camera_info.name}"
-                        f"{channel_prefix}{img_seq_base64.channel}{sequence_prefix}")
+                "text": (f"\n{camera_prefix}{image_seq.camera_info.name}"
+                        f"{channel_prefix}{image_seq.channel}{sequence_prefix}")
             })
 
-            for image_data in img_seq_base64.img_list:
+            for url in image_seq.to_image_urls(frame_ring):
                 user_content.append({
                     "type": "image_url",
                     "image_url": {
-                        "url": image_data.data
+                        "url": url
                     }
                 })
 
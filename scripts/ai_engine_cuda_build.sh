@@ -25,6 +25,7 @@ cmake -S "${AI_ENGINE_DIR}" -B "${BUILD_DIR}" \
     -DCMAKE_BUILD_TYPE=${BUILD_TYPE} \
     -DCMAKE_CUDA_ARCHITECTURES=${CUDA_ARCS} \
     -DGGML_CUDA=ON \
+    -DGGML_CUDA_GRAPHS=ON \
     -DGGML_NATIVE=${NATIVE_ARCS}
 
 cmake --build "${BUILD_DIR}" --target llama-mico -j"$(nproc)"
@@ -932,6 +932,18 @@ struct common_init_result common_init_from_params(common_params& params) {
         return iparams;
     }
 
+    iparams = common_init_from_model(params, model);
+    if (!iparams.context) {
+        llama_model_free(model);
+        return iparams;
+    }
+    iparams.model.reset(model);
+
+    return iparams;
+}
+
+struct common_init_result common_init_from_model(common_params& params, llama_model* model) {
+    common_init_result iparams;
     const llama_vocab* vocab = llama_model_get_vocab(model);
 
     auto cparams = common_context_params_to_llama(params);
@@ -939,7 +951,6 @@ struct common_init_result common_init_from_params(common_params& params) {
     llama_context* lctx = llama_init_from_model(model, cparams);
     if (lctx == NULL) {
         LOG_ERR("%s: failed to create context with model '%s'\n", __func__, params.model.path.c_str());
-        llama_model_free(model);
         return iparams;
     }
 
@@ -955,8 +966,6 @@ struct common_init_result common_init_from_params(common_params& params) {
         const auto cvec = common_control_vector_load(params.control_vectors);
         if (cvec.n_embd == -1) {
             llama_free(lctx);
-            llama_model_free(model);
-
             return iparams;
         }
 
@@ -964,8 +973,6 @@ struct common_init_result common_init_from_params(common_params& params) {
                                            params.control_vector_layer_start, params.control_vector_layer_end);
         if (err) {
             llama_free(lctx);
-            llama_model_free(model);
-
             return iparams;
         }
     }
@@ -993,8 +1000,6 @@ struct common_init_result common_init_from_params(common_params& params) {
 
         if (!ok) {
             llama_free(lctx);
-            llama_model_free(model);
-
             return iparams;
         }
     }
@@ -1006,7 +1011,6 @@ struct common_init_result common_init_from_params(common_params& params) {
         if (lora == nullptr) {
             LOG_ERR("%s: failed to apply lora adapter '%s'\n", __func__, la.path.c_str());
             llama_free(lctx);
-            llama_model_free(model);
             return iparams;
         }
 
@@ -1080,7 +1084,6 @@ struct common_init_result common_init_from_params(common_params& params) {
         llama_set_warmup(lctx, false);
     }
 
-    iparams.model.reset(model);
     iparams.context.reset(lctx);
 
     return iparams;
@@ -1125,6 +1128,10 @@ struct llama_model_params common_model_params_to_llama(common_params& params) {
     mparams.use_mmap = params.use_mmap;
     mparams.use_mlock = params.use_mlock;
     mparams.check_tensors = params.check_tensors;
+    mparams.n_load_threads = params.n_load_threads;
+    mparams.mmap_prefetch_async = params.mmap_prefetch_async;
+    mparams.mmap_hugepages = params.mmap_hugepages;
+    mparams.pinned_host_weights = params.weight_stream_tokens > 0;
 
     if (params.kv_overrides.empty()) {
         mparams.kv_overrides = NULL;
@@ -1170,6 +1177,9 @@ struct llama_context_params common_context_params_to_llama(const common_params&
     cparams.pooling_type = params.pooling_type;
     cparams.attention_type = params.attention_type;
     cparams.defrag_thold = params.defrag_thold;
+    cparams.n_kv_pad = params.n_kv_pad;
+    cparams.n_ubatch_decode = params.n_ubatch_decode;
+    cparams.n_op_offload_min = std::max(params.weight_stream_tokens, 0);
     cparams.cb_eval = params.cb_eval;
     cparams.cb_eval_user_data = params.cb_eval_user_data;
     cparams.offload_kqv = !params.no_kv_offload;
@@ -40,6 +40,7 @@ struct common_adapter_lora_info {
     float scale;
 
     struct llama_adapter_lora* ptr;
+    std::string name;  // requests select the adapter by name, routed per sequence
 };
 
 using llama_tokens = std::vector<llama_token>;
@@ -260,6 +261,9 @@ struct common_params {
 
     struct cpu_params cpuparams;
     struct cpu_params cpuparams_batch;
+    struct cpu_params cpuparams_encoder;    // vision encoder workers and the persistent threads of their CPU graphs
+    struct cpu_params cpuparams_scheduler;  // batch scheduler thread
+    struct cpu_params cpuparams_prepare;    // prompt templating, tokenizing and image preprocessing workers
 
     ggml_backend_sched_eval_callback cb_eval = nullptr;
     void* cb_eval_user_data = nullptr;
@@ -345,6 +349,10 @@ struct common_params {
     bool input_prefix_bos = false;  // prefix BOS to user inputs, preceding input_prefix
     bool use_mmap = true;           // use mmap for faster loads
     bool use_mlock = false;         // use mlock to keep model in memory
+    bool repack_cache = false;      // keep CPU repacked weights in <weights file>.repack for the next load
+    int32_t n_load_threads = 0;     // threads reading and uploading the weights, <= 1 loads them in order
+    bool mmap_prefetch_async = false;  // populate the mapped weights in the background after the load
+    bool mmap_hugepages = false;       // transparent hugepages on the mapped weights
     bool verbose_prompt = false;    // print prompt tokens before generation
     bool display_prompt = true;     // print prompt before generation
     bool no_kv_offload = false;     // disable KV offloading
@@ -362,6 +370,11 @@ struct common_params {
     // multimodal models (see tools/mtmd)
     struct common_params_model mmproj;
     bool mmproj_use_gpu = true;      // use GPU for multimodal model
+    int32_t mmproj_flash_attn = -1;  // flash attention in the vision encoder, -1 if supported, 0 off, 1 on
+    ggml_type mmproj_weight_type = GGML_TYPE_COUNT; // vision encoder linear weights converted on load, COUNT keeps them
+    bool mmproj_f16_activations = false;            // F16 K/V in the vision encoder attention
+    bool mmproj_lazy = false;          // load the multimodal model on the first modal request
+    int32_t mmproj_idle_unload_s = 0;  // unload the multimodal model after this long without modal requests, 0 never
     bool no_mmproj = false;          // explicitly disable multimodal model
     std::vector<std::string> image;  // path to image file(s)
 
@@ -455,6 +468,55 @@ struct common_params {
 
     size_t cache_seq = 0;
     int32_t n_usage_context = 8192;
+    std::string cache_path = "";  // kv cache snapshot kept across restarts, empty disables
+    size_t cache_host_mb = 0;     // host memory for evicted cache sequences, 0 disables
+    int32_t cache_pin_max = -1;   // cache sequences pinned prompts may hold, -1 for half of cache_seq
+    std::vector<int32_t> cache_class_seqs;  // cache sequences prompts of each latency class may hold, empty for all
+    int32_t park_context = 4096;  // kv positions finished sequences keep for a request with the same prefix
+    int32_t video_session_max = 0;  // request sequences keeping the frame window of a video session, 0 disables
+    int32_t n_encoder_workers = 1;             // vision encoder workers, each loads its own copy of the mmproj
+    std::vector<std::string> encoder_devices;  // GPU or CPU of each encoder worker, cycled, empty for the first GPU
+    std::string image_cache_precision = "f32";  // storage of cached image embeddings: f32, f16 or q8
+    int32_t frame_dedup_bits = 0;  // near-duplicate frames within this perceptual hash distance reuse embeddings
+    std::vector<int32_t> warmup_image_sizes;  // square images encoded and decoded once at init, empty skips warmup
+    bool warmup_ubatch = false;               // decode one full n_ubatch and one single-token step at init
+    bool autotune = false;           // calibrate n_ubatch, n_ctx, n_seq_max and cache_seq at init, see autotune.h
+    int32_t autotune_latency_ms = 100;  // longest prefill chunk and decode step the calibration accepts
+    int32_t image_cache_entries = 100;  // cached image embeddings, -1 sizes from free host memory
+    int32_t image_cache_mb = 1024;      // host memory of cached image embeddings, -1 sizes from free host memory
+    std::string image_cache_disk_path;  // directory of the disk tier of evicted image embeddings, empty disables
+    int32_t image_cache_disk_mb = 4096;  // disk tier size
+    int32_t image_cache_shm_mb = 0;      // image embeddings shared across processes of the same mmproj, 0 disables
+    int32_t image_kv_entries = 0;  // image kv spans reused at other positions by a rope shift, reserves a sequence
+    float adaptive_resolution_step = 1.0f;  // encoder backlog per lower image resolution level, 0 disables
+    float image_kv_keep = 0.0f;  // fraction of the kv cells of each prompt image kept after prefill, 0 keeps all
+    int32_t batch_wait_ms = 3;          // a partial prefill or image batch waits this long for more requests
+    int32_t text_batch_size = 512;      // prefill tokens submitted together, 0 for n_batch
+    int32_t image_batch_size = 0;       // image tokens decoded together, 0 for n_batch
+    size_t preempt_host_mb = 1024;      // host memory of kv swapped out by preemption, 0 disables preemption
+    bool coalesce_requests = false;     // identical greedy requests in prefill share one sequence and its tokens
+    int32_t response_cache_mb = 0;      // completions of greedy requests replayed for identical ones, 0 disables
+    int32_t response_cache_ttl_s = 60;  // age of a replayed completion, 0 keeps them until evicted
+    int32_t admission_queue_max = 0;    // requests waiting for a free sequence, 0 rejects them at once
+    int32_t admission_wait_ms = 30000;  // longest wait of a queued request, 0 until its deadline
+    bool kv_admission = false;          // admit a request once its prompt plus max_tokens fit the unclaimed kv cells
+    int32_t kv_output_reserve = 512;    // output tokens projected for a request without max_tokens
+    std::vector<int32_t> slo_class_priorities = {10, 5};      // lowest priority of the interactive and rule classes
+    std::vector<int32_t> slo_target_ms = {300, 2000, 10000};  // latency target of interactive, rule, background
+    int32_t lookup_ngram = 0;  // n-gram size of prompt lookup drafting when there is no draft model, 0 disables
+    int32_t n_prepare_workers = 2;  // threads templating and tokenizing prompts ahead of inference
+    std::string request_log_path = "";  // binary log of the prompt requests for offline replay, empty disables
+    bool op_profile = false;  // time of every ggml op of the llm and vision graphs, each op is synchronised
+    int32_t n_kv_pad = 0;  // attended kv cells padded to a multiple of this, 0 for the kernel padding
+    int32_t n_ubatch_decode = 0;  // tokens of the reserved decode step graph, 0 for a single token
+    int32_t weight_stream_tokens = 0;  // batches of at least this many tokens stream CPU layer weights to the GPU, 0 off
+    int32_t pipeline_microbatches = 0;  // prefill graph runs per batch overlapped over layer split GPUs, 0 for one
+    std::vector<ggml_backend_dev_t> prefill_devices;  // GPUs of the model copy prefilling long prompts, empty disables
+    int32_t prefill_offload_tokens = 1024;  // uncached prompt positions from which a prompt prefills on them
+    std::vector<ggml_backend_dev_t> replica_devices;  // one data parallel replica of the model per GPU, empty for one
+    int32_t sample_threads = 4;  // threads selecting the top_k candidates of decode rows, 0 samples with the chains
+    float kv_defrag_thold = 0.0f;    // kv cells compacted in idle gaps above this fragmentation, 0 disables
+    int32_t kv_defrag_idle_ms = 200;  // quiet time of the memory scheduler before it compacts
 };
 
 // call once at the start of a program if it uses libcommon
@@ -566,6 +628,8 @@ struct common_init_result {
 };
 
 struct common_init_result common_init_from_params(common_params& params);
+// context, lora and sampling setup of common_init_from_params on an already loaded model, result.model stays empty
+struct common_init_result common_init_from_model(common_params& params, llama_model* model);
 
 struct llama_model_params common_model_params_to_llama(common_params& params);
 struct llama_context_params common_context_params_to_llama(const common_params& params);
@@ -321,6 +321,9 @@ extern "C" {
     // Set a callback to be called for each resulting node during graph compute
     GGML_API void                 ggml_backend_sched_set_eval_callback(ggml_backend_sched_t sched, ggml_backend_sched_eval_callback callback, void * user_data);
 
+    // Ops on host weights are offloaded only from this many rows in their batch dimension up (and as the device's offload_op allows), 0 leaves it to the device
+    GGML_API void                 ggml_backend_sched_set_op_offload_min_batch(ggml_backend_sched_t sched, int64_t n_batch);
+
     //
     // Utils
     //
@@ -133,6 +133,12 @@ extern "C" {
 
     GGML_BACKEND_API ggml_backend_reg_t ggml_backend_cpu_reg(void);
 
+    // Repacked weights cache of the calling thread: CPU_REPACK tensors set until end are copied from the mapped file at
+    // path when it was written for the same key (the weights) and CPU features, else they are repacked and the file is
+    // rewritten at end. Not supported on Windows, where both are no-ops
+    GGML_BACKEND_API void ggml_backend_cpu_repack_cache_begin(const char * path, uint64_t key);
+    GGML_BACKEND_API void ggml_backend_cpu_repack_cache_end  (void);
+
     GGML_BACKEND_API void ggml_cpu_fp32_to_fp16(const float *, ggml_fp16_t *, int64_t);
     GGML_BACKEND_API void ggml_cpu_fp16_to_fp32(const ggml_fp16_t *, float *, int64_t);
     GGML_BACKEND_API void ggml_cpu_fp32_to_bf16(const float *, ggml_bf16_t *, int64_t);
@@ -40,6 +40,10 @@ GGML_BACKEND_API void ggml_backend_cuda_get_device_memory(int device, size_t * f
 GGML_BACKEND_API bool ggml_backend_cuda_register_host_buffer(void * buffer, size_t size);
 GGML_BACKEND_API void ggml_backend_cuda_unregister_host_buffer(void * buffer);
 
+// CUDA graphs kept per backend, one per ggml graph shape (default 1)
+// more than one also captures multi-token batches, each batch size and KV span replays its own graph
+GGML_BACKEND_API void ggml_backend_cuda_set_graph_cache(int n_graphs);
+
 GGML_BACKEND_API ggml_backend_reg_t ggml_backend_cuda_reg(void);
 
 #ifdef  __cplusplus
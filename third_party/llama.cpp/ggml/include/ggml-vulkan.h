@@ -22,6 +22,10 @@ GGML_BACKEND_API ggml_backend_buffer_type_t ggml_backend_vk_buffer_type(size_t d
 // pinned host buffer for use with the CPU backend for faster copies between CPU and GPU
 GGML_BACKEND_API ggml_backend_buffer_type_t ggml_backend_vk_host_buffer_type(void);
 
+// directory of the on-disk VkPipelineCache, one file per device and driver (default $GGML_VK_PIPELINE_CACHE)
+// must be set before the devices are initialized, nullptr or "" compiles every pipeline again after a restart
+GGML_BACKEND_API void ggml_backend_vk_set_pipeline_cache(const char * dir);
+
 GGML_BACKEND_API ggml_backend_reg_t ggml_backend_vk_reg(void);
 
 #ifdef  __cplusplus
@@ -631,6 +631,12 @@ static void * ggml_backend_cpu_get_proc_address(ggml_backend_reg_t reg, const ch
     if (strcmp(name, "ggml_backend_cpu_is_numa") == 0) {
         return (void *)ggml_is_numa;
     }
+    if (strcmp(name, "ggml_backend_cpu_repack_cache_begin") == 0) {
+        return (void *)ggml_backend_cpu_repack_cache_begin;
+    }
+    if (strcmp(name, "ggml_backend_cpu_repack_cache_end") == 0) {
+        return (void *)ggml_backend_cpu_repack_cache_end;
+    }
 
     // threadpool - TODO:  move to ggml-base
     if (strcmp(name, "ggml_threadpool_new") == 0) {
@@ -10,14 +10,25 @@
 
 #include "arch-fallback.h"
 
+#include <cinttypes>
 #include <cmath>
+#include <cstddef>
 #include <cstring>
 #include <cassert>
 #include <cstdlib> // for qsort
 #include <cstdio>  // for GGML_ASSERT
+#include <string>
+#include <unordered_map>
 
 #include "repack.h"
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #if defined(__GNUC__)
 #pragma GCC diagnostic ignored "-Woverlength-strings"
 #endif
@@ -1449,15 +1460,224 @@ static enum ggml_status ggml_backend_cpu_repack_buffer_init_tensor(ggml_backend_
     return GGML_STATUS_SUCCESS;
 }
 
+// Repacked weights cache file: header, then per tensor its record, name (padded to 8 bytes) and repacked bytes. The
+// layout of a tensor is chosen from its type, shape and the CPU features, so the features are part of the key
+#define GGML_REPACK_CACHE_MAGIC "GGMLRPK1"  // NOTE: bump when a repacked layout changes
+
+namespace {
+struct repack_cache_header {
+    char     magic[8];
+    uint64_t key;
+    uint64_t n_tensors;
+};
+
+struct repack_cache_record {
+    int32_t  type;
+    int32_t  name_len;
+    int64_t  ne[GGML_MAX_DIMS];
+    uint64_t size;
+};
+
+struct repack_cache_entry {
+    const repack_cache_record * record;
+    const uint8_t             * data;
+};
+
+struct repack_cache {
+    std::string path;
+    uint64_t    key = 0;
+
+    // read, the file matched the key
+    void  * addr = nullptr;
+    size_t  addr_size = 0;
+    std::unordered_map<std::string, repack_cache_entry> entries;
+    size_t  n_hits = 0;
+
+    // write, it did not
+    FILE    * out = nullptr;
+    uint64_t  n_written = 0;
+};
+
+thread_local repack_cache * g_repack_cache = nullptr;
+}
+
+static uint64_t ggml_repack_cache_cpu_key(uint64_t key) {
+    const int features[] = {
+        ggml_cpu_has_avx2(), ggml_cpu_has_avx512(), ggml_cpu_has_neon(), ggml_cpu_has_dotprod(),
+        ggml_cpu_has_matmul_int8(), ggml_cpu_has_sve(), ggml_cpu_get_sve_cnt(), ggml_cpu_has_riscv_v(),
+    };
+    for (int f : features) {
+        key = (key ^ (uint64_t) f) * 0x100000001b3ULL;  // FNV-1a step
+    }
+    return key;
+}
+
+#if !defined(_WIN32)
+static bool ggml_repack_cache_map(repack_cache * cache) {
+    int fd = open(cache->path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(repack_cache_header)) {
+        close(fd);
+        return false;
+    }
+    void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    cache->addr      = addr;
+    cache->addr_size = st.st_size;
+
+    const uint8_t * p   = (const uint8_t *) addr;
+    const uint8_t * end = p + st.st_size;
+    const auto * header = (const repack_cache_header *) p;
+    if (memcmp(header->magic, GGML_REPACK_CACHE_MAGIC, sizeof(header->magic)) != 0 || header->key != cache->key) {
+        return false;
+    }
+    p += sizeof(repack_cache_header);
+    for (uint64_t i = 0; i < header->n_tensors; i++) {
+        if (end - p < (ptrdiff_t) sizeof(repack_cache_record)) {
+            return false;
+        }
+        const auto * record = (const repack_cache_record *) p;
+        p += sizeof(repack_cache_record);
+        if (record->name_len < 0 || (uint64_t) (end - p) < GGML_PAD(record->name_len, 8) + record->size) {
+            return false;
+        }
+        std::string name((const char *) p, record->name_len);
+        p += GGML_PAD(record->name_len, 8);
+        cache->entries[name] = { record, p };
+        p += record->size;
+    }
+    return true;
+}
+#endif
+
+void ggml_backend_cpu_repack_cache_begin(const char * path, uint64_t key) {
+#if !defined(_WIN32)
+    ggml_backend_cpu_repack_cache_end();
+
+    auto * cache = new repack_cache;
+    cache->path = path;
+    cache->key  = ggml_repack_cache_cpu_key(key);
+    if (ggml_repack_cache_map(cache)) {
+        GGML_LOG_INFO("%s: %zu repacked tensors in %s\n", __func__, cache->entries.size(), path);
+    } else {
+        cache->entries.clear();
+        if (cache->addr) {
+            munmap(cache->addr, cache->addr_size);
+            cache->addr = nullptr;
+        }
+        cache->out = fopen((cache->path + ".tmp").c_str(), "wb");
+        repack_cache_header header = {};
+        memcpy(header.magic, GGML_REPACK_CACHE_MAGIC, sizeof(header.magic));
+        header.key = cache->key;
+        if (!cache->out || fwrite(&header, sizeof(header), 1, cache->out) != 1) {
+            GGML_LOG_WARN("%s: cannot write %s.tmp, weights are repacked on every load\n", __func__, path);
+            if (cache->out) {
+                fclose(cache->out);
+                cache->out = nullptr;
+            }
+        }
+    }
+    g_repack_cache = cache;
+#else
+    GGML_UNUSED(path);
+    GGML_UNUSED(key);
+#endif
+}
+
+void ggml_backend_cpu_repack_cache_end(void) {
+#if !defined(_WIN32)
+    auto * cache = g_repack_cache;
+    if (!cache) {
+        return;
+    }
+    g_repack_cache = nullptr;
+    if (cache->addr) {
+        GGML_LOG_INFO("%s: %zu tensors copied from %s\n", __func__, cache->n_hits, cache->path.c_str());
+        munmap(cache->addr, cache->addr_size);
+    }
+    if (cache->out) {
+        std::string tmp = cache->path + ".tmp";
+        // NOTE: the count is written last, a load cut short leaves no file that claims its tensors
+        bool ok = cache->n_written > 0 &&
+                  fseek(cache->out, offsetof(repack_cache_header, n_tensors), SEEK_SET) == 0 &&
+                  fwrite(&cache->n_written, sizeof(cache->n_written), 1, cache->out) == 1;
+        ok = fclose(cache->out) == 0 && ok;
+        if (ok && rename(tmp.c_str(), cache->path.c_str()) == 0) {
+            GGML_LOG_INFO("%s: %" PRIu64 " repacked tensors written to %s\n", __func__, cache->n_written,
+                          cache->path.c_str());
+        } else {
+            remove(tmp.c_str());
+        }
+    }
+    delete cache;
+#endif
+}
+
+// Copies the repacked tensor from the cache, true on a hit
+static bool ggml_repack_cache_load(struct ggml_tensor * tensor, size_t size) {
+    auto * cache = g_repack_cache;
+    if (!cache || !cache->addr) {
+        return false;
+    }
+    auto it = cache->entries.find(tensor->name);
+    if (it == cache->entries.end()) {
+        return false;
+    }
+    const auto * record = it->second.record;
+    if (record->type != tensor->type || record->size != size ||
+        memcmp(record->ne, tensor->ne, sizeof(record->ne)) != 0) {
+        return false;
+    }
+    memcpy(tensor->data, it->second.data, size);
+    cache->n_hits++;
+    return true;
+}
+
+static void ggml_repack_cache_store(const struct ggml_tensor * tensor, size_t size) {
+    auto * cache = g_repack_cache;
+    if (!cache || !cache->out) {
+        return;
+    }
+    repack_cache_record record = {};
+    record.type     = tensor->type;
+    record.name_len = (int32_t) strlen(tensor->name);
+    memcpy(record.ne, tensor->ne, sizeof(record.ne));
+    record.size     = size;
+    char name[GGML_PAD(GGML_MAX_NAME, 8)] = {};
+    memcpy(name, tensor->name, record.name_len);
+    size_t name_size = GGML_PAD(record.name_len, 8);  // NOTE: keeps the records 8 byte aligned
+    if (fwrite(&record, sizeof(record), 1, cache->out) != 1 ||
+        fwrite(name, 1, name_size, cache->out) != name_size ||
+        fwrite(tensor->data, 1, size, cache->out) != size) {
+        GGML_LOG_WARN("%s: failed to write %s.tmp\n", __func__, cache->path.c_str());
+        fclose(cache->out);
+        remove((cache->path + ".tmp").c_str());
+        cache->out = nullptr;
+        return;
+    }
+    cache->n_written++;
+}
+
 static void ggml_backend_cpu_repack_buffer_set_tensor(ggml_backend_buffer_t buffer, struct ggml_tensor * tensor,
                                                        const void * data, size_t offset, size_t size) {
     GGML_ASSERT(offset == 0);
     GGML_ASSERT(size == ggml_nbytes(tensor));
 
+    if (ggml_repack_cache_load(tensor, size)) {
+        return;
+    }
+
     auto tensor_traits = (ggml::cpu::repack::tensor_traits_base *) tensor->extra;
     auto OK            = tensor_traits->repack(tensor, data, size);
 
     GGML_ASSERT(OK == 0);
+    ggml_repack_cache_store(tensor, size);
     GGML_UNUSED(buffer);
 }
 
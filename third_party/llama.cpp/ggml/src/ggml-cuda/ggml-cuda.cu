@@ -2463,7 +2463,49 @@ static void ggml_backend_cuda_synchronize(ggml_backend_t backend) {
     GGML_UNUSED(backend);
 }
 
+// captured graphs kept per backend, one per graph shape, more than one also captures multi-token batches
+static std::atomic<int> ggml_cuda_graph_cache_size{1};
+
+void ggml_backend_cuda_set_graph_cache(int n_graphs) {
+    ggml_cuda_graph_cache_size.store(std::max(1, n_graphs), std::memory_order_relaxed);
+}
+
 #ifdef USE_CUDA_GRAPH
+// FNV-1a of the ops and shapes, the node addresses are checked by is_cuda_graph_update_required
+static uint64_t ggml_cuda_graph_shape_key(const ggml_cgraph * cgraph) {
+    uint64_t key = 14695981039346656037ULL;
+    auto mix = [&key](int64_t v) { key = (key ^ (uint64_t) v) * 1099511628211ULL; };
+    mix(cgraph->n_nodes);
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        const ggml_tensor * node = cgraph->nodes[i];
+        mix(node->op);
+        for (int j = 0; j < GGML_MAX_DIMS; j++) {
+            mix(node->ne[j]);
+        }
+    }
+    return key;
+}
+
+// makes the graph captured for this shape current, the previous one goes back to the cache
+static void ggml_cuda_graph_select(ggml_backend_cuda_context * cuda_ctx, uint64_t key, size_t n_graphs) {
+    auto & cache = cuda_ctx->cuda_graph_cache;
+    if (cuda_ctx->cuda_graph) {
+        cache.push_back(std::move(cuda_ctx->cuda_graph));
+    }
+    auto it = std::find_if(cache.begin(), cache.end(),
+                           [key](const std::unique_ptr<ggml_cuda_graph> & graph) { return graph->shape_key == key; });
+    if (it != cache.end()) {
+        cuda_ctx->cuda_graph = std::move(*it);
+        cache.erase(it);
+    } else {
+        cuda_ctx->cuda_graph.reset(new ggml_cuda_graph());
+        cuda_ctx->cuda_graph->shape_key = key;
+    }
+    while (cache.size() + 1 > n_graphs) {
+        cache.erase(cache.begin());
+    }
+}
+
 static bool check_node_graph_compatibility_and_refresh_copy_ops(ggml_backend_cuda_context * cuda_ctx, ggml_cgraph * cgraph,
     bool use_cuda_graph) {
 
@@ -2491,9 +2533,11 @@ static bool check_node_graph_compatibility_and_refresh_copy_ops(ggml_backend_cud
 #endif
         }
 
-        if (node->op == GGML_OP_ADD && node->src[1] && node->src[1]->ne[1] > 1) {
+        if (node->op == GGML_OP_ADD && node->src[1] && node->src[1]->ne[1] > 1 &&
+            ggml_cuda_graph_cache_size.load(std::memory_order_relaxed) <= 1) {
             // disable CUDA graphs for batch size > 1 for now.
             // Changes in batch size or context size can cause changes to the grid size of some kernels.
+            // With a graph per shape in the cache a batch size or context size gets its own graph instead.
             use_cuda_graph = false;
 #ifndef NDEBUG
             GGML_LOG_DEBUG("%s: disabling CUDA graphs due to batch size > 1 [%s] [%ld %ld %ld %ld]\n", __func__, node->name, node->ne[0], node->ne[1], node->ne[2], node->ne[3]);
@@ -2639,6 +2683,112 @@ static void update_cuda_graph_executable(ggml_backend_cuda_context * cuda_ctx) {
 }
 #endif
 
+// same choice of mul_mat_vec_q as ggml_cuda_mul_mat
+static bool ggml_cuda_mul_mat_uses_mmvq(const ggml_tensor * node) {
+    const ggml_tensor * src0 = node->src[0];
+    const ggml_tensor * src1 = node->src[1];
+    if (node->op != GGML_OP_MUL_MAT || ggml_backend_buft_is_cuda_split(src0->buffer->buft)) {
+        return false;
+    }
+    const bool bad_padding_clear = ggml_backend_buffer_get_usage(src0->buffer) == GGML_BACKEND_BUFFER_USAGE_COMPUTE
+        && ggml_nbytes(src0) != ggml_backend_buffer_get_alloc_size(src0->buffer, src0) && src0->view_src;
+    return ggml_is_quantized(src0->type) && !bad_padding_clear && src1->type == GGML_TYPE_F32 && node->type == GGML_TYPE_F32
+        && src1->ne[1] <= MMVQ_MAX_BATCH_SIZE;
+}
+
+static bool ggml_cuda_tensors_overlap(const ggml_tensor * a, const ggml_tensor * b) {
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// MUL_MAT -> ADD of a bias row -> RESHAPE -> M-RoPE at nodes[i], the projection of the Q or K of a layer
+static bool ggml_cuda_is_mrope_projection(ggml_cgraph * cgraph, int i) {
+    ggml_tensor * mm      = cgraph->nodes[i];
+    ggml_tensor * add     = cgraph->nodes[i + 1];
+    ggml_tensor * reshape = cgraph->nodes[i + 2];
+    ggml_tensor * rope    = cgraph->nodes[i + 3];
+    if (!ggml_cuda_mul_mat_uses_mmvq(mm) || add->op != GGML_OP_ADD || add->src[0] != mm || reshape->op != GGML_OP_RESHAPE ||
+        reshape->src[0] != add || rope->op != GGML_OP_ROPE || rope->src[0] != reshape) {
+        return false;
+    }
+    const ggml_tensor * bias = add->src[1];
+    const int mode = ((const int32_t *) rope->op_params)[2];
+    if (bias->type != GGML_TYPE_F32 || !ggml_is_contiguous(bias) || bias->ne[0] != add->ne[0] || ggml_nrows(bias) != 1 ||
+        !ggml_is_contiguous(mm) || add->type != GGML_TYPE_F32 || !ggml_is_contiguous(rope) || rope->type != GGML_TYPE_F32 ||
+        !(mode & GGML_ROPE_TYPE_MROPE) || (mode & GGML_ROPE_TYPE_NEOX) || mode == GGML_ROPE_TYPE_VISION) {
+        return false;
+    }
+    // the sum is never written, nothing else may read it
+    if ((add->flags & GGML_TENSOR_FLAG_OUTPUT) || (reshape->flags & GGML_TENSOR_FLAG_OUTPUT)) {
+        return false;
+    }
+    for (int j = i + 4; j < cgraph->n_nodes; j++) {
+        const ggml_tensor * node = cgraph->nodes[j];
+        if (node->view_src == add || node->view_src == reshape) {
+            return false;
+        }
+        for (int s = 0; s < GGML_MAX_SRC; s++) {
+            if (node->src[s] == add || node->src[s] == reshape) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Decode Q, K and V projections of an M-RoPE attention layer (Qwen2-VL): MUL_MAT, ADD bias, RESHAPE and ROPE of Q and
+// of K, then the MUL_MAT of V, all of the same activation. The activation is quantized to q8_1 once for the three
+// mat-vecs and the bias adds of Q and K run inside one rope launch: 5 kernels instead of 10, the bias add of V follows
+// as before.
+// Returns the nodes computed from i on, 0 if they do not match (or GGML_CUDA_DISABLE_FUSION is set)
+static int ggml_cuda_fuse_qkv_mrope(ggml_backend_cuda_context & ctx, ggml_cgraph * cgraph, int i) {
+    static const bool disable_fusion = getenv("GGML_CUDA_DISABLE_FUSION") != nullptr;
+    if (disable_fusion || i + 8 > cgraph->n_nodes || cgraph->nodes[i]->op != GGML_OP_MUL_MAT) {
+        return 0;
+    }
+    ggml_tensor ** nodes = cgraph->nodes + i;
+    if (!ggml_cuda_is_mrope_projection(cgraph, i) || !ggml_cuda_is_mrope_projection(cgraph, i + 4)) {
+        return 0;
+    }
+    ggml_tensor * mm_q   = nodes[0];
+    ggml_tensor * rope_q = nodes[3];
+    ggml_tensor * mm_k   = nodes[4];
+    ggml_tensor * rope_k = nodes[7];
+    ggml_tensor * mm_v   = i + 8 < cgraph->n_nodes ? nodes[8] : nullptr;
+    if (mm_k->src[1] != mm_q->src[1] || mm_k->src[0]->type != mm_q->src[0]->type || mm_k->src[0]->ne[0] != mm_q->src[0]->ne[0] ||
+        rope_k->src[1] != rope_q->src[1] || rope_k->src[2] != rope_q->src[2] || rope_k->ne[0] != rope_q->ne[0] ||
+        memcmp(rope_q->op_params, rope_k->op_params, sizeof(rope_q->op_params)) != 0) {
+        return 0;
+    }
+    if (mm_v && (!ggml_cuda_mul_mat_uses_mmvq(mm_v) || mm_v->src[1] != mm_q->src[1] || mm_v->src[0]->type != mm_q->src[0]->type ||
+                 mm_v->src[0]->ne[0] != mm_q->src[0]->ne[0])) {
+        mm_v = nullptr;
+    }
+
+    // the graph allocator placed K and V after Q was roped, they may reuse its memory: everything written here before
+    // it is read must be apart, a rope may only run in place of its own projection
+    ggml_tensor * written[] = { mm_q, mm_k, rope_q, rope_k, mm_v };
+    const int n_written = mm_v ? 5 : 4;
+    for (int a = 0; a < n_written; a++) {
+        if (ggml_cuda_tensors_overlap(written[a], mm_q->src[1])) {
+            return 0;
+        }
+        for (int b = a + 1; b < n_written; b++) {
+            const bool in_place = (written[a] == mm_q && written[b] == rope_q) || (written[a] == mm_k && written[b] == rope_k);
+            if (ggml_cuda_tensors_overlap(written[a], written[b]) && !(in_place && written[a]->data == written[b]->data)) {
+                return 0;
+            }
+        }
+    }
+
+    const ggml_tensor * src0s[] = { mm_q->src[0], mm_k->src[0], mm_v ? mm_v->src[0] : nullptr };
+    ggml_tensor * dsts[] = { mm_q, mm_k, mm_v };
+    ggml_cuda_mul_mat_vec_q_shared(ctx, src0s, mm_q->src[1], nullptr, dsts, mm_v ? 3 : 2);
+    ggml_cuda_op_rope_multi_qk_bias(ctx, rope_q, rope_k, mm_q, nodes[1]->src[1], mm_k, nodes[5]->src[1]);
+    return mm_v ? 9 : 8;
+}
+
 static void evaluate_and_capture_cuda_graph(ggml_backend_cuda_context * cuda_ctx, ggml_cgraph * cgraph,
     bool & graph_evaluated_or_captured, bool & use_cuda_graph, bool & cuda_graph_update_required) {
     // flag used to determine whether it is an integrated_gpu
@@ -2668,6 +2818,12 @@ static void evaluate_and_capture_cuda_graph(ggml_backend_cuda_context * cuda_ctx
                 GGML_UNUSED(integrated);
 #endif // NDEBUG
 
+                const int n_fused = ggml_cuda_fuse_qkv_mrope(*cuda_ctx, cgraph, i);
+                if (n_fused > 0) {
+                    i += n_fused - 1;
+                    continue;
+                }
+
                 bool ok = ggml_cuda_compute_forward(*cuda_ctx, node);
                 if (!ok) {
                     GGML_LOG_ERROR("%s: op not supported %s (%s)\n", __func__, node->name, ggml_op_name(node->op));
@@ -2713,6 +2869,14 @@ static enum ggml_status ggml_backend_cuda_graph_compute(ggml_backend_t backend,
 #ifdef USE_CUDA_GRAPH
     static const bool disable_cuda_graphs_due_to_env = (getenv("GGML_CUDA_DISABLE_GRAPHS") != nullptr);
 
+    const int n_graphs = ggml_cuda_graph_cache_size.load(std::memory_order_relaxed);
+    if (n_graphs > 1 && !disable_cuda_graphs_due_to_env) {
+        const uint64_t key = ggml_cuda_graph_shape_key(cgraph);
+        if (cuda_ctx->cuda_graph == nullptr || cuda_ctx->cuda_graph->shape_key != key) {
+            ggml_cuda_graph_select(cuda_ctx, key, n_graphs);
+        }
+    }
+
     // Objects required for CUDA Graph
     if (cuda_ctx->cuda_graph == nullptr) {
         cuda_ctx->cuda_graph.reset(new ggml_cuda_graph());
@@ -3437,6 +3601,9 @@ static void * ggml_backend_cuda_reg_get_proc_address(ggml_backend_reg_t reg, con
     if (strcmp(name, "ggml_backend_get_features") == 0) {
         return (void *)ggml_backend_cuda_get_features;
     }
+    if (strcmp(name, "ggml_backend_cuda_set_graph_cache") == 0) {
+        return (void *)ggml_backend_cuda_set_graph_cache;
+    }
     return nullptr;
 }
 
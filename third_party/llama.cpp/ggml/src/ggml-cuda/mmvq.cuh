@@ -5,6 +5,11 @@
 void ggml_cuda_mul_mat_vec_q(ggml_backend_cuda_context & ctx,
     const ggml_tensor * src0, const ggml_tensor * src1, const ggml_tensor * ids, ggml_tensor * dst);
 
+// The same src1 times n weights of one type and row length, src1 is quantized to q8_1 once for all of them,
+// e.g. the Q, K and V projections of a decode step
+void ggml_cuda_mul_mat_vec_q_shared(ggml_backend_cuda_context & ctx,
+    const ggml_tensor * const * src0s, const ggml_tensor * src1, const ggml_tensor * ids, ggml_tensor * const * dsts, int n);
+
 void ggml_cuda_op_mul_mat_vec_q(
     ggml_backend_cuda_context & ctx,
     const ggml_tensor * src0, const ggml_tensor * src1, ggml_tensor * dst, const char * src0_dd_i, const float * src1_ddf_i,
@@ -125,6 +125,29 @@ static __global__ void rope_neox(
     dst[idst + n_dims/2] = x0*sin_theta + x1*cos_theta;
 }
 
+// angle of the dimension pair i0 of token channel_x, its position is the one of the section the pair falls in
+static __device__ float rope_multi_theta(
+        const int32_t * pos, const int channel_x, const int ne2, const int i0, const float theta_scale, const mrope_sections & sections) {
+    const int sect_dims = sections.v[0] + sections.v[1] + sections.v[2] + sections.v[3];
+    const int sec_w = sections.v[1] + sections.v[0];
+    const int sector = (i0 / 2) % sect_dims;
+
+    float theta_base = 0.0;
+    if (sector < sections.v[0]) {
+        theta_base = pos[channel_x]*powf(theta_scale, i0/2.0f);
+    }
+    else if (sector >= sections.v[0] && sector < sec_w) {
+        theta_base = pos[channel_x + ne2 * 1]*powf(theta_scale, i0/2.0f);
+    }
+    else if (sector >= sec_w && sector < sec_w + sections.v[2]) {
+        theta_base = pos[channel_x + ne2 * 2]*powf(theta_scale, i0/2.0f);
+    }
+    else if (sector >= sec_w + sections.v[2]) {
+        theta_base = pos[channel_x + ne2 * 3]*powf(theta_scale, i0/2.0f);
+    }
+    return theta_base;
+}
+
 template<bool forward, bool has_ff, typename T>
 static __global__ void rope_multi(
         const T * x, T * dst, const int ne0, const int ne1, const int ne2, const int s1, const int s2,
@@ -153,33 +176,79 @@ static __global__ void rope_multi(
     const int idst = row_dst*ne0 + i0/2;
     const int ix   = channel_x*s2 + row_x*s1 + i0/2;
 
-    const int sect_dims = sections.v[0] + sections.v[1] + sections.v[2] + sections.v[3];
-    const int sec_w = sections.v[1] + sections.v[0];
-    const int sector = (i0 / 2) % sect_dims;
+    const float theta_base = rope_multi_theta(pos, channel_x, ne2, i0, theta_scale, sections);
 
-    float theta_base = 0.0;
-    if (sector < sections.v[0]) {
-        theta_base = pos[channel_x]*powf(theta_scale, i0/2.0f);
-    }
-    else if (sector >= sections.v[0] && sector < sec_w) {
-        theta_base = pos[channel_x + ne2 * 1]*powf(theta_scale, i0/2.0f);
+    const float freq_factor = has_ff ? freq_factors[i0/2] : 1.0f;
+
+    float cos_theta;
+    float sin_theta;
+
+    rope_yarn<forward>(theta_base/freq_factor, freq_scale, corr_dims, i0, ext_factor, attn_factor, cos_theta, sin_theta);
+
+    const float x0 = x[ix + 0];
+    const float x1 = x[ix + n_dims/2];
+
+    dst[idst + 0]        = x0*cos_theta - x1*sin_theta;
+    dst[idst + n_dims/2] = x0*sin_theta + x1*cos_theta;
+}
+
+struct rope_bias_rows {
+    const float * x;   // contiguous rows of ne0, the projection before its bias
+    const float * b;   // bias of the ne1 rows of a token
+    float       * dst;
+    int ne1;           // rows (heads) per token
+    int nr;            // rows of all tokens
+};
+
+// M-RoPE of the Q and K of a layer in one launch, the rows of q first, each value gets its bias added before the
+// rotation. NOTE: a thread reads the pair it writes, so dst may be x
+template<bool has_ff>
+static __global__ void rope_multi_qk_bias(
+        const rope_bias_rows q, const rope_bias_rows k, const int ne0, const int ne2, const int n_dims, const int32_t * pos,
+        const float freq_scale, const float ext_factor, const float attn_factor, const rope_corr_dims corr_dims,
+        const float theta_scale, const float * freq_factors, const mrope_sections sections) {
+    const int i0 = 2*(blockDim.y*blockIdx.y + threadIdx.y);
+
+    if (i0 >= ne0) {
+        return;
     }
-    else if (sector >= sec_w && sector < sec_w + sections.v[2]) {
-        theta_base = pos[channel_x + ne2 * 2]*powf(theta_scale, i0/2.0f);
+
+    int row_dst = blockDim.x*blockIdx.x + threadIdx.x;
+    const bool is_k = row_dst >= q.nr;
+    if (is_k) {
+        row_dst -= q.nr;
     }
-    else if (sector >= sec_w + sections.v[2]) {
-        theta_base = pos[channel_x + ne2 * 3]*powf(theta_scale, i0/2.0f);
+    const float * x   = is_k ? k.x   : q.x;
+    const float * b   = is_k ? k.b   : q.b;
+    float       * dst = is_k ? k.dst : q.dst;
+    const int     ne1 = is_k ? k.ne1 : q.ne1;
+
+    const int row_x     = row_dst % ne1;
+    const int channel_x = row_dst / ne1;
+    const int ib        = row_x*ne0;
+
+    if (i0 >= n_dims) {
+        const int i = row_dst*ne0 + i0;
+
+        dst[i + 0] = x[i + 0] + b[ib + i0 + 0];
+        dst[i + 1] = x[i + 1] + b[ib + i0 + 1];
+
+        return;
     }
 
+    const int idst = row_dst*ne0 + i0/2;
+
+    const float theta_base = rope_multi_theta(pos, channel_x, ne2, i0, theta_scale, sections);
+
     const float freq_factor = has_ff ? freq_factors[i0/2] : 1.0f;
 
     float cos_theta;
     float sin_theta;
 
-    rope_yarn<forward>(theta_base/freq_factor, freq_scale, corr_dims, i0, ext_factor, attn_factor, cos_theta, sin_theta);
+    rope_yarn<true>(theta_base/freq_factor, freq_scale, corr_dims, i0, ext_factor, attn_factor, cos_theta, sin_theta);
 
-    const float x0 = x[ix + 0];
-    const float x1 = x[ix + n_dims/2];
+    const float x0 = x[idst + 0]        + b[ib + i0/2];
+    const float x1 = x[idst + n_dims/2] + b[ib + i0/2 + n_dims/2];
 
     dst[idst + 0]        = x0*cos_theta - x1*sin_theta;
     dst[idst + n_dims/2] = x0*sin_theta + x1*cos_theta;
@@ -454,3 +523,63 @@ void ggml_cuda_op_rope(ggml_backend_cuda_context & ctx, ggml_tensor * dst) {
 void ggml_cuda_op_rope_back(ggml_backend_cuda_context & ctx, ggml_tensor * dst) {
     ggml_cuda_op_rope_impl<false>(ctx, dst);
 }
+
+void ggml_cuda_op_rope_multi_qk_bias(
+        ggml_backend_cuda_context & ctx, ggml_tensor * rope_q, ggml_tensor * rope_k,
+        const ggml_tensor * x_q, const ggml_tensor * b_q, const ggml_tensor * x_k, const ggml_tensor * b_k) {
+    GGML_ASSERT(rope_q->type == GGML_TYPE_F32 && rope_k->type == GGML_TYPE_F32);
+    GGML_ASSERT(x_q->type == GGML_TYPE_F32 && x_k->type == GGML_TYPE_F32 && b_q->type == GGML_TYPE_F32 && b_k->type == GGML_TYPE_F32);
+    GGML_ASSERT(ggml_is_contiguous(rope_q) && ggml_is_contiguous(rope_k) && ggml_is_contiguous(x_q) && ggml_is_contiguous(x_k));
+    GGML_ASSERT(ggml_nelements(x_q) == ggml_nelements(rope_q) && ggml_nelements(x_k) == ggml_nelements(rope_k));
+    GGML_ASSERT(rope_q->ne[0] == rope_k->ne[0] && rope_q->ne[2] == rope_k->ne[2]);
+    GGML_ASSERT(memcmp(rope_q->op_params, rope_k->op_params, sizeof(rope_q->op_params)) == 0);
+
+    const int64_t ne00 = rope_q->ne[0]; // head dims
+    const int64_t ne02 = rope_q->ne[2]; // tokens
+
+    const int n_dims     = ((int32_t *) rope_q->op_params)[1];
+    const int n_ctx_orig = ((int32_t *) rope_q->op_params)[4];
+    mrope_sections sections;
+
+    float freq_base;
+    float freq_scale;
+    float ext_factor;
+    float attn_factor;
+    float beta_fast;
+    float beta_slow;
+
+    memcpy(&freq_base,   (int32_t *) rope_q->op_params +  5, sizeof(float));
+    memcpy(&freq_scale,  (int32_t *) rope_q->op_params +  6, sizeof(float));
+    memcpy(&ext_factor,  (int32_t *) rope_q->op_params +  7, sizeof(float));
+    memcpy(&attn_factor, (int32_t *) rope_q->op_params +  8, sizeof(float));
+    memcpy(&beta_fast,   (int32_t *) rope_q->op_params +  9, sizeof(float));
+    memcpy(&beta_slow,   (int32_t *) rope_q->op_params + 10, sizeof(float));
+    memcpy(&sections.v,  (int32_t *) rope_q->op_params + 11, sizeof(int)*4);
+
+    GGML_ASSERT(ne00 % 2 == 0);
+    GGML_ASSERT(sections.v[0] > 0 || sections.v[1] > 0 || sections.v[2] > 0);
+
+    const int32_t * pos = (const int32_t *) rope_q->src[1]->data;
+    const float * freq_factors = rope_q->src[2] ? (const float *) rope_q->src[2]->data : nullptr;
+
+    rope_corr_dims corr_dims;
+    ggml_rope_yarn_corr_dims(n_dims, n_ctx_orig, freq_base, beta_fast, beta_slow, corr_dims.v);
+
+    const rope_bias_rows q = { (const float *) x_q->data, (const float *) b_q->data, (float *) rope_q->data, (int) rope_q->ne[1], (int) ggml_nrows(rope_q) };
+    const rope_bias_rows k = { (const float *) x_k->data, (const float *) b_k->data, (float *) rope_k->data, (int) rope_k->ne[1], (int) ggml_nrows(rope_k) };
+
+    const dim3 block_dims(1, CUDA_ROPE_BLOCK_SIZE, 1);
+    const int n_blocks_x = (ne00 + 2*CUDA_ROPE_BLOCK_SIZE - 1) / (2*CUDA_ROPE_BLOCK_SIZE);
+    const dim3 block_nums(q.nr + k.nr, n_blocks_x, 1);
+
+    const float theta_scale = powf(freq_base, -2.0f/n_dims);
+
+    cudaStream_t stream = ctx.stream();
+    if (freq_factors == nullptr) {
+        rope_multi_qk_bias<false><<<block_nums, block_dims, 0, stream>>>(
+            q, k, ne00, ne02, n_dims, pos, freq_scale, ext_factor, attn_factor, corr_dims, theta_scale, freq_factors, sections);
+    } else {
+        rope_multi_qk_bias<true><<<block_nums, block_dims, 0, stream>>>(
+            q, k, ne00, ne02, n_dims, pos, freq_scale, ext_factor, attn_factor, corr_dims, theta_scale, freq_factors, sections);
+    }
+}
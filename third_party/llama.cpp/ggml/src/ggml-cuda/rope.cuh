@@ -5,3 +5,8 @@
 void ggml_cuda_op_rope(ggml_backend_cuda_context & ctx, ggml_tensor * dst);
 
 void ggml_cuda_op_rope_back(ggml_backend_cuda_context & ctx, ggml_tensor * dst);
+
+// Decode fusion of the Q and K of an M-RoPE layer: rope_q and rope_k (same op params, positions and head size) of
+// x_q + b_q and x_k + b_k, the projections and their bias rows, in one launch
+void ggml_cuda_op_rope_multi_qk_bias(ggml_backend_cuda_context & ctx, ggml_tensor * rope_q, ggml_tensor * rope_k,
+    const ggml_tensor * x_q, const ggml_tensor * b_q, const ggml_tensor * x_k, const ggml_tensor * b_k);
@@ -23,6 +23,9 @@
 #include <mutex>
 #include <future>
 #include <thread>
+#include <fstream>
+#include <cstdio>
+#include <random>
 
 #if defined(_MSC_VER)
 # define NOMINMAX 1
@@ -368,6 +371,10 @@ struct vk_device_struct {
 
     vk::DescriptorSetLayout dsl;
 
+    // on-disk VkPipelineCache, see ggml_backend_vk_set_pipeline_cache
+    vk::PipelineCache pipeline_cache;
+    std::string pipeline_cache_path;
+
     vk_matmul_pipeline pipeline_matmul_f32 {};
     vk_matmul_pipeline pipeline_matmul_f32_f16 {};
     vk_matmul_pipeline pipeline_matmul_bf16 {};
@@ -522,6 +529,10 @@ struct vk_device_struct {
         }
         pipelines.clear();
 
+        if (pipeline_cache) {
+            device.destroyPipelineCache(pipeline_cache);
+        }
+
         device.destroyDescriptorSetLayout(dsl);
 
         device.destroy();
@@ -1172,7 +1183,7 @@ static void ggml_vk_create_pipeline_func(vk_device& device, vk_pipeline& pipelin
     }
 
     try {
-        pipeline->pipeline = device->device.createComputePipeline(VK_NULL_HANDLE, compute_pipeline_create_info).value;
+        pipeline->pipeline = device->device.createComputePipeline(device->pipeline_cache, compute_pipeline_create_info).value;
     } catch (const vk::SystemError& e) {
         std::cerr << "ggml_vulkan: Compute pipeline creation failed for " << pipeline->name << std::endl;
         std::cerr << "ggml_vulkan: " << e.what() << std::endl;
@@ -1824,6 +1835,82 @@ static uint32_t get_subgroup_size(const std::string &pipeline_name, const vk_dev
     return 0; // If no matching configuration is found
 }
 
+static std::mutex ggml_vk_pipeline_cache_mutex;
+static std::string ggml_vk_pipeline_cache_dir = getenv("GGML_VK_PIPELINE_CACHE") ? getenv("GGML_VK_PIPELINE_CACHE") : "";
+
+void ggml_backend_vk_set_pipeline_cache(const char * dir) {
+    std::lock_guard<std::mutex> guard(ggml_vk_pipeline_cache_mutex);
+    ggml_vk_pipeline_cache_dir = dir ? dir : "";
+}
+
+// The pipeline cache file is keyed by device and driver, the driver also checks the header and ignores foreign data.
+static void ggml_vk_load_pipeline_cache(vk_device& device) {
+    std::string dir;
+    {
+        std::lock_guard<std::mutex> guard(ggml_vk_pipeline_cache_mutex);
+        dir = ggml_vk_pipeline_cache_dir;
+    }
+    if (dir.empty()) {
+        return;
+    }
+
+    std::ostringstream path;
+    path << dir << "/ggml-vk-" << std::hex << std::setfill('0')
+         << std::setw(4) << device->properties.vendorID << "-" << std::setw(4) << device->properties.deviceID << "-"
+         << std::setw(8) << device->properties.driverVersion << "-";
+    for (uint8_t b : device->properties.pipelineCacheUUID) {
+        path << std::setw(2) << (uint32_t) b;
+    }
+    path << ".bin";
+    device->pipeline_cache_path = path.str();
+
+    std::vector<char> data;
+    std::ifstream in(device->pipeline_cache_path, std::ios::binary);
+    if (in) {
+        data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    vk::PipelineCacheCreateInfo pipeline_cache_create_info({}, data.size(), data.data());
+    try {
+        device->pipeline_cache = device->device.createPipelineCache(pipeline_cache_create_info);
+    } catch (const vk::SystemError& e) {
+        // note: a corrupt file must not keep the device from starting
+        GGML_LOG_WARN("ggml_vulkan: discarding pipeline cache %s: %s\n", device->pipeline_cache_path.c_str(), e.what());
+        pipeline_cache_create_info.initialDataSize = 0;
+        pipeline_cache_create_info.pInitialData = nullptr;
+        device->pipeline_cache = device->device.createPipelineCache(pipeline_cache_create_info);
+    }
+    GGML_LOG_INFO("ggml_vulkan: pipeline cache %s, %zu bytes loaded\n", device->pipeline_cache_path.c_str(), data.size());
+}
+
+// Called after every compile pass rather than only at shutdown, since the backend may never destroy its devices.
+static void ggml_vk_save_pipeline_cache(vk_device& device) {
+    if (!device->pipeline_cache) {
+        return;
+    }
+    std::vector<uint8_t> data;
+    try {
+        data = device->device.getPipelineCacheData(device->pipeline_cache);
+    } catch (const vk::SystemError& e) {
+        GGML_LOG_WARN("ggml_vulkan: failed to read pipeline cache data: %s\n", e.what());
+        return;
+    }
+    // note: write then rename, so other processes on the same device never read a partial file
+    const std::string tmp = device->pipeline_cache_path + ".tmp." + std::to_string(std::random_device{}());
+    {
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        if (!out || !out.write((const char *) data.data(), data.size())) {
+            GGML_LOG_WARN("ggml_vulkan: failed to write pipeline cache %s\n", tmp.c_str());
+            std::remove(tmp.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmp.c_str(), device->pipeline_cache_path.c_str()) != 0) {
+        GGML_LOG_WARN("ggml_vulkan: failed to save pipeline cache %s\n", device->pipeline_cache_path.c_str());
+        std::remove(tmp.c_str());
+    }
+}
+
 static void ggml_vk_load_shaders(vk_device& device) {
     VK_LOG_DEBUG("ggml_vk_load_shaders(" << device->name << ")");
 
@@ -2797,6 +2884,10 @@ static void ggml_vk_load_shaders(vk_device& device) {
         c.wait();
     }
     device->need_compiles = false;
+
+    if (!compiles.empty()) {
+        ggml_vk_save_pipeline_cache(device);
+    }
 }
 
 static bool ggml_vk_khr_cooperative_matrix_support(const vk::PhysicalDeviceProperties& props, const vk::PhysicalDeviceDriverProperties& driver_props, vk_device_architecture arch);
@@ -3394,6 +3485,7 @@ static vk_device ggml_vk_get_device(size_t idx) {
         descriptor_set_layout_create_info.setPNext(&dslbfci);
         device->dsl = device->device.createDescriptorSetLayout(descriptor_set_layout_create_info);
 
+        ggml_vk_load_pipeline_cache(device);
         ggml_vk_load_shaders(device);
 
         if (!device->single_queue) {
@@ -10287,11 +10379,19 @@ static ggml_backend_dev_t ggml_backend_vk_reg_get_device(ggml_backend_reg_t reg,
     return devices[device];
 }
 
+static void * ggml_backend_vk_reg_get_proc_address(ggml_backend_reg_t reg, const char * name) {
+    GGML_UNUSED(reg);
+    if (strcmp(name, "ggml_backend_vk_set_pipeline_cache") == 0) {
+        return (void *)ggml_backend_vk_set_pipeline_cache;
+    }
+    return nullptr;
+}
+
 static const struct ggml_backend_reg_i ggml_backend_vk_reg_i = {
     /* .get_name         = */ ggml_backend_vk_reg_get_name,
     /* .get_device_count = */ ggml_backend_vk_reg_get_device_count,
     /* .get_device       = */ ggml_backend_vk_reg_get_device,
-    /* .get_proc_address = */ NULL,
+    /* .get_proc_address = */ ggml_backend_vk_reg_get_proc_address,
 };
 
 ggml_backend_reg_t ggml_backend_vk_reg() {
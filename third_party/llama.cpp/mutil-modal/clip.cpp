@@ -16,7 +16,9 @@
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
+#include <list>
 #include <map>
+#include <mutex>
 #include <regex>
 #include <stdexcept>
 #include <unordered_set>
@@ -27,6 +29,8 @@
 #include <array>
 #include <numeric>
 #include <functional>
+#include <thread>
+#include <atomic>
 
 struct clip_logger_state g_logger_state = {GGML_LOG_LEVEL_CONT, clip_log_callback_default, NULL};
 
@@ -356,6 +360,18 @@ struct clip_model {
     ggml_tensor * mm_norm_mid_w = nullptr;
 };
 
+#define CLIP_GRAPH_CACHE_MAX 4
+
+struct clip_graph_cache_entry {
+    int nx = 0;
+    int ny = 0;
+    bool audio = false;
+    ggml_cgraph * gf = nullptr;          // nullptr until built, or after a failed compute
+    std::vector<uint8_t> buf_meta;       // graph and tensor metadata of gf
+    ggml_backend_sched_ptr sched;        // compute buffers of gf
+    std::vector<ggml_tensor *> debug_print_tensors;
+};
+
 struct clip_ctx {
     clip_model model;
 
@@ -364,12 +380,24 @@ struct clip_ctx {
 
     std::vector<uint8_t> buf_compute_meta;
 
+    // built graphs by input shape, each kept allocated in its own scheduler so that frames alternating between a
+    // few sizes (e.g. 448 and 224) only set their inputs, most recently used first
+    std::list<clip_graph_cache_entry> graph_cache;
+
     std::vector<ggml_backend_t> backend_ptrs;
     std::vector<ggml_backend_buffer_type_t> backend_buft;
 
     ggml_backend_t backend;
     ggml_backend_t backend_cpu;
+    ggml_threadpool_t threadpool = nullptr; // owned, backend_cpu computes on it instead of starting threads per graph
     ggml_backend_buffer_ptr buf;
+    std::vector<ggml_backend_buffer_ptr> bufs_extra; // linear weights in CPU extra buffer types (AMX, KleidiAI, repack)
+    ggml_backend_buffer_type_t host_buft = nullptr; // pinned host memory of the GPU device, nullptr on the CPU
+    ggml_backend_buffer_ptr buf_output; // pinned staging of the embeddings download, grown to the largest output
+
+    // bytes of the buffers above per buffer type, refreshed whenever one is allocated, see clip_memory_breakdown
+    std::mutex mem_mutex;
+    std::vector<clip_memory_breakdown_data> mem_breakdown;
 
     int max_nodes = 8192;
     ggml_backend_sched_ptr sched;
@@ -378,15 +406,46 @@ struct clip_ctx {
     bool debug_graph = false;
     std::vector<ggml_tensor *> debug_print_tensors;
 
+    int n_threads_preprocess = 1;
+
+    ggml_backend_sched_eval_callback cb_eval = nullptr;
+    void * cb_eval_user_data = nullptr;
+
+    clip_flash_attn_type flash_attn_type = CLIP_FLASH_ATTN_TYPE_AUTO; // resolved by alloc_compute_meta
+    ggml_type weight_type = GGML_TYPE_COUNT;
+    bool f16_activations = false;
+    int n_load_threads = 1;
+    // pixels uploaded as f16 0..255 and normalised by the encoder graph, half the bytes of f32 pixels to the device
+    // and no normalisation pass on the CPU; set when the encoder runs on a GPU
+    bool normalize_in_graph = false;
+
     clip_ctx(clip_context_params & ctx_params) {
+        flash_attn_type = ctx_params.flash_attn_type;
+        weight_type = ctx_params.weight_type;
+        f16_activations = ctx_params.f16_activations;
+        n_load_threads = std::max(1, ctx_params.n_load_threads);
         debug_graph = std::getenv("MTMD_DEBUG_GRAPH") != nullptr;
+        n_threads_preprocess = std::max(1, ctx_params.n_threads);
         backend_cpu = ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr);
         if (!backend_cpu) {
             throw std::runtime_error("failed to initialize CPU backend");
         }
-        backend = ctx_params.use_gpu
-                    ? ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_GPU, nullptr)
-                    : nullptr;
+        bool cpu_device = false;  // NOTE: a CPU encoder next to GPU ones, it runs on backend_cpu
+        if (ctx_params.use_gpu && ctx_params.device) {
+            ggml_backend_dev_t dev = ggml_backend_dev_by_name(ctx_params.device);
+            if (dev && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU) {
+                cpu_device = true;
+            } else if (dev) {
+                backend = ggml_backend_dev_init(dev, nullptr);
+            } else {
+                LOG_WRN("%s: device %s not found, using the first GPU\n", __func__, ctx_params.device);
+            }
+        }
+        if (!backend && !cpu_device) {
+            backend = ctx_params.use_gpu
+                        ? ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_GPU, nullptr)
+                        : nullptr;
+        }
 
         if (backend) {
             LOG_INF("%s: CLIP using %s backend\n", __func__, ggml_backend_name(backend));
@@ -397,12 +456,35 @@ struct clip_ctx {
             LOG_INF("%s: CLIP using CPU backend\n", __func__);
         }
 
+        // use the host buffer of the GPU device for the CPU inputs, the pixel upload then runs from pinned memory
+        ggml_backend_dev_t dev = backend != backend_cpu ? ggml_backend_get_device(backend) : nullptr;
+        host_buft = dev ? ggml_backend_dev_host_buffer_type(dev) : nullptr;
         backend_ptrs.push_back(backend_cpu);
-        backend_buft.push_back(ggml_backend_get_default_buffer_type(backend_cpu));
+        backend_buft.push_back(host_buft ? host_buft : ggml_backend_get_default_buffer_type(backend_cpu));
+        normalize_in_graph = backend != backend_cpu;
+        if (ctx_params.threadpool) {
+            attach_threadpool(*ctx_params.threadpool);
+        }
 
-        sched.reset(
-            ggml_backend_sched_new(backend_ptrs.data(), backend_buft.data(), backend_ptrs.size(), 8192, false, true)
-        );
+        sched.reset(new_sched());
+    }
+
+    void attach_threadpool(const ggml_threadpool_params & tpp) {
+        ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(backend_cpu));
+        auto * threadpool_new = (decltype(ggml_threadpool_new) *) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new");
+        auto * set_threadpool = (decltype(ggml_backend_cpu_set_threadpool) *) ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_set_threadpool");
+        auto * set_n_threads = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
+        if (!threadpool_new || !set_threadpool || !set_n_threads) {
+            return;
+        }
+        threadpool = threadpool_new(const_cast<ggml_threadpool_params *>(&tpp));
+        set_threadpool(backend_cpu, threadpool);
+        set_n_threads(backend_cpu, tpp.n_threads);
+        LOG_INF("%s: CLIP CPU graphs on %d persistent threads\n", __func__, tpp.n_threads);
+    }
+
+    ggml_backend_sched_t new_sched() {
+        return ggml_backend_sched_new(backend_ptrs.data(), backend_buft.data(), backend_ptrs.size(), 8192, false, true);
     }
 
     ~clip_ctx() {
@@ -412,6 +494,11 @@ struct clip_ctx {
                 ggml_backend_free(backend_cpu);
             }   
         }
+        if (threadpool) {
+            ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU));
+            auto * threadpool_free = (decltype(ggml_threadpool_free) *) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free");
+            threadpool_free(threadpool);
+        }
     }
 
     // this function is added so that we don't change too much of the existing code
@@ -1704,6 +1791,20 @@ private:
     }
 
     ggml_tensor * build_inp_raw(int channels = 3) {
+        if (channels == 3 && ctx->normalize_in_graph) {
+            // f16 pixels 0..255, (v / 255 - mean) / std per channel as v * scale + bias
+            ggml_tensor * inp_raw = ggml_new_tensor_3d(ctx0, GGML_TYPE_F16, img.nx, img.ny, channels);
+            ggml_set_name(inp_raw, "inp_raw");
+            ggml_set_input(inp_raw);
+            ggml_tensor * scale = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 1, 1, channels);
+            ggml_set_name(scale, "inp_norm_scale");
+            ggml_set_input(scale);
+            ggml_tensor * bias = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 1, 1, channels);
+            ggml_set_name(bias, "inp_norm_bias");
+            ggml_set_input(bias);
+            ggml_tensor * inp = ggml_cast(ctx0, inp_raw, GGML_TYPE_F32);
+            return ggml_add(ctx0, ggml_mul(ctx0, inp, scale), bias);
+        }
         ggml_tensor * inp_raw = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, img.nx, img.ny, channels);
         ggml_set_name(inp_raw, "inp_raw");
         ggml_set_input(inp_raw);
@@ -1836,14 +1937,29 @@ private:
         ggml_tensor * k = ggml_permute(ctx0, k_cur, 0, 2, 1, 3);
         //cb(k, "k", il);
 
-        ggml_tensor * v = ggml_permute(ctx0, v_cur, 1, 2, 0, 3);
-        v = ggml_cont(ctx0, v);
-        //cb(k, "v", il);
-
         ggml_tensor * cur;
 
-        // TODO @ngxson : support flash attention
-        {
+        // the fused kernel never materialises the n_patches x n_patches scores of a head
+        // masked (windowed) attention keeps the explicit path, the flash kernel needs a padded f16 mask
+        if (ctx->flash_attn_type == CLIP_FLASH_ATTN_TYPE_ENABLED && kq_mask == nullptr) {
+            ggml_tensor * v = ggml_permute(ctx0, v_cur, 0, 2, 1, 3);
+            k = ggml_cast(ctx0, k, GGML_TYPE_F16);
+            v = ggml_cast(ctx0, v, GGML_TYPE_F16);
+
+            cur = ggml_flash_attn_ext(ctx0, q, k, v, nullptr, kq_scale, 0.0f, 0.0f);
+            ggml_flash_attn_ext_set_prec(cur, GGML_PREC_F32);
+            cur = ggml_reshape_2d(ctx0, cur, cur->ne[0]*cur->ne[1], cur->ne[2]*cur->ne[3]);
+        } else {
+            ggml_tensor * v = ggml_permute(ctx0, v_cur, 1, 2, 0, 3);
+            if (ctx->f16_activations) {
+                // halves the K/V reads of both products, the copy makes V contiguous like ggml_cont
+                k = ggml_cast(ctx0, k, GGML_TYPE_F16);
+                v = ggml_cast(ctx0, v, GGML_TYPE_F16);
+            } else {
+                v = ggml_cont(ctx0, v);
+            }
+            //cb(k, "v", il);
+
             const auto n_tokens = q->ne[1];
             const auto n_head   = q->ne[2];
             // const auto n_kv     = k->ne[1]; // for flash attention
@@ -1991,6 +2107,49 @@ static ggml_cgraph * clip_image_build_graph(clip_ctx * ctx, const clip_image_f32
     return res;
 }
 
+static void clip_update_memory_breakdown(clip_ctx * ctx) {
+    std::vector<clip_memory_breakdown_data> mb;
+    auto entry = [&mb](ggml_backend_buffer_type_t buft) -> clip_memory_breakdown_data & {
+        const char * name = ggml_backend_buft_name(buft);
+        for (auto & e : mb) {
+            if (strcmp(e.buft, name) == 0) {
+                return e;
+            }
+        }
+        ggml_backend_dev_t dev = ggml_backend_buft_get_device(buft);
+        mb.push_back({name, dev ? ggml_backend_dev_name(dev) : nullptr, 0, 0, 0});
+        return mb.back();
+    };
+    auto add_buffer = [&entry](const ggml_backend_buffer_ptr & buf) -> clip_memory_breakdown_data * {
+        return buf ? &entry(ggml_backend_buffer_get_type(buf.get())) : nullptr;
+    };
+    auto add_sched = [ctx, &entry](const ggml_backend_sched_ptr & sched) {
+        for (size_t i = 0; sched && i < ctx->backend_ptrs.size(); ++i) {
+            const size_t size = ggml_backend_sched_get_buffer_size(sched.get(), ctx->backend_ptrs[i]);
+            if (size > 0) {
+                entry(ctx->backend_buft[i]).compute += size;
+            }
+        }
+    };
+
+    if (auto * e = add_buffer(ctx->buf)) {
+        e->model += ggml_backend_buffer_get_size(ctx->buf.get());
+    }
+    for (const auto & buf : ctx->bufs_extra) {
+        add_buffer(buf)->model += ggml_backend_buffer_get_size(buf.get());
+    }
+    add_sched(ctx->sched);
+    for (const auto & cached : ctx->graph_cache) {
+        add_sched(cached.sched);
+    }
+    if (auto * e = add_buffer(ctx->buf_output)) {
+        e->output += ggml_backend_buffer_get_size(ctx->buf_output.get());
+    }
+
+    std::lock_guard<std::mutex> lock(ctx->mem_mutex);
+    ctx->mem_breakdown = std::move(mb);
+}
+
 struct clip_model_loader {
     ggml_context_ptr ctx_meta;
     gguf_context_ptr ctx_gguf;
@@ -2554,40 +2713,234 @@ struct clip_model_loader {
                 GGML_ASSERT(false && "unknown projector type");
         }
 
-        // load data
+        // tensors are loaded in the file's type, except that
+        // - quantized tensors feeding conv, add and norm ops are dequantized, the backends only take F16/F32 there
+        // - linear weights are converted to weight_type where its block size divides their rows
+        auto set_type = [](ggml_tensor * t, ggml_type type) {
+            t->type  = type;
+            t->nb[0] = ggml_type_size(type);
+            t->nb[1] = t->nb[0]*(t->ne[0]/ggml_blck_size(type));
+            for (int i = 2; i < GGML_MAX_DIMS; i++) {
+                t->nb[i] = t->nb[i - 1]*t->ne[i - 1];
+            }
+        };
         {
-            std::vector<uint8_t> read_buf;
-
-            auto fin = std::ifstream(fname, std::ios::binary);
-            if (!fin) {
-                throw std::runtime_error(string_format("%s: failed to open %s\n", __func__, fname.c_str()));
+            std::vector<ggml_tensor *> dense = {
+                model.class_embedding, model.pre_ln_w, model.pre_ln_b, model.post_ln_w, model.post_ln_b,
+                model.patch_bias, model.patch_embeddings_0, model.patch_embeddings_1, model.position_embeddings,
+            };
+            for (const auto & layer : model.layers) {
+                dense.insert(dense.end(), {
+                    layer.k_norm, layer.q_norm, layer.ln_1_w, layer.ln_2_w, layer.ls_1_w, layer.ls_2_w,
+                    layer.k_b, layer.q_b, layer.v_b, layer.o_b, layer.ln_1_b, layer.ln_2_b,
+                    layer.ff_up_b, layer.ff_gate_b, layer.ff_down_b,
+                });
+            }
+            for (ggml_tensor * t : dense) {
+                if (t && ggml_is_quantized(t->type)) {
+                    set_type(t, GGML_TYPE_F32);
+                }
+            }
+        }
+        if (ctx_clip.weight_type != GGML_TYPE_COUNT && ggml_quantize_requires_imatrix(ctx_clip.weight_type)) {
+            LOG_WRN("%s: %s needs an importance matrix, keeping the file's weight types\n",
+                    __func__, ggml_type_name(ctx_clip.weight_type));
+            ctx_clip.weight_type = GGML_TYPE_COUNT;
+        }
+        std::vector<ggml_tensor *> linear;
+        for (const auto & layer : model.layers) {
+            linear.insert(linear.end(), {
+                layer.q_w, layer.k_w, layer.v_w, layer.o_w, layer.ff_up_w, layer.ff_gate_w, layer.ff_down_w,
+            });
+        }
+        if (model.proj_type == PROJECTOR_TYPE_QWEN2VL || model.proj_type == PROJECTOR_TYPE_QWEN25VL) {
+            linear.insert(linear.end(), { model.mm_0_w, model.mm_1_w });
+        }
+        if (ctx_clip.weight_type != GGML_TYPE_COUNT) {
+            int n_converted = 0;
+            int n_kept = 0;
+            for (ggml_tensor * t : linear) {
+                if (!t || t->type == ctx_clip.weight_type) {
+                    continue;
+                }
+                if (t->ne[0] % ggml_blck_size(ctx_clip.weight_type) == 0) {
+                    set_type(t, ctx_clip.weight_type);
+                    n_converted++;
+                } else {
+                    n_kept++;
+                }
             }
+            LOG_INF("%s: %d linear weights converted to %s, %d kept as their row size is not a multiple of its block\n",
+                    __func__, n_converted, ggml_type_name(ctx_clip.weight_type), n_kept);
+        }
 
+        // load data
+        {
             // alloc memory and offload data
+            if (ctx_clip.backend == ctx_clip.backend_cpu) {
+                alloc_cpu_extra_weights(ctx_clip, linear);
+            }
+            // NOTE: only the tensors not placed in an extra buffer
             ggml_backend_buffer_type_t buft = ggml_backend_get_default_buffer_type(ctx_clip.backend);
             ctx_clip.buf.reset(ggml_backend_alloc_ctx_tensors_from_buft(ctx_clip.ctx_data.get(), buft));
             ggml_backend_buffer_set_usage(ctx_clip.buf.get(), GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
-            for (auto & t : tensors_to_load) {
-                ggml_tensor * cur = ggml_get_tensor(ctx_clip.ctx_data.get(), t->name);
-                const size_t offset = tensor_offset[t->name];
-                fin.seekg(offset, std::ios::beg);
+
+            // reads tensors[next++] until none is left, with its own file and conversion buffers
+            auto load = [&](const std::vector<ggml_tensor *> & tensors, std::atomic<size_t> & next) {
+                std::vector<uint8_t> read_buf;
+                std::vector<float> f32_buf;
+                std::vector<uint8_t> conv_buf;
+
+                auto fin = std::ifstream(fname, std::ios::binary);
                 if (!fin) {
-                    throw std::runtime_error(string_format("%s: failed to seek for tensor %s\n", __func__, t->name));
+                    throw std::runtime_error(string_format("%s: failed to open %s\n", __func__, fname.c_str()));
                 }
-                size_t num_bytes = ggml_nbytes(cur);
-                if (ggml_backend_buft_is_host(buft)) {
-                    // for the CPU and Metal backend, we can read directly into the tensor
-                    fin.read(reinterpret_cast<char *>(cur->data), num_bytes);
-                } else {
-                    // read into a temporary buffer first, then copy to device memory
-                    read_buf.resize(num_bytes);
-                    fin.read(reinterpret_cast<char *>(read_buf.data()), num_bytes);
-                    ggml_backend_tensor_set(cur, read_buf.data(), 0, num_bytes);
+                for (size_t k; (k = next++) < tensors.size();) {
+                    ggml_tensor * t = tensors[k];
+                    ggml_tensor * cur = ggml_get_tensor(ctx_clip.ctx_data.get(), t->name);
+                    const size_t offset = tensor_offset.at(t->name);
+                    fin.seekg(offset, std::ios::beg);
+                    if (!fin) {
+                        throw std::runtime_error(
+                            string_format("%s: failed to seek for tensor %s\n", __func__, t->name));
+                    }
+                    size_t num_bytes = ggml_nbytes(cur);
+                    if (cur->type != t->type) {
+                        // t keeps the file's type, convert through F32
+                        read_buf.resize(ggml_nbytes(t));
+                        fin.read(reinterpret_cast<char *>(read_buf.data()), read_buf.size());
+                        const int64_t n_per_row = t->ne[0];
+                        const int64_t nrows     = ggml_nelements(t)/n_per_row;
+                        const float * src = reinterpret_cast<const float *>(read_buf.data());
+                        if (t->type != GGML_TYPE_F32) {
+                            f32_buf.resize(ggml_nelements(t));
+                            ggml_get_type_traits(t->type)->to_float(read_buf.data(), f32_buf.data(), ggml_nelements(t));
+                            src = f32_buf.data();
+                        }
+                        if (cur->type == GGML_TYPE_F32) {
+                            ggml_backend_tensor_set(cur, src, 0, num_bytes);
+                        } else {
+                            conv_buf.resize(num_bytes);
+                            ggml_quantize_chunk(cur->type, src, conv_buf.data(), 0, nrows, n_per_row, nullptr);
+                            ggml_backend_tensor_set(cur, conv_buf.data(), 0, num_bytes);
+                        }
+                    } else if (ggml_backend_buft_is_host(ggml_backend_buffer_get_type(cur->buffer))) {
+                        // for the CPU and Metal backend, we can read directly into the tensor
+                        fin.read(reinterpret_cast<char *>(cur->data), num_bytes);
+                    } else {
+                        // read into a temporary buffer first, then copy to device memory
+                        read_buf.resize(num_bytes);
+                        fin.read(reinterpret_cast<char *>(read_buf.data()), num_bytes);
+                        ggml_backend_tensor_set(cur, read_buf.data(), 0, num_bytes);
+                    }
+                }
+            };
+
+            // the tensors of the weights buffer are read and uploaded by n_load_threads threads, each with its own
+            // file, the ones in extra buffers stay on this thread: their upload may go through its repack cache
+            std::vector<ggml_tensor *> pooled;
+            std::vector<ggml_tensor *> local;
+            for (auto & t : tensors_to_load) {
+                ggml_tensor * cur = ggml_get_tensor(ctx_clip.ctx_data.get(), t->name);
+                (cur->buffer == ctx_clip.buf.get() ? pooled : local).push_back(t);
+            }
+            const int n_threads = std::min<int>(ctx_clip.n_load_threads, pooled.size());
+            if (n_threads <= 1) {
+                local.insert(local.end(), pooled.begin(), pooled.end());
+                pooled.clear();
+            }
+            std::atomic<size_t> next_tensor{0};
+            std::exception_ptr error;
+            std::mutex error_mutex;
+            std::vector<std::thread> workers;
+            for (int i = 0; i < n_threads && !pooled.empty(); i++) {
+                workers.emplace_back([&]() {
+                    try {
+                        load(pooled, next_tensor);
+                    } catch (...) {
+                        std::lock_guard<std::mutex> lock(error_mutex);
+                        error = std::current_exception();
+                        next_tensor = pooled.size();
+                    }
+                });
+            }
+            try {
+                std::atomic<size_t> next_local{0};
+                load(local, next_local);
+            } catch (...) {
+                next_tensor = pooled.size();
+                for (auto & worker : workers) {
+                    worker.join();
                 }
+                throw;
             }
-            fin.close();
+            for (auto & worker : workers) {
+                worker.join();
+            }
+            if (error) {
+                std::rethrow_exception(error);
+            }
+
+            LOG_DBG("%s: loaded %zu tensors from %s with %d threads\n", __func__, tensors_to_load.size(),
+                    fname.c_str(), std::max(1, n_threads));
+        }
+    }
 
-            LOG_DBG("%s: loaded %zu tensors from %s\n", __func__, tensors_to_load.size(), fname.c_str());
+    // whether the CPU runs the matmul of weight w from buft
+    static bool cpu_extra_supported(ggml_backend_dev_t dev, ggml_backend_buffer_type_t buft, ggml_tensor * w) {
+        ggml_init_params params = {
+            /*.mem_size   =*/ ggml_tensor_overhead()*4,
+            /*.mem_buffer =*/ NULL,
+            /*.no_alloc   =*/ true,
+        };
+        ggml_context_ptr ctx { ggml_init(params) };
+        ggml_tensor * b  = ggml_new_tensor_4d(ctx.get(), GGML_TYPE_F32, w->ne[0], 512, w->ne[2], w->ne[3]);
+        ggml_tensor * op = ggml_mul_mat(ctx.get(), w, b);
+        ggml_backend_buffer_t dummy = ggml_backend_buft_alloc_buffer(buft, 0);
+        ggml_backend_buffer_t prev  = w->buffer;
+        w->buffer = dummy;
+        bool supported = ggml_backend_dev_supports_op(dev, op);
+        w->buffer = prev;
+        ggml_backend_buffer_free(dummy);
+        return supported;
+    }
+
+    // CPU encoder: the linear weights an extra buffer type of the CPU backend (AMX, KleidiAI, repack) takes are placed
+    // there and repacked on upload, so the encoder matmuls run its kernels like the LLM ones do
+    void alloc_cpu_extra_weights(clip_ctx & ctx_clip, const std::vector<ggml_tensor *> & linear) {
+        ggml_backend_dev_t cpu_dev = ggml_backend_get_device(ctx_clip.backend_cpu);
+        ggml_backend_reg_t cpu_reg = ggml_backend_dev_backend_reg(cpu_dev);
+        auto get_extra_bufts = (ggml_backend_dev_get_extra_bufts_t)
+            ggml_backend_reg_get_proc_address(cpu_reg, "ggml_backend_dev_get_extra_bufts");
+        if (!get_extra_bufts) {
+            return;
+        }
+        for (ggml_backend_buffer_type_t * bufts = get_extra_bufts(cpu_dev); bufts && *bufts; ++bufts) {
+            ggml_backend_buffer_type_t buft = *bufts;
+            std::vector<ggml_tensor *> placed;
+            size_t size = 0;
+            for (ggml_tensor * t : linear) {
+                if (!t || t->buffer || !cpu_extra_supported(cpu_dev, buft, t)) {
+                    continue;
+                }
+                placed.push_back(t);
+                size += GGML_PAD(ggml_backend_buft_get_alloc_size(buft, t), ggml_backend_buft_get_alignment(buft));
+            }
+            if (placed.empty()) {
+                continue;
+            }
+            ggml_backend_buffer_t buf = ggml_backend_buft_alloc_buffer(buft, size);
+            if (!buf) {
+                LOG_WRN("%s: failed to allocate %zu bytes of %s\n", __func__, size, ggml_backend_buft_name(buft));
+                continue;
+            }
+            ggml_backend_buffer_set_usage(buf, GGML_BACKEND_BUFFER_USAGE_WEIGHTS);
+            ggml_tallocr alloc = ggml_tallocr_new(buf);
+            for (ggml_tensor * t : placed) {
+                ggml_tallocr_alloc(&alloc, t);
+            }
+            ctx_clip.bufs_extra.emplace_back(buf);
+            LOG_INF("%s: %zu linear weights in %s\n", __func__, placed.size(), ggml_backend_buft_name(buft));
         }
     }
 
@@ -2607,8 +2960,25 @@ struct clip_model_loader {
         }
         batch.entries.push_back(std::move(img));
 
+        if (ctx_clip.flash_attn_type == CLIP_FLASH_ATTN_TYPE_AUTO) {
+            // enabled unless an attention node would fall back from the encoder backend (e.g. an unsupported head size)
+            ctx_clip.flash_attn_type = CLIP_FLASH_ATTN_TYPE_ENABLED;
+            ggml_cgraph * gf = clip_image_build_graph(&ctx_clip, batch);
+            for (int i = 0; i < ggml_graph_n_nodes(gf); i++) {
+                ggml_tensor * node = ggml_graph_node(gf, i);
+                if (node->op == GGML_OP_FLASH_ATTN_EXT && !ggml_backend_supports_op(ctx_clip.backend, node)) {
+                    ctx_clip.flash_attn_type = CLIP_FLASH_ATTN_TYPE_DISABLED;
+                    break;
+                }
+            }
+        }
+        LOG_INF("%s: flash attention %s\n", __func__,
+                ctx_clip.flash_attn_type == CLIP_FLASH_ATTN_TYPE_ENABLED ? "enabled" : "disabled");
+
         ggml_cgraph * gf = clip_image_build_graph(&ctx_clip, batch);
         ggml_backend_sched_reserve(ctx_clip.sched.get(), gf);
+        ctx_clip.graph_cache.clear();
+        clip_update_memory_breakdown(&ctx_clip);
 
         for (size_t i = 0; i < ctx_clip.backend_ptrs.size(); ++i) {
             ggml_backend_t backend = ctx_clip.backend_ptrs[i];
@@ -2817,6 +3187,43 @@ static void normalize_image_u8_to_f32(const clip_image_u8 & src, clip_image_f32
     }
 }
 
+// run fn(0) .. fn(n - 1) on up to n_threads threads, the calling thread included
+static void clip_parallel_for(int n, int n_threads, const std::function<void(int)> & fn) {
+    n_threads = std::min(n_threads, n);
+    if (n_threads <= 1) {
+        for (int i = 0; i < n; i++) {
+            fn(i);
+        }
+        return;
+    }
+    std::atomic<int> next{0};
+    auto worker = [&]() {
+        for (int i = next++; i < n; i = next++) {
+            fn(i);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < n_threads; t++) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto & w : workers) {
+        w.join();
+    }
+}
+
+// normalize each image into res_imgs->entries, in parallel
+static void normalize_images_u8_to_f32(const std::vector<clip_image_u8_ptr> & imgs, clip_image_f32_batch * res_imgs,
+                                       const float mean[3], const float std[3], int n_threads) {
+    size_t n_prev = res_imgs->entries.size();
+    for (size_t i = 0; i < imgs.size(); ++i) {
+        res_imgs->entries.emplace_back(clip_image_f32_init());
+    }
+    clip_parallel_for((int)imgs.size(), n_threads, [&](int i) {
+        normalize_image_u8_to_f32(*imgs[i], *res_imgs->entries[n_prev + i], mean, std);
+    });
+}
+
 // set of tools to manupulate images
 // in the future, we can have HW acceleration by allowing this struct to access 3rd party lib like imagick or opencv
 struct image_manipulation {
@@ -2920,6 +3327,89 @@ struct image_manipulation {
         return true;
     }
 
+    // bicubic_resize then normalize_image_u8_to_f32 in one pass, same values (rounded to u8 before normalising).
+    // Separable: each source row is interpolated along x once (a ring of the 4 rows an output row reads), then
+    // along y, instead of 4 rows x 4 taps per output value
+    static void bicubic_resize_normalize(const clip_image_u8 & img, clip_image_f32 & dst, int target_width, int target_height,
+                                         const float mean[3], const float std[3]) {
+        const int nx = img.nx;
+        const int ny = img.ny;
+
+        dst.nx = target_width;
+        dst.ny = target_height;
+        dst.buf.resize(3 * target_width * target_height);
+
+        float lut[3][256];
+        for (int c = 0; c < 3; c++) {
+            for (int v = 0; v < 256; v++) {
+                lut[c][v] = (static_cast<float>(v) / 255.0f - mean[c]) / std[c];
+            }
+        }
+
+        const float tx = (float)nx / (float)target_width;
+        const float ty = (float)ny / (float)target_height;
+
+        std::vector<int>   col_x(4 * target_width);
+        std::vector<float> col_dx(target_width);
+        for (int j = 0; j < target_width; j++) {
+            const int x = (int)(tx * j);
+            col_dx[j] = tx * j - x;
+            for (int t = 0; t < 4; t++) {
+                col_x[4 * j + t] = clip(x - 1 + t, 0, nx - 1) * 3;
+            }
+        }
+
+        // row ring, slot r % 4 holds source row r interpolated along x
+        std::vector<float> rows(4 * 3 * target_width);
+        int row_tag[4] = {-1, -1, -1, -1};
+        auto x_row = [&](int r) -> const float * {
+            float * out = rows.data() + (r % 4) * 3 * target_width;
+            if (row_tag[r % 4] == r) {
+                return out;
+            }
+            row_tag[r % 4] = r;
+            const uint8_t * src = img.buf.data() + (size_t)r * nx * 3;
+            for (int j = 0; j < target_width; j++) {
+                const int * xs = &col_x[4 * j];
+                const float dx = col_dx[j];
+                for (int k = 0; k < 3; k++) {
+                    const float d0 = src[xs[0] + k] - src[xs[1] + k];
+                    const float d2 = src[xs[2] + k] - src[xs[1] + k];
+                    const float d3 = src[xs[3] + k] - src[xs[1] + k];
+                    const float a0 = src[xs[1] + k];
+                    const float a1 = -1.0 / 3 * d0 + d2 - 1.0 / 6 * d3;
+                    const float a2 =  1.0 / 2 * d0 +      1.0 / 2 * d2;
+                    const float a3 = -1.0 / 6 * d0 -      1.0 / 2 * d2 + 1.0 / 6 * d3;
+                    out[3 * j + k] = a0 + a1 * dx + a2 * dx * dx + a3 * dx * dx * dx;
+                }
+            }
+            return out;
+        };
+
+        for (int i = 0; i < target_height; i++) {
+            const int y = (int)(ty * i);
+            const float dy = ty * i - y;
+            const float * C[4];
+            for (int t = 0; t < 4; t++) {
+                C[t] = x_row(clip(y - 1 + t, 0, ny - 1));
+            }
+            float * out = dst.buf.data() + (size_t)i * target_width * 3;
+            for (int n = 0; n < 3 * target_width; n++) {
+                const float d0 = C[0][n] - C[1][n];
+                const float d2 = C[2][n] - C[1][n];
+                const float d3 = C[3][n] - C[1][n];
+                const float a0 = C[1][n];
+                const float a1 = -1.0 / 3 * d0 + d2 - 1.0 / 6 * d3;
+                const float a2 =  1.0 / 2 * d0 +      1.0 / 2 * d2;
+                const float a3 = -1.0 / 6 * d0 -      1.0 / 2 * d2 + 1.0 / 6 * d3;
+                const float Cc = a0 + a1 * dy + a2 * dy * dy + a3 * dy * dy * dy;
+
+                const uint8_t Cc2 = std::min(std::max(std::round(Cc), 0.0f), 255.0f);
+                out[n] = lut[n % 3][Cc2];
+            }
+        }
+    }
+
     // llava-1.6 type of resize_and_pad
     // if the ratio is not 1:1, padding with pad_color will be applied
     // pad_color is single channel, default is 0 (black)
@@ -3153,37 +3643,38 @@ struct llava_uhd {
         return res;
     }
 
-    static std::vector<clip_image_u8_ptr> slice_image(const clip_image_u8 * img, const slice_instructions & inst) {
+    // the overview and the refined image are resized in parallel, then the slices are cropped in parallel
+    static std::vector<clip_image_u8_ptr> slice_image(const clip_image_u8 * img, const slice_instructions & inst,
+                                                      int n_threads = 1) {
         std::vector<clip_image_u8_ptr> output;
 
         // resize to overview size
         clip_image_u8_ptr resized_img(clip_image_u8_init());
-        image_manipulation::bicubic_resize(*img, *resized_img, inst.overview_size.width, inst.overview_size.height);
+        // resize to refined size
+        clip_image_u8_ptr refined_img(clip_image_u8_init());
+        clip_parallel_for(inst.slices.empty() ? 1 : 2, n_threads, [&](int i) {
+            if (i == 0) {
+                image_manipulation::bicubic_resize(*img, *resized_img, inst.overview_size.width, inst.overview_size.height);
+            } else if (inst.padding_refined) {
+                image_manipulation::resize_and_pad_image(*img, *refined_img, inst.refined_size);
+            } else {
+                image_manipulation::bilinear_resize(*img, *refined_img, inst.refined_size.width, inst.refined_size.height);
+            }
+        });
         output.push_back(std::move(resized_img));
         if (inst.slices.empty()) {
             // no slices, just return the resized image
             return output;
         }
 
-        // resize to refined size
-        clip_image_u8_ptr refined_img(clip_image_u8_init());
-        if (inst.padding_refined) {
-            image_manipulation::resize_and_pad_image(*img, *refined_img, inst.refined_size);
-        } else {
-            image_manipulation::bilinear_resize(*img, *refined_img, inst.refined_size.width, inst.refined_size.height);
-        }
-
         // create slices
-        for (const auto & slice : inst.slices) {
-            int x = slice.x;
-            int y = slice.y;
-            int w = slice.size.width;
-            int h = slice.size.height;
-
-            clip_image_u8_ptr img_slice(clip_image_u8_init());
-            image_manipulation::crop_image(*refined_img, *img_slice, x, y, w, h);
-            output.push_back(std::move(img_slice));
+        for (size_t i = 0; i < inst.slices.size(); i++) {
+            output.emplace_back(clip_image_u8_init());
         }
+        clip_parallel_for((int)inst.slices.size(), n_threads, [&](int i) {
+            const auto & slice = inst.slices[i];
+            image_manipulation::crop_image(*refined_img, *output[1 + i], slice.x, slice.y, slice.size.width, slice.size.height);
+        });
 
         return output;
     }
@@ -3322,32 +3813,28 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, str
     if (params.mm_patch_merge_type == PATCH_MERGE_SPATIAL_UNPAD) {
         pad_to_square = false;
     }
+    // normalised by the encoder graph: the pixels stay 0..255 (v / 255 / (1 / 255), exact once rounded to f16)
+    static const float raw_mean[3] = {0.0f, 0.0f, 0.0f};
+    static const float raw_std[3] = {1.0f / 255.0f, 1.0f / 255.0f, 1.0f / 255.0f};
+    const float * image_mean = ctx->normalize_in_graph ? raw_mean : params.image_mean;
+    const float * image_std = ctx->normalize_in_graph ? raw_std : params.image_std;
 
     if (clip_is_minicpmv(ctx)) {
         auto const inst = llava_uhd::get_slice_instructions(ctx, original_size);
-        std::vector<clip_image_u8_ptr> imgs = llava_uhd::slice_image(img, inst);
-
-        for (size_t i = 0; i < imgs.size(); ++i) {
-            // clip_image_save_to_bmp(*imgs[i], "slice_" + std::to_string(i) + ".bmp");
-            clip_image_f32_ptr res(clip_image_f32_init());
-            normalize_image_u8_to_f32(*imgs[i], *res, params.image_mean, params.image_std);
-            res_imgs->entries.push_back(std::move(res));
-        }
+        std::vector<clip_image_u8_ptr> imgs = llava_uhd::slice_image(img, inst, ctx->n_threads_preprocess);
+        normalize_images_u8_to_f32(imgs, res_imgs, image_mean, image_std, ctx->n_threads_preprocess);
 
         res_imgs->grid_x = inst.grid_size.width;
         res_imgs->grid_y = inst.grid_size.height;
         return true;
 
     } else if (ctx->proj_type() == PROJECTOR_TYPE_QWEN2VL || ctx->proj_type() == PROJECTOR_TYPE_QWEN25VL) {
-        clip_image_u8 resized;
         auto patch_size = params.patch_size * 2;
         auto new_size = image_manipulation::calc_size_preserved_ratio(original_size, patch_size, params.image_size);
-        image_manipulation::bicubic_resize(*img, resized, new_size.width, new_size.height);
 
         clip_image_f32_ptr img_f32(clip_image_f32_init());
-        // clip_image_f32_ptr res(clip_image_f32_init());
-        normalize_image_u8_to_f32(resized, *img_f32, params.image_mean, params.image_std);
-        // res_imgs->data[0] = *res;
+        image_manipulation::bicubic_resize_normalize(*img, *img_f32, new_size.width, new_size.height,
+                                                     image_mean, image_std);
         res_imgs->entries.push_back(std::move(img_f32));
         return true;
     }
@@ -3361,7 +3848,7 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, str
         image_manipulation::resize_and_pad_image(*img, resized_image, {sz, sz});
         clip_image_f32_ptr img_f32(clip_image_f32_init());
         //clip_image_save_to_bmp(resized_image, "resized.bmp");
-        normalize_image_u8_to_f32(resized_image, *img_f32, params.image_mean, params.image_std);
+        normalize_image_u8_to_f32(resized_image, *img_f32, image_mean, image_std);
         res_imgs->entries.push_back(std::move(img_f32));
         return true;
 
@@ -3370,20 +3857,15 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, str
         auto new_size = image_manipulation::calc_size_preserved_ratio(original_size, params.patch_size, params.image_size);
         image_manipulation::bilinear_resize(*img, resized_image, new_size.width, new_size.height);
         clip_image_f32_ptr img_f32(clip_image_f32_init());
-        normalize_image_u8_to_f32(resized_image, *img_f32, params.image_mean, params.image_std);
+        normalize_image_u8_to_f32(resized_image, *img_f32, image_mean, image_std);
         res_imgs->entries.push_back(std::move(img_f32));
         return true;
 
     } else if (ctx->proj_type() == PROJECTOR_TYPE_LLAMA4) {
         GGML_ASSERT(!params.image_res_candidates.empty());
         auto const inst = llava_uhd::get_slice_instructions(ctx, original_size);
-        std::vector<clip_image_u8_ptr> imgs = llava_uhd::slice_image(img, inst);
-
-        for (size_t i = 0; i < imgs.size(); ++i) {
-            clip_image_f32_ptr res(clip_image_f32_init());
-            normalize_image_u8_to_f32(*imgs[i], *res, params.image_mean, params.image_std);
-            res_imgs->entries.push_back(std::move(res));
-        }
+        std::vector<clip_image_u8_ptr> imgs = llava_uhd::slice_image(img, inst, ctx->n_threads_preprocess);
+        normalize_images_u8_to_f32(imgs, res_imgs, image_mean, image_std, ctx->n_threads_preprocess);
 
         res_imgs->grid_x = inst.grid_size.width;
         res_imgs->grid_y = inst.grid_size.height;
@@ -3411,21 +3893,15 @@ bool clip_image_preprocess(struct clip_ctx * ctx, const clip_image_u8 * img, str
         image_manipulation::resize_and_pad_image(*img, *temp, clip_image_size{params.image_size, params.image_size}, pad_color);
 
         clip_image_f32_ptr res(clip_image_f32_init());
-        normalize_image_u8_to_f32(*temp, *res, params.image_mean, params.image_std);
+        normalize_image_u8_to_f32(*temp, *res, image_mean, image_std);
         res_imgs->entries.push_back(std::move(res));
         return true;
 
     } else if (!params.image_res_candidates.empty()) {
         // "spatial_unpad" with "anyres" processing for llava-1.6
         auto const inst = llava_uhd::get_slice_instructions(ctx, original_size);
-        std::vector<clip_image_u8_ptr> imgs = llava_uhd::slice_image(img, inst);
-
-        for (size_t i = 0; i < imgs.size(); ++i) {
-            // clip_image_save_to_bmp(*imgs[i], "slice_" + std::to_string(i) + ".bmp");
-            clip_image_f32_ptr res(clip_image_f32_init());
-            normalize_image_u8_to_f32(*imgs[i], *res, params.image_mean, params.image_std);
-            res_imgs->entries.push_back(std::move(res));
-        }
+        std::vector<clip_image_u8_ptr> imgs = llava_uhd::slice_image(img, inst, ctx->n_threads_preprocess);
+        normalize_images_u8_to_f32(imgs, res_imgs, image_mean, image_std, ctx->n_threads_preprocess);
 
         return true;
 
@@ -3463,6 +3939,19 @@ int32_t clip_get_image_size(const struct clip_ctx * ctx) {
     return ctx->model.hparams.image_size;
 }
 
+int32_t clip_get_max_image_size(const struct clip_ctx * ctx) {
+    switch (ctx->proj_type()) {
+        case PROJECTOR_TYPE_QWEN2VL:
+        case PROJECTOR_TYPE_QWEN25VL:
+        case PROJECTOR_TYPE_PIXTRAL:
+        case PROJECTOR_TYPE_GLM_EDGE:
+        case PROJECTOR_TYPE_GEMMA3:
+            return ctx->model.hparams.image_size;
+        default:
+            return 0;
+    }
+}
+
 int32_t clip_get_patch_size(const struct clip_ctx * ctx) {
     return ctx->model.hparams.patch_size;
 }
@@ -3675,21 +4164,67 @@ bool clip_image_encode(struct clip_ctx * ctx, const int n_threads, clip_image_f3
     return clip_image_batch_encode(ctx, n_threads, &imgs, vec);
 }
 
+void clip_set_eval_callback(clip_ctx * ctx, ggml_backend_sched_eval_callback cb_eval, void * cb_eval_user_data) {
+    ctx->cb_eval = cb_eval;
+    ctx->cb_eval_user_data = cb_eval_user_data;
+}
+
 bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_image_f32_batch * imgs_c_ptr, float * vec) {
     const clip_image_f32_batch & imgs = *imgs_c_ptr;
     int batch_size = imgs.entries.size();
 
-    // TODO @ngxson : implement batch size > 1 as a loop
-    //                we don't need true batching support because the cgraph will gonna be big anyway
+    // batch size > 1 is encoded as a loop, same sized images share one built and allocated graph
     if (batch_size != 1) {
-        return false; // only support batch size of 1
+        if (batch_size == 0 || imgs.is_audio) {
+            return false;
+        }
+        const int n_mmproj_embd = clip_n_mmproj_embd(ctx);
+        for (const auto & entry : imgs.entries) {
+            if (!clip_image_encode(ctx, n_threads, entry.get(), vec)) {
+                return false;
+            }
+            vec += (size_t) clip_n_output_tokens(ctx, entry.get()) * n_mmproj_embd;
+        }
+        return true;
     }
 
-    // build the inference graph
-    ctx->debug_print_tensors.clear();
-    ggml_backend_sched_reset(ctx->sched.get());
-    ggml_cgraph * gf = clip_image_build_graph(ctx, imgs);
-    ggml_backend_sched_alloc_graph(ctx->sched.get(), gf);
+    // build the inference graph, unless one of the same input shape is cached
+    const auto & img0 = *imgs.entries[0];
+    auto & cache = ctx->graph_cache;
+    auto it = cache.begin();
+    while (it != cache.end() && (it->nx != img0.nx || it->ny != img0.ny || it->audio != imgs.is_audio)) {
+        ++it;
+    }
+    if (it == cache.end() && cache.size() >= CLIP_GRAPH_CACHE_MAX) {
+        it = std::prev(cache.end()); // reuse the scheduler and buffers of the least recently used shape
+        it->gf = nullptr;
+    } else if (it == cache.end()) {
+        // the first shape takes over the scheduler reserved at load, others get their own
+        it = cache.emplace(cache.end());
+        it->sched.reset(ctx->sched ? ctx->sched.release() : ctx->new_sched());
+    }
+    cache.splice(cache.begin(), cache, it);
+    clip_graph_cache_entry & entry = cache.front();
+    if (!entry.gf) {
+        entry.nx = img0.nx;
+        entry.ny = img0.ny;
+        entry.audio = imgs.is_audio;
+        entry.buf_meta.resize(ctx->buf_compute_meta.size());
+        ctx->debug_print_tensors.clear();
+        // NOTE: clip_graph builds in buf_compute_meta, the entry's buffer stands in for it so other graphs survive
+        std::swap(ctx->buf_compute_meta, entry.buf_meta);
+        ggml_cgraph * gf_built = clip_image_build_graph(ctx, imgs);
+        std::swap(ctx->buf_compute_meta, entry.buf_meta);
+        entry.debug_print_tensors = ctx->debug_print_tensors;
+        ggml_backend_sched_reset(entry.sched.get());
+        if (!ggml_backend_sched_alloc_graph(entry.sched.get(), gf_built)) {
+            LOG_ERR("%s: failed to allocate the graph of a %dx%d input\n", __func__, img0.nx, img0.ny);
+            return false;
+        }
+        entry.gf = gf_built;
+        clip_update_memory_breakdown(ctx);
+    }
+    ggml_cgraph * gf = entry.gf;
 
     // set inputs
     const auto & model   = ctx->model;
@@ -3768,7 +4303,24 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
                 }
             }
         }
-        set_input_f32("inp_raw", inp_raw);
+        if (ctx->normalize_in_graph) {
+            ggml_tensor * cur = get_inp_tensor("inp_raw");
+            GGML_ASSERT(cur->type == GGML_TYPE_F16 && ggml_nelements(cur) == (int64_t)inp_raw.size());
+            std::vector<ggml_fp16_t> inp_raw_f16(inp_raw.size());
+            ggml_fp32_to_fp16_row(inp_raw.data(), inp_raw_f16.data(), (int64_t)inp_raw.size());
+            ggml_backend_tensor_set(cur, inp_raw_f16.data(), 0, ggml_nbytes(cur));
+
+            std::vector<float> norm_scale(3);
+            std::vector<float> norm_bias(3);
+            for (int c = 0; c < 3; c++) {
+                norm_scale[c] = 1.0f / (255.0f * hparams.image_std[c]);
+                norm_bias[c]  = -hparams.image_mean[c] / hparams.image_std[c];
+            }
+            set_input_f32("inp_norm_scale", norm_scale);
+            set_input_f32("inp_norm_bias", norm_bias);
+        } else {
+            set_input_f32("inp_raw", inp_raw);
+        }
 
     } else {
         // audio input
@@ -4002,17 +4554,20 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     }
 
     // ggml_backend_cpu_set_n_threads(ctx->backend_cpu, n_threads);
+    // note: with a threadpool the graphs run on all of its threads, set at init
     ggml_backend_dev_t dev = ggml_backend_get_device(ctx->backend_cpu);
     ggml_backend_reg_t reg = dev ? ggml_backend_dev_backend_reg(dev) : nullptr;
-    if (reg) {
+    if (reg && !ctx->threadpool) {
         auto ggml_backend_set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
         if (ggml_backend_set_n_threads_fn) {
             ggml_backend_set_n_threads_fn(ctx->backend_cpu, n_threads);
         }
     }
 
-    auto status = ggml_backend_sched_graph_compute(ctx->sched.get(), gf);
+    ggml_backend_sched_set_eval_callback(entry.sched.get(), ctx->cb_eval, ctx->cb_eval_user_data);
+    auto status = ggml_backend_sched_graph_compute(entry.sched.get(), gf);
     if (status != GGML_STATUS_SUCCESS) {
+        entry.gf = nullptr;
         LOG_ERR("%s: ggml_backend_sched_graph_compute failed with error %d\n", __func__, status);
         return false;
     }
@@ -4021,7 +4576,7 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     if (ctx->debug_graph) {
         LOG_INF("\n\n---\n\n");
         LOG_INF("\n\nDebug graph:\n\n");
-        for (ggml_tensor * t : ctx->debug_print_tensors) {
+        for (ggml_tensor * t : entry.debug_print_tensors) {
             std::vector<uint8_t> data(ggml_nbytes(t));
             ggml_backend_tensor_get(t, data.data(), 0, ggml_nbytes(t));
             print_tensor_shape(t);
@@ -4041,7 +4596,23 @@ bool clip_image_batch_encode(clip_ctx * ctx, const int n_threads, const clip_ima
     }
 
     // copy the embeddings to the location passed by the user
-    ggml_backend_tensor_get(embeddings, vec, 0, ggml_nbytes(embeddings));
+    // note: a device output is downloaded async into pinned staging, a pageable download is synchronous and slower
+    const size_t nbytes = ggml_nbytes(embeddings);
+    ggml_backend_t backend_out = ggml_backend_sched_get_tensor_backend(entry.sched.get(), embeddings);
+    if (ctx->host_buft && backend_out && !ggml_backend_buffer_is_host(embeddings->buffer)) {
+        if (!ctx->buf_output || ggml_backend_buffer_get_size(ctx->buf_output.get()) < nbytes) {
+            ctx->buf_output.reset(ggml_backend_buft_alloc_buffer(ctx->host_buft, nbytes));
+            clip_update_memory_breakdown(ctx);
+        }
+        if (ctx->buf_output) {
+            void * staging = ggml_backend_buffer_get_base(ctx->buf_output.get());
+            ggml_backend_tensor_get_async(backend_out, embeddings, staging, 0, nbytes);
+            ggml_backend_synchronize(backend_out);
+            memcpy(vec, staging, nbytes);
+            return true;
+        }
+    }
+    ggml_backend_tensor_get(embeddings, vec, 0, nbytes);
 
     return true;
 }
@@ -4121,6 +4692,14 @@ bool clip_has_audio_encoder(const struct clip_ctx * ctx) {
     return ctx->model.modality == CLIP_MODALITY_AUDIO;
 }
 
+int clip_memory_breakdown(struct clip_ctx * ctx, struct clip_memory_breakdown_data * data, int n_max) {
+    std::lock_guard<std::mutex> lock(ctx->mem_mutex);
+    for (int i = 0; i < n_max && i < (int) ctx->mem_breakdown.size(); ++i) {
+        data[i] = ctx->mem_breakdown[i];
+    }
+    return (int) ctx->mem_breakdown.size();
+}
+
 bool clip_has_whisper_encoder(const struct clip_ctx * ctx) {
     return ctx->proj_type() == PROJECTOR_TYPE_ULTRAVOX
         || ctx->proj_type() == PROJECTOR_TYPE_QWEN2A;
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "ggml.h"
+#include "ggml-backend.h"
 #include <stddef.h>
 #include <stdint.h>
 
@@ -22,9 +23,22 @@ enum clip_modality {
     CLIP_MODALITY_AUDIO,
 };
 
+enum clip_flash_attn_type {
+    CLIP_FLASH_ATTN_TYPE_AUTO     = -1, // enabled if the backend supports it for this model
+    CLIP_FLASH_ATTN_TYPE_DISABLED = 0,
+    CLIP_FLASH_ATTN_TYPE_ENABLED  = 1,
+};
+
 struct clip_context_params {
     bool use_gpu;
     enum ggml_log_level verbosity;
+    const char * device; // GPU backend device name, nullptr for the first GPU
+    int n_threads;       // image preprocessing threads, <= 1 preprocesses on the calling thread
+    enum clip_flash_attn_type flash_attn_type;
+    enum ggml_type weight_type; // linear weights converted to it on load, GGML_TYPE_COUNT keeps the file's types
+    bool f16_activations;       // F16 K/V in the encoder attention, the flash path always uses them
+    int n_load_threads;         // threads reading and uploading the weights, <= 1 loads on the calling thread
+    const struct ggml_threadpool_params * threadpool; // persistent threads of the CPU graphs, nullptr starts them per encode
 };
 
 struct clip_init_result {
@@ -40,6 +54,8 @@ size_t clip_embd_nbytes(const struct clip_ctx * ctx);
 size_t clip_embd_nbytes_by_img(const struct clip_ctx * ctx, int img_w, int img_h);
 
 int32_t clip_get_image_size (const struct clip_ctx * ctx);
+// longest side clip_image_preprocess keeps (the image is resized down to it), 0 if larger images give more tokens
+int32_t clip_get_max_image_size(const struct clip_ctx * ctx);
 int32_t clip_get_patch_size (const struct clip_ctx * ctx);
 int32_t clip_get_hidden_size(const struct clip_ctx * ctx);
 
@@ -95,6 +111,21 @@ struct ggml_tensor * clip_get_newline_tensor(const struct clip_ctx * ctx);
 bool clip_image_encode      (struct clip_ctx * ctx, int n_threads, struct clip_image_f32 * img, float * vec);
 bool clip_image_batch_encode(struct clip_ctx * ctx, int n_threads, const struct clip_image_f32_batch * imgs, float * vec);
 
+// bytes of the encoder buffers in one buffer type, see clip_memory_breakdown
+struct clip_memory_breakdown_data {
+    const char * buft;   // buffer type name
+    const char * device; // device of the buffer type, NULL if none
+    size_t model;        // weights
+    size_t compute;      // compute buffers of the cached graphs
+    size_t output;       // pinned staging of the embeddings download
+};
+
+// fills up to n_max entries, returns the number of buffer types; safe while another thread encodes with ctx
+int clip_memory_breakdown(struct clip_ctx * ctx, struct clip_memory_breakdown_data * data, int n_max);
+
+// eval callback of the backend scheduler of the following encodes, nullptr removes it
+void clip_set_eval_callback(struct clip_ctx * ctx, ggml_backend_sched_eval_callback cb_eval, void * cb_eval_user_data);
+
 int clip_is_minicpmv(const struct clip_ctx * ctx);
 bool clip_is_glm(const struct clip_ctx * ctx);
 bool clip_is_qwen2vl(const struct clip_ctx * ctx);
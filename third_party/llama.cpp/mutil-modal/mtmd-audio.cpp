@@ -54,86 +54,122 @@ struct whisper_global_cache {
 } global_cache;
 }
 
-// naive Discrete Fourier Transform
+// Iterative mixed-radix FFT, N = 2^m * r with r odd (WHISPER_N_FFT = 400 = 16 * 25)
+// each of the 2^m interleaved sub-sequences gets an r-point DFT, stored in bit-reversed order,
+// then m radix-2 butterfly stages combine them in place, without recursion or scratch buffers
 // input is real-valued
-// output is complex-valued
-static void dft(const float* in, int N, float* out) {
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
-
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*global_cache.cos_vals[idx]; // cos(t)
-            im -= in[n]*global_cache.sin_vals[idx]; // sin(t)
+// output is complex-valued, 2 * N floats
+static void fft(const float * in, int N, float * out) {
+    int M = 1;
+    int m_bits = 0;
+    while (N % (2 * M) == 0) {
+        M *= 2;
+        m_bits++;
+    }
+    const int r = N / M;
+
+    WHISPER_ASSERT(SIN_COS_N_COUNT % N == 0);
+
+    const int dft_step = SIN_COS_N_COUNT / r;
+    for (int p = 0; p < M; ++p) {
+        int s = 0;
+        for (int b = 0; b < m_bits; ++b) {
+            s |= ((p >> b) & 1) << (m_bits - 1 - b);
         }
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
-    }
-}
+        // the input is real, so the upper half of the DFT is the conjugate of the lower half
+        float * dst = out + 2 * p * r;
+        for (int k = 0; k <= r / 2; k++) {
+            float re = 0;
+            float im = 0;
+
+            int idx = 0; // t = 2*M_PI*k*n/r
+            for (int n = 0; n < r; n++) {
+                re += in[s + M * n] * global_cache.cos_vals[idx];
+                im -= in[s + M * n] * global_cache.sin_vals[idx];
+                idx += k * dft_step;
+                if (idx >= SIN_COS_N_COUNT) {
+                    idx -= SIN_COS_N_COUNT;
+                }
+            }
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(float* in, int N, float* out) {
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
+            dst[2*k + 0] = re;
+            dst[2*k + 1] = im;
+        }
+        for (int k = r / 2 + 1; k < r; k++) {
+            dst[2*k + 0] = dst[2*(r - k) + 0];
+            dst[2*k + 1] = -dst[2*(r - k) + 1];
+        }
     }
 
-    const int half_N = N / 2;
-    if (N - half_N*2 == 1) {
-        dft(in, N, out);
-        return;
-    }
+    for (int len = 2 * r; len <= N; len *= 2) {
+        const int half_len = len / 2;
+        const int sin_cos_step = SIN_COS_N_COUNT / len;
+        for (int start = 0; start < N; start += len) {
+            float * even = out + 2 * start;
+            float * odd  = even + 2 * half_len;
+            for (int k = 0; k < half_len; k++) {
+                const float re = global_cache.cos_vals[k * sin_cos_step]; // cos(t), t = 2*M_PI*k/len
+                const float im = -global_cache.sin_vals[k * sin_cos_step]; // sin(t)
 
-    float* even = in + N;
-    for (int i = 0; i < half_N; ++i) {
-        even[i]= in[2*i];
-    }
-    float* even_fft = out + 2 * N;
-    fft(even, half_N, even_fft);
+                const float re_odd = re*odd[2*k + 0] - im*odd[2*k + 1];
+                const float im_odd = re*odd[2*k + 1] + im*odd[2*k + 0];
+
+                odd[2*k + 0] = even[2*k + 0] - re_odd;
+                odd[2*k + 1] = even[2*k + 1] - im_odd;
 
-    float* odd = even;
-    for (int i = 0; i < half_N; ++i) {
-        odd[i] = in[2*i + 1];
+                even[2*k + 0] += re_odd;
+                even[2*k + 1] += im_odd;
+            }
+        }
     }
-    float* odd_fft = even_fft + N;
-    fft(odd, half_N, odd_fft);
+}
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < half_N; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = global_cache.cos_vals[idx]; // cos(t)
-        float im = -global_cache.sin_vals[idx]; // sin(t)
+// log mel energies of one windowed frame, written with a stride of mel_stride into mel
+// fft_out is scratch of 2 * frame_size floats
+static void log_mel_frame(const float * fft_in, int frame_size, const whisper_filters & filters, int n_mel,
+                          float * fft_out, float * mel, int mel_stride) {
+    const int n_fft = filters.n_fft;
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+    // FFT
+    fft(fft_in, frame_size, fft_out);
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+    // Calculate modulus^2 of complex numbers
+    // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
+    for (int j = 0; j < n_fft; j++) {
+        fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
+    }
 
-        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+    // mel spectrogram
+    for (int j = 0; j < n_mel; j++) {
+        double sum = 0.0;
+        // unroll loop (suggested by GH user @lunixbochs)
+        int k = 0;
+        for (k = 0; k < n_fft - 3; k += 4) {
+            sum +=
+                    fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
+                    fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
+                    fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
+                    fft_out[k + 3] * filters.data[j * n_fft + k + 3];
+        }
+        // handle n_fft remainder
+        for (; k < n_fft; k++) {
+            sum += fft_out[k] * filters.data[j * n_fft + k];
+        }
+        mel[j * mel_stride] = log10(std::max(sum, 1e-10));
     }
 }
 
 static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
                                               int n_samples, int frame_size, int frame_step, int n_threads,
                                               const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size * 2, 0.0);
-    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
+    std::vector<float> fft_in(frame_size, 0.0);
+    std::vector<float> fft_out(frame_size * 2);
 
-    int n_fft = filters.n_fft;
     int i = ith;
 
     // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    WHISPER_ASSERT(n_fft == 1 + (frame_size / 2));
+    WHISPER_ASSERT(filters.n_fft == 1 + (frame_size / 2));
 
     // calculate FFT only when fft_in are not all zero
     for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
@@ -149,34 +185,7 @@ static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const
             std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
         }
 
-        // FFT
-        fft(fft_in.data(), frame_size, fft_out.data());
-
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
-
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
-            sum = log10(std::max(sum, 1e-10));
-            mel.data[j * mel.n_len + i] = sum;
-        }
+        log_mel_frame(fft_in.data(), frame_size, filters, mel.n_mel, fft_out.data(), mel.data.data() + i, mel.n_len);
     }
 
     // Otherwise fft_out are all zero
@@ -188,6 +197,29 @@ static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const
     }
 }
 
+// clamp to 8 below the max and scale, as whisper does over the whole spectrogram
+static void normalize_mel(whisper_mel & mel) {
+    double mmax = -1e20;
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] > mmax) {
+            mmax = mel.data[i];
+        }
+    }
+
+    mmax -= 8.0;
+
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] < mmax) {
+            mel.data[i] = mmax;
+        }
+
+        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+    }
+}
+
+// the cgraph in clip.cpp only accepts 3000 frames each
+static const int mel_frames_per_chunk = 3000;
+
 // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
 static bool log_mel_spectrogram(
         const float * samples,
@@ -246,23 +278,7 @@ static bool log_mel_spectrogram(
         }
     }
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
-        }
-    }
-
-    mmax -= 8.0;
-
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
-
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
-    }
+    normalize_mel(mel);
 
     // Dump log_mel_spectrogram
     if (debug) {
@@ -308,7 +324,7 @@ bool preprocess_audio(
     // because the cgraph in clip.cpp only accepts 3000 frames each, we need to split the mel
     // we always expect the mel to have 3000 silent frames at the end
     // printf("n_len %d\n", out_full.n_len);
-    const size_t frames_per_chunk = 3000;
+    const size_t frames_per_chunk = mel_frames_per_chunk;
     GGML_ASSERT((size_t)out_full.n_len > frames_per_chunk);
     for (size_t off = 0; off < (size_t)out_full.n_len; off += frames_per_chunk) {
         int n_len = std::min(frames_per_chunk, (size_t)out_full.n_len - off);
@@ -333,6 +349,110 @@ bool preprocess_audio(
     return true;
 }
 
+// the padded samples a frame needs stay in the ring until the frame is computed
+static const size_t mel_stream_ring_size = 512;
+
+whisper_mel_stream::whisper_mel_stream(const whisper_filters & filters)
+    : filters(filters), ring(mel_stream_ring_size), fft_in(WHISPER_N_FFT), fft_out(2 * WHISPER_N_FFT) {
+    WHISPER_ASSERT(filters.n_fft == 1 + (WHISPER_N_FFT / 2));
+
+    head.reserve(WHISPER_N_FFT / 2 + 1);
+
+    chunk.n_len     = mel_frames_per_chunk;
+    chunk.n_mel     = filters.n_mel;
+    chunk.n_len_org = filters.n_mel; // unused
+    chunk.data.resize(chunk.n_mel * chunk.n_len);
+}
+
+void whisper_mel_stream::push(const float * samples, size_t n_samples, std::vector<whisper_mel> & output) {
+    const size_t stage_2_pad = WHISPER_N_FFT / 2;
+
+    for (size_t i = 0; i < n_samples; i++) {
+        this->n_samples++;
+
+        if (n_written > 0) {
+            write(samples[i], output);
+            continue;
+        }
+
+        // reflective pad 200 samples at the beginning of audio, once the samples it mirrors are there
+        head.push_back(samples[i]);
+        if (head.size() == stage_2_pad + 1) {
+            for (size_t j = stage_2_pad; j > 0; j--) {
+                write(head[j], output);
+            }
+            for (float sample : head) {
+                write(sample, output);
+            }
+        }
+    }
+}
+
+void whisper_mel_stream::finish(std::vector<whisper_mel> & output) {
+    const size_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
+    const size_t stage_2_pad = WHISPER_N_FFT / 2;
+
+    if (n_samples == 0) {
+        return;
+    }
+
+    // audio shorter than the reflective pad, mirror what there is
+    if (n_written == 0) {
+        for (size_t j = stage_2_pad; j > 0; j--) {
+            write(j < head.size() ? head[j] : 0.0f, output);
+        }
+        for (float sample : head) {
+            write(sample, output);
+        }
+    }
+
+    // the frame count of preprocess_audio, the frames past the audio and its pad are silent
+    const size_t n_len = (n_samples + stage_1_pad) / WHISPER_HOP_LENGTH;
+    const size_t n_fft_frames = std::min(n_len, (n_samples + stage_2_pad) / WHISPER_HOP_LENGTH + 1);
+
+    while (n_frames < n_fft_frames) {
+        write(0.0f, output);
+    }
+
+    const float silent = log10(1e-10);
+    while (n_frames < n_len) {
+        for (int j = 0; j < chunk.n_mel; j++) {
+            chunk.data[j * chunk.n_len + n_frames % mel_frames_per_chunk] = silent;
+        }
+        next_frame(output);
+    }
+
+    // the last uncomplete chunk is always a padded chunk, like in preprocess_audio
+}
+
+void whisper_mel_stream::write(float sample, std::vector<whisper_mel> & output) {
+    ring[n_written++ % mel_stream_ring_size] = sample;
+
+    const size_t offset = n_frames * WHISPER_HOP_LENGTH;
+    if (offset + WHISPER_N_FFT > n_written) {
+        return;
+    }
+
+    const float * hann = global_cache.hann_window;
+    for (size_t j = 0; j < WHISPER_N_FFT; j++) {
+        fft_in[j] = hann[j] * ring[(offset + j) % mel_stream_ring_size];
+    }
+
+    log_mel_frame(fft_in.data(), WHISPER_N_FFT, filters, chunk.n_mel, fft_out.data(),
+                  chunk.data.data() + n_frames % mel_frames_per_chunk, chunk.n_len);
+    next_frame(output);
+}
+
+void whisper_mel_stream::next_frame(std::vector<whisper_mel> & output) {
+    if (++n_frames % mel_frames_per_chunk != 0) {
+        return;
+    }
+
+    whisper_mel done = chunk;
+    normalize_mel(done);
+    output.push_back(std::move(done));
+}
+
 } // namespace whisper_preprocessor
 
 
@@ -38,6 +38,37 @@ bool preprocess_audio(
         const whisper_filters & filters,
         std::vector<whisper_mel> & output);
 
+// computes the chunks of preprocess_audio incrementally while PCM arrives: each mel frame as soon as its
+// window is complete, each chunk as soon as its last frame is, so encoding can start before the audio ends
+// note: a chunk is normalized over itself, which matches preprocess_audio for audio shorter than one chunk
+class whisper_mel_stream {
+public:
+    explicit whisper_mel_stream(const whisper_filters & filters);
+
+    // append samples, the chunks they complete are appended to output
+    void push(const float * samples, size_t n_samples, std::vector<whisper_mel> & output);
+
+    // pad the end of the audio like preprocess_audio and append the remaining chunks to output
+    void finish(std::vector<whisper_mel> & output);
+
+private:
+    void write(float sample, std::vector<whisper_mel> & output);
+    void next_frame(std::vector<whisper_mel> & output);
+
+    const whisper_filters & filters;
+
+    std::vector<float> head;  // the first samples, until the reflective pad can be written
+    std::vector<float> ring;  // the padded samples of the frames in progress
+    std::vector<float> fft_in;
+    std::vector<float> fft_out;
+
+    size_t n_samples = 0;  // samples pushed
+    size_t n_written = 0;  // padded samples written to the ring
+    size_t n_frames  = 0;  // frames computed
+
+    whisper_mel chunk;
+};
+
 } // namespace whisper_preprocessor
 
 namespace whisper_precalc_filters {
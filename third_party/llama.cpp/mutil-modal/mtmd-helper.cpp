@@ -34,6 +34,75 @@
 
 #define LOG_INF(...) fprintf(stdout, __VA_ARGS__)
 #define LOG_ERR(...) fprintf(stderr, __VA_ARGS__)
+// note: per batch and per slice timings, compiled out of release builds, llama-mico reports them as metrics instead
+#ifdef NDEBUG
+#define LOG_HOT(...) do { if (false) fprintf(stdout, __VA_ARGS__); } while (0)
+#else
+#define LOG_HOT(...) fprintf(stdout, __VA_ARGS__)
+#endif
+
+#ifdef MTMD_USE_LIBJPEG
+#include <stdio.h>  // NOTE: jpeglib.h needs FILE
+
+#include <jpeglib.h>
+#include <setjmp.h>
+
+struct jpeg_error_jmp {
+    struct jpeg_error_mgr mgr;
+    jmp_buf jmp;
+};
+
+static void jpeg_error_longjmp(j_common_ptr cinfo) { longjmp(reinterpret_cast<jpeg_error_jmp*>(cinfo->err)->jmp, 1); }
+
+static void jpeg_output_silent(j_common_ptr) {}  // NOTE: a failed decode falls back to stbi, which reports it
+
+// Decode a jpeg with libjpeg(-turbo, SIMD), downscaled in the DCT domain by the largest power of two (up to 1/8)
+// keeping the longest side >= min_side, 0 decodes at full size. False if not a jpeg or on error
+static bool decode_jpeg_scaled(const unsigned char* buf, size_t len, int min_side, std::vector<unsigned char>& rgb,
+                               int& nx, int& ny) {
+    if (len < 3 || buf[0] != 0xFF || buf[1] != 0xD8 || buf[2] != 0xFF) return false;
+
+    struct jpeg_decompress_struct cinfo;
+    jpeg_error_jmp err;
+    cinfo.err = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit = jpeg_error_longjmp;  // NOTE: the default handler exits the process
+    err.mgr.output_message = jpeg_output_silent;
+    if (setjmp(err.jmp)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, const_cast<unsigned char*>(buf), (unsigned long)len);
+    jpeg_read_header(&cinfo, TRUE);
+
+    int longest = (int)std::max(cinfo.image_width, cinfo.image_height);
+    unsigned int denom = 1;
+    while (min_side > 0 && denom < 8 && longest / (int)(denom * 2) >= min_side) denom *= 2;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    if (cinfo.output_components != 3) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    nx = (int)cinfo.output_width;
+    ny = (int)cinfo.output_height;
+    rgb.resize((size_t)nx * ny * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = rgb.data() + (size_t)cinfo.output_scanline * nx * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+#else
+static bool decode_jpeg_scaled(const unsigned char*, size_t, int, std::vector<unsigned char>&, int&, int&) {
+    return false;
+}
+#endif
 
 size_t mtmd_helper_get_n_tokens(const mtmd_input_chunks* chunks) {
     size_t n_tokens = 0;
@@ -55,24 +124,38 @@ llama_pos mtmd_helper_get_n_pos(const mtmd_input_chunks* chunks) {
 
 // helper struct to make working with embd batch easier
 // note: this will be removed after llama_batch_ext refactoring
+// NOTE: reused across images, the buffers grow to the largest image seen and the per token seq ids and logits flags
+// are only written when they grow, an image only fills its positions
 struct decode_embd_batch {
-    int n_pos_per_embd;
-    int n_mmproj_embd;
+    int n_pos_per_embd = 1;
+    int n_mmproj_embd = 0;
     std::vector<llama_pos> pos;
     std::vector<llama_pos> pos_view;  // used by mrope
     std::vector<int32_t> n_seq_id;
-    std::vector<llama_seq_id> seq_id_0;
+    llama_seq_id seq_id_0[1] = {0};
     std::vector<llama_seq_id*> seq_ids;
     std::vector<int8_t> logits;
-    llama_batch batch;
-    decode_embd_batch(float* embd, int32_t n_tokens, int n_pos_per_embd, int n_mmproj_embd)
-        : n_pos_per_embd(n_pos_per_embd), n_mmproj_embd(n_mmproj_embd) {
-        pos.resize(n_tokens * n_pos_per_embd);
-        n_seq_id.resize(n_tokens);
-        seq_ids.resize(n_tokens + 1);
-        logits.resize(n_tokens);
-        seq_id_0.resize(1);
-        seq_ids[n_tokens] = nullptr;
+    llama_batch batch = {};
+
+    decode_embd_batch() = default;
+    decode_embd_batch(float* embd, int32_t n_tokens, int n_pos_per_embd, int n_mmproj_embd) {
+        reset(embd, n_tokens, n_pos_per_embd, n_mmproj_embd);
+    }
+    decode_embd_batch(const decode_embd_batch&) = delete;
+    decode_embd_batch& operator=(const decode_embd_batch&) = delete;
+
+    void reset(float* embd, int32_t n_tokens, int n_pos_per_embd_, int n_mmproj_embd_) {
+        n_pos_per_embd = n_pos_per_embd_;
+        n_mmproj_embd = n_mmproj_embd_;
+        if (pos.size() < (size_t)n_tokens * n_pos_per_embd) {
+            pos.resize((size_t)n_tokens * n_pos_per_embd);
+        }
+        if (n_seq_id.size() < (size_t)n_tokens) {
+            n_seq_id.assign(n_tokens, 1);
+            seq_ids.assign(n_tokens + 1, seq_id_0);
+            seq_ids[n_tokens] = nullptr;
+            logits.assign(n_tokens, false);
+        }
         batch = {
             /*n_tokens       =*/n_tokens,
             /*tokens         =*/nullptr,
@@ -88,9 +171,6 @@ struct decode_embd_batch {
         seq_id_0[0] = seq_id;
         for (int i = 0; i < batch.n_tokens; i++) {
             batch.pos[i] = pos_0 + i;
-            batch.n_seq_id[i] = 1;
-            batch.seq_id[i] = seq_id_0.data();
-            batch.logits[i] = false;
         }
     }
 
@@ -107,11 +187,6 @@ struct decode_embd_batch {
                 pos[i + batch.n_tokens * 3] = 0;  // last pos dim is unused
             }
         }
-        for (int i = 0; i < batch.n_tokens; i++) {
-            batch.n_seq_id[i] = 1;
-            batch.seq_id[i] = seq_id_0.data();
-            batch.logits[i] = false;
-        }
     }
 
     // M-RoPE for audio
@@ -124,11 +199,6 @@ struct decode_embd_batch {
             pos[i + batch.n_tokens * 2] = pos_0 + i;
             pos[i + batch.n_tokens * 3] = 0;  // last pos dim is unused
         }
-        for (int i = 0; i < batch.n_tokens; i++) {
-            batch.n_seq_id[i] = 1;
-            batch.seq_id[i] = seq_id_0.data();
-            batch.logits[i] = false;
-        }
     }
 
     llama_batch get_view(int offset, int n_tokens) {
@@ -181,7 +251,9 @@ int32_t mtmd_helper_decode_image_chunk(mtmd_context* ctx, struct llama_context*
     int32_t n_tokens = mtmd_input_chunk_get_n_tokens(chunk);
     int32_t i_batch = 0;
     int32_t n_img_batches = GGML_PAD(n_tokens, n_batch) / n_batch;
-    decode_embd_batch batch_embd(encoded_embd, n_tokens, n_pos_per_embd, n_mmproj_embd);
+    // NOTE: one per thread, an image decode allocates nothing once the largest image has been seen
+    thread_local decode_embd_batch batch_embd;
+    batch_embd.reset(encoded_embd, n_tokens, n_pos_per_embd, n_mmproj_embd);
 
     if (mtmd_decode_use_mrope(ctx)) {
         if (chunk_type == MTMD_INPUT_CHUNK_TYPE_IMAGE) {
@@ -203,9 +275,8 @@ int32_t mtmd_helper_decode_image_chunk(mtmd_context* ctx, struct llama_context*
     }
 
     if (mtmd_decode_use_non_causal(ctx)) {
-        llama_set_causal_attn(lctx, false);
-        // TODO @ngxson : need to make sure only one image is processed at a time, and n_ubatch must be enough to hold
-        // the image
+        // NOTE: only this sequence, n_ubatch must be enough to hold the image
+        llama_set_seq_causal_attn(lctx, seq_id, false);
     }
 
     while (i_batch < n_img_batches) {  // split into batches
@@ -219,11 +290,11 @@ int32_t mtmd_helper_decode_image_chunk(mtmd_context* ctx, struct llama_context*
         int32_t ret = llama_decode(lctx, batch_embd_view);
         if (ret != 0) {
             LOG_ERR("failed to decode %s\n", name);
-            llama_set_causal_attn(lctx, true);  // restore causal attn
+            llama_set_seq_causal_attn(lctx, seq_id, true);  // restore causal attn
             return ret;
         }
 
-        LOG_INF("%s decoded (batch %d/%d, n_tokens_batch = %d) in %" PRId64 " ms\n", name, i_batch + 1, n_img_batches,
+        LOG_HOT("%s decoded (batch %d/%d, n_tokens_batch = %d) in %" PRId64 " ms\n", name, i_batch + 1, n_img_batches,
                 n_tokens_batch, ggml_time_ms() - t1);
 
         i_batch++;
@@ -233,7 +304,7 @@ int32_t mtmd_helper_decode_image_chunk(mtmd_context* ctx, struct llama_context*
     *new_n_past = n_past;
 
     if (mtmd_decode_use_non_causal(ctx)) {
-        llama_set_causal_attn(lctx, true);
+        llama_set_seq_causal_attn(lctx, seq_id, true);
     }
     return 0;
 }
@@ -279,7 +350,7 @@ int32_t mtmd_helper_eval_chunk_single(mtmd_context* ctx, struct llama_context* l
         const char* name = chunk_type == MTMD_INPUT_CHUNK_TYPE_IMAGE ? "image" : "audio";
         int64_t t0 = ggml_time_ms();
 
-        LOG_INF("encoding %s slice...\n", name);
+        LOG_HOT("encoding %s slice...\n", name);
 
         ret = mtmd_encode_chunk(ctx, chunk);
         if (ret != 0) {
@@ -288,7 +359,7 @@ int32_t mtmd_helper_eval_chunk_single(mtmd_context* ctx, struct llama_context* l
             return ret;
         }
 
-        LOG_INF("%s slice encoded in %" PRId64 " ms\n", name, ggml_time_ms() - t0);
+        LOG_HOT("%s slice encoded in %" PRId64 " ms\n", name, ggml_time_ms() - t0);
 
         float* embd = mtmd_get_output_embd(ctx);
         ret = mtmd_helper_decode_image_chunk(ctx, lctx, chunk, embd, n_past, seq_id, n_batch, new_n_past);
@@ -392,9 +463,9 @@ static bool decode_audio_from_buf(const unsigned char* buf_in, size_t len, int t
 
 }  // namespace audio_helpers
 
-mtmd_bitmap* mtmd_helper_bitmap_init_from_buf(mtmd_context* ctx, const unsigned char* buf, size_t len, int32_t crop_w,
-                                              int32_t crop_h) {
-                                                
+// crop_x < 0 centers the crop
+static mtmd_bitmap* bitmap_init_from_buf(mtmd_context* ctx, const unsigned char* buf, size_t len, int32_t crop_x,
+                                         int32_t crop_y, int32_t crop_w, int32_t crop_h) {
     if (audio_helpers::is_audio_file((const char*)buf, len)) {
         std::vector<float> pcmf32;
         int bitrate = mtmd_get_audio_bitrate(ctx);
@@ -410,39 +481,73 @@ mtmd_bitmap* mtmd_helper_bitmap_init_from_buf(mtmd_context* ctx, const unsigned
     }
 
     // otherwise, we assume it's an image
-    mtmd_bitmap* result = nullptr;
-    {
-        int nx, ny, nc;
-        auto* data = stbi_load_from_memory(buf, len, &nx, &ny, &nc, 3);
-        if (!data) {
+    int nx = 0, ny = 0;
+    std::vector<unsigned char> jpeg_rgb;
+    unsigned char* stbi_data = nullptr;
+    const unsigned char* data = nullptr;
+    bool crop = crop_w > 0 && crop_h > 0;
+    // NOTE: a crop is in source pixels, only uncropped images are downscaled while decoding
+    int min_side = !crop && ctx ? mtmd_get_max_image_size(ctx) : 0;
+    if (decode_jpeg_scaled(buf, len, min_side, jpeg_rgb, nx, ny)) {
+        data = jpeg_rgb.data();
+    } else {
+        int nc;
+        stbi_data = stbi_load_from_memory(buf, len, &nx, &ny, &nc, 3);
+        if (!stbi_data) {
             LOG_ERR("%s: failed to decode image bytes\n", __func__);
             return nullptr;
         }
+        data = stbi_data;
+    }
 
+    mtmd_bitmap* result = nullptr;
+    if (crop && crop_x >= 0) {  // NOTE: a region is clipped to the image
+        int x1 = std::min(nx, crop_x + crop_w), y1 = std::min(ny, crop_y + crop_h);
+        crop_x = std::min(crop_x, nx);
+        crop_y = std::min(crop_y, ny);
+        crop_w = x1 - crop_x;
+        crop_h = y1 - crop_y;
         if (crop_w <= 0 || crop_h <= 0) {
-            crop_w = nx;
-            crop_h = ny;
+            LOG_ERR("%s: region is outside of the image %dx%d\n", __func__, nx, ny);
+            if (stbi_data) stbi_image_free(stbi_data);
+            return nullptr;
         }
-
-        if (nx >= crop_w && ny >= crop_h) {
-            int crop_x = (nx - crop_w) / 2;
-            int crop_y = (ny - crop_h) / 2;
-
-            unsigned char* center_data = new unsigned char[crop_w * crop_h * 3];
-            for (int y = 0; y < crop_h; ++y) {
-                int src_y = crop_y + y;
-                memcpy(center_data + y * crop_w * 3, data + (src_y * nx + crop_x) * 3, crop_w * 3);
-            }
-            stbi_image_free(data);
-            data = center_data;
+    }
+    if (!crop || (crop_w == nx && crop_h == ny)) {
+        result = mtmd_bitmap_init(nx, ny, data);
+    } else if (nx >= crop_w && ny >= crop_h) {
+        if (crop_x < 0) {
+            crop_x = (nx - crop_w) / 2;
+            crop_y = (ny - crop_h) / 2;
         }
 
-        result = mtmd_bitmap_init(crop_w, crop_h, data);
-        stbi_image_free(data);
+        std::vector<unsigned char> center_data((size_t)crop_w * crop_h * 3);
+        for (int y = 0; y < crop_h; ++y) {
+            int src_y = crop_y + y;
+            memcpy(center_data.data() + (size_t)y * crop_w * 3, data + ((size_t)src_y * nx + crop_x) * 3, crop_w * 3);
+        }
+        result = mtmd_bitmap_init(crop_w, crop_h, center_data.data());
+    } else {
+        LOG_ERR("%s: image %dx%d is smaller than the crop %dx%d\n", __func__, nx, ny, crop_w, crop_h);
     }
+    if (stbi_data) stbi_image_free(stbi_data);
     return result;
 }
 
+mtmd_bitmap* mtmd_helper_bitmap_init_from_buf(mtmd_context* ctx, const unsigned char* buf, size_t len, int32_t crop_w,
+                                              int32_t crop_h) {
+    return bitmap_init_from_buf(ctx, buf, len, -1, -1, crop_w, crop_h);
+}
+
+mtmd_bitmap* mtmd_helper_bitmap_init_region(mtmd_context* ctx, const unsigned char* buf, size_t len, int32_t x,
+                                            int32_t y, int32_t w, int32_t h) {
+    if (x < 0 || y < 0 || w <= 0 || h <= 0) {
+        LOG_ERR("%s: invalid region %d,%d %dx%d\n", __func__, x, y, w, h);
+        return nullptr;
+    }
+    return bitmap_init_from_buf(ctx, buf, len, x, y, w, h);
+}
+
 mtmd_bitmap* mtmd_helper_bitmap_init_from_file(mtmd_context* ctx, const char* fname) {
     std::vector<unsigned char> buf;
     FILE* f = fopen(fname, "rb");
@@ -36,6 +36,11 @@ MTMD_API mtmd_bitmap* mtmd_helper_bitmap_init_from_file(mtmd_context* ctx, const
 MTMD_API mtmd_bitmap* mtmd_helper_bitmap_init_from_buf(mtmd_context* ctx, const unsigned char* buf, size_t len,
                                                        int32_t crop_w, int32_t crop_h);
 
+// same as mtmd_helper_bitmap_init_from_buf, an image is cropped to the region at (x, y) of w x h source pixels,
+// clipped to the image. Returns nullptr if the region holds no pixel of the image
+MTMD_API mtmd_bitmap* mtmd_helper_bitmap_init_region(mtmd_context* ctx, const unsigned char* buf, size_t len,
+                                                     int32_t x, int32_t y, int32_t w, int32_t h);
+
 // helper to count the total number of tokens from a list of chunks, useful to keep track of KV cache
 MTMD_API size_t mtmd_helper_get_n_tokens(const mtmd_input_chunks* chunks);
 
@@ -7,6 +7,7 @@
 #include <cstring>
 #include <iomanip>
 #include <limits>
+#include <unordered_map>
 #include <vector>
 
 #include "clip-impl.h"
@@ -22,6 +23,8 @@ struct mtmd_bitmap {
     std::vector<unsigned char> data;
     std::string id;         // optional user-defined id, for ex: can be set to image hash, useful for KV cache tracking
     bool is_audio = false;  // true if the bitmap is audio
+    bool is_cached = false;  // no pixels, nx * ny is the token grid of a previous tokenize with the same id
+    uint32_t pool = 1;       // image tokens average pooled pool x pool after the projector
 };
 
 struct mtmd_image_tokens {
@@ -31,10 +34,16 @@ struct mtmd_image_tokens {
     uint32_t n_tokens() const { return nx * ny; }
     clip_image_f32_batch batch_f32;  // preprocessed image patches
     std::string id;                  // optional user-defined ID, useful for KV cache tracking
+    uint32_t pool = 1;               // the encoder grid is nx_enc x ny_enc, pooled to nx x ny
+    uint32_t nx_enc = 0;
+    uint32_t ny_enc = 0;
 
-    mtmd_image_tokens clone() { return mtmd_image_tokens{nx, ny, use_mrope_pos, batch_f32.clone(), id}; }
+    mtmd_image_tokens clone() {
+        return mtmd_image_tokens{nx, ny, use_mrope_pos, batch_f32.clone(), id, pool, nx_enc, ny_enc};
+    }
 };
-using mtmd_image_tokens_ptr = std::unique_ptr<mtmd_image_tokens>;
+// NOTE: shared by the copies of a chunk, immutable once tokenized so scheduling never duplicates the pixels
+using mtmd_image_tokens_ptr = std::shared_ptr<mtmd_image_tokens>;
 
 struct mtmd_audio_tokens {
     uint32_t n_tokens;               // number of tokens
@@ -43,7 +52,7 @@ struct mtmd_audio_tokens {
 
     mtmd_audio_tokens clone() { return mtmd_audio_tokens{n_tokens, batch_f32.clone(), id}; }
 };
-using mtmd_audio_tokens_ptr = std::unique_ptr<mtmd_audio_tokens>;
+using mtmd_audio_tokens_ptr = std::shared_ptr<mtmd_audio_tokens>;
 
 struct mtmd_input_chunk {
     mtmd_input_chunk_type type;
@@ -78,19 +87,25 @@ mtmd_context_params mtmd_context_params_default() {
     // params.media_marker = mtmd_default_marker();
     params.image_marker = MICO_DEFAULT_IMAGE_MARKER;
     params.media_marker = MICO_DEFAULT_IMAGE_MARKER;
+    params.device = nullptr;
+    params.flash_attn = -1;
+    params.weight_type = GGML_TYPE_COUNT;
+    params.f16_activations = false;
+    params.n_load_threads = 0;
+    params.threadpool = nullptr;
     return params;
 }
 
 struct mtmd_context {
     struct clip_ctx* ctx_v{nullptr};  // vision
     struct clip_ctx* ctx_a{nullptr};  // audio
-    const struct llama_model* text_model;
+    const struct llama_model* text_model{nullptr};  // bound after the mmproj load by mtmd_bind_text_model
     std::vector<float> image_embd_v;  // image embedding vector
 
     bool print_timings;
     int n_threads;
     std::string media_marker;
-    const int n_embd_text;
+    int n_embd_text{0};
 
     // these are not token, but strings used to mark the beginning and end of image/audio embeddings
     std::string img_beg;
@@ -119,12 +134,10 @@ struct mtmd_context {
 
     // TODO @ngxson : add timings
 
-    mtmd_context(const char* mmproj_fname, const llama_model* text_model, const mtmd_context_params& ctx_params)
-        : text_model(text_model),
-          print_timings(ctx_params.print_timings),
+    mtmd_context(const char* mmproj_fname, const mtmd_context_params& ctx_params)
+        : print_timings(ctx_params.print_timings),
           n_threads(ctx_params.n_threads),
-          media_marker(ctx_params.media_marker),
-          n_embd_text(llama_model_n_embd(text_model)) {
+          media_marker(ctx_params.media_marker) {
         if (std::string(ctx_params.image_marker) != MTMD_DEFAULT_IMAGE_MARKER) {
             throw std::runtime_error("custom image_marker is not supported anymore, use media_marker instead");
         }
@@ -142,6 +155,13 @@ struct mtmd_context {
         clip_context_params ctx_clip_params;
         ctx_clip_params.use_gpu = ctx_params.use_gpu;
         ctx_clip_params.verbosity = ctx_params.verbosity;
+        ctx_clip_params.device = ctx_params.device;
+        ctx_clip_params.n_threads = ctx_params.n_threads;
+        ctx_clip_params.flash_attn_type = (clip_flash_attn_type)ctx_params.flash_attn;
+        ctx_clip_params.weight_type = ctx_params.weight_type;
+        ctx_clip_params.f16_activations = ctx_params.f16_activations;
+        ctx_clip_params.n_load_threads = ctx_params.n_load_threads;
+        ctx_clip_params.threadpool = ctx_params.threadpool;
 
         auto res = clip_init(mmproj_fname, ctx_clip_params);
         ctx_v = res.ctx_v;
@@ -159,6 +179,15 @@ struct mtmd_context {
                     "mismatch between vision and audio mmproj (n_embd_v = %d, n_embd_a = %d)\n", n_embd_v, n_embd_a));
             }
         }
+    }
+
+    // the token lookups of init_vision and init_audio need the vocab of the text model
+    void bind_text_model(const llama_model* model) {
+        text_model = model;
+        n_embd_text = llama_model_n_embd(text_model);
+        if (!ctx_v && !ctx_a) {
+            return;  // no mmproj
+        }
 
         // since we already validate n_embd of vision and audio mmproj,
         // we can safely assume that they are the same
@@ -336,14 +365,33 @@ private:
 
 mtmd_context* mtmd_init_from_file(const char* mmproj_fname, const struct llama_model* text_model,
                                   const struct mtmd_context_params ctx_params) {
+    mtmd_context* ctx = mtmd_load_from_file(mmproj_fname, ctx_params);
+    if (ctx && mtmd_bind_text_model(ctx, text_model) != 0) {
+        delete ctx;
+        return nullptr;
+    }
+    return ctx;
+}
+
+mtmd_context* mtmd_load_from_file(const char* mmproj_fname, const struct mtmd_context_params ctx_params) {
     try {
-        return new mtmd_context(mmproj_fname, text_model, ctx_params);
+        return new mtmd_context(mmproj_fname, ctx_params);
     } catch (const std::exception& e) {
         LOG_ERR("%s: error: %s\n", __func__, e.what());
         return nullptr;
     }
 }
 
+int32_t mtmd_bind_text_model(mtmd_context* ctx, const struct llama_model* text_model) {
+    try {
+        ctx->bind_text_model(text_model);
+        return 0;
+    } catch (const std::exception& e) {
+        LOG_ERR("%s: error: %s\n", __func__, e.what());
+        return 1;
+    }
+}
+
 void mtmd_free(mtmd_context* ctx) {
     if (ctx) {
         delete ctx;
@@ -360,6 +408,8 @@ struct mtmd_tokenizer {
     const llama_vocab* vocab;
 
     mtmd_input_chunks cur;
+    // image tokens by bitmap id, an image repeated in the prompt is preprocessed once and its chunks share the tokens
+    std::unordered_map<std::string, mtmd_image_tokens_ptr> tokenized_images;
 
     mtmd_tokenizer(mtmd_context* ctx, const mtmd_input_text* text, const mtmd_bitmap** bitmaps, size_t n_bitmaps)
         : ctx(ctx), bitmaps(bitmaps, bitmaps + n_bitmaps) {
@@ -475,6 +525,40 @@ struct mtmd_tokenizer {
                 add_text(ctx->img_beg, true);  // add image begin token
             }
 
+            if (bitmap->is_cached) {  // embeddings are held by the caller, skip decode and preprocess
+                mtmd_image_tokens_ptr image_tokens(new mtmd_image_tokens);
+                image_tokens->nx = bitmap->nx;
+                image_tokens->ny = bitmap->ny;
+                image_tokens->use_mrope_pos = ctx->use_mrope;
+                image_tokens->id = bitmap->id;
+                mtmd_input_chunk chunk{
+                    MTMD_INPUT_CHUNK_TYPE_IMAGE,
+                    {},  // text tokens
+                    std::move(image_tokens),
+                    nullptr,  // audio tokens
+                };
+                cur.entries.emplace_back(std::move(chunk));
+                if (!ctx->img_end.empty()) {
+                    add_text(ctx->img_end, true);  // add image end token
+                }
+                return 0;
+            }
+
+            auto tokenized = bitmap->id.empty() ? tokenized_images.end() : tokenized_images.find(bitmap->id);
+            if (tokenized != tokenized_images.end()) {
+                mtmd_input_chunk chunk{
+                    MTMD_INPUT_CHUNK_TYPE_IMAGE,
+                    {},  // text tokens
+                    tokenized->second,
+                    nullptr,  // audio tokens
+                };
+                cur.entries.emplace_back(std::move(chunk));
+                if (!ctx->img_end.empty()) {
+                    add_text(ctx->img_end, true);  // add image end token
+                }
+                return 0;
+            }
+
             // convert mtmd_bitmap to clip_image_u8
             clip_image_u8_ptr img_u8(clip_image_u8_init());
             img_u8->nx = bitmap->nx;
@@ -566,6 +650,13 @@ struct mtmd_tokenizer {
                     image_tokens->nx = clip_n_output_tokens_x(ctx->ctx_v, batch_f32.entries[0].get());
                     image_tokens->ny = clip_n_output_tokens_y(ctx->ctx_v, batch_f32.entries[0].get());
                     image_tokens->use_mrope_pos = true;
+                    if (bitmap->pool > 1 && batch_f32.entries.size() == 1) {  // NOTE: pooled on the token grid
+                        image_tokens->pool = bitmap->pool;
+                        image_tokens->nx_enc = image_tokens->nx;
+                        image_tokens->ny_enc = image_tokens->ny;
+                        image_tokens->nx = (image_tokens->nx + bitmap->pool - 1) / bitmap->pool;
+                        image_tokens->ny = (image_tokens->ny + bitmap->pool - 1) / bitmap->pool;
+                    }
                 } else {
                     // other models, we only need the total number of tokens
                     image_tokens->nx = n_tokens;
@@ -585,20 +676,19 @@ struct mtmd_tokenizer {
                             id = "";
                         }
 
-                        // Simple hash of image data
-                        uint64_t hash = 0x811c9dc5;
-                        for (size_t i = 0; i < n_bytes; ++i) {
-                            hash ^= static_cast<uint64_t>(data[i]);
-                            hash *= 0x01000193;
-                        }
-
-                        std::stringstream ss;
-                        ss << std::hex << std::setfill('0') << std::setw(16) << hash;
-                        id = ss.str();
+                        // 128 bit hash of image data, 32 hex digits
+                        uint64_t hi = 0, lo = 0;
+                        mtmd_hash_bytes(data, data ? n_bytes : 0, &hi, &lo);
+                        char hex[33];
+                        snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long)hi, (unsigned long long)lo);
+                        id = hex;
                     }
                 }
 
                 image_tokens->id = id; 
+                if (!bitmap->id.empty()) {
+                    tokenized_images[bitmap->id] = image_tokens;
+                }
                 LOG_DBG("image_tokens->nx = %d\n", image_tokens->nx);
                 LOG_DBG("image_tokens->ny = %d\n", image_tokens->ny);
                 LOG_DBG("batch_f32 size = %d\n", (int)image_tokens->batch_f32.entries.size());
@@ -646,7 +736,8 @@ struct mtmd_tokenizer {
 
             // consider each mel_spec as a separate audio chunk
             // TODO: maybe support batching, but this may come with memory cost
-            for (auto& mel_spec : mel_spec_chunks) {
+            for (size_t i_chunk = 0; i_chunk < mel_spec_chunks.size(); i_chunk++) {
+                auto& mel_spec = mel_spec_chunks[i_chunk];
                 clip_image_f32_ptr mel_f32(clip_image_f32_init());
                 mel_f32->nx = mel_spec.n_len;
                 mel_f32->ny = mel_spec.n_mel;
@@ -661,6 +752,9 @@ struct mtmd_tokenizer {
                 audio_tokens->n_tokens = n_tokens;
                 audio_tokens->batch_f32 = std::move(batch_f32);
                 audio_tokens->id = bitmap->id;  // optional
+                if (!bitmap->id.empty() && mel_spec_chunks.size() > 1) {
+                    audio_tokens->id += "#" + std::to_string(i_chunk);  // each 30 s chunk has its own embeddings
+                }
 
                 LOG_DBG("audio_tokens->n_tokens = %d\n", audio_tokens->n_tokens);
 
@@ -681,6 +775,8 @@ struct mtmd_tokenizer {
         return 0;
     }
 
+    // NOTE: each slice gets its own id (the overview keeps the image id), so slices are encoded, cached and decoded
+    // as separate chunks, the first slices are decoded while the next ones are still encoding
     std::vector<mtmd_input_chunk> split_batch_to_chunk(clip_image_f32_batch&& batch_f32, const std::string& id) {
         std::vector<mtmd_input_chunk> chunks;
 
@@ -689,7 +785,7 @@ struct mtmd_tokenizer {
             image_tokens->nx = clip_n_output_tokens(ctx->ctx_v, entry.get());
             image_tokens->ny = 1;
             image_tokens->batch_f32.entries.push_back(std::move(entry));
-            image_tokens->id = id;
+            image_tokens->id = chunks.empty() || id.empty() ? id : id + "/" + std::to_string(chunks.size());
 
             mtmd_input_chunk chunk{
                 MTMD_INPUT_CHUNK_TYPE_IMAGE,
@@ -751,7 +847,20 @@ int32_t mtmd_tokenize(mtmd_context* ctx, mtmd_input_chunks* output, const mtmd_i
     return tokenizer.tokenize(output);
 }
 
+static int32_t mtmd_encode_image_to(mtmd_context* ctx, const mtmd_image_tokens* image_tokens, float* out);
+
 int32_t mtmd_encode_chunk(mtmd_context* ctx, const mtmd_input_chunk* chunk) {
+    if (chunk->type == MTMD_INPUT_CHUNK_TYPE_IMAGE && ctx->ctx_v) {
+        ctx->image_embd_v.resize(chunk->tokens_image->n_tokens() * clip_n_mmproj_embd(ctx->ctx_v));
+        return mtmd_encode_chunk_to(ctx, chunk, ctx->image_embd_v.data());
+    } else if (chunk->type == MTMD_INPUT_CHUNK_TYPE_AUDIO && ctx->ctx_a) {
+        ctx->image_embd_v.resize(chunk->tokens_audio->n_tokens * ctx->n_embd_text);
+        return mtmd_encode_chunk_to(ctx, chunk, ctx->image_embd_v.data());
+    }
+    return mtmd_encode_chunk_to(ctx, chunk, nullptr);  // NOTE: reports the error
+}
+
+int32_t mtmd_encode_chunk_to(mtmd_context* ctx, const mtmd_input_chunk* chunk, float* out) {
     if (chunk->type == MTMD_INPUT_CHUNK_TYPE_TEXT) {
         LOG_WRN("mtmd_encode_chunk has no effect for text chunks\n");
         return 0;
@@ -760,16 +869,17 @@ int32_t mtmd_encode_chunk(mtmd_context* ctx, const mtmd_input_chunk* chunk) {
             LOG_ERR("%s: model does not support vision input\n", __func__);
             return 1;
         }
-        return mtmd_encode(ctx, chunk->tokens_image.get());
+        return mtmd_encode_image_to(ctx, chunk->tokens_image.get(), out);
     } else if (chunk->type == MTMD_INPUT_CHUNK_TYPE_AUDIO) {
         if (!ctx->ctx_a) {
             LOG_ERR("%s: model does not support audio input\n", __func__);
             return 1;
         }
-        int n_mmproj_embd = ctx->n_embd_text;
-        ctx->image_embd_v.resize(chunk->tokens_audio->n_tokens * n_mmproj_embd);
-        bool ok = clip_image_batch_encode(ctx->ctx_a, ctx->n_threads, &chunk->tokens_audio->batch_f32,
-                                          ctx->image_embd_v.data());
+        if (chunk->tokens_audio->batch_f32.entries.empty()) {
+            LOG_ERR("%s: audio has no preprocessed samples (released)\n", __func__);
+            return 1;
+        }
+        bool ok = clip_image_batch_encode(ctx->ctx_a, ctx->n_threads, &chunk->tokens_audio->batch_f32, out);
         return ok ? 0 : 1;
     }
 
@@ -778,14 +888,55 @@ int32_t mtmd_encode_chunk(mtmd_context* ctx, const mtmd_input_chunk* chunk) {
 }
 
 int32_t mtmd_encode(mtmd_context* ctx, const mtmd_image_tokens* image_tokens) {
+    if (!ctx->ctx_v) {
+        LOG_ERR("%s: this API does not support non-vision input, please use mtmd_encode_chunk instead\n", __func__);
+        return 1;
+    }
+    ctx->image_embd_v.resize(image_tokens->n_tokens() * clip_n_mmproj_embd(ctx->ctx_v));
+    return mtmd_encode_image_to(ctx, image_tokens, ctx->image_embd_v.data());
+}
+
+// Average of each pool x pool cell of the nx_enc x ny_enc embeddings in enc (row major), the cells of the last row
+// and column may be smaller
+static void mtmd_pool_image_tokens(const mtmd_image_tokens* image_tokens, const float* enc, int n_embd, float* out) {
+    const uint32_t pool = image_tokens->pool;
+    for (uint32_t y = 0; y < image_tokens->ny; y++) {
+        for (uint32_t x = 0; x < image_tokens->nx; x++) {
+            float* dst = out + ((size_t)y * image_tokens->nx + x) * n_embd;
+            std::fill(dst, dst + n_embd, 0.0f);
+            uint32_t y1 = std::min((y + 1) * pool, image_tokens->ny_enc);
+            uint32_t x1 = std::min((x + 1) * pool, image_tokens->nx_enc);
+            for (uint32_t ye = y * pool; ye < y1; ye++) {
+                for (uint32_t xe = x * pool; xe < x1; xe++) {
+                    const float* src = enc + ((size_t)ye * image_tokens->nx_enc + xe) * n_embd;
+                    for (int i = 0; i < n_embd; i++) dst[i] += src[i];
+                }
+            }
+            const float scale = 1.0f / ((y1 - y * pool) * (x1 - x * pool));
+            for (int i = 0; i < n_embd; i++) dst[i] *= scale;
+        }
+    }
+}
+
+static int32_t mtmd_encode_image_to(mtmd_context* ctx, const mtmd_image_tokens* image_tokens, float* out) {
     clip_ctx* ctx_clip = ctx->ctx_v;
     if (!ctx_clip) {
         LOG_ERR("%s: this API does not support non-vision input, please use mtmd_encode_chunk instead\n", __func__);
         return 1;
     }
+    if (image_tokens->batch_f32.entries.empty()) {
+        LOG_ERR("%s: image has no preprocessed patches (cached bitmap or released)\n", __func__);
+        return 1;
+    }
     int n_mmproj_embd = clip_n_mmproj_embd(ctx_clip);
-    ctx->image_embd_v.resize(image_tokens->n_tokens() * n_mmproj_embd);
     bool ok = false;
+    std::vector<float> enc;  // full grid of a pooled image
+    float* pooled = nullptr;
+    if (image_tokens->pool > 1) {
+        enc.resize((size_t)image_tokens->nx_enc * image_tokens->ny_enc * n_mmproj_embd);
+        pooled = out;
+        out = enc.data();
+    }
 
     if (clip_is_llava(ctx_clip) || clip_is_minicpmv(ctx_clip) || clip_is_glm(ctx_clip)) {
         // TODO @ngxson : llava does not support batched encoding ; this should be fixed inside
@@ -794,17 +945,38 @@ int32_t mtmd_encode(mtmd_context* ctx, const mtmd_image_tokens* image_tokens) {
         for (size_t i = 0; i < entries.size(); i++) {
             int n_tokens_per_image = clip_n_output_tokens(ctx_clip, entries[i].get());
             ok = clip_image_encode(ctx_clip, ctx->n_threads, entries[i].get(),
-                                   ctx->image_embd_v.data() + i * n_mmproj_embd * n_tokens_per_image);
+                                   out + i * n_mmproj_embd * n_tokens_per_image);
         }
     } else {
-        ok = clip_image_batch_encode(ctx_clip, ctx->n_threads, &image_tokens->batch_f32, ctx->image_embd_v.data());
+        ok = clip_image_batch_encode(ctx_clip, ctx->n_threads, &image_tokens->batch_f32, out);
     }
+    if (ok && pooled) mtmd_pool_image_tokens(image_tokens, enc.data(), n_mmproj_embd, pooled);
 
     return ok ? 0 : 1;
 }
 
 float* mtmd_get_output_embd(mtmd_context* ctx) { return ctx->image_embd_v.data(); }
 
+int32_t mtmd_memory_breakdown(mtmd_context* ctx, llama_memory_breakdown_data* data, int32_t n_max) {
+    std::vector<llama_memory_breakdown_data> mb;
+    for (clip_ctx* clip : {ctx->ctx_v, ctx->ctx_a}) {
+        if (!clip) continue;
+        std::vector<clip_memory_breakdown_data> entries(clip_memory_breakdown(clip, nullptr, 0));
+        int32_t n_entries = clip_memory_breakdown(clip, entries.data(), (int)entries.size());
+        entries.resize(std::min((size_t)n_entries, entries.size()));  // NOTE: may have changed between the calls
+        for (const auto& e : entries) {
+            auto it = std::find_if(mb.begin(), mb.end(),
+                                   [&e](const llama_memory_breakdown_data& m) { return strcmp(m.buft, e.buft) == 0; });
+            if (it == mb.end()) it = mb.insert(mb.end(), {e.buft, e.device, 0, 0, 0, 0});
+            it->model += e.model;
+            it->compute += e.compute;
+            it->output += e.output;
+        }
+    }
+    for (int32_t i = 0; i < n_max && i < (int32_t)mb.size(); i++) data[i] = mb[i];
+    return (int32_t)mb.size();
+}
+
 bool mtmd_decode_use_non_causal(mtmd_context* ctx) {
     if (ctx->ctx_v && clip_get_projector_type(ctx->ctx_v) == PROJECTOR_TYPE_GEMMA3) {
         return true;
@@ -818,6 +990,17 @@ bool mtmd_support_vision(mtmd_context* ctx) { return ctx->ctx_v != nullptr; }
 
 bool mtmd_support_audio(mtmd_context* ctx) { return ctx->ctx_a != nullptr; }
 
+bool mtmd_support_cached_bitmap(mtmd_context* ctx) {
+    return ctx->ctx_v != nullptr && ctx->slice_tmpl == MTMD_SLICE_TMPL_NONE;
+}
+
+int mtmd_get_max_image_size(mtmd_context* ctx) {
+    if (!ctx->ctx_v || ctx->slice_tmpl != MTMD_SLICE_TMPL_NONE) {
+        return 0;
+    }
+    return clip_get_max_image_size(ctx->ctx_v);
+}
+
 int mtmd_get_audio_bitrate(mtmd_context* ctx) {
     if (!ctx->ctx_a) {
         return -1;
@@ -826,6 +1009,11 @@ int mtmd_get_audio_bitrate(mtmd_context* ctx) {
     return 16000;  // 16kHz
 }
 
+void mtmd_set_eval_callback(mtmd_context* ctx, ggml_backend_sched_eval_callback cb_eval, void* user_data) {
+    if (ctx->ctx_v) clip_set_eval_callback(ctx->ctx_v, cb_eval, user_data);
+    if (ctx->ctx_a) clip_set_eval_callback(ctx->ctx_a, cb_eval, user_data);
+}
+
 //
 // public API functions
 //
@@ -854,6 +1042,19 @@ mtmd_bitmap* mtmd_bitmap_init_from_audio(size_t n_samples, const float* data) {
     return bitmap;
 }
 
+mtmd_bitmap* mtmd_bitmap_init_cached(uint32_t n_tokens_x, uint32_t n_tokens_y, const char* id) {
+    mtmd_bitmap* bitmap = new mtmd_bitmap;
+    bitmap->nx = n_tokens_x;
+    bitmap->ny = n_tokens_y;
+    bitmap->is_cached = true;
+    bitmap->id = id ? id : "";
+    return bitmap;
+}
+
+void mtmd_bitmap_set_pool(mtmd_bitmap* bitmap, uint32_t pool) { bitmap->pool = std::max(pool, 1u); }
+
+uint32_t mtmd_bitmap_get_pool(const mtmd_bitmap* bitmap) { return bitmap->pool; }
+
 uint32_t mtmd_bitmap_get_nx(const mtmd_bitmap* bitmap) { return bitmap->nx; }
 
 uint32_t mtmd_bitmap_get_ny(const mtmd_bitmap* bitmap) { return bitmap->ny; }
@@ -874,6 +1075,49 @@ void mtmd_bitmap_set_id(mtmd_bitmap* bitmap, const char* id) {
     }
 }
 
+static inline uint64_t mtmd_rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t mtmd_fmix64(uint64_t k) {  // murmur3 finalizer
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+void mtmd_hash_bytes(const void* data, size_t n_bytes, uint64_t* hi, uint64_t* lo) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t h1 = 0x9368e53c2f6af274ULL, h2 = 0x586dcd208f7cd3fdULL;
+    size_t i = 0;
+    if (n_bytes >= 32) {  // 4 independent lanes of 32 byte stripes, no serial dependency between words
+        uint64_t lanes[4] = {h1, h2, h1 ^ 0x7a5e8b1c3d2f4e6aULL, h2 ^ 0x1f3e5d7c9b8a6f4eULL};
+        for (; i + 32 <= n_bytes; i += 32) {
+            uint64_t w[4];
+            memcpy(w, bytes + i, sizeof(w));
+            for (int l = 0; l < 4; l++) {
+                lanes[l] = mtmd_rotl64(lanes[l] ^ (w[l] * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+            }
+        }
+        h1 = mtmd_fmix64(lanes[0]) ^ mtmd_rotl64(lanes[1], 21);
+        h2 = mtmd_fmix64(lanes[2]) ^ mtmd_rotl64(lanes[3], 43);
+    }
+    for (; i + 8 <= n_bytes; i += 8) {
+        uint64_t w;
+        memcpy(&w, bytes + i, sizeof(w));
+        h1 = mtmd_rotl64(h1 ^ (w * 0x87c37b91114253d5ULL), 31) * 0x4cf5ad432745937fULL;
+        h2 = mtmd_rotl64(h2 ^ (w * 0x4cf5ad432745937fULL), 27) + h1;
+    }
+    uint64_t tail = 0;
+    for (size_t j = 0; i + j < n_bytes; j++) tail |= (uint64_t)bytes[i + j] << (8 * j);
+    h1 ^= tail * 0x87c37b91114253d5ULL;
+    h2 ^= mtmd_rotl64(tail, 33);
+
+    *hi = mtmd_fmix64(h1 ^ n_bytes) + h2;
+    *lo = mtmd_fmix64(h2 ^ n_bytes) + *hi;
+    if (*hi == 0 && *lo == 0) *lo = 1;  // all zero means no id
+}
+
 void mtmd_bitmap_free(mtmd_bitmap* bitmap) {
     if (bitmap) {
         delete bitmap;
@@ -904,11 +1148,7 @@ void mtmd_input_chunks_add_chunk(mtmd_input_chunks* chunks, const mtmd_input_chu
         return;
     }
     
-    // Create a copy of the chunk
-    mtmd_input_chunk* copied_chunk = mtmd_input_chunk_copy(chunk);
-    if (copied_chunk) {
-        chunks->entries.emplace_back(std::move(*copied_chunk));
-    }
+    chunks->entries.push_back(*chunk);  // NOTE: shares the image and audio tokens
 }
 
 void mtmd_input_chunks_insert_chunk_front(mtmd_input_chunks* chunks, const mtmd_input_chunk* chunk) {
@@ -916,11 +1156,7 @@ void mtmd_input_chunks_insert_chunk_front(mtmd_input_chunks* chunks, const mtmd_
         return;
     }
     
-    // Create a copy of the chunk
-    mtmd_input_chunk* copied_chunk = mtmd_input_chunk_copy(chunk);
-    if (copied_chunk) {
-        chunks->entries.insert(chunks->entries.begin(), std::move(*copied_chunk));
-    }
+    chunks->entries.insert(chunks->entries.begin(), *chunk);  // NOTE: shares the image and audio tokens
 }
 
 // mtmd_input_chunk
@@ -977,23 +1213,8 @@ const char* mtmd_input_chunk_get_id(const mtmd_input_chunk* chunk) {
 }
 
 mtmd_input_chunk* mtmd_input_chunk_copy(const mtmd_input_chunk* chunk) {
-    mtmd_input_chunk* copy = new mtmd_input_chunk{
-        chunk->type,
-        chunk->tokens_text,
-        nullptr,
-        nullptr,
-    };
-    if (chunk->tokens_image) {
-        // copy the image tokens
-        copy->tokens_image = mtmd_image_tokens_ptr(new mtmd_image_tokens());
-        *copy->tokens_image = chunk->tokens_image->clone();
-    }
-    if (chunk->tokens_audio) {
-        // copy the audio tokens
-        copy->tokens_audio = mtmd_audio_tokens_ptr(new mtmd_audio_tokens());
-        *copy->tokens_audio = chunk->tokens_audio->clone();
-    }
-    return copy;
+    // the image and audio tokens are refcounted, only the text tokens are copied
+    return new mtmd_input_chunk(*chunk);
 }
 
 void mtmd_input_chunk_free(mtmd_input_chunk* chunk) {
@@ -1002,6 +1223,18 @@ void mtmd_input_chunk_free(mtmd_input_chunk* chunk) {
     }
 }
 
+void mtmd_input_chunk_release_pixels(mtmd_input_chunk* chunk) {
+    if (!chunk) {
+        return;
+    }
+    if (chunk->tokens_image) {
+        std::vector<clip_image_f32_ptr>().swap(chunk->tokens_image->batch_f32.entries);
+    }
+    if (chunk->tokens_audio) {
+        std::vector<clip_image_f32_ptr>().swap(chunk->tokens_audio->batch_f32.entries);
+    }
+}
+
 // mtmd_image_tokens
 
 size_t mtmd_image_tokens_get_n_tokens(const mtmd_image_tokens* image_tokens) { return image_tokens->n_tokens(); }
@@ -82,6 +82,13 @@ struct mtmd_context_params {
     enum ggml_log_level verbosity;
     const char* image_marker;  // deprecated, use media_marker instead
     const char* media_marker;
+    const char* device;  // GPU backend device of the vision encoder, nullptr for the first GPU
+    int flash_attn;      // flash attention in the encoder, -1 if the backend supports it, 0 off, 1 on
+    enum ggml_type weight_type;  // encoder linear weights converted on load (e.g. Q8_0), GGML_TYPE_COUNT keeps the file's
+    bool f16_activations;        // F16 K/V operands in the encoder attention
+    int n_load_threads;          // threads reading and uploading the weights, <= 1 loads on the calling thread
+    const struct ggml_threadpool_params* threadpool;  // persistent threads of the encoder CPU graphs, nullptr starts
+                                                      // n_threads threads per encode
 };
 
 MTMD_API const char* mtmd_default_marker(void);
@@ -93,6 +100,11 @@ MTMD_API struct mtmd_context_params mtmd_context_params_default(void);
 MTMD_API mtmd_context* mtmd_init_from_file(const char* mmproj_fname, const struct llama_model* text_model,
                                            const struct mtmd_context_params ctx_params);
 
+// two step initialization: the mmproj load does not need the text model, so it may run while the text model loads
+// mtmd_bind_text_model must complete the context before any other use, returns 0 on success
+MTMD_API mtmd_context* mtmd_load_from_file(const char* mmproj_fname, const struct mtmd_context_params ctx_params);
+MTMD_API int32_t mtmd_bind_text_model(mtmd_context* ctx, const struct llama_model* text_model);
+
 MTMD_API void mtmd_free(mtmd_context* ctx);
 
 // whether we need to set non-causal mask before llama_decode
@@ -107,10 +119,20 @@ MTMD_API bool mtmd_support_vision(mtmd_context* ctx);
 // whether the current model supports audio input
 MTMD_API bool mtmd_support_audio(mtmd_context* ctx);
 
+// whether mtmd_bitmap_init_cached can stand in for an image, false for models slicing images into several chunks
+MTMD_API bool mtmd_support_cached_bitmap(mtmd_context* ctx);
+
+// longest image side preprocessing keeps, larger images may be downscaled while decoding
+// return 0 if any size matters (images sliced by size) or vision is not supported
+MTMD_API int mtmd_get_max_image_size(mtmd_context* ctx);
+
 // get audio bitrate in Hz, for example 16000 for Whisper
 // return -1 if audio is not supported
 MTMD_API int mtmd_get_audio_bitrate(mtmd_context* ctx);
 
+// eval callback of the backend schedulers of the following encodes (vision and audio), nullptr removes it
+MTMD_API void mtmd_set_eval_callback(mtmd_context* ctx, ggml_backend_sched_eval_callback cb_eval, void* user_data);
+
 // mtmd_bitmap
 //
 // if bitmap is image:
@@ -121,6 +143,13 @@ MTMD_API int mtmd_get_audio_bitrate(mtmd_context* ctx);
 //     the data is in float format (PCM F32)
 MTMD_API mtmd_bitmap* mtmd_bitmap_init(uint32_t nx, uint32_t ny, const unsigned char* data);
 MTMD_API mtmd_bitmap* mtmd_bitmap_init_from_audio(size_t n_samples, const float* data);
+// image without pixels, tokenized as an image chunk of n_tokens_x * n_tokens_y tokens with the given id and no
+// preprocessed patches, for callers that already hold the embeddings of that id (it cannot be encoded)
+MTMD_API mtmd_bitmap* mtmd_bitmap_init_cached(uint32_t n_tokens_x, uint32_t n_tokens_y, const char* id);
+// vision token reduction: each pool x pool cell of the projected token grid is averaged into one token, so the image
+// takes about 1 / pool^2 of the tokens. Only M-RoPE models (a 2D token grid), ignored for others, 1 keeps every token
+MTMD_API void mtmd_bitmap_set_pool(mtmd_bitmap* bitmap, uint32_t pool);
+MTMD_API uint32_t mtmd_bitmap_get_pool(const mtmd_bitmap* bitmap);
 MTMD_API uint32_t mtmd_bitmap_get_nx(const mtmd_bitmap* bitmap);
 MTMD_API uint32_t mtmd_bitmap_get_ny(const mtmd_bitmap* bitmap);
 MTMD_API const unsigned char* mtmd_bitmap_get_data(const mtmd_bitmap* bitmap);
@@ -132,6 +161,9 @@ MTMD_API void mtmd_bitmap_free(mtmd_bitmap* bitmap);
 // mtmd_bitmap_get_data()
 MTMD_API const char* mtmd_bitmap_get_id(const mtmd_bitmap* bitmap);
 MTMD_API void mtmd_bitmap_set_id(mtmd_bitmap* bitmap, const char* id);
+// 128 bit content hash, never all zero. A bitmap without id gets the 32 hex digits of hi and lo of its data as id,
+// callers keying caches by content must hash with this one so their keys match those ids
+MTMD_API void mtmd_hash_bytes(const void* data, size_t n_bytes, uint64_t* hi, uint64_t* lo);
 
 // mtmd_input_chunks
 //
@@ -160,8 +192,13 @@ MTMD_API llama_pos mtmd_input_chunk_get_n_pos(const mtmd_input_chunk* chunk);
 // in case you want to use custom logic to handle the chunk (i.e. KV cache management)
 // you can move the chunk ownership to your own code by copying it
 // remember to free the chunk when you are done with it
+// NOTE: copies share the preprocessed image and audio tokens (refcounted, immutable), only text tokens are copied
 MTMD_API mtmd_input_chunk* mtmd_input_chunk_copy(const mtmd_input_chunk* chunk);
 MTMD_API void mtmd_input_chunk_free(mtmd_input_chunk* chunk);
+// drops the preprocessed patches of an image or audio chunk in all its copies once its embeddings are held elsewhere,
+// size, id and token count stay, encoding it fails afterwards like a cached bitmap
+// NOTE: no encode of the chunk may run meanwhile
+MTMD_API void mtmd_input_chunk_release_pixels(mtmd_input_chunk* chunk);
 
 // mtmd_image_tokens
 //
@@ -200,11 +237,20 @@ MTMD_API int32_t mtmd_encode(mtmd_context* ctx, const mtmd_image_tokens* image_t
 // returns 0 on success
 MTMD_API int32_t mtmd_encode_chunk(mtmd_context* ctx, const mtmd_input_chunk* chunk);
 
+// same as mtmd_encode_chunk, the embeddings are written straight into out instead of the context output buffer
+// out must hold llama_model_n_embd(model) * mtmd_input_chunk_get_n_tokens(chunk) floats
+// returns 0 on success
+MTMD_API int32_t mtmd_encode_chunk_to(mtmd_context* ctx, const mtmd_input_chunk* chunk, float* out);
+
 // get output embeddings from the last encode pass
 // the reading size (in bytes) is equal to:
 // llama_model_n_embd(model) * mtmd_input_chunk_get_n_tokens(chunk) * sizeof(float)
 MTMD_API float* mtmd_get_output_embd(mtmd_context* ctx);
 
+// bytes the vision and audio encoders hold per buffer type (memory is 0), safe while another thread encodes
+// fills up to n_max entries, returns the number of buffer types
+MTMD_API int32_t mtmd_memory_breakdown(mtmd_context* ctx, llama_memory_breakdown_data* data, int32_t n_max);
+
 MTMD_API mtmd_input_chunks* mtmd_create_text_chunks(std::vector<llama_token> tokens);
 MTMD_API mtmd_input_chunk* mtmd_create_text_chunk(std::vector<llama_token> tokens);
 /////////////////////////////////////////
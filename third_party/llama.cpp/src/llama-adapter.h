@@ -74,3 +74,6 @@ struct llama_adapter_lora {
 };
 
 using llama_adapter_loras = std::unordered_map<llama_adapter_lora *, float>;
+
+// adapter and scale per sequence, a batch row only adds the delta of the adapter its sequence is routed to
+using llama_adapter_lora_routes = std::unordered_map<llama_seq_id, std::pair<llama_adapter_lora *, float>>;
@@ -3,12 +3,17 @@
 #include "llama-impl.h"
 #include "llama-batch.h"
 #include "llama-io.h"
+#include "llama-kv-cache-unified.h"
+#include "llama-kv-cache-unified-iswa.h"
 #include "llama-memory.h"
 #include "llama-mmap.h"
 #include "llama-model.h"
 
+#include <algorithm>
 #include <cinttypes>
+#include <cmath>
 #include <cstring>
+#include <functional>
 #include <limits>
 #include <stdexcept>
 
@@ -40,12 +45,14 @@ llama_context::llama_context(
     cparams.yarn_beta_fast   = params.yarn_beta_fast;
     cparams.yarn_beta_slow   = params.yarn_beta_slow;
     cparams.defrag_thold     = params.defrag_thold;
+    cparams.n_kv_pad         = params.n_kv_pad;
     cparams.embeddings       = params.embeddings;
     cparams.offload_kqv      = params.offload_kqv;
     cparams.flash_attn       = params.flash_attn;
     cparams.no_perf          = params.no_perf;
     cparams.pooling_type     = params.pooling_type;
     cparams.warmup           = false;
+    cparams.attn_probe_seq   = -1;
 
     cparams.n_ctx            = params.n_ctx           == 0    ? hparams.n_ctx_train           : params.n_ctx;
     cparams.rope_freq_base   = params.rope_freq_base  == 0.0f ? hparams.rope_freq_base_train  : params.rope_freq_base;
@@ -100,6 +107,7 @@ llama_context::llama_context(
     }
 
     cparams.n_ubatch = std::min(cparams.n_batch, params.n_ubatch == 0 ? params.n_batch : params.n_ubatch);
+    cparams.n_ubatch_decode = std::min(cparams.n_ubatch, std::max(1u, params.n_ubatch_decode));
 
     cparams.op_offload = params.op_offload;
 
@@ -110,6 +118,9 @@ llama_context::llama_context(
     LLAMA_LOG_INFO("%s: n_ctx_per_seq = %u\n",   __func__, n_ctx_per_seq);
     LLAMA_LOG_INFO("%s: n_batch       = %u\n",   __func__, cparams.n_batch);
     LLAMA_LOG_INFO("%s: n_ubatch      = %u\n",   __func__, cparams.n_ubatch);
+    if (cparams.n_ubatch_decode > 1) {
+        LLAMA_LOG_INFO("%s: n_ubatch_dec  = %u\n",   __func__, cparams.n_ubatch_decode);
+    }
     LLAMA_LOG_INFO("%s: causal_attn   = %d\n",   __func__, cparams.causal_attn);
     LLAMA_LOG_INFO("%s: flash_attn    = %d\n",   __func__, cparams.flash_attn);
     LLAMA_LOG_INFO("%s: freq_base     = %.1f\n", __func__, cparams.rope_freq_base);
@@ -259,6 +270,7 @@ llama_context::llama_context(
         }
 
         sched.reset(ggml_backend_sched_new(backend_ptrs.data(), backend_buft.data(), backend_ptrs.size(), max_nodes, pipeline_parallel, cparams.op_offload));
+        ggml_backend_sched_set_op_offload_min_batch(sched.get(), params.n_op_offload_min);
 
         if (pipeline_parallel) {
             LLAMA_LOG_INFO("%s: pipeline parallelism enabled (n_copies=%d)\n", __func__, ggml_backend_sched_get_n_copies(sched.get()));
@@ -299,8 +311,11 @@ llama_context::llama_context(
         }
 
         // reserve with tg graph to get the number of splits and nodes
+        // NOTE: with n_ubatch_decode the tg graph is a whole decode step, one token and output per sequence, so its
+        //       shape is planned before the first step and the compute buffers cover it next to the pp graph
         {
-            auto * gf = graph_reserve(1, 1, 1, mstate.get());
+            const uint32_t n_tokens_tg = std::min(cparams.n_ctx, cparams.n_ubatch_decode);
+            auto * gf = graph_reserve(n_tokens_tg, std::min(n_seqs, n_tokens_tg), n_tokens_tg, mstate.get());
             if (!gf) {
                 throw std::runtime_error("failed to allocate compute tg buffers");
             }
@@ -331,13 +346,13 @@ llama_context::llama_context(
         if (n_nodes_pp == n_nodes_tg) {
             LLAMA_LOG_INFO("%s: graph nodes  = %d\n", __func__, n_nodes_pp);
         } else {
-            LLAMA_LOG_INFO("%s: graph nodes  = %d (with bs=%d), %d (with bs=1)\n", __func__, n_nodes_pp, n_tokens, n_nodes_tg);
+            LLAMA_LOG_INFO("%s: graph nodes  = %d (with bs=%d), %d (with bs=%u)\n", __func__, n_nodes_pp, n_tokens, n_nodes_tg, cparams.n_ubatch_decode);
         }
 
         if (n_splits_pp == n_splits_tg) {
             LLAMA_LOG_INFO("%s: graph splits = %d\n", __func__, n_splits_pp);
         } else {
-            LLAMA_LOG_INFO("%s: graph splits = %d (with bs=%d), %d (with bs=1)\n", __func__, n_splits_pp, n_tokens, n_splits_tg);
+            LLAMA_LOG_INFO("%s: graph splits = %d (with bs=%d), %d (with bs=%u)\n", __func__, n_splits_pp, n_tokens, n_splits_tg, cparams.n_ubatch_decode);
         }
     }
 }
@@ -424,6 +439,45 @@ llama_memory_t llama_context::get_memory() const {
     return memory.get();
 }
 
+std::map<ggml_backend_buffer_type_t, llama_memory_breakdown_data> llama_context::memory_breakdown() const {
+    std::map<ggml_backend_buffer_type_t, llama_memory_breakdown_data> mb;
+    auto entry = [&mb](ggml_backend_buffer_type_t buft) -> llama_memory_breakdown_data & {
+        auto it = mb.find(buft);
+        if (it == mb.end()) {
+            ggml_backend_dev_t dev = ggml_backend_buft_get_device(buft);
+            it = mb.emplace(buft, llama_memory_breakdown_data{
+                ggml_backend_buft_name(buft), dev ? ggml_backend_dev_name(dev) : nullptr, 0, 0, 0, 0}).first;
+        }
+        return it->second;
+    };
+
+    for (const auto & [buft, size] : model.memory_breakdown()) {
+        entry(buft).model += size;
+    }
+    if (memory) {
+        for (const auto & [buft, size] : memory->memory_breakdown()) {
+            entry(buft).memory += size;
+        }
+    }
+    if (buf_output) {
+        entry(ggml_backend_buffer_get_type(buf_output.get())).output += ggml_backend_buffer_get_size(buf_output.get());
+    }
+    {
+        std::lock_guard<std::mutex> lock(buf_output_mutex);
+        for (const auto & buf : buf_output_pool) {
+            entry(ggml_backend_buffer_get_type(buf.get())).output += ggml_backend_buffer_get_size(buf.get());
+        }
+    }
+    for (size_t i = 0; i < backend_ptrs.size(); ++i) {
+        const size_t size = ggml_backend_sched_get_buffer_size(sched.get(), backend_ptrs[i]);
+        if (size > 0) {
+            entry(backend_buft[i]).compute += size;
+        }
+    }
+
+    return mb;
+}
+
 // deprecated
 void llama_context::kv_self_defrag_sched() {
     if (!memory) {
@@ -533,6 +587,87 @@ float * llama_context::get_logits_ith(int32_t i) {
     }
 }
 
+llama_token llama_context::get_argmax_ith(int32_t i) {
+    int64_t j = -1;
+
+    if (i < 0) {
+        j = n_outputs + i;
+    } else if ((size_t) i < output_ids.size()) {
+        j = output_ids[i];
+    }
+
+    if (j < 0 || j >= (int64_t) argmax.size()) {
+        LLAMA_LOG_ERROR("%s: invalid argmax id %d\n", __func__, i);
+        return LLAMA_TOKEN_NULL;
+    }
+
+    return argmax[j];
+}
+
+llama_outputs * llama_context::take_outputs() {
+    synchronize();
+
+    if (n_outputs == 0 || !buf_output) {
+        return nullptr;
+    }
+
+    auto * outputs = new llama_outputs;
+    outputs->ctx        = this;
+    outputs->buf        = std::move(buf_output);
+    outputs->logits     = logits_size > 0 && !output_argmax ? logits : nullptr; // note: argmax only is not copied
+    outputs->n_outputs  = n_outputs;
+    outputs->n_vocab    = model.vocab.n_tokens();
+    outputs->output_ids = output_ids;
+    if (output_argmax) {
+        outputs->argmax = argmax;
+    }
+
+    // note: output_reserve() of the next decode allocates a buffer if the pool is empty
+    logits    = nullptr;
+    embd      = nullptr;
+    n_outputs = 0;
+    std::fill(output_ids.begin(), output_ids.end(), -1);
+    {
+        std::lock_guard<std::mutex> lock(buf_output_mutex);
+        if (!buf_output_pool.empty()) {
+            buf_output = std::move(buf_output_pool.back());
+            buf_output_pool.pop_back();
+        }
+    }
+
+    return outputs;
+}
+
+void llama_context::free_outputs(llama_outputs * outputs) {
+    std::lock_guard<std::mutex> lock(buf_output_mutex);
+    buf_output_pool.push_back(std::move(outputs->buf));
+}
+
+int64_t llama_outputs::output_id(int32_t i) const {
+    if (i < 0) {
+        return (int64_t) n_outputs + i;
+    }
+    return (size_t) i < output_ids.size() ? output_ids[i] : -1;
+}
+
+float * llama_outputs::get_logits_ith(int32_t i) {
+    const int64_t j = output_id(i);
+    if (!logits || j < 0 || j >= n_outputs) {
+        LLAMA_LOG_ERROR("%s: invalid logits id %d\n", __func__, i);
+        return nullptr;
+    }
+    return logits + j*n_vocab;
+}
+
+llama_token llama_outputs::get_argmax_ith(int32_t i) {
+    const int64_t j = output_id(i);
+    if (j < 0 || j >= (int64_t) argmax.size()) {
+        LLAMA_LOG_ERROR("%s: invalid argmax id %d\n", __func__, i);
+        return LLAMA_TOKEN_NULL;
+    }
+    return argmax[j];
+}
+
 float * llama_context::get_embeddings() {
     return embd;
 }
@@ -628,12 +763,67 @@ void llama_context::set_embeddings(bool value) {
     cparams.embeddings = value;
 }
 
+void llama_context::set_eval_callback(ggml_backend_sched_eval_callback cb_eval, void * cb_eval_user_data) {
+    cparams.cb_eval           = cb_eval;
+    cparams.cb_eval_user_data = cb_eval_user_data;
+}
+
+void llama_context::set_output_argmax(bool value) {
+    LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
+
+    output_argmax = value;
+}
+
+void llama_context::set_attn_probe(llama_seq_id seq_id) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d\n", __func__, seq_id);
+
+    cparams.attn_probe_seq = seq_id;
+}
+
+int32_t llama_context::attn_probe_evict(llama_seq_id seq_id, llama_pos p0, llama_pos p1, float keep) {
+    auto * kv = dynamic_cast<llama_kv_cache_unified *>(memory.get());
+    if (!kv || seq_id != attn_probe_of) {
+        return -1;
+    }
+
+    // the probed cells of the sequence in [p0, p1), the most attended ones first
+    std::vector<std::pair<float, uint32_t>> cells;
+    for (const auto & [cell, score] : attn_probe) {
+        const llama_pos pos = kv->cell_seq_pos(cell, seq_id);
+        if (pos >= p0 && pos < p1) {
+            cells.emplace_back(score, cell);
+        }
+    }
+    const size_t n_keep = (size_t) std::ceil(std::max(0.0f, keep) * cells.size());
+    if (n_keep >= cells.size()) {
+        return 0;
+    }
+    std::nth_element(cells.begin(), cells.begin() + n_keep, cells.end(), std::greater<std::pair<float, uint32_t>>());
+
+    std::vector<uint32_t> dropped;
+    for (size_t i = n_keep; i < cells.size(); ++i) {
+        dropped.push_back(cells[i].second);
+    }
+    return (int32_t) kv->seq_rm_cells(seq_id, dropped);
+}
+
 void llama_context::set_causal_attn(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
     cparams.causal_attn = value;
 }
 
+void llama_context::set_seq_causal_attn(llama_seq_id seq_id, bool value) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d, value = %d\n", __func__, seq_id, value);
+
+    if (seq_id < 0 || (uint32_t) seq_id >= cparams.n_seq_max) {
+        LLAMA_LOG_ERROR("%s: invalid seq_id = %d\n", __func__, seq_id);
+        return;
+    }
+    cparams.seq_non_causal.resize(cparams.n_seq_max, false);
+    cparams.seq_non_causal[seq_id] = !value;
+}
+
 void llama_context::set_warmup(bool value) {
     LLAMA_LOG_DEBUG("%s: value = %d\n", __func__, value);
 
@@ -667,6 +857,19 @@ void llama_context::clear_adapter_lora() {
     loras.clear();
 }
 
+void llama_context::set_adapter_lora_seq(
+            llama_seq_id seq_id,
+            llama_adapter_lora * adapter,
+            float scale) {
+    LLAMA_LOG_DEBUG("%s: seq_id = %d, adapter = %p, scale = %f\n", __func__, seq_id, (void *) adapter, scale);
+
+    if (adapter == nullptr) {
+        lora_routes.erase(seq_id);
+    } else {
+        lora_routes[seq_id] = { adapter, scale };
+    }
+}
+
 bool llama_context::apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -699,6 +902,19 @@ llm_graph_result_ptr llama_context::process_ubatch(const llama_ubatch & ubatch,
         return nullptr;
     }
 
+    if (auto * t_probe = res->get_attn_probe()) {
+        ggml_set_output(t_probe);
+        ggml_build_forward_expand(gf, t_probe);
+    }
+
+    t_argmax = nullptr;
+    if (output_argmax && res->get_logits()) {
+        // fused greedy sampling: only one id per output row leaves the device
+        t_argmax = ggml_argmax(ctx_compute.get(), res->get_logits());
+        ggml_set_output(t_argmax);
+        ggml_build_forward_expand(gf, t_argmax);
+    }
+
     // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
     if (!ggml_backend_sched_alloc_graph(sched.get(), gf)) {
@@ -929,6 +1145,18 @@ int llama_context::decode(const llama_batch & batch_inp) {
 
     GGML_ASSERT((cparams.causal_attn || cparams.n_ubatch >= n_tokens_all) && "non-causal attention requires n_ubatch >= n_tokens");
 
+    if (n_tokens_all > cparams.n_ubatch && !cparams.seq_non_causal.empty()) {
+        // a non-causal sequence split over ubatches would miss its own later tokens
+        for (uint32_t i = 0; i < n_tokens_all; ++i) {
+            const llama_seq_id seq_id = batch.seq_id[i][0];
+            if (seq_id >= 0 && (size_t) seq_id < cparams.seq_non_causal.size() && cparams.seq_non_causal[seq_id]) {
+                LLAMA_LOG_ERROR("%s: non-causal sequence %d requires n_ubatch >= n_tokens (%u > %u)\n", __func__,
+                        seq_id, n_tokens_all, cparams.n_ubatch);
+                return -1;
+            }
+        }
+    }
+
     if (t_compute_start_us == 0) {
         t_compute_start_us = ggml_time_us();
     }
@@ -993,6 +1221,15 @@ int llama_context::decode(const llama_batch & batch_inp) {
         return -2;
     };
 
+    if (output_argmax) {
+        argmax.assign(n_outputs_all, LLAMA_TOKEN_NULL);
+    }
+
+    if (cparams.attn_probe_seq >= 0) {
+        attn_probe.clear();
+        attn_probe_of = -1;
+    }
+
     int64_t n_outputs_prev = 0;
 
     do {
@@ -1065,6 +1302,36 @@ int llama_context::decode(const llama_batch & batch_inp) {
             t_embd = res->get_embd_pooled();
         }
 
+        // extract the attention probe, kept for the cells of the probed sequence
+        if (auto * t_probe = res->get_attn_probe()) {
+            const auto * kv_state = dynamic_cast<const llama_kv_cache_unified_state *>(mstate.get());
+            ggml_backend_t backend_probe = ggml_backend_sched_get_tensor_backend(sched.get(), t_probe);
+            if (kv_state && backend_probe) {
+                std::vector<float> scores(ggml_nelements(t_probe));
+                ggml_backend_tensor_get_async(backend_probe, t_probe, scores.data(), 0, ggml_nbytes(t_probe));
+                ggml_backend_synchronize(backend_probe);
+
+                attn_probe.clear();
+                attn_probe_of = cparams.attn_probe_seq;
+                for (uint32_t j = 0; j < scores.size(); ++j) {
+                    const uint32_t cell = kv_state->get_kv_min() + j;
+                    if (kv_state->get_kv()->cell_seq_pos(cell, attn_probe_of) >= 0) {
+                        attn_probe.emplace_back(cell, scores[j]);
+                    }
+                }
+            }
+        }
+
+        // extract argmax
+        if (t_argmax && n_outputs > 0) {
+            ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_argmax);
+            GGML_ASSERT(backend_res != nullptr);
+            GGML_ASSERT(n_outputs_prev + n_outputs <= (int64_t) argmax.size());
+
+            ggml_backend_tensor_get_async(backend_res, t_argmax, argmax.data() + n_outputs_prev, 0, n_outputs*sizeof(llama_token));
+            t_logits = nullptr;
+        }
+
         // extract logits
         if (t_logits && n_outputs > 0) {
             ggml_backend_t backend_res = ggml_backend_sched_get_tensor_backend(sched.get(), t_logits);
@@ -1178,6 +1445,9 @@ int llama_context::decode(const llama_batch & batch_inp) {
                     continue;
                 }
                 std::swap(out_ids[i], out_ids[j_min]);
+                if (output_argmax) {
+                    std::swap(argmax[i], argmax[j_min]);
+                }
                 if (logits_size > 0) {
                     for (uint32_t k = 0; k < n_vocab; k++) {
                         std::swap(logits[i*n_vocab + k], logits[j_min*n_vocab + k]);
@@ -1359,6 +1629,7 @@ llm_graph_result_ptr llama_context::graph_build(
                 /*.backend_cpu =*/ backend_cpu,
                 /*.cvec        =*/ &cvec,
                 /*.loras       =*/ &loras,
+                /*.lora_routes =*/ &lora_routes,
                 /*.mstate      =*/ mstate,
                 /*.cross       =*/ &cross,
                 /*.n_outputs   =*/ n_outputs,
@@ -2181,6 +2452,9 @@ llama_context_params llama_context_default_params() {
         /*.yarn_beta_slow              =*/1.0f,
         /*.yarn_orig_ctx               =*/0,
         /*.defrag_thold                =*/-1.0f,
+        /*.n_kv_pad                    =*/0,
+        /*.n_ubatch_decode             =*/0,
+        /*.n_op_offload_min            =*/0,
         /*.cb_eval                     =*/nullptr,
         /*.cb_eval_user_data           =*/nullptr,
         /*.type_k                      =*/GGML_TYPE_F16,
@@ -2312,6 +2586,26 @@ void llama_set_embeddings(llama_context * ctx, bool embeddings) {
     ctx->set_embeddings(embeddings);
 }
 
+void llama_set_eval_callback(llama_context * ctx, ggml_backend_sched_eval_callback cb_eval, void * cb_eval_user_data) {
+    ctx->set_eval_callback(cb_eval, cb_eval_user_data);
+}
+
+void llama_set_output_argmax(llama_context * ctx, bool argmax) {
+    ctx->set_output_argmax(argmax);
+}
+
+void llama_set_attn_probe(llama_context * ctx, llama_seq_id seq_id) {
+    ctx->set_attn_probe(seq_id);
+}
+
+int32_t llama_attn_probe_evict(llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1, float keep) {
+    return ctx->attn_probe_evict(seq_id, p0, p1, keep);
+}
+
+void llama_set_seq_causal_attn(llama_context * ctx, llama_seq_id seq_id, bool causal_attn) {
+    ctx->set_seq_causal_attn(seq_id, causal_attn);
+}
+
 void llama_set_causal_attn(llama_context * ctx, bool causal_attn) {
     ctx->set_causal_attn(causal_attn);
 }
@@ -2336,6 +2630,32 @@ float * llama_get_logits_ith(llama_context * ctx, int32_t i) {
     return ctx->get_logits_ith(i);
 }
 
+llama_token llama_get_argmax_ith(llama_context * ctx, int32_t i) {
+    ctx->synchronize();
+
+    return ctx->get_argmax_ith(i);
+}
+
+llama_outputs * llama_take_outputs(llama_context * ctx) {
+    return ctx->take_outputs();
+}
+
+float * llama_outputs_logits_ith(llama_outputs * outputs, int32_t i) {
+    return outputs->get_logits_ith(i);
+}
+
+llama_token llama_outputs_argmax_ith(llama_outputs * outputs, int32_t i) {
+    return outputs->get_argmax_ith(i);
+}
+
+void llama_outputs_free(llama_outputs * outputs) {
+    if (!outputs) {
+        return;
+    }
+    outputs->ctx->free_outputs(outputs);
+    delete outputs;
+}
+
 float * llama_get_embeddings(llama_context * ctx) {
     ctx->synchronize();
 
@@ -2377,6 +2697,14 @@ void llama_clear_adapter_lora(llama_context * ctx) {
     ctx->clear_adapter_lora();
 }
 
+void llama_set_adapter_lora_seq(
+            llama_context * ctx,
+            llama_seq_id seq_id,
+            llama_adapter_lora * adapter,
+            float scale) {
+    ctx->set_adapter_lora_seq(seq_id, adapter, scale);
+}
+
 int32_t llama_apply_adapter_cvec(
         llama_context * ctx,
                  const float * data,
@@ -2494,6 +2822,53 @@ bool llama_memory_can_shift(llama_memory_t mem) {
     return mem->get_can_shift();
 }
 
+float llama_memory_fragmentation(llama_memory_t mem) {
+    const auto * kv = dynamic_cast<const llama_kv_cache_unified *>(mem);
+    if (!kv) {
+        return 0.0f;
+    }
+
+    return kv->get_fragmentation();
+}
+
+bool llama_memory_defrag(llama_context * ctx) {
+    return ctx->kv_self_update(true);
+}
+
+bool llama_memory_cells(
+        llama_memory_t mem,
+        const llama_seq_id * seq_ids,
+        int32_t n_seq_ids,
+        uint32_t * n_total,
+        uint32_t * n_used,
+        uint32_t * n_used_seqs) {
+    const llama_kv_cache_unified * kv = dynamic_cast<const llama_kv_cache_unified *>(mem);
+    if (const auto * kv_iswa = dynamic_cast<const llama_kv_cache_unified_iswa *>(mem)) {
+        kv = kv_iswa->get_base();
+    }
+    if (!kv) {
+        return false;
+    }
+
+    kv->get_cells(seq_ids, n_seq_ids, *n_total, *n_used, *n_used_seqs);
+
+    return true;
+}
+
+int32_t llama_memory_breakdown(const llama_context * ctx, llama_memory_breakdown_data * data, int32_t n_max) {
+    const auto mb = ctx->memory_breakdown();
+
+    int32_t i = 0;
+    for (const auto & [buft, entry] : mb) {
+        if (i < n_max) {
+            data[i] = entry;
+        }
+        i++;
+    }
+
+    return i;
+}
+
 //
 // kv cache
 //
@@ -9,6 +9,7 @@
 #include "ggml-opt.h"
 
 #include <map>
+#include <mutex>
 #include <vector>
 
 struct llama_model;
@@ -20,6 +21,25 @@ class llama_io_write_i;
 struct llama_memory_i;
 struct llama_memory_state_i;
 
+// outputs of a decode moved out of its context, see llama_take_outputs()
+struct llama_outputs {
+    llama_context * ctx;
+
+    ggml_backend_buffer_ptr buf;
+    float *  logits = nullptr; // [n_outputs][n_vocab] in buf, nullptr if only the argmax was copied back
+    uint32_t n_outputs = 0;
+    uint32_t n_vocab   = 0;
+
+    std::vector<int32_t>     output_ids;
+    std::vector<llama_token> argmax;
+
+    float *     get_logits_ith(int32_t i);
+    llama_token get_argmax_ith(int32_t i);
+
+  private:
+    int64_t output_id(int32_t i) const;
+};
+
 struct llama_context {
     // init scheduler and compute buffers, reserve worst-case graphs
     llama_context(
@@ -48,6 +68,9 @@ struct llama_context {
 
     llama_memory_t get_memory() const;
 
+    // bytes of the buffers of the model and the context per buffer type
+    std::map<ggml_backend_buffer_type_t, llama_memory_breakdown_data> memory_breakdown() const;
+
     // return true of the KV cache was updated
     // TODO: remove
     bool kv_self_update(bool optimize);
@@ -58,6 +81,11 @@ struct llama_context {
     float * get_logits();
     float * get_logits_ith(int32_t i);
 
+    llama_token get_argmax_ith(int32_t i);
+
+    llama_outputs * take_outputs();
+    void            free_outputs(llama_outputs * outputs); // thread safe
+
     float * get_embeddings();
     float * get_embeddings_ith(int32_t i);
     float * get_embeddings_seq(llama_seq_id seq_id);
@@ -71,9 +99,14 @@ struct llama_context {
     void set_n_threads(int32_t n_threads, int32_t n_threads_batch);
 
     void set_abort_callback(bool (*abort_callback)(void * data), void * abort_callback_data);
+    void set_eval_callback(ggml_backend_sched_eval_callback cb_eval, void * cb_eval_user_data);
 
     void set_embeddings (bool value);
+    void set_output_argmax(bool value);
     void set_causal_attn(bool value);
+    void set_seq_causal_attn(llama_seq_id seq_id, bool value);
+    void set_attn_probe(llama_seq_id seq_id);
+    int32_t attn_probe_evict(llama_seq_id seq_id, llama_pos p0, llama_pos p1, float keep);
     void set_warmup(bool value);
 
     void set_adapter_lora(
@@ -85,6 +118,11 @@ struct llama_context {
 
     void clear_adapter_lora();
 
+    void set_adapter_lora_seq(
+            llama_seq_id seq_id,
+            llama_adapter_lora * adapter,
+            float scale);
+
     bool apply_adapter_cvec(
             const float * data,
                  size_t   len,
@@ -225,6 +263,7 @@ private:
     llama_cparams       cparams;
     llama_adapter_cvec  cvec;
     llama_adapter_loras loras;
+    llama_adapter_lora_routes lora_routes;
 
     llama_cross cross; // TODO: tmp for handling cross-attention - need something better probably
 
@@ -237,6 +276,15 @@ private:
     size_t  logits_size = 0; // capacity (of floats) for logits
     float * logits      = nullptr;
 
+    // greedy output (only the argmax of each output row is copied back)
+    bool                     output_argmax = false;
+    std::vector<llama_token> argmax;             // [n_outputs]
+    ggml_tensor *            t_argmax = nullptr; // in the last built graph
+
+    // attention probe of the last llama_decode() with llama_set_attn_probe() on
+    llama_seq_id                             attn_probe_of = -1; // the probed sequence, -1 if none
+    std::vector<std::pair<uint32_t, float>>  attn_probe;         // (cell, attention) of its cells
+
     // embeddings output (2-dimensional array: [n_outputs][n_embd])
     // populated only when pooling_type == LLAMA_POOLING_TYPE_NONE
     size_t  embd_size = 0; // capacity (of floats) for embeddings
@@ -281,6 +329,10 @@ private:
     // host buffer for the model output (logits and embeddings)
     ggml_backend_buffer_ptr buf_output;
 
+    // output buffers given back by llama_outputs_free(), reused before a new one is allocated
+    mutable std::mutex                   buf_output_mutex;
+    std::vector<ggml_backend_buffer_ptr> buf_output_pool;
+
     bool has_evaluated_once = false;
 
     // perf
@@ -3,6 +3,7 @@
 #include "llama.h"
 
 #include <cstdint>
+#include <vector>
 
 #define LLAMA_MAX_SEQ 128
 
@@ -25,14 +26,18 @@ struct llama_cparams {
     float yarn_beta_fast;
     float yarn_beta_slow;
     float defrag_thold;
+    uint32_t n_kv_pad;
+    uint32_t n_ubatch_decode;
 
     bool embeddings;
     bool causal_attn;
+    std::vector<bool> seq_non_causal;  // by sequence, see llama_set_seq_causal_attn
     bool offload_kqv;
     bool flash_attn;
     bool no_perf;
     bool warmup;
     bool op_offload;
+    llama_seq_id attn_probe_seq;  // see llama_set_attn_probe, -1 if off
 
     enum llama_pooling_type pooling_type;
 
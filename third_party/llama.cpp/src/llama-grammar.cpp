@@ -6,7 +6,16 @@
 
 #include <cmath>
 #include <algorithm>
+#include <deque>
+#include <list>
+#include <mutex>
 #include <stdexcept>
+#include <unordered_map>
+
+#define LLAMA_GRAMMAR_MASK_CACHE_GRAMMARS 8    // grammars (rule sets) with a mask cache, the oldest is dropped first
+#define LLAMA_GRAMMAR_MASK_CACHE_STATES   1024 // cached states per grammar, the least recently used is dropped first
+#define LLAMA_GRAMMAR_MASK_SPARSE         256  // states allowing at most this many tokens keep a sorted list
+#define LLAMA_GRAMMAR_MASK_MIN_CANDIDATES 64   // fewer candidates are checked directly, e.g. the sampled token
 
 //
 // helpers
@@ -905,6 +914,141 @@ llama_grammar_candidates llama_grammar_reject_candidates_for_stack(
 
 ////////////////////
 
+struct llama_grammar_mask {
+    std::vector<llama_token> tokens; // sorted, allowed tokens of a sparse state
+    std::vector<uint64_t>    bits;   // bit per vocab token otherwise
+    size_t                   n_allowed = 0;
+
+    bool allows(llama_token id) const {
+        if (bits.empty()) {
+            return std::binary_search(tokens.begin(), tokens.end(), id);
+        }
+        return (bits[id >> 6] >> (id & 63)) & 1;
+    }
+};
+
+struct llama_grammar_mask_cache {
+    using entry = std::pair<std::string, std::shared_ptr<const llama_grammar_mask>>; // key: llama_grammar_state_key
+
+    std::mutex mutex;
+    std::list<entry> lru; // most recently used first
+    std::unordered_map<std::string, std::list<entry>::iterator> masks;
+};
+
+// rules and vocab of a grammar, the key of its mask cache
+// NOTE: the vocab by its uid, a vocab loaded later at the same address must not see the masks of this one
+static std::string llama_grammar_rules_key(const llama_vocab * vocab, const llama_grammar_rules & rules) {
+    const uint64_t uid = vocab->get_uid();
+    std::string key(reinterpret_cast<const char *>(&uid), sizeof(uid));
+    for (const auto & rule : rules) {
+        key.append(reinterpret_cast<const char *>(rule.data()), rule.size() * sizeof(llama_grammar_element));
+    }
+    return key;
+}
+
+static std::shared_ptr<llama_grammar_mask_cache> llama_grammar_mask_cache_get(
+        const llama_vocab * vocab, const llama_grammar_rules & rules) {
+    static std::mutex mutex;
+    static std::deque<std::pair<std::string, std::shared_ptr<llama_grammar_mask_cache>>> caches; // oldest first
+
+    std::string key = llama_grammar_rules_key(vocab, rules);
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto & cache : caches) {
+        if (cache.first == key) {
+            return cache.second;
+        }
+    }
+    if (caches.size() >= LLAMA_GRAMMAR_MASK_CACHE_GRAMMARS) {
+        caches.pop_front(); // grammars still using it keep it alive
+    }
+    caches.emplace_back(std::move(key), std::make_shared<llama_grammar_mask_cache>());
+    return caches.back().second;
+}
+
+// stacks as (rule, element) offsets, equal across clones and grammars of the same rules
+static bool llama_grammar_state_key(const llama_grammar & grammar, std::string & key) {
+    if (grammar.partial_utf8.n_remain != 0) {
+        return false;
+    }
+    key.clear();
+    for (const auto & stack : grammar.stacks) {
+        for (const auto * elem : stack) {
+            uint32_t offset[2] = { 0, 0 };
+            for (size_t ir = 0; ir < grammar.rules.size(); ir++) {
+                const auto & rule = grammar.rules[ir];
+                if (elem >= rule.data() && elem < rule.data() + rule.size()) {
+                    offset[0] = (uint32_t) ir;
+                    offset[1] = (uint32_t) (elem - rule.data());
+                    break;
+                }
+            }
+            key.append(reinterpret_cast<const char *>(offset), sizeof(offset));
+        }
+        key.push_back('\xff'); // NOTE: stack separator, an offset pair is 8 bytes
+    }
+    return true;
+}
+
+static void llama_grammar_apply_candidates(const struct llama_grammar & grammar, llama_token_data_array * cur_p);
+
+// mask of the current state, computed over the full vocab on a miss, nullptr if the state cannot be cached
+static std::shared_ptr<const llama_grammar_mask> llama_grammar_state_mask(const struct llama_grammar & grammar) {
+    auto & cache = grammar.mask_cache;
+    std::string key;
+    if (!cache || grammar.awaiting_trigger || !llama_grammar_state_key(grammar, key)) {
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock(cache->mutex);
+        auto it = cache->masks.find(key);
+        if (it != cache->masks.end()) {
+            cache->lru.splice(cache->lru.begin(), cache->lru, it->second);
+            return it->second->second;
+        }
+    }
+
+    const int32_t n_vocab = (int32_t) grammar.vocab->n_tokens();
+    std::vector<llama_token_data> cur(n_vocab);
+    for (llama_token id = 0; id < n_vocab; id++) {
+        cur[id] = { id, 0.0f, 0.0f };
+    }
+    llama_token_data_array cur_p = { cur.data(), cur.size(), -1, false };
+    llama_grammar_apply_candidates(grammar, &cur_p);
+
+    auto mask = std::make_shared<llama_grammar_mask>();
+    for (const auto & data : cur) {
+        mask->n_allowed += data.logit != -INFINITY;
+    }
+    if (mask->n_allowed <= LLAMA_GRAMMAR_MASK_SPARSE) {
+        mask->tokens.reserve(mask->n_allowed);
+        for (const auto & data : cur) {
+            if (data.logit != -INFINITY) {
+                mask->tokens.push_back(data.id);
+            }
+        }
+    } else {
+        mask->bits.assign((n_vocab + 63) / 64, 0);
+        for (const auto & data : cur) {
+            if (data.logit != -INFINITY) {
+                mask->bits[data.id >> 6] |= 1ull << (data.id & 63);
+            }
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(cache->mutex);
+    auto it = cache->masks.find(key);
+    if (it != cache->masks.end()) { // computed by another grammar meanwhile
+        return it->second->second;
+    }
+    if (cache->masks.size() >= LLAMA_GRAMMAR_MASK_CACHE_STATES) {
+        cache->masks.erase(cache->lru.back().first); // grammars holding its mask keep it alive
+        cache->lru.pop_back();
+    }
+    cache->lru.emplace_front(key, std::move(mask));
+    cache->masks.emplace(std::move(key), cache->lru.begin());
+    return cache->lru.front().second;
+}
+
 struct llama_grammar * llama_grammar_init_impl(
         const struct llama_vocab * vocab,
         const llama_grammar_element ** rules,
@@ -1062,6 +1206,8 @@ struct llama_grammar * llama_grammar_init_impl(
         trigger.regex = std::regex(trigger.pattern);
     }
 
+    auto mask_cache = vocab ? llama_grammar_mask_cache_get(vocab, vec_rules) : nullptr;
+
     // Important: vec_rules has to be moved here, not copied, because stacks contains
     // pointers to elements of vec_rules. If vec_rules were copied into llama_grammar
     // then the pointers would be invalidated when the local vec_rules goes out of scope.
@@ -1075,6 +1221,7 @@ struct llama_grammar * llama_grammar_init_impl(
         /* .trigger_buffer = */   "",
         std::move(vec_trigger_tokens),
         std::move(vec_trigger_patterns),
+        std::move(mask_cache),
     };
 }
 
@@ -1097,6 +1244,7 @@ struct llama_grammar * llama_grammar_clone_impl(const struct llama_grammar & gra
         grammar.trigger_buffer,
         grammar.trigger_tokens,
         grammar.trigger_patterns,
+        grammar.mask_cache,
     };
 
     // redirect elements in stacks to point to new rules
@@ -1122,6 +1270,31 @@ void llama_grammar_apply_impl(const struct llama_grammar & grammar, llama_token_
         return;
     }
 
+    if (cur_p->size >= LLAMA_GRAMMAR_MASK_MIN_CANDIDATES) {
+        const auto mask = llama_grammar_state_mask(grammar);
+        if (mask) {
+            for (size_t i = 0; i < cur_p->size; ++i) {
+                if (!mask->allows(cur_p->data[i].id)) {
+                    cur_p->data[i].logit = -INFINITY;
+                }
+            }
+            return;
+        }
+    }
+
+    llama_grammar_apply_candidates(grammar, cur_p);
+}
+
+llama_token llama_grammar_forced_token_impl(const struct llama_grammar & grammar) {
+    const auto mask = llama_grammar_state_mask(grammar);
+    if (!mask || mask->n_allowed != 1 || mask->tokens.empty()) {
+        return LLAMA_TOKEN_NULL;
+    }
+    const llama_token id = mask->tokens[0];
+    return grammar.vocab->is_eog(id) ? LLAMA_TOKEN_NULL : id;
+}
+
+static void llama_grammar_apply_candidates(const struct llama_grammar & grammar, llama_token_data_array * cur_p) {
     bool allow_eog = false;
     for (const auto & stack : grammar.stacks) {
         if (stack.empty()) {
@@ -3,6 +3,7 @@
 #include "llama.h"
 
 #include <map>
+#include <memory>
 #include <regex>
 #include <string>
 #include <vector>
@@ -106,6 +107,10 @@ struct llama_grammar_parser {
     void print(FILE * file);
 };
 
+// allowed tokens of each grammar state (stacks with no partial utf8), shared by all grammars of the same rules so the
+// full vocab is checked once per state across samplers, requests and resets
+struct llama_grammar_mask_cache;
+
 struct llama_grammar_trigger_pattern {
     std::string pattern;
     std::regex  regex;
@@ -132,6 +137,7 @@ struct llama_grammar {
                              trigger_patterns;         // Regular expressions that trigger a lazy grammar. Must be a full match of the entire generated
                                                        // string, and the grammar will be given the string from the first match group onwards.
 
+    std::shared_ptr<llama_grammar_mask_cache> mask_cache; // nullptr: every apply checks the candidates
 };
 
 //
@@ -168,6 +174,10 @@ void llama_grammar_accept_impl(
               struct llama_grammar & grammar,
                        llama_token   token);
 
+// the only token the grammar allows next (jump-forward), LLAMA_TOKEN_NULL if there are more, the grammar may end,
+// it awaits a trigger or its state is not cached and the cache is full
+llama_token llama_grammar_forced_token_impl(const struct llama_grammar & grammar);
+
 void llama_grammar_accept_str(
               struct llama_grammar & grammar,
                  const std::string & piece);
@@ -9,6 +9,7 @@
 #include "llama-memory-hybrid.h"
 #include "llama-memory-recurrent.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <cstring>
@@ -126,6 +127,37 @@ void llm_graph_input_out_ids::set_input(const llama_ubatch * ubatch) {
     }
 }
 
+void llm_graph_input_lora_routes::set_input(const llama_ubatch * ubatch) {
+    const int64_t n_tokens     = ubatch->n_tokens;
+    const int64_t n_seq_tokens = ubatch->n_seq_tokens;
+    const int64_t n_outputs    = scales_out->ne[1];
+
+    GGML_ASSERT(ggml_backend_buffer_is_host(scales->buffer));
+    GGML_ASSERT(ggml_backend_buffer_is_host(scales_out->buffer));
+
+    float * data     = (float *) scales->data;
+    float * data_out = (float *) scales_out->data;
+    memset(scales->data, 0, ggml_nbytes(scales));
+    memset(scales_out->data, 0, ggml_nbytes(scales_out));
+
+    // NOTE: same row order as llm_graph_input_out_ids
+    int64_t i_out = 0;
+    for (int64_t i = 0; i < n_tokens; ++i) {
+        const bool output = n_outputs == n_tokens || (ubatch->output ? ubatch->output[i] : i == n_tokens - 1);
+        const auto route = routes->find(ubatch->seq_id[i / n_seq_tokens][0]);
+        for (size_t k = 0; k < adapters.size() && route != routes->end(); ++k) {
+            if (route->second.first != adapters[k]) {
+                continue;
+            }
+            data[k*n_tokens + i] = route->second.second;
+            if (output && i_out < n_outputs) {
+                data_out[k*n_outputs + i_out] = route->second.second;
+            }
+        }
+        i_out += output ? 1 : 0;
+    }
+}
+
 void llm_graph_input_mean::set_input(const llama_ubatch * ubatch) {
     if (cparams.embeddings && cparams.pooling_type == LLAMA_POOLING_TYPE_MEAN) {
         const int64_t n_tokens     = ubatch->n_tokens;
@@ -356,17 +388,17 @@ void llm_graph_input_attn_no_cache::set_input(const llama_ubatch * ubatch) {
 
 void llm_graph_input_attn_kv_unified::set_input(const llama_ubatch * ubatch) {
     if (self_kq_mask) {
-        kv_state->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
+        kv_state->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn, cparams.seq_non_causal);
     }
 }
 
 void llm_graph_input_attn_kv_unified_iswa::set_input(const llama_ubatch * ubatch) {
     if (self_kq_mask) {
-        kv_state->get_base()->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
+        kv_state->get_base()->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn, cparams.seq_non_causal);
     }
 
     if (self_kq_mask_swa) {
-        kv_state->get_swa()->set_input_kq_mask(self_kq_mask_swa, ubatch, cparams.causal_attn);
+        kv_state->get_swa()->set_input_kq_mask(self_kq_mask_swa, ubatch, cparams.causal_attn, cparams.seq_non_causal);
     }
 }
 
@@ -406,7 +438,7 @@ void llm_graph_input_attn_cross::set_input(const llama_ubatch * ubatch) {
 
 void llm_graph_input_mem_hybrid::set_input(const llama_ubatch * ubatch) {
     if (self_kq_mask) {
-        mem_state->get_state_attn()->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn);
+        mem_state->get_state_attn()->set_input_kq_mask(self_kq_mask, ubatch, cparams.causal_attn, cparams.seq_non_causal);
     }
 
     const int64_t n_rs = mem_state->get_state_recr()->get_n_rs();
@@ -461,12 +493,38 @@ llm_graph_context::llm_graph_context(const llm_graph_params & params) :
     backend_cpu      (params.backend_cpu),
     cvec             (params.cvec),
     loras            (params.loras),
+    lora_routes      (params.lora_routes),
     mstate           (params.mstate),
     cross            (params.cross),
     cb_func          (params.cb),
     res              (std::make_unique<llm_graph_result>()) {
+    if (lora_routes == nullptr || lora_routes->empty() || ubatch.seq_id == nullptr) {
+        return;
     }
 
+    // only the adapters routed to a sequence of the ubatch are in the graph
+    auto inp = std::make_unique<llm_graph_input_lora_routes>(lora_routes);
+    for (uint32_t s = 0; s < ubatch.n_seqs; ++s) {
+        const auto route = lora_routes->find(ubatch.seq_id[s][0]);
+        if (route != lora_routes->end() &&
+            std::find(inp->adapters.begin(), inp->adapters.end(), route->second.first) == inp->adapters.end()) {
+            inp->adapters.push_back(route->second.first);
+        }
+    }
+    if (inp->adapters.empty()) {
+        return;
+    }
+
+    const int64_t n_adapters = inp->adapters.size();
+    inp->scales     = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 1, n_tokens,  n_adapters);
+    inp->scales_out = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 1, std::max<int64_t>(n_outputs, 1), n_adapters);
+    ggml_set_input(inp->scales);
+    ggml_set_input(inp->scales_out);
+
+    inp_lora_routes = inp.get();
+    res->add_input(std::move(inp));
+}
+
 int64_t llm_graph_context::n_pos_per_embd() const {
     return hparams.rope_type == LLAMA_ROPE_TYPE_MROPE ? 4 : 1;
 }
@@ -506,9 +564,42 @@ ggml_tensor * llm_graph_context::build_lora_mm(
         res = ggml_add(ctx0, res, ab_cur);
     }
 
+    for (size_t k = 0; inp_lora_routes && k < inp_lora_routes->adapters.size(); ++k) {
+        llama_adapter_lora * adapter = inp_lora_routes->adapters[k];
+        llama_adapter_lora_weight * lw = adapter->get_weight(w);
+        if (lw == nullptr) {
+            continue;
+        }
+
+        ggml_tensor * ab_cur = ggml_mul_mat(
+                ctx0, lw->b,
+                ggml_mul_mat(ctx0, lw->a, cur)
+                );
+
+        ab_cur = ggml_scale(ctx0, ab_cur, lw->get_scale(adapter->alpha, 1.0f));
+        res = ggml_add(ctx0, res, build_lora_route(ab_cur, k, false));
+    }
+
     return res;
 }
 
+ggml_tensor * llm_graph_context::build_lora_route(
+          ggml_tensor * delta,
+               size_t   i_adapter,
+                 bool   per_expert) const {
+    const int64_t n_rows = per_expert ? delta->ne[2] : delta->ne[1];
+
+    ggml_tensor * scales = n_rows == n_tokens ? inp_lora_routes->scales : inp_lora_routes->scales_out;
+    GGML_ASSERT(scales->ne[1] == n_rows && "lora delta rows are neither the ubatch tokens nor its outputs");
+
+    const size_t offset = i_adapter*scales->nb[2];
+    scales = per_expert
+        ? ggml_view_3d(ctx0, scales, 1, 1, n_rows, scales->nb[1], scales->nb[1], offset)
+        : ggml_view_2d(ctx0, scales, 1, n_rows, scales->nb[1], offset);
+
+    return ggml_mul(ctx0, delta, scales);
+}
+
 ggml_tensor * llm_graph_context::build_lora_mm_id(
           ggml_tensor * w,   // ggml_tensor * as
           ggml_tensor * cur, // ggml_tensor * b
@@ -534,6 +625,23 @@ ggml_tensor * llm_graph_context::build_lora_mm_id(
         res = ggml_add(ctx0, res, ab_cur);
     }
 
+    for (size_t k = 0; inp_lora_routes && k < inp_lora_routes->adapters.size(); ++k) {
+        llama_adapter_lora * adapter = inp_lora_routes->adapters[k];
+        llama_adapter_lora_weight * lw = adapter->get_weight(w);
+        if (lw == nullptr) {
+            continue;
+        }
+
+        ggml_tensor * ab_cur = ggml_mul_mat_id(
+                ctx0, lw->b,
+                ggml_mul_mat_id(ctx0, lw->a, cur, ids),
+                ids
+                );
+
+        ab_cur = ggml_scale(ctx0, ab_cur, lw->get_scale(adapter->alpha, 1.0f));
+        res = ggml_add(ctx0, res, build_lora_route(ab_cur, k, true));
+    }
+
     return res;
 }
 
@@ -895,6 +1003,21 @@ ggml_tensor * llm_graph_context::build_inp_embd(ggml_tensor * tok_embd) const {
 
             cur = ggml_add(ctx0, cur, inpL_delta);
         }
+
+        for (size_t k = 0; inp_lora_routes && k < inp_lora_routes->adapters.size(); ++k) {
+            llama_adapter_lora * adapter = inp_lora_routes->adapters[k];
+            llama_adapter_lora_weight * lw = adapter->get_weight(tok_embd);
+            if (lw == nullptr) {
+                continue;
+            }
+
+            ggml_tensor * inpL_delta = ggml_scale(ctx0, ggml_mul_mat(
+                        ctx0, lw->b, // non-transposed lora_b
+                        ggml_get_rows(ctx0, lw->a, inp->tokens)
+                        ), lw->get_scale(adapter->alpha, 1.0f));
+
+            cur = ggml_add(ctx0, cur, build_lora_route(inpL_delta, k, false));
+        }
     } else {
         inp->embd = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, ubatch.n_tokens);
         ggml_set_input(inp->embd);
@@ -1193,6 +1316,43 @@ ggml_tensor * llm_graph_context::build_attn_mha(
     return cur;
 }
 
+void llm_graph_context::build_attn_probe(
+         ggml_tensor * q,
+         ggml_tensor * k,
+         ggml_tensor * kq_mask,
+               float   kq_scale) const {
+    int32_t row = -1;
+    for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+        for (int32_t s = 0; s < ubatch.n_seq_id[i]; ++s) {
+            if (ubatch.seq_id[i][s] == cparams.attn_probe_seq) {
+                row = i;
+            }
+        }
+    }
+    if (row < 0) {
+        return;
+    }
+
+    q = ggml_permute(ctx0, q, 0, 2, 1, 3);
+    k = ggml_permute(ctx0, k, 0, 2, 1, 3);
+
+    const auto n_head = q->ne[2];
+    const auto n_kv   = k->ne[1];
+
+    // note: only the probed row, the attention itself may run as flash attention
+    ggml_tensor * q_row    = ggml_view_3d(ctx0, q, q->ne[0], 1, n_head, q->nb[1], q->nb[2], row*q->nb[1]);
+    ggml_tensor * mask_row = ggml_view_2d(ctx0, kq_mask, kq_mask->ne[0], 1, kq_mask->nb[1], row*kq_mask->nb[1]);
+
+    ggml_tensor * kq = ggml_mul_mat(ctx0, k, q_row); // [n_kv, 1, n_head]
+    ggml_mul_mat_set_prec(kq, GGML_PREC_F32);
+    kq = ggml_soft_max_ext(ctx0, kq, mask_row, kq_scale, hparams.f_max_alibi_bias);
+    kq = ggml_reshape_2d(ctx0, kq, n_kv, n_head);
+    kq = ggml_sum_rows(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, kq))); // [1, n_kv]
+    kq = ggml_reshape_1d(ctx0, kq, n_kv);
+
+    res->t_attn_probe = res->t_attn_probe ? ggml_add(ctx0, res->t_attn_probe, kq) : kq;
+}
+
 llm_graph_input_attn_no_cache * llm_graph_context::build_attn_inp_no_cache() const {
     auto inp = std::make_unique<llm_graph_input_attn_no_cache>(hparams, cparams);
 
@@ -1302,6 +1462,10 @@ ggml_tensor * llm_graph_context::build_attn(
     ggml_tensor * k = kv_state->get_k(ctx0, il);
     ggml_tensor * v = kv_state->get_v(ctx0, il);
 
+    if (cparams.attn_probe_seq >= 0) {
+        build_attn_probe(q, k, kq_mask, kq_scale);
+    }
+
     ggml_tensor * cur = build_attn_mha(gf, q, k, v, kq_b, kq_mask, v_mla, kq_scale);
     cb(cur, "kqv_out", il);
 
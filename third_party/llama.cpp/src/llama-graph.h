@@ -165,6 +165,22 @@ public:
     const int32_t n_outputs;
 };
 
+// per sequence lora: the route scale of each row for every adapter routed in the ubatch, 0 for rows of other adapters
+class llm_graph_input_lora_routes : public llm_graph_input_i {
+public:
+    llm_graph_input_lora_routes(const llama_adapter_lora_routes * routes) : routes(routes) {}
+    virtual ~llm_graph_input_lora_routes() = default;
+
+    void set_input(const llama_ubatch * ubatch) override;
+
+    ggml_tensor * scales     = nullptr; // F32 [1, n_batch, n_adapters]
+    ggml_tensor * scales_out = nullptr; // F32 [1, n_outputs, n_adapters], rows kept by out_ids
+
+    std::vector<llama_adapter_lora *> adapters;
+
+    const llama_adapter_lora_routes * routes;
+};
+
 class llm_graph_input_mean : public llm_graph_input_i {
 public:
     llm_graph_input_mean(const llama_cparams & cparams) : cparams(cparams) {}
@@ -346,6 +362,7 @@ public:
     virtual ggml_tensor * get_logits()      = 0;
     virtual ggml_tensor * get_embd()        = 0;
     virtual ggml_tensor * get_embd_pooled() = 0;
+    virtual ggml_tensor * get_attn_probe()  = 0;
 
     virtual void set_inputs(const llama_ubatch * ubatch) = 0;
 };
@@ -361,6 +378,7 @@ public:
     ggml_tensor * get_logits()      override { return t_logits; }
     ggml_tensor * get_embd()        override { return t_embd; }
     ggml_tensor * get_embd_pooled() override { return t_embd_pooled; }
+    ggml_tensor * get_attn_probe()  override { return t_attn_probe; }
 
     void set_inputs(const llama_ubatch * ubatch) override {
         for (auto & input : inputs) {
@@ -378,6 +396,7 @@ public:
     ggml_tensor * t_logits      = nullptr;
     ggml_tensor * t_embd        = nullptr;
     ggml_tensor * t_embd_pooled = nullptr;
+    ggml_tensor * t_attn_probe  = nullptr; // [n_kv], see llama_set_attn_probe
 
     std::vector<llm_graph_input_ptr> inputs;
 };
@@ -403,6 +422,7 @@ struct llm_graph_params {
 
     const llama_adapter_cvec   * cvec;
     const llama_adapter_loras  * loras;
+    const llama_adapter_lora_routes * lora_routes;
     const llama_memory_state_i * mstate;
     const llama_cross          * cross;
 
@@ -455,11 +475,14 @@ struct llm_graph_context {
 
     const llama_adapter_cvec   * cvec;
     const llama_adapter_loras  * loras;
+    const llama_adapter_lora_routes * lora_routes;
     const llama_memory_state_i * mstate;
     const llama_cross          * cross;
 
     const llm_graph_cb & cb_func;
 
+    llm_graph_input_lora_routes * inp_lora_routes = nullptr; // adapters routed to the sequences of the ubatch
+
     std::unique_ptr<llm_graph_result> res;
 
     llm_graph_context(const llm_graph_params & params);
@@ -481,6 +504,12 @@ struct llm_graph_context {
               ggml_tensor * w,
               ggml_tensor * cur) const;
 
+    // scale a lora delta by the route scale of its rows, per_expert for [n, n_expert_used, n_rows] deltas
+    ggml_tensor * build_lora_route(
+              ggml_tensor * delta,
+                   size_t   i_adapter,
+                     bool   per_expert) const;
+
     // do mat_mul_id, while optionally apply lora
     ggml_tensor * build_lora_mm_id(
               ggml_tensor * w,   // ggml_tensor * as
@@ -558,6 +587,14 @@ struct llm_graph_context {
              ggml_tensor * v_mla,   // [n_embd_head_v_mla, n_embd_head_v, n_head_v]
                    float   kq_scale) const;
 
+    // attention of the last token of the probed sequence to the kv cells, summed over the heads, added to
+    // res->t_attn_probe (see llama_set_attn_probe)
+    void build_attn_probe(
+             ggml_tensor * q,       // [n_embd_head_q, n_head_q, n_tokens]
+             ggml_tensor * k,       // [n_embd_head_k, n_head_k, n_kv]
+             ggml_tensor * kq_mask,
+                   float   kq_scale) const;
+
     llm_graph_input_attn_no_cache * build_attn_inp_no_cache() const;
 
     ggml_tensor * build_attn(
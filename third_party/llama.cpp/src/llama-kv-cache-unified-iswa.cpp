@@ -172,6 +172,14 @@ bool llama_kv_cache_unified_iswa::get_can_shift() const {
     return kv_base->get_size() == kv_swa->get_size();
 }
 
+std::map<ggml_backend_buffer_type_t, size_t> llama_kv_cache_unified_iswa::memory_breakdown() const {
+    std::map<ggml_backend_buffer_type_t, size_t> mb = kv_base->memory_breakdown();
+    for (const auto & [buft, size] : kv_swa->memory_breakdown()) {
+        mb[buft] += size;
+    }
+    return mb;
+}
+
 void llama_kv_cache_unified_iswa::state_write(llama_io_write_i & io, llama_seq_id seq_id) const {
     kv_base->state_write(io, seq_id);
     kv_swa ->state_write(io, seq_id);
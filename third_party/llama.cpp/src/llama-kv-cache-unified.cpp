@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstring>
 #include <limits>
 #include <map>
 #include <stdexcept>
@@ -134,6 +135,7 @@ llama_kv_cache_unified::llama_kv_cache_unified(const llama_model& model, layer_f
 
 void llama_kv_cache_unified::clear(bool data) {
     cells.reset();
+    pending_copies.clear();
 
     head = 0;
 
@@ -251,6 +253,37 @@ void llama_kv_cache_unified::seq_add(llama_seq_id seq_id, llama_pos p0, llama_po
         return;
     }
 
+    // Cells shared with other sequences (prefix copies) are split off first, so the shift only moves seq_id
+    std::vector<std::pair<uint32_t, uint32_t>> cow;
+    uint32_t i_free = 0;
+    for (uint32_t i = 0; i < cells.size(); ++i) {
+        if (!cells.pos_in(i, p0, p1) || !cells.seq_has(i, seq_id) || cells.seq_count(i) == 1) {
+            continue;
+        }
+
+        if (cells.pos_get(i) + shift < 0) {
+            // shifted out, the other sequences keep the cell
+            cells.seq_rm(i, seq_id);
+            continue;
+        }
+
+        while (i_free < cells.size() && !cells.is_empty(i_free)) {
+            ++i_free;
+        }
+
+        if (i_free == cells.size()) {
+            LLAMA_LOG_WARN("%s: no free cell to split shared cells of seq %d, the shift moves them for all sequences\n",
+                           __func__, seq_id);
+            break;
+        }
+
+        cells.seq_split(i, i_free, seq_id);
+        cow.emplace_back(i, i_free);
+    }
+
+    // NOTE: the data is copied by the next update, on the backend and before the K-shift rotates the split cells
+    pending_copies.insert(pending_copies.end(), cow.begin(), cow.end());
+
     for (uint32_t i = 0; i < cells.size(); ++i) {
         if (!cells.pos_in(i, p0, p1)) {
             continue;
@@ -331,6 +364,7 @@ llama_memory_state_ptr llama_kv_cache_unified::init_full() {
 }
 
 llama_memory_state_ptr llama_kv_cache_unified::init_update(llama_context* lctx, bool optimize) {
+    bool do_copy = !pending_copies.empty();
     bool do_shift = get_has_shift();
 
     defrag_info dinfo;
@@ -361,7 +395,7 @@ llama_memory_state_ptr llama_kv_cache_unified::init_update(llama_context* lctx,
         }
     }
 
-    return std::make_unique<llama_kv_cache_unified_state>(this, lctx, do_shift, std::move(dinfo));
+    return std::make_unique<llama_kv_cache_unified_state>(this, lctx, do_copy, do_shift, std::move(dinfo));
 }
 
 llama_kv_cache_unified::ubatch_heads llama_kv_cache_unified::prepare(const std::vector<llama_ubatch>& ubatches) {
@@ -410,11 +444,47 @@ llama_kv_cache_unified::ubatch_heads llama_kv_cache_unified::prepare(const std::
     return res;
 }
 
-bool llama_kv_cache_unified::update(llama_context* lctx, bool do_shift, const defrag_info& dinfo) {
+bool llama_kv_cache_unified::update(llama_context* lctx, bool do_copy, bool do_shift, const defrag_info& dinfo) {
     bool updated = false;
 
     auto* sched = lctx->get_sched();
 
+    if (do_copy && !pending_copies.empty()) {
+        LLAMA_LOG_DEBUG("%s: copying %zu split cells\n", __func__, pending_copies.size());
+
+        // each copy requires 6*n_layer tensors, as a defrag move
+        const int64_t n_layer = layers.size();
+        const size_t max_copies =
+            std::max<int64_t>(1, ((int64_t)lctx->graph_max_nodes() - 2 * n_layer) / (6 * n_layer));
+
+        for (size_t i0 = 0; i0 < pending_copies.size(); i0 += max_copies) {
+            const std::vector<std::pair<uint32_t, uint32_t>> ids(
+                pending_copies.begin() + i0, pending_copies.begin() + std::min(i0 + max_copies, pending_copies.size()));
+
+            ggml_backend_sched_reset(sched);
+
+            auto* gf = lctx->graph_init();
+
+            auto res = build_graph_copy(lctx->get_ctx_compute(), gf, ids);
+
+            bool ok = ggml_backend_sched_alloc_graph(sched, gf);
+            if (ok) {
+                res->set_inputs(nullptr);
+                ok = lctx->graph_compute(gf, false) == GGML_STATUS_SUCCESS;
+            }
+
+            if (!ok) {
+                LLAMA_LOG_WARN("%s: failed to compute the cell copies, copying them on the host\n", __func__);
+                pending_copies.erase(pending_copies.begin(), pending_copies.begin() + i0);
+                flush_copies();
+                break;
+            }
+        }
+
+        pending_copies.clear();
+        updated = true;
+    }
+
     if (do_shift) {
         if (!get_can_shift()) {
             GGML_ABORT("The current KV cache / model configuration does not support K-shift");
@@ -698,25 +768,95 @@ void llama_kv_cache_unified::apply_ubatch(uint32_t head_cur, const llama_ubatch&
 
 bool llama_kv_cache_unified::get_can_shift() const { return true; }
 
+std::map<ggml_backend_buffer_type_t, size_t> llama_kv_cache_unified::memory_breakdown() const {
+    std::map<ggml_backend_buffer_type_t, size_t> mb;
+    for (const auto & buf : bufs) {
+        mb[ggml_backend_buffer_get_type(buf.get())] += ggml_backend_buffer_get_size(buf.get());
+    }
+    return mb;
+}
+
 uint32_t llama_kv_cache_unified::get_size() const { return cells.size(); }
 
 bool llama_kv_cache_unified::get_has_shift() const { return cells.get_has_shift(); }
 
+float llama_kv_cache_unified::get_fragmentation() const {
+    const uint32_t n_used_max = cells.used_max_p1();
+    return n_used_max == 0 ? 0.0f : 1.0f - float(cells.get_used()) / n_used_max;
+}
+
+void llama_kv_cache_unified::get_cells(const llama_seq_id * seq_ids, int32_t n_seq_ids, uint32_t & n_total, uint32_t & n_used, uint32_t & n_used_seqs) const {
+    n_total     = cells.size();
+    n_used      = cells.get_used();
+    n_used_seqs = 0;
+
+    for (uint32_t i = 0; i < cells.used_max_p1(); ++i) {
+        if (cells.is_empty(i)) {
+            continue;
+        }
+        for (int32_t s = 0; s < n_seq_ids; ++s) {
+            if (cells.seq_has(i, seq_ids[s])) {
+                n_used_seqs++;
+                break;
+            }
+        }
+    }
+}
+
+llama_pos llama_kv_cache_unified::cell_seq_pos(uint32_t i, llama_seq_id seq_id) const {
+    if (i >= cells.size() || cells.is_empty(i) || !cells.seq_has(i, seq_id)) {
+        return -1;
+    }
+    return cells.pos_get(i);
+}
+
+uint32_t llama_kv_cache_unified::seq_rm_cells(llama_seq_id seq_id, const std::vector<uint32_t> & cell_ids) {
+    uint32_t n_removed = 0;
+    for (uint32_t i : cell_ids) {
+        if (cell_seq_pos(i, seq_id) < 0) {
+            continue;
+        }
+        if (cells.seq_rm(i, seq_id) && i < head) {
+            head = i;
+        }
+        n_removed++;
+    }
+    return n_removed;
+}
+
 uint32_t llama_kv_cache_unified::get_n_kv() const {
     return std::min(cells.size(), std::max(n_pad, GGML_PAD(cells.used_max_p1(), n_pad)));
 }
 
-ggml_tensor* llama_kv_cache_unified::get_k(ggml_context* ctx, int32_t il, uint32_t n_kv) const {
+void llama_kv_cache_unified::get_kv_window(const llama_ubatch& ubatch, uint32_t& kv_min, uint32_t& n_kv) const {
+    std::bitset<LLAMA_MAX_SEQ> seqs;
+    for (uint32_t i = 0; i < ubatch.n_tokens; ++i) {
+        for (int32_t s = 0; s < ubatch.n_seq_id[i]; ++s) {
+            seqs.set(ubatch.seq_id[i][s]);
+        }
+    }
+
+    // the ubatch is already applied, so the window is never empty
+    uint32_t hi = 0;
+    cells.seq_span(seqs, kv_min, hi);
+
+    // the window starts on a padding boundary, which keeps the view offsets aligned
+    kv_min -= kv_min % n_pad;
+    n_kv = std::min(cells.size(), std::max(n_pad, GGML_PAD(hi - kv_min, n_pad)));
+    kv_min = std::min(kv_min, cells.size() - n_kv);
+}
+
+ggml_tensor* llama_kv_cache_unified::get_k(ggml_context* ctx, int32_t il, uint32_t n_kv, uint32_t kv_min) const {
     const int32_t ikv = map_layer_ids.at(il);
 
     auto* k = layers[ikv].k;
 
     return ggml_view_3d(ctx, k, hparams.n_embd_head_k, hparams.n_head_kv(il), n_kv,
                         ggml_row_size(k->type, hparams.n_embd_head_k), ggml_row_size(k->type, hparams.n_embd_k_gqa(il)),
-                        0);
+                        ggml_row_size(k->type, hparams.n_embd_k_gqa(il)) * kv_min);
 }
 
-ggml_tensor* llama_kv_cache_unified::get_v(ggml_context* ctx, int32_t il, uint32_t n_kv) const {
+ggml_tensor* llama_kv_cache_unified::get_v(ggml_context* ctx, int32_t il, uint32_t n_kv, uint32_t kv_min) const {
     const int32_t ikv = map_layer_ids.at(il);
 
     auto* v = layers[ikv].v;
@@ -726,14 +866,14 @@ ggml_tensor* llama_kv_cache_unified::get_v(ggml_context* ctx, int32_t il, uint32
         return ggml_view_3d(ctx, v, hparams.n_embd_head_v, hparams.n_head_kv(il), n_kv,
                             ggml_row_size(v->type, hparams.n_embd_head_v),     // v->nb[1]
                             ggml_row_size(v->type, hparams.n_embd_v_gqa(il)),  // v->nb[2]
-                            0);
+                            ggml_row_size(v->type, hparams.n_embd_v_gqa(il)) * kv_min);
     }
 
     // note: v->nb[1] > v->nb[2]
     return ggml_view_3d(ctx, v, n_kv, hparams.n_head_kv(il), hparams.n_embd_head_v,
                         ggml_row_size(v->type, v->ne[1] * hparams.n_embd_head_v),  // v->nb[1]
                         ggml_row_size(v->type, v->ne[1]),                          // v->nb[2]
-                        0);
+                        ggml_row_size(v->type, kv_min));
 }
 
 ggml_tensor* llama_kv_cache_unified::cpy_k(ggml_context* ctx, ggml_tensor* k_cur, int32_t il, uint32_t head_cur) const {
@@ -774,7 +914,8 @@ ggml_tensor* llama_kv_cache_unified::cpy_v(ggml_context* ctx, ggml_tensor* v_cur
     return ggml_cpy(ctx, v_cur, v_view);
 }
 
-void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor* dst, const llama_ubatch* ubatch, bool causal_attn) const {
+void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor* dst, const llama_ubatch* ubatch, bool causal_attn,
+                                               const std::vector<bool>& seq_non_causal, uint32_t kv_min) const {
     const uint32_t n_tokens = ubatch->n_tokens;
     const uint32_t n_seq_tokens = ubatch->n_seq_tokens;
     const uint32_t n_seqs = ubatch->n_seqs;
@@ -799,6 +940,8 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor* dst, const llama_uba
     for (uint32_t h = 0; h < 1; ++h) {
         for (uint32_t s = 0; s < n_seqs; ++s) {
             const llama_seq_id seq_id = ubatch->seq_id[s][0];
+            // a non-causal sequence (image block) attends its later cells too, the others of the ubatch stay causal
+            const bool causal_seq = causal_attn && !((size_t)seq_id < seq_non_causal.size() && seq_non_causal[seq_id]);
 
             for (uint32_t j = 0; j < n_seq_tokens; ++j) {
                 const uint32_t idx = s * n_seq_tokens + j;
@@ -810,16 +953,16 @@ void llama_kv_cache_unified::set_input_kq_mask(ggml_tensor* dst, const llama_uba
 
                     bool masked = false;
 
-                    if (cells.is_empty(i)) {
+                    if (cells.is_empty(kv_min + i)) {
                         masked = true;
                     } else {
-                        const llama_pos p0 = cells.pos_get(i);
+                        const llama_pos p0 = cells.pos_get(kv_min + i);
 
                         // mask the token if not the same sequence
-                        masked = masked || (!cells.seq_has(i, seq_id));
+                        masked = masked || (!cells.seq_has(kv_min + i, seq_id));
 
                         // mask future tokens
-                        masked = masked || (causal_attn && p0 > p1);
+                        masked = masked || (causal_seq && p0 > p1);
 
                         // apply SWA if any
                         masked = masked || (is_masked_swa(p0, p1));
@@ -859,7 +1002,7 @@ void llama_kv_cache_unified::set_input_k_shift(ggml_tensor* dst) const {
     }
 }
 
-void llama_kv_cache_unified::set_input_pos_bucket(ggml_tensor* dst, const llama_ubatch* ubatch) const {
+void llama_kv_cache_unified::set_input_pos_bucket(ggml_tensor* dst, const llama_ubatch* ubatch, uint32_t kv_min) const {
     const int64_t n_tokens = ubatch->n_tokens;
 
     GGML_ASSERT(ggml_backend_buffer_is_host(dst->buffer));
@@ -873,7 +1016,7 @@ void llama_kv_cache_unified::set_input_pos_bucket(ggml_tensor* dst, const llama_
         for (int j = 0; j < n_tokens; ++j) {
             for (int i = 0; i < n_kv; ++i) {
                 // the position when the cells is empty is irrelevant - it will be masked out later in the attention
-                const llama_pos p0 = cells.is_empty(i) ? -1 : cells.pos_get(i);
+                const llama_pos p0 = cells.is_empty(kv_min + i) ? -1 : cells.pos_get(kv_min + i);
 
                 data[h * (n_kv * n_tokens) + j * n_kv + i] =
                     llama_relative_position_bucket(p0, ubatch->pos[j], hparams.n_rel_attn_bkts, false);
@@ -1146,6 +1289,63 @@ llm_graph_result_ptr llama_kv_cache_unified::build_graph_defrag(const llama_cpar
     return res;
 }
 
+llm_graph_result_ptr llama_kv_cache_unified::build_graph_copy(ggml_context* ctx, ggml_cgraph* gf,
+                                                              const std::vector<std::pair<uint32_t, uint32_t>>& ids) const {
+    auto res = std::make_unique<llm_graph_result>();
+
+    // NOTE: the copies run in order, a later one may write a cell an earlier one read
+    for (size_t i = 0; i < ids.size(); ++i) {
+        const uint32_t src = ids[i].first;
+        const uint32_t dst = ids[i].second;
+
+        // batch copy [src, src+nm) to [dst, dst+nm)
+        uint32_t nm = 1;
+
+        while (i + nm < ids.size() && ids[i + nm].first == src + nm && ids[i + nm].second == dst + nm) {
+            nm++;
+        }
+
+        for (const auto& layer : layers) {
+            const uint32_t il = layer.il;
+
+            const int64_t n_embd_k_gqa = hparams.n_embd_k_gqa(il);
+            const int64_t n_embd_v_gqa = hparams.n_embd_v_gqa(il);
+
+            ggml_tensor* view_k_src =
+                ggml_view_2d(ctx, layer.k, n_embd_k_gqa, nm, ggml_row_size(layer.k->type, n_embd_k_gqa),
+                             ggml_row_size(layer.k->type, n_embd_k_gqa * src));
+
+            ggml_tensor* view_k_dst =
+                ggml_view_2d(ctx, layer.k, n_embd_k_gqa, nm, ggml_row_size(layer.k->type, n_embd_k_gqa),
+                             ggml_row_size(layer.k->type, n_embd_k_gqa * dst));
+
+            ggml_tensor* view_v_src;
+            ggml_tensor* view_v_dst;
+
+            if (!v_trans) {
+                view_v_src = ggml_view_2d(ctx, layer.v, n_embd_v_gqa, nm, ggml_row_size(layer.v->type, n_embd_v_gqa),
+                                          ggml_row_size(layer.v->type, n_embd_v_gqa * src));
+
+                view_v_dst = ggml_view_2d(ctx, layer.v, n_embd_v_gqa, nm, ggml_row_size(layer.v->type, n_embd_v_gqa),
+                                          ggml_row_size(layer.v->type, n_embd_v_gqa * dst));
+            } else {
+                view_v_src = ggml_view_2d(ctx, layer.v, nm, n_embd_v_gqa, ggml_row_size(layer.v->type, cells.size()),
+                                          ggml_row_size(layer.v->type, src));
+
+                view_v_dst = ggml_view_2d(ctx, layer.v, nm, n_embd_v_gqa, ggml_row_size(layer.v->type, cells.size()),
+                                          ggml_row_size(layer.v->type, dst));
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_k_src, view_k_dst));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx, view_v_src, view_v_dst));
+        }
+
+        i += nm - 1;
+    }
+
+    return res;
+}
+
 llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32_t n_max_nodes) const {
     const uint32_t n_layer = layers.size();
 
@@ -1266,6 +1466,52 @@ llama_kv_cache_unified::defrag_info llama_kv_cache_unified::defrag_prepare(int32
     return res;
 }
 
+void llama_kv_cache_unified::flush_copies() const {
+    if (pending_copies.empty()) {
+        return;
+    }
+
+    const auto& ids = pending_copies;
+
+    std::vector<uint8_t> buf;
+
+    for (const auto& layer : layers) {
+        const uint32_t il = layer.il;
+
+        const size_t k_size_row = ggml_row_size(layer.k->type, hparams.n_embd_k_gqa(il));
+        buf.resize(k_size_row);
+        for (const auto& [src, dst] : ids) {
+            ggml_backend_tensor_get(layer.k, buf.data(), src * k_size_row, k_size_row);
+            ggml_backend_tensor_set(layer.k, buf.data(), dst * k_size_row, k_size_row);
+        }
+
+        if (!v_trans) {
+            const size_t v_size_row = ggml_row_size(layer.v->type, hparams.n_embd_v_gqa(il));
+            buf.resize(v_size_row);
+            for (const auto& [src, dst] : ids) {
+                ggml_backend_tensor_get(layer.v, buf.data(), src * v_size_row, v_size_row);
+                ggml_backend_tensor_set(layer.v, buf.data(), dst * v_size_row, v_size_row);
+            }
+            continue;
+        }
+
+        // the cells are columns of the transposed V, move them on the host in one round trip
+        const size_t v_size_el = ggml_type_size(layer.v->type);
+        const int64_t kv_size = layer.v->ne[1];
+        buf.resize(ggml_nbytes(layer.v));
+        ggml_backend_tensor_get(layer.v, buf.data(), 0, buf.size());
+        for (uint32_t j = 0; j < hparams.n_embd_v_gqa(il); ++j) {
+            for (const auto& [src, dst] : ids) {
+                memcpy(buf.data() + (j * kv_size + dst) * v_size_el, buf.data() + (j * kv_size + src) * v_size_el,
+                       v_size_el);
+            }
+        }
+        ggml_backend_tensor_set(layer.v, buf.data(), 0, buf.size());
+    }
+
+    pending_copies.clear();
+}
+
 bool llama_kv_cache_unified::is_masked_swa(llama_pos p0, llama_pos p1) const {
     assert(p0 >= 0 && p1 >= 0);
 
@@ -1290,6 +1536,8 @@ bool llama_kv_cache_unified::is_masked_swa(llama_pos p0, llama_pos p1) const {
 }
 
 void llama_kv_cache_unified::state_write(llama_io_write_i& io, llama_seq_id seq_id) const {
+    flush_copies();  // NOTE: no llama_context here, the split cells must hold their data before it is read
+
     std::vector<std::pair<uint32_t, uint32_t>> cell_ranges;  // ranges, from inclusive, to exclusive
     uint32_t cell_count = 0;
 
@@ -1330,6 +1578,8 @@ void llama_kv_cache_unified::state_write(llama_io_write_i& io, llama_seq_id seq_
 }
 
 void llama_kv_cache_unified::state_read(llama_io_read_i& io, llama_seq_id seq_id) {
+    flush_copies();  // NOTE: before the restored cells may be written, one may be a pending copy source
+
     uint32_t cell_count;
     io.read_to(&cell_count, sizeof(cell_count));
     // printf("llama_kv_cache_unified::state_read: cell_count = %u\n", cell_count);
@@ -1715,9 +1965,14 @@ llama_kv_cache_unified_state::llama_kv_cache_unified_state(llama_kv_cache_unifie
 }
 
 llama_kv_cache_unified_state::llama_kv_cache_unified_state(llama_kv_cache_unified* kv, llama_context* lctx,
-                                                           bool do_shift, defrag_info dinfo)
-    : status(LLAMA_MEMORY_STATUS_SUCCESS), kv(kv), lctx(lctx), do_shift(do_shift), dinfo(std::move(dinfo)) {
-    if (!do_shift && this->dinfo.empty()) {
+                                                           bool do_copy, bool do_shift, defrag_info dinfo)
+    : status(LLAMA_MEMORY_STATUS_SUCCESS),
+      kv(kv),
+      lctx(lctx),
+      do_copy(do_copy),
+      do_shift(do_shift),
+      dinfo(std::move(dinfo)) {
+    if (!do_copy && !do_shift && this->dinfo.empty()) {
         status = LLAMA_MEMORY_STATUS_NO_UPDATE;
     }
 }
@@ -1748,14 +2003,16 @@ bool llama_kv_cache_unified_state::apply() {
 
     // no ubatches -> this is a KV cache update
     if (ubatches.empty()) {
-        kv->update(lctx, do_shift, dinfo);
+        kv->update(lctx, do_copy, do_shift, dinfo);
 
         return true;
     }
 
     kv->apply_ubatch(heads[i_next], ubatches[i_next]);
 
-    n_kv = kv->get_n_kv();
+    uint32_t n_kv_window = 0;
+    kv->get_kv_window(ubatches[i_next], kv_min, n_kv_window);
+    n_kv = n_kv_window;
     head = heads[i_next];
 
     return true;
@@ -1778,11 +2035,11 @@ const llama_ubatch& llama_kv_cache_unified_state::get_ubatch() const {
 uint32_t llama_kv_cache_unified_state::get_n_kv() const { return n_kv; }
 
 ggml_tensor* llama_kv_cache_unified_state::get_k(ggml_context* ctx, int32_t il) const {
-    return kv->get_k(ctx, il, n_kv);
+    return kv->get_k(ctx, il, n_kv, kv_min);
 }
 
 ggml_tensor* llama_kv_cache_unified_state::get_v(ggml_context* ctx, int32_t il) const {
-    return kv->get_v(ctx, il, n_kv);
+    return kv->get_v(ctx, il, n_kv, kv_min);
 }
 
 ggml_tensor* llama_kv_cache_unified_state::cpy_k(ggml_context* ctx, ggml_tensor* k_cur, int32_t il) const {
@@ -1795,16 +2052,18 @@ ggml_tensor* llama_kv_cache_unified_state::cpy_v(ggml_context* ctx, ggml_tensor*
 
 void llama_kv_cache_unified_state::set_input_k_shift(ggml_tensor* dst) const { kv->set_input_k_shift(dst); }
 
-void llama_kv_cache_unified_state::set_input_kq_mask(ggml_tensor* dst, const llama_ubatch* ubatch,
-                                                     bool causal_attn) const {
-    kv->set_input_kq_mask(dst, ubatch, causal_attn);
+void llama_kv_cache_unified_state::set_input_kq_mask(ggml_tensor* dst, const llama_ubatch* ubatch, bool causal_attn,
+                                                     const std::vector<bool>& seq_non_causal) const {
+    kv->set_input_kq_mask(dst, ubatch, causal_attn, seq_non_causal, kv_min);
 }
 
 void llama_kv_cache_unified_state::set_input_pos_bucket(ggml_tensor* dst, const llama_ubatch* ubatch) const {
-    kv->set_input_pos_bucket(dst, ubatch);
+    kv->set_input_pos_bucket(dst, ubatch, kv_min);
 }
 
 uint32_t llama_kv_cache_unified::get_padding(const llama_cparams& cparams) {
     // the FA kernels require padding to avoid extra runtime boundary checks
-    return cparams.flash_attn ? 256u : 32u;
+    const uint32_t n_pad = cparams.flash_attn ? 256u : 32u;
+    // a coarser padding changes n_kv, and so the shape of the decode graph, less often
+    return cparams.n_kv_pad > n_pad ? GGML_PAD(cparams.n_kv_pad, n_pad) : n_pad;
 }
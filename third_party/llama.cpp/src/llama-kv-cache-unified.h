@@ -66,6 +66,7 @@ public:
     llama_memory_state_ptr init_update(llama_context * lctx, bool optimize) override;
 
     bool get_can_shift() const override;
+    std::map<ggml_backend_buffer_type_t, size_t> memory_breakdown() const override;
 
     void clear(bool data) override;
 
@@ -91,15 +92,30 @@ public:
 
     bool get_has_shift() const;
 
+    // fraction of the cells up to the last used one that hold no token
+    float get_fragmentation() const;
+
+    // cells in total, holding a token and holding a token of any of seq_ids
+    void get_cells(const llama_seq_id * seq_ids, int32_t n_seq_ids, uint32_t & n_total, uint32_t & n_used, uint32_t & n_used_seqs) const;
+
+    // position of cell i if it holds seq_id, -1 otherwise
+    llama_pos cell_seq_pos(uint32_t i, llama_seq_id seq_id) const;
+
+    // removes seq_id from the cells cell_ids, returns the number of cells it was removed from
+    uint32_t seq_rm_cells(llama_seq_id seq_id, const std::vector<uint32_t> & cell_ids);
+
     //
     // graph_build API
     //
 
     uint32_t get_n_kv() const;
 
-    // get views of the current state of the cache
-    ggml_tensor * get_k(ggml_context * ctx, int32_t il, uint32_t n_kv) const;
-    ggml_tensor * get_v(ggml_context * ctx, int32_t il, uint32_t n_kv) const;
+    // the padded window [kv_min, kv_min + n_kv) of cells holding the sequences of the ubatch
+    void get_kv_window(const llama_ubatch & ubatch, uint32_t & kv_min, uint32_t & n_kv) const;
+
+    // get views of the current state of the cache, starting at cell kv_min
+    ggml_tensor * get_k(ggml_context * ctx, int32_t il, uint32_t n_kv, uint32_t kv_min = 0) const;
+    ggml_tensor * get_v(ggml_context * ctx, int32_t il, uint32_t n_kv, uint32_t kv_min = 0) const;
 
     // store k_cur and v_cur in the cache based on the provided head location
     ggml_tensor * cpy_k(ggml_context * ctx, ggml_tensor * k_cur, int32_t il, uint32_t head_cur) const;
@@ -113,7 +129,7 @@ public:
     // return empty vector on failure
     ubatch_heads prepare(const std::vector<llama_ubatch> & ubatches);
 
-    bool update(llama_context * lctx, bool do_shift, const defrag_info & dinfo);
+    bool update(llama_context * lctx, bool do_copy, bool do_shift, const defrag_info & dinfo);
 
     // return the cell position where we can insert the ubatch
     // return -1 on failure to find a contiguous slot of kv cells
@@ -126,9 +142,10 @@ public:
     // set_input API
     //
 
-    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
+    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn,
+                              const std::vector<bool> & seq_non_causal, uint32_t kv_min = 0) const;
     void set_input_k_shift   (ggml_tensor * dst) const;
-    void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
+    void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch, uint32_t kv_min = 0) const;
 
 private:
     const llama_model & model;
@@ -168,6 +185,10 @@ private:
 
     std::vector<kv_layer> layers;
 
+    // (src, dst) cells split off by seq_add, their K/V data is copied by the next update before the K-shift
+    // NOTE: mutable, the state readers copy them on the host first
+    mutable std::vector<std::pair<uint32_t, uint32_t>> pending_copies;
+
     // model layer id -> KV cache layer id
     std::unordered_map<int32_t, int32_t> map_layer_ids;
 
@@ -181,6 +202,9 @@ private:
 
     bool is_masked_swa(llama_pos p0, llama_pos p1) const;
 
+    // copy the K/V data of the pending copies through the host, without a llama_context
+    void flush_copies() const;
+
     ggml_tensor * build_rope_shift(
             const llama_cparams & cparams,
                    ggml_context * ctx,
@@ -201,6 +225,12 @@ private:
                     ggml_cgraph * gf,
               const defrag_info & dinfo) const;
 
+    // copy the K/V data of cell src to cell dst for each (src, dst) pair
+    llm_graph_result_ptr build_graph_copy(
+                   ggml_context * ctx,
+                    ggml_cgraph * gf,
+            const std::vector<std::pair<uint32_t, uint32_t>> & ids) const;
+
     void state_write_meta(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges, llama_seq_id seq_id = -1) const;
     void state_write_data(llama_io_write_i & io, const std::vector<std::pair<uint32_t, uint32_t>> & cell_ranges) const;
 
@@ -225,6 +255,7 @@ public:
     llama_kv_cache_unified_state(
             llama_kv_cache_unified * kv,
             llama_context * lctx,
+            bool do_copy,
             bool do_shift,
             defrag_info dinfo);
 
@@ -255,6 +286,10 @@ public:
 
     uint32_t get_n_kv() const;
 
+    uint32_t get_kv_min() const { return kv_min; }
+
+    const llama_kv_cache_unified * get_kv() const { return kv; }
+
     // get views of the current state of the cache
     ggml_tensor * get_k(ggml_context * ctx, int32_t il) const;
     ggml_tensor * get_v(ggml_context * ctx, int32_t il) const;
@@ -265,7 +300,8 @@ public:
 
     void set_input_k_shift(ggml_tensor * dst) const;
 
-    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn) const;
+    void set_input_kq_mask   (ggml_tensor * dst, const llama_ubatch * ubatch, bool causal_attn,
+                              const std::vector<bool> & seq_non_causal) const;
     void set_input_pos_bucket(ggml_tensor * dst, const llama_ubatch * ubatch) const;
 
 private:
@@ -278,6 +314,7 @@ private:
     // update state
     //
 
+    bool do_copy  = false;
     bool do_shift = false;
 
     defrag_info dinfo;
@@ -303,6 +340,9 @@ private:
     // as the cache gets filled, the benefit from this heuristic disappears
     int32_t n_kv;
 
+    // the first cell attended by the current ubatch, cells below it hold only other sequences
+    uint32_t kv_min = 0;
+
     // the beginning of the current slot in which the ubatch will be inserted
     int32_t head;
 };
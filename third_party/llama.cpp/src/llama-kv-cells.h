@@ -63,6 +63,20 @@ public:
     // return 0 if no cells are used
     uint32_t used_max_p1() const { return used.empty() ? 0 : *used.rbegin() + 1; }
 
+    // [lo, hi) spanning the cells that hold any of the sequences in seqs, lo == hi if there are none
+    void seq_span(const std::bitset<LLAMA_MAX_SEQ>& seqs, uint32_t& lo, uint32_t& hi) const {
+        lo = used_min();
+        hi = used_max_p1();
+
+        while (hi > lo && (seq[hi - 1] & seqs).none()) {
+            --hi;
+        }
+
+        while (lo < hi && (seq[lo] & seqs).none()) {
+            ++lo;
+        }
+    }
+
     bool get_has_shift() const { return has_shift; }
 
     // move cell isrc to idst (used during defrag)
@@ -226,6 +240,24 @@ public:
         seq_pos[seq_id].insert(pos[i]);
     }
 
+    // move seq_id out of the shared cell isrc into the empty cell idst, which takes over the position and the
+    // pending shift of isrc (copy-on-write, the caller copies the K/V data)
+    void seq_split(uint32_t isrc, uint32_t idst, llama_seq_id seq_id) {
+        assert(isrc < pos.size());
+        assert(idst < pos.size());
+        assert(seq[isrc].test(seq_id));
+        assert(seq[isrc].count() > 1);
+        assert(pos[idst] == -1);
+
+        seq[isrc].reset(seq_id);
+
+        pos[idst] = pos[isrc];
+        shift[idst] = shift[isrc];
+        seq[idst].set(seq_id);
+
+        used.insert(idst);
+    }
+
     // return the sequence id of this cell
     // note: call only for cells with exactly one sequence
     llama_seq_id seq_get(uint32_t i) const {
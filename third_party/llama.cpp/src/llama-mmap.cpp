@@ -9,6 +9,8 @@
 #include <stdexcept>
 #include <cerrno>
 #include <algorithm>
+#include <atomic>
+#include <thread>
 
 #ifdef __has_include
     #if __has_include(<unistd.h>)
@@ -39,6 +41,16 @@
 #include <TargetConditionals.h>
 #endif
 
+#if defined(__linux__) && defined(_POSIX_MAPPED_FILES)
+#include <sys/vfs.h>
+#ifndef HUGETLBFS_MAGIC
+#define HUGETLBFS_MAGIC 0x958458f6
+#endif
+#endif
+
+#define LLAMA_MMAP_THP_SIZE      (2u*1024*1024)  // transparent hugepages map 2 MB aligned file offsets only
+#define LLAMA_MMAP_PREFETCH_STEP (64u*1024*1024) // range populated per step of the background prefetch
+
 // TODO: consider moving to llama-impl.h if needed in more places
 #if defined(_WIN32)
 static std::string llama_format_win_err(DWORD err) {
@@ -126,6 +138,27 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            DWORD chunk_size = (DWORD) std::min<size_t>(len - bytes_read, 64*1024*1024);
+            DWORD chunk_read = 0;
+            OVERLAPPED overlapped = {};
+            overlapped.Offset     = (DWORD) (offset + bytes_read);
+            overlapped.OffsetHigh = (DWORD) ((offset + bytes_read) >> 32);
+            char * dst = reinterpret_cast<char*>(ptr) + bytes_read;
+            BOOL result = ReadFile(fp_win32, dst, chunk_size, &chunk_read, &overlapped);
+            if (!result) {
+                throw std::runtime_error(format("read error: %s", GetErrorMessageWin32(GetLastError()).c_str()));
+            }
+            if (chunk_read == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+
+            bytes_read += chunk_read;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t val;
         read_raw(&val, sizeof(val));
@@ -209,6 +242,23 @@ struct llama_file::impl {
         }
     }
 
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        size_t bytes_read = 0;
+        while (bytes_read < len) {
+            ssize_t ret = pread(fileno(fp), (char *) ptr + bytes_read, len - bytes_read, (off_t) (offset + bytes_read));
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+            if (ret == 0) {
+                throw std::runtime_error("unexpectedly reached end of file");
+            }
+            bytes_read += ret;
+        }
+    }
+
     uint32_t read_u32() const {
         uint32_t ret;
         read_raw(&ret, sizeof(ret));
@@ -261,6 +311,7 @@ int llama_file::file_id() const {
 
 void llama_file::seek(size_t offset, int whence) const { pimpl->seek(offset, whence); }
 void llama_file::read_raw(void * ptr, size_t len) const { pimpl->read_raw(ptr, len); }
+void llama_file::read_raw_at(void * ptr, size_t len, size_t offset) const { pimpl->read_raw_at(ptr, len, offset); }
 
 uint32_t llama_file::read_u32() const { return pimpl->read_u32(); }
 
@@ -272,20 +323,67 @@ void llama_file::write_u32(uint32_t val) const { pimpl->write_u32(val); }
 struct llama_mmap::impl {
 #ifdef _POSIX_MAPPED_FILES
     std::vector<std::pair<size_t, size_t>> mapped_fragments;
+    size_t page_size;
+    std::thread prefetch_thread;
+    std::atomic<bool> prefetch_stop{false};
 
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    impl(struct llama_file * file, size_t prefetch, bool numa, bool hugepages) {
         size = file->size();
         int fd = file->file_id();
         int flags = MAP_SHARED;
         if (numa) { prefetch = 0; }
+        page_size = sysconf(_SC_PAGESIZE);
 #ifdef __linux__
+        struct statfs fs;
+        if (fstatfs(fd, &fs) == 0 && (uint32_t) fs.f_type == HUGETLBFS_MAGIC) {
+            // explicit hugepages: the file is on a hugetlbfs mount, it maps and unmaps in its page size
+            page_size = fs.f_bsize;
+            LLAMA_LOG_INFO("%s: mapping from hugetlbfs, %zu kB pages\n", __func__, page_size / 1024);
+        }
         if (posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL)) {
             LLAMA_LOG_WARN("warning: posix_fadvise(.., POSIX_FADV_SEQUENTIAL) failed: %s\n",
                     strerror(errno));
         }
         if (prefetch) { flags |= MAP_POPULATE; }
 #endif
-        addr = mmap(NULL, file->size(), PROT_READ, flags, fd, 0);
+        const size_t map_size = (size + page_size - 1) / page_size * page_size;
+        void * hint = NULL;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        // reserve a range with room to place the mapping at a THP aligned address, the slack is unmapped again
+        void * reserved = MAP_FAILED;
+        const size_t reserved_size = map_size + LLAMA_MMAP_THP_SIZE;
+        if (hugepages && page_size < LLAMA_MMAP_THP_SIZE) {
+            reserved = mmap(NULL, reserved_size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        }
+        if (reserved != MAP_FAILED) {
+            hint = (void *) (((uintptr_t) reserved + LLAMA_MMAP_THP_SIZE - 1) & ~(uintptr_t) (LLAMA_MMAP_THP_SIZE - 1));
+            flags |= MAP_FIXED;
+        }
+#else
+        GGML_UNUSED(hugepages);
+#endif
+        addr = mmap(hint, map_size, PROT_READ, flags, fd, 0);
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+        if (reserved != MAP_FAILED) {
+            if (addr == MAP_FAILED) {
+                munmap(reserved, reserved_size);
+            } else {
+                size_t head = (uint8_t *) hint - (uint8_t *) reserved;
+                if (head > 0) {
+                    munmap(reserved, head);
+                }
+                if (reserved_size - head > map_size) {
+                    munmap((uint8_t *) hint + map_size, reserved_size - head - map_size);
+                }
+            }
+        }
+        if (addr != MAP_FAILED && hugepages && page_size < LLAMA_MMAP_THP_SIZE) {
+            // NOTE: file backed THP need CONFIG_READ_ONLY_THP_FOR_FS, khugepaged collapses the pages over time
+            if (madvise(addr, map_size, MADV_HUGEPAGE)) {
+                LLAMA_LOG_WARN("warning: madvise(.., MADV_HUGEPAGE) failed: %s\n", strerror(errno));
+            }
+        }
+#endif
         if (addr == MAP_FAILED) {
             throw std::runtime_error(format("mmap failed: %s", strerror(errno)));
         }
@@ -303,7 +401,34 @@ struct llama_mmap::impl {
             }
         }
 
-        mapped_fragments.emplace_back(0, file->size());
+        mapped_fragments.emplace_back(0, map_size);
+    }
+
+    // populates [first, last) in a background thread, stopped before the mapping goes
+    void prefetch_async(size_t first, size_t last) {
+        GGML_ASSERT(!prefetch_thread.joinable());
+        first = first / page_size * page_size;
+        prefetch_thread = std::thread([this, first, last]() {
+            const int64_t t_start_us = ggml_time_us();
+            for (size_t offs = first; offs < last && !prefetch_stop; offs += LLAMA_MMAP_PREFETCH_STEP) {
+                uint8_t * p = (uint8_t *) addr + offs;
+                const size_t len = std::min<size_t>(LLAMA_MMAP_PREFETCH_STEP, last - offs);
+                posix_madvise(p, len, POSIX_MADV_WILLNEED);
+#if defined(MADV_POPULATE_READ)
+                if (madvise(p, len, MADV_POPULATE_READ) == 0) {
+                    continue;
+                }
+#endif
+                // NOTE: kernels before 5.14, one read per page faults it in
+                uint8_t sum = 0;
+                for (size_t i = 0; i < len; i += page_size) {
+                    sum += ((volatile const uint8_t *) p)[i];
+                }
+                GGML_UNUSED(sum);
+            }
+            LLAMA_LOG_DEBUG("prefetch_async: %zu MB of weights populated in %.1f s\n", (last - first) >> 20,
+                    (ggml_time_us() - t_start_us) / 1e6);
+        });
     }
 
     static void align_range(size_t * first, size_t * last, size_t page_size) {
@@ -319,7 +444,6 @@ struct llama_mmap::impl {
     }
 
     void unmap_fragment(size_t first, size_t last) {
-        int page_size = sysconf(_SC_PAGESIZE);
         align_range(&first, &last, page_size);
         size_t len = last - first;
 
@@ -355,6 +479,10 @@ struct llama_mmap::impl {
     }
 
     ~impl() {
+        if (prefetch_thread.joinable()) {
+            prefetch_stop = true;
+            prefetch_thread.join();
+        }
         for (const auto & frag : mapped_fragments) {
             if (munmap((char *) addr + frag.first, frag.second - frag.first)) {
                 LLAMA_LOG_WARN("warning: munmap failed: %s\n", strerror(errno));
@@ -362,8 +490,9 @@ struct llama_mmap::impl {
         }
     }
 #elif defined(_WIN32)
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    impl(struct llama_file * file, size_t prefetch, bool numa, bool hugepages) {
         GGML_UNUSED(numa);
+        GGML_UNUSED(hugepages);
 
         size = file->size();
 
@@ -411,6 +540,11 @@ struct llama_mmap::impl {
         GGML_UNUSED(last);
     }
 
+    void prefetch_async(size_t first, size_t last) {
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
+
     ~impl() {
         if (!UnmapViewOfFile(addr)) {
             LLAMA_LOG_WARN("warning: UnmapViewOfFile failed: %s\n",
@@ -418,10 +552,11 @@ struct llama_mmap::impl {
         }
     }
 #else
-    impl(struct llama_file * file, size_t prefetch, bool numa) {
+    impl(struct llama_file * file, size_t prefetch, bool numa, bool hugepages) {
         GGML_UNUSED(file);
         GGML_UNUSED(prefetch);
         GGML_UNUSED(numa);
+        GGML_UNUSED(hugepages);
 
         throw std::runtime_error("mmap not supported");
     }
@@ -432,19 +567,26 @@ struct llama_mmap::impl {
 
         throw std::runtime_error("mmap not supported");
     }
+
+    void prefetch_async(size_t first, size_t last) {
+        GGML_UNUSED(first);
+        GGML_UNUSED(last);
+    }
 #endif
 
     void * addr;
     size_t size;
 };
 
-llama_mmap::llama_mmap(struct llama_file * file, size_t prefetch, bool numa) : pimpl(std::make_unique<impl>(file, prefetch, numa)) {}
+llama_mmap::llama_mmap(struct llama_file * file, size_t prefetch, bool numa, bool hugepages)
+    : pimpl(std::make_unique<impl>(file, prefetch, numa, hugepages)) {}
 llama_mmap::~llama_mmap() = default;
 
 size_t llama_mmap::size() const { return pimpl->size; }
 void * llama_mmap::addr() const { return pimpl->addr; }
 
 void llama_mmap::unmap_fragment(size_t first, size_t last) { pimpl->unmap_fragment(first, last); }
+void llama_mmap::prefetch_async(size_t first, size_t last) { pimpl->prefetch_async(first, last); }
 
 #if defined(_POSIX_MEMLOCK_RANGE) || defined(_WIN32)
 const bool llama_mmap::SUPPORTED  = true;
@@ -24,6 +24,7 @@ struct llama_file {
     void seek(size_t offset, int whence) const;
 
     void read_raw(void * ptr, size_t len) const;
+    void read_raw_at(void * ptr, size_t len, size_t offset) const; // leaves the file position, safe across threads
     uint32_t read_u32() const;
 
     void write_raw(const void * ptr, size_t len) const;
@@ -36,13 +37,14 @@ private:
 
 struct llama_mmap {
     llama_mmap(const llama_mmap &) = delete;
-    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1, bool numa = false);
+    llama_mmap(struct llama_file * file, size_t prefetch = (size_t) -1, bool numa = false, bool hugepages = false);
     ~llama_mmap();
 
     size_t size() const;
     void * addr() const;
 
     void unmap_fragment(size_t first, size_t last);
+    void prefetch_async(size_t first, size_t last); // populates the range in a background thread
 
     static const bool SUPPORTED;
 
@@ -3,9 +3,13 @@
 #include "ggml.h"
 
 #include <array>
+#include <atomic>
 #include <cinttypes>
+#include <condition_variable>
 #include <cstring>
 #include <future>
+#include <mutex>
+#include <thread>
 
 static const size_t kiB = 1024;
 static const size_t MiB = 1024*kiB;
@@ -858,7 +862,11 @@ void llama_model_loader::init_mappings(bool prefetch, llama_mlocks * mlock_mmaps
                 }
             }
 
-            std::unique_ptr<llama_mmap> mapping = std::make_unique<llama_mmap>(file.get(), prefetch ? -1 : 0, is_numa);
+            // NOTE: an async prefetch populates only the range the CPU keeps, once the load unmapped the rest
+            const bool prefetch_now = prefetch && !(mmap_prefetch_async && !is_numa);
+            mmap_prefetch_pending = prefetch && !prefetch_now;
+            std::unique_ptr<llama_mmap> mapping =
+                std::make_unique<llama_mmap>(file.get(), prefetch_now ? -1 : 0, is_numa, mmap_hugepages);
             mmaps_used.emplace_back(mapping->size(), 0);
             if (mlock_mmaps) {
                 std::unique_ptr<llama_mlock> mlock_mmap(new llama_mlock());
@@ -928,7 +936,8 @@ bool llama_model_loader::load_all_data(
 
     // 4 staging buffers for async uploads, each sized 1MB seems to be a good default for single NVMe drives.
     // NVMe raid configurations might require more / larger buffers.
-    constexpr size_t n_buffers = 4;
+    // With n_load_threads readers, each keeps two in flight.
+    const size_t n_buffers = n_load_threads > 1 ? 2 * (size_t) n_load_threads : 4;
     constexpr size_t buffer_size = 1 * 1024 * 1024; // 1MB
 
     std::vector<ggml_backend_buffer_t> host_buffers;
@@ -936,10 +945,10 @@ bool llama_model_loader::load_all_data(
     std::vector<void *> host_ptrs;
     size_t buffer_idx = 0; // buffer to use for async loads
     ggml_backend_t upload_backend = [&](const char * func) -> ggml_backend_t {
-        if (use_mmap || check_tensors) {
+        if ((use_mmap && n_load_threads <= 1) || check_tensors) {
             return nullptr;
         }
-        // When not using mmaped io use async uploads from pinned memory to GPU memory.
+        // When not using mmaped io (or reading in parallel) use async uploads from pinned memory to GPU memory.
         // First determine if the backend supports the necessary features for async uploads.
         auto * buf = bufs.count(0) ? bufs.at(0) : nullptr;
         if (!buf) {
@@ -1015,6 +1024,10 @@ bool llama_model_loader::load_all_data(
             ggml_backend_name(upload_backend));
     }
 
+    // device tensors read by the parallel uploads below
+    const bool parallel_upload = upload_backend && n_load_threads > 1;
+    std::vector<ggml_tensor *> uploads;
+
     for (struct ggml_tensor * cur = ggml_get_first_tensor(ctx); cur != NULL; cur = ggml_get_next_tensor(ctx, cur)) {
         const auto * weight = get_weight(ggml_get_name(cur));
         if (weight == nullptr) {
@@ -1022,6 +1035,11 @@ bool llama_model_loader::load_all_data(
             continue;
         }
 
+        if (parallel_upload && !ggml_backend_buffer_is_host(cur->buffer)) {
+            uploads.push_back(cur);
+            continue;
+        }
+
         if (progress_callback) {
             if (!progress_callback((float) size_done / size_data, progress_callback_user_data)) {
                 return false;
@@ -1102,6 +1120,105 @@ bool llama_model_loader::load_all_data(
         size_done += n_size;
     }
 
+    // Parallel uploads: n_load_threads readers read the chunks of the device tensors into the staging buffers, chunk i
+    // into buffer i % n_buffers once the copy of chunk i - n_buffers out of it completed, while this thread queues the
+    // copies in order, the only one using upload_backend
+    std::string upload_error;
+    bool upload_cancelled = false;
+    if (!uploads.empty()) {
+        struct upload_chunk {
+            ggml_tensor      * cur;
+            const llama_file * file;
+            size_t             file_offs;
+            size_t             offs;
+            size_t             size;
+        };
+        std::vector<upload_chunk> chunks;
+        for (ggml_tensor * cur : uploads) {
+            const auto * weight = get_weight(ggml_get_name(cur));
+            const size_t n_size = ggml_nbytes(cur);
+            for (size_t offs = 0; offs < n_size; offs += buffer_size) {
+                chunks.push_back({ cur, files.at(weight->idx).get(), weight->offs + offs, offs,
+                                   std::min(buffer_size, n_size - offs) });
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<char> chunk_read(chunks.size(), 0);
+        size_t n_issued = 0;
+        bool failed = false;
+        std::atomic<size_t> next_chunk{0};
+
+        auto reader = [&]() {
+            for (size_t i; (i = next_chunk++) < chunks.size();) {
+                const auto & chunk = chunks[i];
+                const size_t idx = i % n_buffers;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [&] { return failed || i < n_issued + n_buffers; });
+                    if (failed) {
+                        return;
+                    }
+                }
+                if (i >= n_buffers) {
+                    ggml_backend_event_synchronize(events[idx]);
+                }
+                try {
+                    chunk.file->read_raw_at(host_ptrs[idx], chunk.size, chunk.file_offs);
+                } catch (const std::exception & e) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    failed = true;
+                    upload_error = e.what();
+                    cv.notify_all();
+                    return;
+                }
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    chunk_read[i] = 1;
+                }
+                cv.notify_all();
+            }
+        };
+        std::vector<std::thread> readers;
+        for (int i = 0; i < n_load_threads; i++) {
+            readers.emplace_back(reader);
+        }
+
+        for (size_t i = 0; i < chunks.size(); i++) {
+            const auto & chunk = chunks[i];
+            if (chunk.offs == 0 && progress_callback &&
+                    !progress_callback((float) size_done / size_data, progress_callback_user_data)) {
+                upload_cancelled = true;
+                break;
+            }
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                cv.wait(lock, [&] { return failed || chunk_read[i]; });
+                if (failed) {
+                    break;
+                }
+            }
+            ggml_backend_tensor_set_async(upload_backend, chunk.cur, host_ptrs[i % n_buffers], chunk.offs, chunk.size);
+            ggml_backend_event_record(events[i % n_buffers], upload_backend);
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                n_issued = i + 1;
+            }
+            cv.notify_all();
+            size_done += chunk.size;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            failed = failed || n_issued < chunks.size();
+        }
+        cv.notify_all();
+        for (auto & thread : readers) {
+            thread.join();
+        }
+        LLAMA_LOG_DEBUG("%s: %zu tensors uploaded by %d reader threads\n", __func__, uploads.size(), n_load_threads);
+    }
+
     // free temporary resources used for async uploads
     for (auto * event : events) {
         ggml_backend_event_synchronize(event);
@@ -1112,6 +1229,13 @@ bool llama_model_loader::load_all_data(
     }
     ggml_backend_free(upload_backend);
 
+    if (!upload_error.empty()) {
+        throw std::runtime_error(upload_error);
+    }
+    if (upload_cancelled) {
+        return false;
+    }
+
     // check validation results
     bool validation_failed = false;
     for (auto & future : validation_result) {
@@ -1136,6 +1260,9 @@ bool llama_model_loader::load_all_data(
                 if (mmap_used.second != 0) {
                     mapping->unmap_fragment(mmap_used.second, mapping->size());
                 }
+                if (mmap_prefetch_pending && mmap_used.second > mmap_used.first) {
+                    mapping->prefetch_async(mmap_used.first, mmap_used.second);
+                }
             }
         }
         if (progress_callback) {
@@ -70,6 +70,11 @@ struct llama_model_loader {
 
     bool use_mmap = false;
     bool check_tensors;
+    int  n_load_threads = 0; // > 1 reads the tensors of device buffers in parallel, see load_all_data
+    bool mmap_prefetch_async = false; // populate the mapped weights in the background after the load
+    bool mmap_hugepages      = false; // transparent hugepages on the mapped weights
+    bool pinned_host_weights = false; // CPU layer weights in the pinned host buffer type even with mmap
+    bool mmap_prefetch_pending = false;
 
     llama_files files;
     llama_ftype ftype;
@@ -1741,7 +1741,8 @@ bool llama_model::load_tensors(llama_model_loader & ml) {
 
             // avoid using a host buffer when using mmap
             auto * buft_dev = ggml_backend_buft_get_device(buft);
-            if (ml.use_mmap && buft_dev && buft == ggml_backend_dev_host_buffer_type(buft_dev)) {
+            // note: unless pinned_host_weights asks for it, the weights are then read into it instead of mapped
+            if (ml.use_mmap && !ml.pinned_host_weights && buft_dev && buft == ggml_backend_dev_host_buffer_type(buft_dev)) {
                 auto * cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
                 if (!cpu_dev) {
                     throw std::runtime_error("no CPU backend found");
@@ -4432,6 +4433,14 @@ size_t llama_model::size() const {
     return pimpl->n_bytes;
 }
 
+std::map<ggml_backend_buffer_type_t, size_t> llama_model::memory_breakdown() const {
+    std::map<ggml_backend_buffer_type_t, size_t> mb;
+    for (const auto & buf : pimpl->bufs) {
+        mb[ggml_backend_buffer_get_type(buf.get())] += ggml_backend_buffer_get_size(buf.get());
+    }
+    return mb;
+}
+
 size_t llama_model::n_tensors() const {
     return tensors_by_name.size();
 }
@@ -14131,6 +14140,10 @@ llama_model_params llama_model_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.check_tensors               =*/ false,
+        /*.n_load_threads              =*/ 0,
+        /*.mmap_prefetch_async         =*/ false,
+        /*.mmap_hugepages              =*/ false,
+        /*.pinned_host_weights         =*/ false,
     };
 
 #ifdef GGML_USE_METAL
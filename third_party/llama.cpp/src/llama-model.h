@@ -386,6 +386,9 @@ struct llama_model {
 
     size_t size() const;
     size_t n_tensors() const;
+
+    // bytes of the weight buffers per buffer type
+    std::map<ggml_backend_buffer_type_t, size_t> memory_breakdown() const;
     size_t n_devices() const;
 
     // total number of parameters in the model
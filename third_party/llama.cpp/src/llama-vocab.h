@@ -21,6 +21,9 @@ struct llama_vocab {
 
     void load(llama_model_loader & ml, const LLM_KV & kv);
 
+    // process-unique id of this vocab, never reused by another one (unlike its address)
+    uint64_t get_uid() const;
+
     std::string get_tokenizer_model() const;
     std::string get_tokenizer_pre() const;
 
@@ -60,6 +60,7 @@ extern "C" {
     struct llama_vocab;
     struct llama_model;
     struct llama_context;
+    struct llama_outputs;
     struct llama_sampler;
 
     typedef struct llama_memory_i * llama_memory_t;
@@ -327,6 +328,10 @@ extern "C" {
         bool use_mmap;      // use mmap if possible
         bool use_mlock;     // force system to keep model in RAM
         bool check_tensors; // validate model tensor data
+        int32_t n_load_threads; // threads reading the tensors uploaded to a device, <= 1 reads them in order
+        bool mmap_prefetch_async; // populate the mapped weights in a background thread after the load, not during it
+        bool mmap_hugepages;      // transparent hugepages on the mapped weights
+        bool pinned_host_weights; // CPU layer weights in pinned host memory of the first GPU even with mmap, op_offload streams them faster
     };
 
     // NOTE: changing the default values of parameters marked as [EXPERIMENTAL] may cause crashes or incorrect results in certain configurations
@@ -352,6 +357,9 @@ extern "C" {
         float    yarn_beta_slow;   // YaRN high correction dim
         uint32_t yarn_orig_ctx;    // YaRN original context size
         float    defrag_thold;     // defragment the KV cache if holes/size > thold, <= 0 disabled (default)
+        uint32_t n_kv_pad;         // attended KV cells are padded to a multiple of this, fewer decode graph shapes, 0 = kernel padding
+        uint32_t n_ubatch_decode;  // tokens of the decode step graph reserved next to the n_ubatch one, 0 = single token
+        uint32_t n_op_offload_min; // op_offload streams host weights to the GPU for batches of at least this many tokens, 0 = backend default
 
         ggml_backend_sched_eval_callback cb_eval;
         void * cb_eval_user_data;
@@ -609,6 +617,14 @@ extern "C" {
     // Remove all LoRA adapters from given context
     LLAMA_API void llama_clear_adapter_lora(struct llama_context * ctx);
 
+    // Route a sequence to a loaded LoRA adapter, rows of other sequences in the same batch are not affected
+    // adapter == NULL removes the route of the sequence
+    LLAMA_API void llama_set_adapter_lora_seq(
+            struct llama_context * ctx,
+            llama_seq_id seq_id,
+            struct llama_adapter_lora * adapter,
+            float scale);
+
     // Apply a loaded control vector to a llama_context, or if data is NULL, clear
     // the currently loaded vector.
     // n_embd should be the size of a single layer's control, and data should point
@@ -697,6 +713,40 @@ extern "C" {
     // Check if the memory supports shifting
     LLAMA_API bool llama_memory_can_shift(llama_memory_t mem);
 
+    // Fraction of the KV cells up to the last used one that hold no token, 0 for other memory types
+    LLAMA_API float llama_memory_fragmentation(llama_memory_t mem);
+
+    // Compacts the KV cells now instead of inside a later llama_decode
+    // Returns true if the memory was updated
+    LLAMA_API bool llama_memory_defrag(struct llama_context * ctx);
+
+    // KV cells in total, holding a token and holding a token of any of seq_ids (n_seq_ids may be 0)
+    // For a sliding window model the cells of the full attention cache, returns false for other memory types
+    LLAMA_API bool llama_memory_cells(
+            llama_memory_t mem,
+            const llama_seq_id * seq_ids,
+            int32_t n_seq_ids,
+            uint32_t * n_total,
+            uint32_t * n_used,
+            uint32_t * n_used_seqs);
+
+    // Bytes a context and its model hold in one buffer type, see llama_memory_breakdown
+    struct llama_memory_breakdown_data {
+        const char * buft;    // buffer type name, e.g. "CUDA0", "CUDA_Host" or "CPU"
+        const char * device;  // device of the buffer type, NULL if none
+        size_t       model;   // weights
+        size_t       memory;  // kv cache or recurrent state
+        size_t       output;  // logits and embeddings outputs, with the pooled output buffers
+        size_t       compute; // graph compute buffers
+    };
+
+    // Fills up to n_max entries, one per buffer type the context or its model allocated from
+    // Returns the number of buffer types, which may be more than n_max
+    LLAMA_API int32_t llama_memory_breakdown(
+            const struct llama_context * ctx,
+            struct llama_memory_breakdown_data * data,
+            int32_t n_max);
+
     //
     // KV cache for self-attention (TODO: deprecate in favor of llama_memory)
     //
@@ -972,13 +1022,41 @@ extern "C" {
     // If set to true, the model will only attend to the past tokens
     LLAMA_API void llama_set_causal_attn(struct llama_context * ctx, bool causal_attn);
 
+    // Set whether the tokens of one sequence use causal attention, the other sequences of a batch are not affected
+    // A non-causal sequence attends all its kv cells, so a non-causal image block can share a batch with causal text
+    // of other sequences. Its tokens must fit in one ubatch (n_ubatch), llama_decode() fails otherwise
+    LLAMA_API void llama_set_seq_causal_attn(struct llama_context * ctx, llama_seq_id seq_id, bool causal_attn);
+
+    // Attention probe: while seq_id >= 0, llama_decode() records the attention the last token of seq_id in a ubatch
+    // pays to each kv cell of seq_id, summed over the heads and layers. Unified kv cache only, -1 turns it off
+    LLAMA_API void llama_set_attn_probe(struct llama_context * ctx, llama_seq_id seq_id);
+
+    // Removes the cells of seq_id with positions in [p0, p1) that got the least attention in the last probed
+    // llama_decode(), keeping the keep fraction of them (rounded up). Cells are dropped individually, so this also
+    // works for M-RoPE images whose tokens share a position. Call it before any other llama_decode()
+    // Returns the number of cells removed, -1 if seq_id was not probed
+    LLAMA_API int32_t llama_attn_probe_evict(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1,
+                           float   keep);
+
     // Set whether the model is in warmup mode or not
     // If true, all model tensors are activated during llama_decode() to load and cache their weights.
     LLAMA_API void llama_set_warmup(struct llama_context * ctx, bool warmup);
 
+    // Set whether llama_decode() only returns the argmax of each output row (greedy sampling)
+    // If true, the graph ends in a fused argmax and the logits are not copied to host,
+    // use llama_get_argmax_ith() instead of llama_get_logits*()
+    LLAMA_API void llama_set_output_argmax(struct llama_context * ctx, bool argmax);
+
     // Set abort callback
     LLAMA_API void llama_set_abort_callback(struct llama_context * ctx, ggml_abort_callback abort_callback, void * abort_callback_data);
 
+    // Set the eval callback of the backend scheduler, used from the next llama_decode() on (nullptr removes it)
+    LLAMA_API void llama_set_eval_callback(struct llama_context * ctx, ggml_backend_sched_eval_callback cb_eval, void * cb_eval_user_data);
+
     // Wait until all computations are finished
     // This is automatically done when using one of the functions below to obtain the computation results
     // and is not necessary to call it explicitly in most cases
@@ -997,6 +1075,25 @@ extern "C" {
     // returns NULL for invalid ids.
     LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
 
+    // Argmax token of the ith output, same indexing as llama_get_logits_ith()
+    // Only valid when llama_set_output_argmax() was enabled for the last call to llama_decode()
+    // returns LLAMA_TOKEN_NULL for invalid ids.
+    LLAMA_API llama_token llama_get_argmax_ith(struct llama_context * ctx, int32_t i);
+
+    // Moves the outputs of the last llama_decode() (logits, argmax and the output ids) out of the context, together
+    // with the host buffer the logits were copied into. The next llama_decode() writes into another buffer, so the
+    // outputs can be read on another thread while the context decodes on. Waits for the last llama_decode()
+    // Returns NULL if it had no outputs
+    LLAMA_API struct llama_outputs * llama_take_outputs(struct llama_context * ctx);
+
+    // Same indexing and results as llama_get_logits_ith() and llama_get_argmax_ith() right after the decode
+    LLAMA_API float *     llama_outputs_logits_ith(struct llama_outputs * outputs, int32_t i);
+    LLAMA_API llama_token llama_outputs_argmax_ith(struct llama_outputs * outputs, int32_t i);
+
+    // Gives the buffer back to the context for a later llama_decode(), from any thread
+    // note: the context must outlive the outputs taken from it
+    LLAMA_API void llama_outputs_free(struct llama_outputs * outputs);
+
     // Get all output token embeddings.
     // when pooling_type == LLAMA_POOLING_TYPE_NONE or when using a generative model,
     // the embeddings for which llama_batch.logits[i] != 0 are stored contiguously
@@ -1324,6 +1421,10 @@ extern "C" {
                const llama_token * trigger_tokens,
                             size_t num_trigger_tokens);
 
+    /// @details The only token a grammar sampler allows next, LLAMA_TOKEN_NULL if there are more or it is not a grammar sampler.
+    /// Forced tokens can be appended without sampling (jump-forward), allowed-token masks are cached per grammar state.
+    LLAMA_API llama_token llama_sampler_grammar_forced_token(const struct llama_sampler * smpl);
+
 
     /// NOTE: Avoid using on the full vocabulary as searching for repeated tokens can become slow. For example, apply top-k or top-p sampling first.
     LLAMA_API struct llama_sampler * llama_sampler_init_penalties(